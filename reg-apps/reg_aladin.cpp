@@ -14,6 +14,7 @@
 #include "_reg_ReadWriteMatrix.h"
 #include "_reg_aladin_sym.h"
 #include "_reg_tools.h"
+#include "_reg_simd.h"
 #include "reg_aladin.h"
 //#include <libgen.h> //DO NOT WORK ON WINDOWS !
 
@@ -77,6 +78,8 @@ void Usage(char *exec)
    reg_print_info(exec, "\t-comi\t\t\tUse the input images centre of mass to initialise the transformation. (Image centres are used by default)");
    reg_print_info(exec, "\t-interp\t\t\tInterpolation order to use internally to warp the floating image.");
    reg_print_info(exec, "\t-iso\t\t\tMake floating and reference images isotropic if required.");
+   reg_print_info(exec, "\t-crop <int>\t\tBuild the pyramids from images cropped around the reference mask (or foreground)");
+   reg_print_info(exec, "\t\t\t\tand the floating foreground, keeping the specified margin in voxel.");
 
    reg_print_info(exec, "\t-pv <int>\t\tPercentage of blocks to use in the optimisation scheme. [50]");
    reg_print_info(exec, "\t-pi <int>\t\tPercentage of blocks to consider as inlier in the optimisation scheme. [50]");
@@ -173,6 +176,7 @@ int main(int argc, char **argv)
    bool iso=false;
    bool verbose=true;
    int captureRangeVox = 3;
+   int cropMargin=-1;
    unsigned int platformFlag = NR_PLATFORM_CPU;
    unsigned gpuIdx = 999;
 
@@ -346,6 +350,10 @@ int main(int argc, char **argv)
       {
          iso=true;
       }
+      else if(strcmp(argv[i], "-crop")==0 || strcmp(argv[i], "--crop")==0)
+      {
+         cropMargin=atoi(argv[++i]);
+      }
       else if(strcmp(argv[i], "-voff")==0 || strcmp(argv[i], "--voff")==0)
       {
          verbose=false;
@@ -551,6 +559,8 @@ int main(int argc, char **argv)
    REG->SetInlierLts(inlierLts);
    REG->SetInterpolation(interpolation);
    REG->setCaptureRangeVox(captureRangeVox);
+   if(cropMargin>=0)
+      REG->UseForegroundCropping(cropMargin);
    REG->setPlatformCode(platformFlag);
    REG->setGpuIdx(gpuIdx);
 
@@ -596,6 +606,11 @@ int main(int argc, char **argv)
       reg_print_info((argv[0]), text);
    }
 #endif // _OPENMP
+   if(verbose)
+   {
+      sprintf(text, "The %s CPU kernels are used", reg_simd_getName(reg_simd_getType()));
+      reg_print_info((argv[0]), text);
+   }
 
    // Run the registration
    REG->Run();
@@ -0,0 +1,15 @@
+#include "_reg_maths.h"
+#include "_reg_simd.h"
+
+/* *************************************************************** */
+int main()
+{
+   showSIMDInfo();
+#if defined (_OPENMP)
+   char text[255];
+   sprintf(text, "OpenMP is used with %i thread(s)", omp_get_max_threads());
+   reg_print_info("NiftyReg SIMD", text);
+#endif
+   return EXIT_SUCCESS;
+}
+/* *************************************************************** */
@@ -13,6 +13,7 @@
 #include "_reg_ReadWriteImage.h"
 #include "_reg_ReadWriteMatrix.h"
 #include "_reg_f3d2.h"
+#include "_reg_simd.h"
 #include "reg_f3d.h"
 #include <float.h>
 //#include <libgen.h> //DOES NOT WORK ON WINDOWS !
@@ -123,12 +124,20 @@ void Usage(char *exec)
    reg_print_info(exec, "\t-ln <int>\t\tNumber of level to perform [3]");
    reg_print_info(exec, "\t-lp <int>\t\tOnly perform the first levels [ln]");
    reg_print_info(exec, "\t-nopy\t\t\tDo not use a pyramidal approach");
+   reg_print_info(exec, "\t-crop <int>\t\tRegister images cropped around the reference mask (or foreground) and the");
+   reg_print_info(exec, "\t\t\t\tfloating foreground, keeping the specified margin in voxel. The output");
+   reg_print_info(exec, "\t\t\t\tgrid is extended back over the whole reference image");
+   reg_print_info(exec, "\t-sample <float>\t\tEvaluate the measure of similarity at the last level over a fixed random");
+   reg_print_info(exec, "\t\t\t\tsubset of the active voxels. The value is the sampling rate in ]0,1]");
+   reg_print_info(exec, "\t-sampleIt <float>\tSame as -sample but a new subset is drawn at every iteration");
    reg_print_info(exec, "\t-noConj\t\t\tTo not use the conjuage gradient optimisation but a simple gradient ascent");
    reg_print_info(exec, "\t-pert <int>\t\tTo add perturbation step(s) after each optimisation scheme");
    reg_print_info(exec, "");
    reg_print_info(exec, "*** F3D2 options:");
    reg_print_info(exec, "\t-vel \t\t\tUse a velocity field integration to generate the deformation");
    reg_print_info(exec, "\t-nogce \t\t\tDo not use the gradient accumulation through exponentiation");
+   reg_print_info(exec, "\t-cpexp <int>\t\tExponentiate the velocity grid at the control point level. The squaring");
+   reg_print_info(exec, "\t\t\t\tis performed on the grid nodes (1) or on nodes with half the spacing (2)");
    reg_print_info(exec, "\t-fmask <filename>\tFilename of a mask image in the floating space");
    reg_print_info(exec, "");
 
@@ -717,6 +726,18 @@ int main(int argc, char **argv)
       {
          REG->DoNotUsePyramidalApproach();
       }
+      else if(strcmp(argv[i], "-crop")==0 || strcmp(argv[i], "--crop")==0)
+      {
+         REG->UseForegroundCropping(atoi(argv[++i]));
+      }
+      else if(strcmp(argv[i], "-sample")==0 || strcmp(argv[i], "--sample")==0)
+      {
+         REG->UseVoxelSampling(atof(argv[++i]));
+      }
+      else if(strcmp(argv[i], "-sampleIt")==0 || strcmp(argv[i], "--sampleIt")==0)
+      {
+         REG->UseVoxelSampling(atof(argv[++i]), true);
+      }
       else if(strcmp(argv[i], "-noConj")==0 || strcmp(argv[i], "--noConj")==0)
       {
          REG->DoNotUseConjugateGradient();
@@ -785,6 +806,10 @@ int main(int argc, char **argv)
       {
          REG->UseBCHUpdate(atoi(argv[++i]));
       }
+      else if(strcmp(argv[i], "-cpexp")==0 || strcmp(argv[i], "--cpexp")==0)
+      {
+         REG->UseControlPointExponentiation(atoi(argv[++i]));
+      }
 
       else if(strcmp(argv[i], "-omp")==0 || strcmp(argv[i], "--omp")==0)
       {
@@ -812,7 +837,7 @@ int main(int argc, char **argv)
       }
    }
    if(useMeanLNCC)
-      REG->SetLNCCKernelType(2);
+      REG->SetLNCCKernelType(MEAN_KERNEL);
 
 #ifndef NDEBUG
    reg_print_msg_debug("*******************************************");
@@ -832,6 +857,11 @@ int main(int argc, char **argv)
       reg_print_info((argv[0]), text.c_str());
    }
 #endif // _OPENMP
+   if(verbose)
+   {
+      text = stringFormat("The %s CPU kernels are used", reg_simd_getName(reg_simd_getType()));
+      reg_print_info((argv[0]), text.c_str());
+   }
 
    // Run the registration
    REG->Run();
@@ -31,6 +31,7 @@ typedef struct
    int interpolation;
    float paddingValue;
    float PSF_Algorithm;
+   int slabSize;
 } PARAM;
 typedef struct
 {
@@ -44,6 +45,8 @@ typedef struct
    bool outputBlankXZFlag;
    bool isTensor;
    bool usePSF;
+   bool useFastPSF;
+   bool reportPSFError;
 } FLAG;
 
 
@@ -68,6 +71,12 @@ void Usage(char *exec)
    printf("\t-tensor\n\t\tThe last six timepoints of the floating image are considered to be tensor order as XX, XY, YY, XZ, YZ, ZZ [off]\n");
    printf("\t-psf\n\t\tPerform the resampling in two steps to resample an image to a lower resolution [off]\n");
    printf("\t-psf_alg <0/1>\n\t\tMinimise the matrix metric (0) or the determinant (1) when estimating the PSF [0]\n");
+   printf("\t-psf_fast\n\t\tApproximate the PSF resampling using a separable convolution when the PSF is shared by all voxels\n");
+   printf("\t\tand axis-aligned, or a PSF cached per quantised Jacobian matrix otherwise [off]\n");
+   printf("\t-psf_err\n\t\tAlso perform the exact PSF resampling and report the error of the fast PSF resampling.\n");
+   printf("\t\tImplies -psf_fast and requires -psf [off]\n");
+   printf("\t-slab <int>\n\t\tWhen a spline grid is used, the warped image is computed and written slab by slab along the z axis,\n");
+   printf("\t\twith the specified number of slices per slab. Only the deformation field of the current slab is kept in memory [off]\n");
    printf("\t-voff\n\t\tTurns verbose off [on]\n");
 #if defined (_OPENMP)
    int defaultOpenMPValue=omp_get_num_procs();
@@ -81,6 +90,167 @@ void Usage(char *exec)
    return;
 }
 
+/* *************************************************************** */
+// Update the header of a slab so that its first slice corresponds to the
+// slice firstSlice of the full image
+void reg_resample_setSlabHeader(nifti_image *slab,
+                                nifti_image *image,
+                                int firstSlice,
+                                int sliceNumber)
+{
+   slab->dim[3]=slab->nz=sliceNumber;
+   slab->nvox=(size_t)slab->nx*slab->ny*slab->nz*slab->nt*slab->nu;
+   slab->qto_xyz=image->qto_xyz;
+   slab->sto_xyz=image->sto_xyz;
+   for(int i=0; i<3; ++i)
+   {
+      slab->qto_xyz.m[i][3] += image->qto_xyz.m[i][2] * (float)firstSlice;
+      slab->sto_xyz.m[i][3] += image->sto_xyz.m[i][2] * (float)firstSlice;
+   }
+   // The quaternion offsets are kept consistent with the shifted origin
+   slab->qoffset_x=slab->qto_xyz.m[0][3];
+   slab->qoffset_y=slab->qto_xyz.m[1][3];
+   slab->qoffset_z=slab->qto_xyz.m[2][3];
+   slab->qto_ijk=nifti_mat44_inverse(slab->qto_xyz);
+   if(slab->sform_code>0)
+      slab->sto_ijk=nifti_mat44_inverse(slab->sto_xyz);
+}
+/* *************************************************************** */
+// Resample the floating image slab by slab along the z axis using a spline
+// grid parametrisation. Only the deformation field and the warped intensities
+// of the current slab are kept in memory. The deformation field of a slab is
+// evaluated once and used to resample all the volumes of the floating image.
+// Every volume of the slab is then written at its position in the output
+// file. As compressed files can only be written sequentially, the volumes of
+// a compressed multi-volume output are resampled one after the other, the
+// deformation field of every slab being evaluated again for each volume.
+int reg_resample_slabWise(nifti_image *floatingImage,
+                          nifti_image *warpedImage,
+                          nifti_image *splineGrid,
+                          int interpolation,
+                          float paddingValue,
+                          int slabSize,
+                          const char *filename)
+{
+   // A slab of a 3D image contains at least two slices to be resampled in 3D
+   if(warpedImage->nz>1 && slabSize<2)
+      slabSize=2;
+   if(slabSize>warpedImage->nz)
+      slabSize=warpedImage->nz;
+   size_t sliceVoxelNumber=(size_t)warpedImage->nx*warpedImage->ny;
+   size_t sliceByteNumber=sliceVoxelNumber*warpedImage->nbyper;
+   int volumeNumber=warpedImage->nt*warpedImage->nu;
+
+   // The header is written first and the file is kept open to write the slabs
+   nifti_set_filenames(warpedImage,filename,0,0);
+   znzFile outputFile=nifti_image_write_hdr_img(warpedImage,2,"wb");
+   if(znz_isnull(outputFile))
+   {
+      reg_print_fct_error("reg_resample_slabWise");
+      reg_print_msg_error("The output file can not be created");
+      return EXIT_FAILURE;
+   }
+   long dataOffset=znztell(outputFile);
+   bool sequentialVolumes=volumeNumber>1 && nifti_is_gzfile(warpedImage->fname);
+   int passNumber=sequentialVolumes?volumeNumber:1;
+   int slabVolumeNumber=sequentialVolumes?1:volumeNumber;
+
+   // Deformation field that covers a single slab
+   nifti_image *slabField=nifti_copy_nim_info(warpedImage);
+   slabField->dim[0]=slabField->ndim=5;
+   slabField->dim[4]=slabField->nt=1;
+   slabField->pixdim[4]=slabField->dt=1.0;
+   slabField->dim[5]=slabField->nu=warpedImage->nz>1?3:2;
+   slabField->dim[6]=slabField->nv=1;
+   slabField->dim[7]=slabField->nw=1;
+   slabField->datatype=splineGrid->datatype;
+   slabField->nbyper=splineGrid->nbyper;
+   slabField->scl_slope=1.f;
+   slabField->scl_inter=0.f;
+   slabField->intent_p1=DEF_FIELD;
+   slabField->data=malloc(sliceVoxelNumber*(slabSize+1)*slabField->nu*slabField->nbyper);
+
+   // Warped intensities of the resampled volumes of a single slab
+   nifti_image *warpedSlab=nifti_copy_nim_info(warpedImage);
+   warpedSlab->data=malloc(sliceByteNumber*(slabSize+1)*slabVolumeNumber);
+   // Floating volume resampled by the current pass
+   nifti_image *floatingVolume=floatingImage;
+   if(sequentialVolumes)
+   {
+      warpedSlab->dim[0]=warpedSlab->ndim=3;
+      warpedSlab->dim[4]=warpedSlab->nt=1;
+      warpedSlab->dim[5]=warpedSlab->nu=1;
+      floatingVolume=nifti_copy_nim_info(floatingImage);
+      floatingVolume->dim[0]=floatingVolume->ndim=3;
+      floatingVolume->dim[4]=floatingVolume->nt=1;
+      floatingVolume->dim[5]=floatingVolume->nu=1;
+      floatingVolume->nvox=(size_t)floatingVolume->nx*floatingVolume->ny*floatingVolume->nz;
+   }
+
+   int status=EXIT_SUCCESS;
+   for(int pass=0; pass<passNumber && status==EXIT_SUCCESS; ++pass)
+   {
+      if(sequentialVolumes)
+         floatingVolume->data=&static_cast<char *>(floatingImage->data)
+               [(size_t)pass*floatingVolume->nvox*floatingVolume->nbyper];
+      int sliceNumber;
+      for(int firstSlice=0; firstSlice<warpedImage->nz && status==EXIT_SUCCESS; firstSlice+=sliceNumber)
+      {
+         sliceNumber=slabSize<warpedImage->nz-firstSlice?slabSize:warpedImage->nz-firstSlice;
+         // A single remaining slice is merged with the current slab
+         if(warpedImage->nz-firstSlice-sliceNumber==1)
+            ++sliceNumber;
+         reg_resample_setSlabHeader(slabField,warpedImage,firstSlice,sliceNumber);
+         reg_resample_setSlabHeader(warpedSlab,warpedImage,firstSlice,sliceNumber);
+
+         // The slab positions are initialised with an identity and composed with the spline grid
+         memset(slabField->data,0,slabField->nvox*slabField->nbyper);
+         reg_getDeformationFromDisplacement(slabField);
+         reg_spline_getDeformationField(splineGrid,
+                                        slabField,
+                                        NULL,
+                                        true, // composition
+                                        true); // bspline
+         reg_resampleImage(floatingVolume,
+                           warpedSlab,
+                           slabField,
+                           NULL,
+                           interpolation,
+                           paddingValue);
+
+         size_t slabByteNumber=sliceByteNumber*sliceNumber;
+         for(int t=0; t<slabVolumeNumber; ++t)
+         {
+            char *slabPtr=&static_cast<char *>(warpedSlab->data)[t*slabByteNumber];
+            // The slabs of a single volume are written sequentially
+            if(slabVolumeNumber>1)
+            {
+               size_t outputOffset=((size_t)t*warpedImage->nz+firstSlice)*sliceByteNumber;
+               znzseek(outputFile,dataOffset+(long)outputOffset,SEEK_SET);
+            }
+            if(nifti_write_buffer(outputFile,slabPtr,slabByteNumber)!=slabByteNumber)
+            {
+               reg_print_fct_error("reg_resample_slabWise");
+               reg_print_msg_error("The slab could not be written");
+               status=EXIT_FAILURE;
+               break;
+            }
+         }
+      }
+   }
+   znzclose(outputFile);
+
+   if(sequentialVolumes)
+   {
+      floatingVolume->data=NULL;
+      nifti_image_free(floatingVolume);
+   }
+   nifti_image_free(warpedSlab);
+   nifti_image_free(slabField);
+   return status;
+}
+/* *************************************************************** */
+
 int main(int argc, char **argv)
 {
    PARAM *param = (PARAM *)calloc(1,sizeof(PARAM));
@@ -237,6 +407,22 @@ int main(int argc, char **argv)
       {
          param->PSF_Algorithm=(float)atof(argv[++i]);
       }
+      else if(strcmp(argv[i], "-psf_fast") == 0 ||
+              (strcmp(argv[i],"--psf_fast")==0))
+      {
+         flag->useFastPSF=true;
+      }
+      else if(strcmp(argv[i], "-psf_err") == 0 ||
+              (strcmp(argv[i],"--psf_err")==0))
+      {
+         flag->reportPSFError=true;
+         flag->useFastPSF=true;
+      }
+      else if(strcmp(argv[i], "-slab") == 0 ||
+              (strcmp(argv[i],"--slab")==0))
+      {
+         param->slabSize=atoi(argv[++i]);
+      }
       else
       {
          fprintf(stderr,"Err:\tParameter %s unknown.\n",argv[i]);
@@ -252,6 +438,9 @@ int main(int argc, char **argv)
       return EXIT_FAILURE;
    }
 
+   if(flag->reportPSFError && !flag->usePSF)
+      reg_print_msg_warn("The -psf_err flag only applies to the PSF resampling and requires -psf. It is ignored");
+
    /* Read the reference image */
    nifti_image *referenceImage = reg_io_ReadImageHeader(param->referenceImageName);
    if(referenceImage == NULL)
@@ -320,41 +509,66 @@ int main(int argc, char **argv)
       reg_mat44_eye(&inputAffineTransformation);
    }
 
-   // Create a deformation field
-   nifti_image *deformationFieldImage = nifti_copy_nim_info(referenceImage);
-   deformationFieldImage->dim[0]=deformationFieldImage->ndim=5;
-   deformationFieldImage->dim[1]=deformationFieldImage->nx=referenceImage->nx;
-   deformationFieldImage->dim[2]=deformationFieldImage->ny=referenceImage->ny;
-   deformationFieldImage->dim[3]=deformationFieldImage->nz=referenceImage->nz;
-   deformationFieldImage->dim[4]=deformationFieldImage->nt=1;
-   deformationFieldImage->pixdim[4]=deformationFieldImage->dt=1.0;
-   deformationFieldImage->dim[5]=deformationFieldImage->nu=referenceImage->nz>1?3:2;
-   deformationFieldImage->dim[6]=deformationFieldImage->nv=1;
-   deformationFieldImage->dim[7]=deformationFieldImage->nw=1;
-   deformationFieldImage->nvox =(size_t)deformationFieldImage->nx*
-         deformationFieldImage->ny*deformationFieldImage->nz*
-         deformationFieldImage->nt*deformationFieldImage->nu;
-   deformationFieldImage->scl_slope=1.f;
-   deformationFieldImage->scl_inter=0.f;
-   if(inputTransformationImage!=NULL)
+   // The affine transformations are applied directly, without deformation field,
+   // unless the Jacobian matrices are required for the DTI or PSF resampling
+   bool useAffineResampling = inputTransformationImage==NULL &&
+         flag->usePSF==false &&
+         !((floatingImage->dim[4]==6 || floatingImage->dim[4]==7) && flag->isTensor==true);
+
+   // The spline grid parametrisations can be evaluated and resampled slab by slab
+   bool useSlabResampling = false;
+   if(param->slabSize>0)
    {
-      deformationFieldImage->datatype = inputTransformationImage->datatype;
-      deformationFieldImage->nbyper = inputTransformationImage->nbyper;
+      if(inputTransformationImage!=NULL &&
+            (inputTransformationImage->intent_p1==LIN_SPLINE_GRID ||
+             inputTransformationImage->intent_p1==CUB_SPLINE_GRID) &&
+            flag->usePSF==false &&
+            !((floatingImage->dim[4]==6 || floatingImage->dim[4]==7) && flag->isTensor==true) &&
+            (!flag->outputResultFlag || reg_io_checkFileFormat(param->outputResultName)==NR_NII_FORMAT) &&
+            (param->outputBlankName==NULL || reg_io_checkFileFormat(param->outputBlankName)==NR_NII_FORMAT))
+         useSlabResampling=true;
+      else reg_print_msg_warn("The slab-wise resampling requires a spline grid transformation, no PSF or tensor resampling and nifti outputs. It is ignored");
    }
-   else
+
+   // Create a deformation field
+   nifti_image *deformationFieldImage = NULL;
+   if(!useAffineResampling && !useSlabResampling)
    {
-      deformationFieldImage->datatype = NIFTI_TYPE_FLOAT32;
-      deformationFieldImage->nbyper = sizeof(float);
-   }
-   deformationFieldImage->data = (void *)calloc(deformationFieldImage->nvox, deformationFieldImage->nbyper);
+      deformationFieldImage = nifti_copy_nim_info(referenceImage);
+      deformationFieldImage->dim[0]=deformationFieldImage->ndim=5;
+      deformationFieldImage->dim[1]=deformationFieldImage->nx=referenceImage->nx;
+      deformationFieldImage->dim[2]=deformationFieldImage->ny=referenceImage->ny;
+      deformationFieldImage->dim[3]=deformationFieldImage->nz=referenceImage->nz;
+      deformationFieldImage->dim[4]=deformationFieldImage->nt=1;
+      deformationFieldImage->pixdim[4]=deformationFieldImage->dt=1.0;
+      deformationFieldImage->dim[5]=deformationFieldImage->nu=referenceImage->nz>1?3:2;
+      deformationFieldImage->dim[6]=deformationFieldImage->nv=1;
+      deformationFieldImage->dim[7]=deformationFieldImage->nw=1;
+      deformationFieldImage->nvox =(size_t)deformationFieldImage->nx*
+            deformationFieldImage->ny*deformationFieldImage->nz*
+            deformationFieldImage->nt*deformationFieldImage->nu;
+      deformationFieldImage->scl_slope=1.f;
+      deformationFieldImage->scl_inter=0.f;
+      if(inputTransformationImage!=NULL)
+      {
+         deformationFieldImage->datatype = inputTransformationImage->datatype;
+         deformationFieldImage->nbyper = inputTransformationImage->nbyper;
+      }
+      else
+      {
+         deformationFieldImage->datatype = NIFTI_TYPE_FLOAT32;
+         deformationFieldImage->nbyper = sizeof(float);
+      }
+      deformationFieldImage->data = (void *)calloc(deformationFieldImage->nvox, deformationFieldImage->nbyper);
 
-   // Initialise the deformation field with an identity transformation
-   reg_tools_multiplyValueToImage(deformationFieldImage,deformationFieldImage,0.f);
-   reg_getDeformationFromDisplacement(deformationFieldImage);
-   deformationFieldImage->intent_p1=DEF_FIELD;
+      // Initialise the deformation field with an identity transformation
+      reg_tools_multiplyValueToImage(deformationFieldImage,deformationFieldImage,0.f);
+      reg_getDeformationFromDisplacement(deformationFieldImage);
+      deformationFieldImage->intent_p1=DEF_FIELD;
+   }
 
    // Compute the transformation to apply
-   if(inputTransformationImage!=NULL)
+   if(inputTransformationImage!=NULL && !useSlabResampling)
    {
       switch(static_cast<int>(inputTransformationImage->intent_p1))
       {
@@ -372,9 +586,8 @@ int main(int argc, char **argv)
          {
             nifti_image *tempFlowField = nifti_copy_nim_info(deformationFieldImage);
             tempFlowField->data = (void *)malloc(tempFlowField->nvox*tempFlowField->nbyper);
-            memcpy(tempFlowField->data,deformationFieldImage->data,
-                   tempFlowField->nvox*tempFlowField->nbyper);
             reg_defField_compose(inputTransformationImage,
+                                 deformationFieldImage,
                                  tempFlowField,
                                  NULL);
             tempFlowField->intent_p1=inputTransformationImage->intent_p1;
@@ -401,7 +614,7 @@ int main(int argc, char **argv)
       nifti_image_free(inputTransformationImage);
       inputTransformationImage=NULL;
    }
-   else
+   else if(inputTransformationImage==NULL && !useAffineResampling)
    {
       reg_affine_getDeformationField(&inputAffineTransformation,
                                      deformationFieldImage,
@@ -453,7 +666,8 @@ int main(int argc, char **argv)
       warpedImage->nbyper = floatingImage->nbyper;
       warpedImage->nvox = (size_t)warpedImage->dim[1] * warpedImage->dim[2] *
             warpedImage->dim[3] * warpedImage->dim[4] * warpedImage->dim[5];
-      warpedImage->data = (void *)calloc(warpedImage->nvox, warpedImage->nbyper);
+      if(!useSlabResampling)
+         warpedImage->data = (void *)calloc(warpedImage->nvox, warpedImage->nbyper);
 
       if((floatingImage->dim[4]==6 || floatingImage->dim[4]==7) && flag->isTensor==true)
       {
@@ -499,12 +713,94 @@ int main(int argc, char **argv)
                                   param->interpolation,
                                   param->paddingValue,
                                   jacobian,
-                                  (char)round(param->PSF_Algorithm));
+                                  (char)round(param->PSF_Algorithm),
+                                  flag->useFastPSF);
+            if(flag->useFastPSF && flag->reportPSFError)
+            {
+               // The exact PSF resampling is used as reference
+               nifti_image *exactWarpedImage = nifti_copy_nim_info(warpedImage);
+               exactWarpedImage->data = (void *)malloc(exactWarpedImage->nvox*exactWarpedImage->nbyper);
+               reg_resampleImage_PSF(floatingImage,
+                                     exactWarpedImage,
+                                     deformationFieldImage,
+                                     NULL,
+                                     param->interpolation,
+                                     param->paddingValue,
+                                     jacobian,
+                                     (char)round(param->PSF_Algorithm),
+                                     false);
+               nifti_image *fastWarpedImage = nifti_copy_nim_info(warpedImage);
+               fastWarpedImage->data = (void *)malloc(fastWarpedImage->nvox*fastWarpedImage->nbyper);
+               memcpy(fastWarpedImage->data, warpedImage->data, fastWarpedImage->nvox*fastWarpedImage->nbyper);
+               reg_tools_changeDatatype<double>(exactWarpedImage);
+               reg_tools_changeDatatype<double>(fastWarpedImage);
+               double *exactPtr = static_cast<double *>(exactWarpedImage->data);
+               double *fastPtr = static_cast<double *>(fastWarpedImage->data);
+               double maxError=0, meanError=0, minValue=std::numeric_limits<double>::max();
+               double maxValue=-std::numeric_limits<double>::max();
+               size_t voxelNumber=0;
+               for(size_t i=0; i<exactWarpedImage->nvox; ++i)
+               {
+                  if(exactPtr[i]!=exactPtr[i] || fastPtr[i]!=fastPtr[i])
+                     continue;
+                  double error=fabs(exactPtr[i]-fastPtr[i]);
+                  maxError=error>maxError?error:maxError;
+                  meanError+=error;
+                  minValue=exactPtr[i]<minValue?exactPtr[i]:minValue;
+                  maxValue=exactPtr[i]>maxValue?exactPtr[i]:maxValue;
+                  ++voxelNumber;
+               }
+               if(voxelNumber>0)
+                  meanError/=(double)voxelNumber;
+               double range=maxValue>minValue?maxValue-minValue:1.;
+               char text[255];
+               sprintf(text, "Fast PSF error against the exact PSF resampling over %zu voxels:", voxelNumber);
+               reg_print_info((argv[0]), text);
+               sprintf(text, "\tmaximal absolute error %g (%g%% of the intensity range)",
+                       maxError, 100.*maxError/range);
+               reg_print_info((argv[0]), text);
+               sprintf(text, "\tmean absolute error %g (%g%% of the intensity range)",
+                       meanError, 100.*meanError/range);
+               reg_print_info((argv[0]), text);
+               nifti_image_free(exactWarpedImage);
+               nifti_image_free(fastWarpedImage);
+            }
 #ifndef NDEBUG
             reg_print_msg_debug("PSF resampling completed\n");
 #endif
             free(jacobian);
          }
+         else if(useSlabResampling)
+         {
+            memset(warpedImage->descrip, 0, 80);
+            strcpy (warpedImage->descrip,"Warped image using NiftyReg (reg_resample)");
+            if(reg_resample_slabWise(floatingImage,
+                                     warpedImage,
+                                     inputTransformationImage,
+                                     param->interpolation,
+                                     param->paddingValue,
+                                     param->slabSize,
+                                     param->outputResultName)!=EXIT_SUCCESS)
+            {
+               nifti_image_free(warpedImage);
+               nifti_image_free(referenceImage);
+               nifti_image_free(floatingImage);
+               if(inputTransformationImage!=NULL)
+                  nifti_image_free(inputTransformationImage);
+               free(flag);
+               free(param);
+               return EXIT_FAILURE;
+            }
+         }
+         else if(useAffineResampling)
+         {
+            reg_resampleImage_affine(floatingImage,
+                                     warpedImage,
+                                     &inputAffineTransformation,
+                                     NULL,
+                                     param->interpolation,
+                                     param->paddingValue);
+         }
          else
          {
             reg_resampleImage(floatingImage,
@@ -518,7 +814,8 @@ int main(int argc, char **argv)
 
       memset(warpedImage->descrip, 0, 80);
       strcpy (warpedImage->descrip,"Warped image using NiftyReg (reg_resample)");
-      reg_io_WriteImageFile(warpedImage,param->outputResultName);
+      if(!useSlabResampling)
+         reg_io_WriteImageFile(warpedImage,param->outputResultName);
 
       if(verbose)
          printf("[NiftyReg] Resampled image has been saved: %s\n", param->outputResultName);
@@ -602,17 +899,48 @@ int main(int argc, char **argv)
       warpedImage->dim[5]=warpedImage->nu=1;
       warpedImage->datatype =NIFTI_TYPE_UINT8;
       warpedImage->nbyper = sizeof(unsigned char);
-      warpedImage->data = (void *)calloc(warpedImage->nvox,
-                                         warpedImage->nbyper);
-      reg_resampleImage(gridImage,
-                        warpedImage,
-                        deformationFieldImage,
-                        NULL,
-                        1, // linear interpolation
-                        0);
       memset(warpedImage->descrip, 0, 80);
       strcpy (warpedImage->descrip,"Warped regular grid using NiftyReg (reg_resample)");
-      reg_io_WriteImageFile(warpedImage,param->outputBlankName);
+      if(useSlabResampling)
+      {
+         if(reg_resample_slabWise(gridImage,
+                                  warpedImage,
+                                  inputTransformationImage,
+                                  1, // linear interpolation
+                                  0,
+                                  param->slabSize,
+                                  param->outputBlankName)!=EXIT_SUCCESS)
+         {
+            nifti_image_free(warpedImage);
+            nifti_image_free(gridImage);
+            nifti_image_free(referenceImage);
+            nifti_image_free(floatingImage);
+            if(inputTransformationImage!=NULL)
+               nifti_image_free(inputTransformationImage);
+            free(flag);
+            free(param);
+            return EXIT_FAILURE;
+         }
+      }
+      else
+      {
+         warpedImage->data = (void *)calloc(warpedImage->nvox,
+                                            warpedImage->nbyper);
+         if(useAffineResampling)
+            reg_resampleImage_affine(gridImage,
+                                     warpedImage,
+                                     &inputAffineTransformation,
+                                     NULL,
+                                     1, // linear interpolation
+                                     0);
+         else reg_resampleImage(gridImage,
+                                warpedImage,
+                                deformationFieldImage,
+                                NULL,
+                                1, // linear interpolation
+                                0);
+         reg_io_WriteImageFile(warpedImage,param->outputBlankName);
+      }
       nifti_image_free(warpedImage);
       nifti_image_free(gridImage);
       if(verbose)
@@ -624,7 +952,10 @@ int main(int argc, char **argv)
 
    nifti_image_free(referenceImage);
    nifti_image_free(floatingImage);
-   nifti_image_free(deformationFieldImage);
+   if(deformationFieldImage!=NULL)
+      nifti_image_free(deformationFieldImage);
+   if(inputTransformationImage!=NULL)
+      nifti_image_free(inputTransformationImage);
 
    free(flag);
    free(param);
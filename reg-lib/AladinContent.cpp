@@ -94,6 +94,7 @@ AladinContent::~AladinContent()
 {
    ClearWarpedImage();
    ClearDeformationField();
+   reg_tools_freeMaskSpans(this->CurrentReferenceMaskSpans);
    if (this->blockMatchingParams != NULL)
       delete this->blockMatchingParams;
 }
@@ -107,17 +108,21 @@ void AladinContent::initVars()
       this->CurrentWarped = NULL;
    }
 
-   if (this->CurrentReference != NULL){
-      this->AllocateDeformationField(bytes);
+   // The deformation field is only allocated once a kernel requests it
+   this->CurrentDeformationField = NULL;
+   if (this->CurrentReference != NULL)
       refMatrix_xyz = (CurrentReference->sform_code > 0) ? (CurrentReference->sto_xyz) : (CurrentReference->qto_xyz);
-   }
-   else {
-      this->CurrentDeformationField = NULL;
-   }
 
    if (this->CurrentReferenceMask == NULL && this->CurrentReference != NULL)
       this->CurrentReferenceMask = (int *) calloc(this->CurrentReference->nx * this->CurrentReference->ny * this->CurrentReference->nz, sizeof(int));
 
+   // The spans are built once per level, the resampling kernels reuse them at every iteration
+   this->CurrentReferenceMaskSpans = NULL;
+   if (this->CurrentReference != NULL) {
+      int dim[3] = {this->CurrentReference->nx, this->CurrentReference->ny, this->CurrentReference->nz};
+      this->CurrentReferenceMaskSpans = reg_tools_createMaskSpans(this->CurrentReferenceMask, dim);
+   }
+
    if (this->CurrentFloating != NULL) {
       floMatrix_ijk = (CurrentFloating->sform_code > 0) ? (CurrentFloating->sto_ijk) :  (CurrentFloating->qto_ijk);
    }
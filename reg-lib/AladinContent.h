@@ -8,6 +8,7 @@
 #include <vector>
 #include "Kernel.h"
 #include "_reg_blockMatching.h"
+#include "_reg_tools.h"
 
 class AladinContent {
 public:
@@ -53,6 +54,8 @@ public:
 	//getters
 	virtual nifti_image *getCurrentDeformationField()
 	{
+		if (this->CurrentDeformationField == NULL && this->CurrentReference != NULL)
+			this->AllocateDeformationField(this->bytes);
 		return this->CurrentDeformationField;
 	}
 	nifti_image *getCurrentReference()
@@ -71,6 +74,10 @@ public:
 	{
 		return this->CurrentReferenceMask;
 	}
+	const reg_maskSpans *getCurrentReferenceMaskSpans()
+	{
+		return this->CurrentReferenceMaskSpans;
+	}
 	mat44 *getTransformationMatrix()
 	{
 		return this->transformationMatrix;
@@ -105,6 +112,8 @@ protected:
 	nifti_image *CurrentReference;
 	nifti_image *CurrentFloating;
 	int *CurrentReferenceMask;
+	// Active voxels of the reference mask stored as spans, used by the CPU kernels
+	reg_maskSpans *CurrentReferenceMaskSpans;
 
 	nifti_image *CurrentDeformationField;
 	nifti_image *CurrentWarped;
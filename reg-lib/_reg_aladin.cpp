@@ -7,6 +7,7 @@
 #include "Platform.h"
 #include "AffineDeformationFieldKernel.h"
 #include "ResampleImageKernel.h"
+#include "AffineResampleImageKernel.h"
 #include "BlockMatchingKernel.h"
 #include "OptimiseKernel.h"
 #include "ConvolutionKernel.h"
@@ -39,6 +40,7 @@ template<class T> reg_aladin<T>::reg_aladin()
   this->blockMatchingKernel = NULL;
   this->optimiseKernel = NULL;
   this->resamplingKernel = NULL;
+  this->affineResamplingKernel = NULL;
 
   this->con = NULL;
   this->blockMatchingParams = NULL;
@@ -74,6 +76,9 @@ template<class T> reg_aladin<T>::reg_aladin()
 
   this->WarpedPaddingValue = std::numeric_limits<T>::quiet_NaN();
 
+  this->CropMargin = -1;
+  this->InputCropped = false;
+
   this->funcProgressCallback = NULL;
   this->paramsProgressCallback = NULL;
 
@@ -270,18 +275,53 @@ void reg_aladin<T>::InitialiseRegistration()
   this->ReferenceMaskPyramid = (int **) malloc(this->LevelsToPerform * sizeof(int *));
   this->activeVoxelNumber = (int *) malloc(this->LevelsToPerform * sizeof(int));
 
+  // CROP THE INPUT IMAGES AROUND THEIR FOREGROUND IF REQUIRED
+  // The transformation is estimated in world coordinates, only the pyramids
+  // are built from the cropped images
+  nifti_image *reference = this->InputReference;
+  nifti_image *floating = this->InputFloating;
+  nifti_image *referenceMask = this->InputReferenceMask;
+  this->InputCropped = false;
+  if (this->CropMargin >= 0) {
+    nifti_image *referenceForeground = referenceMask != NULL ? referenceMask : reference;
+    if (reg_tools_getForegroundBoundingBox(referenceForeground, this->CropMargin, this->ReferenceCropBox) &&
+        reg_tools_getForegroundBoundingBox(floating, this->CropMargin, this->FloatingCropBox)) {
+      this->InputCropped = true;
+      reference = reg_tools_cropImage(this->InputReference, this->ReferenceCropBox);
+      floating = reg_tools_cropImage(this->InputFloating, this->FloatingCropBox);
+      if (referenceMask != NULL)
+        referenceMask = reg_tools_cropImage(this->InputReferenceMask, this->ReferenceCropBox);
+#ifdef NDEBUG
+      if(this->Verbose)
+      {
+#endif
+        std::string text;
+        text = stringFormat("Reference image cropped to %ix%ix%i voxels", reference->nx, reference->ny, reference->nz);
+        reg_print_info(this->executableName, text.c_str());
+        text = stringFormat("Floating image cropped to %ix%ix%i voxels", floating->nx, floating->ny, floating->nz);
+        reg_print_info(this->executableName, text.c_str());
+#ifdef NDEBUG
+      }
+#endif
+    }
+    else {
+      reg_print_fct_warn("reg_aladin<T>::InitialiseRegistration()");
+      reg_print_msg_warn("No foreground voxel found. The input images are not cropped");
+    }
+  }
+
   // FINEST LEVEL OF REGISTRATION
-  reg_createImagePyramid<T>(this->InputReference,
+  reg_createImagePyramid<T>(reference,
                             this->ReferencePyramid,
                             this->NumberOfLevels,
                             this->LevelsToPerform);
-  reg_createImagePyramid<T>(this->InputFloating,
+  reg_createImagePyramid<T>(floating,
                             this->FloatingPyramid,
                             this->NumberOfLevels,
                             this->LevelsToPerform);
 
-  if (this->InputReferenceMask != NULL)
-    reg_createMaskPyramid<T>(this->InputReferenceMask,
+  if (referenceMask != NULL)
+    reg_createMaskPyramid<T>(referenceMask,
                              this->ReferenceMaskPyramid,
                              this->NumberOfLevels,
                              this->LevelsToPerform,
@@ -292,6 +332,12 @@ void reg_aladin<T>::InitialiseRegistration()
       this->ReferenceMaskPyramid[l] = (int *) calloc(activeVoxelNumber[l], sizeof(int));
     }
   }
+  if (this->InputCropped) {
+    nifti_image_free(reference);
+    nifti_image_free(floating);
+    if (referenceMask != NULL)
+      nifti_image_free(referenceMask);
+  }
 
   Kernel *convolutionKernel = this->platform->createKernel(ConvolutionKernel::getName(), NULL);
   // SMOOTH THE INPUT IMAGES IF REQUIRED
@@ -450,8 +496,16 @@ void reg_aladin<T>::ClearCurrentInputImage()
 template<class T>
 void reg_aladin<T>::createKernels()
 {
-  this->affineTransformation3DKernel = platform->createKernel(AffineDeformationFieldKernel::getName(), this->con);
-  this->resamplingKernel = platform->createKernel(ResampleImageKernel::getName(), this->con);
+  // The fused affine resampling is used when the platform provides it, so that no
+  // deformation field has to be allocated and filled
+  this->affineResamplingKernel = platform->createKernel(AffineResampleImageKernel::getName(), this->con);
+  if (this->affineResamplingKernel != NULL) {
+    this->affineTransformation3DKernel = NULL;
+    this->resamplingKernel = NULL;
+  } else {
+    this->affineTransformation3DKernel = platform->createKernel(AffineDeformationFieldKernel::getName(), this->con);
+    this->resamplingKernel = platform->createKernel(ResampleImageKernel::getName(), this->con);
+  }
   if (this->blockMatchingParams != NULL) {
     this->blockMatchingKernel = platform->createKernel(BlockMatchingKernel::getName(), this->con);
     this->optimiseKernel = platform->createKernel(OptimiseKernel::getName(), this->con);
@@ -464,8 +518,12 @@ void reg_aladin<T>::createKernels()
 template<class T>
 void reg_aladin<T>::clearKernels()
 {
-  delete this->affineTransformation3DKernel;
-  delete this->resamplingKernel;
+  if (this->affineResamplingKernel != NULL)
+    delete this->affineResamplingKernel;
+  if (this->affineTransformation3DKernel != NULL)
+    delete this->affineTransformation3DKernel;
+  if (this->resamplingKernel != NULL)
+    delete this->resamplingKernel;
   if (this->blockMatchingKernel != NULL)
     delete this->blockMatchingKernel;
   if (this->optimiseKernel != NULL)
@@ -475,12 +533,19 @@ void reg_aladin<T>::clearKernels()
 template<class T>
 void reg_aladin<T>::GetDeformationField()
 {
+  // Only created on demand when the fused affine resampling is in use
+  if (this->affineTransformation3DKernel == NULL)
+    this->affineTransformation3DKernel = platform->createKernel(AffineDeformationFieldKernel::getName(), this->con);
   this->affineTransformation3DKernel->template castTo<AffineDeformationFieldKernel>()->calculate();
 }
 /* *************************************************************** */
 template<class T>
 void reg_aladin<T>::GetWarpedImage(int interp, float padding)
 {
+  if (this->affineResamplingKernel != NULL) {
+    this->affineResamplingKernel->template castTo<AffineResampleImageKernel>()->calculate(interp, padding);
+    return;
+  }
   this->GetDeformationField();
   this->resamplingKernel->template castTo<ResampleImageKernel>()->calculate(interp, padding);
 }
@@ -102,6 +102,13 @@ class reg_aladin
         float FloatingLowerThreshold;
         float WarpedPaddingValue;
 
+        // Margin, in voxel, kept around the foreground when the pyramids are
+        // built from cropped images. No cropping is performed if negative
+        int CropMargin;
+        bool InputCropped;
+        int ReferenceCropBox[6];
+        int FloatingCropBox[6];
+
         Platform *platform;
         int platformCode;
         unsigned gpuIdx;
@@ -243,6 +250,11 @@ class reg_aladin
         SetClampMacro(Interpolation,int,0,3)
         GetMacro(Interpolation, int)
 
+        void UseForegroundCropping(int margin)
+        {
+            this->CropMargin = margin < 0 ? 0 : margin;
+        }
+
         virtual void SetInputFloatingMask(nifti_image*)
         {
             reg_print_fct_warn("reg_aladin::SetInputFloatingMask()");
@@ -285,6 +297,7 @@ class reg_aladin
     private:
         Kernel *affineTransformation3DKernel,*blockMatchingKernel;
         Kernel *optimiseKernel, *resamplingKernel;
+        Kernel *affineResamplingKernel;
         void resolveMatrix(unsigned int iterations,
                            const unsigned int optimizationFlag);
 };
@@ -22,6 +22,7 @@ reg_aladin_sym<T>::reg_aladin_sym ()
    this->bBlockMatchingKernel=NULL;
    this->bOptimiseKernel=NULL;
    this->bResamplingKernel=NULL;
+   this->bAffineResamplingKernel=NULL;
 
    this->backCon = NULL;
    this->BackwardBlockMatchingParams=NULL;
@@ -84,11 +85,17 @@ void reg_aladin_sym<T>::InitialiseRegistration()
    this->BackwardActiveVoxelNumber= (int *)malloc(this->LevelsToPerform*sizeof(int));
    if (this->InputFloatingMask!=NULL)
    {
-      reg_createMaskPyramid<T>(this->InputFloatingMask,
+      // The floating mask has to match the cropped floating image
+      nifti_image *floatingMask = this->InputFloatingMask;
+      if(this->InputCropped)
+         floatingMask = reg_tools_cropImage(this->InputFloatingMask, this->FloatingCropBox);
+      reg_createMaskPyramid<T>(floatingMask,
                                this->FloatingMaskPyramid,
                                this->NumberOfLevels,
                                this->LevelsToPerform,
                                this->BackwardActiveVoxelNumber);
+      if(this->InputCropped)
+         nifti_image_free(floatingMask);
    }
    else
    {
@@ -214,6 +221,8 @@ void reg_aladin_sym<T>::InitialiseRegistration()
 template <class T>
 void reg_aladin_sym<T>::GetBackwardDeformationField()
 {
+   if (this->bAffineTransformation3DKernel == NULL)
+      this->bAffineTransformation3DKernel = this->platform->createKernel(AffineDeformationFieldKernel::getName(), this->backCon);
    this->bAffineTransformation3DKernel->template castTo<AffineDeformationFieldKernel>()->calculate();
 }
 /* *************************************************************** */
@@ -221,6 +230,10 @@ template <class T>
 void reg_aladin_sym<T>::GetWarpedImage(int interp, float padding)
 {
    reg_aladin<T>::GetWarpedImage(interp, padding);
+   if (this->bAffineResamplingKernel != NULL) {
+      this->bAffineResamplingKernel->template castTo<AffineResampleImageKernel>()->calculate(interp, padding);
+      return;
+   }
    this->GetBackwardDeformationField();
    this->bResamplingKernel->template castTo<ResampleImageKernel>()->calculate(interp, padding);
 
@@ -330,9 +343,15 @@ template <class T>
 void reg_aladin_sym<T>::createKernels()
 {
   reg_aladin<T>::createKernels();
-  this->bAffineTransformation3DKernel = this->platform->createKernel (AffineDeformationFieldKernel::getName(), this->backCon);
+  this->bAffineResamplingKernel = this->platform->createKernel(AffineResampleImageKernel::getName(), this->backCon);
+  if (this->bAffineResamplingKernel != NULL) {
+    this->bAffineTransformation3DKernel = NULL;
+    this->bResamplingKernel = NULL;
+  } else {
+    this->bAffineTransformation3DKernel = this->platform->createKernel (AffineDeformationFieldKernel::getName(), this->backCon);
+    this->bResamplingKernel = this->platform->createKernel(ResampleImageKernel::getName(), this->backCon);
+  }
   this->bBlockMatchingKernel = this->platform->createKernel(BlockMatchingKernel::getName(), this->backCon);
-  this->bResamplingKernel = this->platform->createKernel(ResampleImageKernel::getName(), this->backCon);
   this->bOptimiseKernel = this->platform->createKernel(OptimiseKernel::getName(), this->backCon);
 }
 /* *************************************************************** */
@@ -347,8 +366,12 @@ template <class T>
 void reg_aladin_sym<T>::clearKernels()
 {
   reg_aladin<T>::clearKernels();
-  delete this->bResamplingKernel;
-  delete this->bAffineTransformation3DKernel;
+  if (this->bAffineResamplingKernel != NULL)
+    delete this->bAffineResamplingKernel;
+  if (this->bResamplingKernel != NULL)
+    delete this->bResamplingKernel;
+  if (this->bAffineTransformation3DKernel != NULL)
+    delete this->bAffineTransformation3DKernel;
   delete this->bBlockMatchingKernel;
   delete this->bOptimiseKernel;
 }
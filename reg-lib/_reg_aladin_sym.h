@@ -22,6 +22,7 @@ class reg_aladin_sym : public reg_aladin<T>
 private:
   AladinContent *backCon;
   Kernel *bAffineTransformation3DKernel, *bConvolutionKernel, *bBlockMatchingKernel, *bOptimiseKernel, *bResamplingKernel;
+  Kernel *bAffineResamplingKernel;
 
   virtual void initAladinContent(nifti_image *ref,
                                  nifti_image *flo,
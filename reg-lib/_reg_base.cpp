@@ -53,6 +53,10 @@ reg_base<T>::reg_base(int refTimePoint,int floTimePoint)
    this->inputFloating=NULL; // pointer to external
    this->maskImage=NULL; // pointer to external
    this->affineTransformation=NULL;  // pointer to external
+   this->cropMargin=-1;
+   this->uncroppedReference=NULL; // pointer to external
+   this->uncroppedFloating=NULL; // pointer to external
+   this->uncroppedMask=NULL; // pointer to external
    this->referenceMask=NULL;
    this->referenceSmoothingSigma=0.;
    this->floatingSmoothingSigma=0.;
@@ -87,10 +91,22 @@ reg_base<T>::reg_base(int refTimePoint,int floTimePoint)
    this->currentReference=NULL;
    this->currentFloating=NULL;
    this->currentMask=NULL;
+   this->currentMaskSpans=NULL;
+   this->samplingRate=1.f;
+   this->samplingPerIteration=false;
+   this->samplingSeed=0;
+   this->samplingDraw=0;
+   this->currentFullMask=NULL;
+   this->currentSampledMask=NULL;
+   this->sampledVoxelNumber=0;
    this->warped=NULL;
    this->deformationFieldImage=NULL;
    this->warImgGradient=NULL;
+   this->warImgGradientUpToDate=false;
    this->voxelBasedMeasureGradient=NULL;
+   this->voxelBasedMeasureDerivative=NULL;
+   this->warImgGradientTimePoint=NULL;
+   this->measureDerivativeTimePointNumber=0;
 
    this->interpolation=1;
 
@@ -108,6 +124,8 @@ reg_base<T>::reg_base(int refTimePoint,int floTimePoint)
 template <class T>
 reg_base<T>::~reg_base()
 {
+   if(this->uncroppedReference!=NULL)
+      reg_base<T>::UncropInputImages();
    this->ClearWarped();
    this->ClearWarpedGradient();
    this->ClearDeformationField();
@@ -160,6 +178,13 @@ reg_base<T>::~reg_base()
       free(this->maskPyramid);
       maskPyramid=NULL;
    }
+   reg_tools_freeMaskSpans(this->currentMaskSpans);
+   this->currentMaskSpans=NULL;
+   if(this->currentSampledMask!=NULL)
+   {
+      free(this->currentSampledMask);
+      this->currentSampledMask=NULL;
+   }
    if(this->floatingPyramid!=NULL)
    {
       if(this->usePyramid)
@@ -383,6 +408,32 @@ void reg_base<T>::DoNotUseRobustRange()
 #endif
 }
 /* *************************************************************** */
+template <class T>
+void reg_base<T>::UseForegroundCropping(int margin)
+{
+   this->cropMargin=margin<0?0:margin;
+#ifndef NDEBUG
+   reg_print_fct_debug("reg_base<T>::UseForegroundCropping");
+#endif
+}
+/* *************************************************************** */
+template <class T>
+void reg_base<T>::UseVoxelSampling(float rate, bool perIteration, unsigned int seed)
+{
+   if(rate<=0.f || rate>1.f)
+   {
+      reg_print_fct_error("reg_base<T>::UseVoxelSampling");
+      reg_print_msg_error("The sampling rate is expected to be in ]0,1]");
+      reg_exit();
+   }
+   this->samplingRate=rate;
+   this->samplingPerIteration=perIteration;
+   this->samplingSeed=seed;
+#ifndef NDEBUG
+   reg_print_fct_debug("reg_base<T>::UseVoxelSampling");
+#endif
+}
+/* *************************************************************** */
 template<class T>
 void reg_base<T>::SetWarpedPaddingValue(T p)
 {
@@ -536,6 +587,68 @@ void reg_base<T>::ClearCurrentInputImage()
 #endif
 }
 /* *************************************************************** */
+template <class T>
+void reg_base<T>::CropInputImages()
+{
+   // The reference image is cropped around the mask when available and
+   // around its own foreground otherwise
+   int referenceBox[6], floatingBox[6];
+   nifti_image *referenceForeground = this->maskImage!=NULL ? this->maskImage : this->inputReference;
+   if(!reg_tools_getForegroundBoundingBox(referenceForeground, this->cropMargin, referenceBox) ||
+         !reg_tools_getForegroundBoundingBox(this->inputFloating, this->cropMargin, floatingBox))
+   {
+      reg_print_fct_warn("reg_base<T>::CropInputImages()");
+      reg_print_msg_warn("No foreground voxel found. The input images are not cropped");
+      return;
+   }
+   this->AlignCropBox(referenceBox);
+   this->uncroppedReference=this->inputReference;
+   this->uncroppedFloating=this->inputFloating;
+   this->uncroppedMask=this->maskImage;
+   this->inputReference=reg_tools_cropImage(this->uncroppedReference, referenceBox);
+   this->inputFloating=reg_tools_cropImage(this->uncroppedFloating, floatingBox);
+   if(this->uncroppedMask!=NULL)
+      this->maskImage=reg_tools_cropImage(this->uncroppedMask, referenceBox);
+#ifdef NDEBUG
+   if(this->verbose)
+   {
+#endif
+      char text[255];
+      sprintf(text, "Reference image cropped from %ix%ix%i to %ix%ix%i voxels",
+              this->uncroppedReference->nx, this->uncroppedReference->ny, this->uncroppedReference->nz,
+              this->inputReference->nx, this->inputReference->ny, this->inputReference->nz);
+      reg_print_info(this->executableName, text);
+      sprintf(text, "Floating image cropped from %ix%ix%i to %ix%ix%i voxels",
+              this->uncroppedFloating->nx, this->uncroppedFloating->ny, this->uncroppedFloating->nz,
+              this->inputFloating->nx, this->inputFloating->ny, this->inputFloating->nz);
+      reg_print_info(this->executableName, text);
+#ifdef NDEBUG
+   }
+#endif
+#ifndef NDEBUG
+   reg_print_fct_debug("reg_base<T>::CropInputImages");
+#endif
+}
+/* *************************************************************** */
+template <class T>
+void reg_base<T>::UncropInputImages()
+{
+   if(this->uncroppedReference==NULL) return;
+   nifti_image_free(this->inputReference);
+   nifti_image_free(this->inputFloating);
+   if(this->maskImage!=NULL)
+      nifti_image_free(this->maskImage);
+   this->inputReference=this->uncroppedReference;
+   this->inputFloating=this->uncroppedFloating;
+   this->maskImage=this->uncroppedMask;
+   this->uncroppedReference=NULL;
+   this->uncroppedFloating=NULL;
+   this->uncroppedMask=NULL;
+#ifndef NDEBUG
+   reg_print_fct_debug("reg_base<T>::UncropInputImages");
+#endif
+}
+/* *************************************************************** */
 /* *************************************************************** */
 template <class T>
 void reg_base<T>::AllocateWarped()
@@ -675,6 +788,7 @@ void reg_base<T>::ClearWarpedGradient()
       nifti_image_free(this->warImgGradient);
       this->warImgGradient=NULL;
    }
+   this->warImgGradientUpToDate=false;
 #ifndef NDEBUG
    reg_print_fct_debug("reg_base<T>::ClearWarpedGradient");
 #endif
@@ -706,6 +820,21 @@ void reg_base<T>::ClearVoxelBasedMeasureGradient()
       nifti_image_free(this->voxelBasedMeasureGradient);
       this->voxelBasedMeasureGradient=NULL;
    }
+   if(this->voxelBasedMeasureDerivative!=NULL)
+   {
+      for(int t=0; t<this->measureDerivativeTimePointNumber; ++t)
+      {
+         if(this->voxelBasedMeasureDerivative[t]!=NULL)
+            nifti_image_free(this->voxelBasedMeasureDerivative[t]);
+         if(this->warImgGradientTimePoint[t]!=NULL)
+            nifti_image_free(this->warImgGradientTimePoint[t]);
+      }
+      free(this->voxelBasedMeasureDerivative);
+      free(this->warImgGradientTimePoint);
+      this->voxelBasedMeasureDerivative=NULL;
+      this->warImgGradientTimePoint=NULL;
+      this->measureDerivativeTimePointNumber=0;
+   }
 #ifndef NDEBUG
    reg_print_fct_debug("reg_base<T>::ClearVoxelBasedMeasureGradient");
 #endif
@@ -901,6 +1030,15 @@ void reg_base<T>::CheckParameters()
         delete[] chanWeightSum;
 	}
 
+	// THE MIND DESCRIPTORS REQUIRE THE WARPED IMAGE AROUND EVERY ACTIVE VOXEL
+	if (this->samplingRate < 1.f &&
+		(this->measure_mind != NULL || this->measure_mindssc != NULL))
+	{
+		reg_print_fct_warn("reg_base::CheckParameters()");
+		reg_print_msg_warn("The voxel sampling is not available with the MIND measures and is disabled");
+		this->samplingRate = 1.f;
+	}
+
 #ifndef NDEBUG
 	reg_print_fct_debug("reg_base<T>::CheckParameters");
 #endif
@@ -937,6 +1075,7 @@ void reg_base<T>::InitialiseSimilarity()
    else this->localWeightSimCurrent=NULL;
 
    if(this->measure_nmi!=NULL)
+   {
       this->measure_nmi->InitialiseMeasure(this->currentReference,
                                            this->currentFloating,
                                            this->currentMask,
@@ -945,8 +1084,11 @@ void reg_base<T>::InitialiseSimilarity()
                                            this->voxelBasedMeasureGradient,
                                            this->localWeightSimCurrent
                                           );
+      this->measure_nmi->SetMaskSpans(this->currentMaskSpans);
+   }
 
    if(this->measure_ssd!=NULL)
+   {
       this->measure_ssd->InitialiseMeasure(this->currentReference,
                                            this->currentFloating,
                                            this->currentMask,
@@ -955,8 +1097,11 @@ void reg_base<T>::InitialiseSimilarity()
                                            this->voxelBasedMeasureGradient,
                                            this->localWeightSimCurrent
                                           );
+      this->measure_ssd->SetMaskSpans(this->currentMaskSpans);
+   }
 
    if(this->measure_kld!=NULL)
+   {
       this->measure_kld->InitialiseMeasure(this->currentReference,
                                            this->currentFloating,
                                            this->currentMask,
@@ -965,6 +1110,8 @@ void reg_base<T>::InitialiseSimilarity()
                                            this->voxelBasedMeasureGradient,
                                            this->localWeightSimCurrent
                                           );
+      this->measure_kld->SetMaskSpans(this->currentMaskSpans);
+   }
 
    if(this->measure_lncc!=NULL)
       this->measure_lncc->InitialiseMeasure(this->currentReference,
@@ -1074,6 +1221,10 @@ void reg_base<T>::Initialise()
       nifti_image_free(temp_floating);
    }
 
+   // Crop the input images around their foreground if required
+   if(this->cropMargin>=0)
+      this->CropInputImages();
+
    // FINEST LEVEL OF REGISTRATION
    if(this->usePyramid)
    {
@@ -1165,6 +1316,10 @@ void reg_base<T>::SetOptimiser()
 template <class T>
 double reg_base<T>::ComputeSimilarityMeasure()
 {
+   // The measure values are not fused: each measure still reads the images it
+   // uses in its own pass. NMI first needs its joint histogram and LNCC its
+   // convolutions, so they have no per-voxel term to share. Measures set on
+   // different time points read different warped volumes
    double measure=0.;
    if(this->measure_nmi!=NULL)
       measure += this->measure_nmi->GetSimilarityMeasureValue();
@@ -1225,24 +1380,70 @@ void reg_base<T>::GetVoxelBasedGradient()
    //   if(this->measure_dti!=NULL)
    //      this->measure_dti->GetVoxelBasedSimilarityMeasureGradient();
 
+   // When several point-wise measures are active on a time point, their
+   // derivatives with respect to the warped intensities are summed. The voxel
+   // based gradient is then updated once from the derivatives and warped image
+   // gradients of all such time points. A time point with a single point-wise
+   // measure uses the gradient of this measure, which is faster than storing
+   // its derivative. Such a time point, as well as LNCC and MIND, thus still
+   // updates the voxel based gradient in its own pass
+   reg_measure *pointWiseMeasure[3]={this->measure_nmi,
+                                     this->measure_ssd,
+                                     this->measure_kld};
+   int accumulatedTimepointNumber=0;
+
    for(int t=0; t<this->currentReference->nt; ++t){
-      reg_getImageGradient(this->currentFloating,
-                           this->warImgGradient,
-                           this->deformationFieldImage,
-                           this->currentMask,
-                           this->interpolation,
-                           this->warpedPaddingValue,
-                           t);
+      // The gradient of the first time point might already have been computed
+      // together with the warped image
+      if(t>0 || !this->warImgGradientUpToDate)
+         reg_getImageGradient_spans(this->currentFloating,
+                                    this->warImgGradient,
+                                    this->deformationFieldImage,
+                                    this->currentMaskSpans,
+                                    this->interpolation,
+                                    this->warpedPaddingValue,
+                                    t);
+      this->warImgGradientUpToDate=false;
 
       // The gradient of the various measures of similarity are computed
-      if(this->measure_nmi!=NULL)
-         this->measure_nmi->GetVoxelBasedSimilarityMeasureGradient(t);
-
-      if(this->measure_ssd!=NULL)
-         this->measure_ssd->GetVoxelBasedSimilarityMeasureGradient(t);
-
-      if(this->measure_kld!=NULL)
-         this->measure_kld->GetVoxelBasedSimilarityMeasureGradient(t);
+      int activeMeasureNumber=0;
+      for(int m=0; m<3; ++m)
+         if(pointWiseMeasure[m]!=NULL && pointWiseMeasure[m]->GetTimepointsWeights()[t]>0)
+            ++activeMeasureNumber;
+      if(activeMeasureNumber>1)
+      {
+         if(this->voxelBasedMeasureDerivative==NULL)
+         {
+            this->measureDerivativeTimePointNumber=this->currentReference->nt;
+            this->voxelBasedMeasureDerivative=(nifti_image **)calloc(this->currentReference->nt,sizeof(nifti_image *));
+            this->warImgGradientTimePoint=(nifti_image **)calloc(this->currentReference->nt,sizeof(nifti_image *));
+         }
+         nifti_image *derivative=this->voxelBasedMeasureDerivative[accumulatedTimepointNumber];
+         if(derivative==NULL)
+         {
+            derivative=nifti_copy_nim_info(this->currentReference);
+            derivative->ndim=derivative->dim[0]=this->currentReference->nz>1?3:2;
+            derivative->nt=derivative->dim[4]=1;
+            derivative->nu=derivative->dim[5]=1;
+            derivative->nvox=(size_t)this->currentReference->nx*
+                  this->currentReference->ny*this->currentReference->nz;
+            derivative->data=(void *)malloc(derivative->nvox*derivative->nbyper);
+            this->voxelBasedMeasureDerivative[accumulatedTimepointNumber]=derivative;
+         }
+         memset(derivative->data, 0, derivative->nvox*derivative->nbyper);
+         for(int m=0; m<3; ++m)
+         {
+            if(pointWiseMeasure[m]!=NULL &&
+                  !pointWiseMeasure[m]->AddVoxelBasedSimilarityMeasureDerivative(t, derivative))
+               pointWiseMeasure[m]->GetVoxelBasedSimilarityMeasureGradient(t);
+         }
+      }
+      else
+      {
+         for(int m=0; m<3; ++m)
+            if(pointWiseMeasure[m]!=NULL)
+               pointWiseMeasure[m]->GetVoxelBasedSimilarityMeasureGradient(t);
+      }
 
       if(this->measure_lncc!=NULL)
          this->measure_lncc->GetVoxelBasedSimilarityMeasureGradient(t);
@@ -1252,6 +1453,39 @@ void reg_base<T>::GetVoxelBasedGradient()
 
       if(this->measure_mindssc!=NULL)
          this->measure_mindssc->GetVoxelBasedSimilarityMeasureGradient(t);
+
+      if(activeMeasureNumber>1)
+      {
+         // The warped image gradient is kept until all time points are processed.
+         // The one of the last time point remains in warImgGradient
+         if(t<this->currentReference->nt-1)
+         {
+            nifti_image *gradient=this->warImgGradientTimePoint[accumulatedTimepointNumber];
+            if(gradient==NULL)
+            {
+               gradient=nifti_copy_nim_info(this->warImgGradient);
+               gradient->data=(void *)malloc(gradient->nvox*gradient->nbyper);
+               this->warImgGradientTimePoint[accumulatedTimepointNumber]=gradient;
+            }
+            void *temp=gradient->data;
+            gradient->data=this->warImgGradient->data;
+            this->warImgGradient->data=temp;
+         }
+         else this->warImgGradientTimePoint[accumulatedTimepointNumber]=this->warImgGradient;
+         ++accumulatedTimepointNumber;
+      }
+   }
+
+   if(accumulatedTimepointNumber>0)
+   {
+      reg_tools_accumulateVoxelBasedGradient(this->voxelBasedMeasureDerivative,
+                                             this->warImgGradientTimePoint,
+                                             accumulatedTimepointNumber,
+                                             this->voxelBasedMeasureGradient,
+                                             this->currentMaskSpans);
+      // The warped image gradient is not owned by the array
+      if(this->warImgGradientTimePoint[accumulatedTimepointNumber-1]==this->warImgGradient)
+         this->warImgGradientTimePoint[accumulatedTimepointNumber-1]=NULL;
    }
 
 #ifndef NDEBUG
@@ -1461,16 +1695,17 @@ void reg_base<T>::WarpFloatingImage(int inter)
 {
    // Compute the deformation field
    this->GetDeformationField();
+   this->warImgGradientUpToDate=false;
 
    if(this->measure_dti==NULL)
    {
       // Resample the floating image
-      reg_resampleImage(this->currentFloating,
-                        this->warped,
-                        this->deformationFieldImage,
-                        this->currentMask,
-                        inter,
-                        this->warpedPaddingValue);
+      reg_resampleImage_spans(this->currentFloating,
+                              this->warped,
+                              this->deformationFieldImage,
+                              this->currentMaskSpans,
+                              inter,
+                              this->warpedPaddingValue);
    }
    else
    {
@@ -1491,6 +1726,108 @@ void reg_base<T>::WarpFloatingImage(int inter)
 #endif
 }
 /* *************************************************************** */
+template <class T>
+void reg_base<T>::WarpFloatingImageAndGradient(int inter)
+{
+   // The DTI resampling is not handled by the single pass resampling
+   if(this->measure_dti!=NULL || this->warImgGradient==NULL)
+   {
+      this->WarpFloatingImage(inter);
+      return;
+   }
+
+   // Compute the deformation field
+   this->GetDeformationField();
+
+   // Resample the floating image and compute the gradient of its first time point
+   reg_resampleImageAndGradient_spans(this->currentFloating,
+                                      this->warped,
+                                      this->warImgGradient,
+                                      this->deformationFieldImage,
+                                      this->currentMaskSpans,
+                                      inter,
+                                      this->warpedPaddingValue,
+                                      0);
+   this->warImgGradientUpToDate=true;
+#ifndef NDEBUG
+   reg_print_fct_debug("reg_base<T>::WarpFloatingImageAndGradient");
+#endif
+}
+/* *************************************************************** */
+/* *************************************************************** */
+template <class T>
+void reg_base<T>::InitialiseVoxelSampling()
+{
+   this->currentFullMask=this->currentMask;
+   this->currentSampledMask=(int *)malloc((size_t)this->currentReference->nx*
+                                          this->currentReference->ny*
+                                          this->currentReference->nz*sizeof(int));
+   this->currentMask=this->currentSampledMask;
+   this->samplingDraw=0;
+   this->DrawVoxelSample();
+#ifdef NDEBUG
+   if(this->verbose)
+   {
+#endif
+      char text[255];
+      sprintf(text, "The measure of similarity is evaluated over %g%% of the active voxels%s",
+              100.f*this->samplingRate,
+              this->samplingPerIteration?", drawn at every iteration":"");
+      reg_print_info(this->executableName, text);
+#ifdef NDEBUG
+   }
+#endif
+#ifndef NDEBUG
+   reg_print_fct_debug("reg_base<T>::InitialiseVoxelSampling");
+#endif
+}
+/* *************************************************************** */
+template <class T>
+void reg_base<T>::DrawVoxelSample()
+{
+   int currentDim[3]={this->currentReference->nx,
+                      this->currentReference->ny,
+                      this->currentReference->nz};
+   size_t voxelNumber=(size_t)currentDim[0]*currentDim[1]*currentDim[2];
+   size_t sampleNumber=reg_tools_sampleMask(this->currentFullMask,
+                                            this->currentSampledMask,
+                                            voxelNumber,
+                                            this->samplingRate,
+                                            this->samplingSeed+this->samplingDraw);
+   ++this->samplingDraw;
+   if(sampleNumber==0)
+   {
+      reg_print_fct_warn("reg_base<T>::DrawVoxelSample");
+      reg_print_msg_warn("No active voxel has been sampled. All active voxels are used");
+      memcpy(this->currentSampledMask, this->currentFullMask, voxelNumber*sizeof(int));
+      sampleNumber=this->activeVoxelNumber[this->usePyramid?this->currentLevel:0];
+   }
+   this->sampledVoxelNumber=sampleNumber;
+   // The spans and the measures are updated to only visit the sampled voxels
+   reg_tools_freeMaskSpans(this->currentMaskSpans);
+   this->currentMaskSpans=reg_tools_createMaskSpans(this->currentMask, currentDim);
+   if(this->measure_nmi!=NULL)
+      this->measure_nmi->SetMaskSpans(this->currentMaskSpans);
+   if(this->measure_ssd!=NULL)
+      this->measure_ssd->SetMaskSpans(this->currentMaskSpans);
+   if(this->measure_kld!=NULL)
+      this->measure_kld->SetMaskSpans(this->currentMaskSpans);
+#ifndef NDEBUG
+   reg_print_fct_debug("reg_base<T>::DrawVoxelSample");
+#endif
+}
+/* *************************************************************** */
+template <class T>
+void reg_base<T>::ClearVoxelSampling()
+{
+   free(this->currentSampledMask);
+   this->currentSampledMask=NULL;
+   this->currentMask=this->currentFullMask;
+#ifndef NDEBUG
+   reg_print_fct_debug("reg_base<T>::ClearVoxelSampling");
+#endif
+}
+/* *************************************************************** */
 /* *************************************************************** */
 template <class T>
 void reg_base<T>::Run()
@@ -1533,6 +1870,12 @@ void reg_base<T>::Run()
          this->currentFloating = this->floatingPyramid[0];
          this->currentMask = this->maskPyramid[0];
       }
+      // The active voxels are stored as spans so that the resampling and the
+      // measures only visit them
+      int currentDim[3]={this->currentReference->nx,
+                         this->currentReference->ny,
+                         this->currentReference->nz};
+      this->currentMaskSpans=reg_tools_createMaskSpans(this->currentMask, currentDim);
 
       // Allocate image that depends on the reference image
       this->AllocateWarped();
@@ -1544,6 +1887,10 @@ void reg_base<T>::Run()
       T currentSize = maxStepSize;
       T smallestSize = maxStepSize / (T)100.0;
 
+      // A random subset of the active voxels is used at the last level
+      if(this->samplingRate<1.f && this->currentLevel==this->levelToPerform-1)
+         this->InitialiseVoxelSampling();
+
       this->DisplayCurrentLevelParameters();
 
       // Allocate image that are required to compute the gradient
@@ -1577,6 +1924,16 @@ void reg_base<T>::Run()
                break;
             }
 
+            // A new subset of voxels is drawn and the best objective function value
+            // is evaluated over it so that the line search compares the same voxels
+            if(this->currentSampledMask!=NULL && this->samplingPerIteration &&
+                  this->optimiser->GetCurrentIterationNumber()>0)
+            {
+               this->DrawVoxelSample();
+               this->optimiser->SetBestObjFunctionValue(this->GetObjectiveFunctionValue());
+               this->UpdateBestObjFunctionValue();
+            }
+
             // Compute the objective function gradient
             this->GetObjectiveFunctionGradient();
 
@@ -1625,6 +1982,10 @@ void reg_base<T>::Run()
       this->ClearWarpedGradient();
       this->ClearVoxelBasedMeasureGradient();
       this->ClearTransformationGradient();
+      reg_tools_freeMaskSpans(this->currentMaskSpans);
+      this->currentMaskSpans=NULL;
+      if(this->currentSampledMask!=NULL)
+         this->ClearVoxelSampling();
       if(this->usePyramid)
       {
          nifti_image_free(this->referencePyramid[this->currentLevel]);
@@ -1658,6 +2019,9 @@ void reg_base<T>::Run()
       this->maxiterationNumber /= 2;
    } // level this->levelToPerform
 
+   // The transformation is expressed in the space of the uncropped images
+   this->UncropInputImages();
+
 #ifndef NDEBUG
    reg_print_fct_debug("reg_base<T>::Run");
 #endif
@@ -70,6 +70,12 @@ protected:
    nifti_image *inputFloating; // pointer to external
    nifti_image *maskImage; // pointer to external
    mat44 *affineTransformation; // pointer to external
+   // Margin, in voxel, kept around the foreground when the input images
+   // are cropped. No cropping is performed if negative
+   int cropMargin;
+   nifti_image *uncroppedReference; // pointer to external
+   nifti_image *uncroppedFloating; // pointer to external
+   nifti_image *uncroppedMask; // pointer to external
    int *referenceMask;
    T referenceSmoothingSigma;
    T floatingSmoothingSigma;
@@ -98,10 +104,30 @@ protected:
    nifti_image *currentReference;
    nifti_image *currentFloating;
    int *currentMask;
+   // Active voxels of the current mask, stored as spans along the x-axis
+   reg_maskSpans *currentMaskSpans;
+   // Rate of the random subset of active voxels used to evaluate the measure
+   // of similarity at the last level. No sampling is performed if equal to one
+   float samplingRate;
+   bool samplingPerIteration;
+   unsigned int samplingSeed;
+   unsigned int samplingDraw;
+   int *currentFullMask; // pointer to the mask pyramid
+   int *currentSampledMask;
+   size_t sampledVoxelNumber;
    nifti_image *warped;
    nifti_image *deformationFieldImage;
    nifti_image *warImgGradient;
+   // Set when the warped image gradient of the first time point has been
+   // computed alongside the warped image by WarpFloatingImageAndGradient
+   bool warImgGradientUpToDate;
    nifti_image *voxelBasedMeasureGradient;
+   // Derivatives of the measures with respect to the warped intensities and
+   // warped image gradients, indexed by time point. They are used when the
+   // gradients of several point-wise measures are accumulated together
+   nifti_image **voxelBasedMeasureDerivative;
+   nifti_image **warImgGradientTimePoint;
+   int measureDerivativeTimePointNumber;
    unsigned int currentLevel;
 
    mat33 *forwardJacobianMatrix;
@@ -130,8 +156,18 @@ protected:
       return 0.;
    }
    virtual void ClearCurrentInputImage();
+   virtual void CropInputImages();
+   virtual void UncropInputImages();
+   virtual void AlignCropBox(int *)
+   {
+      return;  // Need to be filled
+   }
+   virtual void InitialiseVoxelSampling();
+   virtual void DrawVoxelSample();
+   virtual void ClearVoxelSampling();
 
    virtual void WarpFloatingImage(int);
+   virtual void WarpFloatingImageAndGradient(int);
    virtual double ComputeSimilarityMeasure();
    virtual void GetVoxelBasedGradient();
    virtual void SmoothGradient()
@@ -269,6 +305,8 @@ public:
    void SetFloatingThresholdLow(unsigned int,T);
    void UseRobustRange();
    void DoNotUseRobustRange();
+   void UseForegroundCropping(int margin);
+   void UseVoxelSampling(float rate, bool perIteration=false, unsigned int seed=0);
    void SetWarpedPaddingValue(T);
    void SetLevelNumber(unsigned int);
    void SetLevelToPerform(unsigned int);
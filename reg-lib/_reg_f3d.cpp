@@ -189,6 +189,13 @@ template<class T>
 void reg_f3d<T>::CheckParameters()
 {
    reg_base<T>::CheckParameters();
+   // An input grid is defined over the whole reference image
+   if(this->cropMargin>=0 && this->inputControlPointGrid!=NULL)
+   {
+      reg_print_fct_warn("reg_f3d<T>::CheckParameters()");
+      reg_print_msg_warn("The input images are not cropped when an input control point grid is used");
+      this->cropMargin=-1;
+   }
    // NORMALISE THE OBJECTIVE FUNCTION WEIGHTS
    if(strcmp(this->executableName,"NiftyReg F3D")==0 ||
          strcmp(this->executableName,"NiftyReg F3D GPU")==0)
@@ -544,56 +551,18 @@ void reg_f3d<T>::GetSimilarityMeasureGradient()
 {
    this->GetVoxelBasedGradient();
 
-   int kernel_type=CUBIC_SPLINE_KERNEL;
-   // The voxel based NMI gradient is convolved with a spline kernel
-   // Convolution along the x axis
-   float currentNodeSpacing[3];
-   currentNodeSpacing[0]=currentNodeSpacing[1]=currentNodeSpacing[2]=this->controlPointGrid->dx;
-   bool activeAxis[3]= {1,0,0};
-   reg_tools_kernelConvolution(this->voxelBasedMeasureGradient,
-                               currentNodeSpacing,
-                               kernel_type,
-                               NULL, // mask
-                               NULL, // all volumes are considered as active
-                               activeAxis
-                               );
-   // Convolution along the y axis
-   currentNodeSpacing[0]=currentNodeSpacing[1]=currentNodeSpacing[2]=this->controlPointGrid->dy;
-   activeAxis[0]=0;
-   activeAxis[1]=1;
-   reg_tools_kernelConvolution(this->voxelBasedMeasureGradient,
-                               currentNodeSpacing,
-                               kernel_type,
-                               NULL, // mask
-                               NULL, // all volumes are considered as active
-                               activeAxis
-                               );
-   // Convolution along the z axis if required
-   if(this->voxelBasedMeasureGradient->nz>1)
-   {
-      currentNodeSpacing[0]=currentNodeSpacing[1]=currentNodeSpacing[2]=this->controlPointGrid->dz;
-      activeAxis[1]=0;
-      activeAxis[2]=1;
-      reg_tools_kernelConvolution(this->voxelBasedMeasureGradient,
-                                  currentNodeSpacing,
-                                  kernel_type,
-                                  NULL, // mask
-                                  NULL, // all volumes are considered as active
-                                  activeAxis
-                                  );
-   }
-
-   // The node based NMI gradient is extracted
+   // The voxel-based gradient is projected onto the control points using the
+   // transpose of the spline interpolation. Only the node values are computed.
    mat44 reorientation;
    if(this->currentFloating->sform_code>0)
       reorientation = this->currentFloating->sto_ijk;
    else reorientation = this->currentFloating->qto_ijk;
-   reg_voxelCentric2NodeCentric(this->transformationGradient,
-                                this->voxelBasedMeasureGradient,
-                                this->similarityWeight,
-                                false, // no update
-                                &reorientation
-                                );
+   reg_spline_voxelCentric2NodeCentric(this->transformationGradient,
+                                       this->voxelBasedMeasureGradient,
+                                       this->similarityWeight,
+                                       false, // no update
+                                       &reorientation
+                                       );
 #ifndef NDEBUG
    reg_print_fct_debug("reg_f3d<T>::GetSimilarityMeasureGradient");
 #endif
@@ -1128,7 +1097,7 @@ void reg_f3d<T>::GetObjectiveFunctionGradient()
       // Compute the gradient of the similarity measure
       if(this->similarityWeight>0)
       {
-         this->WarpFloatingImage(this->interpolation);
+         this->WarpFloatingImageAndGradient(this->interpolation);
          this->GetSimilarityMeasureGradient();
       }
       else
@@ -1166,6 +1135,52 @@ void reg_f3d<T>::CorrectTransformation()
 #endif
 }
 /* *************************************************************** */
+template<class T>
+void reg_f3d<T>::AlignCropBox(int *bbox)
+{
+   // The spline evaluation assumes that the first reference voxel lies on a
+   // control point. The lower bounds of the crop are thus moved onto the
+   // lattice of the final grid so that it can be extended back afterwards
+   int refinementNumber = this->gridRefinement ? this->levelToPerform-1 : 0;
+   int dimNumber = this->inputReference->nz>1 ? 3 : 2;
+   for(int d=0; d<dimNumber; ++d)
+   {
+      float gridSpacing = this->spacing[d]!=this->spacing[d] ? this->spacing[0] : this->spacing[d];
+      gridSpacing = gridSpacing<0 ? -gridSpacing : gridSpacing / this->inputReference->pixdim[d+1];
+      gridSpacing *= powf(2.0f, (float)(this->levelNumber-1-refinementNumber));
+      // Smallest whole number of voxels that spans a whole number of control points
+      int period=0;
+      for(int m=1; m<=16 && period==0; ++m)
+      {
+         float span=(float)m*gridSpacing;
+         if(fabsf(span-reg_round(span))<1e-3f && reg_round(span)>0)
+            period=reg_round(span);
+      }
+      if(period>0)
+         bbox[2*d] -= bbox[2*d] % period;
+      else bbox[2*d] = 0;
+   }
+#ifndef NDEBUG
+   reg_print_fct_debug("reg_f3d<T>::AlignCropBox");
+#endif
+}
+/* *************************************************************** */
+template<class T>
+void reg_f3d<T>::UncropInputImages()
+{
+   // The grid is extended over the whole reference image. The added nodes
+   // follow the affine initialisation so the transformation is unchanged
+   // over the cropped region
+   if(this->uncroppedReference!=NULL && this->controlPointGrid!=NULL)
+      reg_spline_extendControlPointGrid(&this->controlPointGrid,
+                                        this->uncroppedReference,
+                                        this->affineTransformation);
+   reg_base<T>::UncropInputImages();
+#ifndef NDEBUG
+   reg_print_fct_debug("reg_f3d<T>::UncropInputImages");
+#endif
+}
+/* *************************************************************** */
 /* *************************************************************** */
 
 template class reg_f3d<float>;
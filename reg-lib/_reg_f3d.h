@@ -70,6 +70,8 @@ protected:
    virtual void PrintCurrentObjFunctionValue(T);
 
    virtual void CorrectTransformation();
+   virtual void UncropInputImages();
+   virtual void AlignCropBox(int *);
 
    void (*funcProgressCallback)(float pcntProgress, void *params);
    void *paramsProgressCallback;
@@ -115,6 +117,10 @@ public:
    {
       return;
    }
+   virtual void UseControlPointExponentiation(int)
+   {
+      return;
+   }
 
    // F3D_SYM specific options
    virtual void SetFloatingMask(nifti_image *)
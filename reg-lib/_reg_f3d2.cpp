@@ -27,6 +27,9 @@ reg_f3d2<T>::reg_f3d2(int refTimePoint,int floTimePoint)
    this->BCHUpdate=false;
    this->useGradientCumulativeExp=true;
    this->BCHUpdateValue=0;
+   this->controlPointExponentiation=0;
+   this->squaringField[0]=this->squaringField[1]=NULL;
+   this->backwardSquaringField[0]=this->backwardSquaringField[1]=NULL;
 
 #ifndef NDEBUG
    reg_print_msg_debug("reg_f3d2 constructor called");
@@ -37,6 +40,7 @@ reg_f3d2<T>::reg_f3d2(int refTimePoint,int floTimePoint)
 template <class T>
 reg_f3d2<T>::~reg_f3d2()
 {
+   reg_f3d2<T>::ClearDeformationField();
 #ifndef NDEBUG
    reg_print_msg_debug("reg_f3d2 destructor called");
 #endif
@@ -68,6 +72,19 @@ void reg_f3d2<T>::DoNotUseGradientCumulativeExp()
 }
 /* *************************************************************** */
 /* *************************************************************** */
+template <class T>
+void reg_f3d2<T>::UseControlPointExponentiation(int upsampling)
+{
+   if(upsampling<0 || upsampling>2)
+   {
+      reg_print_fct_error("reg_f3d2<T>::UseControlPointExponentiation()");
+      reg_print_msg_error("The control point exponentiation expects 0, 1 or 2");
+      reg_exit();
+   }
+   this->controlPointExponentiation = upsampling;
+}
+/* *************************************************************** */
+/* *************************************************************** */
 template<class T>
 void reg_f3d2<T>::Initialise()
 {
@@ -87,6 +104,51 @@ void reg_f3d2<T>::Initialise()
 /* *************************************************************** */
 /* *************************************************************** */
 template <class T>
+void reg_f3d2<T>::AllocateDeformationField()
+{
+   reg_f3d_sym<T>::AllocateDeformationField();
+
+   // The scaling-and-squaring buffers are allocated once per level and
+   // share the geometry of the forward and backward deformation fields
+   for(int i=0; i<2; ++i)
+   {
+      this->squaringField[i]=nifti_copy_nim_info(this->deformationFieldImage);
+      this->squaringField[i]->data=(void *)malloc(this->squaringField[i]->nvox *
+                                                  this->squaringField[i]->nbyper);
+      this->backwardSquaringField[i]=nifti_copy_nim_info(this->backwardDeformationFieldImage);
+      this->backwardSquaringField[i]->data=(void *)malloc(this->backwardSquaringField[i]->nvox *
+                                                          this->backwardSquaringField[i]->nbyper);
+   }
+#ifndef NDEBUG
+   reg_print_fct_debug("reg_f3d2<T>::AllocateDeformationField");
+#endif
+}
+/* *************************************************************** */
+/* *************************************************************** */
+template <class T>
+void reg_f3d2<T>::ClearDeformationField()
+{
+   reg_f3d_sym<T>::ClearDeformationField();
+   for(int i=0; i<2; ++i)
+   {
+      if(this->squaringField[i]!=NULL)
+      {
+         nifti_image_free(this->squaringField[i]);
+         this->squaringField[i]=NULL;
+      }
+      if(this->backwardSquaringField[i]!=NULL)
+      {
+         nifti_image_free(this->backwardSquaringField[i]);
+         this->backwardSquaringField[i]=NULL;
+      }
+   }
+#ifndef NDEBUG
+   reg_print_fct_debug("reg_f3d2<T>::ClearDeformationField");
+#endif
+}
+/* *************************************************************** */
+/* *************************************************************** */
+template <class T>
 void reg_f3d2<T>::GetDeformationField()
 {
    // By default the number of steps is automatically updated
@@ -100,10 +162,19 @@ void reg_f3d2<T>::GetDeformationField()
    reg_print_msg_debug(text);
 #endif
    // The forward transformation is computed using the scaling-and-squaring approach
-   reg_spline_getDefFieldFromVelocityGrid(this->controlPointGrid,
-                                          this->deformationFieldImage,
-                                          updateStepNumber
-                                          );
+   if(this->controlPointExponentiation>0)
+      reg_spline_getDefFieldFromVelGridAtNodes(this->controlPointGrid,
+                                               this->deformationFieldImage,
+                                               updateStepNumber,
+                                               this->controlPointExponentiation==2,
+                                               this->squaringField[0]
+                                               );
+   else
+      reg_spline_getDefFieldFromVelocityGrid(this->controlPointGrid,
+                                             this->deformationFieldImage,
+                                             updateStepNumber,
+                                             this->squaringField[0]
+                                             );
 #ifndef NDEBUG
    sprintf(text, "Velocity integration backward. Step number update=%i",updateStepNumber);
    reg_print_msg_debug(text);
@@ -111,10 +182,19 @@ void reg_f3d2<T>::GetDeformationField()
    // The number of step number is copied over from the forward transformation
    this->backwardControlPointGrid->intent_p2=this->controlPointGrid->intent_p2;
    // The backward transformation is computed using the scaling-and-squaring approach
-   reg_spline_getDefFieldFromVelocityGrid(this->backwardControlPointGrid,
-                                          this->backwardDeformationFieldImage,
-                                          false
-                                          );
+   if(this->controlPointExponentiation>0)
+      reg_spline_getDefFieldFromVelGridAtNodes(this->backwardControlPointGrid,
+                                               this->backwardDeformationFieldImage,
+                                               false,
+                                               this->controlPointExponentiation==2,
+                                               this->backwardSquaringField[0]
+                                               );
+   else
+      reg_spline_getDefFieldFromVelocityGrid(this->backwardControlPointGrid,
+                                             this->backwardDeformationFieldImage,
+                                             false,
+                                             this->backwardSquaringField[0]
+                                             );
    return;
 }
 /* *************************************************************** */
@@ -166,26 +246,18 @@ void reg_f3d2<T>::ExponentiateGradient()
 {
    if(!this->useGradientCumulativeExp) return;
 
+   // The intermediate deformation fields of the scaling-and-squaring are
+   // generated one at a time using two buffers, the buffer of a field
+   // being reused once its square and its contribution have been computed
+
    /* /\/\/\/\/\/\/\/\/\/\/\/\/\/\/\/\/\/\/\/\/\/\/\/\/\/\/\/\/\/\/\/\ */
    // Exponentiate the forward gradient using the backward transformation
 #ifndef NDEBUG
    reg_print_msg_debug("Update the forward measure gradient using a Dartel like approach");
 #endif
-   // Create all deformation field images needed for resampling
-   nifti_image **tempDef=(nifti_image **)malloc(
-                            (unsigned int)(fabs(this->backwardControlPointGrid->intent_p2)+1) *
-                            sizeof(nifti_image *));
-   for(unsigned int i=0; i<=(unsigned int)fabs(this->backwardControlPointGrid->intent_p2); ++i)
-   {
-      tempDef[i]=nifti_copy_nim_info(this->deformationFieldImage);
-      tempDef[i]->data=(void *)malloc(tempDef[i]->nvox*tempDef[i]->nbyper);
-   }
-   // Generate all intermediate deformation fields
-   reg_spline_getIntermediateDefFieldFromVelGrid(this->backwardControlPointGrid,
-         tempDef);
-
    // Remove the affine component
    nifti_image *affine_disp=NULL;
+   nifti_image *affineOnly=NULL;
    if(this->affineTransformation!=NULL){
       affine_disp=nifti_copy_nim_info(this->deformationFieldImage);
       affine_disp->data=(void *)malloc(affine_disp->nvox*affine_disp->nbyper);
@@ -194,20 +266,38 @@ void reg_f3d2<T>::ExponentiateGradient()
                                      affine_disp);
       reg_getDisplacementFromDeformation(affine_disp);
    }
+   if(this->backwardControlPointGrid->num_ext>0){
+      affineOnly=nifti_copy_nim_info(this->deformationFieldImage);
+      affineOnly->data=(void *)malloc(affineOnly->nvox*affineOnly->nbyper);
+   }
 
    /* Allocate a temporary gradient image to store the backward gradient */
    nifti_image *tempGrad=nifti_copy_nim_info(this->voxelBasedMeasureGradient);
 
    tempGrad->data=(void *)malloc(tempGrad->nvox*tempGrad->nbyper);
-   for(int i=0; i<(int)fabsf(this->backwardControlPointGrid->intent_p2); ++i)
+   // Generate the first intermediate deformation field
+   int squaringNumber=reg_spline_getScaledDefFieldFromVelGrid(this->backwardControlPointGrid,
+                                                              this->squaringField[0],
+                                                              affineOnly,
+                                                              false);
+   for(int i=0; i<squaringNumber; ++i)
    {
+      nifti_image *currentDef=this->squaringField[i%2];
+      // The next intermediate field is computed before the current one
+      // gets its affine component back
+      if(i<squaringNumber-1)
+         reg_defField_square(currentDef,
+                             this->squaringField[(i+1)%2]);
+      reg_spline_restoreAffineFromVelGrid(this->backwardControlPointGrid,
+                                          affineOnly,
+                                          currentDef);
       if(affine_disp!=NULL)
-         reg_tools_substractImageToImage(tempDef[i],
+         reg_tools_substractImageToImage(currentDef,
                                          affine_disp,
-                                         tempDef[i]);
+                                         currentDef);
       reg_resampleGradient(this->voxelBasedMeasureGradient, // floating
                            tempGrad, // warped - out
-                           tempDef[i], // deformation field
+                           currentDef, // deformation field
                            1, // interpolation type - linear
                            0.f); // padding value
       reg_tools_addImageToImage(tempGrad, // in1
@@ -215,21 +305,16 @@ void reg_f3d2<T>::ExponentiateGradient()
                                 this->voxelBasedMeasureGradient); // out
    }
 
-   // Free the temporary deformation fields
-   for(int i=0; i<=(int)fabsf(this->backwardControlPointGrid->intent_p2); ++i)
-   {
-      nifti_image_free(tempDef[i]);
-      tempDef[i]=NULL;
-   }
-   free(tempDef);
-   tempDef=NULL;
    // Free the temporary gradient image
    nifti_image_free(tempGrad);
    tempGrad=NULL;
-   // Free the temporary affine displacement field
+   // Free the temporary affine fields
    if(affine_disp!=NULL)
       nifti_image_free(affine_disp);
    affine_disp=NULL;
+   if(affineOnly!=NULL)
+      nifti_image_free(affineOnly);
+   affineOnly=NULL;
    // Normalise the forward gradient
    reg_tools_divideValueToImage(this->voxelBasedMeasureGradient, // in
                                 this->voxelBasedMeasureGradient, // out
@@ -240,20 +325,6 @@ void reg_f3d2<T>::ExponentiateGradient()
 #ifndef NDEBUG
    reg_print_msg_debug("Update the backward measure gradient using a Dartel like approach");
 #endif
-   // Allocate a temporary gradient image to store the backward gradient
-   tempGrad=nifti_copy_nim_info(this->backwardVoxelBasedMeasureGradientImage);
-   tempGrad->data=(void *)malloc(tempGrad->nvox*tempGrad->nbyper);
-   // Create all deformation field images needed for resampling
-   tempDef=(nifti_image **)malloc((unsigned int)(fabs(this->controlPointGrid->intent_p2)+1) * sizeof(nifti_image *));
-   for(unsigned int i=0; i<=(unsigned int)fabs(this->controlPointGrid->intent_p2); ++i)
-   {
-      tempDef[i]=nifti_copy_nim_info(this->backwardDeformationFieldImage);
-      tempDef[i]->data=(void *)malloc(tempDef[i]->nvox*tempDef[i]->nbyper);
-   }
-   // Generate all intermediate deformation fields
-   reg_spline_getIntermediateDefFieldFromVelGrid(this->controlPointGrid,
-         tempDef);
-
    // Remove the affine component
    if(this->affineTransformation!=NULL){
       affine_disp=nifti_copy_nim_info(this->backwardDeformationFieldImage);
@@ -262,16 +333,37 @@ void reg_f3d2<T>::ExponentiateGradient()
                                      affine_disp);
       reg_getDisplacementFromDeformation(affine_disp);
    }
+   if(this->controlPointGrid->num_ext>0){
+      affineOnly=nifti_copy_nim_info(this->backwardDeformationFieldImage);
+      affineOnly->data=(void *)malloc(affineOnly->nvox*affineOnly->nbyper);
+   }
 
-   for(int i=0; i<(int)fabsf(this->controlPointGrid->intent_p2); ++i)
+   // Allocate a temporary gradient image to store the backward gradient
+   tempGrad=nifti_copy_nim_info(this->backwardVoxelBasedMeasureGradientImage);
+   tempGrad->data=(void *)malloc(tempGrad->nvox*tempGrad->nbyper);
+   // Generate the first intermediate deformation field
+   squaringNumber=reg_spline_getScaledDefFieldFromVelGrid(this->controlPointGrid,
+                                                          this->backwardSquaringField[0],
+                                                          affineOnly,
+                                                          false);
+   for(int i=0; i<squaringNumber; ++i)
    {
+      nifti_image *currentDef=this->backwardSquaringField[i%2];
+      // The next intermediate field is computed before the current one
+      // gets its affine component back
+      if(i<squaringNumber-1)
+         reg_defField_square(currentDef,
+                             this->backwardSquaringField[(i+1)%2]);
+      reg_spline_restoreAffineFromVelGrid(this->controlPointGrid,
+                                          affineOnly,
+                                          currentDef);
       if(affine_disp!=NULL)
-         reg_tools_substractImageToImage(tempDef[i],
+         reg_tools_substractImageToImage(currentDef,
                                          affine_disp,
-                                         tempDef[i]);
+                                         currentDef);
       reg_resampleGradient(this->backwardVoxelBasedMeasureGradientImage, // floating
                            tempGrad, // warped - out
-                           tempDef[i], // deformation field
+                           currentDef, // deformation field
                            1, // interpolation type - linear
                            0.f); // padding value
       reg_tools_addImageToImage(tempGrad, // in1
@@ -279,21 +371,16 @@ void reg_f3d2<T>::ExponentiateGradient()
                                 this->backwardVoxelBasedMeasureGradientImage); // out
    }
 
-   // Free the temporary deformation field
-   for(int i=0; i<=(int)fabsf(this->controlPointGrid->intent_p2); ++i)
-   {
-      nifti_image_free(tempDef[i]);
-      tempDef[i]=NULL;
-   }
-   free(tempDef);
-   tempDef=NULL;
    // Free the temporary gradient image
    nifti_image_free(tempGrad);
    tempGrad=NULL;
-   // Free the temporary affine displacement field
+   // Free the temporary affine fields
    if(affine_disp!=NULL)
       nifti_image_free(affine_disp);
    affine_disp=NULL;
+   if(affineOnly!=NULL)
+      nifti_image_free(affineOnly);
+   affineOnly=NULL;
    // Normalise the backward gradient
    reg_tools_divideValueToImage(this->backwardVoxelBasedMeasureGradientImage, // in
                                 this->backwardVoxelBasedMeasureGradientImage, // out
@@ -24,7 +24,16 @@ protected:
    bool BCHUpdate;
    bool useGradientCumulativeExp;
    int BCHUpdateValue;
+   // The velocity grid is exponentiated at the voxel level if set to 0,
+   // on its nodes if set to 1 or on nodes with half its spacing if set to 2
+   int controlPointExponentiation;
+   // Buffers used alternately by the scaling-and-squaring in the
+   // reference and floating spaces
+   nifti_image *squaringField[2];
+   nifti_image *backwardSquaringField[2];
 
+   virtual void AllocateDeformationField();
+   virtual void ClearDeformationField();
    virtual void GetDeformationField();
    virtual void GetInverseConsistencyErrorField(bool forceAll);
    virtual void GetInverseConsistencyGradient();
@@ -34,6 +43,7 @@ protected:
    virtual void UseBCHUpdate(int);
    virtual void UseGradientCumulativeExp();
    virtual void DoNotUseGradientCumulativeExp();
+   virtual void UseControlPointExponentiation(int);
 
 public:
    reg_f3d2(int refTimePoint,int floTimePoint);
@@ -35,6 +35,10 @@ reg_f3d_sym<T>::reg_f3d_sym(int refTimePoint,int floTimePoint)
 
    this->floatingMaskImage=NULL;
    this->currentFloatingMask=NULL;
+   this->currentFloatingMaskSpans=NULL;
+   this->currentFullFloatingMask=NULL;
+   this->currentSampledFloatingMask=NULL;
+   this->backwardSampledVoxelNumber=0;
    this->floatingMaskPyramid=NULL;
    this->backwardActiveVoxelNumber=NULL;
 
@@ -51,6 +55,14 @@ reg_f3d_sym<T>::reg_f3d_sym(int refTimePoint,int floTimePoint)
 template <class T>
 reg_f3d_sym<T>::~reg_f3d_sym()
 {
+   reg_tools_freeMaskSpans(this->currentFloatingMaskSpans);
+   this->currentFloatingMaskSpans=NULL;
+   if(this->currentSampledFloatingMask!=NULL)
+   {
+      free(this->currentSampledFloatingMask);
+      this->currentSampledFloatingMask=NULL;
+   }
+
    if(this->backwardControlPointGrid!=NULL)
    {
       nifti_image_free(this->backwardControlPointGrid);
@@ -146,6 +158,11 @@ T reg_f3d_sym<T>::InitialiseCurrentLevel()
       this->currentMask = this->maskPyramid[0];
       this->currentFloatingMask = this->floatingMaskPyramid[0];
    }
+   int floatingDim[3]={this->currentFloating->nx,
+                       this->currentFloating->ny,
+                       this->currentFloating->nz};
+   reg_tools_freeMaskSpans(this->currentFloatingMaskSpans);
+   this->currentFloatingMaskSpans=reg_tools_createMaskSpans(this->currentFloatingMask, floatingDim);
 
    // Define the initial step size for the gradient ascent optimisation
    T maxStepSize = this->currentReference->dx;
@@ -164,9 +181,78 @@ T reg_f3d_sym<T>::InitialiseCurrentLevel()
 }
 /* *************************************************************** */
 template <class T>
+void reg_f3d_sym<T>::InitialiseVoxelSampling()
+{
+   // The floating mask is sampled alongside the reference mask when the
+   // reference sample is drawn
+   this->currentFullFloatingMask=this->currentFloatingMask;
+   this->currentSampledFloatingMask=(int *)malloc((size_t)this->currentFloating->nx*
+                                                  this->currentFloating->ny*
+                                                  this->currentFloating->nz*sizeof(int));
+   this->currentFloatingMask=this->currentSampledFloatingMask;
+   reg_f3d<T>::InitialiseVoxelSampling();
+#ifndef NDEBUG
+   reg_print_fct_debug("reg_f3d_sym<T>::InitialiseVoxelSampling");
+#endif
+}
+/* *************************************************************** */
+template <class T>
+void reg_f3d_sym<T>::DrawVoxelSample()
+{
+   int floatingDim[3]={this->currentFloating->nx,
+                       this->currentFloating->ny,
+                       this->currentFloating->nz};
+   size_t voxelNumber=(size_t)floatingDim[0]*floatingDim[1]*floatingDim[2];
+   size_t sampleNumber=reg_tools_sampleMask(this->currentFullFloatingMask,
+                                            this->currentSampledFloatingMask,
+                                            voxelNumber,
+                                            this->samplingRate,
+                                            this->samplingSeed+this->samplingDraw);
+   if(sampleNumber==0)
+   {
+      reg_print_fct_warn("reg_f3d_sym<T>::DrawVoxelSample");
+      reg_print_msg_warn("No active floating voxel has been sampled. All active voxels are used");
+      memcpy(this->currentSampledFloatingMask, this->currentFullFloatingMask, voxelNumber*sizeof(int));
+      sampleNumber=this->backwardActiveVoxelNumber[this->usePyramid?this->currentLevel:0];
+   }
+   this->backwardSampledVoxelNumber=sampleNumber;
+   reg_tools_freeMaskSpans(this->currentFloatingMaskSpans);
+   this->currentFloatingMaskSpans=reg_tools_createMaskSpans(this->currentFloatingMask, floatingDim);
+
+   // The reference mask is sampled and both spans are passed to the measures
+   reg_f3d<T>::DrawVoxelSample();
+   if(this->measure_nmi!=NULL)
+      this->measure_nmi->SetMaskSpans(this->currentMaskSpans,
+                                     this->currentFloatingMaskSpans);
+   if(this->measure_ssd!=NULL)
+      this->measure_ssd->SetMaskSpans(this->currentMaskSpans,
+                                     this->currentFloatingMaskSpans);
+   if(this->measure_kld!=NULL)
+      this->measure_kld->SetMaskSpans(this->currentMaskSpans,
+                                      this->currentFloatingMaskSpans);
+#ifndef NDEBUG
+   reg_print_fct_debug("reg_f3d_sym<T>::DrawVoxelSample");
+#endif
+}
+/* *************************************************************** */
+template <class T>
+void reg_f3d_sym<T>::ClearVoxelSampling()
+{
+   reg_f3d<T>::ClearVoxelSampling();
+   free(this->currentSampledFloatingMask);
+   this->currentSampledFloatingMask=NULL;
+   this->currentFloatingMask=this->currentFullFloatingMask;
+#ifndef NDEBUG
+   reg_print_fct_debug("reg_f3d_sym<T>::ClearVoxelSampling");
+#endif
+}
+/* *************************************************************** */
+template <class T>
 void reg_f3d_sym<T>::ClearCurrentInputImage()
 {
    reg_f3d<T>::ClearCurrentInputImage();
+   reg_tools_freeMaskSpans(this->currentFloatingMaskSpans);
+   this->currentFloatingMaskSpans=NULL;
 #ifndef NDEBUG
    reg_print_fct_debug("reg_f3d_sym<T>::ClearCurrentInputImage");
 #endif
@@ -421,6 +507,15 @@ void reg_f3d_sym<T>::CheckParameters()
 
    reg_f3d<T>::CheckParameters();
 
+   // The backward transformation is defined over the floating image, which
+   // can not be cropped
+   if(this->cropMargin>=0)
+   {
+      reg_print_fct_warn("reg_f3d_sym<T>::CheckParameters()");
+      reg_print_msg_warn("The input images are not cropped in the symmetric registration");
+      this->cropMargin=-1;
+   }
+
    // CHECK THE FLOATING MASK DIMENSION IF IT IS DEFINED
    if(this->floatingMaskImage!=NULL)
    {
@@ -607,16 +702,17 @@ void reg_f3d_sym<T>::WarpFloatingImage(int inter)
 {
    // Compute the deformation fields
    this->GetDeformationField();
+   this->warImgGradientUpToDate=false;
 
    // Resample the floating image
    if(this->measure_dti==NULL)
    {
-      reg_resampleImage(this->currentFloating,
-                        this->warped,
-                        this->deformationFieldImage,
-                        this->currentMask,
-                        inter,
-                        this->warpedPaddingValue);
+      reg_resampleImage_spans(this->currentFloating,
+                              this->warped,
+                              this->deformationFieldImage,
+                              this->currentMaskSpans,
+                              inter,
+                              this->warpedPaddingValue);
    }
    else
    {
@@ -636,12 +732,12 @@ void reg_f3d_sym<T>::WarpFloatingImage(int inter)
    // Resample the reference image
    if(this->measure_dti==NULL)
    {
-      reg_resampleImage(this->currentReference, // input image
-                        this->backwardWarped, // warped input image
-                        this->backwardDeformationFieldImage, // deformation field
-                        this->currentFloatingMask, // mask
-                        inter, // interpolation type
-                        this->warpedPaddingValue); // padding value
+      reg_resampleImage_spans(this->currentReference, // input image
+                              this->backwardWarped, // warped input image
+                              this->backwardDeformationFieldImage, // deformation field
+                              this->currentFloatingMaskSpans, // mask
+                              inter, // interpolation type
+                              this->warpedPaddingValue); // padding value
    }
    else
    {
@@ -663,6 +759,46 @@ void reg_f3d_sym<T>::WarpFloatingImage(int inter)
    return;
 }
 /* *************************************************************** */
+template <class T>
+void reg_f3d_sym<T>::WarpFloatingImageAndGradient(int inter)
+{
+   // The DTI resampling is not handled by the single pass resampling
+   if(this->measure_dti!=NULL || this->warImgGradient==NULL ||
+         this->backwardWarpedGradientImage==NULL)
+   {
+      this->WarpFloatingImage(inter);
+      return;
+   }
+
+   // Compute the deformation fields
+   this->GetDeformationField();
+
+   // Resample the floating image and compute the gradient of its first time point
+   reg_resampleImageAndGradient_spans(this->currentFloating,
+                                      this->warped,
+                                      this->warImgGradient,
+                                      this->deformationFieldImage,
+                                      this->currentMaskSpans,
+                                      inter,
+                                      this->warpedPaddingValue,
+                                      0);
+
+   // Resample the reference image and compute the gradient of its first time point
+   reg_resampleImageAndGradient_spans(this->currentReference,
+                                      this->backwardWarped,
+                                      this->backwardWarpedGradientImage,
+                                      this->backwardDeformationFieldImage,
+                                      this->currentFloatingMaskSpans,
+                                      inter,
+                                      this->warpedPaddingValue,
+                                      0);
+   this->warImgGradientUpToDate=true;
+#ifndef NDEBUG
+   reg_print_fct_debug("reg_f3d_sym<T>::WarpFloatingImageAndGradient");
+#endif
+   return;
+}
+/* *************************************************************** */
 /* *************************************************************** */
 template <class T>
 double reg_f3d_sym<T>::ComputeJacobianBasedPenaltyTerm(int type)
@@ -829,21 +965,27 @@ void reg_f3d_sym<T>::GetVoxelBasedGradient()
 
 
    for(int t=0; t<this->currentReference->nt; ++t){
-      reg_getImageGradient(this->currentFloating,
-                           this->warImgGradient,
-                           this->deformationFieldImage,
-                           this->currentMask,
-                           this->interpolation,
-                           this->warpedPaddingValue,
-                           t);
-
-      reg_getImageGradient(this->currentReference,
-                           this->backwardWarpedGradientImage,
-                           this->backwardDeformationFieldImage,
-                           this->currentFloatingMask,
-                           this->interpolation,
-                           this->warpedPaddingValue,
-                           t);
+      // The gradients of the first time point might already have been computed
+      // together with the warped images
+      if(t>0 || !this->warImgGradientUpToDate)
+      {
+         reg_getImageGradient_spans(this->currentFloating,
+                                    this->warImgGradient,
+                                    this->deformationFieldImage,
+                                    this->currentMaskSpans,
+                                    this->interpolation,
+                                    this->warpedPaddingValue,
+                                    t);
+
+         reg_getImageGradient_spans(this->currentReference,
+                                    this->backwardWarpedGradientImage,
+                                    this->backwardDeformationFieldImage,
+                                    this->currentFloatingMaskSpans,
+                                    this->interpolation,
+                                    this->warpedPaddingValue,
+                                    t);
+      }
+      this->warImgGradientUpToDate=false;
 
       // The gradient of the various measures of similarity are computed
       if(this->measure_nmi!=NULL)
@@ -877,54 +1019,17 @@ void reg_f3d_sym<T>::GetSimilarityMeasureGradient()
 {
    reg_f3d<T>::GetSimilarityMeasureGradient();
 
-   // The voxel based sim measure gradient is convolved with a spline kernel
-   // Convolution along the x axis
-   float currentNodeSpacing[3];
-   currentNodeSpacing[0]=currentNodeSpacing[1]=currentNodeSpacing[2]=this->backwardControlPointGrid->dx;
-   bool activeAxis[3]= {1,0,0};
-   reg_tools_kernelConvolution(this->backwardVoxelBasedMeasureGradientImage,
-                               currentNodeSpacing,
-                               CUBIC_SPLINE_KERNEL, // cubic spline kernel
-                               NULL, // mask
-                               NULL, // all volumes are active
-                               activeAxis
-                               );
-   // Convolution along the y axis
-   currentNodeSpacing[0]=currentNodeSpacing[1]=currentNodeSpacing[2]=this->backwardControlPointGrid->dy;
-   activeAxis[0]=0;
-   activeAxis[1]=1;
-   reg_tools_kernelConvolution(this->backwardVoxelBasedMeasureGradientImage,
-                               currentNodeSpacing,
-                               CUBIC_SPLINE_KERNEL, // cubic spline kernel
-                               NULL, // mask
-                               NULL, // all volumes are active
-                               activeAxis
-                               );
-   // Convolution along the z axis if required
-   if(this->voxelBasedMeasureGradient->nz>1)
-   {
-      currentNodeSpacing[0]=currentNodeSpacing[1]=currentNodeSpacing[2]=this->backwardControlPointGrid->dz;
-      activeAxis[1]=0;
-      activeAxis[2]=1;
-      reg_tools_kernelConvolution(this->backwardVoxelBasedMeasureGradientImage,
-                                  currentNodeSpacing,
-                                  CUBIC_SPLINE_KERNEL, // cubic spline kernel
-                                  NULL, // mask
-                                  NULL, // all volumes are active
-                                  activeAxis
-                                  );
-   }
    // The backward node based sim measure gradient is extracted
    mat44 reorientation;
    if(this->currentReference->sform_code>0)
       reorientation = this->currentReference->sto_ijk;
    else reorientation = this->currentReference->qto_ijk;
-   reg_voxelCentric2NodeCentric(this->backwardTransformationGradient,
-                                this->backwardVoxelBasedMeasureGradientImage,
-                                this->similarityWeight,
-                                false, // no update
-                                &reorientation // voxel to mm conversion
-                                );
+   reg_spline_voxelCentric2NodeCentric(this->backwardTransformationGradient,
+                                       this->backwardVoxelBasedMeasureGradientImage,
+                                       this->similarityWeight,
+                                       false, // no update
+                                       &reorientation // voxel to mm conversion
+                                       );
 #ifndef NDEBUG
    reg_print_fct_debug("reg_f3d_sym<T>::GetSimilarityMeasureGradient");
 #endif
@@ -1142,7 +1247,7 @@ void reg_f3d_sym<T>::GetObjectiveFunctionGradient()
       // Compute the gradient of the similarity measure
       if(this->similarityWeight>0)
       {
-         this->WarpFloatingImage(this->interpolation);
+         this->WarpFloatingImageAndGradient(this->interpolation);
          this->GetSimilarityMeasureGradient();
       }
       else
@@ -1304,7 +1409,12 @@ double reg_f3d_sym<T>::GetInverseConsistencyPenaltyTerm()
          }
       }
    }
-   double error = ferror/double(this->activeVoxelNumber[this->currentLevel])
+   // The errors are averaged over the sampled voxels when sampling is used
+   double error;
+   if(this->currentSampledMask!=NULL)
+      error = ferror/double(this->sampledVoxelNumber)
+            + berror/double(this->backwardSampledVoxelNumber);
+   else error = ferror/double(this->activeVoxelNumber[this->currentLevel])
          + berror / (double)(this->backwardActiveVoxelNumber[this->currentLevel]);
 #ifndef NDEBUG
    reg_print_fct_debug("reg_f3d_sym<T>::GetInverseConsistencyPenaltyTerm");
@@ -1652,6 +1762,7 @@ void reg_f3d_sym<T>::InitialiseSimilarity()
          this->measure_nmi->SetTimepointWeight(i,1.0);
    }
    if(this->measure_nmi!=NULL)
+   {
       this->measure_nmi->InitialiseMeasure(this->currentReference,
                                            this->currentFloating,
                                            this->currentMask,
@@ -1664,8 +1775,12 @@ void reg_f3d_sym<T>::InitialiseSimilarity()
                                            this->backwardWarpedGradientImage,
                                            this->backwardVoxelBasedMeasureGradientImage
                                            );
+      this->measure_nmi->SetMaskSpans(this->currentMaskSpans,
+                                     this->currentFloatingMaskSpans);
+   }
 
    if(this->measure_ssd!=NULL)
+   {
       this->measure_ssd->InitialiseMeasure(this->currentReference,
                                            this->currentFloating,
                                            this->currentMask,
@@ -1678,8 +1793,12 @@ void reg_f3d_sym<T>::InitialiseSimilarity()
                                            this->backwardWarpedGradientImage,
                                            this->backwardVoxelBasedMeasureGradientImage
                                            );
+      this->measure_ssd->SetMaskSpans(this->currentMaskSpans,
+                                     this->currentFloatingMaskSpans);
+   }
 
    if(this->measure_kld!=NULL)
+   {
       this->measure_kld->InitialiseMeasure(this->currentReference,
                                            this->currentFloating,
                                            this->currentMask,
@@ -1692,6 +1811,9 @@ void reg_f3d_sym<T>::InitialiseSimilarity()
                                            this->backwardWarpedGradientImage,
                                            this->backwardVoxelBasedMeasureGradientImage
                                            );
+      this->measure_kld->SetMaskSpans(this->currentMaskSpans,
+                                      this->currentFloatingMaskSpans);
+   }
 
    if(this->measure_lncc!=NULL)
       this->measure_lncc->InitialiseMeasure(this->currentReference,
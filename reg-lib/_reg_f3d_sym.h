@@ -26,6 +26,10 @@ protected:
    nifti_image *floatingMaskImage;
    int **floatingMaskPyramid;
    int *currentFloatingMask;
+   reg_maskSpans *currentFloatingMaskSpans;
+   int *currentFullFloatingMask; // pointer to the floating mask pyramid
+   int *currentSampledFloatingMask;
+   size_t backwardSampledVoxelNumber;
    int *backwardActiveVoxelNumber;
 
    nifti_image *backwardControlPointGrid;
@@ -57,6 +61,9 @@ protected:
    virtual void ClearTransformationGradient();
    virtual T InitialiseCurrentLevel();
    virtual void ClearCurrentInputImage();
+   virtual void InitialiseVoxelSampling();
+   virtual void DrawVoxelSample();
+   virtual void ClearVoxelSampling();
 
    virtual double ComputeBendingEnergyPenaltyTerm();
    virtual double ComputeLinearEnergyPenaltyTerm();
@@ -64,6 +71,7 @@ protected:
    virtual double ComputeLandmarkDistancePenaltyTerm();
    virtual void GetDeformationField();
    virtual void WarpFloatingImage(int);
+   virtual void WarpFloatingImageAndGradient(int);
    virtual void GetVoxelBasedGradient();
    virtual void GetSimilarityMeasureGradient();
    virtual void GetObjectiveFunctionGradient();
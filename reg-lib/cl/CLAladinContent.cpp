@@ -99,6 +99,10 @@ void ClAladinContent::initVars()
 		if (this->CurrentWarped != NULL)
 			reg_tools_changeDatatype<float>(this->CurrentWarped);
 	}
+	// The device kernels always rely on a deformation field
+	if (this->CurrentReference != NULL && this->CurrentDeformationField == NULL)
+		this->AllocateDeformationField(this->bytes);
+
 	this->sContext = &CLContextSingletton::Instance();
 	this->clContext = this->sContext->getContext();
 	this->commandQueue = this->sContext->getCommandQueue();
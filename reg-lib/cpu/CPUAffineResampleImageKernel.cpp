@@ -0,0 +1,20 @@
+#include "CPUAffineResampleImageKernel.h"
+#include "_reg_resampling.h"
+
+CPUAffineResampleImageKernel::CPUAffineResampleImageKernel(AladinContent *con, std::string name) : AffineResampleImageKernel( name) {
+   floatingImage = con->getCurrentFloating();
+   warpedImage = con->getCurrentWarped();
+   affineTransformation = con->getTransformationMatrix();
+   maskSpans = con->getCurrentReferenceMaskSpans();
+}
+
+void CPUAffineResampleImageKernel::calculate(int interp,
+                                             float paddingValue)
+{
+   reg_resampleImage_affine_spans(this->floatingImage,
+                                  this->warpedImage,
+                                  this->affineTransformation,
+                                  this->maskSpans,
+                                  interp,
+                                  paddingValue);
+}
@@ -0,0 +1,20 @@
+#ifndef CPUAFFINERESAMPLEIMAGEKERNEL_H
+#define CPUAFFINERESAMPLEIMAGEKERNEL_H
+
+#include "AffineResampleImageKernel.h"
+#include "AladinContent.h"
+
+class CPUAffineResampleImageKernel : public AffineResampleImageKernel
+{
+    public:
+        CPUAffineResampleImageKernel(AladinContent *con, std::string name);
+
+        nifti_image *floatingImage;
+        nifti_image *warpedImage;
+        mat44 *affineTransformation;
+        const reg_maskSpans *maskSpans;
+
+        void calculate(int interp, float paddingValue);
+};
+
+#endif // CPUAFFINERESAMPLEIMAGEKERNEL_H
@@ -1,5 +1,6 @@
 #include "CPUKernelFactory.h"
 #include "CPUAffineDeformationFieldKernel.h"
+#include "CPUAffineResampleImageKernel.h"
 #include "CPUConvolutionKernel.h"
 #include "CPUBlockMatchingKernel.h"
 #include "CPUResampleImageKernel.h"
@@ -13,6 +14,7 @@ Kernel *CPUKernelFactory::produceKernel(std::string name,  AladinContent *con) c
 	else if (name == ConvolutionKernel::getName()) return new CPUConvolutionKernel(name);
 	else if (name == BlockMatchingKernel::getName()) return new CPUBlockMatchingKernel(con, name);
 	else if (name == ResampleImageKernel::getName()) return new CPUResampleImageKernel(con, name);
+	else if (name == AffineResampleImageKernel::getName()) return new CPUAffineResampleImageKernel(con, name);
 	else if (name == OptimiseKernel::getName()) return new CPUOptimiseKernel(con, name);
 	else return NULL;
 }
@@ -6,6 +6,7 @@ CPUResampleImageKernel::CPUResampleImageKernel(AladinContent *con, std::string n
    warpedImage = con->getCurrentWarped();
    deformationField = con->getCurrentDeformationField();
    mask = con->getCurrentReferenceMask();
+   maskSpans = con->getCurrentReferenceMaskSpans();
 }
 
 void CPUResampleImageKernel::calculate(int interp,
@@ -13,6 +14,16 @@ void CPUResampleImageKernel::calculate(int interp,
                                        bool *dti_timepoint,
                                        mat33 * jacMat)
 {
+   // The mask spans can be used unless the tensors have to be reoriented
+   if (dti_timepoint == NULL && jacMat == NULL) {
+      reg_resampleImage_spans(this->floatingImage,
+                              this->warpedImage,
+                              this->deformationField,
+                              this->maskSpans,
+                              interp,
+                              paddingValue);
+      return;
+   }
    reg_resampleImage(this->floatingImage,
                      this->warpedImage,
                      this->deformationField,
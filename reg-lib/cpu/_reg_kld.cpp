@@ -86,26 +86,29 @@ double reg_getKLDivergence(nifti_image *referenceImage,
                            nifti_image *warpedImage,
                            double *timePointWeight,
                            nifti_image *jacobianDetImg,
-                           int *mask)
+                           int *mask,
+                           const reg_maskSpans *maskSpans)
 {
 #ifdef _WIN32
-   long voxel;
+   long voxel, line;
    long voxelNumber = (long)referenceImage->nx*referenceImage->ny*referenceImage->nz;
+   long lineNumber = (long)referenceImage->ny*referenceImage->nz;
 #else
-   size_t voxel;
+   size_t voxel, line;
    size_t voxelNumber = (size_t)referenceImage->nx*referenceImage->ny*referenceImage->nz;
+   size_t lineNumber = (size_t)referenceImage->ny*referenceImage->nz;
 #endif
+   size_t span;
+   // Only the active spans are visited. They are built from the mask array if not provided
+   reg_maskSpans *temporarySpans=NULL;
+   if(maskSpans==NULL)
+   {
+      int dim[3]={referenceImage->nx, referenceImage->ny, referenceImage->nz};
+      maskSpans=temporarySpans=reg_tools_createMaskSpans(mask, dim);
+   }
 
    DTYPE *refPtr=static_cast<DTYPE *>(referenceImage->data);
    DTYPE *warPtr=static_cast<DTYPE *>(warpedImage->data);
-   int *maskPtr=NULL;
-   bool MrClean=false;
-   if(mask==NULL)
-   {
-      maskPtr=(int *)calloc(voxelNumber,sizeof(int));
-      MrClean=true;
-   }
-   else maskPtr = &mask[0];
 
    DTYPE *jacPtr=NULL;
    if(jacobianDetImg!=NULL)
@@ -120,31 +123,35 @@ double reg_getKLDivergence(nifti_image *referenceImage,
          DTYPE *currentWarPtr=&warPtr[time*voxelNumber];
 #if defined (_OPENMP)
 #pragma omp parallel for default(none) \
-   shared(voxelNumber,currentRefPtr, currentWarPtr, \
-   maskPtr, jacobianDetImg, jacPtr) \
-   private(voxel, tempRefValue, tempWarValue, tempValue) \
+   shared(lineNumber, referenceImage, currentRefPtr, currentWarPtr, \
+   maskSpans, jacobianDetImg, jacPtr) \
+   private(voxel, line, span, tempRefValue, tempWarValue, tempValue) \
    reduction(+:measure_tp) \
    reduction(+:num)
 #endif
-         for(voxel=0; voxel<voxelNumber; ++voxel)
+         for(line=0; line<lineNumber; ++line)
          {
-            if(maskPtr[voxel]>-1)
+            for(span=maskSpans->lineSpan[line]; span<maskSpans->lineSpan[line+1]; ++span)
             {
-               tempRefValue = currentRefPtr[voxel]+1e-16;
-               tempWarValue = currentWarPtr[voxel]+1e-16;
-               tempValue=tempRefValue*log(tempRefValue/tempWarValue);
-               if(tempValue==tempValue &&
-                     tempValue!=std::numeric_limits<double>::infinity())
+               for(voxel=line*referenceImage->nx+maskSpans->spanStart[span];
+                   voxel<line*referenceImage->nx+maskSpans->spanEnd[span]; ++voxel)
                {
-                  if(jacobianDetImg==NULL)
-                  {
-                     measure_tp -= tempValue;
-                     num++;
-                  }
-                  else
+                  tempRefValue = currentRefPtr[voxel]+1e-16;
+                  tempWarValue = currentWarPtr[voxel]+1e-16;
+                  tempValue=tempRefValue*log(tempRefValue/tempWarValue);
+                  if(tempValue==tempValue &&
+                        tempValue!=std::numeric_limits<double>::infinity())
                   {
-                     measure_tp -= tempValue * jacPtr[voxel];
-                     num+=jacPtr[voxel];
+                     if(jacobianDetImg==NULL)
+                     {
+                        measure_tp -= tempValue;
+                        num++;
+                     }
+                     else
+                     {
+                        measure_tp -= tempValue * jacPtr[voxel];
+                        num+=jacPtr[voxel];
+                     }
                   }
                }
             }
@@ -152,13 +159,13 @@ double reg_getKLDivergence(nifti_image *referenceImage,
        measure += measure_tp * timePointWeight[time] / num;
       }
    }
-   if(MrClean==true) free(maskPtr);
+   reg_tools_freeMaskSpans(temporarySpans);
    return measure;
 }
 template double reg_getKLDivergence<float>
-(nifti_image *,nifti_image *,double *,nifti_image *,int *);
+(nifti_image *,nifti_image *,double *,nifti_image *,int *, const reg_maskSpans *);
 template double reg_getKLDivergence<double>
-(nifti_image *,nifti_image *,double *,nifti_image *,int *);
+(nifti_image *,nifti_image *,double *,nifti_image *,int *, const reg_maskSpans *);
 /* *************************************************************** */
 double reg_kld::GetSimilarityMeasureValue()
 {
@@ -178,7 +185,8 @@ double reg_kld::GetSimilarityMeasureValue()
              this->warpedFloatingImagePointer,
              this->timePointWeight,
              NULL, // HERE TODO this->forwardJacDetImagePointer,
-             this->referenceMaskPointer
+             this->referenceMaskPointer,
+             this->referenceMaskSpans
              );
       break;
    case NIFTI_TYPE_FLOAT64:
@@ -187,7 +195,8 @@ double reg_kld::GetSimilarityMeasureValue()
              this->warpedFloatingImagePointer,
              this->timePointWeight,
              NULL, // HERE TODO this->forwardJacDetImagePointer,
-             this->referenceMaskPointer
+             this->referenceMaskPointer,
+             this->referenceMaskSpans
              );
       break;
    default:
@@ -214,7 +223,8 @@ double reg_kld::GetSimilarityMeasureValue()
                 this->warpedReferenceImagePointer,
                 this->timePointWeight,
                 NULL, // HERE TODO this->backwardJacDetImagePointer,
-                this->floatingMaskPointer
+                this->floatingMaskPointer,
+                this->floatingMaskSpans
                 );
          break;
       case NIFTI_TYPE_FLOAT64:
@@ -223,7 +233,8 @@ double reg_kld::GetSimilarityMeasureValue()
                 this->warpedReferenceImagePointer,
                 this->timePointWeight,
                 NULL, // HERE TODO this->backwardJacDetImagePointer,
-                this->floatingMaskPointer
+                this->floatingMaskPointer,
+                this->floatingMaskSpans
                 );
          break;
       default:
@@ -244,28 +255,31 @@ void reg_getKLDivergenceVoxelBasedGradient(nifti_image *referenceImage,
                                            nifti_image *jacobianDetImg,
                                            int *mask,
                                            int current_timepoint,
-                                 double timepoint_weight)
+                                 double timepoint_weight,
+                                           const reg_maskSpans *maskSpans)
 {
 #ifdef _WIN32
-   long voxel;
+   long voxel, line;
    long voxelNumber = (long)referenceImage->nx*referenceImage->ny*referenceImage->nz;
+   long lineNumber = (long)referenceImage->ny*referenceImage->nz;
 #else
-   size_t  voxel;
+   size_t  voxel, line;
    size_t voxelNumber = (size_t)referenceImage->nx*referenceImage->ny*referenceImage->nz;
+   size_t lineNumber = (size_t)referenceImage->ny*referenceImage->nz;
 #endif
+   size_t span;
+   // Only the active spans are visited. They are built from the mask array if not provided
+   reg_maskSpans *temporarySpans=NULL;
+   if(maskSpans==NULL)
+   {
+      int dim[3]={referenceImage->nx, referenceImage->ny, referenceImage->nz};
+      maskSpans=temporarySpans=reg_tools_createMaskSpans(mask, dim);
+   }
 
    DTYPE *refImagePtr=static_cast<DTYPE *>(referenceImage->data);
    DTYPE *warImagePtr=static_cast<DTYPE *>(warpedImage->data);
    DTYPE *currentRefPtr = &refImagePtr[current_timepoint*voxelNumber];
    DTYPE *currentWarPtr = &warImagePtr[current_timepoint*voxelNumber];
-   int *maskPtr=NULL;
-   bool MrClean=false;
-   if(mask==NULL)
-   {
-      maskPtr=(int *)calloc(voxelNumber,sizeof(int));
-      MrClean=true;
-   }
-   else maskPtr = &mask[0];
 
    DTYPE *jacPtr=NULL;
    if(jacobianDetImg!=NULL)
@@ -288,76 +302,168 @@ void reg_getKLDivergenceVoxelBasedGradient(nifti_image *referenceImage,
 
    // find number of active voxels and correct weight
    double activeVoxel_num = 0.0;
-   for (voxel = 0; voxel < voxelNumber; voxel++)
+   for(line=0; line<lineNumber; ++line)
    {
-      if (mask[voxel]>-1)
+      for(span=maskSpans->lineSpan[line]; span<maskSpans->lineSpan[line+1]; ++span)
       {
-         if (currentRefPtr[voxel] == currentRefPtr[voxel] && currentWarPtr[voxel] == currentWarPtr[voxel])
-            activeVoxel_num += 1.0;
+         for(voxel=line*referenceImage->nx+maskSpans->spanStart[span];
+             voxel<line*referenceImage->nx+maskSpans->spanEnd[span]; ++voxel)
+         {
+            if (currentRefPtr[voxel] == currentRefPtr[voxel] && currentWarPtr[voxel] == currentWarPtr[voxel])
+               activeVoxel_num += 1.0;
+         }
       }
    }
    double adjusted_weight = timepoint_weight / activeVoxel_num;
 
 #if defined (_OPENMP)
 #pragma omp parallel for default(none) \
-   shared(voxelNumber,currentRefPtr, currentWarPtr, \
-   maskPtr, jacobianDetImg, jacPtr, referenceImage, \
+   shared(lineNumber, voxelNumber,currentRefPtr, currentWarPtr, \
+   maskSpans, jacobianDetImg, jacPtr, referenceImage, \
    measureGradPtrX, measureGradPtrY, measureGradPtrZ, \
    currentGradPtrX, currentGradPtrY, currentGradPtrZ, adjusted_weight) \
-   private(voxel, tempValue, tempGradX, tempGradY, tempGradZ, \
+   private(voxel, line, span, tempValue, tempGradX, tempGradY, tempGradZ, \
    tempRefValue, tempWarValue)
 #endif
-   for(voxel=0; voxel<voxelNumber; ++voxel)
+   for(line=0; line<lineNumber; ++line)
    {
-      // Check if the current voxel is in the mask
-      if(maskPtr[voxel]>-1)
+      for(span=maskSpans->lineSpan[line]; span<maskSpans->lineSpan[line+1]; ++span)
       {
-         // Read referenceImage and warpedImage probabilities and compute the ratio
-         tempRefValue = currentRefPtr[voxel]+1e-16;
-         tempWarValue = currentWarPtr[voxel]+1e-16;
-         tempValue=(currentRefPtr[voxel]+1e-16)/(currentWarPtr[voxel]+1e-16);
-         // Check if the intensity ratio is defined and different from zero
-         if(tempValue==tempValue &&
-               tempValue!=std::numeric_limits<double>::infinity() &&
-               tempValue>0)
+         for(voxel=line*referenceImage->nx+maskSpans->spanStart[span];
+             voxel<line*referenceImage->nx+maskSpans->spanEnd[span]; ++voxel)
          {
-            tempValue = tempRefValue / tempWarValue;
-            tempValue *= adjusted_weight;
+            // Read referenceImage and warpedImage probabilities and compute the ratio
+            tempRefValue = currentRefPtr[voxel]+1e-16;
+            tempWarValue = currentWarPtr[voxel]+1e-16;
+            tempValue=(currentRefPtr[voxel]+1e-16)/(currentWarPtr[voxel]+1e-16);
+            // Check if the intensity ratio is defined and different from zero
+            if(tempValue==tempValue &&
+                  tempValue!=std::numeric_limits<double>::infinity() &&
+                  tempValue>0)
+            {
+               tempValue = tempRefValue / tempWarValue;
+               tempValue *= adjusted_weight;
 
-            // Jacobian modulation if the Jacobian determinant image is defined
-            if(jacobianDetImg!=NULL)
-               tempValue *= jacPtr[voxel];
+               // Jacobian modulation if the Jacobian determinant image is defined
+               if(jacobianDetImg!=NULL)
+                  tempValue *= jacPtr[voxel];
 
-            // Ensure that gradient of the warpedImage image along x-axis is not NaN
-            tempGradX=currentGradPtrX[voxel];
-            if(tempGradX==tempGradX)
-               // Update the gradient along the x-axis
-               measureGradPtrX[voxel] -= (DTYPE)(tempValue * tempGradX);
+               // Ensure that gradient of the warpedImage image along x-axis is not NaN
+               tempGradX=currentGradPtrX[voxel];
+               if(tempGradX==tempGradX)
+                  // Update the gradient along the x-axis
+                  measureGradPtrX[voxel] -= (DTYPE)(tempValue * tempGradX);
 
-            // Ensure that gradient of the warpedImage image along y-axis is not NaN
-            tempGradY=currentGradPtrY[voxel];
-            if(tempGradY==tempGradY)
-               // Update the gradient along the y-axis
-               measureGradPtrY[voxel] -= (DTYPE)(tempValue * tempGradY);
+               // Ensure that gradient of the warpedImage image along y-axis is not NaN
+               tempGradY=currentGradPtrY[voxel];
+               if(tempGradY==tempGradY)
+                  // Update the gradient along the y-axis
+                  measureGradPtrY[voxel] -= (DTYPE)(tempValue * tempGradY);
 
-            // Check if the current images are 3D
-            if(referenceImage->nz>1)
-            {
-               // Ensure that gradient of the warpedImage image along z-axis is not NaN
-               tempGradZ=currentGradPtrZ[voxel];
-               if(tempGradZ==tempGradZ)
-                  // Update the gradient along the z-axis
-                  measureGradPtrZ[voxel] -= (DTYPE)(tempValue * tempGradZ);
+               // Check if the current images are 3D
+               if(referenceImage->nz>1)
+               {
+                  // Ensure that gradient of the warpedImage image along z-axis is not NaN
+                  tempGradZ=currentGradPtrZ[voxel];
+                  if(tempGradZ==tempGradZ)
+                     // Update the gradient along the z-axis
+                     measureGradPtrZ[voxel] -= (DTYPE)(tempValue * tempGradZ);
+               }
             }
          }
       }
    }
-   if(MrClean==true) free(maskPtr);
+   reg_tools_freeMaskSpans(temporarySpans);
 }
 template void reg_getKLDivergenceVoxelBasedGradient<float>
-(nifti_image *,nifti_image *,nifti_image *,nifti_image *,nifti_image *, int *, int, double);
+(nifti_image *,nifti_image *,nifti_image *,nifti_image *,nifti_image *, int *, int, double, const reg_maskSpans *);
 template void reg_getKLDivergenceVoxelBasedGradient<double>
-(nifti_image *,nifti_image *,nifti_image *,nifti_image *,nifti_image *, int *, int, double);
+(nifti_image *,nifti_image *,nifti_image *,nifti_image *,nifti_image *, int *, int, double, const reg_maskSpans *);
+/* *************************************************************** */
+template <class DTYPE>
+void reg_getKLDivergenceVoxelBasedDerivative(nifti_image *referenceImage,
+                                             nifti_image *warpedImage,
+                                             nifti_image *derivativeImage,
+                                             int *mask,
+                                             int current_timepoint,
+                                             double timepoint_weight,
+                                             const reg_maskSpans *maskSpans)
+{
+#ifdef _WIN32
+   long voxel, line;
+   long voxelNumber = (long)referenceImage->nx*referenceImage->ny*referenceImage->nz;
+   long lineNumber = (long)referenceImage->ny*referenceImage->nz;
+#else
+   size_t  voxel, line;
+   size_t voxelNumber = (size_t)referenceImage->nx*referenceImage->ny*referenceImage->nz;
+   size_t lineNumber = (size_t)referenceImage->ny*referenceImage->nz;
+#endif
+   size_t span;
+   // Only the active spans are visited. They are built from the mask array if not provided
+   reg_maskSpans *temporarySpans=NULL;
+   if(maskSpans==NULL)
+   {
+      int dim[3]={referenceImage->nx, referenceImage->ny, referenceImage->nz};
+      maskSpans=temporarySpans=reg_tools_createMaskSpans(mask, dim);
+   }
+
+   DTYPE *refImagePtr=static_cast<DTYPE *>(referenceImage->data);
+   DTYPE *warImagePtr=static_cast<DTYPE *>(warpedImage->data);
+   DTYPE *currentRefPtr = &refImagePtr[current_timepoint*voxelNumber];
+   DTYPE *currentWarPtr = &warImagePtr[current_timepoint*voxelNumber];
+   DTYPE *derivativePtr = static_cast<DTYPE *>(derivativeImage->data);
+   double tempValue, tempRefValue, tempWarValue;
+
+   // find number of active voxels and correct weight
+   double activeVoxel_num = 0.0;
+   for(line=0; line<lineNumber; ++line)
+   {
+      for(span=maskSpans->lineSpan[line]; span<maskSpans->lineSpan[line+1]; ++span)
+      {
+         for(voxel=line*referenceImage->nx+maskSpans->spanStart[span];
+             voxel<line*referenceImage->nx+maskSpans->spanEnd[span]; ++voxel)
+         {
+            if (currentRefPtr[voxel] == currentRefPtr[voxel] && currentWarPtr[voxel] == currentWarPtr[voxel])
+               activeVoxel_num += 1.0;
+         }
+      }
+   }
+   double adjusted_weight = timepoint_weight / activeVoxel_num;
+
+#if defined (_OPENMP)
+#pragma omp parallel for default(none) \
+   shared(lineNumber, referenceImage, currentRefPtr, currentWarPtr, \
+   maskSpans, derivativePtr, adjusted_weight) \
+   private(voxel, line, span, tempValue, tempRefValue, tempWarValue)
+#endif
+   for(line=0; line<lineNumber; ++line)
+   {
+      for(span=maskSpans->lineSpan[line]; span<maskSpans->lineSpan[line+1]; ++span)
+      {
+         for(voxel=line*referenceImage->nx+maskSpans->spanStart[span];
+             voxel<line*referenceImage->nx+maskSpans->spanEnd[span]; ++voxel)
+         {
+            // Read referenceImage and warpedImage probabilities and compute the ratio
+            tempRefValue = currentRefPtr[voxel]+1e-16;
+            tempWarValue = currentWarPtr[voxel]+1e-16;
+            tempValue=(currentRefPtr[voxel]+1e-16)/(currentWarPtr[voxel]+1e-16);
+            // Check if the intensity ratio is defined and different from zero
+            if(tempValue==tempValue &&
+                  tempValue!=std::numeric_limits<double>::infinity() &&
+                  tempValue>0)
+            {
+               tempValue = tempRefValue / tempWarValue;
+               derivativePtr[voxel] -= (DTYPE)(tempValue * adjusted_weight);
+            }
+         }
+      }
+   }
+   reg_tools_freeMaskSpans(temporarySpans);
+}
+template void reg_getKLDivergenceVoxelBasedDerivative<float>
+(nifti_image *,nifti_image *,nifti_image *, int *, int, double, const reg_maskSpans *);
+template void reg_getKLDivergenceVoxelBasedDerivative<double>
+(nifti_image *,nifti_image *,nifti_image *, int *, int, double, const reg_maskSpans *);
 /* *************************************************************** */
 void reg_kld::GetVoxelBasedSimilarityMeasureGradient(int current_timepoint)
 {
@@ -389,7 +495,8 @@ void reg_kld::GetVoxelBasedSimilarityMeasureGradient(int current_timepoint)
              NULL, // HERE TODO this->forwardJacDetImagePointer,
              this->referenceMaskPointer,
              current_timepoint,
-          this->timePointWeight[current_timepoint]
+          this->timePointWeight[current_timepoint],
+             this->referenceMaskSpans
              );
       break;
    case NIFTI_TYPE_FLOAT64:
@@ -401,7 +508,8 @@ void reg_kld::GetVoxelBasedSimilarityMeasureGradient(int current_timepoint)
              NULL, // HERE TODO this->forwardJacDetImagePointer,
              this->referenceMaskPointer,
           current_timepoint,
-          this->timePointWeight[current_timepoint]
+          this->timePointWeight[current_timepoint],
+             this->referenceMaskSpans
              );
       break;
    default:
@@ -434,7 +542,8 @@ void reg_kld::GetVoxelBasedSimilarityMeasureGradient(int current_timepoint)
                 NULL, // HERE TODO this->backwardJacDetImagePointer,
                 this->floatingMaskPointer,
             current_timepoint,
-            this->timePointWeight[current_timepoint]
+            this->timePointWeight[current_timepoint],
+                this->floatingMaskSpans
                 );
          break;
       case NIFTI_TYPE_FLOAT64:
@@ -446,7 +555,8 @@ void reg_kld::GetVoxelBasedSimilarityMeasureGradient(int current_timepoint)
                 NULL, // HERE TODO this->backwardJacDetImagePointer,
                 this->floatingMaskPointer,
             current_timepoint,
-            this->timePointWeight[current_timepoint]
+            this->timePointWeight[current_timepoint],
+                this->floatingMaskSpans
                 );
          break;
       default:
@@ -458,3 +568,56 @@ void reg_kld::GetVoxelBasedSimilarityMeasureGradient(int current_timepoint)
 }
 /* *************************************************************** */
 /* *************************************************************** */
+bool reg_kld::AddVoxelBasedSimilarityMeasureDerivative(int current_timepoint,
+                                                       nifti_image *derivativeImage)
+{
+   // Check if the specified time point exists and is active
+   reg_measure::GetVoxelBasedSimilarityMeasureGradient(current_timepoint);
+   if(this->timePointWeight[current_timepoint]==0.0)
+      return true;
+   // The backward gradient is only computed by GetVoxelBasedSimilarityMeasureGradient
+   if(this->isSymmetric)
+      return false;
+
+   // Check if all required input images are of the same data type
+   int dtype = this->referenceImagePointer->datatype;
+   if(this->warpedFloatingImagePointer->datatype != dtype ||
+         derivativeImage->datatype != dtype)
+   {
+      reg_print_fct_error("reg_kld::AddVoxelBasedSimilarityMeasureDerivative");
+      reg_print_msg_error("Input images are exepected to be of the same type");
+      reg_exit();
+   }
+   switch(dtype)
+   {
+   case NIFTI_TYPE_FLOAT32:
+      reg_getKLDivergenceVoxelBasedDerivative<float>
+            (this->referenceImagePointer,
+             this->warpedFloatingImagePointer,
+             derivativeImage,
+             this->referenceMaskPointer,
+             current_timepoint,
+             this->timePointWeight[current_timepoint],
+             this->referenceMaskSpans
+             );
+      break;
+   case NIFTI_TYPE_FLOAT64:
+      reg_getKLDivergenceVoxelBasedDerivative<double>
+            (this->referenceImagePointer,
+             this->warpedFloatingImagePointer,
+             derivativeImage,
+             this->referenceMaskPointer,
+             current_timepoint,
+             this->timePointWeight[current_timepoint],
+             this->referenceMaskSpans
+             );
+      break;
+   default:
+      reg_print_fct_error("reg_kld::AddVoxelBasedSimilarityMeasureDerivative");
+      reg_print_msg_error("Unsupported datatype");
+      reg_exit();
+   }
+   return true;
+}
+/* *************************************************************** */
+/* *************************************************************** */
@@ -37,6 +37,9 @@ public:
    virtual double GetSimilarityMeasureValue();
    /// @brief Compute the voxel based kld gradient
    virtual void GetVoxelBasedSimilarityMeasureGradient(int current_timepoint);
+   /// @brief Add the kld derivative with respect to the warped intensities
+   virtual bool AddVoxelBasedSimilarityMeasureDerivative(int current_timepoint,
+                                                         nifti_image *derivativeImage);
    /// @brief reg_kld class destructor
    ~reg_kld() {}
 };
@@ -52,6 +55,8 @@ public:
  * pointer is set to NULL
  * @param mask Array that contains a mask to specify which voxel
  * should be considered. If set to NULL, all voxels are considered
+ * @param maskSpans Active voxels of the mask stored as spans. They are
+ * built from the mask array if set to NULL
  * @return Returns the computed sum squared difference
  */
 extern "C++" template <class DTYPE>
@@ -59,7 +64,8 @@ double reg_getKLDivergence(nifti_image *reference,
                            nifti_image *warped,
                            double *timePointWeight,
                            nifti_image *jacobianDeterminantImage,
-                           int *mask);
+                           int *mask,
+                           const reg_maskSpans *maskSpans = NULL);
 /* *************************************************************** */
 
 /** @brief Compute a voxel based gradient of the sum squared difference.
@@ -75,6 +81,8 @@ double reg_getKLDivergence(nifti_image *reference,
  * pointer is set to NULL
  * @param mask Array that contains a mask to specify which voxel
  * should be considered. If set to NULL, all voxels are considered
+ * @param maskSpans Active voxels of the mask stored as spans. They are
+ * built from the mask array if set to NULL
  */
 extern "C++" template <class DTYPE>
 void reg_getKLDivergenceVoxelBasedGradient(nifti_image *reference,
@@ -84,7 +92,29 @@ void reg_getKLDivergenceVoxelBasedGradient(nifti_image *reference,
                                            nifti_image *jacobianDeterminantImage,
                                            int *mask,
                                            int current_timepoint,
-                                 double timepoint_weight);
+                                 double timepoint_weight,
+                                           const reg_maskSpans *maskSpans = NULL);
+/* *************************************************************** */
+/** @brief Add the derivative of the KLD with respect to the warped
+ * intensities to a scalar image. Multiplying it by the warped image gradient
+ * gives the result of reg_getKLDivergenceVoxelBasedGradient
+ * @param reference First input image to use to compute the metric
+ * @param warped Second input image to use to compute the metric
+ * @param derivativeImage Output image that will be updated with the
+ * value of the KLD derivative
+ * @param mask Array that contains a mask to specify which voxel
+ * should be considered
+ * @param maskSpans Active voxels of the mask stored as spans. They are
+ * built from the mask array if set to NULL
+ */
+extern "C++" template <class DTYPE>
+void reg_getKLDivergenceVoxelBasedDerivative(nifti_image *reference,
+                                             nifti_image *warped,
+                                             nifti_image *derivativeImage,
+                                             int *mask,
+                                             int current_timepoint,
+                                             double timepoint_weight,
+                                             const reg_maskSpans *maskSpans = NULL);
 /* *************************************************************** */
 
 #endif
@@ -26,6 +26,9 @@ reg_lncc::reg_lncc()
    this->warpedFloatingMeanImage=NULL;
    this->warpedFloatingSdevImage=NULL;
    this->forwardMask = NULL;
+   this->forwardMaskSpans = NULL;
+   this->forwardStatMask = NULL;
+   this->forwardStatTimePoint = -1;
 
    this->backwardCorrelationImage=NULL;
    this->floatingMeanImage=NULL;
@@ -33,6 +36,9 @@ reg_lncc::reg_lncc()
    this->warpedReferenceMeanImage=NULL;
    this->warpedReferenceSdevImage=NULL;
    this->backwardMask = NULL;
+   this->backwardMaskSpans = NULL;
+   this->backwardStatMask = NULL;
+   this->backwardStatTimePoint = -1;
 
    // Gaussian kernel is used by default
    this->kernelType=GAUSSIAN_KERNEL;
@@ -65,6 +71,12 @@ reg_lncc::~reg_lncc()
    if(this->forwardMask!=NULL)
       free(this->forwardMask);
    this->forwardMask=NULL;
+   reg_tools_freeMaskSpans(this->forwardMaskSpans);
+   this->forwardMaskSpans=NULL;
+   if(this->forwardStatMask!=NULL)
+      free(this->forwardStatMask);
+   this->forwardStatMask=NULL;
+   this->forwardStatTimePoint=-1;
 
    if(this->backwardCorrelationImage!=NULL)
       nifti_image_free(this->backwardCorrelationImage);
@@ -84,6 +96,12 @@ reg_lncc::~reg_lncc()
    if(this->backwardMask!=NULL)
       free(this->backwardMask);
    this->backwardMask=NULL;
+   reg_tools_freeMaskSpans(this->backwardMaskSpans);
+   this->backwardMaskSpans=NULL;
+   if(this->backwardStatMask!=NULL)
+      free(this->backwardStatMask);
+   this->backwardStatMask=NULL;
+   this->backwardStatTimePoint=-1;
 }
 /* *************************************************************** */
 /* *************************************************************** */
@@ -96,33 +114,54 @@ void reg_lncc::UpdateLocalStatImages(nifti_image *refImage,
                                      nifti_image *stdDevWarImage,
                                      int *refMask,
                                      int *combinedMask,
+                                     reg_maskSpans *&combinedSpans,
+                                     int *statMask,
+                                     int &statTimePoint,
                                      int current_timepoint)
 {
    // Generate the foward mask to ignore all NaN values
 #ifdef _WIN32
-   long voxel;
+   long voxel, line;
    long voxelNumber = (long)refImage->nx*refImage->ny*refImage->nz;
+   long lineNumber = (long)refImage->ny*refImage->nz;
 #else
-   size_t voxel;
+   size_t voxel, line;
    size_t voxelNumber = (size_t)refImage->nx*refImage->ny*refImage->nz;
+   size_t lineNumber = (size_t)refImage->ny*refImage->nz;
 #endif
+   size_t span;
    memcpy(combinedMask, refMask, voxelNumber*sizeof(int));
    reg_tools_removeNanFromMask(refImage, combinedMask);
    reg_tools_removeNanFromMask(warImage, combinedMask);
+   // The per-voxel loops only visit the spans of the combined mask. The
+   // mask array itself is still used by the convolutions
+   int dim[3]={refImage->nx, refImage->ny, refImage->nz};
+   reg_tools_freeMaskSpans(combinedSpans);
+   combinedSpans=reg_tools_createMaskSpans(combinedMask, dim);
+
+   // The reference statistics only depend on the combined mask and on the
+   // time point, they are kept from the previous call when both are unchanged
+   bool updateRefStat = statTimePoint!=current_timepoint ||
+         memcmp(statMask, combinedMask, voxelNumber*sizeof(int))!=0;
 
    DTYPE *origRefPtr = static_cast<DTYPE *>(refImage->data);
    DTYPE *meanRefPtr = static_cast<DTYPE *>(meanRefImage->data);
    DTYPE *sdevRefPtr = static_cast<DTYPE *>(stdDevRefImage->data);
-   memcpy(meanRefPtr, &origRefPtr[current_timepoint*voxelNumber],
-         voxelNumber*refImage->nbyper);
-   memcpy(sdevRefPtr, &origRefPtr[current_timepoint*voxelNumber],
-         voxelNumber*refImage->nbyper);
-
-   reg_tools_multiplyImageToImage(stdDevRefImage, stdDevRefImage, stdDevRefImage);
-   reg_tools_kernelConvolution(meanRefImage, this->kernelStandardDeviation,
-                               this->kernelType, combinedMask);
-   reg_tools_kernelConvolution(stdDevRefImage, this->kernelStandardDeviation,
-                               this->kernelType, combinedMask);
+   if(updateRefStat)
+   {
+      memcpy(meanRefPtr, &origRefPtr[current_timepoint*voxelNumber],
+            voxelNumber*refImage->nbyper);
+      memcpy(sdevRefPtr, &origRefPtr[current_timepoint*voxelNumber],
+            voxelNumber*refImage->nbyper);
+
+      reg_tools_multiplyImageToImage(stdDevRefImage, stdDevRefImage, stdDevRefImage);
+      reg_tools_kernelConvolution(meanRefImage, this->kernelStandardDeviation,
+                                  this->kernelType, combinedMask);
+      reg_tools_kernelConvolution(stdDevRefImage, this->kernelStandardDeviation,
+                                  this->kernelType, combinedMask);
+      memcpy(statMask, combinedMask, voxelNumber*sizeof(int));
+      statTimePoint=current_timepoint;
+   }
 
    DTYPE *origWarPtr = static_cast<DTYPE *>(warImage->data);
    DTYPE *meanWarPtr = static_cast<DTYPE *>(meanWarImage->data);
@@ -137,19 +176,30 @@ void reg_lncc::UpdateLocalStatImages(nifti_image *refImage,
                                this->kernelType, combinedMask);
    reg_tools_kernelConvolution(stdDevWarImage, this->kernelStandardDeviation,
                                this->kernelType, combinedMask);
+   const reg_maskSpans *spans=combinedSpans;
 #if defined (_OPENMP)
 #pragma omp parallel for default(none) \
-   shared(voxelNumber, sdevRefPtr, meanRefPtr, sdevWarPtr, meanWarPtr) \
-   private(voxel)
+   shared(lineNumber, refImage, spans, sdevRefPtr, meanRefPtr, sdevWarPtr, meanWarPtr, updateRefStat) \
+   private(voxel, line, span)
 #endif
-   for(voxel=0; voxel<voxelNumber; ++voxel)
+   for(line=0; line<lineNumber; ++line)
    {
-      // G*(I^2) - (G*I)^2
-      sdevRefPtr[voxel] = sqrt(sdevRefPtr[voxel] - reg_pow2(meanRefPtr[voxel]));
-      sdevWarPtr[voxel] = sqrt(sdevWarPtr[voxel] - reg_pow2(meanWarPtr[voxel]));
-      // Stabilise the computation
-      if(sdevRefPtr[voxel]<1.e-06) sdevRefPtr[voxel]=static_cast<DTYPE>(0);
-      if(sdevWarPtr[voxel]<1.e-06) sdevWarPtr[voxel]=static_cast<DTYPE>(0);
+      for(span=spans->lineSpan[line]; span<spans->lineSpan[line+1]; ++span)
+      {
+         for(voxel=line*refImage->nx+spans->spanStart[span];
+             voxel<line*refImage->nx+spans->spanEnd[span]; ++voxel)
+         {
+            // G*(I^2) - (G*I)^2
+            if(updateRefStat)
+            {
+               sdevRefPtr[voxel] = sqrt(sdevRefPtr[voxel] - reg_pow2(meanRefPtr[voxel]));
+               // Stabilise the computation
+               if(sdevRefPtr[voxel]<1.e-06) sdevRefPtr[voxel]=static_cast<DTYPE>(0);
+            }
+            sdevWarPtr[voxel] = sqrt(sdevWarPtr[voxel] - reg_pow2(meanWarPtr[voxel]));
+            if(sdevWarPtr[voxel]<1.e-06) sdevWarPtr[voxel]=static_cast<DTYPE>(0);
+         }
+      }
    }
 }
 /* *************************************************************** */
@@ -227,9 +277,21 @@ void reg_lncc::InitialiseMeasure(nifti_image *refImgPtr,
    if(this->forwardMask!=NULL)
       free(this->forwardMask);
    this->forwardMask=NULL;
+   reg_tools_freeMaskSpans(this->forwardMaskSpans);
+   this->forwardMaskSpans=NULL;
+   if(this->forwardStatMask!=NULL)
+      free(this->forwardStatMask);
+   this->forwardStatMask=NULL;
+   this->forwardStatTimePoint=-1;
    if(this->backwardMask!=NULL)
       free(this->backwardMask);
    this->backwardMask=NULL;
+   reg_tools_freeMaskSpans(this->backwardMaskSpans);
+   this->backwardMaskSpans=NULL;
+   if(this->backwardStatMask!=NULL)
+      free(this->backwardStatMask);
+   this->backwardStatMask=NULL;
+   this->backwardStatTimePoint=-1;
 
    //
    size_t voxelNumber = (size_t)this->referenceImagePointer->nx *
@@ -263,6 +325,7 @@ void reg_lncc::InitialiseMeasure(nifti_image *refImgPtr,
 
    // Allocate the array to store the mask of the forward image
    this->forwardMask=(int *)malloc(voxelNumber*sizeof(int));
+   this->forwardStatMask=(int *)malloc(voxelNumber*sizeof(int));
    if(this->isSymmetric)
    {
       voxelNumber = (size_t)floatingImagePointer->nx *
@@ -295,6 +358,7 @@ void reg_lncc::InitialiseMeasure(nifti_image *refImgPtr,
 
       // Allocate the array to store the mask of the backward image
       this->backwardMask=(int *)malloc(voxelNumber*sizeof(int));
+      this->backwardStatMask=(int *)malloc(voxelNumber*sizeof(int));
    }
 #ifndef NDEBUG
    char text[255];
@@ -319,17 +383,28 @@ double reg_getLNCCValue(nifti_image *referenceImage,
                         float *kernelStandardDeviation,
                         nifti_image *correlationImage,
                         int kernelType,
-                        int current_timepoint)
+                        int current_timepoint,
+                        const reg_maskSpans *maskSpans)
 {
 #ifdef _WIN32
-   long voxel;
+   long voxel, line;
    long voxelNumber=(long)referenceImage->nx*
          referenceImage->ny*referenceImage->nz;
+   long lineNumber=(long)referenceImage->ny*referenceImage->nz;
 #else
-   size_t voxel;
+   size_t voxel, line;
    size_t voxelNumber=(size_t)referenceImage->nx*
          referenceImage->ny*referenceImage->nz;
+   size_t lineNumber=(size_t)referenceImage->ny*referenceImage->nz;
 #endif
+   size_t span;
+   // Only the active spans are visited. They are built from the mask array if not provided
+   reg_maskSpans *temporarySpans=NULL;
+   if(maskSpans==NULL)
+   {
+      int dim[3]={referenceImage->nx, referenceImage->ny, referenceImage->nz};
+      maskSpans=temporarySpans=reg_tools_createMaskSpans(combinedMask, dim);
+   }
 
    // Compute the local correlation
    DTYPE *refImagePtr=static_cast<DTYPE *>(referenceImage->data);
@@ -355,30 +430,34 @@ double reg_getLNCCValue(nifti_image *referenceImage,
    // Iteration over all voxels
 #if defined (_OPENMP)
 #pragma omp parallel for default(none) \
-   shared(voxelNumber,combinedMask,refMeanPtr,warMeanPtr, \
+   shared(lineNumber,referenceImage,maskSpans,refMeanPtr,warMeanPtr, \
    refSdevPtr,warSdevPtr,correlaPtr) \
-   private(voxel,lncc_value) \
+   private(voxel,line,span,lncc_value) \
    reduction(+:lncc_value_sum) \
    reduction(+:activeVoxel_num)
 #endif
-   for(voxel=0; voxel<voxelNumber; ++voxel)
+   for(line=0; line<lineNumber; ++line)
    {
-      // Check if the current voxel belongs to the mask
-      if(combinedMask[voxel]>-1)
+      for(span=maskSpans->lineSpan[line]; span<maskSpans->lineSpan[line+1]; ++span)
       {
-         lncc_value = (
-                  correlaPtr[voxel] -
-                  (refMeanPtr[voxel]*warMeanPtr[voxel])
-                  ) /
-               (refSdevPtr[voxel]*warSdevPtr[voxel]);
-
-         if(lncc_value==lncc_value && isinf(lncc_value)==0)
+         for(voxel=line*referenceImage->nx+maskSpans->spanStart[span];
+             voxel<line*referenceImage->nx+maskSpans->spanEnd[span]; ++voxel)
          {
-            lncc_value_sum += fabs(lncc_value);
-            ++activeVoxel_num;
+            lncc_value = (
+                     correlaPtr[voxel] -
+                     (refMeanPtr[voxel]*warMeanPtr[voxel])
+                     ) /
+                  (refSdevPtr[voxel]*warSdevPtr[voxel]);
+
+            if(lncc_value==lncc_value && isinf(lncc_value)==0)
+            {
+               lncc_value_sum += fabs(lncc_value);
+               ++activeVoxel_num;
+            }
          }
       }
    }
+   reg_tools_freeMaskSpans(temporarySpans);
    return lncc_value_sum/activeVoxel_num;
 }
 /* *************************************************************** */
@@ -404,6 +483,9 @@ double reg_lncc::GetSimilarityMeasureValue()
                this->warpedFloatingSdevImage,
                this->referenceMaskPointer,
                this->forwardMask,
+               this->forwardMaskSpans,
+               this->forwardStatMask,
+               this->forwardStatTimePoint,
                current_timepoint);
             break;
          case NIFTI_TYPE_FLOAT64:
@@ -415,6 +497,9 @@ double reg_lncc::GetSimilarityMeasureValue()
                this->warpedFloatingSdevImage,
                this->referenceMaskPointer,
                this->forwardMask,
+               this->forwardMaskSpans,
+               this->forwardStatMask,
+               this->forwardStatTimePoint,
                current_timepoint);
             break;
          }
@@ -433,7 +518,8 @@ double reg_lncc::GetSimilarityMeasureValue()
 					this->kernelStandardDeviation,
 					this->forwardCorrelationImage,
 					this->kernelType,
-					current_timepoint);
+					current_timepoint,
+					this->forwardMaskSpans);
 				break;
 			case NIFTI_TYPE_FLOAT64:
 				tp_value += reg_getLNCCValue<double>(this->referenceImagePointer,
@@ -446,7 +532,8 @@ double reg_lncc::GetSimilarityMeasureValue()
 					this->kernelStandardDeviation,
 					this->forwardCorrelationImage,
 					this->kernelType,
-					current_timepoint);
+					current_timepoint,
+					this->forwardMaskSpans);
 				break;
 			}
 			if (this->isSymmetric)
@@ -463,6 +550,9 @@ double reg_lncc::GetSimilarityMeasureValue()
 						this->warpedReferenceSdevImage,
 						this->floatingMaskPointer,
 						this->backwardMask,
+						this->backwardMaskSpans,
+						this->backwardStatMask,
+						this->backwardStatTimePoint,
 						current_timepoint);
 					break;
 				case NIFTI_TYPE_FLOAT64:
@@ -474,6 +564,9 @@ double reg_lncc::GetSimilarityMeasureValue()
 						this->warpedReferenceSdevImage,
 						this->floatingMaskPointer,
 						this->backwardMask,
+						this->backwardMaskSpans,
+						this->backwardStatMask,
+						this->backwardStatTimePoint,
 						current_timepoint);
 					break;
 				}
@@ -491,7 +584,8 @@ double reg_lncc::GetSimilarityMeasureValue()
 						this->kernelStandardDeviation,
 						this->backwardCorrelationImage,
 						this->kernelType,
-						current_timepoint);
+						current_timepoint,
+						this->backwardMaskSpans);
 					break;
 				case NIFTI_TYPE_FLOAT64:
 					tp_value += reg_getLNCCValue<double>(this->floatingImagePointer,
@@ -504,7 +598,8 @@ double reg_lncc::GetSimilarityMeasureValue()
 						this->kernelStandardDeviation,
 						this->backwardCorrelationImage,
 						this->kernelType,
-						current_timepoint);
+						current_timepoint,
+						this->backwardMaskSpans);
 					break;
 				}
 			}
@@ -529,17 +624,28 @@ void reg_getVoxelBasedLNCCGradient(nifti_image *referenceImage,
                                    nifti_image *measureGradientImage,
                                    int kernelType,
                                    int current_timepoint,
-                           double timepoint_weight)
+                           double timepoint_weight,
+                           const reg_maskSpans *maskSpans)
 {
 #ifdef _WIN32
-   long voxel;
+   long voxel, line;
    long voxelNumber=(long)referenceImage->nx*
          referenceImage->ny*referenceImage->nz;
+   long lineNumber=(long)referenceImage->ny*referenceImage->nz;
 #else
-   size_t voxel;
+   size_t voxel, line;
    size_t voxelNumber=(size_t)referenceImage->nx*
          referenceImage->ny*referenceImage->nz;
+   size_t lineNumber=(size_t)referenceImage->ny*referenceImage->nz;
 #endif
+   size_t span;
+   // Only the active spans are visited. They are built from the mask array if not provided
+   reg_maskSpans *temporarySpans=NULL;
+   if(maskSpans==NULL)
+   {
+      int dim[3]={referenceImage->nx, referenceImage->ny, referenceImage->nz};
+      maskSpans=temporarySpans=reg_tools_createMaskSpans(combinedMask, dim);
+   }
 
    // Compute the local correlation
    DTYPE *refImagePtr=static_cast<DTYPE *>(referenceImage->data);
@@ -565,52 +671,54 @@ void reg_getVoxelBasedLNCCGradient(nifti_image *referenceImage,
    double activeVoxel_num = 0.;
 
    // Iteration over all voxels
+   // The voxels outside of the mask are discarded by the convolutions below
 #if defined (_OPENMP)
 #pragma omp parallel for default(none) \
-   shared(voxelNumber,combinedMask,refMeanPtr,warMeanPtr, \
+   shared(lineNumber,referenceImage,maskSpans,refMeanPtr,warMeanPtr, \
    refSdevPtr,warSdevPtr,correlaPtr) \
-   private(voxel,refMeanValue,warMeanValue,refSdevValue, \
+   private(voxel,line,span,refMeanValue,warMeanValue,refSdevValue, \
    warSdevValue, correlaValue, temp1, temp2, temp3) \
    reduction(+:activeVoxel_num)
 #endif
-   for(voxel=0; voxel<voxelNumber; ++voxel)
+   for(line=0; line<lineNumber; ++line)
    {
-      // Check if the current voxel belongs to the mask
-      if(combinedMask[voxel]>-1)
+      for(span=maskSpans->lineSpan[line]; span<maskSpans->lineSpan[line+1]; ++span)
       {
-
-         refMeanValue = refMeanPtr[voxel];
-         warMeanValue = warMeanPtr[voxel];
-         refSdevValue = refSdevPtr[voxel];
-         warSdevValue = warSdevPtr[voxel];
-         correlaValue = correlaPtr[voxel] - (refMeanValue*warMeanValue);
-
-         temp1 = 1.0 / (refSdevValue * warSdevValue);
-         temp2 = correlaValue /
-               (refSdevValue*warSdevValue*warSdevValue*warSdevValue);
-         temp3 = (correlaValue * warMeanValue) /
-               (refSdevValue*warSdevValue*warSdevValue*warSdevValue)
-               -
-               refMeanValue / (refSdevValue * warSdevValue);
-         if(temp1==temp1 && isinf(temp1)==0 &&
-               temp2==temp2 && isinf(temp2)==0 &&
-               temp3==temp3 && isinf(temp3)==0)
+         for(voxel=line*referenceImage->nx+maskSpans->spanStart[span];
+             voxel<line*referenceImage->nx+maskSpans->spanEnd[span]; ++voxel)
          {
-            // Derivative of the absolute function
-            if(correlaValue<0)
+            refMeanValue = refMeanPtr[voxel];
+            warMeanValue = warMeanPtr[voxel];
+            refSdevValue = refSdevPtr[voxel];
+            warSdevValue = warSdevPtr[voxel];
+            correlaValue = correlaPtr[voxel] - (refMeanValue*warMeanValue);
+
+            temp1 = 1.0 / (refSdevValue * warSdevValue);
+            temp2 = correlaValue /
+                  (refSdevValue*warSdevValue*warSdevValue*warSdevValue);
+            temp3 = (correlaValue * warMeanValue) /
+                  (refSdevValue*warSdevValue*warSdevValue*warSdevValue)
+                  -
+                  refMeanValue / (refSdevValue * warSdevValue);
+            if(temp1==temp1 && isinf(temp1)==0 &&
+                  temp2==temp2 && isinf(temp2)==0 &&
+                  temp3==temp3 && isinf(temp3)==0)
             {
-               temp1 *= -1.;
-               temp2 *= -1.;
-               temp3 *= -1.;
+               // Derivative of the absolute function
+               if(correlaValue<0)
+               {
+                  temp1 *= -1.;
+                  temp2 *= -1.;
+                  temp3 *= -1.;
+               }
+               warMeanPtr[voxel]=temp1;
+               warSdevPtr[voxel]=temp2;
+               correlaPtr[voxel]=temp3;
+               activeVoxel_num++;
             }
-            warMeanPtr[voxel]=temp1;
-            warSdevPtr[voxel]=temp2;
-            correlaPtr[voxel]=temp3;
-         activeVoxel_num++;
+            else warMeanPtr[voxel]=warSdevPtr[voxel]=correlaPtr[voxel]=0.;
          }
-         else warMeanPtr[voxel]=warSdevPtr[voxel]=correlaPtr[voxel]=0.;
       }
-      else warMeanPtr[voxel]=warSdevPtr[voxel]=correlaPtr[voxel]=0.;
    }
 
    //adjust weight for number of voxels
@@ -637,26 +745,30 @@ void reg_getVoxelBasedLNCCGradient(nifti_image *referenceImage,
    // Iteration over all voxels
 #if defined (_OPENMP)
 #pragma omp parallel for default(none) \
-   shared(voxelNumber,combinedMask,currentRefPtr,currentWarPtr, \
+   shared(lineNumber,referenceImage,maskSpans,currentRefPtr,currentWarPtr, \
    warMeanPtr,warSdevPtr,correlaPtr,measureGradPtrX,measureGradPtrY, \
    measureGradPtrZ, warpGradPtrX, warpGradPtrY, warpGradPtrZ, adjusted_weight) \
-   private(voxel, common)
+   private(voxel, line, span, common)
 #endif
-   for(voxel=0; voxel<voxelNumber; ++voxel)
+   for(line=0; line<lineNumber; ++line)
    {
-      // Check if the current voxel belongs to the mask
-      if(combinedMask[voxel]>-1)
+      for(span=maskSpans->lineSpan[line]; span<maskSpans->lineSpan[line+1]; ++span)
       {
-         common = warMeanPtr[voxel] * currentRefPtr[voxel] -
-               warSdevPtr[voxel] * currentWarPtr[voxel] +
-               correlaPtr[voxel];
-       common *= adjusted_weight;
-         measureGradPtrX[voxel] -= warpGradPtrX[voxel] * common;
-         measureGradPtrY[voxel] -= warpGradPtrY[voxel] * common;
-         if(warpGradPtrZ!=NULL)
-            measureGradPtrZ[voxel] -= warpGradPtrZ[voxel] * common;
+         for(voxel=line*referenceImage->nx+maskSpans->spanStart[span];
+             voxel<line*referenceImage->nx+maskSpans->spanEnd[span]; ++voxel)
+         {
+            common = warMeanPtr[voxel] * currentRefPtr[voxel] -
+                  warSdevPtr[voxel] * currentWarPtr[voxel] +
+                  correlaPtr[voxel];
+            common *= adjusted_weight;
+            measureGradPtrX[voxel] -= warpGradPtrX[voxel] * common;
+            measureGradPtrY[voxel] -= warpGradPtrY[voxel] * common;
+            if(warpGradPtrZ!=NULL)
+               measureGradPtrZ[voxel] -= warpGradPtrZ[voxel] * common;
+         }
       }
    }
+   reg_tools_freeMaskSpans(temporarySpans);
    // Check for NaN
    DTYPE val;
 #ifdef _WIN32
@@ -697,6 +809,9 @@ void reg_lncc::GetVoxelBasedSimilarityMeasureGradient(int current_timepoint)
                                          this->warpedFloatingSdevImage,
                                          this->referenceMaskPointer,
                                          this->forwardMask,
+                                         this->forwardMaskSpans,
+                                         this->forwardStatMask,
+                                         this->forwardStatTimePoint,
                                          current_timepoint);
       break;
    case NIFTI_TYPE_FLOAT64:
@@ -708,6 +823,9 @@ void reg_lncc::GetVoxelBasedSimilarityMeasureGradient(int current_timepoint)
                                           this->warpedFloatingSdevImage,
                                           this->referenceMaskPointer,
                                           this->forwardMask,
+                                          this->forwardMaskSpans,
+                                          this->forwardStatMask,
+                                          this->forwardStatTimePoint,
                                           current_timepoint);
       break;
    }
@@ -729,7 +847,8 @@ void reg_lncc::GetVoxelBasedSimilarityMeasureGradient(int current_timepoint)
                                            this->forwardVoxelBasedGradientImagePointer,
                                            this->kernelType,
                                            current_timepoint,
-                                 this->timePointWeight[current_timepoint]);
+                                 this->timePointWeight[current_timepoint],
+                                 this->forwardMaskSpans);
       break;
    case NIFTI_TYPE_FLOAT64:
       reg_getVoxelBasedLNCCGradient<double>(this->referenceImagePointer,
@@ -745,7 +864,8 @@ void reg_lncc::GetVoxelBasedSimilarityMeasureGradient(int current_timepoint)
                                             this->forwardVoxelBasedGradientImagePointer,
                                             this->kernelType,
                                  current_timepoint,
-                                 this->timePointWeight[current_timepoint]);
+                                 this->timePointWeight[current_timepoint],
+                                 this->forwardMaskSpans);
       break;
    }
    if(this->isSymmetric)
@@ -762,6 +882,9 @@ void reg_lncc::GetVoxelBasedSimilarityMeasureGradient(int current_timepoint)
                                             this->warpedReferenceSdevImage,
                                             this->floatingMaskPointer,
                                             this->backwardMask,
+                                            this->backwardMaskSpans,
+                                            this->backwardStatMask,
+                                            this->backwardStatTimePoint,
                                             current_timepoint);
          break;
       case NIFTI_TYPE_FLOAT64:
@@ -773,6 +896,9 @@ void reg_lncc::GetVoxelBasedSimilarityMeasureGradient(int current_timepoint)
                                              this->warpedReferenceSdevImage,
                                              this->floatingMaskPointer,
                                              this->backwardMask,
+                                             this->backwardMaskSpans,
+                                             this->backwardStatMask,
+                                             this->backwardStatTimePoint,
                                              current_timepoint);
          break;
       }
@@ -793,7 +919,8 @@ void reg_lncc::GetVoxelBasedSimilarityMeasureGradient(int current_timepoint)
                                               this->backwardVoxelBasedGradientImagePointer,
                                               this->kernelType,
                                    current_timepoint,
-                                   this->timePointWeight[current_timepoint]);
+                                   this->timePointWeight[current_timepoint],
+                                   this->backwardMaskSpans);
          break;
       case NIFTI_TYPE_FLOAT64:
          reg_getVoxelBasedLNCCGradient<double>(this->floatingImagePointer,
@@ -809,7 +936,8 @@ void reg_lncc::GetVoxelBasedSimilarityMeasureGradient(int current_timepoint)
                                                this->backwardVoxelBasedGradientImagePointer,
                                                this->kernelType,
                                     current_timepoint,
-                                    this->timePointWeight[current_timepoint]);
+                                    this->timePointWeight[current_timepoint],
+                                    this->backwardMaskSpans);
          break;
       }
    }
@@ -58,6 +58,13 @@ protected:
    nifti_image *warpedFloatingMeanImage;
    nifti_image *warpedFloatingSdevImage;
    int *forwardMask;
+   // Active voxels of the forward combined mask stored as spans
+   reg_maskSpans *forwardMaskSpans;
+   // Combined mask and time point used to compute the current reference
+   // mean and standard deviation images. The reference statistics are only
+   // updated when they differ from the current ones
+   int *forwardStatMask;
+   int forwardStatTimePoint;
 
    nifti_image *backwardCorrelationImage;
    nifti_image *floatingMeanImage;
@@ -65,6 +72,9 @@ protected:
    nifti_image *warpedReferenceMeanImage;
    nifti_image *warpedReferenceSdevImage;
    int *backwardMask;
+   reg_maskSpans *backwardMaskSpans;
+   int *backwardStatMask;
+   int backwardStatTimePoint;
 
    int kernelType;
 
@@ -77,6 +87,9 @@ protected:
                               nifti_image *stdDevWarImage,
                               int *refMask,
                               int *mask,
+                              reg_maskSpans *&maskSpans,
+                              int *statMask,
+                              int &statTimePoint,
                               int current_timepoint);
 };
 /* *************************************************************** */
@@ -88,6 +101,8 @@ protected:
  * to use.
  * @param mask Array that contains a mask to specify which voxel
  * should be considered. If set to NULL, all voxels are considered
+ * @param maskSpans Active voxels of the mask stored as spans. They are
+ * built from the mask array if set to NULL
  * @return Returns the computed LNCC
  */
 extern "C++" template<class DTYPE>
@@ -100,7 +115,9 @@ double reg_getLNCCValue(nifti_image *referenceImage,
                         int *combinedMask,
                         float *kernelStdDev,
                         nifti_image *correlationImage,
-                        int kernelType);
+                        int kernelType,
+                        int current_timepoint,
+                        const reg_maskSpans *maskSpans = NULL);
 
 /* *************************************************************** */
 /** @brief Compute a voxel based gradient of the LNCC.
@@ -113,6 +130,8 @@ double reg_getLNCCValue(nifti_image *referenceImage,
  *  to use.
  *  @param mask Array that contains a mask to specify which voxel
  *  should be considered. If set to NULL, all voxels are considered
+ *  @param maskSpans Active voxels of the mask stored as spans. They are
+ *  built from the mask array if set to NULL
  */
 extern "C++" template <class DTYPE>
 void reg_getVoxelBasedLNCCGradient(nifti_image *referenceImage,
@@ -128,6 +147,7 @@ void reg_getVoxelBasedLNCCGradient(nifti_image *referenceImage,
                                    nifti_image *lnccGradientImage,
                                    int kernelType,
                                    int current_timepoint,
-                           double timepoint_weight);
+                           double timepoint_weight,
+                           const reg_maskSpans *maskSpans = NULL);
 #endif
 
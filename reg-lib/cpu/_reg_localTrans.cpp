@@ -13,6 +13,7 @@
 #include <cmath>
 #include "_reg_localTrans.h"
 #include "_reg_maths_eigen.h"
+#include "_reg_simd.h"
 
 /* *************************************************************** */
 /* *************************************************************** */
@@ -920,25 +921,163 @@ void reg_cubic_spline_getDeformationField2D(nifti_image *splineControlPoint,
    return;
 }
 /* *************************************************************** */
+/** Basis values of every voxel along one axis of the deformation field. The
+ * voxels are grouped into runs that share the same first control point.
+ */
+template<class DTYPE>
+void reg_cubic_spline_getAxisBasis(int voxelNumber,
+                                   DTYPE gridVoxelSpacing,
+                                   bool bspline,
+                                   DTYPE *basisValues,
+                                   std::vector<int> &runStart,
+                                   std::vector<int> &runPre)
+{
+   DTYPE basis;
+   int pre, oldPre=-1;
+   runStart.clear();
+   runPre.clear();
+   for(int i=0; i<voxelNumber; ++i)
+   {
+      pre=static_cast<int>(static_cast<DTYPE>(i)/gridVoxelSpacing);
+      basis=static_cast<DTYPE>(i)/gridVoxelSpacing-static_cast<DTYPE>(pre);
+      if(basis<0.0) basis=0.0; //rounding error
+      if(bspline) get_BSplineBasisValues<DTYPE>(basis, &basisValues[4*i]);
+      else get_SplineBasisValues<DTYPE>(basis, &basisValues[4*i]);
+      if(pre!=oldPre)
+      {
+         runStart.push_back(i);
+         runPre.push_back(pre);
+         oldPre=pre;
+      }
+   }
+   runStart.push_back(voxelNumber);
+}
+/* *************************************************************** */
+/** Evaluation of a cubic spline parametrised deformation field, one control
+ * point cell at a time. The 4x4x4 control points of a cell are read once and
+ * the tensor product is collapsed along z, y and x in turn so that most of the
+ * products are shared between the voxels of the cell. The three coordinates
+ * are interleaved so that each collapse is a single call to the selected
+ * vectorised kernel.
+ */
+template<class DTYPE>
+void reg_cubic_spline_getDeformationField3D_cells(nifti_image *splineControlPoint,
+                                                  nifti_image *deformationField,
+                                                  int *mask,
+                                                  bool bspline)
+{
+   DTYPE *controlPointPtrX = static_cast<DTYPE *>(splineControlPoint->data);
+   DTYPE *controlPointPtrY = &controlPointPtrX[splineControlPoint->nx*splineControlPoint->ny*splineControlPoint->nz];
+   DTYPE *controlPointPtrZ = &controlPointPtrY[splineControlPoint->nx*splineControlPoint->ny*splineControlPoint->nz];
+
+   size_t voxelNumber = (size_t)deformationField->nx*deformationField->ny*deformationField->nz;
+   DTYPE *fieldPtrX=static_cast<DTYPE *>(deformationField->data);
+   DTYPE *fieldPtrY=&fieldPtrX[voxelNumber];
+   DTYPE *fieldPtrZ=&fieldPtrY[voxelNumber];
+
+   // The basis values only depend on the voxel position along each axis
+   DTYPE *xBasis=(DTYPE *)malloc(4*deformationField->nx*sizeof(DTYPE));
+   DTYPE *yBasis=(DTYPE *)malloc(4*deformationField->ny*sizeof(DTYPE));
+   DTYPE *zBasis=(DTYPE *)malloc(4*deformationField->nz*sizeof(DTYPE));
+   std::vector<int> xRunStart, xRunPre, yRunStart, yRunPre, zRunStart, zRunPre;
+   reg_cubic_spline_getAxisBasis<DTYPE>(deformationField->nx,
+                                        splineControlPoint->dx / deformationField->dx,
+                                        bspline, xBasis, xRunStart, xRunPre);
+   reg_cubic_spline_getAxisBasis<DTYPE>(deformationField->ny,
+                                        splineControlPoint->dy / deformationField->dy,
+                                        bspline, yBasis, yRunStart, yRunPre);
+   reg_cubic_spline_getAxisBasis<DTYPE>(deformationField->nz,
+                                        splineControlPoint->dz / deformationField->dz,
+                                        bspline, zBasis, zRunStart, zRunPre);
+   int xRunNumber=static_cast<int>(xRunPre.size());
+   int yRunNumber=static_cast<int>(yRunPre.size());
+   int cellNumber=xRunNumber*yRunNumber*static_cast<int>(zRunPre.size());
+
+   const reg_simd_kernels *simdKernels = reg_simd_getKernels();
+
+   int cell, xRun, yRun, zRun, x, y, z, n;
+   size_t index;
+   DTYPE xControlPointCoordinates[64];
+   DTYPE yControlPointCoordinates[64];
+   DTYPE zControlPointCoordinates[64];
+   // Control point values stored as [z][y][x][coordinate], the fourth
+   // coordinate being zero, then collapsed along z and along z and y
+   DTYPE controlPointCoordinates[256], zCollapsed[64], yzCollapsed[16];
+   DTYPE real[4];
+#if defined (_OPENMP)
+#pragma omp parallel for default(none) \
+   private(cell, xRun, yRun, zRun, x, y, z, n, index, real, \
+   xControlPointCoordinates, yControlPointCoordinates, zControlPointCoordinates, \
+   controlPointCoordinates, zCollapsed, yzCollapsed) \
+   shared(cellNumber, xRunNumber, yRunNumber, xRunStart, xRunPre, yRunStart, yRunPre, \
+   zRunStart, zRunPre, xBasis, yBasis, zBasis, splineControlPoint, deformationField, \
+   controlPointPtrX, controlPointPtrY, controlPointPtrZ, fieldPtrX, fieldPtrY, fieldPtrZ, mask, \
+   simdKernels)
+#endif // _OPENMP
+   for(cell=0; cell<cellNumber; ++cell)
+   {
+      xRun = cell % xRunNumber;
+      yRun = (cell / xRunNumber) % yRunNumber;
+      zRun = cell / (xRunNumber * yRunNumber);
+
+      get_GridValues<DTYPE>(xRunPre[xRun],
+                            yRunPre[yRun],
+                            zRunPre[zRun],
+                            splineControlPoint,
+                            controlPointPtrX,
+                            controlPointPtrY,
+                            controlPointPtrZ,
+                            xControlPointCoordinates,
+                            yControlPointCoordinates,
+                            zControlPointCoordinates,
+                            false, // no approximation
+                            false // not a deformation field
+                            );
+
+      for(n=0; n<64; ++n)
+      {
+         controlPointCoordinates[4*n] = xControlPointCoordinates[n];
+         controlPointCoordinates[4*n+1] = yControlPointCoordinates[n];
+         controlPointCoordinates[4*n+2] = zControlPointCoordinates[n];
+         controlPointCoordinates[4*n+3] = 0;
+      }
+
+      for(z=zRunStart[zRun]; z<zRunStart[zRun+1]; ++z)
+      {
+         reg_simd_splineCollapse(simdKernels, &zBasis[4*z],
+                                 controlPointCoordinates, 64, zCollapsed);
+         for(y=yRunStart[yRun]; y<yRunStart[yRun+1]; ++y)
+         {
+            reg_simd_splineCollapse(simdKernels, &yBasis[4*y],
+                                    zCollapsed, 16, yzCollapsed);
+            index=((size_t)z*deformationField->ny+y)*deformationField->nx+xRunStart[xRun];
+            for(x=xRunStart[xRun]; x<xRunStart[xRun+1]; ++x, ++index)
+            {
+               // The masked out voxels are left untouched
+               if(mask[index]<0) continue;
+               reg_simd_splineCollapse(simdKernels, &xBasis[4*x],
+                                       yzCollapsed, 4, real);
+               fieldPtrX[index] = real[0];
+               fieldPtrY[index] = real[1];
+               fieldPtrZ[index] = real[2];
+            } // x
+         } // y
+      } // z
+   } // cell
+   free(xBasis);
+   free(yBasis);
+   free(zBasis);
+}
+/* *************************************************************** */
 template<class DTYPE>
 void reg_cubic_spline_getDeformationField3D(nifti_image *splineControlPoint,
                                             nifti_image *deformationField,
                                             int *mask,
                                             bool composition,
-                                            bool bspline,
-                                            bool force_no_lut=false)
+                                            bool bspline)
 {
 #if _USE_SSE
-   union
-   {
-      __m128 m;
-      float f[4];
-   } val;
-   __m128 tempX, tempY, tempZ, tempCurrent;
-   __m128 xBasis_sse, yBasis_sse, zBasis_sse, temp_basis_sse, basis_sse;
-
 #ifdef _WIN32
-   __declspec(align(16)) DTYPE temp[4];
    __declspec(align(16)) DTYPE zBasis[4];
    union
    {
@@ -956,7 +1095,6 @@ void reg_cubic_spline_getDeformationField3D(nifti_image *splineControlPoint,
       __declspec(align(16)) DTYPE f[16];
    } zControlPointCoordinates;
 #else // _WIN32
-   DTYPE temp[4] __attribute__((aligned(16)));
    DTYPE zBasis[4] __attribute__((aligned(16)));
    union
    {
@@ -975,12 +1113,10 @@ void reg_cubic_spline_getDeformationField3D(nifti_image *splineControlPoint,
    } zControlPointCoordinates;
 #endif // _WIN32
 #else // _USE_SSE
-   DTYPE temp[4];
    DTYPE zBasis[4];
    DTYPE xControlPointCoordinates[64];
    DTYPE yControlPointCoordinates[64];
    DTYPE zControlPointCoordinates[64];
-   int coord;
 #endif // _USE_SSE
 
    DTYPE *controlPointPtrX = static_cast<DTYPE *>(splineControlPoint->data);
@@ -991,11 +1127,14 @@ void reg_cubic_spline_getDeformationField3D(nifti_image *splineControlPoint,
    DTYPE *fieldPtrY=&fieldPtrX[deformationField->nx*deformationField->ny*deformationField->nz];
    DTYPE *fieldPtrZ=&fieldPtrY[deformationField->nx*deformationField->ny*deformationField->nz];
 
-   DTYPE basis, oldBasis=(DTYPE)(1.1);
+   DTYPE basis;
 
-   int x, y, z, a, b, c, oldPreX, oldPreY, oldPreZ, xPre, yPre, zPre, index;
+   int x, y, z, oldPreX, oldPreY, oldPreZ, xPre, yPre, zPre, index;
    DTYPE real[3];
 
+   // The 64 control point weighted sums use the widest vectorised kernel
+   const reg_simd_kernels *simdKernels = reg_simd_getKernels();
+
    if(composition)  // Composition of deformation fields
    {
       // read the ijk sform or qform, as appropriate
@@ -1017,602 +1156,148 @@ void reg_cubic_spline_getDeformationField3D(nifti_image *splineControlPoint,
 
       DTYPE voxel[3];
 
+      // The voxels are processed tile by tile so that the control points
+      // read for neighbouring voxels remain in cache
+      int fieldDim[3]={deformationField->nx, deformationField->ny, deformationField->nz};
+      int tileNumber[3], tile, tileStart[3], tileEnd[3];
+      int tileCount = reg_getTileNumber(fieldDim, tileNumber);
+
 #if defined (_OPENMP)
-#ifdef _USE_SSE
-#pragma omp parallel for default(none) \
-   private(x, y, z, a, b, c, oldPreX, oldPreY, oldPreZ, xPre, yPre, zPre, real, \
-   index, voxel, basis, xBasis, yBasis, zBasis, xControlPointCoordinates, \
-   yControlPointCoordinates, zControlPointCoordinates,  \
-   tempX, tempY, tempZ, xBasis_sse, yBasis_sse, zBasis_sse, \
-   temp_basis_sse, basis_sse, val) \
-   shared(deformationField, fieldPtrX, fieldPtrY, fieldPtrZ, referenceMatrix_real_to_voxel, \
-   bspline, controlPointPtrX, controlPointPtrY, controlPointPtrZ, \
-   splineControlPoint, mask)
-#else
-#pragma omp parallel for default(none) \
-   private(x, y, z, a, b, c, oldPreX, oldPreY, oldPreZ, xPre, yPre, zPre, real, \
+#pragma omp parallel for default(none) schedule(dynamic) \
+   private(tile, tileStart, tileEnd, x, y, z, oldPreX, oldPreY, oldPreZ, xPre, yPre, zPre, real, \
    index, voxel, basis, xBasis, yBasis, zBasis, xControlPointCoordinates, \
-   yControlPointCoordinates, zControlPointCoordinates, coord) \
+   yControlPointCoordinates, zControlPointCoordinates) \
    shared(deformationField, fieldPtrX, fieldPtrY, fieldPtrZ, referenceMatrix_real_to_voxel, \
    bspline, controlPointPtrX, controlPointPtrY, controlPointPtrZ, \
-   splineControlPoint, mask)
-#endif // _USE_SSE
+   splineControlPoint, mask, fieldDim, tileNumber, tileCount, simdKernels)
 #endif // _OPENMP
-      for(z=0; z<deformationField->nz; z++)
+      for(tile=0; tile<tileCount; tile++)
       {
-
-         index=z*deformationField->nx*deformationField->ny;
+         reg_getTileBounds(tile, fieldDim, tileNumber, tileStart, tileEnd);
          oldPreX=-99;
          oldPreY=-99;
          oldPreZ=-99;
-         for(y=0; y<deformationField->ny; y++)
+         for(z=tileStart[2]; z<tileEnd[2]; z++)
          {
-            for(x=0; x<deformationField->nx; x++)
+            for(y=tileStart[1]; y<tileEnd[1]; y++)
             {
-
-               if(mask[index]>-1)
+               index=(z*deformationField->ny+y)*deformationField->nx+tileStart[0];
+               for(x=tileStart[0]; x<tileEnd[0]; x++, index++)
                {
-                  // The previous position at the current pixel position is read
-                  real[0] = fieldPtrX[index];
-                  real[1] = fieldPtrY[index];
-                  real[2] = fieldPtrZ[index];
-
-                  // From real to pixel position in the control point space
-                  voxel[0] =
-                        referenceMatrix_real_to_voxel.m[0][0] * real[0] +
-                        referenceMatrix_real_to_voxel.m[0][1] * real[1] +
-                        referenceMatrix_real_to_voxel.m[0][2] * real[2] +
-                        referenceMatrix_real_to_voxel.m[0][3] ;
-                  voxel[1] =
-                        referenceMatrix_real_to_voxel.m[1][0] * real[0] +
-                        referenceMatrix_real_to_voxel.m[1][1] * real[1] +
-                        referenceMatrix_real_to_voxel.m[1][2] * real[2] +
-                        referenceMatrix_real_to_voxel.m[1][3] ;
-                  voxel[2] =
-                        referenceMatrix_real_to_voxel.m[2][0] * real[0] +
-                        referenceMatrix_real_to_voxel.m[2][1] * real[1] +
-                        referenceMatrix_real_to_voxel.m[2][2] * real[2] +
-                        referenceMatrix_real_to_voxel.m[2][3] ;
-                  //                        reg_mat44_mul(referenceMatrix_real_to_voxel, real, voxel);
-
-                  // The spline coefficients are computed
-                  xPre=(int)reg_floor(voxel[0]);
-                  basis=voxel[0]-static_cast<DTYPE>(xPre);
-                  --xPre;
-                  if(basis<0.0) basis=0.0; //rounding error
-                  if(bspline) get_BSplineBasisValues<DTYPE>(basis, xBasis);
-                  else get_SplineBasisValues<DTYPE>(basis, xBasis);
-
-                  yPre=(int)reg_floor(voxel[1]);
-                  basis=voxel[1]-static_cast<DTYPE>(yPre);
-                  --yPre;
-                  if(basis<0.0) basis=0.0; //rounding error
-                  if(bspline) get_BSplineBasisValues<DTYPE>(basis, yBasis);
-                  else get_SplineBasisValues<DTYPE>(basis, yBasis);
-
-                  zPre=(int)reg_floor(voxel[2]);
-                  basis=voxel[2]-static_cast<DTYPE>(zPre);
-                  --zPre;
-                  if(basis<0.0) basis=0.0; //rounding error
-                  if(bspline) get_BSplineBasisValues<DTYPE>(basis, zBasis);
-                  else get_SplineBasisValues<DTYPE>(basis, zBasis);
-
-                  // The control point postions are extracted
-                  if(xPre!=oldPreX || yPre!=oldPreY || zPre!=oldPreZ)
+                  if(mask[index]>-1)
                   {
+                     // The previous position at the current pixel position is read
+                     real[0] = fieldPtrX[index];
+                     real[1] = fieldPtrY[index];
+                     real[2] = fieldPtrZ[index];
+
+                     // From real to pixel position in the control point space
+                     voxel[0] =
+                           referenceMatrix_real_to_voxel.m[0][0] * real[0] +
+                           referenceMatrix_real_to_voxel.m[0][1] * real[1] +
+                           referenceMatrix_real_to_voxel.m[0][2] * real[2] +
+                           referenceMatrix_real_to_voxel.m[0][3] ;
+                     voxel[1] =
+                           referenceMatrix_real_to_voxel.m[1][0] * real[0] +
+                           referenceMatrix_real_to_voxel.m[1][1] * real[1] +
+                           referenceMatrix_real_to_voxel.m[1][2] * real[2] +
+                           referenceMatrix_real_to_voxel.m[1][3] ;
+                     voxel[2] =
+                           referenceMatrix_real_to_voxel.m[2][0] * real[0] +
+                           referenceMatrix_real_to_voxel.m[2][1] * real[1] +
+                           referenceMatrix_real_to_voxel.m[2][2] * real[2] +
+                           referenceMatrix_real_to_voxel.m[2][3] ;
+                     //                        reg_mat44_mul(referenceMatrix_real_to_voxel, real, voxel);
+
+                     // The spline coefficients are computed
+                     xPre=(int)reg_floor(voxel[0]);
+                     basis=voxel[0]-static_cast<DTYPE>(xPre);
+                     --xPre;
+                     if(basis<0.0) basis=0.0; //rounding error
+                     if(bspline) get_BSplineBasisValues<DTYPE>(basis, xBasis);
+                     else get_SplineBasisValues<DTYPE>(basis, xBasis);
+
+                     yPre=(int)reg_floor(voxel[1]);
+                     basis=voxel[1]-static_cast<DTYPE>(yPre);
+                     --yPre;
+                     if(basis<0.0) basis=0.0; //rounding error
+                     if(bspline) get_BSplineBasisValues<DTYPE>(basis, yBasis);
+                     else get_SplineBasisValues<DTYPE>(basis, yBasis);
+
+                     zPre=(int)reg_floor(voxel[2]);
+                     basis=voxel[2]-static_cast<DTYPE>(zPre);
+                     --zPre;
+                     if(basis<0.0) basis=0.0; //rounding error
+                     if(bspline) get_BSplineBasisValues<DTYPE>(basis, zBasis);
+                     else get_SplineBasisValues<DTYPE>(basis, zBasis);
+
+                     // The control point postions are extracted
+                     if(xPre!=oldPreX || yPre!=oldPreY || zPre!=oldPreZ)
+                     {
 #ifdef _USE_SSE
-                     get_GridValues<DTYPE>(xPre,
-                                           yPre,
-                                           zPre,
-                                           splineControlPoint,
-                                           controlPointPtrX,
-                                           controlPointPtrY,
-                                           controlPointPtrZ,
-                                           xControlPointCoordinates.f,
-                                           yControlPointCoordinates.f,
-                                           zControlPointCoordinates.f,
-                                           false, // no approximation
-                                           false // not a deformation field
-                                           );
+                        get_GridValues<DTYPE>(xPre,
+                                              yPre,
+                                              zPre,
+                                              splineControlPoint,
+                                              controlPointPtrX,
+                                              controlPointPtrY,
+                                              controlPointPtrZ,
+                                              xControlPointCoordinates.f,
+                                              yControlPointCoordinates.f,
+                                              zControlPointCoordinates.f,
+                                              false, // no approximation
+                                              false // not a deformation field
+                                              );
 #else // _USE_SSE
-                     get_GridValues<DTYPE>(xPre,
-                                           yPre,
-                                           zPre,
-                                           splineControlPoint,
-                                           controlPointPtrX,
-                                           controlPointPtrY,
-                                           controlPointPtrZ,
-                                           xControlPointCoordinates,
-                                           yControlPointCoordinates,
-                                           zControlPointCoordinates,
-                                           false, // no approximation
-                                           false // not a deformation field
-                                           );
+                        get_GridValues<DTYPE>(xPre,
+                                              yPre,
+                                              zPre,
+                                              splineControlPoint,
+                                              controlPointPtrX,
+                                              controlPointPtrY,
+                                              controlPointPtrZ,
+                                              xControlPointCoordinates,
+                                              yControlPointCoordinates,
+                                              zControlPointCoordinates,
+                                              false, // no approximation
+                                              false // not a deformation field
+                                              );
 #endif // _USE_SSE
-                     oldPreX=xPre;
-                     oldPreY=yPre;
-                     oldPreZ=zPre;
-                  }
+                        oldPreX=xPre;
+                        oldPreY=yPre;
+                        oldPreZ=zPre;
+                     }
 
 #if _USE_SSE
-                  tempX =  _mm_set_ps1(0.0);
-                  tempY =  _mm_set_ps1(0.0);
-                  tempZ =  _mm_set_ps1(0.0);
-                  val.f[0] = xBasis[0];
-                  val.f[1] = xBasis[1];
-                  val.f[2] = xBasis[2];
-                  val.f[3] = xBasis[3];
-                  xBasis_sse = val.m;
-
-                  //addition and multiplication of the 16 basis value and CP position for each axis
-                  for(c=0; c<4; c++)
-                  {
-                     for(b=0; b<4; b++)
-                     {
-                        yBasis_sse  = _mm_set_ps1(yBasis[b]);
-                        zBasis_sse  = _mm_set_ps1(zBasis[c]);
-                        temp_basis_sse = _mm_mul_ps(yBasis_sse, zBasis_sse);
-                        basis_sse = _mm_mul_ps(temp_basis_sse, xBasis_sse);
-
-                        tempX = _mm_add_ps(_mm_mul_ps(basis_sse, xControlPointCoordinates.m[c*4+b]), tempX );
-                        tempY = _mm_add_ps(_mm_mul_ps(basis_sse, yControlPointCoordinates.m[c*4+b]), tempY );
-                        tempZ = _mm_add_ps(_mm_mul_ps(basis_sse, zControlPointCoordinates.m[c*4+b]), tempZ );
-                     }
-                  }
-                  //the values stored in SSE variables are transfered to normal float
-                  val.m = tempX;
-                  real[0] = val.f[0]+val.f[1]+val.f[2]+val.f[3];
-                  val.m = tempY;
-                  real[1] = val.f[0]+val.f[1]+val.f[2]+val.f[3];
-                  val.m = tempZ;
-                  real[2] = val.f[0]+val.f[1]+val.f[2]+val.f[3];
+                     reg_simd_splineValue(simdKernels,
+                                          xBasis, yBasis, zBasis,
+                                          xControlPointCoordinates.f,
+                                          yControlPointCoordinates.f,
+                                          zControlPointCoordinates.f,
+                                          real);
 #else
-                  real[0]=0.0;
-                  real[1]=0.0;
-                  real[2]=0.0;
-                  coord=0;
-                  for(c=0; c<4; c++)
-                  {
-                     for(b=0; b<4; b++)
-                     {
-                        for(a=0; a<4; a++)
-                        {
-                           DTYPE tempValue = xBasis[a] * yBasis[b] * zBasis[c];
-                           real[0] += xControlPointCoordinates[coord] * tempValue;
-                           real[1] += yControlPointCoordinates[coord] * tempValue;
-                           real[2] += zControlPointCoordinates[coord] * tempValue;
-                           coord++;
-                        }
-                     }
-                  }
+                     reg_simd_splineValue(simdKernels,
+                                          xBasis, yBasis, zBasis,
+                                          xControlPointCoordinates,
+                                          yControlPointCoordinates,
+                                          zControlPointCoordinates,
+                                          real);
 #endif
-                  fieldPtrX[index] = real[0];
-                  fieldPtrY[index] = real[1];
-                  fieldPtrZ[index] = real[2];
+                     fieldPtrX[index] = real[0];
+                     fieldPtrY[index] = real[1];
+                     fieldPtrZ[index] = real[2];
+                  }
                }
-               index++;
             }
          }
       }
    }//Composition of deformation
    else  // !composition
    {
-      DTYPE gridVoxelSpacing[3];
-      gridVoxelSpacing[0] = splineControlPoint->dx / deformationField->dx;
-      gridVoxelSpacing[1] = splineControlPoint->dy / deformationField->dy;
-      gridVoxelSpacing[2] = splineControlPoint->dz / deformationField->dz;
-
-#ifdef _USE_SSE
-#ifdef _WIN32
-      union u1
-      {
-         __m128 m[4];
-         __declspec(align(16)) DTYPE f[16];
-      } yzBasis;
-      union u2
-      {
-         __m128 m[16];
-         __declspec(align(16)) DTYPE f[64];
-      } xyzBasis;
-#else // _WIN32
-      union
-      {
-         __m128 m[4];
-         DTYPE f[16] __attribute__((aligned(16)));
-      } yzBasis;
-      union
-      {
-         __m128 m[16];
-         DTYPE f[64] __attribute__((aligned(16)));
-      } xyzBasis;
-#endif // _WIN32
-#else // _USE_SSE
-      DTYPE yzBasis[16], xyzBasis[64];
-#endif // _USE_SSE
-
-      // Assess if lookup table can be used
-      if(gridVoxelSpacing[0]==5. && gridVoxelSpacing[1]==5. && gridVoxelSpacing[2]==5. && force_no_lut==false){
-
-          // Assign a single array that will contain all coefficients
-         DTYPE *coefficients = (DTYPE *)malloc(125*64*sizeof(DTYPE));
-          // Compute and store all required coefficients
-          int coeff_index;
-#if defined (_OPENMP)
-#ifdef _USE_SSE
-#pragma omp parallel for default(none) \
-    private(x, y, z, a, b, c, coeff_index, basis, zBasis, temp, \
-    val, tempCurrent, yzBasis) \
-    shared(coefficients, bspline)
-#else //  _USE_SSE
-#pragma omp parallel for default(none) \
-    private(x, y, z, a, b, c, coeff_index, basis, zBasis, temp, \
-    yzBasis, coord) \
-    shared(coefficients, bspline)
-#endif // _USE_SSE
-#endif // _OPENMP
-          for(z=0;z<5;++z){
-             coeff_index=z*5*5*64;
-              basis=(DTYPE)z/5.;
-              if(bspline) get_BSplineBasisValues<DTYPE>(basis, zBasis);
-              else get_SplineBasisValues<DTYPE>(basis, zBasis);
-              for(y=0;y<5;++y){
-                  basis=(DTYPE)y/5.;
-                  if(bspline) get_BSplineBasisValues<DTYPE>(basis, temp);
-                  else get_SplineBasisValues<DTYPE>(basis, temp);
-#if _USE_SSE
-                  val.f[0] = temp[0];
-                  val.f[1] = temp[1];
-                  val.f[2] = temp[2];
-                  val.f[3] = temp[3];
-                  tempCurrent=val.m;
-                  for(a=0; a<4; a++)
-                  {
-                      val.m=_mm_set_ps1(zBasis[a]);
-                      yzBasis.m[a] = _mm_mul_ps(tempCurrent,val.m);
-                  }
-#else
-                  coord=0;
-                  for(a=0; a<4; a++)
-                  {
-                      yzBasis[coord++]=temp[0]*zBasis[a];
-                      yzBasis[coord++]=temp[1]*zBasis[a];
-                      yzBasis[coord++]=temp[2]*zBasis[a];
-                      yzBasis[coord++]=temp[3]*zBasis[a];
-                  }
-#endif
-
-                  for(x=0;x<5;++x){
-                      basis=(DTYPE)x/5.;
-                      if(bspline) get_BSplineBasisValues<DTYPE>(basis, temp);
-                      else get_SplineBasisValues<DTYPE>(basis, temp);
-#if _USE_SSE
-
-                      val.f[0] = temp[0];
-                      val.f[1] = temp[1];
-                      val.f[2] = temp[2];
-                      val.f[3] = temp[3];
-                      tempCurrent=val.m;
-                      for(a=0; a<16; ++a)
-                      {
-                          val.m=_mm_set_ps1(yzBasis.f[a]);
-                          val.m=_mm_mul_ps(tempCurrent,val.m);
-                          coefficients[coeff_index++]=val.f[0];
-                          coefficients[coeff_index++]=val.f[1];
-                          coefficients[coeff_index++]=val.f[2];
-                          coefficients[coeff_index++]=val.f[3];
-                      }
-#else
-                      for(a=0; a<16; a++)
-                      {
-                          coefficients[coeff_index++]=temp[0]*yzBasis[a];
-                          coefficients[coeff_index++]=temp[1]*yzBasis[a];
-                          coefficients[coeff_index++]=temp[2]*yzBasis[a];
-                          coefficients[coeff_index++]=temp[3]*yzBasis[a];
-                      }
-#endif
-                  } //x
-              } // y
-          } // z
-
-          // Loop over block of 5x5x5 voxels
-#if _USE_SSE
-          int coord;
-#endif // USE_SSE
-#if defined (_OPENMP)
-#ifdef _USE_SSE
-#pragma omp parallel for default(none) \
-   private(x, y, z, a, b, c, xPre, yPre, zPre, real, \
-   index, xyzBasis, temp, coeff_index, coord, tempX, tempY, tempZ, val,\
-   xControlPointCoordinates, yControlPointCoordinates, zControlPointCoordinates) \
-   shared(deformationField, fieldPtrX, fieldPtrY, fieldPtrZ, splineControlPoint, mask, \
-   gridVoxelSpacing, bspline, controlPointPtrX, controlPointPtrY, controlPointPtrZ, \
-   coefficients)
-#else //  _USE_SSE
-#pragma omp parallel for default(none) \
-   private(x, y, z, a, b, c, xPre, yPre, zPre, real, \
-   index, xyzBasis, temp, coeff_index, coord, basis, \
-   xControlPointCoordinates, yControlPointCoordinates, zControlPointCoordinates) \
-   shared(deformationField, fieldPtrX, fieldPtrY, fieldPtrZ, splineControlPoint, mask, \
-   gridVoxelSpacing, bspline, controlPointPtrX, controlPointPtrY, controlPointPtrZ, \
-   coefficients)
-#endif // _USE_SSE
-#endif // _OPENMP
-          for(zPre=0; zPre<splineControlPoint->nz-3; zPre++)
-          {
-              for(yPre=0; yPre<splineControlPoint->ny-3; yPre++)
-              {
-                  for(xPre=0; xPre<splineControlPoint->nx-3; xPre++)
-                  {
-#if _USE_SSE
-                      get_GridValues<DTYPE>(xPre,
-                                            yPre,
-                                            zPre,
-                                            splineControlPoint,
-                                            controlPointPtrX,
-                                            controlPointPtrY,
-                                            controlPointPtrZ,
-                                            xControlPointCoordinates.f,
-                                            yControlPointCoordinates.f,
-                                            zControlPointCoordinates.f,
-                                            false, // no approximation
-                                            false // not a deformation field
-                                            );
-#else // _USE_SSE
-                      get_GridValues<DTYPE>(xPre,
-                                            yPre,
-                                            zPre,
-                                            splineControlPoint,
-                                            controlPointPtrX,
-                                            controlPointPtrY,
-                                            controlPointPtrZ,
-                                            xControlPointCoordinates,
-                                            yControlPointCoordinates,
-                                            zControlPointCoordinates,
-                                            false, // no approximation
-                                            false // not a deformation field
-                                            );
-#endif // _USE_SSE
-                      coeff_index=0;
-                      for(c=0;c<5;++c){
-                          z = zPre*5+c;
-                          if(z<deformationField->nz){
-                              for(b=0;b<5;++b){
-                                  y = yPre*5+b;
-                                  if(y<deformationField->ny){
-                                      index = (z*deformationField->ny+y)*deformationField->nx+xPre*5;
-                                      for(a=0;a<5;++a){
-                                          x = xPre*5+a;
-                                          if(x<deformationField->nx && mask[index]>-1){
-#if _USE_SSE
-                                              tempX =  _mm_set_ps1(0.0);
-                                              tempY =  _mm_set_ps1(0.0);
-                                              tempZ =  _mm_set_ps1(0.0);
-                                              for(coord=0;coord<16;++coord){
-                                                  val.m = _mm_set_ps(coefficients[coeff_index+3],
-                                                        coefficients[coeff_index+2],
-                                                        coefficients[coeff_index+1],
-                                                        coefficients[coeff_index]);
-                                                  coeff_index+=4;
-                                                  tempX = _mm_add_ps(_mm_mul_ps(val.m,
-                                                                                xControlPointCoordinates.m[coord]),
-                                                                     tempX );
-                                                  tempY = _mm_add_ps(_mm_mul_ps(val.m,
-                                                                                yControlPointCoordinates.m[coord]),
-                                                                     tempY );
-                                                  tempZ = _mm_add_ps(_mm_mul_ps(val.m,
-                                                                                zControlPointCoordinates.m[coord]),
-                                                                     tempZ );
-                                              }
-                                              //the values stored in SSE variables are transfered to normal float
-#ifdef __SSE3__
-                                              val.m = _mm_hadd_ps(tempX, tempY);
-                                              val.m = _mm_hadd_ps(val.m, tempZ);
-                                              real[0] = val.f[0];
-                                              real[1] = val.f[1];
-                                              real[2] = val.f[2]+val.f[3];
-#else
-                                              val.m=tempX;
-                                              real[0]=val.f[0]+val.f[1]+val.f[2]+val.f[3];
-                                              val.m=tempY;
-                                              real[1]= val.f[0]+val.f[1]+val.f[2]+val.f[3];
-                                              val.m=tempZ;
-                                              real[2]= val.f[0]+val.f[1]+val.f[2]+val.f[3];
-#endif
-#else // _USE_SSE
-                                              real[0]=real[1]=real[2]=0;
-                                              for(coord=0;coord<64;++coord){
-                                                  basis = coefficients[coeff_index++];
-                                                  real[0] += xControlPointCoordinates[coord] * basis;
-                                                  real[1] += yControlPointCoordinates[coord] * basis;
-                                                  real[2] += zControlPointCoordinates[coord] * basis;
-                                              }
-#endif // _USE_SSE
-                                              fieldPtrX[index] = real[0];
-                                              fieldPtrY[index] = real[1];
-                                              fieldPtrZ[index] = real[2];
-                                          } // x defined
-                                          else coeff_index += 64;
-                                          index++;
-                                      } // a
-                                  } // y defined
-                                  else coeff_index += 5*64;
-                              } // b
-                          } // z defined
-                          else coeff_index += 5*5*64;
-                      } // c
-                  } // xPre
-              } // yPre
-          } // zPre
-          free(coefficients);
-      } // if spacings==5 voxels
-      else{
-
-#if defined (_OPENMP)
-#ifdef _USE_SSE
-#pragma omp parallel for default(none) \
-    private(x, y, z, a, b, c, oldPreX, oldPreY, oldPreZ, xPre, yPre, zPre, real, \
-    index, basis, xyzBasis, yzBasis, zBasis, temp, xControlPointCoordinates, \
-    yControlPointCoordinates, zControlPointCoordinates, oldBasis, \
-    tempX, tempY, tempZ, xBasis_sse, yBasis_sse, zBasis_sse, \
-    temp_basis_sse, basis_sse, val, tempCurrent) \
-    shared(deformationField, fieldPtrX, fieldPtrY, fieldPtrZ, splineControlPoint, mask, \
-    gridVoxelSpacing, bspline, controlPointPtrX, controlPointPtrY, controlPointPtrZ)
-#else //  _USE_SSE
-#pragma omp parallel for default(none) \
-    private(x, y, z, a, b, c, oldPreX, oldPreY, oldPreZ, xPre, yPre, zPre, real, \
-    index, basis, xyzBasis, yzBasis, zBasis, temp, xControlPointCoordinates, \
-    yControlPointCoordinates, zControlPointCoordinates, oldBasis, coord) \
-    shared(deformationField, fieldPtrX, fieldPtrY, fieldPtrZ, splineControlPoint, mask, \
-    gridVoxelSpacing, bspline, controlPointPtrX, controlPointPtrY, controlPointPtrZ)
-#endif // _USE_SSE
-#endif // _OPENMP
-          for(z=0; z<deformationField->nz; z++)
-          {
-
-              index=z*deformationField->nx*deformationField->ny;
-              oldBasis=1.1;
-
-              zPre=static_cast<int>(static_cast<DTYPE>(z)/gridVoxelSpacing[2]);
-              basis=static_cast<DTYPE>(z)/gridVoxelSpacing[2]-static_cast<DTYPE>(zPre);
-              if(basis<0.0) basis=0.0; //rounding error
-              if(bspline) get_BSplineBasisValues<DTYPE>(basis, zBasis);
-              else get_SplineBasisValues<DTYPE>(basis, zBasis);
-
-              for(y=0; y<deformationField->ny; y++)
-              {
-
-                  yPre=static_cast<int>(static_cast<DTYPE>(y)/gridVoxelSpacing[1]);
-                  basis=static_cast<DTYPE>(y)/gridVoxelSpacing[1]-static_cast<DTYPE>(yPre);
-                  if(basis<0.0) basis=0.0; //rounding error
-                  if(bspline) get_BSplineBasisValues<DTYPE>(basis, temp);
-                  else get_SplineBasisValues<DTYPE>(basis, temp);
-#if _USE_SSE
-                  val.f[0] = temp[0];
-                  val.f[1] = temp[1];
-                  val.f[2] = temp[2];
-                  val.f[3] = temp[3];
-                  tempCurrent=val.m;
-                  for(a=0; a<4; a++)
-                  {
-                      val.m=_mm_set_ps1(zBasis[a]);
-                      yzBasis.m[a] = _mm_mul_ps(tempCurrent,val.m);
-                  }
-#else
-                  coord=0;
-                  for(a=0; a<4; a++)
-                  {
-                      yzBasis[coord++]=temp[0]*zBasis[a];
-                      yzBasis[coord++]=temp[1]*zBasis[a];
-                      yzBasis[coord++]=temp[2]*zBasis[a];
-                      yzBasis[coord++]=temp[3]*zBasis[a];
-                  }
-#endif
-
-                  for(x=0; x<deformationField->nx; x++)
-                  {
-
-                      xPre=static_cast<int>(static_cast<DTYPE>(x)/gridVoxelSpacing[0]);
-                      basis=static_cast<DTYPE>(x)/gridVoxelSpacing[0]-static_cast<DTYPE>(xPre);
-                      if(basis<0.0) basis=0.0; //rounding error
-                      if(bspline) get_BSplineBasisValues<DTYPE>(basis, temp);
-                      else get_SplineBasisValues<DTYPE>(basis, temp);
-#if _USE_SSE
-
-                      val.f[0] = temp[0];
-                      val.f[1] = temp[1];
-                      val.f[2] = temp[2];
-                      val.f[3] = temp[3];
-                      tempCurrent=val.m;
-                      for(a=0; a<16; ++a)
-                      {
-                          val.m=_mm_set_ps1(yzBasis.f[a]);
-                          xyzBasis.m[a]=_mm_mul_ps(tempCurrent,val.m);
-                      }
-#else
-                      coord=0;
-                      for(a=0; a<16; a++)
-                      {
-                          xyzBasis[coord++]=temp[0]*yzBasis[a];
-                          xyzBasis[coord++]=temp[1]*yzBasis[a];
-                          xyzBasis[coord++]=temp[2]*yzBasis[a];
-                          xyzBasis[coord++]=temp[3]*yzBasis[a];
-                      }
-#endif
-                      if(basis<=oldBasis || x==0)
-                      {
-#ifdef _USE_SSE
-                          get_GridValues<DTYPE>(xPre,
-                                                yPre,
-                                                zPre,
-                                                splineControlPoint,
-                                                controlPointPtrX,
-                                                controlPointPtrY,
-                                                controlPointPtrZ,
-                                                xControlPointCoordinates.f,
-                                                yControlPointCoordinates.f,
-                                                zControlPointCoordinates.f,
-                                                false, // no approximation
-                                                false // not a deformation field
-                                                );
-#else // _USE_SSE
-                          get_GridValues<DTYPE>(xPre,
-                                                yPre,
-                                                zPre,
-                                                splineControlPoint,
-                                                controlPointPtrX,
-                                                controlPointPtrY,
-                                                controlPointPtrZ,
-                                                xControlPointCoordinates,
-                                                yControlPointCoordinates,
-                                                zControlPointCoordinates,
-                                                false, // no approximation
-                                                false // not a deformation field
-                                                );
-#endif // _USE_SSE
-                      }
-                      oldBasis=basis;
-
-                      real[0]=0.0;
-                      real[1]=0.0;
-                      real[2]=0.0;
-
-                      if(mask[index]>-1)
-                      {
-#if _USE_SSE
-                          tempX =  _mm_set_ps1(0.0);
-                          tempY =  _mm_set_ps1(0.0);
-                          tempZ =  _mm_set_ps1(0.0);
-                          //addition and multiplication of the 64 basis value and CP displacement for each axis
-                          for(a=0; a<16; a++)
-                          {
-                              tempX = _mm_add_ps(_mm_mul_ps(xyzBasis.m[a], xControlPointCoordinates.m[a]), tempX );
-                              tempY = _mm_add_ps(_mm_mul_ps(xyzBasis.m[a], yControlPointCoordinates.m[a]), tempY );
-                              tempZ = _mm_add_ps(_mm_mul_ps(xyzBasis.m[a], zControlPointCoordinates.m[a]), tempZ );
-                          }
-                          //the values stored in SSE variables are transfered to normal float
-                          val.m=tempX;
-                          real[0]=val.f[0]+val.f[1]+val.f[2]+val.f[3];
-                          val.m=tempY;
-                          real[1]= val.f[0]+val.f[1]+val.f[2]+val.f[3];
-                          val.m=tempZ;
-                          real[2]= val.f[0]+val.f[1]+val.f[2]+val.f[3];
-#else
-                          for(a=0; a<64; a++)
-                          {
-                              real[0] += xControlPointCoordinates[a] * xyzBasis[a];
-                              real[1] += yControlPointCoordinates[a] * xyzBasis[a];
-                              real[2] += zControlPointCoordinates[a] * xyzBasis[a];
-                          }
-#endif
-                      }// mask
-                      fieldPtrX[index] = real[0];
-                      fieldPtrY[index] = real[1];
-                      fieldPtrZ[index] = real[2];
-                      index++;
-                  } // x
-              } // y
-          } // z
-      } // else spacing==5
+      reg_cubic_spline_getDeformationField3D_cells<DTYPE>(splineControlPoint,
+                                                          deformationField,
+                                                          mask,
+                                                          bspline);
    }// from a deformation field
 
    return;
@@ -1623,7 +1308,7 @@ void reg_spline_getDeformationField(nifti_image *splineControlPoint,
                                     int *mask,
                                     bool composition,
                                     bool bspline,
-                                    bool force_no_lut)
+                                    bool /* force_no_lut */)
 {
    if(splineControlPoint->datatype != deformationField->datatype)
    {
@@ -1708,10 +1393,10 @@ void reg_spline_getDeformationField(nifti_image *splineControlPoint,
          switch(deformationField->datatype)
          {
          case NIFTI_TYPE_FLOAT32:
-            reg_cubic_spline_getDeformationField3D<float>(splineControlPoint, deformationField, mask, composition, bspline, force_no_lut);
+            reg_cubic_spline_getDeformationField3D<float>(splineControlPoint, deformationField, mask, composition, bspline);
             break;
          case NIFTI_TYPE_FLOAT64:
-            reg_cubic_spline_getDeformationField3D<double>(splineControlPoint, deformationField, mask, composition, bspline, force_no_lut);
+            reg_cubic_spline_getDeformationField3D<double>(splineControlPoint, deformationField, mask, composition, bspline);
             break;
          default:
             reg_print_fct_error("reg_spline_getDeformationField");
@@ -1947,26 +1632,336 @@ void reg_voxelCentric2NodeCentric(nifti_image *nodeImage,
    }
 }
 /* *************************************************************** */
-/* *************************************************************** */
-template<class SplineTYPE>
-SplineTYPE GetValue(SplineTYPE *array, int *dim, int x, int y, int z)
+/// @brief Adds the values accumulated for the 4x4x4 nodes supporting a
+/// cell to the node image and resets them
+template<class DTYPE>
+static void reg_spline_addCellToNodes(DTYPE *cellAcc,
+                                      const int *pre,
+                                      const int *nodeDim,
+                                      size_t nodeNumber,
+                                      int ndim,
+                                      DTYPE *nodeAcc)
 {
-   if(x<0 || x>= dim[1] || y<0 || y>= dim[2] || z<0 || z>= dim[3])
-      return 0.0;
-   return array[(z*dim[2]+y)*dim[1]+x];
+   size_t nodeIndex;
+   for(int c=0; c<(ndim==3?4:1); ++c)
+   {
+      if(ndim==3 && (pre[2]-1+c<0 || pre[2]-1+c>=nodeDim[2])) continue;
+      for(int b=0; b<4; ++b)
+      {
+         if(pre[1]-1+b<0 || pre[1]-1+b>=nodeDim[1]) continue;
+         nodeIndex=((size_t)(pre[2]-1+c)*nodeDim[1]+pre[1]-1+b)*nodeDim[0];
+         for(int a=0; a<4; ++a)
+         {
+            if(pre[0]-1+a<0 || pre[0]-1+a>=nodeDim[0]) continue;
+            for(int i=0; i<ndim; ++i)
+               nodeAcc[i*nodeNumber+nodeIndex+pre[0]-1+a] += cellAcc[i*64+(c*4+b)*4+a];
+         }
+      }
+   }
+   for(int i=0; i<192; ++i)
+      cellAcc[i]=0;
 }
 /* *************************************************************** */
-template<class SplineTYPE>
-void SetValue(SplineTYPE *array, int *dim, int x, int y, int z, SplineTYPE value)
+template<class DTYPE>
+void reg_spline_voxelCentric2NodeCentric_core(nifti_image *nodeImage,
+                                              nifti_image *voxelImage,
+                                              float weight,
+                                              bool update,
+                                              mat44 *voxelToMillimeter
+                                              )
 {
-   if(x<0 || x>= dim[1] || y<0 || y>= dim[2] || z<0 || z>= dim[3])
-      return;
-   array[(z*dim[2]+y)*dim[1]+x] = value;
-}
-/* *************************************************************** */
-template<class SplineTYPE>
-void reg_spline_refineControlPointGrid2D(nifti_image *splineControlPoint,
-                                         nifti_image *referenceImage)
+   const size_t nodeNumber = (size_t)nodeImage->nx*nodeImage->ny*nodeImage->nz;
+   const size_t voxelNumber = (size_t)voxelImage->nx*voxelImage->ny*voxelImage->nz;
+   const int ndim = voxelImage->nz>1?3:2;
+   DTYPE *nodePtr = static_cast<DTYPE *>(nodeImage->data);
+   DTYPE *voxelPtrX = static_cast<DTYPE *>(voxelImage->data);
+   DTYPE *voxelPtrY = &voxelPtrX[voxelNumber];
+   DTYPE *voxelPtrZ = ndim==3?&voxelPtrY[voxelNumber]:NULL;
+
+   // The transformation between the image and the grid is used
+   mat44 transformation;
+   // voxel to millimeter in the grid image
+   if(nodeImage->sform_code>0)
+      transformation=nodeImage->sto_xyz;
+   else transformation=nodeImage->qto_xyz;
+   // Affine transformation between the grid and the reference image
+   if(nodeImage->num_ext>0)
+   {
+      if(nodeImage->ext_list[0].edata!=NULL)
+      {
+         mat44 temp=*(reinterpret_cast<mat44 *>(nodeImage->ext_list[0].edata));
+         temp=nifti_mat44_inverse(temp);
+         transformation = reg_mat44_mul(&temp,&transformation);
+      }
+   }
+   // millimeter to voxel in the reference image
+   if(voxelImage->sform_code>0)
+      transformation = reg_mat44_mul(&voxelImage->sto_ijk,&transformation);
+   else transformation = reg_mat44_mul(&voxelImage->qto_ijk,&transformation);
+   // The voxel positions are expressed in the grid voxel space
+   const mat44 voxelToNode = nifti_mat44_inverse(transformation);
+
+   // The information has to be reoriented
+   mat33 reorientation;
+   if(voxelToMillimeter!=NULL)
+   {
+      reorientation=reg_mat44_to_mat33(voxelToMillimeter);
+      if(nodeImage->num_ext>0)
+      {
+         if(nodeImage->ext_list[0].edata!=NULL)
+         {
+            mat33 temp = reg_mat44_to_mat33(reinterpret_cast<mat44 *>(nodeImage->ext_list[0].edata));
+            temp=nifti_mat33_inverse(temp);
+            reorientation = nifti_mat33_mul(temp,reorientation);
+         }
+      }
+   }
+   else reg_mat33_eye(&reorientation);
+
+   // When the grid x axis is aligned with the image lines, the y and z
+   // basis values are shared by all the voxels of a line. The line is then
+   // first projected onto a line of nodes, which is spread afterwards
+   const bool lineAligned = fabs(voxelToNode.m[1][0])<1.e-6 && fabs(voxelToNode.m[2][0])<1.e-6;
+
+   // Every thread accumulates into its own copy of the node gradient
+   int threadNumber = 1;
+#if defined (_OPENMP)
+   threadNumber=omp_get_max_threads();
+#endif
+   DTYPE *accumulator = (DTYPE *)calloc((size_t)threadNumber*nodeNumber*ndim, sizeof(DTYPE));
+   const int nodeDim[3]={nodeImage->nx, nodeImage->ny, nodeImage->nz};
+   const int zRange = ndim==3?4:1;
+   const int lineNodeNumber = nodeDim[0]+6;
+
+   int tid=0, x, y, z, a, b, c, i, pre[3];
+   size_t index, nodeIndex;
+   DTYPE nodePos[3], basis, xBasis[4], yBasis[4], zBasis[4]={1,0,0,0}, yzBasis[16];
+   DTYPE gradient[3]={0,0,0}, cellBasis[64], cellAcc[192]={0}, *threadAcc, *lineAcc;
+   int cellPre[3];
+#if defined (_OPENMP)
+#pragma omp parallel default(none) \
+   shared(voxelImage, voxelPtrX, voxelPtrY, voxelPtrZ, voxelToNode, accumulator, nodeDim, \
+   nodeNumber, ndim, zRange, lineAligned, lineNodeNumber) \
+   private(tid, x, y, z, a, b, c, i, pre, index, nodeIndex, nodePos, basis, \
+   xBasis, yBasis, yzBasis, cellBasis, cellPre, threadAcc, lineAcc) \
+   firstprivate(zBasis, gradient, cellAcc)
+#endif
+   {
+#if defined (_OPENMP)
+      tid=omp_get_thread_num();
+#endif
+      threadAcc = &accumulator[(size_t)tid*nodeNumber*ndim];
+      lineAcc = (DTYPE *)malloc(lineNodeNumber*ndim*sizeof(DTYPE));
+#if defined (_OPENMP)
+#pragma omp for schedule(static)
+#endif
+      for(z=0; z<voxelImage->nz; ++z)
+      {
+         for(y=0; y<voxelImage->ny; ++y)
+         {
+            index=((size_t)z*voxelImage->ny+y)*voxelImage->nx;
+            if(lineAligned)
+            {
+               // The y and z node positions are constant along the line
+               nodePos[1]=voxelToNode.m[1][1]*y+voxelToNode.m[1][2]*z+voxelToNode.m[1][3];
+               nodePos[2]=voxelToNode.m[2][1]*y+voxelToNode.m[2][2]*z+voxelToNode.m[2][3];
+               pre[1]=static_cast<int>(reg_floor(nodePos[1]));
+               get_BSplineBasisValues<DTYPE>(nodePos[1]-pre[1], yBasis);
+               if(ndim==3)
+               {
+                  pre[2]=static_cast<int>(reg_floor(nodePos[2]));
+                  get_BSplineBasisValues<DTYPE>(nodePos[2]-pre[2], zBasis);
+               }
+               else pre[2]=1;
+               for(i=0; i<lineNodeNumber*ndim; ++i)
+                  lineAcc[i]=0;
+               // The line is projected onto the x axis of the grid. The
+               // line of nodes is shifted by three to include the nodes
+               // before the first one
+               for(x=0; x<voxelImage->nx; ++x, ++index)
+               {
+                  gradient[0]=voxelPtrX[index];
+                  gradient[1]=voxelPtrY[index];
+                  if(ndim==3) gradient[2]=voxelPtrZ[index];
+                  if(gradient[0]!=gradient[0] || gradient[1]!=gradient[1] ||
+                        gradient[2]!=gradient[2])
+                     continue;
+                  nodePos[0]=voxelToNode.m[0][0]*x+voxelToNode.m[0][1]*y+
+                        voxelToNode.m[0][2]*z+voxelToNode.m[0][3];
+                  pre[0]=static_cast<int>(reg_floor(nodePos[0]));
+                  if(pre[0]<-2 || pre[0]>nodeDim[0]) continue;
+                  get_BSplineBasisValues<DTYPE>(nodePos[0]-pre[0], xBasis);
+                  for(a=0; a<4; ++a)
+                  {
+                     nodeIndex=pre[0]+a+2;
+                     lineAcc[nodeIndex] += xBasis[a]*gradient[0];
+                     lineAcc[lineNodeNumber+nodeIndex] += xBasis[a]*gradient[1];
+                     if(ndim==3)
+                        lineAcc[2*lineNodeNumber+nodeIndex] += xBasis[a]*gradient[2];
+                  }
+               }
+               // The projected line is spread over the y and z nodes
+               for(c=0; c<zRange; ++c)
+                  for(b=0; b<4; ++b)
+                     yzBasis[c*4+b]=yBasis[b]*zBasis[c];
+               for(c=0; c<zRange; ++c)
+               {
+                  if(pre[2]-1+c<0 || pre[2]-1+c>=nodeDim[2]) continue;
+                  for(b=0; b<4; ++b)
+                  {
+                     if(pre[1]-1+b<0 || pre[1]-1+b>=nodeDim[1]) continue;
+                     basis=yzBasis[c*4+b];
+                     nodeIndex=((size_t)(pre[2]-1+c)*nodeDim[1]+pre[1]-1+b)*nodeDim[0];
+                     for(a=0; a<nodeDim[0]; ++a)
+                     {
+                        threadAcc[nodeIndex+a] += basis*lineAcc[a+3];
+                        threadAcc[nodeNumber+nodeIndex+a] += basis*lineAcc[lineNodeNumber+a+3];
+                        if(ndim==3)
+                           threadAcc[2*nodeNumber+nodeIndex+a] += basis*lineAcc[2*lineNodeNumber+a+3];
+                     }
+                  }
+               }
+            }
+            else
+            {
+               // Every voxel is spread over its 4x4x4 supporting nodes. The
+               // consecutive voxels of a line mostly share the same nodes,
+               // whose values are accumulated locally until the nodes change
+               cellPre[0]=cellPre[1]=cellPre[2]=99999;
+               for(x=0; x<voxelImage->nx; ++x, ++index)
+               {
+                  gradient[0]=voxelPtrX[index];
+                  gradient[1]=voxelPtrY[index];
+                  if(ndim==3) gradient[2]=voxelPtrZ[index];
+                  if(gradient[0]!=gradient[0] || gradient[1]!=gradient[1] ||
+                        gradient[2]!=gradient[2])
+                     continue;
+                  for(i=0; i<3; ++i)
+                     nodePos[i]=voxelToNode.m[i][0]*x+voxelToNode.m[i][1]*y+
+                           voxelToNode.m[i][2]*z+voxelToNode.m[i][3];
+                  pre[0]=static_cast<int>(reg_floor(nodePos[0]));
+                  pre[1]=static_cast<int>(reg_floor(nodePos[1]));
+                  get_BSplineBasisValues<DTYPE>(nodePos[0]-pre[0], xBasis);
+                  get_BSplineBasisValues<DTYPE>(nodePos[1]-pre[1], yBasis);
+                  if(ndim==3)
+                  {
+                     pre[2]=static_cast<int>(reg_floor(nodePos[2]));
+                     get_BSplineBasisValues<DTYPE>(nodePos[2]-pre[2], zBasis);
+                  }
+                  else pre[2]=1;
+                  if(pre[0]!=cellPre[0] || pre[1]!=cellPre[1] || pre[2]!=cellPre[2])
+                  {
+                     if(cellPre[0]!=99999)
+                        reg_spline_addCellToNodes<DTYPE>(cellAcc, cellPre, nodeDim,
+                                                         nodeNumber, ndim, threadAcc);
+                     cellPre[0]=pre[0];
+                     cellPre[1]=pre[1];
+                     cellPre[2]=pre[2];
+                  }
+                  for(c=0; c<zRange; ++c)
+                     for(b=0; b<4; ++b)
+                        for(a=0; a<4; ++a)
+                           cellBasis[(c*4+b)*4+a]=xBasis[a]*yBasis[b]*zBasis[c];
+                  for(i=0; i<zRange*16; ++i)
+                  {
+                     cellAcc[i] += cellBasis[i]*gradient[0];
+                     cellAcc[64+i] += cellBasis[i]*gradient[1];
+                     cellAcc[128+i] += cellBasis[i]*gradient[2];
+                  }
+               }
+               if(cellPre[0]!=99999)
+                  reg_spline_addCellToNodes<DTYPE>(cellAcc, cellPre, nodeDim,
+                                                   nodeNumber, ndim, threadAcc);
+            }
+         }
+      }
+      free(lineAcc);
+   }
+
+   // The thread accumulators are summed, reoriented and weighted
+   DTYPE summed[3]={0,0,0}, reorientedValue[3];
+   size_t n;
+   int t;
+#if defined (_OPENMP)
+#pragma omp parallel for default(none) \
+   shared(nodePtr, accumulator, nodeNumber, ndim, threadNumber, reorientation, weight, update) \
+   private(n, t, i, reorientedValue) \
+   firstprivate(summed)
+#endif
+   for(n=0; n<nodeNumber; ++n)
+   {
+      for(i=0; i<ndim; ++i)
+      {
+         summed[i]=0;
+         for(t=0; t<threadNumber; ++t)
+            summed[i] += accumulator[((size_t)t*ndim+i)*nodeNumber+n];
+      }
+      for(i=0; i<ndim; ++i)
+      {
+         reorientedValue[i] =
+               reorientation.m[0][i] * summed[0] +
+               reorientation.m[1][i] * summed[1] +
+               reorientation.m[2][i] * summed[2] ;
+         if(update)
+            nodePtr[i*nodeNumber+n] += reorientedValue[i]*static_cast<DTYPE>(weight);
+         else nodePtr[i*nodeNumber+n] = reorientedValue[i]*static_cast<DTYPE>(weight);
+      }
+   }
+   free(accumulator);
+}
+/* *************************************************************** */
+extern "C++"
+void reg_spline_voxelCentric2NodeCentric(nifti_image *nodeImage,
+                                         nifti_image *voxelImage,
+                                         float weight,
+                                         bool update,
+                                         mat44 *voxelToMillimeter
+                                         )
+{
+   if(nodeImage->datatype!=voxelImage->datatype)
+   {
+      reg_print_fct_error("reg_spline_voxelCentric2NodeCentric");
+      reg_print_msg_error("Both input images do not have the same type");
+      reg_exit();
+   }
+
+   switch(nodeImage->datatype)
+   {
+   case NIFTI_TYPE_FLOAT32:
+      reg_spline_voxelCentric2NodeCentric_core<float>
+            (nodeImage, voxelImage, weight, update, voxelToMillimeter);
+      break;
+   case NIFTI_TYPE_FLOAT64:
+      reg_spline_voxelCentric2NodeCentric_core<double>
+            (nodeImage, voxelImage, weight, update, voxelToMillimeter);
+      break;
+   default:
+      reg_print_fct_error("reg_spline_voxelCentric2NodeCentric");
+      reg_print_msg_error("Data type not supported");
+      reg_exit();
+   }
+}
+/* *************************************************************** */
+/* *************************************************************** */
+template<class SplineTYPE>
+SplineTYPE GetValue(SplineTYPE *array, int *dim, int x, int y, int z)
+{
+   if(x<0 || x>= dim[1] || y<0 || y>= dim[2] || z<0 || z>= dim[3])
+      return 0.0;
+   return array[(z*dim[2]+y)*dim[1]+x];
+}
+/* *************************************************************** */
+template<class SplineTYPE>
+void SetValue(SplineTYPE *array, int *dim, int x, int y, int z, SplineTYPE value)
+{
+   if(x<0 || x>= dim[1] || y<0 || y>= dim[2] || z<0 || z>= dim[3])
+      return;
+   array[(z*dim[2]+y)*dim[1]+x] = value;
+}
+/* *************************************************************** */
+template<class SplineTYPE>
+void reg_spline_refineControlPointGrid2D(nifti_image *splineControlPoint,
+                                         nifti_image *referenceImage)
 {
    // The input grid is first saved
    SplineTYPE *oldGrid = (SplineTYPE *)malloc(splineControlPoint->nvox*splineControlPoint->nbyper);
@@ -2548,9 +2543,145 @@ void reg_spline_refineControlPointGrid(nifti_image *controlPointGrid,
    return;
 }
 /* *************************************************************** */
+template<class DTYPE>
+void reg_spline_extendControlPointGrid1(nifti_image **controlPointGridImage,
+                                        nifti_image *referenceImage,
+                                        mat44 *affineTransformation)
+{
+   nifti_image *oldGrid=*controlPointGridImage;
+   int oldDim[3]={oldGrid->nx, oldGrid->ny, oldGrid->nz};
+   int dimNumber=oldGrid->nz>1?3:2;
+
+   mat44 *referenceMatrix_xyz = referenceImage->sform_code>0 ?
+            &referenceImage->sto_xyz : &referenceImage->qto_xyz;
+   mat44 *oldGridMatrix_xyz = oldGrid->sform_code>0 ?
+            &oldGrid->sto_xyz : &oldGrid->qto_xyz;
+   mat44 *oldGridMatrix_ijk = oldGrid->sform_code>0 ?
+            &oldGrid->sto_ijk : &oldGrid->qto_ijk;
+   mat44 referenceToGrid = reg_mat44_mul(oldGridMatrix_ijk, referenceMatrix_xyz);
+
+   // The node range required by the cubic B-Spline support over every
+   // reference image corner is computed in the current grid indices
+   int first[3]={0,0,0}, last[3]={oldDim[0]-1, oldDim[1]-1, oldDim[2]-1};
+   for(int c=0; c<8; ++c)
+   {
+      float corner[3]={(c&1)?(float)(referenceImage->nx-1):0.f,
+                       (c&2)?(float)(referenceImage->ny-1):0.f,
+                       (c&4)?(float)(referenceImage->nz-1):0.f};
+      float gridPosition[3];
+      reg_mat44_mul(&referenceToGrid, corner, gridPosition);
+      for(int d=0; d<dimNumber; ++d)
+      {
+         // Corners that lie on a node up to the rounding error of the
+         // transformation are snapped onto it, so that a corner at 0.9999999
+         // does not require an extra node
+         double position=gridPosition[d];
+         if(fabs(position-(double)reg_round(position))<1.0e-4)
+            position=(double)reg_round(position);
+         int node=static_cast<int>(floor(position));
+         if(node-1<first[d]) first[d]=node-1;
+         if(node+2>last[d]) last[d]=node+2;
+      }
+   }
+   if(first[0]==0 && first[1]==0 && first[2]==0 &&
+         last[0]==oldDim[0]-1 && last[1]==oldDim[1]-1 && last[2]==oldDim[2]-1)
+      return;
+
+   // Create the extended grid. Its nodes lie on the lattice of the current grid
+   nifti_image *newGrid=nifti_copy_nim_info(oldGrid);
+   newGrid->dim[1]=newGrid->nx=last[0]-first[0]+1;
+   newGrid->dim[2]=newGrid->ny=last[1]-first[1]+1;
+   newGrid->dim[3]=newGrid->nz=last[2]-first[2]+1;
+   newGrid->nvox=(size_t)newGrid->nx*newGrid->ny*newGrid->nz*newGrid->nt*newGrid->nu;
+   newGrid->data=(void *)malloc(newGrid->nvox*newGrid->nbyper);
+   float originIndex[3]={(float)first[0], (float)first[1], (float)first[2]};
+   float originReal[3];
+   reg_mat44_mul(&oldGrid->qto_xyz, originIndex, originReal);
+   newGrid->qto_xyz.m[0][3]=newGrid->qoffset_x=originReal[0];
+   newGrid->qto_xyz.m[1][3]=newGrid->qoffset_y=originReal[1];
+   newGrid->qto_xyz.m[2][3]=newGrid->qoffset_z=originReal[2];
+   newGrid->qto_ijk=nifti_mat44_inverse(newGrid->qto_xyz);
+   if(oldGrid->sform_code>0)
+   {
+      reg_mat44_mul(&oldGrid->sto_xyz, originIndex, originReal);
+      newGrid->sto_xyz.m[0][3]=originReal[0];
+      newGrid->sto_xyz.m[1][3]=originReal[1];
+      newGrid->sto_xyz.m[2][3]=originReal[2];
+      newGrid->sto_ijk=nifti_mat44_inverse(newGrid->sto_xyz);
+   }
+
+   size_t oldNodeNumber=(size_t)oldDim[0]*oldDim[1]*oldDim[2];
+   size_t newNodeNumber=(size_t)newGrid->nx*newGrid->ny*newGrid->nz;
+   DTYPE *oldPtr=static_cast<DTYPE *>(oldGrid->data);
+   DTYPE *newPtr=static_cast<DTYPE *>(newGrid->data);
+
+   // Existing nodes are copied. The added nodes follow the affine
+   // transformation (or the identity) plus the residual displacement of
+   // the closest existing node
+   size_t newIndex=0;
+   for(int z=first[2]; z<=last[2]; ++z)
+   {
+      int oldZ=z<0?0:(z>=oldDim[2]?oldDim[2]-1:z);
+      for(int y=first[1]; y<=last[1]; ++y)
+      {
+         int oldY=y<0?0:(y>=oldDim[1]?oldDim[1]-1:y);
+         for(int x=first[0]; x<=last[0]; ++x, ++newIndex)
+         {
+            int oldX=x<0?0:(x>=oldDim[0]?oldDim[0]-1:x);
+            size_t oldIndex=((size_t)oldZ*oldDim[1]+oldY)*oldDim[0]+oldX;
+            if(oldX==x && oldY==y && oldZ==z)
+            {
+               for(int d=0; d<dimNumber; ++d)
+                  newPtr[d*newNodeNumber+newIndex]=oldPtr[d*oldNodeNumber+oldIndex];
+               continue;
+            }
+            float newNode[3]={(float)x, (float)y, (float)z};
+            float oldNode[3]={(float)oldX, (float)oldY, (float)oldZ};
+            float newPosition[3], oldPosition[3];
+            reg_mat44_mul(oldGridMatrix_xyz, newNode, newPosition);
+            reg_mat44_mul(oldGridMatrix_xyz, oldNode, oldPosition);
+            if(affineTransformation!=NULL)
+            {
+               float temp[3]={newPosition[0], newPosition[1], newPosition[2]};
+               reg_mat44_mul(affineTransformation, temp, newPosition);
+               temp[0]=oldPosition[0];
+               temp[1]=oldPosition[1];
+               temp[2]=oldPosition[2];
+               reg_mat44_mul(affineTransformation, temp, oldPosition);
+            }
+            for(int d=0; d<dimNumber; ++d)
+               newPtr[d*newNodeNumber+newIndex]=static_cast<DTYPE>(newPosition[d] +
+                     oldPtr[d*oldNodeNumber+oldIndex] - oldPosition[d]);
+         }
+      }
+   }
+   nifti_image_free(oldGrid);
+   *controlPointGridImage=newGrid;
+}
+/* *************************************************************** */
+void reg_spline_extendControlPointGrid(nifti_image **controlPointGridImage,
+                                       nifti_image *referenceImage,
+                                       mat44 *affineTransformation)
+{
+   switch((*controlPointGridImage)->datatype)
+   {
+   case NIFTI_TYPE_FLOAT32:
+      reg_spline_extendControlPointGrid1<float>(controlPointGridImage, referenceImage, affineTransformation);
+      break;
+   case NIFTI_TYPE_FLOAT64:
+      reg_spline_extendControlPointGrid1<double>(controlPointGridImage, referenceImage, affineTransformation);
+      break;
+   default:
+      reg_print_fct_error("reg_spline_extendControlPointGrid");
+      reg_print_msg_error("Only single or double precision is implemented for the control point grid");
+      reg_exit();
+   }
+}
+/* *************************************************************** */
 /* *************************************************************** */
 template <class DTYPE>
 void reg_defField_compose2D(nifti_image *deformationField,
+                            nifti_image *positionField,
                             nifti_image *dfToUpdate,
                             int *mask)
 {
@@ -2565,6 +2696,9 @@ void reg_defField_compose2D(nifti_image *deformationField,
    DTYPE *defPtrX = static_cast<DTYPE *>(deformationField->data);
    DTYPE *defPtrY = &defPtrX[DFVoxelNumber];
 
+   DTYPE *posPtrX = static_cast<DTYPE *>(positionField->data);
+   DTYPE *posPtrY = &posPtrX[warVoxelNumber];
+
    DTYPE *resPtrX = static_cast<DTYPE *>(dfToUpdate->data);
    DTYPE *resPtrY = &resPtrX[warVoxelNumber];
 
@@ -2588,16 +2722,16 @@ void reg_defField_compose2D(nifti_image *deformationField,
 #if defined (_OPENMP)
 #pragma omp parallel for default(none) \
    shared(warVoxelNumber, mask, df_real2Voxel, df_voxel2Real, \
-   deformationField, defPtrX, defPtrY, resPtrX, resPtrY) \
+   deformationField, defPtrX, defPtrY, posPtrX, posPtrY, resPtrX, resPtrY) \
    private(i, a, b, index, pre,realDefX, realDefY, voxelX, voxelY, \
    defX, defY, relX, relY, basis)
 #endif
    for(i=0; i<warVoxelNumber; ++i)
    {
-      if(mask[i]>-1)
+      if(mask==NULL || mask[i]>-1)
       {
-         realDefX = resPtrX[i];
-         realDefY = resPtrY[i];
+         realDefX = posPtrX[i];
+         realDefY = posPtrY[i];
 
          // Conversion from real to voxel in the deformation field
          voxelX = realDefX * df_real2Voxel->m[0][0]
@@ -2649,30 +2783,35 @@ void reg_defField_compose2D(nifti_image *deformationField,
          resPtrX[i]=realDefX;
          resPtrY[i]=realDefY;
       }// mask
+      else
+      {
+         // The voxels outside of the mask keep their position
+         resPtrX[i]=posPtrX[i];
+         resPtrY[i]=posPtrY[i];
+      }
    }// loop over every voxel
 }
 /* *************************************************************** */
 template <class DTYPE>
 void reg_defField_compose3D(nifti_image *deformationField,
+                            nifti_image *positionField,
                             nifti_image *dfToUpdate,
                             int *mask)
 {
    const int DefFieldDim[3]= {deformationField->nx,deformationField->ny,deformationField->nz};
    const size_t DFVoxelNumber=(size_t)DefFieldDim[0]*DefFieldDim[1]*DefFieldDim[2];
-#ifdef _WIN32
-   long i;
-   long warVoxelNumber=(size_t)dfToUpdate->nx*
-         dfToUpdate->ny*dfToUpdate->nz;
-#else
-   size_t i;
-   size_t warVoxelNumber=(size_t)dfToUpdate->nx*
-         dfToUpdate->ny*dfToUpdate->nz;
-#endif
+   const size_t DFPlaneNumber=(size_t)DefFieldDim[0]*DefFieldDim[1];
+   int warDim[3]= {dfToUpdate->nx,dfToUpdate->ny,dfToUpdate->nz};
+   const size_t warVoxelNumber=(size_t)warDim[0]*warDim[1]*warDim[2];
 
    DTYPE *defPtrX = static_cast<DTYPE *>(deformationField->data);
    DTYPE *defPtrY = &defPtrX[DFVoxelNumber];
    DTYPE *defPtrZ = &defPtrY[DFVoxelNumber];
 
+   DTYPE *posPtrX = static_cast<DTYPE *>(positionField->data);
+   DTYPE *posPtrY = &posPtrX[warVoxelNumber];
+   DTYPE *posPtrZ = &posPtrY[warVoxelNumber];
+
    DTYPE *resPtrX = static_cast<DTYPE *>(dfToUpdate->data);
    DTYPE *resPtrY = &resPtrX[warVoxelNumber];
    DTYPE *resPtrZ = &resPtrY[warVoxelNumber];
@@ -2694,139 +2833,198 @@ void reg_defField_compose3D(nifti_image *deformationField,
       df_voxel2Real=&deformationField->qto_xyz;
    }
 
-   size_t tempIndex, index;
+   // The voxels are processed tile by tile so that the deformation vectors
+   // read for neighbouring voxels remain in cache. The voxel positions of a
+   // tile line are computed first, in a loop the compiler vectorises
+   int tileNumber[3], tile, tileStart[3], tileEnd[3], x, y, z, lineLength;
+   int tileCount = reg_getTileNumber(warDim, tileNumber);
+   DTYPE lineVoxelX[REG_TILE_SIZE_X], lineVoxelY[REG_TILE_SIZE_X], lineVoxelZ[REG_TILE_SIZE_X];
+
+   size_t i, tempIndex, index;
    int a, b, c, currentX, currentY, currentZ, pre[3];
-   DTYPE realDef[3], voxel[3], basis, tempBasis;
+   DTYPE realDef[3], basis, tempBasis;
    DTYPE defX, defY, defZ, relX[2], relY[2], relZ[2];
    bool inY, inZ;
 #if defined (_OPENMP)
-#pragma omp parallel for default(none) \
-   shared(warVoxelNumber, mask, df_real2Voxel, df_voxel2Real, DefFieldDim, \
-   defPtrX, defPtrY, defPtrZ, resPtrX, resPtrY, resPtrZ, deformationField) \
-   private(i, a, b, c, currentX, currentY, currentZ, index, tempIndex, pre, \
-   realDef, voxel, tempBasis, defX, defY, defZ, relX, relY, relZ, basis, inY, inZ)
+#pragma omp parallel for default(none) schedule(dynamic) \
+   shared(mask, df_real2Voxel, df_voxel2Real, DefFieldDim, DFPlaneNumber, \
+   defPtrX, defPtrY, defPtrZ, posPtrX, posPtrY, posPtrZ, \
+   resPtrX, resPtrY, resPtrZ, deformationField, warDim, tileNumber, tileCount) \
+   private(tile, tileStart, tileEnd, x, y, z, lineLength, lineVoxelX, lineVoxelY, lineVoxelZ, \
+   i, a, b, c, currentX, currentY, currentZ, index, tempIndex, pre, \
+   realDef, tempBasis, defX, defY, defZ, relX, relY, relZ, basis, inY, inZ)
 #endif
-   for(i=0; i<warVoxelNumber; ++i)
+   for(tile=0; tile<tileCount; tile++)
    {
-      if(mask[i]>-1)
+      reg_getTileBounds(tile, warDim, tileNumber, tileStart, tileEnd);
+      lineLength=tileEnd[0]-tileStart[0];
+      for(z=tileStart[2]; z<tileEnd[2]; z++)
       {
-         // Conversion from real to voxel in the deformation field
-         realDef[0] = resPtrX[i];
-         realDef[1] = resPtrY[i];
-         realDef[2] = resPtrZ[i];
-         voxel[0] =
-               df_real2Voxel.m[0][0] * realDef[0] +
-               df_real2Voxel.m[0][1] * realDef[1] +
-               df_real2Voxel.m[0][2] * realDef[2] +
-               df_real2Voxel.m[0][3] ;
-         voxel[1] =
-               df_real2Voxel.m[1][0] * realDef[0] +
-               df_real2Voxel.m[1][1] * realDef[1] +
-               df_real2Voxel.m[1][2] * realDef[2] +
-               df_real2Voxel.m[1][3] ;
-         voxel[2] =
-               df_real2Voxel.m[2][0] * realDef[0] +
-               df_real2Voxel.m[2][1] * realDef[1] +
-               df_real2Voxel.m[2][2] * realDef[2] +
-               df_real2Voxel.m[2][3] ;
-         //reg_mat44_mul(df_real2Voxel, realDef, voxel);
-
-         // Linear interpolation to compute the new deformation
-         pre[0]=static_cast<int>reg_floor(voxel[0]);
-         pre[1]=static_cast<int>reg_floor(voxel[1]);
-         pre[2]=static_cast<int>reg_floor(voxel[2]);
-         relX[1]=voxel[0]-static_cast<DTYPE>(pre[0]);
-         relX[0]=1.-relX[1];
-         relY[1]=voxel[1]-static_cast<DTYPE>(pre[1]);
-         relY[0]=1.-relY[1];
-         relZ[1]=voxel[2]-static_cast<DTYPE>(pre[2]);
-         relZ[0]=1.-relZ[1];
-         realDef[0]=realDef[1]=realDef[2]=0.;
-         for(c=0; c<2; ++c)
+         for(y=tileStart[1]; y<tileEnd[1]; y++)
          {
-            currentZ = pre[2]+c;
-            tempIndex=currentZ*DefFieldDim[0]*DefFieldDim[1];
-            if(currentZ>-1 && currentZ<DefFieldDim[2]) inZ=true;
-            else inZ=false;
-            for(b=0; b<2; ++b)
+            i=((size_t)z*warDim[1]+y)*warDim[0]+tileStart[0];
+
+            // Conversion from real to voxel in the deformation field
+            for(x=0; x<lineLength; ++x)
             {
-               currentY = pre[1]+b;
-               index=tempIndex+currentY*DefFieldDim[0] + pre[0];
-               tempBasis= relY[b] * relZ[c];
-               if(currentY>-1 && currentY<DefFieldDim[1]) inY=true;
-               else inY=false;
-               for(a=0; a<2; ++a)
+               lineVoxelX[x] =
+                     df_real2Voxel.m[0][0] * posPtrX[i+x] +
+                     df_real2Voxel.m[0][1] * posPtrY[i+x] +
+                     df_real2Voxel.m[0][2] * posPtrZ[i+x] +
+                     df_real2Voxel.m[0][3] ;
+               lineVoxelY[x] =
+                     df_real2Voxel.m[1][0] * posPtrX[i+x] +
+                     df_real2Voxel.m[1][1] * posPtrY[i+x] +
+                     df_real2Voxel.m[1][2] * posPtrZ[i+x] +
+                     df_real2Voxel.m[1][3] ;
+               lineVoxelZ[x] =
+                     df_real2Voxel.m[2][0] * posPtrX[i+x] +
+                     df_real2Voxel.m[2][1] * posPtrY[i+x] +
+                     df_real2Voxel.m[2][2] * posPtrZ[i+x] +
+                     df_real2Voxel.m[2][3] ;
+            }
+
+            for(x=0; x<lineLength; ++x, ++i)
+            {
+               if(mask!=NULL && mask[i]<0)
+               {
+                  // The voxels outside of the mask keep their position
+                  resPtrX[i] = posPtrX[i];
+                  resPtrY[i] = posPtrY[i];
+                  resPtrZ[i] = posPtrZ[i];
+                  continue;
+               }
+
+               // Linear interpolation to compute the new deformation
+               pre[0]=static_cast<int>reg_floor(lineVoxelX[x]);
+               pre[1]=static_cast<int>reg_floor(lineVoxelY[x]);
+               pre[2]=static_cast<int>reg_floor(lineVoxelZ[x]);
+               relX[1]=lineVoxelX[x]-static_cast<DTYPE>(pre[0]);
+               relX[0]=1.-relX[1];
+               relY[1]=lineVoxelY[x]-static_cast<DTYPE>(pre[1]);
+               relY[0]=1.-relY[1];
+               relZ[1]=lineVoxelZ[x]-static_cast<DTYPE>(pre[2]);
+               relZ[0]=1.-relZ[1];
+               realDef[0]=realDef[1]=realDef[2]=0.;
+               if(pre[0]>-1 && pre[0]<DefFieldDim[0]-1 &&
+                     pre[1]>-1 && pre[1]<DefFieldDim[1]-1 &&
+                     pre[2]>-1 && pre[2]<DefFieldDim[2]-1)
                {
-                  currentX = pre[0]+a;
-                  if(currentX>-1 && currentX<DefFieldDim[0] && inY && inZ)
+                  // All eight neighbours are in the deformation field space
+                  for(c=0; c<2; ++c)
                   {
-                     // Uses the deformation field if voxel is in its space
-                     defX = defPtrX[index];
-                     defY = defPtrY[index];
-                     defZ = defPtrZ[index];
-                  }
-                  else
+                     tempIndex=(pre[2]+c)*DFPlaneNumber+pre[0];
+                     for(b=0; b<2; ++b)
+                     {
+                        index=tempIndex+(pre[1]+b)*DefFieldDim[0];
+                        tempBasis= relY[b] * relZ[c];
+                        for(a=0; a<2; ++a)
+                        {
+                           basis = relX[a] * tempBasis;
+                           realDef[0] += defPtrX[index+a] * basis;
+                           realDef[1] += defPtrY[index+a] * basis;
+                           realDef[2] += defPtrZ[index+a] * basis;
+                        } // a loop
+                     } // b loop
+                  } // c loop
+               }
+               else
+               {
+                  for(c=0; c<2; ++c)
                   {
-                     // Uses a sliding effect
-                     get_SlidedValues<DTYPE>(defX,
-                                             defY,
-                                             defZ,
-                                             currentX,
-                                             currentY,
-                                             currentZ,
-                                             defPtrX,
-                                             defPtrY,
-                                             defPtrZ,
-                                             df_voxel2Real,
-                                             deformationField->dim,
-                                             false // not a displacement field
-                                             );
-                  }
-                  ++index;
-                  basis = relX[a] * tempBasis;
-                  realDef[0] += defX * basis;
-                  realDef[1] += defY * basis;
-                  realDef[2] += defZ * basis;
-               } // a loop
-            } // b loop
-         } // c loop
-         resPtrX[i] = realDef[0];
-         resPtrY[i] = realDef[1];
-         resPtrZ[i] = realDef[2];
-      }// mask
-   }// loop over every voxel
+                     currentZ = pre[2]+c;
+                     tempIndex=currentZ*DFPlaneNumber;
+                     if(currentZ>-1 && currentZ<DefFieldDim[2]) inZ=true;
+                     else inZ=false;
+                     for(b=0; b<2; ++b)
+                     {
+                        currentY = pre[1]+b;
+                        index=tempIndex+currentY*DefFieldDim[0] + pre[0];
+                        tempBasis= relY[b] * relZ[c];
+                        if(currentY>-1 && currentY<DefFieldDim[1]) inY=true;
+                        else inY=false;
+                        for(a=0; a<2; ++a)
+                        {
+                           currentX = pre[0]+a;
+                           if(currentX>-1 && currentX<DefFieldDim[0] && inY && inZ)
+                           {
+                              // Uses the deformation field if voxel is in its space
+                              defX = defPtrX[index];
+                              defY = defPtrY[index];
+                              defZ = defPtrZ[index];
+                           }
+                           else
+                           {
+                              // Uses a sliding effect
+                              get_SlidedValues<DTYPE>(defX,
+                                                      defY,
+                                                      defZ,
+                                                      currentX,
+                                                      currentY,
+                                                      currentZ,
+                                                      defPtrX,
+                                                      defPtrY,
+                                                      defPtrZ,
+                                                      df_voxel2Real,
+                                                      deformationField->dim,
+                                                      false // not a displacement field
+                                                      );
+                           }
+                           ++index;
+                           basis = relX[a] * tempBasis;
+                           realDef[0] += defX * basis;
+                           realDef[1] += defY * basis;
+                           realDef[2] += defZ * basis;
+                        } // a loop
+                     } // b loop
+                  } // c loop
+               }
+               resPtrX[i] = realDef[0];
+               resPtrY[i] = realDef[1];
+               resPtrZ[i] = realDef[2];
+            } // x
+         } // y
+      } // z
+   }// loop over every tile
 }
 /* *************************************************************** */
 void reg_defField_compose(nifti_image *deformationField,
-                          nifti_image *dfToUpdate,
+                          nifti_image *positionField,
+                          nifti_image *outputField,
                           int *mask)
 {
-   if(deformationField->datatype != dfToUpdate->datatype)
+   if(deformationField->datatype != positionField->datatype ||
+         deformationField->datatype != outputField->datatype)
    {
       reg_print_fct_error("reg_defField_compose");
-      reg_print_msg_error("Both deformation fields are expected to have the same type");
+      reg_print_msg_error("The deformation fields are expected to have the same type");
       reg_exit();
    }
-
-   bool freeMask=false;
-   if(mask==NULL)
+   if(positionField->nvox != outputField->nvox)
+   {
+      reg_print_fct_error("reg_defField_compose");
+      reg_print_msg_error("The position and output fields are expected to have the same size");
+      reg_exit();
+   }
+   if(deformationField->data == outputField->data)
    {
-      mask=(int *)calloc(dfToUpdate->nx*
-                         dfToUpdate->ny*
-                         dfToUpdate->nz,
-                         sizeof(int));
-      freeMask=true;
+      reg_print_fct_error("reg_defField_compose");
+      reg_print_msg_error("The applied deformation field can not be overwritten");
+      reg_exit();
    }
 
-   if(dfToUpdate->nu==2)
+   // Every voxel only reads its own position before writing it, which makes
+   // the composition safe when the position and output fields are the same.
+   // A NULL mask selects all voxels
+   if(outputField->nu==2)
    {
       switch(deformationField->datatype)
       {
       case NIFTI_TYPE_FLOAT32:
-         reg_defField_compose2D<float>(deformationField,dfToUpdate,mask);
+         reg_defField_compose2D<float>(deformationField,positionField,outputField,mask);
          break;
       case NIFTI_TYPE_FLOAT64:
-         reg_defField_compose2D<double>(deformationField,dfToUpdate,mask);
+         reg_defField_compose2D<double>(deformationField,positionField,outputField,mask);
          break;
       default:
          reg_print_fct_error("reg_defField_compose");
@@ -2839,10 +3037,10 @@ void reg_defField_compose(nifti_image *deformationField,
       switch(deformationField->datatype)
       {
       case NIFTI_TYPE_FLOAT32:
-         reg_defField_compose3D<float>(deformationField,dfToUpdate,mask);
+         reg_defField_compose3D<float>(deformationField,positionField,outputField,mask);
          break;
       case NIFTI_TYPE_FLOAT64:
-         reg_defField_compose3D<double>(deformationField,dfToUpdate,mask);
+         reg_defField_compose3D<double>(deformationField,positionField,outputField,mask);
          break;
       default:
          reg_print_fct_error("reg_defField_compose");
@@ -2850,34 +3048,95 @@ void reg_defField_compose(nifti_image *deformationField,
          reg_exit();
       }
    }
-
-   if(freeMask==true) free(mask);
 }
 /* *************************************************************** */
+void reg_defField_compose(nifti_image *deformationField,
+                          nifti_image *dfToUpdate,
+                          int *mask)
+{
+   // The field to update also contains the positions to interpolate
+   reg_defField_compose(deformationField,
+                        dfToUpdate,
+                        dfToUpdate,
+                        mask);
+}
 /* *************************************************************** */
-/// @brief Internal data structure to pass user data into optimizer that get passed to cost_function
-struct ddata
+void reg_defField_square(nifti_image *deformationField,
+                         nifti_image *squaredField)
 {
-   nifti_image *deformationField;
-   double gx, gy, gz;
-   double *arrayy[4];
-   double values[4];
-};
-
-/* ************************************************************************** */
-/* internal routine : deform one point(x, y, x) according to deformationField */
-/* returns ERROR when the input point falls outside the deformation field     */
-/* ************************************************************************** */
+   if(deformationField->datatype != squaredField->datatype ||
+         deformationField->nvox != squaredField->nvox)
+   {
+      reg_print_fct_error("reg_defField_square");
+      reg_print_msg_error("Both deformation fields are expected to have the same type and size");
+      reg_exit();
+   }
+   if(deformationField->data == squaredField->data)
+   {
+      reg_print_fct_error("reg_defField_square");
+      reg_print_msg_error("The squared field can not be computed in place");
+      reg_exit();
+   }
 
-template<class FieldTYPE>
-static int inline FastWarp(double x, double y, double z, nifti_image *deformationField, double *px, double *py, double *pz)
-{
-   double wax, wbx, wcx, wdx, wex, wfx, wgx, whx, wf3x;
-   FieldTYPE *wpx;
-   double way, wby, wcy, wdy, wey, wfy, wgy, why, wf3y;
-   FieldTYPE *wpy;
-   double waz, wbz, wcz, wdz, wez, wfz, wgz, whz, wf3z;
-   FieldTYPE *wpz;
+   // The field is interpolated at its own positions in a single pass
+   if(squaredField->nu==2)
+   {
+      switch(deformationField->datatype)
+      {
+      case NIFTI_TYPE_FLOAT32:
+         reg_defField_compose2D<float>(deformationField,deformationField,squaredField,NULL);
+         break;
+      case NIFTI_TYPE_FLOAT64:
+         reg_defField_compose2D<double>(deformationField,deformationField,squaredField,NULL);
+         break;
+      default:
+         reg_print_fct_error("reg_defField_square");
+         reg_print_msg_error("Deformation field pixel type unsupported");
+         reg_exit();
+      }
+   }
+   else
+   {
+      switch(deformationField->datatype)
+      {
+      case NIFTI_TYPE_FLOAT32:
+         reg_defField_compose3D<float>(deformationField,deformationField,squaredField,NULL);
+         break;
+      case NIFTI_TYPE_FLOAT64:
+         reg_defField_compose3D<double>(deformationField,deformationField,squaredField,NULL);
+         break;
+      default:
+         reg_print_fct_error("reg_defField_square");
+         reg_print_msg_error("Deformation field pixel type unsupported");
+         reg_exit();
+      }
+   }
+}
+/* *************************************************************** */
+/* *************************************************************** */
+/// @brief Internal data structure to pass user data into optimizer that get passed to cost_function
+struct ddata
+{
+   nifti_image *deformationField;
+   double gx, gy, gz;
+   double *arrayy[4];
+   double values[4];
+};
+
+/* ************************************************************************** */
+/* internal routine : deform one point(x, y, x) according to deformationField */
+/* returns ERROR when the input point falls outside the deformation field     */
+/* ************************************************************************** */
+
+template<class FieldTYPE>
+static int inline FastWarp(double x, double y, double z, nifti_image *deformationField, double *px, double *py, double *pz)
+{
+   double wax, wbx, wcx, wdx, wex, wfx, wgx, whx, wf3x;
+   FieldTYPE *wpx;
+   double way, wby, wcy, wdy, wey, wfy, wgy, why, wf3y;
+   FieldTYPE *wpy;
+   double waz, wbz, wcz, wdz, wez, wfz, wgz, whz, wf3z;
+   FieldTYPE *wpz;
    int   xw, yw, zw, dxw, dyw, dxyw, dxyzw;
    double wxf, wyf, wzf, wyzf;
    double world[4], position[4];
@@ -3347,6 +3606,87 @@ static void optimize(gsl_multimin_function *f, double *start, void *data, double
    nmsimplex_calc_center (&t, start);
 }
 /* *************************************************************** */
+/* Internal fixed-point search of the position that the deformation field
+ * maps onto the target: position <- position - P (warp(position)-target),
+ * where the preconditioner P is the inverse of the field Jacobian at the
+ * starting position, or the identity where that Jacobian is singular. The
+ * step is halved when the residual does not decrease. Returns EXIT_SUCCESS
+ * once the residual is below the tolerance and EXIT_FAILURE if the
+ * iteration stalls, the best position found being kept. */
+#define REG_INVERT_MAX_IT 100
+template <class DTYPE>
+static int reg_defFieldInvert_fixedPoint(nifti_image *deformationField,
+                                         const double *target,
+                                         double *position,
+                                         double tolerance)
+{
+   double warped[3], residual[3], update[3], trial[3];
+   FastWarp<DTYPE>(position[0], position[1], position[2], deformationField,
+                   &warped[0], &warped[1], &warped[2]);
+   residual[0] = warped[0] - target[0];
+   residual[1] = warped[1] - target[1];
+   residual[2] = warped[2] - target[2];
+   double distance = reg_pow2(residual[0]) + reg_pow2(residual[1]) + reg_pow2(residual[2]);
+   if(distance!=distance) return EXIT_FAILURE;
+   if(distance<=tolerance*tolerance) return EXIT_SUCCESS;
+
+   // Finite difference estimate of the Jacobian at the starting position
+   mat33 preconditioner;
+   double h = deformationField->dx;
+   if(deformationField->dy<h) h = deformationField->dy;
+   if(deformationField->dz<h) h = deformationField->dz;
+   h *= 0.01;
+   for(int i=0; i<3; ++i)
+   {
+      trial[0] = position[0];
+      trial[1] = position[1];
+      trial[2] = position[2];
+      trial[i] += h;
+      FastWarp<DTYPE>(trial[0], trial[1], trial[2], deformationField,
+                      &update[0], &update[1], &update[2]);
+      for(int j=0; j<3; ++j)
+         preconditioner.m[j][i] = static_cast<float>((update[j] - warped[j]) / h);
+   }
+   if(nifti_mat33_determ(preconditioner)>1.0e-3)
+      preconditioner = nifti_mat33_inverse(preconditioner);
+   else reg_mat33_eye(&preconditioner);
+
+   double step = 1.;
+   for(int it=0; it<REG_INVERT_MAX_IT; ++it)
+   {
+      for(int i=0; i<3; ++i)
+      {
+         update[i] = preconditioner.m[i][0] * residual[0] +
+               preconditioner.m[i][1] * residual[1] +
+               preconditioner.m[i][2] * residual[2];
+         trial[i] = position[i] - step * update[i];
+      }
+      FastWarp<DTYPE>(trial[0], trial[1], trial[2], deformationField,
+                      &warped[0], &warped[1], &warped[2]);
+      double newDistance = reg_pow2(warped[0] - target[0]) +
+            reg_pow2(warped[1] - target[1]) +
+            reg_pow2(warped[2] - target[2]);
+      if(newDistance<distance)
+      {
+         position[0] = trial[0];
+         position[1] = trial[1];
+         position[2] = trial[2];
+         residual[0] = warped[0] - target[0];
+         residual[1] = warped[1] - target[1];
+         residual[2] = warped[2] - target[2];
+         distance = newDistance;
+         if(distance<=tolerance*tolerance) return EXIT_SUCCESS;
+         step = step<1. ? 2.*step : 1.;
+      }
+      else
+      {
+         step *= 0.5;
+         if(step<1.0e-3) return EXIT_FAILURE;
+      }
+   }
+   return EXIT_FAILURE;
+}
+/* *************************************************************** */
 template <class DTYPE>
 void reg_defFieldInvert3D(nifti_image *inputDeformationField,
                           nifti_image *outputDeformationField,
@@ -3373,22 +3713,29 @@ void reg_defFieldInvert3D(nifti_image *inputDeformationField,
    center[2] = inputDeformationField->nz / 2;
    center[3] = 1;
    reg_mat44_mul(InXYZMatrix, center, center2);
-   FastWarp<float>(center2[0], center2[1], center2[2], inputDeformationField, &centerout[0], &centerout[1], &centerout[2]);
+   FastWarp<DTYPE>(center2[0], center2[1], center2[2], inputDeformationField, &centerout[0], &centerout[1], &centerout[2]);
    delta[0] = center2[0]-centerout[0];
    delta[1] = center2[1]-centerout[1];
    delta[2] = center2[2]-centerout[2];
    // end added
 
-
+   // Every voxel is first inverted using a fixed-point iteration. It is
+   // initialised by extrapolating the inverse of the previous voxels along
+   // the line, or from the first voxel of the previous line.
+   // The simplex optimisation is only used when the iteration fails.
    int i,x,y,z;
    double position[4], pars[4], arrayy[4][3];
+   double previousTarget[3], previousPars[3], olderPars[3], lineTarget[3], linePars[3];
    struct ddata dat;
    DTYPE *outData;
+   size_t fallbackNumber=0;
 #if defined (_OPENMP)
 #pragma omp parallel for default(none) \
    shared(outputDeformationField,tolerance,outputVoxelNumber, \
    inputDeformationField, OutXYZMatrix, delta) \
-   private(i,x,y,z,dat,outData,position,pars,arrayy)
+   private(i,x,y,z,dat,outData,position,pars,arrayy, \
+   previousTarget, previousPars, olderPars, lineTarget, linePars) \
+   reduction(+:fallbackNumber)
 #endif
    for (z=0; z<outputDeformationField->nz; ++z)
    {
@@ -3414,14 +3761,63 @@ void reg_defFieldInvert3D(nifti_image *inputDeformationField,
             dat.gy = pars[1];
             dat.gz = pars[2];
 
-            // added
-            pars[0] += delta[0];
-            pars[1] += delta[1];
-            pars[2] += delta[2];
-            // end added
+            // Warm start from the neighbouring inverse
+            if(x>1)
+            {
+               // linear extrapolation from the two previous voxels
+               for(i=0; i<3; ++i)
+                  pars[i] = 2. * previousPars[i] - olderPars[i];
+            }
+            else if(x>0)
+            {
+               for(i=0; i<3; ++i)
+                  pars[i] = previousPars[i] + (pars[i] - previousTarget[i]);
+            }
+            else if(y>0)
+            {
+               for(i=0; i<3; ++i)
+                  pars[i] = linePars[i] + (pars[i] - lineTarget[i]);
+            }
+            else
+            {
+               pars[0] += delta[0];
+               pars[1] += delta[1];
+               pars[2] += delta[2];
+            }
 
-            optimize(cost_function, pars, (void *)&dat, tolerance);
+            previousTarget[0] = dat.gx;
+            previousTarget[1] = dat.gy;
+            previousTarget[2] = dat.gz;
+            if(reg_defFieldInvert_fixedPoint<DTYPE>(inputDeformationField,
+                                                    previousTarget,
+                                                    pars,
+                                                    tolerance)!=EXIT_SUCCESS)
+            {
+               // The iteration stalled, typically because of a folding
+               if(pars[0]!=pars[0] || pars[1]!=pars[1] || pars[2]!=pars[2])
+               {
+                  pars[0] = dat.gx + delta[0];
+                  pars[1] = dat.gy + delta[1];
+                  pars[2] = dat.gz + delta[2];
+               }
+               optimize(cost_function, pars, (void *)&dat, tolerance);
+               ++fallbackNumber;
+            }
             // output = (warp-1)(input);
+            olderPars[0] = previousPars[0];
+            olderPars[1] = previousPars[1];
+            olderPars[2] = previousPars[2];
+            previousPars[0] = pars[0];
+            previousPars[1] = pars[1];
+            previousPars[2] = pars[2];
+            if(x==0)
+            {
+               for(i=0; i<3; ++i)
+               {
+                  lineTarget[i] = previousTarget[i];
+                  linePars[i] = previousPars[i];
+               }
+            }
 
             outData[0]        = pars[0];
             outData[outputVoxelNumber]   = pars[1];
@@ -3430,6 +3826,12 @@ void reg_defFieldInvert3D(nifti_image *inputDeformationField,
          }
       }
    }
+#ifndef NDEBUG
+   char text[255];
+   sprintf(text, "Deformation field inversion: simplex used for %zu voxel(s) out of %i",
+           fallbackNumber, outputVoxelNumber);
+   reg_print_msg_debug(text);
+#endif
 }
 /* *************************************************************** */
 void reg_defFieldInvert(nifti_image *inputDeformationField,
@@ -3460,6 +3862,7 @@ void reg_defFieldInvert(nifti_image *inputDeformationField,
    case NIFTI_TYPE_FLOAT64:
       reg_defFieldInvert3D<double>
             (inputDeformationField,outputDeformationField,tolerance);
+      break;
    default:
       reg_print_fct_error("reg_defFieldInvert");
       reg_print_msg_error("Deformation field pixel type unsupported");
@@ -3472,11 +3875,12 @@ void reg_defFieldInvert(nifti_image *inputDeformationField,
 template<class DTYPE>
 void reg_spline_cppComposition_2D(nifti_image *grid1,
                                   nifti_image *grid2,
+                                  nifti_image *outputGrid,
                                   bool displacement1,
                                   bool displacement2,
                                   bool bspline)
 {
-   // REMINDER Grid2(x)=Grid1(Grid2(x))
+   // REMINDER outputGrid(x)=Grid1(Grid2(x))
 
  #if _USE_SSE
    union
@@ -3486,7 +3890,10 @@ void reg_spline_cppComposition_2D(nifti_image *grid1,
    } val;
  #endif // _USE_SSE
 
-   DTYPE *outCPPPtrX = static_cast<DTYPE *>(grid2->data);
+   DTYPE *posCPPPtrX = static_cast<DTYPE *>(grid2->data);
+   DTYPE *posCPPPtrY = &posCPPPtrX[grid2->nx*grid2->ny];
+
+   DTYPE *outCPPPtrX = static_cast<DTYPE *>(outputGrid->data);
    DTYPE *outCPPPtrY = &outCPPPtrX[grid2->nx*grid2->ny];
 
    DTYPE *controlPointPtrX = static_cast<DTYPE *>(grid1->data);
@@ -3532,8 +3939,8 @@ void reg_spline_cppComposition_2D(nifti_image *grid1,
       {
 
          // Get the control point actual position
-         DTYPE xReal = *outCPPPtrX;
-         DTYPE yReal = *outCPPPtrY;
+         DTYPE xReal = *posCPPPtrX++;
+         DTYPE yReal = *posCPPPtrY++;
          DTYPE initialX=xReal;
          DTYPE initialY=yReal;
          if(displacement2)
@@ -3642,41 +4049,26 @@ void reg_spline_cppComposition_2D(nifti_image *grid1,
 template<class DTYPE>
 void reg_spline_cppComposition_3D(nifti_image *grid1,
                                   nifti_image *grid2,
+                                  nifti_image *outputGrid,
                                   bool displacement1,
                                   bool displacement2,
                                   bool bspline)
 {
-   // REMINDER Grid2(x)=Grid1(Grid2(x))
- #if _USE_SSE
-   union
-   {
-      __m128 m;
-      float f[4];
-   } val;
-   __m128 _xBasis_sse;
-   __m128 tempX;
-   __m128 tempY;
-   __m128 tempZ;
-   __m128 *ptrX;
-   __m128 *ptrY;
-   __m128 *ptrZ;
-   __m128 _yBasis_sse;
-   __m128 _zBasis_sse;
-   __m128 _temp_basis;
-   __m128 _basis;
- #else
-   int a, b, c;
-   size_t coord;
-   DTYPE tempValue;
- #endif
+   // REMINDER outputGrid(x)=Grid1(Grid2(x))
+   const size_t nodeNumber1=(size_t)grid1->nx*grid1->ny*grid1->nz;
+   const size_t nodeNumber2=(size_t)grid2->nx*grid2->ny*grid2->nz;
+
+   DTYPE *posCPPPtrX = static_cast<DTYPE *>(grid2->data);
+   DTYPE *posCPPPtrY = &posCPPPtrX[nodeNumber2];
+   DTYPE *posCPPPtrZ = &posCPPPtrY[nodeNumber2];
 
-   DTYPE *outCPPPtrX = static_cast<DTYPE *>(grid2->data);
-   DTYPE *outCPPPtrY = &outCPPPtrX[grid2->nx*grid2->ny*grid2->nz];
-   DTYPE *outCPPPtrZ = &outCPPPtrY[grid2->nx*grid2->ny*grid2->nz];
+   DTYPE *outCPPPtrX = static_cast<DTYPE *>(outputGrid->data);
+   DTYPE *outCPPPtrY = &outCPPPtrX[nodeNumber2];
+   DTYPE *outCPPPtrZ = &outCPPPtrY[nodeNumber2];
 
    DTYPE *controlPointPtrX = static_cast<DTYPE *>(grid1->data);
-   DTYPE *controlPointPtrY = &controlPointPtrX[grid1->nx*grid1->ny*grid1->nz];
-   DTYPE *controlPointPtrZ = &controlPointPtrY[grid1->nx*grid1->ny*grid1->nz];
+   DTYPE *controlPointPtrY = &controlPointPtrX[nodeNumber1];
+   DTYPE *controlPointPtrZ = &controlPointPtrY[nodeNumber1];
 
    DTYPE basis;
 
@@ -3696,205 +4088,189 @@ void reg_spline_cppComposition_3D(nifti_image *grid1,
    DTYPE zControlPointCoordinates[64] __attribute__((aligned(16)));
  #endif
 
-   int xPre, xPreOld, yPre, yPreOld, zPre, zPreOld;
-   int x, y, z;
-   size_t index;
-   DTYPE xReal, yReal, zReal, initialPositionX, initialPositionY, initialPositionZ;
-   DTYPE xVoxel, yVoxel, zVoxel;
+   // The 64 control point weighted sums use the widest vectorised kernel
+   const reg_simd_kernels *simdKernels = reg_simd_getKernels();
 
    // read the xyz/ijk sform or qform, as appropriate
-   mat44 *matrix_real_to_voxel1=NULL;
-   mat44 *matrix_voxel_to_real2=NULL;
+   mat44 matrix_real_to_voxel1, matrix_voxel_to_real2;
    if(grid1->sform_code>0)
-      matrix_real_to_voxel1=&(grid1->sto_ijk);
-   else matrix_real_to_voxel1=&(grid1->qto_ijk);
+      matrix_real_to_voxel1=grid1->sto_ijk;
+   else matrix_real_to_voxel1=grid1->qto_ijk;
    if(grid2->sform_code>0)
-      matrix_voxel_to_real2=&(grid2->sto_xyz);
-   else matrix_voxel_to_real2=&(grid2->qto_xyz);
+      matrix_voxel_to_real2=grid2->sto_xyz;
+   else matrix_voxel_to_real2=grid2->qto_xyz;
+
+   // The nodes are processed tile by tile so that the control points read
+   // for neighbouring nodes remain in cache. The initial and grid1 voxel
+   // positions of a tile line are computed first, in loops the compiler
+   // vectorises
+   int gridDim[3]={grid2->nx, grid2->ny, grid2->nz};
+   int grid1Dim[3]={grid1->nx, grid1->ny, grid1->nz};
+   int tileNumber[3], tile, tileStart[3], tileEnd[3];
+   int tileCount = reg_getTileNumber(gridDim, tileNumber);
+   DTYPE initialX[REG_TILE_SIZE_X], initialY[REG_TILE_SIZE_X], initialZ[REG_TILE_SIZE_X];
+   DTYPE voxelX[REG_TILE_SIZE_X], voxelY[REG_TILE_SIZE_X], voxelZ[REG_TILE_SIZE_X];
+
+   int xPre, xPreOld, yPre, yPreOld, zPre, zPreOld;
+   int x, y, z, i, lineLength, a, b, c, coord;
+   size_t index, nodeIndex;
+   DTYPE xReal, yReal, zReal, real[3];
 
  #if defined (_OPENMP)
- #ifdef _USE_SSE
- #pragma omp parallel for default(none) \
-   shared(grid1, grid2, displacement1, displacement2, matrix_voxel_to_real2, matrix_real_to_voxel1, \
-   outCPPPtrX, outCPPPtrY, outCPPPtrZ, controlPointPtrX, controlPointPtrY, controlPointPtrZ, bspline) \
-   private(xPre, xPreOld, yPre, yPreOld, zPre, zPreOld, val, index, \
-   x, y, z, xVoxel, yVoxel, zVoxel, basis, xBasis, yBasis, zBasis, \
-   xReal, yReal, zReal, initialPositionX, initialPositionY, initialPositionZ, \
-   _xBasis_sse, tempX, tempY, tempZ, ptrX, ptrY, ptrZ, _yBasis_sse, _zBasis_sse, _temp_basis, _basis, \
+ #pragma omp parallel for default(none) schedule(dynamic) \
+   shared(grid1, displacement1, displacement2, matrix_voxel_to_real2, matrix_real_to_voxel1, \
+   posCPPPtrX, posCPPPtrY, posCPPPtrZ, outCPPPtrX, outCPPPtrY, outCPPPtrZ, \
+   controlPointPtrX, controlPointPtrY, controlPointPtrZ, bspline, \
+   gridDim, grid1Dim, tileNumber, tileCount, simdKernels) \
+   private(tile, tileStart, tileEnd, xPre, xPreOld, yPre, yPreOld, zPre, zPreOld, index, \
+   nodeIndex, a, b, c, coord, x, y, z, i, lineLength, basis, xBasis, yBasis, zBasis, xReal, yReal, zReal, real, \
+   initialX, initialY, initialZ, voxelX, voxelY, voxelZ, \
    xControlPointCoordinates, yControlPointCoordinates, zControlPointCoordinates)
- #else
- #pragma omp parallel for default(none) \
-   shared(grid1, grid2, displacement1, displacement2, matrix_voxel_to_real2, matrix_real_to_voxel1, \
-   outCPPPtrX, outCPPPtrY, outCPPPtrZ, controlPointPtrX, controlPointPtrY, controlPointPtrZ, bspline) \
-   private(xPre, xPreOld, yPre, yPreOld, zPre, zPreOld, index, \
-   x, y, z, xVoxel, yVoxel, zVoxel, a, b, c, coord, basis, tempValue, xBasis, yBasis, zBasis, \
-   xReal, yReal, zReal, initialPositionX, initialPositionY, initialPositionZ, \
-   xControlPointCoordinates, yControlPointCoordinates, zControlPointCoordinates)
- #endif
  #endif
-   for(z=0; z<grid2->nz; z++)
+   for(tile=0; tile<tileCount; tile++)
    {
+      reg_getTileBounds(tile, gridDim, tileNumber, tileStart, tileEnd);
+      lineLength=tileEnd[0]-tileStart[0];
       xPreOld=99999;
       yPreOld=99999;
       zPreOld=99999;
-      index=z*grid2->nx*grid2->ny;
-      for(y=0; y<grid2->ny; y++)
+      for(z=tileStart[2]; z<tileEnd[2]; z++)
       {
-         for(x=0; x<grid2->nx; x++)
+         for(y=tileStart[1]; y<tileEnd[1]; y++)
          {
-            // Get the control point actual position
-            xReal = outCPPPtrX[index];
-            yReal = outCPPPtrY[index];
-            zReal = outCPPPtrZ[index];
-            initialPositionX=0;
-            initialPositionY=0;
-            initialPositionZ=0;
+            index=((size_t)z*gridDim[1]+y)*gridDim[0]+tileStart[0];
+
+            // Get the initial position of the nodes
             if(displacement2)
             {
-               xReal += initialPositionX =
-                     matrix_voxel_to_real2->m[0][0]*x
-                     + matrix_voxel_to_real2->m[0][1]*y
-                     + matrix_voxel_to_real2->m[0][2]*z
-                     + matrix_voxel_to_real2->m[0][3];
-               yReal += initialPositionY =
-                     matrix_voxel_to_real2->m[1][0]*x
-                     + matrix_voxel_to_real2->m[1][1]*y
-                     + matrix_voxel_to_real2->m[1][2]*z
-                     + matrix_voxel_to_real2->m[1][3];
-               zReal += initialPositionZ =
-                     matrix_voxel_to_real2->m[2][0]*x
-                     + matrix_voxel_to_real2->m[2][1]*y
-                     + matrix_voxel_to_real2->m[2][2]*z
-                     + matrix_voxel_to_real2->m[2][3];
+               for(i=0; i<lineLength; i++)
+               {
+                  x=tileStart[0]+i;
+                  initialX[i] =
+                        matrix_voxel_to_real2.m[0][0]*x
+                        + matrix_voxel_to_real2.m[0][1]*y
+                        + matrix_voxel_to_real2.m[0][2]*z
+                        + matrix_voxel_to_real2.m[0][3];
+                  initialY[i] =
+                        matrix_voxel_to_real2.m[1][0]*x
+                        + matrix_voxel_to_real2.m[1][1]*y
+                        + matrix_voxel_to_real2.m[1][2]*z
+                        + matrix_voxel_to_real2.m[1][3];
+                  initialZ[i] =
+                        matrix_voxel_to_real2.m[2][0]*x
+                        + matrix_voxel_to_real2.m[2][1]*y
+                        + matrix_voxel_to_real2.m[2][2]*z
+                        + matrix_voxel_to_real2.m[2][3];
+               }
             }
-
-            // Get the voxel based control point position in grid1
-            xVoxel =
-                  matrix_real_to_voxel1->m[0][0]*xReal
-                  + matrix_real_to_voxel1->m[0][1]*yReal
-                  + matrix_real_to_voxel1->m[0][2]*zReal
-                  + matrix_real_to_voxel1->m[0][3];
-            yVoxel =
-                  matrix_real_to_voxel1->m[1][0]*xReal
-                  + matrix_real_to_voxel1->m[1][1]*yReal
-                  + matrix_real_to_voxel1->m[1][2]*zReal
-                  + matrix_real_to_voxel1->m[1][3];
-            zVoxel =
-                  matrix_real_to_voxel1->m[2][0]*xReal
-                  + matrix_real_to_voxel1->m[2][1]*yReal
-                  + matrix_real_to_voxel1->m[2][2]*zReal
-                  + matrix_real_to_voxel1->m[2][3];
-
-            // The spline coefficients are computed
-            xPre=(int)(reg_floor(xVoxel));
-            basis=(DTYPE)xVoxel-(DTYPE)xPre;
-            if(basis<0.0) basis=0.0; //rounding error
-            if(bspline) get_BSplineBasisValues<DTYPE>(basis, xBasis);
-            else get_SplineBasisValues<DTYPE>(basis, xBasis);
-
-            yPre=(int)(reg_floor(yVoxel));
-            basis=(DTYPE)yVoxel-(DTYPE)yPre;
-            if(basis<0.0) basis=0.0; //rounding error
-            if(bspline) get_BSplineBasisValues<DTYPE>(basis, yBasis);
-            else get_SplineBasisValues<DTYPE>(basis, yBasis);
-
-            zPre=(int)(reg_floor(zVoxel));
-            basis=(DTYPE)zVoxel-(DTYPE)zPre;
-            if(basis<0.0) basis=0.0; //rounding error
-            if(bspline) get_BSplineBasisValues<DTYPE>(basis, zBasis);
-            else get_SplineBasisValues<DTYPE>(basis, zBasis);
-
-            --xPre;
-            --yPre;
-            --zPre;
-
-            // The control points are stored
-            if(xPre!=xPreOld || yPre!=yPreOld || zPre!=zPreOld)
+            else
             {
-               get_GridValues(xPre,
-                              yPre,
-                              zPre,
-                              grid1,
-                              controlPointPtrX,
-                              controlPointPtrY,
-                              controlPointPtrZ,
-                              xControlPointCoordinates,
-                              yControlPointCoordinates,
-                              zControlPointCoordinates,
-                              false, // no approximation
-                              displacement1 // a displacement field?
-                              );
-               xPreOld=xPre;
-               yPreOld=yPre;
-               zPreOld=zPre;
+               for(i=0; i<lineLength; i++)
+                  initialX[i]=initialY[i]=initialZ[i]=0;
             }
-            xReal=0.0;
-            yReal=0.0;
-            zReal=0.0;
- #if _USE_SSE
-            val.f[0] = xBasis[0];
-            val.f[1] = xBasis[1];
-            val.f[2] = xBasis[2];
-            val.f[3] = xBasis[3];
-            _xBasis_sse = val.m;
-
-            tempX =  _mm_set_ps1(0.0);
-            tempY =  _mm_set_ps1(0.0);
-            tempZ =  _mm_set_ps1(0.0);
-            ptrX = (__m128 *) &xControlPointCoordinates[0];
-            ptrY = (__m128 *) &yControlPointCoordinates[0];
-            ptrZ = (__m128 *) &zControlPointCoordinates[0];
-
-            for(unsigned int c=0; c<4; c++)
+
+            // Get the voxel based control point positions in grid1
+            for(i=0; i<lineLength; i++)
             {
-               for(unsigned int b=0; b<4; b++)
-               {
-                  _yBasis_sse  = _mm_set_ps1(yBasis[b]);
-                  _zBasis_sse  = _mm_set_ps1(zBasis[c]);
-                  _temp_basis   = _mm_mul_ps(_yBasis_sse, _zBasis_sse);
-                  _basis       = _mm_mul_ps(_temp_basis, _xBasis_sse);
-                  tempX = _mm_add_ps(_mm_mul_ps(_basis, *ptrX), tempX );
-                  tempY = _mm_add_ps(_mm_mul_ps(_basis, *ptrY), tempY );
-                  tempZ = _mm_add_ps(_mm_mul_ps(_basis, *ptrZ), tempZ );
-                  ptrX++;
-                  ptrY++;
-                  ptrZ++;
-               }
+               xReal = posCPPPtrX[index+i] + initialX[i];
+               yReal = posCPPPtrY[index+i] + initialY[i];
+               zReal = posCPPPtrZ[index+i] + initialZ[i];
+               voxelX[i] =
+                     matrix_real_to_voxel1.m[0][0]*xReal
+                     + matrix_real_to_voxel1.m[0][1]*yReal
+                     + matrix_real_to_voxel1.m[0][2]*zReal
+                     + matrix_real_to_voxel1.m[0][3];
+               voxelY[i] =
+                     matrix_real_to_voxel1.m[1][0]*xReal
+                     + matrix_real_to_voxel1.m[1][1]*yReal
+                     + matrix_real_to_voxel1.m[1][2]*zReal
+                     + matrix_real_to_voxel1.m[1][3];
+               voxelZ[i] =
+                     matrix_real_to_voxel1.m[2][0]*xReal
+                     + matrix_real_to_voxel1.m[2][1]*yReal
+                     + matrix_real_to_voxel1.m[2][2]*zReal
+                     + matrix_real_to_voxel1.m[2][3];
             }
-            //the values stored in SSE variables are transfered to normal float
-            val.m = tempX;
-            xReal = val.f[0]+val.f[1]+val.f[2]+val.f[3];
-            val.m = tempY;
-            yReal = val.f[0]+val.f[1]+val.f[2]+val.f[3];
-            val.m = tempZ;
-            zReal = val.f[0]+val.f[1]+val.f[2]+val.f[3];
- #else
-            coord=0;
-            for(c=0; c<4; c++)
+
+            for(i=0; i<lineLength; i++, index++)
             {
-               for(b=0; b<4; b++)
+               // The spline coefficients are computed
+               xPre=(int)(reg_floor(voxelX[i]));
+               basis=voxelX[i]-(DTYPE)xPre;
+               if(basis<0.0) basis=0.0; //rounding error
+               if(bspline) get_BSplineBasisValues<DTYPE>(basis, xBasis);
+               else get_SplineBasisValues<DTYPE>(basis, xBasis);
+
+               yPre=(int)(reg_floor(voxelY[i]));
+               basis=voxelY[i]-(DTYPE)yPre;
+               if(basis<0.0) basis=0.0; //rounding error
+               if(bspline) get_BSplineBasisValues<DTYPE>(basis, yBasis);
+               else get_SplineBasisValues<DTYPE>(basis, yBasis);
+
+               zPre=(int)(reg_floor(voxelZ[i]));
+               basis=voxelZ[i]-(DTYPE)zPre;
+               if(basis<0.0) basis=0.0; //rounding error
+               if(bspline) get_BSplineBasisValues<DTYPE>(basis, zBasis);
+               else get_SplineBasisValues<DTYPE>(basis, zBasis);
+
+               --xPre;
+               --yPre;
+               --zPre;
+
+               // The control points are stored
+               if(xPre!=xPreOld || yPre!=yPreOld || zPre!=zPreOld)
                {
-                  for(a=0; a<4; a++)
+                  if(xPre>-1 && xPre<grid1Dim[0]-3 &&
+                        yPre>-1 && yPre<grid1Dim[1]-3 &&
+                        zPre>-1 && zPre<grid1Dim[2]-3)
+                  {
+                     // The neighbourhood is within grid1 and is directly copied
+                     coord=0;
+                     for(c=0; c<4; c++)
+                     {
+                        for(b=0; b<4; b++)
+                        {
+                           nodeIndex=((size_t)(zPre+c)*grid1Dim[1]+yPre+b)*grid1Dim[0]+xPre;
+                           for(a=0; a<4; a++)
+                           {
+                              xControlPointCoordinates[coord] = controlPointPtrX[nodeIndex+a];
+                              yControlPointCoordinates[coord] = controlPointPtrY[nodeIndex+a];
+                              zControlPointCoordinates[coord] = controlPointPtrZ[nodeIndex+a];
+                              coord++;
+                           }
+                        }
+                     }
+                  }
+                  else
                   {
-                     tempValue = xBasis[a] * yBasis[b] * zBasis[c];
-                     xReal += xControlPointCoordinates[coord] * tempValue;
-                     yReal += yControlPointCoordinates[coord] * tempValue;
-                     zReal += zControlPointCoordinates[coord] * tempValue;
-                     coord++;
+                     get_GridValues<DTYPE>(xPre,
+                                           yPre,
+                                           zPre,
+                                           grid1,
+                                           controlPointPtrX,
+                                           controlPointPtrY,
+                                           controlPointPtrZ,
+                                           xControlPointCoordinates,
+                                           yControlPointCoordinates,
+                                           zControlPointCoordinates,
+                                           false, // no approximation
+                                           displacement1 // a displacement field?
+                                           );
                   }
+                  xPreOld=xPre;
+                  yPreOld=yPre;
+                  zPreOld=zPre;
                }
+               reg_simd_splineValue(simdKernels,
+                                    xBasis, yBasis, zBasis,
+                                    xControlPointCoordinates,
+                                    yControlPointCoordinates,
+                                    zControlPointCoordinates,
+                                    real);
+               outCPPPtrX[index] = real[0] - initialX[i];
+               outCPPPtrY[index] = real[1] - initialY[i];
+               outCPPPtrZ[index] = real[2] - initialZ[i];
             }
- #endif
-            if(displacement2)
-            {
-               xReal -= initialPositionX;
-               yReal -= initialPositionY;
-               zReal -= initialPositionZ;
-            }
-            outCPPPtrX[index] = xReal;
-            outCPPPtrY[index] = yReal;
-            outCPPPtrZ[index] = zReal;
-            index++;
          }
       }
    }
@@ -3903,27 +4279,31 @@ void reg_spline_cppComposition_3D(nifti_image *grid1,
 /* *************************************************************** */
 int reg_spline_cppComposition(nifti_image *grid1,
                               nifti_image *grid2,
+                              nifti_image *outputGrid,
                               bool displacement1,
                               bool displacement2,
                               bool bspline)
 {
-   // REMINDER Grid2(x)=Grid1(Grid2(x))
+   // REMINDER outputGrid(x)=Grid1(Grid2(x))
 
-   if(grid1->datatype != grid2->datatype)
+   if(grid1->datatype != grid2->datatype || grid1->datatype != outputGrid->datatype)
    {
       reg_print_fct_error("reg_spline_cppComposition");
-      reg_print_msg_error("Both input images do not have the same type.");
+      reg_print_msg_error("The input images do not have the same type.");
       reg_exit();
    }
-
- #if _USE_SSE
-   if(grid1->datatype != NIFTI_TYPE_FLOAT32)
+   if(grid2->nvox != outputGrid->nvox)
    {
       reg_print_fct_error("reg_spline_cppComposition");
-      reg_print_msg_error("SSE computation has only been implemented for single precision.");
+      reg_print_msg_error("The second and output grids do not have the same size.");
+      reg_exit();
+   }
+   if(grid1->data == outputGrid->data)
+   {
+      reg_print_fct_error("reg_spline_cppComposition");
+      reg_print_msg_error("The first grid can not be overwritten.");
       reg_exit();
    }
- #endif
 
    if(grid1->nz>1)
    {
@@ -3931,11 +4311,11 @@ int reg_spline_cppComposition(nifti_image *grid1,
       {
       case NIFTI_TYPE_FLOAT32:
          reg_spline_cppComposition_3D<float>
-               (grid1, grid2, displacement1, displacement2, bspline);
+               (grid1, grid2, outputGrid, displacement1, displacement2, bspline);
          break;
       case NIFTI_TYPE_FLOAT64:
          reg_spline_cppComposition_3D<double>
-               (grid1, grid2, displacement1, displacement2, bspline);
+               (grid1, grid2, outputGrid, displacement1, displacement2, bspline);
          break;
       default:
          reg_print_fct_error("reg_spline_cppComposition");
@@ -3945,15 +4325,23 @@ int reg_spline_cppComposition(nifti_image *grid1,
    }
    else
    {
+ #if _USE_SSE
+      if(grid1->datatype != NIFTI_TYPE_FLOAT32)
+      {
+         reg_print_fct_error("reg_spline_cppComposition");
+         reg_print_msg_error("SSE computation has only been implemented for single precision.");
+         reg_exit();
+      }
+ #endif
       switch(grid1->datatype)
       {
       case NIFTI_TYPE_FLOAT32:
          reg_spline_cppComposition_2D<float>
-               (grid1, grid2, displacement1, displacement2, bspline);
+               (grid1, grid2, outputGrid, displacement1, displacement2, bspline);
          break;
       case NIFTI_TYPE_FLOAT64:
          reg_spline_cppComposition_2D<double>
-               (grid1, grid2, displacement1, displacement2, bspline);
+               (grid1, grid2, outputGrid, displacement1, displacement2, bspline);
          break;
       default:
          reg_print_fct_error("reg_spline_cppComposition");
@@ -3964,6 +4352,21 @@ int reg_spline_cppComposition(nifti_image *grid1,
    return EXIT_SUCCESS;
 }
 /* *************************************************************** */
+int reg_spline_cppComposition(nifti_image *grid1,
+                              nifti_image *grid2,
+                              bool displacement1,
+                              bool displacement2,
+                              bool bspline)
+{
+   // REMINDER Grid2(x)=Grid1(Grid2(x))
+   return reg_spline_cppComposition(grid1,
+                                    grid2,
+                                    grid2,
+                                    displacement1,
+                                    displacement2,
+                                    bspline);
+}
+/* *************************************************************** */
 /* *************************************************************** */
 void reg_spline_getFlowFieldFromVelocityGrid(nifti_image *velocityFieldGrid,
                                              nifti_image *flowField)
@@ -4000,36 +4403,12 @@ void reg_spline_getFlowFieldFromVelocityGrid(nifti_image *velocityFieldGrid,
    velocityFieldGrid->num_ext=oldNumExt;
 }
 /* *************************************************************** */
-void reg_defField_getDeformationFieldFromFlowField(nifti_image *flowFieldImage,
-                                                   nifti_image *deformationFieldImage,
-                                                   bool updateStepNumber)
+/// @brief Returns the number of squaring steps of a displacement flow
+/// field. It is computed from the flow magnitude and stored in the
+/// field intent_p2 if required, it is read from intent_p2 otherwise
+static int reg_defField_getSquaringNumber(nifti_image *flowFieldImage,
+                                          bool updateStepNumber)
 {
-   // Check first if the velocity field is actually a velocity field
-   if(flowFieldImage->intent_p1 != DEF_VEL_FIELD)
-   {
-      reg_print_fct_error("reg_defField_getDeformationFieldFromFlowField");
-      reg_print_msg_error("The provide field is not a velocity field");
-      reg_exit();
-   }
-
-   // Remove the affine component from the flow field
-   nifti_image *affineOnly=NULL;
-   if(flowFieldImage->num_ext>0)
-   {
-      if(flowFieldImage->ext_list[0].edata!=NULL)
-      {
-         // Create a field that contains the affine component only
-         affineOnly = nifti_copy_nim_info(deformationFieldImage);
-         affineOnly->data = (void *)calloc(affineOnly->nvox,affineOnly->nbyper);
-         reg_affine_getDeformationField(reinterpret_cast<mat44 *>(flowFieldImage->ext_list[0].edata),
-               affineOnly,
-               false);
-         reg_tools_substractImageToImage(flowFieldImage,affineOnly,flowFieldImage);
-      }
-   }
-   else reg_getDisplacementFromDeformation(flowFieldImage);
-
-   // Compute the number of scaling value to ensure unfolded transformation
    int squaringNumber = 1;
    if(updateStepNumber || flowFieldImage->intent_p2==0)
    {
@@ -4039,7 +4418,7 @@ void reg_defField_getDeformationFieldFromFlowField(nifti_image *flowFieldImage,
       extrema=extrema>temp?extrema:temp;
       // Check the values for scaling purpose
       float maxLength;
-      if(deformationFieldImage->nz>1)
+      if(flowFieldImage->nz>1)
          // 0.2888675 = sqrt(0.5^2/3)
          maxLength=0.28;
       // 0.3535533 = sqrt(0.5^2/2)
@@ -4068,6 +4447,50 @@ void reg_defField_getDeformationFieldFromFlowField(nifti_image *flowFieldImage,
       else flowFieldImage->intent_p2 = -squaringNumber;
    }
    else squaringNumber=static_cast<int>(fabsf(flowFieldImage->intent_p2));
+   return squaringNumber;
+}
+/* *************************************************************** */
+void reg_defField_getDeformationFieldFromFlowField(nifti_image *flowFieldImage,
+                                                   nifti_image *deformationFieldImage,
+                                                   bool updateStepNumber)
+{
+   // Check first if the velocity field is actually a velocity field
+   if(flowFieldImage->intent_p1 != DEF_VEL_FIELD)
+   {
+      reg_print_fct_error("reg_defField_getDeformationFieldFromFlowField");
+      reg_print_msg_error("The provide field is not a velocity field");
+      reg_exit();
+   }
+
+   // The flow and the deformation fields are used as the two buffers of the
+   // scaling-and-squaring and no other field is allocated
+   if(flowFieldImage->nvox != deformationFieldImage->nvox ||
+         flowFieldImage->datatype != deformationFieldImage->datatype)
+   {
+      reg_print_fct_error("reg_defField_getDeformationFieldFromFlowField");
+      reg_print_msg_error("The flow and deformation fields are expected to have the same size and type");
+      reg_exit();
+   }
+
+   // Remove the affine component from the flow field
+   bool removedAffine=false;
+   if(flowFieldImage->num_ext>0)
+   {
+      if(flowFieldImage->ext_list[0].edata!=NULL)
+      {
+         // The deformation field temporarly contains the affine component only
+         reg_affine_getDeformationField(reinterpret_cast<mat44 *>(flowFieldImage->ext_list[0].edata),
+               deformationFieldImage,
+               false);
+         reg_tools_substractImageToImage(flowFieldImage,deformationFieldImage,flowFieldImage);
+         removedAffine=true;
+      }
+   }
+   else reg_getDisplacementFromDeformation(flowFieldImage);
+
+   // Compute the number of scaling value to ensure unfolded transformation
+   int squaringNumber = reg_defField_getSquaringNumber(flowFieldImage,
+                                                       updateStepNumber);
 
    // The displacement field is scaled
    float scalingValue = pow(2.0f,std::abs((float)squaringNumber));
@@ -4085,33 +4508,37 @@ void reg_defField_getDeformationFieldFromFlowField(nifti_image *flowFieldImage,
    // Conversion from displacement to deformation
    reg_getDeformationFromDisplacement(flowFieldImage);
 
-   // The computed scaled deformation field is copied over
-   memcpy(deformationFieldImage->data, flowFieldImage->data,
-          deformationFieldImage->nvox*deformationFieldImage->nbyper);
-
-   // The deformation field is squared
-   for(unsigned short i=0; i<squaringNumber; ++i)
+   // The deformation field is squared by alternating between both buffers.
+   // The first buffer is chosen so that the last step ends in the
+   // deformation field image
+   nifti_image *squaringField[2]={flowFieldImage, deformationFieldImage};
+   if(squaringNumber%2==0)
    {
-      // The deformation field is applied to itself
-      reg_defField_compose(deformationFieldImage,
-                           flowFieldImage,
-                           NULL);
-      // The computed scaled deformation field is copied over
       memcpy(deformationFieldImage->data, flowFieldImage->data,
              deformationFieldImage->nvox*deformationFieldImage->nbyper);
+      squaringField[0]=deformationFieldImage;
+      squaringField[1]=flowFieldImage;
+   }
+   for(unsigned short i=0; i<squaringNumber; ++i)
+   {
+      // The deformation field is applied to itself
+      reg_defField_square(squaringField[i%2],
+                          squaringField[(i+1)%2]);
 #ifndef NDEBUG
       char text[255];
       sprintf(text, "Squaring (composition) step %u/%u", i+1, squaringNumber);
       reg_print_msg_debug(text);
 #endif
    }
-   // The affine conponent of the transformation is restored
-   if(affineOnly!=NULL)
+   // The affine conponent of the transformation is restored. The flow
+   // field is not needed anymore and stores the affine component
+   if(removedAffine)
    {
+      reg_affine_getDeformationField(reinterpret_cast<mat44 *>(flowFieldImage->ext_list[0].edata),
+            flowFieldImage,
+            false);
       reg_getDisplacementFromDeformation(deformationFieldImage);
-      reg_tools_addImageToImage(deformationFieldImage,affineOnly,deformationFieldImage);
-      nifti_image_free(affineOnly);
-      affineOnly=NULL;
+      reg_tools_addImageToImage(deformationFieldImage,flowFieldImage,deformationFieldImage);
    }
    deformationFieldImage->intent_p1=DEF_FIELD;
    deformationFieldImage->intent_p2=0;
@@ -4126,7 +4553,8 @@ void reg_defField_getDeformationFieldFromFlowField(nifti_image *flowFieldImage,
 /* *************************************************************** */
 void reg_spline_getDefFieldFromVelocityGrid(nifti_image *velocityFieldGrid,
                                             nifti_image *deformationFieldImage,
-                                            bool updateStepNumber)
+                                            bool updateStepNumber,
+                                            nifti_image *flowFieldWorkspace)
 {
    // Clean any extension in the deformation field as it is unexpected
    nifti_free_extensions(deformationFieldImage);
@@ -4144,16 +4572,35 @@ void reg_spline_getDefFieldFromVelocityGrid(nifti_image *velocityFieldGrid,
    }
    else if(velocityFieldGrid->intent_p1 == SPLINE_VEL_GRID)
    {
-      // Create an image to store the flow field
-      nifti_image *flowField = nifti_copy_nim_info(deformationFieldImage);
-      flowField->data = (void *)calloc(flowField->nvox,flowField->nbyper);
+      // Create an image to store the flow field, unless a workspace with
+      // the deformation field size is provided
+      nifti_image *flowField = flowFieldWorkspace;
+      if(flowField==NULL)
+      {
+         flowField = nifti_copy_nim_info(deformationFieldImage);
+         flowField->data = (void *)calloc(flowField->nvox,flowField->nbyper);
+         if(velocityFieldGrid->num_ext>0)
+            nifti_copy_extensions(flowField, velocityFieldGrid);
+      }
+      else
+      {
+         if(flowField->nvox != deformationFieldImage->nvox ||
+               flowField->datatype != deformationFieldImage->datatype)
+         {
+            reg_print_fct_error("reg_spline_getDefFieldFromVelocityGrid");
+            reg_print_msg_error("The workspace and deformation fields are expected to have the same size and type");
+            reg_exit();
+         }
+         memset(flowField->data, 0, flowField->nvox*flowField->nbyper);
+         // The affine components are borrowed from the grid
+         flowField->num_ext=velocityFieldGrid->num_ext;
+         flowField->ext_list=velocityFieldGrid->ext_list;
+      }
       flowField->intent_code=NIFTI_INTENT_VECTOR;
       memset(flowField->intent_name, 0, 16);
       strcpy(flowField->intent_name,"NREG_TRANS");
       flowField->intent_p1=DEF_VEL_FIELD;
       flowField->intent_p2=velocityFieldGrid->intent_p2;
-      if(velocityFieldGrid->num_ext>0)
-         nifti_copy_extensions(flowField, velocityFieldGrid);
 
       // Generate the velocity field
       reg_spline_getFlowFieldFromVelocityGrid(velocityFieldGrid,
@@ -4165,7 +4612,13 @@ void reg_spline_getDefFieldFromVelocityGrid(nifti_image *velocityFieldGrid,
       // Update the number of step required. No action otherwise
       velocityFieldGrid->intent_p2=flowField->intent_p2;
       // Clear the allocated flow field
-      nifti_image_free(flowField);
+      if(flowFieldWorkspace==NULL)
+         nifti_image_free(flowField);
+      else
+      {
+         flowField->num_ext=0;
+         flowField->ext_list=NULL;
+      }
    }
    else
    {
@@ -4176,6 +4629,214 @@ void reg_spline_getDefFieldFromVelocityGrid(nifti_image *velocityFieldGrid,
    return;
 }
 /* *************************************************************** */
+void reg_spline_getDefFieldFromVelGridAtNodes(nifti_image *velocityFieldGrid,
+                                              nifti_image *deformationFieldImage,
+                                              bool updateStepNumber,
+                                              bool upsampling,
+                                              nifti_image *affineWorkspace)
+{
+   // Check if the velocity field is actually a velocity field
+   if(velocityFieldGrid->intent_p1 != SPLINE_VEL_GRID)
+   {
+      reg_print_fct_error("reg_spline_getDefFieldFromVelGridAtNodes");
+      reg_print_msg_error("The provided input image is not a spline parametrised velocity grid");
+      reg_exit();
+   }
+   // Clean any extension in the deformation field as it is unexpected
+   nifti_free_extensions(deformationFieldImage);
+
+   // Two images are created to store the transformation at the node positions.
+   // They share the grid geometry, with a halved spacing when upsampling
+   nifti_image *nodeField[2];
+   nodeField[0]=nifti_copy_nim_info(velocityFieldGrid);
+   nifti_free_extensions(nodeField[0]);
+   if(upsampling)
+   {
+      // The node i of the grid becomes the node 2i-1 of the upsampled grid
+      mat44 halfSpacing;
+      reg_mat44_eye(&halfSpacing);
+      int dimNumber = velocityFieldGrid->nz>1?3:2;
+      for(int i=0; i<dimNumber; ++i)
+      {
+         nodeField[0]->dim[i+1]=(velocityFieldGrid->dim[i+1]-3)*2+3;
+         nodeField[0]->pixdim[i+1]=velocityFieldGrid->pixdim[i+1]/2.f;
+         halfSpacing.m[i][i]=0.5f;
+         halfSpacing.m[i][3]=0.5f;
+      }
+      nodeField[0]->nx=nodeField[0]->dim[1];
+      nodeField[0]->ny=nodeField[0]->dim[2];
+      nodeField[0]->nz=nodeField[0]->dim[3];
+      nodeField[0]->dx=nodeField[0]->pixdim[1];
+      nodeField[0]->dy=nodeField[0]->pixdim[2];
+      nodeField[0]->dz=nodeField[0]->pixdim[3];
+      nodeField[0]->nvox=(size_t)nodeField[0]->nx*nodeField[0]->ny*nodeField[0]->nz*
+            nodeField[0]->nt*nodeField[0]->nu;
+      nodeField[0]->qto_xyz=reg_mat44_mul(&velocityFieldGrid->qto_xyz,&halfSpacing);
+      nodeField[0]->qto_ijk=nifti_mat44_inverse(nodeField[0]->qto_xyz);
+      if(nodeField[0]->sform_code>0)
+      {
+         nodeField[0]->sto_xyz=reg_mat44_mul(&velocityFieldGrid->sto_xyz,&halfSpacing);
+         nodeField[0]->sto_ijk=nifti_mat44_inverse(nodeField[0]->sto_xyz);
+      }
+   }
+   nodeField[0]->data=(void *)malloc(nodeField[0]->nvox*nodeField[0]->nbyper);
+   nodeField[1]=nifti_copy_nim_info(nodeField[0]);
+   nodeField[1]->data=(void *)malloc(nodeField[1]->nvox*nodeField[1]->nbyper);
+   nifti_image *nodeAffine=NULL;
+   if(velocityFieldGrid->num_ext>0 && velocityFieldGrid->ext_list[0].edata!=NULL)
+   {
+      nodeAffine=nifti_copy_nim_info(nodeField[0]);
+      nodeAffine->data=(void *)malloc(nodeAffine->nvox*nodeAffine->nbyper);
+   }
+
+   // The scaled flow is evaluated at the node positions
+   int squaringNumber = reg_spline_getScaledDefFieldFromVelGrid(velocityFieldGrid,
+                                                                nodeField[0],
+                                                                nodeAffine,
+                                                                updateStepNumber);
+   if(nodeAffine!=NULL)
+      nifti_image_free(nodeAffine);
+
+   // The node values are squared using a cubic spline interpolation, which
+   // is interpolating and thus keeps the node values as coefficients
+   for(unsigned short i=0; i<squaringNumber; ++i)
+   {
+      reg_spline_cppComposition(nodeField[i%2],
+                                nodeField[i%2],
+                                nodeField[(i+1)%2],
+                                false, // deformation
+                                false, // deformation
+                                false // cubic spline
+                                );
+#ifndef NDEBUG
+      char text[255];
+      sprintf(text, "Squaring (composition) step %u/%u at the control point level", i+1, squaringNumber);
+      reg_print_msg_debug(text);
+#endif
+   }
+
+   // The dense deformation field is only generated from the final values.
+   // The grid is evaluated at the voxel real positions, as the grid origin
+   // is not necessarily aligned with the voxel lattice
+   memset(deformationFieldImage->data, 0,
+          deformationFieldImage->nvox*deformationFieldImage->nbyper);
+   deformationFieldImage->intent_p1=DISP_FIELD;
+   reg_getDeformationFromDisplacement(deformationFieldImage);
+   nodeField[squaringNumber%2]->intent_p1=CUB_SPLINE_GRID;
+   reg_spline_getDeformationField(nodeField[squaringNumber%2],
+                                  deformationFieldImage,
+                                  NULL, // mask
+                                  true, // composition
+                                  false // cubic spline
+                                  );
+   nifti_image_free(nodeField[0]);
+   nifti_image_free(nodeField[1]);
+
+   // The affine components are restored at the voxel level
+   nifti_image *affineField=NULL;
+   if(velocityFieldGrid->num_ext>0 && velocityFieldGrid->ext_list[0].edata!=NULL)
+   {
+      affineField=affineWorkspace;
+      if(affineField==NULL)
+      {
+         affineField=nifti_copy_nim_info(deformationFieldImage);
+         affineField->data=(void *)malloc(affineField->nvox*affineField->nbyper);
+      }
+      reg_affine_getDeformationField(reinterpret_cast<mat44 *>(velocityFieldGrid->ext_list[0].edata),
+            affineField,
+            false);
+   }
+   reg_spline_restoreAffineFromVelGrid(velocityFieldGrid,
+                                       affineField,
+                                       deformationFieldImage);
+   if(affineField!=NULL && affineField!=affineWorkspace)
+      nifti_image_free(affineField);
+}
+/* *************************************************************** */
+/* *************************************************************** */
+int reg_spline_getScaledDefFieldFromVelGrid(nifti_image *velocityFieldGrid,
+                                            nifti_image *scaledField,
+                                            nifti_image *affineField,
+                                            bool updateStepNumber)
+{
+   // Check if the velocity field is actually a velocity field
+   if(velocityFieldGrid->intent_p1 != SPLINE_VEL_GRID)
+   {
+      reg_print_fct_error("reg_spline_getScaledDefFieldFromVelGrid");
+      reg_print_msg_error("The provided input image is not a spline parametrised transformation");
+      reg_exit();
+   }
+   bool hasAffine = velocityFieldGrid->num_ext>0 &&
+         velocityFieldGrid->ext_list[0].edata!=NULL;
+   if(hasAffine && affineField==NULL)
+   {
+      reg_print_fct_error("reg_spline_getScaledDefFieldFromVelGrid");
+      reg_print_msg_error("An image is required to store the affine component");
+      reg_exit();
+   }
+
+   // The flow field is generated directly in the scaled field image
+   scaledField->intent_code=NIFTI_INTENT_VECTOR;
+   memset(scaledField->intent_name, 0, 16);
+   strcpy(scaledField->intent_name,"NREG_TRANS");
+   memset(scaledField->data, 0, scaledField->nvox*scaledField->nbyper);
+   reg_spline_getFlowFieldFromVelocityGrid(velocityFieldGrid,
+                                           scaledField);
+   // Remove the affine component from the flow field
+   if(hasAffine)
+   {
+      reg_affine_getDeformationField(reinterpret_cast<mat44 *>(velocityFieldGrid->ext_list[0].edata),
+            affineField,
+            false);
+      reg_tools_substractImageToImage(scaledField,affineField,scaledField);
+   }
+   else if(velocityFieldGrid->num_ext==0)
+      reg_getDisplacementFromDeformation(scaledField);
+
+   // Compute the number of scaling value to ensure unfolded transformation
+   int squaringNumber = reg_defField_getSquaringNumber(scaledField,
+                                                       updateStepNumber);
+   velocityFieldGrid->intent_p2=scaledField->intent_p2;
+
+   // The displacement field is scaled
+   float scalingValue = pow(2.0f,std::abs((float)squaringNumber));
+   if(velocityFieldGrid->intent_p2<0)
+      // backward deformation field is scaled down
+      reg_tools_divideValueToImage(scaledField,
+                                   scaledField,
+                                   -scalingValue); // (/-scalingValue)
+   else
+      // forward deformation field is scaled down
+      reg_tools_divideValueToImage(scaledField,
+                                   scaledField,
+                                   scalingValue); // (/scalingValue)
+
+   // Conversion from displacement to deformation
+   reg_getDeformationFromDisplacement(scaledField);
+   return squaringNumber;
+}
+/* *************************************************************** */
+void reg_spline_restoreAffineFromVelGrid(nifti_image *velocityFieldGrid,
+                                         nifti_image *affineField,
+                                         nifti_image *deformationField)
+{
+   // The affine conponent of the transformation is restored
+   if(velocityFieldGrid->num_ext>0 &&
+         velocityFieldGrid->ext_list[0].edata!=NULL)
+   {
+      reg_getDisplacementFromDeformation(deformationField);
+      reg_tools_addImageToImage(deformationField,affineField,deformationField);
+   }
+   deformationField->intent_p1=DEF_FIELD;
+   deformationField->intent_p2=0;
+   // If required an affine component is composed
+   if(velocityFieldGrid->num_ext>1)
+   {
+      reg_affine_getDeformationField(reinterpret_cast<mat44 *>(velocityFieldGrid->ext_list[1].edata),
+            deformationField,
+            true);
+   }
+}
 /* *************************************************************** */
 void reg_spline_getIntermediateDefFieldFromVelGrid(nifti_image *velocityFieldGrid,
                                                    nifti_image **deformationFieldImage)
@@ -4183,70 +4844,26 @@ void reg_spline_getIntermediateDefFieldFromVelGrid(nifti_image *velocityFieldGri
    // Check if the velocity field is actually a velocity field
    if(velocityFieldGrid->intent_p1 == SPLINE_VEL_GRID)
    {
-      // Create an image to store the flow field
-      nifti_image *flowFieldImage = nifti_copy_nim_info(deformationFieldImage[0]);
-      flowFieldImage->data = (void *)calloc(flowFieldImage->nvox,flowFieldImage->nbyper);
-      flowFieldImage->intent_code=NIFTI_INTENT_VECTOR;
-      memset(flowFieldImage->intent_name, 0, 16);
-      strcpy(flowFieldImage->intent_name,"NREG_TRANS");
-      flowFieldImage->intent_p1=DEF_VEL_FIELD;
-      flowFieldImage->intent_p2=velocityFieldGrid->intent_p2;
-      if(velocityFieldGrid->num_ext>0 && flowFieldImage->ext_list==NULL)
-         nifti_copy_extensions(flowFieldImage, velocityFieldGrid);
-
-      // Generate the velocity field
-      reg_spline_getFlowFieldFromVelocityGrid(velocityFieldGrid,
-                                              flowFieldImage);
-      // Remove the affine component from the flow field
+      // Create a field that contains the affine component only
       nifti_image *affineOnly=NULL;
-      if(flowFieldImage->num_ext>0)
+      if(velocityFieldGrid->num_ext>0 && velocityFieldGrid->ext_list[0].edata!=NULL)
       {
-         if(flowFieldImage->ext_list[0].edata!=NULL)
-         {
-            // Create a field that contains the affine component only
-            affineOnly = nifti_copy_nim_info(deformationFieldImage[0]);
-            affineOnly->data = (void *)calloc(affineOnly->nvox,affineOnly->nbyper);
-            reg_affine_getDeformationField(reinterpret_cast<mat44 *>(flowFieldImage->ext_list[0].edata),
-                  affineOnly,
-                  false);
-            reg_tools_substractImageToImage(flowFieldImage,affineOnly,flowFieldImage);
-         }
+         affineOnly = nifti_copy_nim_info(deformationFieldImage[0]);
+         affineOnly->data = (void *)malloc(affineOnly->nvox*affineOnly->nbyper);
       }
-      else reg_getDisplacementFromDeformation(flowFieldImage);
-
-      // Compute the number of scaling value to ensure unfolded transformation
-      int squaringNumber = static_cast<int>(fabsf(velocityFieldGrid->intent_p2));
-
-      // The displacement field is scaled
-      float scalingValue = pow(2.0f,std::abs((float)squaringNumber));
-      if(velocityFieldGrid->intent_p2<0)
-         // backward deformation field is scaled down
-         reg_tools_divideValueToImage(flowFieldImage,
-                                      deformationFieldImage[0],
-                                      -scalingValue); // (/-scalingValue)
-      else
-         // forward deformation field is scaled down
-         reg_tools_divideValueToImage(flowFieldImage,
-                                      deformationFieldImage[0],
-                                      scalingValue); // (/scalingValue)
 
-      // Clear the allocated flow field
-      nifti_image_free(flowFieldImage);
-      flowFieldImage=NULL;
-
-      // Conversion from displacement to deformation
-      reg_getDeformationFromDisplacement(deformationFieldImage[0]);
+      // The first field is the scaled flow field without affine component
+      int squaringNumber = reg_spline_getScaledDefFieldFromVelGrid(velocityFieldGrid,
+                                                                   deformationFieldImage[0],
+                                                                   affineOnly,
+                                                                   false);
 
       // The deformation field is squared
       for(unsigned short i=0; i<squaringNumber; ++i)
       {
-         // The computed scaled deformation field is copied over
-         memcpy(deformationFieldImage[i+1]->data, deformationFieldImage[i]->data,
-               deformationFieldImage[i]->nvox*deformationFieldImage[i]->nbyper);
          // The deformation field is applied to itself
-         reg_defField_compose(deformationFieldImage[i], // to apply
-                              deformationFieldImage[i+1], // to update
-               NULL);
+         reg_defField_square(deformationFieldImage[i],
+                             deformationFieldImage[i+1]);
    #ifndef NDEBUG
          char text[255];
          sprintf(text, "Squaring (composition) step %u/%u", i+1, squaringNumber);
@@ -4254,26 +4871,12 @@ void reg_spline_getIntermediateDefFieldFromVelGrid(nifti_image *velocityFieldGri
    #endif
       }
       // The affine conponent of the transformation is restored
+      for(unsigned short i=0; i<=squaringNumber; ++i)
+         reg_spline_restoreAffineFromVelGrid(velocityFieldGrid,
+                                             affineOnly,
+                                             deformationFieldImage[i]);
       if(affineOnly!=NULL)
-      {
-         for(unsigned short i=0; i<=squaringNumber; ++i){
-            reg_getDisplacementFromDeformation(deformationFieldImage[i]);
-            reg_tools_addImageToImage(deformationFieldImage[i],affineOnly,deformationFieldImage[i]);
-            deformationFieldImage[i]->intent_p1=DEF_FIELD;
-            deformationFieldImage[i]->intent_p2=0;
-         }
          nifti_image_free(affineOnly);
-         affineOnly=NULL;
-      }
-      // If required an affine component is composed
-      if(velocityFieldGrid->num_ext>1)
-      {
-         for(unsigned short i=0; i<=squaringNumber; ++i){
-            reg_affine_getDeformationField(reinterpret_cast<mat44 *>(velocityFieldGrid->ext_list[1].edata),
-                  deformationFieldImage[i],
-                  true);
-         }
-      }
    }
    else
    {
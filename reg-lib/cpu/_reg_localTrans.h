@@ -61,6 +61,9 @@ void reg_createSymmetricControlPointGrids(nifti_image **forwardGridImage,
  * the deformation is starting from a blank grid otherwise.
  * @param bspline A cubic B-Spline scheme is used if the value is set to true,
  * a cubic spline scheme is used otherwise (interpolant spline).
+ * @param force_no_lut Deprecated and ignored. It was used to disable the lookup
+ * table of basis values, which is superseded by the evaluation of the field one
+ * control point cell at a time.
  */
 extern "C++"
 void reg_spline_getDeformationField(nifti_image *controlPointGridImage,
@@ -90,6 +93,32 @@ void reg_voxelCentric2NodeCentric(nifti_image *nodeImage,
                                   mat44 *voxelToMillimeter = NULL
       );
 /* *************************************************************** */
+/** @brief Project a dense image onto the nodes of a cubic B-spline grid
+ * using the transpose of the spline evaluation: every voxel value is
+ * accumulated into its 4x4x4 supporting nodes, weighted by the B-spline
+ * basis values. It is used to obtain the gradient of an objective
+ * function with respect to the control points from its voxel-based
+ * gradient, without convolving the voxel-based gradient.
+ * @param nodeImage This image is a coarse representation of the
+ * transformation (typically a grid of control point). This image
+ * values are going to be updated
+ * @param voxelImage This image contains a dense representation
+ * of the gradient. NaN values are ignored.
+ * @param weight The values from used to update the node image
+ * will be multiplied by the weight
+ * @param update The values in node image will be incremented if
+ * update is set to true; a blank node image is considered otherwise
+ * @param voxelToMillimeter Orientation of the image used to compute
+ * the voxel-based gradient
+ */
+extern "C++"
+void reg_spline_voxelCentric2NodeCentric(nifti_image *nodeImage,
+                                         nifti_image *voxelImage,
+                                         float weight,
+                                         bool update,
+                                         mat44 *voxelToMillimeter = NULL
+      );
+/* *************************************************************** */
 /** @brief Refine a grid of control points
  * @param referenceImage Image that defined the space of the reference
  * image
@@ -101,6 +130,23 @@ void reg_spline_refineControlPointGrid(nifti_image *controlPointGridImage,
                                        nifti_image *referenceImage = NULL
       );
 /* *************************************************************** */
+/** @brief Extend a grid of control points so that it covers a
+ * reference image. The added nodes lie on the lattice of the input grid
+ * and the existing nodes are left untouched, which preserves the
+ * transformation wherever the input grid was defined
+ * @param controlPointGridImage Grid of control point positions. It is
+ * replaced by a newly allocated extended grid if required
+ * @param referenceImage Image that defines the space to cover
+ * @param affineTransformation Affine transformation followed by the
+ * added nodes, on top of the displacement of their closest existing
+ * node. The identity is used if NULL
+ */
+extern "C++"
+void reg_spline_extendControlPointGrid(nifti_image **controlPointGridImage,
+                                       nifti_image *referenceImage,
+                                       mat44 *affineTransformation = NULL
+      );
+/* *************************************************************** */
 /** @brief This function compose the a first control point image with a second one:
  * Grid2(x) <= Grid1(Grid2(x)).
  * Grid1 and Grid2 have to contain either displacement or deformation.
@@ -123,6 +169,29 @@ int reg_spline_cppComposition(nifti_image *grid1,
                               bool bspline
                               );
 /* *************************************************************** */
+/** @brief This function compose the a first control point image with a second one
+ * and stores the result in a third image: outputGrid(x) <= Grid1(Grid2(x)).
+ * The output grid can be the second grid but not the first one. A grid
+ * can thus be squared without copy by using it as both grid1 and grid2.
+ * @param grid1 Image that contains the first grid of control points
+ * @param grid2 Image that contains the second grid of control points
+ * @param outputGrid Image that will contain the composed grid
+ * @param displacement1 The first grid is a displacement field if this
+ * value is set to true, a deformation field otherwise
+ * @param displacement2 The second grid is a displacement field if this
+ * value is set to true, a deformation field otherwise
+ * @param Cubic B-Spline can be used (bspline==true)
+ * or cubic Spline (bspline==false)
+ */
+extern "C++"
+int reg_spline_cppComposition(nifti_image *grid1,
+                              nifti_image *grid2,
+                              nifti_image *outputGrid,
+                              bool displacement1,
+                              bool displacement2,
+                              bool bspline
+                              );
+/* *************************************************************** */
 /** @brief Preforms the composition of two deformation fields
  * The deformation field image is applied to the second image:
  * dfToUpdate. Both images are expected to contain deformation
@@ -140,7 +209,40 @@ void reg_defField_compose(nifti_image *deformationField,
                           nifti_image *dfToUpdate,
                           int *mask);
 /* *************************************************************** */
-/** @brief Compute the inverse of a deformation field
+/** @brief Preforms the composition of two deformation fields without
+ * modifying the field that contains the positions:
+ * outputField(x) = deformationField(positionField(x)).
+ * The output field can be the position field, in which case the
+ * composition is done in place.
+ * @param deformationField Image that contains the deformation field
+ * that will be applied
+ * @param positionField Image that contains the deformation field
+ * whose positions are interpolated
+ * @param outputField Image that will contain the composed field. The
+ * voxels outside of the mask receive their position.
+ * @param mask Mask overlaid on the output field. NULL selects all voxels
+ */
+extern "C++"
+void reg_defField_compose(nifti_image *deformationField,
+                          nifti_image *positionField,
+                          nifti_image *outputField,
+                          int *mask);
+/* *************************************************************** */
+/** @brief Squares a deformation field in a single trilinear pass:
+ * squaredField(x) = deformationField(deformationField(x)).
+ * Both images are expected to contain deformation fields with the same
+ * size and type and can not share their data.
+ * @param deformationField Image that contains the field to square
+ * @param squaredField Image that will contain the squared field
+ */
+extern "C++"
+void reg_defField_square(nifti_image *deformationField,
+                         nifti_image *squaredField);
+/* *************************************************************** */
+/** @brief Compute the inverse of a deformation field. Every voxel is
+ * inverted using a preconditioned fixed-point iteration initialised from
+ * its already inverted neighbours. A Nelder-Mead simplex is only used
+ * where the iteration does not converge, e.g. in folded regions.
  * @author Marcel van Herk (CMIC / NKI / AVL)
  * @param inputDeformationField Image that contains the deformation
  * field to invert.
@@ -154,6 +256,17 @@ void reg_defFieldInvert(nifti_image *inputDeformationField,
                         nifti_image *outputDeformationField,
                         float tolerance);
 /* *************************************************************** */
+/** @brief The deformation field is computed by scaling-and-squaring
+ * of a flow field. The flow field and the deformation field images are
+ * used alternately to store the squared fields and no other image is
+ * allocated: the flow field content is lost.
+ * @param flowFieldImage Image that contains the flow field. It has
+ * to have the same size and type as the deformation field.
+ * @param deformationFieldImage Deformation field image that will
+ * be filled using the exponentiation of the flow field.
+ * @param updateStepNumber The number of squaring steps is updated
+ * from the flow field magnitude if true.
+ */
 extern "C++"
 void reg_defField_getDeformationFieldFromFlowField(nifti_image *flowFieldImage,
                                                    nifti_image *deformationFieldImage,
@@ -166,12 +279,75 @@ void reg_defField_getDeformationFieldFromFlowField(nifti_image *flowFieldImage,
  * parametrised using a grid of control points
  * @param deformationFieldImage Deformation field image that will
  * be filled using the exponentiation of the velocity field.
+ * @param flowFieldWorkspace Optional image with the deformation field
+ * size and type that is used to store the flow field. A temporary
+ * image is allocated when it is NULL.
  */
 extern "C++"
 void reg_spline_getDefFieldFromVelocityGrid(nifti_image *velocityFieldGrid,
                                             nifti_image *deformationFieldImage,
+                                            bool updateStepNumber,
+                                            nifti_image *flowFieldWorkspace = NULL);
+/* *************************************************************** */
+/** @brief The deformation field is computed by integrating a velocity
+ * grid at the control point resolution. The scaled flow is evaluated at
+ * the node positions, the squaring steps compose the node values using a
+ * cubic spline interpolation and the dense field is only generated from
+ * the final values.
+ * @param velocityFieldGrid Image that contains a velocity field
+ * parametrised using a grid of control points
+ * @param deformationFieldImage Deformation field image that will
+ * be filled using the exponentiation of the velocity field.
+ * @param updateStepNumber The number of squaring steps is updated
+ * from the flow magnitude if true.
+ * @param upsampling The squaring is performed on nodes with half the
+ * control point spacing if true.
+ * @param affineWorkspace Optional image with the deformation field
+ * size and type used to restore the affine component of the grid.
+ */
+extern "C++"
+void reg_spline_getDefFieldFromVelGridAtNodes(nifti_image *velocityFieldGrid,
+                                              nifti_image *deformationFieldImage,
+                                              bool updateStepNumber,
+                                              bool upsampling,
+                                              nifti_image *affineWorkspace = NULL);
+/* *************************************************************** */
+/** @brief Computes the first field of the scaling-and-squaring of a
+ * velocity grid, i.e. the scaled flow field without its affine
+ * component. The following fields are obtained using reg_defField_square
+ * and are made complete using reg_spline_restoreAffineFromVelGrid.
+ * @param velocityFieldGrid Image that contains a velocity field
+ * parametrised using a grid of control points
+ * @param scaledField Deformation field image that will contain the
+ * scaled flow field
+ * @param affineField Image that will contain the affine component of
+ * the grid. It is only required when the grid has an affine component.
+ * @param updateStepNumber The number of squaring steps is updated
+ * from the flow magnitude if true.
+ * @return The number of squaring steps
+ */
+extern "C++"
+int reg_spline_getScaledDefFieldFromVelGrid(nifti_image *velocityFieldGrid,
+                                            nifti_image *scaledField,
+                                            nifti_image *affineField,
                                             bool updateStepNumber);
 /* *************************************************************** */
+/** @brief Restores the affine components of a velocity grid into a
+ * field obtained by scaling-and-squaring.
+ * @param velocityFieldGrid Image that contains a velocity field
+ * parametrised using a grid of control points
+ * @param affineField Image filled by reg_spline_getScaledDefFieldFromVelGrid
+ * @param deformationField Deformation field image that is updated
+ */
+extern "C++"
+void reg_spline_restoreAffineFromVelGrid(nifti_image *velocityFieldGrid,
+                                         nifti_image *affineField,
+                                         nifti_image *deformationField);
+/* *************************************************************** */
+/** @brief All the intermediate fields of the scaling-and-squaring of a
+ * velocity grid are computed. The array has to contain
+ * |velocityFieldGrid->intent_p2|+1 allocated images.
+ */
 extern "C++"
 void reg_spline_getIntermediateDefFieldFromVelGrid(nifti_image *velocityFieldGrid,
                                                    nifti_image **deformationFieldImage);
@@ -11,6 +11,7 @@
  */
 
 #include "_reg_localTrans_jac.h"
+#include "_reg_simd.h"
 
 #define _USE_SQUARE_LOG_JAC
 
@@ -682,7 +683,6 @@ void reg_cubic_spline_jacobian3D(nifti_image *splineControlPoint,
          float f[4];
       } val;
       __m128 _xBasis, _xFirst, _yBasis, _yFirst;
-      __m128 tempX_x, tempX_y, tempX_z, tempY_x, tempY_y, tempY_z, tempZ_x, tempZ_y, tempZ_z;
 #ifdef _WINDOWS
       union
       {
@@ -785,6 +785,8 @@ void reg_cubic_spline_jacobian3D(nifti_image *splineControlPoint,
       DTYPE basisX[64], basisY[64], basisZ[64];
       DTYPE coeffX[64], coeffY[64], coeffZ[64];
 #endif
+      // The 9 weighted sums of the Jacobian matrix use the widest vectorised kernel
+      const reg_simd_kernels *simdKernels = reg_simd_getKernels();
       DTYPE gridVoxelSpacing[3]=
       {
          splineControlPoint->dx / referenceImage->dx,
@@ -929,64 +931,15 @@ void reg_cubic_spline_jacobian3D(nifti_image *splineControlPoint,
                   }
                   // Compute the Jacobian matrix
 #if _USE_SSE
-                  tempX_x =  _mm_set_ps1(0.0);
-                  tempX_y =  _mm_set_ps1(0.0);
-                  tempX_z =  _mm_set_ps1(0.0);
-                  tempY_x =  _mm_set_ps1(0.0);
-                  tempY_y =  _mm_set_ps1(0.0);
-                  tempY_z =  _mm_set_ps1(0.0);
-                  tempZ_x =  _mm_set_ps1(0.0);
-                  tempZ_y =  _mm_set_ps1(0.0);
-                  tempZ_z =  _mm_set_ps1(0.0);
-                  //addition and multiplication of the 16 basis value and CP position for each axis
-                  for(incr0=0; incr0<16; ++incr0)
-                  {
-                     tempX_x = _mm_add_ps(_mm_mul_ps(basisX.m[incr0], coeffX.m[incr0]), tempX_x );
-                     tempX_y = _mm_add_ps(_mm_mul_ps(basisY.m[incr0], coeffX.m[incr0]), tempX_y );
-                     tempX_z = _mm_add_ps(_mm_mul_ps(basisZ.m[incr0], coeffX.m[incr0]), tempX_z );
-
-                     tempY_x = _mm_add_ps(_mm_mul_ps(basisX.m[incr0], coeffY.m[incr0]), tempY_x );
-                     tempY_y = _mm_add_ps(_mm_mul_ps(basisY.m[incr0], coeffY.m[incr0]), tempY_y );
-                     tempY_z = _mm_add_ps(_mm_mul_ps(basisZ.m[incr0], coeffY.m[incr0]), tempY_z );
-
-                     tempZ_x = _mm_add_ps(_mm_mul_ps(basisX.m[incr0], coeffZ.m[incr0]), tempZ_x );
-                     tempZ_y = _mm_add_ps(_mm_mul_ps(basisY.m[incr0], coeffZ.m[incr0]), tempZ_y );
-                     tempZ_z = _mm_add_ps(_mm_mul_ps(basisZ.m[incr0], coeffZ.m[incr0]), tempZ_z );
-                  }
-
-                  //the values stored in SSE variables are transfered to normal float
-                  val.m = tempX_x;
-                  jacobianMatrix.m[0][0] = val.f[0]+val.f[1]+val.f[2]+val.f[3];
-                  val.m = tempX_y;
-                  jacobianMatrix.m[0][1] = val.f[0]+val.f[1]+val.f[2]+val.f[3];
-                  val.m = tempX_z;
-                  jacobianMatrix.m[0][2] = val.f[0]+val.f[1]+val.f[2]+val.f[3];
-                  val.m = tempY_x;
-                  jacobianMatrix.m[1][0] = val.f[0]+val.f[1]+val.f[2]+val.f[3];
-                  val.m = tempY_y;
-                  jacobianMatrix.m[1][1] = val.f[0]+val.f[1]+val.f[2]+val.f[3];
-                  val.m = tempY_z;
-                  jacobianMatrix.m[1][2] = val.f[0]+val.f[1]+val.f[2]+val.f[3];
-                  val.m = tempZ_x;
-                  jacobianMatrix.m[2][0] = val.f[0]+val.f[1]+val.f[2]+val.f[3];
-                  val.m = tempZ_y;
-                  jacobianMatrix.m[2][1] = val.f[0]+val.f[1]+val.f[2]+val.f[3];
-                  val.m = tempZ_z;
-                  jacobianMatrix.m[2][2] = val.f[0]+val.f[1]+val.f[2]+val.f[3];
+                  reg_simd_splineJacobian(simdKernels,
+                                          basisX.f, basisY.f, basisZ.f,
+                                          coeffX.f, coeffY.f, coeffZ.f,
+                                          &jacobianMatrix.m[0][0]);
 #else
-                  memset(&jacobianMatrix, 0, sizeof(mat33));
-                  for(incr0=0; incr0<64; ++incr0)
-                  {
-                     jacobianMatrix.m[0][0] += basisX[incr0]*coeffX[incr0];
-                     jacobianMatrix.m[0][1] += basisY[incr0]*coeffX[incr0];
-                     jacobianMatrix.m[0][2] += basisZ[incr0]*coeffX[incr0];
-                     jacobianMatrix.m[1][0] += basisX[incr0]*coeffY[incr0];
-                     jacobianMatrix.m[1][1] += basisY[incr0]*coeffY[incr0];
-                     jacobianMatrix.m[1][2] += basisZ[incr0]*coeffY[incr0];
-                     jacobianMatrix.m[2][0] += basisX[incr0]*coeffZ[incr0];
-                     jacobianMatrix.m[2][1] += basisY[incr0]*coeffZ[incr0];
-                     jacobianMatrix.m[2][2] += basisZ[incr0]*coeffZ[incr0];
-                  }
+                  reg_simd_splineJacobian(simdKernels,
+                                          basisX, basisY, basisZ,
+                                          coeffX, coeffY, coeffZ,
+                                          &jacobianMatrix.m[0][0]);
 #endif
                   // reorient the matrix
                   jacobianMatrix=nifti_mat33_mul(reorientation,
@@ -1009,19 +962,18 @@ void reg_cubic_spline_jacobian3D(nifti_image *splineControlPoint,
 #pragma omp parallel for default(none) \
    shared(referenceImage, gridVoxelSpacing, splineControlPoint, \
    coeffPtrX, coeffPtrY, coeffPtrZ,reorientation, JacobianMatrices, \
-   JacobianDeterminants) \
+   JacobianDeterminants, simdKernels) \
    private(x, y, z, pre, oldPre, basis, val, \
    _xBasis, _xFirst, _yBasis, _yFirst, \
    tempX, tempY, tempZ, basisX, basisY, basisZ, \
    xBasis, xFirst, yBasis, yFirst, zBasis, zFirst, \
    coeffX, coeffY, coeffZ, incr0, \
-   jacobianMatrix, voxelIndex, \
-   tempX_x, tempX_y, tempX_z, tempY_x, tempY_y, tempY_z, tempZ_x, tempZ_y, tempZ_z)
+   jacobianMatrix, voxelIndex)
 #else // _USE_SEE
 #pragma omp parallel for default(none) \
    shared(referenceImage, gridVoxelSpacing, splineControlPoint, \
    coeffPtrX, coeffPtrY, coeffPtrZ, reorientation, JacobianMatrices, \
-   JacobianDeterminants) \
+   JacobianDeterminants, simdKernels) \
    private(x, y, z, pre, oldPre, basis, \
    basisX, basisY, basisZ, coord, tempX, tempY, tempZ, \
    xBasis, xFirst, yBasis, yFirst, zBasis, zFirst, \
@@ -1157,64 +1109,15 @@ void reg_cubic_spline_jacobian3D(nifti_image *splineControlPoint,
                      oldPre[2]=pre[2];
                   }
 #if _USE_SSE
-                  tempX_x =  _mm_set_ps1(0.0);
-                  tempX_y =  _mm_set_ps1(0.0);
-                  tempX_z =  _mm_set_ps1(0.0);
-                  tempY_x =  _mm_set_ps1(0.0);
-                  tempY_y =  _mm_set_ps1(0.0);
-                  tempY_z =  _mm_set_ps1(0.0);
-                  tempZ_x =  _mm_set_ps1(0.0);
-                  tempZ_y =  _mm_set_ps1(0.0);
-                  tempZ_z =  _mm_set_ps1(0.0);
-                  //addition and multiplication of the 16 basis value and CP position for each axis
-                  for(incr0=0; incr0<16; ++incr0)
-                  {
-                     tempX_x = _mm_add_ps(_mm_mul_ps(basisX.m[incr0], coeffX.m[incr0]), tempX_x );
-                     tempX_y = _mm_add_ps(_mm_mul_ps(basisY.m[incr0], coeffX.m[incr0]), tempX_y );
-                     tempX_z = _mm_add_ps(_mm_mul_ps(basisZ.m[incr0], coeffX.m[incr0]), tempX_z );
-
-                     tempY_x = _mm_add_ps(_mm_mul_ps(basisX.m[incr0], coeffY.m[incr0]), tempY_x );
-                     tempY_y = _mm_add_ps(_mm_mul_ps(basisY.m[incr0], coeffY.m[incr0]), tempY_y );
-                     tempY_z = _mm_add_ps(_mm_mul_ps(basisZ.m[incr0], coeffY.m[incr0]), tempY_z );
-
-                     tempZ_x = _mm_add_ps(_mm_mul_ps(basisX.m[incr0], coeffZ.m[incr0]), tempZ_x );
-                     tempZ_y = _mm_add_ps(_mm_mul_ps(basisY.m[incr0], coeffZ.m[incr0]), tempZ_y );
-                     tempZ_z = _mm_add_ps(_mm_mul_ps(basisZ.m[incr0], coeffZ.m[incr0]), tempZ_z );
-                  }
-
-                  //the values stored in SSE variables are transfered to normal float
-                  val.m = tempX_x;
-                  jacobianMatrix.m[0][0] = val.f[0]+val.f[1]+val.f[2]+val.f[3];
-                  val.m = tempX_y;
-                  jacobianMatrix.m[0][1] = val.f[0]+val.f[1]+val.f[2]+val.f[3];
-                  val.m = tempX_z;
-                  jacobianMatrix.m[0][2] = val.f[0]+val.f[1]+val.f[2]+val.f[3];
-                  val.m = tempY_x;
-                  jacobianMatrix.m[1][0] = val.f[0]+val.f[1]+val.f[2]+val.f[3];
-                  val.m = tempY_y;
-                  jacobianMatrix.m[1][1] = val.f[0]+val.f[1]+val.f[2]+val.f[3];
-                  val.m = tempY_z;
-                  jacobianMatrix.m[1][2] = val.f[0]+val.f[1]+val.f[2]+val.f[3];
-                  val.m = tempZ_x;
-                  jacobianMatrix.m[2][0] = val.f[0]+val.f[1]+val.f[2]+val.f[3];
-                  val.m = tempZ_y;
-                  jacobianMatrix.m[2][1] = val.f[0]+val.f[1]+val.f[2]+val.f[3];
-                  val.m = tempZ_z;
-                  jacobianMatrix.m[2][2] = val.f[0]+val.f[1]+val.f[2]+val.f[3];
+                  reg_simd_splineJacobian(simdKernels,
+                                          basisX.f, basisY.f, basisZ.f,
+                                          coeffX.f, coeffY.f, coeffZ.f,
+                                          &jacobianMatrix.m[0][0]);
 #else
-                  memset(&jacobianMatrix, 0, sizeof(mat33));
-                  for(incr0=0; incr0<64; ++incr0)
-                  {
-                     jacobianMatrix.m[0][0] += basisX[incr0]*coeffX[incr0];
-                     jacobianMatrix.m[0][1] += basisY[incr0]*coeffX[incr0];
-                     jacobianMatrix.m[0][2] += basisZ[incr0]*coeffX[incr0];
-                     jacobianMatrix.m[1][0] += basisX[incr0]*coeffY[incr0];
-                     jacobianMatrix.m[1][1] += basisY[incr0]*coeffY[incr0];
-                     jacobianMatrix.m[1][2] += basisZ[incr0]*coeffY[incr0];
-                     jacobianMatrix.m[2][0] += basisX[incr0]*coeffZ[incr0];
-                     jacobianMatrix.m[2][1] += basisY[incr0]*coeffZ[incr0];
-                     jacobianMatrix.m[2][2] += basisZ[incr0]*coeffZ[incr0];
-                  }
+                  reg_simd_splineJacobian(simdKernels,
+                                          basisX, basisY, basisZ,
+                                          coeffX, coeffY, coeffZ,
+                                          &jacobianMatrix.m[0][0]);
 #endif
                   jacobianMatrix=nifti_mat33_mul(reorientation,
                                                  jacobianMatrix);
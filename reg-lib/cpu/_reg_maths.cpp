@@ -977,6 +977,29 @@ double get_square_distance2D(float * first_point2D, float * second_point2D) {
           reg_pow2(first_point2D[1] - second_point2D[1]));
 }
 /* *************************************************************** */
+int reg_getTileNumber(const int *dim,
+                      int *tileNumber)
+{
+   tileNumber[0] = (dim[0] + REG_TILE_SIZE_X - 1) / REG_TILE_SIZE_X;
+   tileNumber[1] = (dim[1] + REG_TILE_SIZE_Y - 1) / REG_TILE_SIZE_Y;
+   tileNumber[2] = (dim[2] + REG_TILE_SIZE_Z - 1) / REG_TILE_SIZE_Z;
+   return tileNumber[0] * tileNumber[1] * tileNumber[2];
+}
+/* *************************************************************** */
+void reg_getTileBounds(int tile,
+                       const int *dim,
+                       const int *tileNumber,
+                       int *start,
+                       int *end)
+{
+   start[0] = (tile % tileNumber[0]) * REG_TILE_SIZE_X;
+   start[1] = ((tile / tileNumber[0]) % tileNumber[1]) * REG_TILE_SIZE_Y;
+   start[2] = (tile / (tileNumber[0] * tileNumber[1])) * REG_TILE_SIZE_Z;
+   end[0] = start[0] + REG_TILE_SIZE_X < dim[0] ? start[0] + REG_TILE_SIZE_X : dim[0];
+   end[1] = start[1] + REG_TILE_SIZE_Y < dim[1] ? start[1] + REG_TILE_SIZE_Y : dim[1];
+   end[2] = start[2] + REG_TILE_SIZE_Z < dim[2] ? start[2] + REG_TILE_SIZE_Z : dim[2];
+}
+/* *************************************************************** */
 // Calculate pythagorean distance
 template<class T>
 T pythag(T a, T b)
@@ -286,4 +286,34 @@ double get_square_distance3D(float * first_point3D, float * second_point3D);
 /* *************************************************************** */
 double get_square_distance2D(float * first_point2D, float * second_point2D);
 /* *************************************************************** */
+/** @brief Size of the tiles used to traverse the voxels of 3D images.
+ * The voxels of a tile map to close positions in the floating image or in
+ * the control point grid, whose values thus remain in cache while the tile
+ * is processed.
+ */
+#define REG_TILE_SIZE_X 16
+#define REG_TILE_SIZE_Y 16
+#define REG_TILE_SIZE_Z 16
+/* *************************************************************** */
+/** @brief Compute the number of tiles required to cover a 3D image
+ * @param dim Image dimension along the x, y and z axes
+ * @param tileNumber Number of tiles along the x, y and z axes
+ * @return Total number of tiles
+ */
+int reg_getTileNumber(const int *dim,
+                      int *tileNumber);
+/* *************************************************************** */
+/** @brief Compute the voxel range covered by a tile
+ * @param tile Index of the tile, the tiles being ordered along x, then y and z
+ * @param dim Image dimension along the x, y and z axes
+ * @param tileNumber Number of tiles along the x, y and z axes
+ * @param start First voxel of the tile along the x, y and z axes
+ * @param end Last voxel (excluded) of the tile along the x, y and z axes
+ */
+void reg_getTileBounds(int tile,
+                       const int *dim,
+                       const int *tileNumber,
+                       int *start,
+                       int *end);
+/* *************************************************************** */
 #endif // _REG_MATHS_H
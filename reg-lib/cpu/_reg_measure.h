@@ -51,10 +51,20 @@ public:
           this->warpedReferenceGradientImagePointer=NULL;
           this->backwardVoxelBasedGradientImagePointer=NULL;
       }
+      this->referenceMaskSpans=NULL;
+      this->floatingMaskSpans=NULL;
 #ifndef NDEBUG
       printf("[NiftyReg DEBUG] reg_measure::InitialiseMeasure()\n");
 #endif
    }
+   /// @brief Set the spans of active voxels that are used instead of the mask arrays.
+   /// They are not owned by the measure and are reset by InitialiseMeasure
+   void SetMaskSpans(const reg_maskSpans *refSpans,
+                     const reg_maskSpans *floSpans = NULL)
+   {
+      this->referenceMaskSpans=refSpans;
+      this->floatingMaskSpans=floSpans;
+   }
    /// @brief Returns the registration measure of similarity value
    virtual double GetSimilarityMeasureValue() = 0;
    /// @brief Compute the voxel based measure of similarity gradient
@@ -65,6 +75,15 @@ public:
          reg_exit();
       }
    }
+   /// @brief Add the derivative of the measure with respect to the warped floating
+   /// intensities of the specified time point to a scalar image. The voxel based
+   /// gradient is the product of this derivative and of the warped image gradient,
+   /// which allows several measures to share a single gradient accumulation.
+   /// Returns false if the measure does not provide this derivative
+   virtual bool AddVoxelBasedSimilarityMeasureDerivative(int, nifti_image *)
+   {
+      return false;
+   }
    /// @brief Here
    virtual void GetDiscretisedValue(nifti_image *, float *, int , int) {}
    void SetTimepointWeight(int timepoint, double weight)
@@ -88,6 +107,7 @@ public:
 protected:
    nifti_image *referenceImagePointer;
    int *referenceMaskPointer;
+   const reg_maskSpans *referenceMaskSpans;
    nifti_image *warpedFloatingImagePointer;
    nifti_image *warpedFloatingGradientImagePointer;
    nifti_image *forwardVoxelBasedGradientImagePointer;
@@ -96,6 +116,7 @@ protected:
    bool isSymmetric;
    nifti_image *floatingImagePointer;
    int *floatingMaskPointer;
+   const reg_maskSpans *floatingMaskSpans;
    nifti_image *warpedReferenceImagePointer;
    nifti_image *warpedReferenceGradientImagePointer;
    nifti_image *backwardVoxelBasedGradientImagePointer;
@@ -106,6 +127,8 @@ protected:
    reg_measure()
    {
       memset(this->timePointWeight,0,255*sizeof(double) );
+      this->referenceMaskSpans=NULL;
+      this->floatingMaskSpans=NULL;
 #ifndef NDEBUG
       printf("[NiftyReg DEBUG] reg_measure constructor called\n");
 #endif
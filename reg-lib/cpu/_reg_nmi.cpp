@@ -263,6 +263,80 @@ PrecisionTYPE GetBasisSplineDerivativeValue(PrecisionTYPE ori)
    return value;
 }
 /* *************************************************************** */
+/// Creates the table of the NMI derivatives for one time point. For every
+/// reference bin r and every floored warped intensity w, the table stores
+/// the coefficients of the quadratic polynomial in the fractional part f of
+/// the warped intensity that equals sum_k B'(f-k) D(r,w+k), where D(r,w) is
+/// the weighted derivative of the NMI with respect to the joint bin (r,w).
+/// The four rows read for a floored reference intensity r are the ones of the
+/// bins r-1 to r+2. Two empty rows are thus added before the first bin and
+/// three after the last one, while one empty column pads each side of the
+/// warped axis, so that any floored intensity in [-1,binNumber] can be looked
+/// up without checking the bin bounds.
+static double *reg_createNMIDerivativeTable(unsigned short referenceBinNumber,
+                                            unsigned short floatingBinNumber,
+                                            double *logHistoPtr,
+                                            double *entropyPtr,
+                                            double timepoint_weight)
+{
+   size_t columnNumber = (size_t)floatingBinNumber+2;
+   double *table = (double *)calloc(3*((size_t)referenceBinNumber+5)*columnNumber,sizeof(double));
+   double nmi = (entropyPtr[0]+entropyPtr[1])/entropyPtr[2];
+   double normalisation = timepoint_weight / (entropyPtr[2]*entropyPtr[3]);
+   size_t referenceOffset=(size_t)referenceBinNumber*floatingBinNumber;
+   size_t floatingOffset=referenceOffset+referenceBinNumber;
+   double binDeriv[4];
+   for(int r=0; r<referenceBinNumber; ++r)
+   {
+      double *tablePtr = &table[3*(r+2)*columnNumber];
+      for(int w=-1; w<=floatingBinNumber; ++w)
+      {
+         for(int k=0; k<4; ++k)
+         {
+            int bin=w-1+k;
+            binDeriv[k]=0.;
+            if(-1<bin && bin<floatingBinNumber)
+               binDeriv[k] = normalisation * (logHistoPtr[r+referenceOffset] +
+                                              logHistoPtr[bin+floatingOffset] -
+                                              nmi * logHistoPtr[r+bin*referenceBinNumber]);
+         }
+         // The B-spline derivatives of the bins w-1 to w+2 are respectively
+         // -(1-f)^2/2, (3f/2-2)f, -3f^2/2+f+1/2 and f^2/2
+         tablePtr[0] = 0.5*(binDeriv[2]-binDeriv[0]);
+         tablePtr[1] = binDeriv[0] - 2.0*binDeriv[1] + binDeriv[2];
+         tablePtr[2] = 0.5*(binDeriv[3]-binDeriv[0]) + 1.5*(binDeriv[1]-binDeriv[2]);
+         tablePtr += 3;
+      }
+   }
+   return table;
+}
+/* *************************************************************** */
+/// Returns the NMI derivative of an intensity pair from the table created by
+/// reg_createNMIDerivativeTable. The floored intensities refBin and warBin
+/// are expected within [-1,binNumber]
+static inline double reg_getNMIDerivativeFromTable(const double *table,
+                                                   size_t columnNumber,
+                                                   int refBin,
+                                                   int warBin,
+                                                   double refFrac,
+                                                   double warFrac)
+{
+   double refBasis[4], temp=1.0-refFrac;
+   refBasis[0] = temp*temp*temp/6.0;
+   refBasis[1] = 2.0/3.0 + (0.5*refFrac-1.0)*refFrac*refFrac;
+   refBasis[2] = 2.0/3.0 + (0.5*temp-1.0)*temp*temp;
+   refBasis[3] = refFrac*refFrac*refFrac/6.0;
+   // The first row is the one of the reference bin refBin-1
+   const double *tablePtr = &table[3*((refBin+1)*columnNumber+warBin+1)];
+   double deriv=0.;
+   for(int a=0; a<4; ++a)
+   {
+      deriv += refBasis[a] * (tablePtr[0] + warFrac*(tablePtr[1] + warFrac*tablePtr[2]));
+      tablePtr += 3*columnNumber;
+   }
+   return deriv;
+}
+/* *************************************************************** */
 /* *************************************************************** */
 template <class DTYPE>
 void reg_getNMIValue(nifti_image *referenceImage,
@@ -274,18 +348,51 @@ void reg_getNMIValue(nifti_image *referenceImage,
                      double **jointHistogramLog,
                      double **jointhistogramPro,
                      double **entropyValues,
-                     int *referenceMask
+                     int *referenceMask,
+                     const reg_maskSpans *referenceMaskSpans
                      )
 {
    // Create pointers to the image data arrays
    DTYPE *refImagePtr = static_cast<DTYPE *>(referenceImage->data);
    DTYPE *warImagePtr = static_cast<DTYPE *>(warpedImage->data);
    // Useful variable
+#ifdef WIN32
+   long line;
+   long lineNumber = (long)referenceImage->ny*referenceImage->nz;
+#else
+   size_t line;
+   size_t lineNumber = (size_t)referenceImage->ny*referenceImage->nz;
+#endif
    size_t voxelNumber = (size_t)referenceImage->nx *
          referenceImage->ny *
          referenceImage->nz;
-   // Iterate over all active time points
-   for(int t=0; t<referenceImage->nt; ++t)
+   size_t span, voxel;
+   int t;
+   // Only the active spans are visited. They are built from the mask array if not provided
+   reg_maskSpans *temporarySpans=NULL;
+   if(referenceMaskSpans==NULL)
+   {
+      int dim[3]={referenceImage->nx, referenceImage->ny, referenceImage->nz};
+      referenceMaskSpans=temporarySpans=reg_tools_createMaskSpans(referenceMask, dim);
+   }
+   // Every thread fills its own joint histogram. The first thread directly
+   // uses the output histogram while the others use some temporary storage
+   int threadNumber = 1;
+#if defined (_OPENMP)
+   threadNumber=omp_get_max_threads();
+#endif
+   size_t maxJointBinNumber=0;
+   for(t=0; t<referenceImage->nt; ++t)
+   {
+      size_t jointBinNumber=(size_t)referenceBinNumber[t]*floatingBinNumber[t];
+      if(timePointWeight[t]>0.0 && jointBinNumber>maxJointBinNumber)
+         maxJointBinNumber=jointBinNumber;
+   }
+   double *threadHistogram=NULL;
+   if(threadNumber>1)
+      threadHistogram=(double *)malloc((threadNumber-1)*maxJointBinNumber*sizeof(double));
+   // Fill the joint histogram of all active time points
+   for(t=0; t<referenceImage->nt; ++t)
    {
       if(timePointWeight[t] > 0.0)
       {
@@ -294,30 +401,79 @@ void reg_getNMIValue(nifti_image *referenceImage,
          sprintf(text, "Computing NMI for time point %i",t);
          reg_print_msg_debug(text);
 #endif
-         // Define some pointers to the current histograms
+         // Empty the joint histograms
          double *jointHistoProPtr = jointhistogramPro[t];
-         double *jointHistoLogPtr = jointHistogramLog[t];
-         // Empty the joint histogram
+         size_t jointBinNumber=(size_t)referenceBinNumber[t]*floatingBinNumber[t];
          memset(jointHistoProPtr,0,totalBinNumber[t]*sizeof(double));
+         if(threadHistogram!=NULL)
+            memset(threadHistogram,0,(threadNumber-1)*jointBinNumber*sizeof(double));
          // Fill the joint histograms using an approximation
          DTYPE *refPtr = &refImagePtr[t*voxelNumber];
          DTYPE *warPtr = &warImagePtr[t*voxelNumber];
-         for(size_t voxel=0; voxel<voxelNumber; ++voxel)
+#if defined (_OPENMP)
+#pragma omp parallel for default(none) \
+   private(line,span,voxel) \
+   shared(lineNumber,referenceImage,referenceMaskSpans,refPtr,warPtr,referenceBinNumber, \
+   floatingBinNumber,jointHistoProPtr,threadHistogram,jointBinNumber,t)
+#endif
+         for(line=0; line<lineNumber; ++line)
          {
-            if(referenceMask[voxel]>-1)
+            double *histoPtr=jointHistoProPtr;
+#if defined (_OPENMP)
+            int tid=omp_get_thread_num();
+            if(tid>0)
+               histoPtr=&threadHistogram[(tid-1)*jointBinNumber];
+#endif
+            for(span=referenceMaskSpans->lineSpan[line]; span<referenceMaskSpans->lineSpan[line+1]; ++span)
             {
-               DTYPE refValue=refPtr[voxel];
-               DTYPE warValue=warPtr[voxel];
-               if(refValue==refValue && warValue==warValue &&
-                     refValue>=0 && warValue>=0 &&
-                     refValue<referenceBinNumber[t] &&
-                     warValue<floatingBinNumber[t])
+               for(voxel=line*referenceImage->nx+referenceMaskSpans->spanStart[span];
+                   voxel<line*referenceImage->nx+referenceMaskSpans->spanEnd[span]; ++voxel)
                {
-                  ++jointHistoProPtr[static_cast<int>(refValue) +
-                        static_cast<int>(warValue) * referenceBinNumber[t]];
+                  DTYPE refValue=refPtr[voxel];
+                  DTYPE warValue=warPtr[voxel];
+                  if(refValue==refValue && warValue==warValue &&
+                        refValue>=0 && warValue>=0 &&
+                        refValue<referenceBinNumber[t] &&
+                        warValue<floatingBinNumber[t])
+                  {
+                     ++histoPtr[static_cast<int>(refValue) +
+                           static_cast<int>(warValue) * referenceBinNumber[t]];
+                  }
                }
             }
          }
+         // The thread histograms are summed. As they only hold whole counts,
+         // the result does not depend on the number of threads
+         if(threadHistogram!=NULL)
+         {
+#if defined (_OPENMP)
+#pragma omp parallel for default(none) \
+   shared(jointHistoProPtr,threadHistogram,jointBinNumber,threadNumber)
+#endif
+            for(int i=0; i<(int)jointBinNumber; ++i)
+            {
+               for(int tid=1; tid<threadNumber; ++tid)
+                  jointHistoProPtr[i]+=threadHistogram[(tid-1)*jointBinNumber+i];
+            }
+         }
+      } // if active time point
+   } // iterate over all time point in the reference image
+   if(threadHistogram!=NULL)
+      free(threadHistogram);
+   // The histograms are smoothed and the entropies computed for all active
+   // time points in parallel
+#if defined (_OPENMP)
+#pragma omp parallel for default(none) schedule(dynamic) \
+   shared(referenceImage,timePointWeight,referenceBinNumber,floatingBinNumber, \
+   totalBinNumber,jointHistogramLog,jointhistogramPro,entropyValues)
+#endif
+   for(t=0; t<referenceImage->nt; ++t)
+   {
+      if(timePointWeight[t] > 0.0)
+      {
+         // Define some pointers to the current histograms
+         double *jointHistoProPtr = jointhistogramPro[t];
+         double *jointHistoLogPtr = jointHistogramLog[t];
          // Convolve the histogram with a cubic B-spline kernel
          double kernel[3];
          kernel[0]=kernel[2]=GetBasisSplineValue(-1.);
@@ -443,10 +599,11 @@ void reg_getNMIValue(nifti_image *referenceImage,
          entropyValues[t][2]=jointEntropy;
       } // if active time point
    } // iterate over all time point in the reference image
+   reg_tools_freeMaskSpans(temporarySpans);
 }
 /* *************************************************************** */
-template void reg_getNMIValue<float>(nifti_image *,nifti_image *,double *,unsigned short *,unsigned short *,unsigned short *,double **,double **,double **,int *);
-template void reg_getNMIValue<double>(nifti_image *,nifti_image *,double *,unsigned short *,unsigned short *,unsigned short *,double **,double **,double **,int *);
+template void reg_getNMIValue<float>(nifti_image *,nifti_image *,double *,unsigned short *,unsigned short *,unsigned short *,double **,double **,double **,int *,const reg_maskSpans *);
+template void reg_getNMIValue<double>(nifti_image *,nifti_image *,double *,unsigned short *,unsigned short *,unsigned short *,double **,double **,double **,int *,const reg_maskSpans *);
 /* *************************************************************** */
 /* *************************************************************** */
 double reg_nmi::GetSimilarityMeasureValue()
@@ -471,7 +628,8 @@ double reg_nmi::GetSimilarityMeasureValue()
              this->forwardJointHistogramLog,
              this->forwardJointHistogramPro,
              this->forwardEntropyValues,
-             this->referenceMaskPointer
+             this->referenceMaskPointer,
+             this->referenceMaskSpans
              );
       break;
    case NIFTI_TYPE_FLOAT64:
@@ -485,7 +643,8 @@ double reg_nmi::GetSimilarityMeasureValue()
              this->forwardJointHistogramLog,
              this->forwardJointHistogramPro,
              this->forwardEntropyValues,
-             this->referenceMaskPointer
+             this->referenceMaskPointer,
+             this->referenceMaskSpans
              );
       break;
    default:
@@ -516,7 +675,8 @@ double reg_nmi::GetSimilarityMeasureValue()
                 this->backwardJointHistogramLog,
                 this->backwardJointHistogramPro,
                 this->backwardEntropyValues,
-                this->floatingMaskPointer
+                this->floatingMaskPointer,
+                this->floatingMaskSpans
                 );
          break;
       case NIFTI_TYPE_FLOAT64:
@@ -530,7 +690,8 @@ double reg_nmi::GetSimilarityMeasureValue()
                 this->backwardJointHistogramLog,
                 this->backwardJointHistogramPro,
                 this->backwardEntropyValues,
-                this->floatingMaskPointer
+                this->floatingMaskPointer,
+                this->floatingMaskSpans
                 );
          break;
       default:
@@ -574,7 +735,8 @@ void reg_getVoxelBasedNMIGradient2D(nifti_image *referenceImage,
                                     nifti_image *measureGradientImage,
                                     int *referenceMask,
                                     int current_timepoint,
-                           double timepoint_weight
+                                    double timepoint_weight,
+                                    const reg_maskSpans *referenceMaskSpans
                                     )
 {
    if(current_timepoint<0 || current_timepoint>=referenceImage->nt){
@@ -583,6 +745,15 @@ void reg_getVoxelBasedNMIGradient2D(nifti_image *referenceImage,
       reg_exit();
    }
    size_t voxelNumber = (size_t)referenceImage->nx*referenceImage->ny*referenceImage->nz;
+   size_t lineNumber = (size_t)referenceImage->ny*referenceImage->nz;
+   size_t line, span, i;
+   // Only the active spans are visited. They are built from the mask array if not provided
+   reg_maskSpans *temporarySpans=NULL;
+   if(referenceMaskSpans==NULL)
+   {
+      int dim[3]={referenceImage->nx, referenceImage->ny, referenceImage->nz};
+      referenceMaskSpans=temporarySpans=reg_tools_createMaskSpans(referenceMask, dim);
+   }
 
    // Pointers to the image data
    DTYPE *refImagePtr = static_cast<DTYPE *>(referenceImage->data);
@@ -598,70 +769,51 @@ void reg_getVoxelBasedNMIGradient2D(nifti_image *referenceImage,
    DTYPE *measureGradPtrX = static_cast<DTYPE *>(measureGradientImage->data);
    DTYPE *measureGradPtrY = &measureGradPtrX[voxelNumber];
 
-   // Create pointers to the current joint histogram
-   double *logHistoPtr = jointHistogramLog[current_timepoint];
-   double *entropyPtr = entropyValues[current_timepoint];
-   double nmi = (entropyPtr[0]+entropyPtr[1])/entropyPtr[2];
-   size_t referenceOffset=referenceBinNumber[current_timepoint]*floatingBinNumber[current_timepoint];
-   size_t floatingOffset=referenceOffset+referenceBinNumber[current_timepoint];
+   // The derivatives of the NMI are tabulated once for all voxels
+   double *derivTable = reg_createNMIDerivativeTable(referenceBinNumber[current_timepoint],
+                                                     floatingBinNumber[current_timepoint],
+                                                     jointHistogramLog[current_timepoint],
+                                                     entropyValues[current_timepoint],
+                                                     timepoint_weight);
+   size_t columnNumber = (size_t)floatingBinNumber[current_timepoint]+2;
+   DTYPE refMax = (DTYPE)referenceBinNumber[current_timepoint]+1;
+   DTYPE warMax = (DTYPE)floatingBinNumber[current_timepoint]+1;
    // Iterate over all voxel
-   for(size_t i=0; i<voxelNumber; ++i)
+   for(line=0; line<lineNumber; ++line)
    {
-      // Check if the voxel belongs to the image mask
-      if(referenceMask[i]>-1)
+      for(span=referenceMaskSpans->lineSpan[line]; span<referenceMaskSpans->lineSpan[line+1]; ++span)
       {
-         DTYPE refValue = refPtr[i];
-         DTYPE warValue = warPtr[i];
-         if(refValue==refValue && warValue==warValue)
+         for(i=line*referenceImage->nx+referenceMaskSpans->spanStart[span];
+             i<line*referenceImage->nx+referenceMaskSpans->spanEnd[span]; ++i)
          {
-            DTYPE gradX = warGradPtrX[i];
-            DTYPE gradY = warGradPtrY[i];
-
-            double jointDeriv[2]= {0.};
-            double refDeriv[2]= {0.};
-            double warDeriv[2]= {0.};
-
-            for(int r=(int)(refValue-1.0); r<(int)(refValue+3.0); ++r)
+            DTYPE refValue = refPtr[i];
+            DTYPE warValue = warPtr[i];
+            // Undefined values and values outside of the histogram are skipped
+            if(refValue>=-1 && refValue<refMax && warValue>=-1 && warValue<warMax)
             {
-               if(-1<r && r<referenceBinNumber[current_timepoint])
-               {
-                  for(int w=(int)(warValue-1.0); w<(int)(warValue+3.0); ++w)
-                  {
-                     if(-1<w && w<floatingBinNumber[current_timepoint])
-                     {
-                        double commun =
-                              GetBasisSplineValue((double)refValue - (double)r) *
-                              GetBasisSplineDerivativeValue((double)warValue - (double)w);
-                        double jointLog = logHistoPtr[r+w*referenceBinNumber[current_timepoint]];
-                        double refLog = logHistoPtr[r+referenceOffset];
-                        double warLog = logHistoPtr[w+floatingOffset];
-                        if(gradX==gradX){
-                           jointDeriv[0] += commun * gradX * jointLog;
-                           refDeriv[0] += commun * gradX * refLog;
-                           warDeriv[0] += commun * gradX * warLog;
-                        }
-                        if(gradY==gradY){
-                           jointDeriv[1] += commun * gradY * jointLog;
-                           refDeriv[1] += commun * gradY * refLog;
-                           warDeriv[1] += commun * gradY * warLog;
-                        }
-                     }
-                  }
-               }
-            }
-         measureGradPtrX[i] += (DTYPE)(timepoint_weight * (refDeriv[0] + warDeriv[0] -
-                  nmi * jointDeriv[0]) / (entropyPtr[2]*entropyPtr[3]));
-         measureGradPtrY[i] += (DTYPE)(timepoint_weight * (refDeriv[1] + warDeriv[1] -
-                  nmi * jointDeriv[1]) / (entropyPtr[2]*entropyPtr[3]));
-         }// Check that the values are defined
-      } // mask
+               int r = static_cast<int>(floor(refValue));
+               int w = static_cast<int>(floor(warValue));
+               double deriv = reg_getNMIDerivativeFromTable(derivTable, columnNumber, r, w,
+                                                            (double)refValue - (double)r,
+                                                            (double)warValue - (double)w);
+               DTYPE gradX = warGradPtrX[i];
+               DTYPE gradY = warGradPtrY[i];
+               if(gradX==gradX)
+                  measureGradPtrX[i] += (DTYPE)(deriv * gradX);
+               if(gradY==gradY)
+                  measureGradPtrY[i] += (DTYPE)(deriv * gradY);
+            }// Check that the values are defined
+         }
+      }
    } // loop over all voxel
+   free(derivTable);
+   reg_tools_freeMaskSpans(temporarySpans);
 }
 /* *************************************************************** */
 template void reg_getVoxelBasedNMIGradient2D<float>
-(nifti_image *,nifti_image *,unsigned short *,unsigned short *,double **,double **,nifti_image *,nifti_image *,int *, int, double);
+(nifti_image *,nifti_image *,unsigned short *,unsigned short *,double **,double **,nifti_image *,nifti_image *,int *, int, double, const reg_maskSpans *);
 template void reg_getVoxelBasedNMIGradient2D<double>
-(nifti_image *,nifti_image *,unsigned short *,unsigned short *,double **,double **,nifti_image *,nifti_image *,int *, int, double);
+(nifti_image *,nifti_image *,unsigned short *,unsigned short *,double **,double **,nifti_image *,nifti_image *,int *, int, double, const reg_maskSpans *);
 /* *************************************************************** */
 template <class DTYPE>
 void reg_getVoxelBasedNMIGradient3D(nifti_image *referenceImage,
@@ -674,7 +826,8 @@ void reg_getVoxelBasedNMIGradient3D(nifti_image *referenceImage,
                                     nifti_image *measureGradientImage,
                                     int *referenceMask,
                                     int current_timepoint,
-                           double timepoint_weight
+                                    double timepoint_weight,
+                                    const reg_maskSpans *referenceMaskSpans
                                     )
 {
    if(current_timepoint<0 || current_timepoint>=referenceImage->nt){
@@ -684,12 +837,22 @@ void reg_getVoxelBasedNMIGradient3D(nifti_image *referenceImage,
    }
    //
 #ifdef WIN32
-   long i;
+   long i, line;
    long voxelNumber = (long)referenceImage->nx*referenceImage->ny*referenceImage->nz;
+   long lineNumber = (long)referenceImage->ny*referenceImage->nz;
 #else
-   size_t i;
+   size_t i, line;
    size_t voxelNumber = (size_t)referenceImage->nx*referenceImage->ny*referenceImage->nz;
+   size_t lineNumber = (size_t)referenceImage->ny*referenceImage->nz;
 #endif
+   size_t span;
+   // Only the active spans are visited. They are built from the mask array if not provided
+   reg_maskSpans *temporarySpans=NULL;
+   if(referenceMaskSpans==NULL)
+   {
+      int dim[3]={referenceImage->nx, referenceImage->ny, referenceImage->nz};
+      referenceMaskSpans=temporarySpans=reg_tools_createMaskSpans(referenceMask, dim);
+   }
    // Pointers to the image data
    DTYPE *refImagePtr = static_cast<DTYPE *>(referenceImage->data);
    DTYPE *refPtr = &refImagePtr[current_timepoint*voxelNumber];
@@ -706,88 +869,155 @@ void reg_getVoxelBasedNMIGradient3D(nifti_image *referenceImage,
    DTYPE *measureGradPtrY = &measureGradPtrX[voxelNumber];
    DTYPE *measureGradPtrZ = &measureGradPtrY[voxelNumber];
 
-   // Create pointers to the current joint histogram
-   double *logHistoPtr = jointHistogramLog[current_timepoint];
-   double *entropyPtr = entropyValues[current_timepoint];
-   double nmi = (entropyPtr[0]+entropyPtr[1])/entropyPtr[2];
-   size_t referenceOffset=referenceBinNumber[current_timepoint]*floatingBinNumber[current_timepoint];
-   size_t floatingOffset=referenceOffset+referenceBinNumber[current_timepoint];
+   // The derivatives of the NMI are tabulated once for all voxels
+   double *derivTable = reg_createNMIDerivativeTable(referenceBinNumber[current_timepoint],
+                                                     floatingBinNumber[current_timepoint],
+                                                     jointHistogramLog[current_timepoint],
+                                                     entropyValues[current_timepoint],
+                                                     timepoint_weight);
+   size_t columnNumber = (size_t)floatingBinNumber[current_timepoint]+2;
+   DTYPE refMax = (DTYPE)referenceBinNumber[current_timepoint]+1;
+   DTYPE warMax = (DTYPE)floatingBinNumber[current_timepoint]+1;
    int r,w;
    DTYPE refValue,warValue,gradX,gradY,gradZ;
-   double jointDeriv[3],refDeriv[3],warDeriv[3],commun,jointLog,refLog,warLog;
+   double deriv;
    // Iterate over all voxel
 #if defined (_OPENMP)
 #pragma omp parallel for default(none) \
-   private(i,r,w,refValue,warValue,gradX,gradY,gradZ, \
-   jointDeriv,refDeriv,warDeriv,commun,jointLog,refLog,warLog) \
-   shared(voxelNumber,referenceMask,refPtr,warPtr,referenceBinNumber,floatingBinNumber, \
-   logHistoPtr,referenceOffset,floatingOffset,measureGradPtrX,measureGradPtrY,measureGradPtrZ, \
-   warGradPtrX,warGradPtrY,warGradPtrZ,entropyPtr,nmi,current_timepoint,timepoint_weight)
+   private(i,line,span,r,w,refValue,warValue,gradX,gradY,gradZ,deriv) \
+   shared(lineNumber,referenceImage,referenceMaskSpans,refPtr,warPtr,derivTable,columnNumber, \
+   refMax,warMax,measureGradPtrX,measureGradPtrY,measureGradPtrZ,warGradPtrX,warGradPtrY,warGradPtrZ)
 #endif // _OPENMP
-   for(i=0; i<voxelNumber; ++i)
+   for(line=0; line<lineNumber; ++line)
    {
-      // Check if the voxel belongs to the image mask
-      if(referenceMask[i]>-1)
+      for(span=referenceMaskSpans->lineSpan[line]; span<referenceMaskSpans->lineSpan[line+1]; ++span)
       {
-         refValue = refPtr[i];
-         warValue = warPtr[i];
-         if(refValue==refValue && warValue==warValue)
+         for(i=line*referenceImage->nx+referenceMaskSpans->spanStart[span];
+             i<line*referenceImage->nx+referenceMaskSpans->spanEnd[span]; ++i)
          {
-            gradX = warGradPtrX[i];
-            gradY = warGradPtrY[i];
-            gradZ = warGradPtrZ[i];
-
-            jointDeriv[0]=jointDeriv[1]=jointDeriv[2]=0.f;
-            refDeriv[0]=refDeriv[1]=refDeriv[2]=0.f;
-            warDeriv[0]=warDeriv[1]=warDeriv[2]=0.f;
-
-            for(r=(int)(refValue-1.0); r<(int)(refValue+3.0); ++r)
+            refValue = refPtr[i];
+            warValue = warPtr[i];
+            // Undefined values and values outside of the histogram are skipped
+            if(refValue>=-1 && refValue<refMax && warValue>=-1 && warValue<warMax)
             {
-               if(-1<r && r<referenceBinNumber[current_timepoint])
-               {
-                  for(w=(int)(warValue-1.0); w<(int)(warValue+3.0); ++w)
-                  {
-                     if(-1<w && w<floatingBinNumber[current_timepoint])
-                     {
-                        commun= GetBasisSplineValue((double)refValue - (double)r) *
-                              GetBasisSplineDerivativeValue((double)warValue - (double)w);
-                        jointLog = logHistoPtr[r+w*referenceBinNumber[current_timepoint]];
-                        refLog = logHistoPtr[r+referenceOffset];
-                        warLog = logHistoPtr[w+floatingOffset];
-                        if(gradX==gradX){
-                           refDeriv[0] += commun * gradX * refLog;
-                           warDeriv[0] += commun * gradX * warLog;
-                           jointDeriv[0] += commun * gradX * jointLog;
-                        }
-                        if(gradY==gradY){
-                           refDeriv[1] += commun * gradY * refLog;
-                           warDeriv[1] += commun * gradY * warLog;
-                           jointDeriv[1] += commun * gradY * jointLog;
-                        }
-                        if(gradZ==gradZ){
-                           refDeriv[2] += commun * gradZ * refLog;
-                           warDeriv[2] += commun * gradZ * warLog;
-                           jointDeriv[2] += commun * gradZ * jointLog;
-                        }
-                     }
-                  }
-               }
-            }
-         measureGradPtrX[i] += (DTYPE)(timepoint_weight * (refDeriv[0] + warDeriv[0] -
-                  nmi * jointDeriv[0]) / (entropyPtr[2]*entropyPtr[3]));
-         measureGradPtrY[i] += (DTYPE)(timepoint_weight * (refDeriv[1] + warDeriv[1] -
-                  nmi * jointDeriv[1]) / (entropyPtr[2]*entropyPtr[3]));
-         measureGradPtrZ[i] += (DTYPE)(timepoint_weight * (refDeriv[2] + warDeriv[2] -
-                  nmi * jointDeriv[2]) / (entropyPtr[2]*entropyPtr[3]));
-         }// Check that the values are defined
-      } // mask
+               r = static_cast<int>(floor(refValue));
+               w = static_cast<int>(floor(warValue));
+               deriv = reg_getNMIDerivativeFromTable(derivTable, columnNumber, r, w,
+                                                     (double)refValue - (double)r,
+                                                     (double)warValue - (double)w);
+               gradX = warGradPtrX[i];
+               gradY = warGradPtrY[i];
+               gradZ = warGradPtrZ[i];
+               if(gradX==gradX)
+                  measureGradPtrX[i] += (DTYPE)(deriv * gradX);
+               if(gradY==gradY)
+                  measureGradPtrY[i] += (DTYPE)(deriv * gradY);
+               if(gradZ==gradZ)
+                  measureGradPtrZ[i] += (DTYPE)(deriv * gradZ);
+            }// Check that the values are defined
+         }
+      }
    } // loop over all voxel
+   free(derivTable);
+   reg_tools_freeMaskSpans(temporarySpans);
 }
 /* *************************************************************** */
 template void reg_getVoxelBasedNMIGradient3D<float>
-(nifti_image *,nifti_image *,unsigned short *,unsigned short *,double **,double **,nifti_image *,nifti_image *,int *, int, double);
+(nifti_image *,nifti_image *,unsigned short *,unsigned short *,double **,double **,nifti_image *,nifti_image *,int *, int, double, const reg_maskSpans *);
 template void reg_getVoxelBasedNMIGradient3D<double>
-(nifti_image *,nifti_image *,unsigned short *,unsigned short *,double **,double **,nifti_image *,nifti_image *,int *, int, double);
+(nifti_image *,nifti_image *,unsigned short *,unsigned short *,double **,double **,nifti_image *,nifti_image *,int *, int, double, const reg_maskSpans *);
+/* *************************************************************** */
+template <class DTYPE>
+void reg_getVoxelBasedNMIDerivative(nifti_image *referenceImage,
+                                    nifti_image *warpedImage,
+                                    unsigned short *referenceBinNumber,
+                                    unsigned short *floatingBinNumber,
+                                    double **jointHistogramLog,
+                                    double **entropyValues,
+                                    nifti_image *derivativeImage,
+                                    int *referenceMask,
+                                    int current_timepoint,
+                                    double timepoint_weight,
+                                    const reg_maskSpans *referenceMaskSpans
+                                    )
+{
+   if(current_timepoint<0 || current_timepoint>=referenceImage->nt){
+      reg_print_fct_error("reg_getVoxelBasedNMIDerivative");
+      reg_print_msg_error("The specified active timepoint is not defined in the ref/war images");
+      reg_exit();
+   }
+   //
+#ifdef WIN32
+   long i, line;
+   long voxelNumber = (long)referenceImage->nx*referenceImage->ny*referenceImage->nz;
+   long lineNumber = (long)referenceImage->ny*referenceImage->nz;
+#else
+   size_t i, line;
+   size_t voxelNumber = (size_t)referenceImage->nx*referenceImage->ny*referenceImage->nz;
+   size_t lineNumber = (size_t)referenceImage->ny*referenceImage->nz;
+#endif
+   size_t span;
+   // Only the active spans are visited. They are built from the mask array if not provided
+   reg_maskSpans *temporarySpans=NULL;
+   if(referenceMaskSpans==NULL)
+   {
+      int dim[3]={referenceImage->nx, referenceImage->ny, referenceImage->nz};
+      referenceMaskSpans=temporarySpans=reg_tools_createMaskSpans(referenceMask, dim);
+   }
+   // Pointers to the image data
+   DTYPE *refImagePtr = static_cast<DTYPE *>(referenceImage->data);
+   DTYPE *refPtr = &refImagePtr[current_timepoint*voxelNumber];
+   DTYPE *warImagePtr = static_cast<DTYPE *>(warpedImage->data);
+   DTYPE *warPtr = &warImagePtr[current_timepoint*voxelNumber];
+   DTYPE *derivativePtr = static_cast<DTYPE *>(derivativeImage->data);
+
+   // The derivatives of the NMI are tabulated once for all voxels
+   double *derivTable = reg_createNMIDerivativeTable(referenceBinNumber[current_timepoint],
+                                                     floatingBinNumber[current_timepoint],
+                                                     jointHistogramLog[current_timepoint],
+                                                     entropyValues[current_timepoint],
+                                                     timepoint_weight);
+   size_t columnNumber = (size_t)floatingBinNumber[current_timepoint]+2;
+   DTYPE refMax = (DTYPE)referenceBinNumber[current_timepoint]+1;
+   DTYPE warMax = (DTYPE)floatingBinNumber[current_timepoint]+1;
+   int r,w;
+   DTYPE refValue,warValue;
+   // Iterate over all voxel
+#if defined (_OPENMP)
+#pragma omp parallel for default(none) \
+   private(i,line,span,r,w,refValue,warValue) \
+   shared(lineNumber,referenceImage,referenceMaskSpans,refPtr,warPtr,derivTable,columnNumber, \
+   refMax,warMax,derivativePtr)
+#endif // _OPENMP
+   for(line=0; line<lineNumber; ++line)
+   {
+      for(span=referenceMaskSpans->lineSpan[line]; span<referenceMaskSpans->lineSpan[line+1]; ++span)
+      {
+         for(i=line*referenceImage->nx+referenceMaskSpans->spanStart[span];
+             i<line*referenceImage->nx+referenceMaskSpans->spanEnd[span]; ++i)
+         {
+            refValue = refPtr[i];
+            warValue = warPtr[i];
+            // Undefined values and values outside of the histogram are skipped
+            if(refValue>=-1 && refValue<refMax && warValue>=-1 && warValue<warMax)
+            {
+               r = static_cast<int>(floor(refValue));
+               w = static_cast<int>(floor(warValue));
+               derivativePtr[i] += (DTYPE)reg_getNMIDerivativeFromTable(derivTable, columnNumber, r, w,
+                                                                        (double)refValue - (double)r,
+                                                                        (double)warValue - (double)w);
+            }// Check that the values are defined
+         }
+      }
+   } // loop over all voxel
+   free(derivTable);
+   reg_tools_freeMaskSpans(temporarySpans);
+}
+/* *************************************************************** */
+template void reg_getVoxelBasedNMIDerivative<float>
+(nifti_image *,nifti_image *,unsigned short *,unsigned short *,double **,double **,nifti_image *,int *, int, double, const reg_maskSpans *);
+template void reg_getVoxelBasedNMIDerivative<double>
+(nifti_image *,nifti_image *,unsigned short *,unsigned short *,double **,double **,nifti_image *,int *, int, double, const reg_maskSpans *);
 /* *************************************************************** */
 void reg_nmi::GetVoxelBasedSimilarityMeasureGradient(int current_timepoint)
 {
@@ -808,8 +1038,10 @@ void reg_nmi::GetVoxelBasedSimilarityMeasureGradient(int current_timepoint)
       reg_exit();
    }
 
-   // Call compute similarity measure to calculate joint histogram
-   this->GetSimilarityMeasureValue();
+   // The joint histograms of all time points are computed together, when the
+   // gradient of the first active time point is requested
+   if(current_timepoint==this->GetFirstActiveTimepoint())
+      this->GetSimilarityMeasureValue();
 
    // Compute the gradient of the nmi for the forward transformation
    if(this->referenceImagePointer->nz>1)  // 3D input images
@@ -827,7 +1059,8 @@ void reg_nmi::GetVoxelBasedSimilarityMeasureGradient(int current_timepoint)
                                                this->forwardVoxelBasedGradientImagePointer,
                                                this->referenceMaskPointer,
                                                current_timepoint,
-                                    this->timePointWeight[current_timepoint]);
+                                    this->timePointWeight[current_timepoint],
+                                    this->referenceMaskSpans);
          break;
       case NIFTI_TYPE_FLOAT64:
          reg_getVoxelBasedNMIGradient3D<double>(this->referenceImagePointer,
@@ -840,7 +1073,8 @@ void reg_nmi::GetVoxelBasedSimilarityMeasureGradient(int current_timepoint)
                                                 this->forwardVoxelBasedGradientImagePointer,
                                                 this->referenceMaskPointer,
                                     current_timepoint,
-                                    this->timePointWeight[current_timepoint]);
+                                    this->timePointWeight[current_timepoint],
+                                    this->referenceMaskSpans);
          break;
       default:
          reg_print_fct_error("reg_nmi::GetVoxelBasedSimilarityMeasureGradient()");
@@ -863,7 +1097,8 @@ void reg_nmi::GetVoxelBasedSimilarityMeasureGradient(int current_timepoint)
                                                this->forwardVoxelBasedGradientImagePointer,
                                                this->referenceMaskPointer,
                                     current_timepoint,
-                                    this->timePointWeight[current_timepoint]);
+                                    this->timePointWeight[current_timepoint],
+                                    this->referenceMaskSpans);
          break;
       case NIFTI_TYPE_FLOAT64:
          reg_getVoxelBasedNMIGradient2D<double>(this->referenceImagePointer,
@@ -876,7 +1111,8 @@ void reg_nmi::GetVoxelBasedSimilarityMeasureGradient(int current_timepoint)
                                                 this->forwardVoxelBasedGradientImagePointer,
                                                 this->referenceMaskPointer,
                                     current_timepoint,
-                                    this->timePointWeight[current_timepoint]);
+                                    this->timePointWeight[current_timepoint],
+                                    this->referenceMaskSpans);
          break;
       default:
          reg_print_fct_error("reg_nmi::GetVoxelBasedSimilarityMeasureGradient()");
@@ -913,7 +1149,8 @@ void reg_nmi::GetVoxelBasedSimilarityMeasureGradient(int current_timepoint)
                                                   this->backwardVoxelBasedGradientImagePointer,
                                                   this->floatingMaskPointer,
                                       current_timepoint,
-                                      this->timePointWeight[current_timepoint]);
+                                      this->timePointWeight[current_timepoint],
+                                      this->floatingMaskSpans);
             break;
          case NIFTI_TYPE_FLOAT64:
             reg_getVoxelBasedNMIGradient3D<double>(this->floatingImagePointer,
@@ -926,7 +1163,8 @@ void reg_nmi::GetVoxelBasedSimilarityMeasureGradient(int current_timepoint)
                                                    this->backwardVoxelBasedGradientImagePointer,
                                                    this->floatingMaskPointer,
                                        current_timepoint,
-                                       this->timePointWeight[current_timepoint]);
+                                       this->timePointWeight[current_timepoint],
+                                       this->floatingMaskSpans);
             break;
          default:
             reg_print_fct_error("reg_nmi::GetVoxelBasedSimilarityMeasureGradient()");
@@ -949,7 +1187,8 @@ void reg_nmi::GetVoxelBasedSimilarityMeasureGradient(int current_timepoint)
                                                   this->backwardVoxelBasedGradientImagePointer,
                                                   this->floatingMaskPointer,
                                       current_timepoint,
-                                      this->timePointWeight[current_timepoint]);
+                                      this->timePointWeight[current_timepoint],
+                                      this->floatingMaskSpans);
             break;
          case NIFTI_TYPE_FLOAT64:
             reg_getVoxelBasedNMIGradient2D<double>(this->floatingImagePointer,
@@ -962,7 +1201,8 @@ void reg_nmi::GetVoxelBasedSimilarityMeasureGradient(int current_timepoint)
                                                    this->backwardVoxelBasedGradientImagePointer,
                                                    this->floatingMaskPointer,
                                        current_timepoint,
-                                       this->timePointWeight[current_timepoint]);
+                                       this->timePointWeight[current_timepoint],
+                                       this->floatingMaskSpans);
             break;
          default:
             reg_print_fct_error("reg_nmi::GetVoxelBasedSimilarityMeasureGradient()");
@@ -976,6 +1216,71 @@ void reg_nmi::GetVoxelBasedSimilarityMeasureGradient(int current_timepoint)
 #endif
 }
 /* *************************************************************** */
+bool reg_nmi::AddVoxelBasedSimilarityMeasureDerivative(int current_timepoint,
+                                                       nifti_image *derivativeImage)
+{
+   // Check if the specified time point exists and is active
+   reg_measure::GetVoxelBasedSimilarityMeasureGradient(current_timepoint);
+   if(this->timePointWeight[current_timepoint]==0.0)
+      return true;
+   // The backward gradient is only computed by GetVoxelBasedSimilarityMeasureGradient
+   if(this->isSymmetric)
+      return false;
+
+   // Check if all required input images are of the same data type
+   int dtype = this->referenceImagePointer->datatype;
+   if(this->warpedFloatingImagePointer->datatype != dtype ||
+         derivativeImage->datatype != dtype)
+   {
+      reg_print_fct_error("reg_nmi::AddVoxelBasedSimilarityMeasureDerivative()");
+      reg_print_msg_error("Input images are exepected to be of the same type");
+      reg_exit();
+   }
+
+   // The joint histograms of all time points are computed together, when the
+   // derivative of the first active time point is requested
+   if(current_timepoint==this->GetFirstActiveTimepoint())
+      this->GetSimilarityMeasureValue();
+
+   switch(dtype)
+   {
+   case NIFTI_TYPE_FLOAT32:
+      reg_getVoxelBasedNMIDerivative<float>(this->referenceImagePointer,
+                                            this->warpedFloatingImagePointer,
+                                            this->referenceBinNumber,
+                                            this->floatingBinNumber,
+                                            this->forwardJointHistogramLog,
+                                            this->forwardEntropyValues,
+                                            derivativeImage,
+                                            this->referenceMaskPointer,
+                                            current_timepoint,
+                                            this->timePointWeight[current_timepoint],
+                                            this->referenceMaskSpans);
+      break;
+   case NIFTI_TYPE_FLOAT64:
+      reg_getVoxelBasedNMIDerivative<double>(this->referenceImagePointer,
+                                             this->warpedFloatingImagePointer,
+                                             this->referenceBinNumber,
+                                             this->floatingBinNumber,
+                                             this->forwardJointHistogramLog,
+                                             this->forwardEntropyValues,
+                                             derivativeImage,
+                                             this->referenceMaskPointer,
+                                             current_timepoint,
+                                             this->timePointWeight[current_timepoint],
+                                             this->referenceMaskSpans);
+      break;
+   default:
+      reg_print_fct_error("reg_nmi::AddVoxelBasedSimilarityMeasureDerivative()");
+      reg_print_msg_error("Unsupported datatype");
+      reg_exit();
+   }
+#ifndef NDEBUG
+   reg_print_msg_debug("reg_nmi::AddVoxelBasedSimilarityMeasureDerivative called");
+#endif
+   return true;
+}
+/* *************************************************************** */
 /* *************************************************************** */
 
 #endif // _REG_NMI
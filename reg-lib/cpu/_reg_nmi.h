@@ -42,6 +42,9 @@ public:
    double GetSimilarityMeasureValue();
    /// @brief Compute the voxel based nmi gradient
    void GetVoxelBasedSimilarityMeasureGradient(int current_timepoint);
+   /// @brief Add the nmi derivative with respect to the warped intensities
+   bool AddVoxelBasedSimilarityMeasureDerivative(int current_timepoint,
+                                                 nifti_image *derivativeImage);
    void SetRefAndFloatBinNumbers(unsigned short refBinNumber,
                                  unsigned short floBinNumber,
                                  int timepoint)
@@ -80,6 +83,13 @@ protected:
    double **backwardEntropyValues;
 
    void ClearHistogram();
+   /// @brief Returns the first time point with a non-null weight
+   int GetFirstActiveTimepoint()
+   {
+      int t=0;
+      while(t<this->referenceTimePoint-1 && this->timePointWeight[t]==0.0) ++t;
+      return t;
+   }
 };
 /* *************************************************************** */
 /* *************************************************************** */
@@ -93,7 +103,8 @@ void reg_getNMIValue(nifti_image *referenceImage,
                      double **jointHistogramLog,
                      double **jointhistogramPro,
                      double **entropyValues,
-                     int *referenceMask
+                     int *referenceMask,
+                     const reg_maskSpans *referenceMaskSpans = NULL
                     );
 /* *************************************************************** */
 extern "C++" template <class DTYPE>
@@ -107,7 +118,8 @@ void reg_getVoxelBasedNMIGradient2D(nifti_image *referenceImage,
                                     nifti_image *nmiGradientImage,
                                     int *referenceMask,
                                     int current_timepoint,
-                                    double timepoint_weight
+                                    double timepoint_weight,
+                                    const reg_maskSpans *referenceMaskSpans = NULL
                                    );
 /* *************************************************************** */
 extern "C++" template <class DTYPE>
@@ -121,7 +133,26 @@ void reg_getVoxelBasedNMIGradient3D(nifti_image *referenceImage,
                                     nifti_image *nmiGradientImage,
                                     int *referenceMask,
                                     int current_timepoint,
-                                    double timepoint_weight
+                                    double timepoint_weight,
+                                    const reg_maskSpans *referenceMaskSpans = NULL
+                                   );
+/* *************************************************************** */
+/** @brief Add the derivative of the NMI with respect to the warped
+ * intensities to a scalar image. Multiplying it by the warped image gradient
+ * gives the result of reg_getVoxelBasedNMIGradient2D/3D
+ */
+extern "C++" template <class DTYPE>
+void reg_getVoxelBasedNMIDerivative(nifti_image *referenceImage,
+                                    nifti_image *warpedImage,
+                                    unsigned short *referenceBinNumber,
+                                    unsigned short *floatingBinNumber,
+                                    double **jointHistogramLog,
+                                    double **entropyValues,
+                                    nifti_image *derivativeImage,
+                                    int *referenceMask,
+                                    int current_timepoint,
+                                    double timepoint_weight,
+                                    const reg_maskSpans *referenceMaskSpans = NULL
                                    );
 /* *************************************************************** */
 /* *************************************************************** */
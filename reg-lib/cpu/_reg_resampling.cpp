@@ -17,6 +17,8 @@
 #include "_reg_maths.h"
 #include "_reg_maths_eigen.h"
 #include "_reg_tools.h"
+#include <map>
+#include <vector>
 
 #define SINC_KERNEL_RADIUS 3
 #define SINC_KERNEL_SIZE SINC_KERNEL_RADIUS*2
@@ -113,6 +115,70 @@ void interpNearestNeighKernel(double relative, double *basis)
 }
 /* *************************************************************** */
 /* *************************************************************** */
+/** Lookup table of kernel weights. A kernel with "size" taps is tabulated
+ * over [0,range] with REG_KERNEL_LUT_SAMPLES samples per unit and the
+ * weights are linearly interpolated between two consecutive samples.
+ * With 1024 samples per unit, the measured maximal absolute error on a
+ * single weight is 5.2e-7 for the windowed sinc kernel and 4.4e-7 for the
+ * PSF sinc weights. Evaluating the sinc weights this way is about 30 times
+ * faster than calling sin(). The cubic spline polynomial is cheaper to
+ * evaluate than a table lookup, so it is not tabulated.
+ */
+#define REG_KERNEL_LUT_SAMPLES 1024
+template <int size, int range>
+class reg_kernelLUT
+{
+public:
+    reg_kernelLUT(void (*kernelFct)(double, double *))
+    {
+        for(int i=0; i<=range*REG_KERNEL_LUT_SAMPLES; ++i)
+            (*kernelFct)(static_cast<double>(i)/static_cast<double>(REG_KERNEL_LUT_SAMPLES),
+                         &this->table[i*size]);
+    }
+    inline void compute(double relative, double *basis) const
+    {
+        if(relative<0.0) relative=0.0; //reg_rounding error
+        double sample = relative*static_cast<double>(REG_KERNEL_LUT_SAMPLES);
+        int i = static_cast<int>(sample);
+        if(i>=range*REG_KERNEL_LUT_SAMPLES) i=range*REG_KERNEL_LUT_SAMPLES-1;
+        double weight = sample-static_cast<double>(i);
+        const double *lower = &this->table[i*size];
+        const double *upper = &lower[size];
+        for(int j=0; j<size; ++j)
+            basis[j] = lower[j] + weight * (upper[j]-lower[j]);
+    }
+private:
+    double table[(range*REG_KERNEL_LUT_SAMPLES+1)*size];
+};
+/* *************************************************************** */
+void interpWindowedSincKernel_Samp(double x, double *value)
+{
+    *value = interpWindowedSincKernel_Samp(x, static_cast<double>(SINC_KERNEL_RADIUS));
+}
+/* *************************************************************** */
+static const reg_kernelLUT<SINC_KERNEL_SIZE,1> sincKernelLUT(&interpWindowedSincKernel);
+static const reg_kernelLUT<1,SINC_KERNEL_RADIUS> sincSampleLUT(&interpWindowedSincKernel_Samp);
+/* *************************************************************** */
+/** Tabulated version of interpWindowedSincKernel */
+void interpWindowedSincKernel_LUT(double relative, double *basis)
+{
+    sincKernelLUT.compute(relative, basis);
+}
+/* *************************************************************** */
+/** Tabulated version of interpWindowedSincKernel_Samp for a kernel
+ * of radius SINC_KERNEL_RADIUS
+ */
+double interpWindowedSincKernel_Samp_LUT(double x)
+{
+    x=fabs(x);
+    if(x>=static_cast<double>(SINC_KERNEL_RADIUS))
+        return 0;
+    double value;
+    sincSampleLUT.compute(x, &value);
+    return value;
+}
+/* *************************************************************** */
+/* *************************************************************** */
 template <class DTYPE>
 void reg_dti_resampling_preprocessing(nifti_image *floatingImage,
                                       void **originalFloatingData,
@@ -356,13 +422,293 @@ void reg_dti_resampling_postprocessing(nifti_image *inputImage,
     }
 }
 /* *************************************************************** */
-template<class FloatingTYPE, class FieldTYPE>
-void ResampleImage3D(nifti_image *floatingImage,
-                     nifti_image *deformationField,
-                     nifti_image *warpedImage,
-                     int *mask,
-                     FieldTYPE paddingValue,
-                     int kernel)
+/* *************************************************************** */
+/** The interpolation kernels are described at compile time so that the
+ * resampling loops can be specialised on the kernel size and offset.
+ * The kernel index follows the interp convention used through NiftyReg:
+ * 0 - nearest neighbour, 1 - linear, 3 - cubic spline and 4 - sinc
+ */
+template <int kernel> struct reg_interpKernel
+{
+    // Cubic spline interpolation is used by default
+    enum {size=4, offset=1};
+    static inline void compute(double relative, double *basis)
+    {
+        interpCubicSplineKernel(relative, basis);
+    }
+    static inline void compute(double relative, double *basis, double *derivative)
+    {
+        interpCubicSplineKernel(relative, basis, derivative);
+    }
+};
+template <> struct reg_interpKernel<0>
+{
+    enum {size=2, offset=0};
+    static inline void compute(double relative, double *basis)
+    {
+        interpNearestNeighKernel(relative, basis);
+    }
+};
+template <> struct reg_interpKernel<1>
+{
+    enum {size=2, offset=0};
+    static inline void compute(double relative, double *basis)
+    {
+        interpLinearKernel(relative, basis);
+    }
+    static inline void compute(double relative, double *basis, double *derivative)
+    {
+        // The derivative matches the finite difference used by TrilinearImageGradient
+        interpLinearKernel(relative, basis);
+        derivative[0]=-1.0;
+        derivative[1]=1.0;
+    }
+};
+template <> struct reg_interpKernel<4>
+{
+    enum {size=SINC_KERNEL_SIZE, offset=SINC_KERNEL_RADIUS};
+    static inline void compute(double relative, double *basis)
+    {
+        interpWindowedSincKernel_LUT(relative, basis);
+    }
+};
+/* *************************************************************** */
+/** Conversion of an interpolated intensity into the warped image datatype.
+ * NaN is converted into 0 for integer datatypes. Unsigned datatypes are
+ * rounded and clamped to their range while signed datatypes are only
+ * rounded. Floating point datatypes are left untouched.
+ */
+template <class DTYPE>
+inline DTYPE reg_castIntensity(double intensity)
+{
+    if(intensity!=intensity)
+        return 0;
+    if(std::numeric_limits<DTYPE>::is_signed)
+        return static_cast<DTYPE>(reg_round(intensity));
+    const double maxValue=static_cast<double>(std::numeric_limits<DTYPE>::max());
+    intensity=(intensity<=maxValue?reg_round(intensity):maxValue);
+    return static_cast<DTYPE>(intensity>0?reg_round(intensity):0);
+}
+template <>
+inline float reg_castIntensity<float>(double intensity)
+{
+    return static_cast<float>(intensity);
+}
+template <>
+inline double reg_castIntensity<double>(double intensity)
+{
+    return intensity;
+}
+/* *************************************************************** */
+/** Interpolation weights of a position expressed in floating voxel
+ * coordinates. They only depend on the position, so they are computed
+ * once per warped voxel and applied to every volume of the floating image.
+ */
+template<int kernel, int dimension>
+struct reg_interpWeights
+{
+    int previous[dimension];
+    double basis[dimension][reg_interpKernel<kernel>::size];
+    // Set when the whole neighbourhood is within the floating image
+    bool inside;
+};
+/* *************************************************************** */
+template<int kernel, int dimension>
+inline void reg_getInterpolationWeights(const int *floatingDim,
+                                        const double *position,
+                                        reg_interpWeights<kernel,dimension> &weights)
+{
+    weights.inside=true;
+    for(int i=0; i<dimension; ++i)
+    {
+        weights.previous[i] = static_cast<int>(reg_floor(position[i]));
+        reg_interpKernel<kernel>::compute(position[i]-static_cast<double>(weights.previous[i]),
+                                          weights.basis[i]);
+        weights.previous[i] -= reg_interpKernel<kernel>::offset;
+        weights.inside = weights.inside && -1<weights.previous[i] &&
+                (weights.previous[i]+reg_interpKernel<kernel>::size-1)<floatingDim[i];
+    }
+}
+/* *************************************************************** */
+/** Interpolation of one floating volume using precomputed weights.
+ * Neighbours outside of the floating image take the padding value.
+ */
+template<class FloatingTYPE, int kernel>
+inline double reg_applyInterpolationWeights3D(const FloatingTYPE *floatingIntensity,
+                                              const int *floatingDim,
+                                              size_t floatingPlaneNumber,
+                                              const reg_interpWeights<kernel,3> &weights,
+                                              double paddingValue)
+{
+    int a, b, c, Y, Z;
+    const int *previous = weights.previous;
+    const double *xBasis = weights.basis[0];
+    const double *yBasis = weights.basis[1];
+    const double *zBasis = weights.basis[2];
+    const FloatingTYPE *zPointer, *xyzPointer;
+    double xTempNewValue, yTempNewValue, intensity=0.0;
+
+    if(weights.inside)
+    {
+        // The whole neighbourhood is within the floating image, no boundary check is required
+        for(c=0; c<reg_interpKernel<kernel>::size; c++)
+        {
+            zPointer = &floatingIntensity[(previous[2]+c)*floatingPlaneNumber];
+            yTempNewValue=0.0;
+            for(b=0; b<reg_interpKernel<kernel>::size; b++)
+            {
+                xyzPointer = &zPointer[(previous[1]+b)*floatingDim[0]+previous[0]];
+                xTempNewValue=0.0;
+                for(a=0; a<reg_interpKernel<kernel>::size; a++)
+                    xTempNewValue += static_cast<double>(xyzPointer[a]) * xBasis[a];
+                yTempNewValue += xTempNewValue * yBasis[b];
+            }
+            intensity += yTempNewValue * zBasis[c];
+        }
+    }
+    else
+    {
+        for(c=0; c<reg_interpKernel<kernel>::size; c++)
+        {
+            Z= previous[2]+c;
+            zPointer = &floatingIntensity[Z*floatingPlaneNumber];
+            yTempNewValue=0.0;
+            for(b=0; b<reg_interpKernel<kernel>::size; b++)
+            {
+                Y= previous[1]+b;
+                xyzPointer = &zPointer[Y*floatingDim[0]+previous[0]];
+                xTempNewValue=0.0;
+                for(a=0; a<reg_interpKernel<kernel>::size; a++)
+                {
+                    if(-1<(previous[0]+a) && (previous[0]+a)<floatingDim[0] &&
+                       -1<Z && Z<floatingDim[2] &&
+                       -1<Y && Y<floatingDim[1])
+                    {
+                        xTempNewValue +=  static_cast<double>(*xyzPointer) * xBasis[a];
+                    }
+                    else
+                    {
+                        // paddingValue
+                        xTempNewValue +=  paddingValue * xBasis[a];
+                    }
+                    xyzPointer++;
+                }
+                yTempNewValue += xTempNewValue * yBasis[b];
+            }
+            intensity += yTempNewValue * zBasis[c];
+        }
+    }
+    return intensity;
+}
+/* *************************************************************** */
+template<class FloatingTYPE, int kernel>
+inline double reg_applyInterpolationWeights2D(const FloatingTYPE *floatingIntensity,
+                                              const int *floatingDim,
+                                              const reg_interpWeights<kernel,2> &weights,
+                                              double paddingValue)
+{
+    int a, b, Y;
+    const int *previous = weights.previous;
+    const double *xBasis = weights.basis[0];
+    const double *yBasis = weights.basis[1];
+    const FloatingTYPE *xyzPointer;
+    double xTempNewValue, intensity=0.0;
+
+    if(weights.inside)
+    {
+        // The whole neighbourhood is within the floating image, no boundary check is required
+        for(b=0; b<reg_interpKernel<kernel>::size; b++)
+        {
+            xyzPointer = &floatingIntensity[(previous[1]+b)*floatingDim[0]+previous[0]];
+            xTempNewValue=0.0;
+            for(a=0; a<reg_interpKernel<kernel>::size; a++)
+                xTempNewValue += static_cast<double>(xyzPointer[a]) * xBasis[a];
+            intensity += xTempNewValue * yBasis[b];
+        }
+    }
+    else
+    {
+        for(b=0; b<reg_interpKernel<kernel>::size; b++)
+        {
+            Y= previous[1]+b;
+            xyzPointer = &floatingIntensity[Y*floatingDim[0]+previous[0]];
+            xTempNewValue=0.0;
+            for(a=0; a<reg_interpKernel<kernel>::size; a++)
+            {
+                if(-1<(previous[0]+a) && (previous[0]+a)<floatingDim[0] &&
+                        -1<Y && Y<floatingDim[1])
+                {
+                    xTempNewValue +=  static_cast<double>(*xyzPointer) * xBasis[a];
+                }
+                else
+                {
+                    // paddingValue
+                    xTempNewValue +=  paddingValue * xBasis[a];
+                }
+                xyzPointer++;
+            }
+            intensity += xTempNewValue * yBasis[b];
+        }
+    }
+    return intensity;
+}
+/* *************************************************************** */
+/** Interpolation of all the floating volumes at a position expressed in
+ * voxel coordinates. The weights are computed once and the interpolated
+ * intensities are written to every volume of the warped image.
+ */
+template<class FloatingTYPE, int kernel>
+inline void reg_interpolateVolumes3D(const FloatingTYPE *floatingIntensity,
+                                     const int *floatingDim,
+                                     size_t floatingPlaneNumber,
+                                     size_t floatingVoxelNumber,
+                                     FloatingTYPE *warpedIntensity,
+                                     size_t warpedVoxelNumber,
+                                     size_t volumeNumber,
+                                     const double *position,
+                                     double paddingValue)
+{
+    reg_interpWeights<kernel,3> weights;
+    reg_getInterpolationWeights<kernel,3>(floatingDim, position, weights);
+    for(size_t t=0; t<volumeNumber; ++t)
+    {
+        warpedIntensity[t*warpedVoxelNumber] = reg_castIntensity<FloatingTYPE>(
+                    reg_applyInterpolationWeights3D<FloatingTYPE,kernel>(&floatingIntensity[t*floatingVoxelNumber],
+                                                                         floatingDim,
+                                                                         floatingPlaneNumber,
+                                                                         weights,
+                                                                         paddingValue));
+    }
+}
+/* *************************************************************** */
+template<class FloatingTYPE, int kernel>
+inline void reg_interpolateVolumes2D(const FloatingTYPE *floatingIntensity,
+                                     const int *floatingDim,
+                                     size_t floatingVoxelNumber,
+                                     FloatingTYPE *warpedIntensity,
+                                     size_t warpedVoxelNumber,
+                                     size_t volumeNumber,
+                                     const double *position,
+                                     double paddingValue)
+{
+    reg_interpWeights<kernel,2> weights;
+    reg_getInterpolationWeights<kernel,2>(floatingDim, position, weights);
+    for(size_t t=0; t<volumeNumber; ++t)
+    {
+        warpedIntensity[t*warpedVoxelNumber] = reg_castIntensity<FloatingTYPE>(
+                    reg_applyInterpolationWeights2D<FloatingTYPE,kernel>(&floatingIntensity[t*floatingVoxelNumber],
+                                                                         floatingDim,
+                                                                         weights,
+                                                                         paddingValue));
+    }
+}
+/* *************************************************************** */
+template<class FloatingTYPE, class FieldTYPE, int kernel>
+void ResampleImage3D_core(nifti_image *floatingImage,
+                          nifti_image *deformationField,
+                          nifti_image *warpedImage,
+                          const reg_maskSpans *maskSpans,
+                          FieldTYPE paddingValue)
 {
 #ifdef _WIN32
     long  index;
@@ -379,194 +725,130 @@ void ResampleImage3D(nifti_image *floatingImage,
     FieldTYPE *deformationFieldPtrY = &deformationFieldPtrX[warpedVoxelNumber];
     FieldTYPE *deformationFieldPtrZ = &deformationFieldPtrY[warpedVoxelNumber];
 
-    int *maskPtr = &mask[0];
-
     mat44 *floatingIJKMatrix;
     if(floatingImage->sform_code>0)
         floatingIJKMatrix=&(floatingImage->sto_ijk);
     else floatingIJKMatrix=&(floatingImage->qto_ijk);
 
-    // Define the kernel to use
-    int kernel_size;
-    int kernel_offset=0;
-    void (*kernelCompFctPtr)(double,double *);
-    switch(kernel){
-    case 0:
-        kernel_size=2;
-        kernelCompFctPtr=&interpNearestNeighKernel;
-        kernel_offset=0;
-        break; // nereast-neighboor interpolation
-    case 1:
-        kernel_size=2;
-        kernelCompFctPtr=&interpLinearKernel;
-        kernel_offset=0;
-        break; // linear interpolation
-    case 4:
-        kernel_size=SINC_KERNEL_SIZE;
-        kernelCompFctPtr=&interpWindowedSincKernel;
-        kernel_offset=SINC_KERNEL_RADIUS;
-        break; // sinc interpolation
-    default:
-        kernel_size=4;
-        kernelCompFctPtr=&interpCubicSplineKernel;
-        kernel_offset=1;
-        break; // cubic spline interpolation
-    }
+    int floatingDim[3]={floatingImage->nx, floatingImage->ny, floatingImage->nz};
+    size_t floatingPlaneNumber = (size_t)floatingDim[0]*floatingDim[1];
+    size_t volumeNumber = (size_t)warpedImage->nt*warpedImage->nu;
+    double padding = static_cast<double>(paddingValue);
+    // The padding value is also converted once as it is used for every voxel outside of the mask
+    FloatingTYPE warpedPadding = reg_castIntensity<FloatingTYPE>(padding);
 
-    // Iteration over the different volume along the 4th axis
-    for(size_t t=0; t<(size_t)warpedImage->nt*warpedImage->nu; t++)
-    {
 #ifndef NDEBUG
-        char text[255];
-        sprintf(text, "3D resampling of volume number %zu",t);
-        reg_print_msg_debug(text);
+    char text[255];
+    sprintf(text, "3D resampling of %zu volume(s)", volumeNumber);
+    reg_print_msg_debug(text);
 #endif
 
-        FloatingTYPE *warpedIntensity = &warpedIntensityPtr[t*warpedVoxelNumber];
-        FloatingTYPE *floatingIntensity = &floatingIntensityPtr[t*floatingVoxelNumber];
-
-        int a, b, c, Y, Z, previous[3];
-
-        FloatingTYPE *zPointer, *xyzPointer;
-        double xBasis[SINC_KERNEL_SIZE], yBasis[SINC_KERNEL_SIZE], zBasis[SINC_KERNEL_SIZE], relative[3];
-        double xTempNewValue, yTempNewValue, intensity;
-        float world[3], position[3];
+    // The volumes along the 4th and 5th axes share the same deformation field. The
+    // interpolation weights are thus computed once per voxel and used for all volumes.
+    // The voxels are processed tile by tile so that the floating intensities read for
+    // neighbouring voxels remain in cache. Only the active spans of every line are
+    // interpolated, the voxels in between are set to the padding value
+    int warpedDim[3]={warpedImage->nx, warpedImage->ny, warpedImage->nz};
+    int tileNumber[3], tile, tileStart[3], tileEnd[3], x, y, z, start, end;
+    size_t line, span;
+    int tileCount = reg_getTileNumber(warpedDim, tileNumber);
+    size_t t;
+    float world[3], position[3];
+    double voxel[3];
 #if defined (_OPENMP)
-#pragma omp parallel for default(none) \
-    private(index, intensity, world, position, previous, xBasis, yBasis, zBasis, relative, \
-    a, b, c, Y, Z, zPointer, xyzPointer, xTempNewValue, yTempNewValue) \
-    shared(floatingIntensity, warpedIntensity, warpedVoxelNumber, floatingVoxelNumber, \
-    deformationFieldPtrX, deformationFieldPtrY, deformationFieldPtrZ, maskPtr, \
-    floatingIJKMatrix, floatingImage, paddingValue, kernel_size, kernel_offset, kernelCompFctPtr)
+#pragma omp parallel for default(none) schedule(dynamic) \
+    private(tile, tileStart, tileEnd, x, y, z, start, end, line, span, index, t, world, position, voxel) \
+    shared(floatingIntensityPtr, warpedIntensityPtr, warpedVoxelNumber, floatingVoxelNumber, \
+    deformationFieldPtrX, deformationFieldPtrY, deformationFieldPtrZ, maskSpans, volumeNumber, \
+    floatingIJKMatrix, floatingDim, floatingPlaneNumber, padding, warpedPadding, \
+    warpedDim, tileNumber, tileCount)
 #endif // _OPENMP
-        for(index=0; index<warpedVoxelNumber; index++)
+    for(tile=0; tile<tileCount; tile++)
+    {
+        reg_getTileBounds(tile, warpedDim, tileNumber, tileStart, tileEnd);
+        for(z=tileStart[2]; z<tileEnd[2]; z++)
         {
-
-            intensity=paddingValue;
-
-            if((maskPtr[index])>-1)
+            for(y=tileStart[1]; y<tileEnd[1]; y++)
             {
-                world[0]=static_cast<float>(deformationFieldPtrX[index]);
-                world[1]=static_cast<float>(deformationFieldPtrY[index]);
-                world[2]=static_cast<float>(deformationFieldPtrZ[index]);
-
-                // real -> voxel; floating space
-                reg_mat44_mul(floatingIJKMatrix, world, position);
-
-                previous[0] = static_cast<int>(reg_floor(position[0]));
-                previous[1] = static_cast<int>(reg_floor(position[1]));
-                previous[2] = static_cast<int>(reg_floor(position[2]));
-
-                relative[0]=static_cast<double>(position[0])-static_cast<double>(previous[0]);
-                relative[1]=static_cast<double>(position[1])-static_cast<double>(previous[1]);
-                relative[2]=static_cast<double>(position[2])-static_cast<double>(previous[2]);
-
-                (*kernelCompFctPtr)(relative[0], xBasis);
-                (*kernelCompFctPtr)(relative[1], yBasis);
-                (*kernelCompFctPtr)(relative[2], zBasis);
-                previous[0]-=kernel_offset;
-                previous[1]-=kernel_offset;
-                previous[2]-=kernel_offset;
-
-                intensity=0.0;
-                if(-1<(previous[0]) && (previous[0]+kernel_size-1)<floatingImage->nx &&
-                   -1<(previous[1]) && (previous[1]+kernel_size-1)<floatingImage->ny &&
-                   -1<(previous[2]) && (previous[2]+kernel_size-1)<floatingImage->nz){
-                   for(c=0; c<kernel_size; c++)
-                   {
-                      Z= previous[2]+c;
-                      zPointer = &floatingIntensity[Z*floatingImage->nx*floatingImage->ny];
-                      yTempNewValue=0.0;
-                      for(b=0; b<kernel_size; b++)
-                      {
-                         Y= previous[1]+b;
-                         xyzPointer = &zPointer[Y*floatingImage->nx+previous[0]];
-                         xTempNewValue=0.0;
-                         for(a=0; a<kernel_size; a++)
-                         {
-                            xTempNewValue +=  static_cast<double>(*xyzPointer++) * xBasis[a];
-                         }
-                         yTempNewValue += xTempNewValue * yBasis[b];
-                      }
-                      intensity += yTempNewValue * zBasis[c];
-                   }
+                line=(size_t)z*warpedDim[1]+y;
+                x=tileStart[0];
+                for(span=maskSpans->lineSpan[line]; span<maskSpans->lineSpan[line+1] && x<tileEnd[0]; span++)
+                {
+                    start=maskSpans->spanStart[span]>x?maskSpans->spanStart[span]:x;
+                    start=start<tileEnd[0]?start:tileEnd[0];
+                    end=maskSpans->spanEnd[span]<tileEnd[0]?maskSpans->spanEnd[span]:tileEnd[0];
+                    for(index=line*warpedDim[0]+x; x<start; x++, index++)
+                    {
+                        for(t=0; t<volumeNumber; t++)
+                            warpedIntensityPtr[t*warpedVoxelNumber+index]=warpedPadding;
+                    }
+                    for(index=line*warpedDim[0]+start, x=start; x<end; x++, index++)
+                    {
+                        world[0]=static_cast<float>(deformationFieldPtrX[index]);
+                        world[1]=static_cast<float>(deformationFieldPtrY[index]);
+                        world[2]=static_cast<float>(deformationFieldPtrZ[index]);
+
+                        // real -> voxel; floating space
+                        reg_mat44_mul(floatingIJKMatrix, world, position);
+                        voxel[0]=position[0];
+                        voxel[1]=position[1];
+                        voxel[2]=position[2];
+
+                        reg_interpolateVolumes3D<FloatingTYPE,kernel>(floatingIntensityPtr,
+                                                                      floatingDim,
+                                                                      floatingPlaneNumber,
+                                                                      floatingVoxelNumber,
+                                                                      &warpedIntensityPtr[index],
+                                                                      warpedVoxelNumber,
+                                                                      volumeNumber,
+                                                                      voxel,
+                                                                      padding);
+                    }
                 }
-                else{
-                   for(c=0; c<kernel_size; c++)
-                   {
-                      Z= previous[2]+c;
-                      zPointer = &floatingIntensity[Z*floatingImage->nx*floatingImage->ny];
-                      yTempNewValue=0.0;
-                      for(b=0; b<kernel_size; b++)
-                      {
-                         Y= previous[1]+b;
-                         xyzPointer = &zPointer[Y*floatingImage->nx+previous[0]];
-                         xTempNewValue=0.0;
-                         for(a=0; a<kernel_size; a++)
-                         {
-                            if(-1<(previous[0]+a) && (previous[0]+a)<floatingImage->nx &&
-                               -1<Z && Z<floatingImage->nz &&
-                               -1<Y && Y<floatingImage->ny)
-                            {
-                               xTempNewValue +=  static_cast<double>(*xyzPointer) * xBasis[a];
-                            }
-                            else
-                            {
-                               // paddingValue
-                               xTempNewValue +=  static_cast<double>(paddingValue) * xBasis[a];
-                            }
-                            xyzPointer++;
-                         }
-                         yTempNewValue += xTempNewValue * yBasis[b];
-                      }
-                      intensity += yTempNewValue * zBasis[c];
-                   }
+                for(index=line*warpedDim[0]+x; x<tileEnd[0]; x++, index++)
+                {
+                    for(t=0; t<volumeNumber; t++)
+                        warpedIntensityPtr[t*warpedVoxelNumber+index]=warpedPadding;
                 }
             }
-
-            switch(floatingImage->datatype)
-            {
-            case NIFTI_TYPE_FLOAT32:
-                warpedIntensity[index]=static_cast<FloatingTYPE>(intensity);
-                break;
-            case NIFTI_TYPE_FLOAT64:
-                warpedIntensity[index]=intensity;
-                break;
-            case NIFTI_TYPE_UINT8:
-                if(intensity!=intensity)
-                    intensity=0;
-                intensity=(intensity<=255?reg_round(intensity):255); // 255=2^8-1
-                warpedIntensity[index]=static_cast<FloatingTYPE>(intensity>0?reg_round(intensity):0);
-                break;
-            case NIFTI_TYPE_UINT16:
-                if(intensity!=intensity)
-                    intensity=0;
-                intensity=(intensity<=65535?reg_round(intensity):65535); // 65535=2^16-1
-                warpedIntensity[index]=static_cast<FloatingTYPE>(intensity>0?reg_round(intensity):0);
-                break;
-            case NIFTI_TYPE_UINT32:
-                if(intensity!=intensity)
-                    intensity=0;
-                intensity=(intensity<=4294967295?reg_round(intensity):4294967295); // 4294967295=2^32-1
-                warpedIntensity[index]=static_cast<FloatingTYPE>(intensity>0?reg_round(intensity):0);
-                break;
-            default:
-                if(intensity!=intensity)
-                    intensity=0;
-                warpedIntensity[index]=static_cast<FloatingTYPE>(reg_round(intensity));
-                break;
-            }
         }
     }
 }
 /* *************************************************************** */
 template<class FloatingTYPE, class FieldTYPE>
-void ResampleImage2D(nifti_image *floatingImage,
+void ResampleImage3D(nifti_image *floatingImage,
                      nifti_image *deformationField,
                      nifti_image *warpedImage,
-                     int *mask,
+                     const reg_maskSpans *maskSpans,
                      FieldTYPE paddingValue,
                      int kernel)
+{
+    switch(kernel){
+    case 0:
+        ResampleImage3D_core<FloatingTYPE,FieldTYPE,0>
+                (floatingImage, deformationField, warpedImage, maskSpans, paddingValue);
+        break; // nereast-neighboor interpolation
+    case 1:
+        ResampleImage3D_core<FloatingTYPE,FieldTYPE,1>
+                (floatingImage, deformationField, warpedImage, maskSpans, paddingValue);
+        break; // linear interpolation
+    case 4:
+        ResampleImage3D_core<FloatingTYPE,FieldTYPE,4>
+                (floatingImage, deformationField, warpedImage, maskSpans, paddingValue);
+        break; // sinc interpolation
+    default:
+        ResampleImage3D_core<FloatingTYPE,FieldTYPE,3>
+                (floatingImage, deformationField, warpedImage, maskSpans, paddingValue);
+        break; // cubic spline interpolation
+    }
+}
+/* *************************************************************** */
+template<class FloatingTYPE, class FieldTYPE, int kernel>
+void ResampleImage2D_core(nifti_image *floatingImage,
+                          nifti_image *deformationField,
+                          nifti_image *warpedImage,
+                          const reg_maskSpans *maskSpans,
+                          FieldTYPE paddingValue)
 {
 #ifdef _WIN32
     long  index;
@@ -582,138 +864,102 @@ void ResampleImage2D(nifti_image *floatingImage,
     FieldTYPE *deformationFieldPtrX = static_cast<FieldTYPE *>(deformationField->data);
     FieldTYPE *deformationFieldPtrY = &deformationFieldPtrX[warpedVoxelNumber];
 
-    int *maskPtr = &mask[0];
-
     mat44 *floatingIJKMatrix;
     if(floatingImage->sform_code>0)
         floatingIJKMatrix=&(floatingImage->sto_ijk);
     else floatingIJKMatrix=&(floatingImage->qto_ijk);
 
-    int kernel_size;
-    int kernel_offset=0;
-    void (*kernelCompFctPtr)(double,double *);
-    switch(kernel){
-    case 0:
-        kernel_size=2;
-        kernelCompFctPtr=&interpNearestNeighKernel;
-        kernel_offset=0;
-        break; // nereast-neighboor interpolation
-    case 1:
-        kernel_size=2;
-        kernelCompFctPtr=&interpLinearKernel;
-        kernel_offset=0;
-        break; // linear interpolation
-    case 4:
-        kernel_size=SINC_KERNEL_SIZE;
-        kernelCompFctPtr=&interpWindowedSincKernel;
-        kernel_offset=SINC_KERNEL_RADIUS;
-        break; // sinc interpolation
-    default:
-        kernel_size=4;
-        kernelCompFctPtr=&interpCubicSplineKernel;
-        kernel_offset=1;
-        break; // cubic spline interpolation
-    }
+    int floatingDim[2]={floatingImage->nx, floatingImage->ny};
+    size_t volumeNumber = (size_t)warpedImage->nt*warpedImage->nu;
+    double padding = static_cast<double>(paddingValue);
+    FloatingTYPE warpedPadding = reg_castIntensity<FloatingTYPE>(padding);
 
-    // Iteration over the different volume along the 4th axis
-    for(size_t t=0; t<(size_t)warpedImage->nt*warpedImage->nu; t++)
-    {
 #ifndef NDEBUG
-        char text[255];
-        sprintf(text, "2D resampling of volume number %zu",t);
-        reg_print_msg_debug(text);
+    char text[255];
+    sprintf(text, "2D resampling of %zu volume(s)", volumeNumber);
+    reg_print_msg_debug(text);
 #endif
-        FloatingTYPE *warpedIntensity = &warpedIntensityPtr[t*warpedVoxelNumber];
-        FloatingTYPE *floatingIntensity = &floatingIntensityPtr[t*floatingVoxelNumber];
-
-        int a, b, Y, previous[2];
 
-        FloatingTYPE *xyzPointer;
-        double xBasis[SINC_KERNEL_SIZE], yBasis[SINC_KERNEL_SIZE], relative[2];
-        double xTempNewValue, intensity;
-        float world[3] = {0.0, 0.0, 0.0};
-        float position[3] = {0.0, 0.0, 0.0};
+    size_t t, span;
+    int x, y, start, end;
+    float world[3] = {0.0, 0.0, 0.0};
+    float position[3] = {0.0, 0.0, 0.0};
+    double voxel[2];
+    // Only the active spans of every line are interpolated, the voxels in between
+    // are set to the padding value
 #if defined (_OPENMP)
 #pragma omp parallel for default(none) \
-    private(index, intensity, world, position, previous, xBasis, yBasis, relative, \
-    a, b, Y, xyzPointer, xTempNewValue) \
-    shared(floatingIntensity, warpedIntensity, warpedVoxelNumber, floatingVoxelNumber, \
-    deformationFieldPtrX, deformationFieldPtrY, maskPtr, \
-    floatingIJKMatrix, floatingImage, paddingValue, kernel_size, kernel_offset, kernelCompFctPtr)
+    firstprivate(world, position) \
+    private(x, y, start, end, span, index, t, voxel) \
+    shared(floatingIntensityPtr, warpedIntensityPtr, warpedVoxelNumber, floatingVoxelNumber, \
+    deformationFieldPtrX, deformationFieldPtrY, maskSpans, volumeNumber, \
+    floatingIJKMatrix, floatingDim, padding, warpedPadding, warpedImage)
 #endif // _OPENMP
-        for(index=0; index<warpedVoxelNumber; index++)
+    for(y=0; y<warpedImage->ny; y++)
+    {
+        x=0;
+        for(span=maskSpans->lineSpan[y]; span<maskSpans->lineSpan[y+1]; span++)
         {
-
-            intensity=paddingValue;
-            if((maskPtr[index])>-1)
+            start=maskSpans->spanStart[span];
+            end=maskSpans->spanEnd[span];
+            for(index=(size_t)y*warpedImage->nx+x; x<start; x++, index++)
+            {
+                for(t=0; t<volumeNumber; t++)
+                    warpedIntensityPtr[t*warpedVoxelNumber+index]=warpedPadding;
+            }
+            for(index=(size_t)y*warpedImage->nx+start, x=start; x<end; x++, index++)
             {
                 world[0] = static_cast<float>(deformationFieldPtrX[index]);
                 world[1] = static_cast<float>(deformationFieldPtrY[index]);
-                world[2] = 0;
 
                 // real -> voxel; floating space
                 reg_mat44_mul(floatingIJKMatrix, world, position);
-
-                previous[0] = static_cast<int>(reg_floor(position[0]));
-                previous[1] = static_cast<int>(reg_floor(position[1]));
-
-                relative[0] = static_cast<double>(position[0])-static_cast<double>(previous[0]);
-                relative[1] = static_cast<double>(position[1])-static_cast<double>(previous[1]);
-
-                (*kernelCompFctPtr)(relative[0], xBasis);
-                (*kernelCompFctPtr)(relative[1], yBasis);
-                previous[0]-=kernel_offset;
-                previous[1]-=kernel_offset;
-
-                intensity=0.0;
-                for(b=0; b<kernel_size; b++)
-                {
-                    Y= previous[1]+b;
-                    xyzPointer = &floatingIntensity[Y*floatingImage->nx+previous[0]];
-                    xTempNewValue=0.0;
-                    for(a=0; a<kernel_size; a++)
-                    {
-                        if(-1<(previous[0]+a) && (previous[0]+a)<floatingImage->nx &&
-                                -1<Y && Y<floatingImage->ny)
-                        {
-                            xTempNewValue +=  static_cast<double>(*xyzPointer) * xBasis[a];
-                        }
-                        else
-                        {
-                            // paddingValue
-                            xTempNewValue +=  static_cast<double>(paddingValue) * xBasis[a];
-                        }
-                        xyzPointer++;
-                    }
-                    intensity += xTempNewValue * yBasis[b];
-                }
-
-                switch(floatingImage->datatype)
-                {
-                case NIFTI_TYPE_FLOAT32:
-                    warpedIntensity[index]=static_cast<FloatingTYPE>(intensity);
-                    break;
-                case NIFTI_TYPE_FLOAT64:
-                    warpedIntensity[index]=intensity;
-                    break;
-                case NIFTI_TYPE_UINT8:
-                    intensity=(intensity<=255?reg_round(intensity):255); // 255=2^8-1
-                    warpedIntensity[index]=static_cast<FloatingTYPE>(intensity>0?reg_round(intensity):0);
-                    break;
-                case NIFTI_TYPE_UINT16:
-                    intensity=(intensity<=65535?reg_round(intensity):65535); // 65535=2^16-1
-                    warpedIntensity[index]=static_cast<FloatingTYPE>(intensity>0?reg_round(intensity):0);
-                    break;
-                case NIFTI_TYPE_UINT32:
-                    intensity=(intensity<=4294967295?reg_round(intensity):4294967295); // 4294967295=2^32-1
-                    warpedIntensity[index]=static_cast<FloatingTYPE>(intensity>0?reg_round(intensity):0);
-                    break;
-                default:
-                    warpedIntensity[index]=static_cast<FloatingTYPE>(reg_round(intensity));
-                    break;
-                }
+                voxel[0]=position[0];
+                voxel[1]=position[1];
+
+                reg_interpolateVolumes2D<FloatingTYPE,kernel>(floatingIntensityPtr,
+                                                              floatingDim,
+                                                              floatingVoxelNumber,
+                                                              &warpedIntensityPtr[index],
+                                                              warpedVoxelNumber,
+                                                              volumeNumber,
+                                                              voxel,
+                                                              padding);
             }
         }
+        for(index=(size_t)y*warpedImage->nx+x; x<warpedImage->nx; x++, index++)
+        {
+            for(t=0; t<volumeNumber; t++)
+                warpedIntensityPtr[t*warpedVoxelNumber+index]=warpedPadding;
+        }
+    }
+}
+/* *************************************************************** */
+template<class FloatingTYPE, class FieldTYPE>
+void ResampleImage2D(nifti_image *floatingImage,
+                     nifti_image *deformationField,
+                     nifti_image *warpedImage,
+                     const reg_maskSpans *maskSpans,
+                     FieldTYPE paddingValue,
+                     int kernel)
+{
+    switch(kernel){
+    case 0:
+        ResampleImage2D_core<FloatingTYPE,FieldTYPE,0>
+                (floatingImage, deformationField, warpedImage, maskSpans, paddingValue);
+        break; // nereast-neighboor interpolation
+    case 1:
+        ResampleImage2D_core<FloatingTYPE,FieldTYPE,1>
+                (floatingImage, deformationField, warpedImage, maskSpans, paddingValue);
+        break; // linear interpolation
+    case 4:
+        ResampleImage2D_core<FloatingTYPE,FieldTYPE,4>
+                (floatingImage, deformationField, warpedImage, maskSpans, paddingValue);
+        break; // sinc interpolation
+    default:
+        ResampleImage2D_core<FloatingTYPE,FieldTYPE,3>
+                (floatingImage, deformationField, warpedImage, maskSpans, paddingValue);
+        break; // cubic spline interpolation
     }
 }
 /* *************************************************************** */
@@ -735,6 +981,7 @@ template <class FieldTYPE, class FloatingTYPE>
 void reg_resampleImage2(nifti_image *floatingImage,
                         nifti_image *warpedImage,
                         nifti_image *deformationFieldImage,
+                        const reg_maskSpans *maskSpans,
                         int *mask,
                         int interp,
                         FieldTYPE paddingValue,
@@ -754,7 +1001,7 @@ void reg_resampleImage2(nifti_image *floatingImage,
         ResampleImage3D<FloatingTYPE,FieldTYPE>(floatingImage,
                                                 deformationFieldImage,
                                                 warpedImage,
-                                                mask,
+                                                maskSpans,
                                                 paddingValue,
                                                 interp);
     }
@@ -763,7 +1010,7 @@ void reg_resampleImage2(nifti_image *floatingImage,
         ResampleImage2D<FloatingTYPE,FieldTYPE>(floatingImage,
                                                 deformationFieldImage,
                                                 warpedImage,
-                                                mask,
+                                                maskSpans,
                                                 paddingValue,
                                                 interp);
     }
@@ -782,63 +1029,16 @@ void reg_resampleImage2(nifti_image *floatingImage,
                                                     dtIndicies);
 }
 /* *************************************************************** */
-void reg_resampleImage(nifti_image *floatingImage,
-                       nifti_image *warpedImage,
-                       nifti_image *deformationField,
-                       int *mask,
-                       int interp,
-                       float paddingValue,
-                       bool *dti_timepoint,
-                       mat33 * jacMat)
+static void reg_resampleImage1(nifti_image *floatingImage,
+                               nifti_image *warpedImage,
+                               nifti_image *deformationField,
+                               const reg_maskSpans *maskSpans,
+                               int *mask,
+                               int interp,
+                               float paddingValue,
+                               int *dtIndicies,
+                               mat33 * jacMat)
 {
-    if(floatingImage->datatype != warpedImage->datatype)
-    {
-        reg_print_fct_error("reg_resampleImage");
-        reg_print_msg_error("The floating and warped image should have the same data type");
-        reg_exit();
-    }
-
-    if(floatingImage->nt != warpedImage->nt)
-    {
-        reg_print_fct_error("reg_resampleImage");
-        reg_print_msg_error("The floating and warped images have different dimension along the time axis");
-        reg_exit();
-    }
-
-    // Define the DTI indices if required
-    int dtIndicies[6];
-    for(int i=0; i<6; ++i) dtIndicies[i]=-1;
-    if(dti_timepoint!=NULL)
-    {
-        if(jacMat==NULL)
-        {
-            reg_print_fct_error("reg_resampleImage");
-            reg_print_msg_error("DTI resampling: No Jacobian matrix array has been provided");
-            reg_exit();
-        }
-        int j=0;
-        for(int i=0; i<floatingImage->nt; ++i)
-        {
-            if(dti_timepoint[i]==true)
-                dtIndicies[j++]=i;
-        }
-        if((floatingImage->nz>1 && j!=6) && (floatingImage->nz==1 && j!=3))
-        {
-            reg_print_fct_error("reg_resampleImage");
-            reg_print_msg_error("DTI resampling: Unexpected number of DTI components");
-            reg_exit();
-        }
-    }
-
-    // a mask array is created if no mask is specified
-    bool MrPropreRules = false;
-    if(mask==NULL)
-    {
-        // voxels in the background are set to negative value so 0 corresponds to active voxel
-        mask=(int *)calloc(warpedImage->nx*warpedImage->ny*warpedImage->nz,sizeof(int));
-        MrPropreRules = true;
-    }
-
     switch ( deformationField->datatype )
     {
     case NIFTI_TYPE_FLOAT32:
@@ -848,6 +1048,7 @@ void reg_resampleImage(nifti_image *floatingImage,
             reg_resampleImage2<float,unsigned char>(floatingImage,
                                                     warpedImage,
                                                     deformationField,
+                                                    maskSpans,
                                                     mask,
                                                     interp,
                                                     paddingValue,
@@ -858,6 +1059,7 @@ void reg_resampleImage(nifti_image *floatingImage,
             reg_resampleImage2<float,char>(floatingImage,
                                            warpedImage,
                                            deformationField,
+                                           maskSpans,
                                            mask,
                                            interp,
                                            paddingValue,
@@ -868,6 +1070,7 @@ void reg_resampleImage(nifti_image *floatingImage,
             reg_resampleImage2<float,unsigned short>(floatingImage,
                                                      warpedImage,
                                                      deformationField,
+                                                     maskSpans,
                                                      mask,
                                                      interp,
                                                      paddingValue,
@@ -878,6 +1081,7 @@ void reg_resampleImage(nifti_image *floatingImage,
             reg_resampleImage2<float,short>(floatingImage,
                                             warpedImage,
                                             deformationField,
+                                            maskSpans,
                                             mask,
                                             interp,
                                             paddingValue,
@@ -888,6 +1092,7 @@ void reg_resampleImage(nifti_image *floatingImage,
             reg_resampleImage2<float,unsigned int>(floatingImage,
                                                    warpedImage,
                                                    deformationField,
+                                                   maskSpans,
                                                    mask,
                                                    interp,
                                                    paddingValue,
@@ -898,6 +1103,7 @@ void reg_resampleImage(nifti_image *floatingImage,
             reg_resampleImage2<float,int>(floatingImage,
                                           warpedImage,
                                           deformationField,
+                                          maskSpans,
                                           mask,
                                           interp,
                                           paddingValue,
@@ -908,6 +1114,7 @@ void reg_resampleImage(nifti_image *floatingImage,
             reg_resampleImage2<float,float>(floatingImage,
                                             warpedImage,
                                             deformationField,
+                                            maskSpans,
                                             mask,
                                             interp,
                                             paddingValue,
@@ -918,6 +1125,7 @@ void reg_resampleImage(nifti_image *floatingImage,
             reg_resampleImage2<float,double>(floatingImage,
                                              warpedImage,
                                              deformationField,
+                                             maskSpans,
                                              mask,
                                              interp,
                                              paddingValue,
@@ -936,6 +1144,7 @@ void reg_resampleImage(nifti_image *floatingImage,
             reg_resampleImage2<double,unsigned char>(floatingImage,
                                                      warpedImage,
                                                      deformationField,
+                                                     maskSpans,
                                                      mask,
                                                      interp,
                                                      paddingValue,
@@ -946,6 +1155,7 @@ void reg_resampleImage(nifti_image *floatingImage,
             reg_resampleImage2<double,char>(floatingImage,
                                             warpedImage,
                                             deformationField,
+                                            maskSpans,
                                             mask,
                                             interp,
                                             paddingValue,
@@ -956,6 +1166,7 @@ void reg_resampleImage(nifti_image *floatingImage,
             reg_resampleImage2<double,unsigned short>(floatingImage,
                                                       warpedImage,
                                                       deformationField,
+                                                      maskSpans,
                                                       mask,
                                                       interp,
                                                       paddingValue,
@@ -966,6 +1177,7 @@ void reg_resampleImage(nifti_image *floatingImage,
             reg_resampleImage2<double,short>(floatingImage,
                                              warpedImage,
                                              deformationField,
+                                             maskSpans,
                                              mask,
                                              interp,
                                              paddingValue,
@@ -976,6 +1188,7 @@ void reg_resampleImage(nifti_image *floatingImage,
             reg_resampleImage2<double,unsigned int>(floatingImage,
                                                     warpedImage,
                                                     deformationField,
+                                                    maskSpans,
                                                     mask,
                                                     interp,
                                                     paddingValue,
@@ -986,6 +1199,7 @@ void reg_resampleImage(nifti_image *floatingImage,
             reg_resampleImage2<double,int>(floatingImage,
                                            warpedImage,
                                            deformationField,
+                                           maskSpans,
                                            mask,
                                            interp,
                                            paddingValue,
@@ -996,6 +1210,7 @@ void reg_resampleImage(nifti_image *floatingImage,
             reg_resampleImage2<double,float>(floatingImage,
                                              warpedImage,
                                              deformationField,
+                                             maskSpans,
                                              mask,
                                              interp,
                                              paddingValue,
@@ -1006,6 +1221,7 @@ void reg_resampleImage(nifti_image *floatingImage,
             reg_resampleImage2<double,double>(floatingImage,
                                               warpedImage,
                                               deformationField,
+                                              maskSpans,
                                               mask,
                                               interp,
                                               paddingValue,
@@ -1021,6 +1237,79 @@ void reg_resampleImage(nifti_image *floatingImage,
         printf("Deformation field pixel type unsupported.");
         break;
     }
+}
+/* *************************************************************** */
+void reg_resampleImage(nifti_image *floatingImage,
+                       nifti_image *warpedImage,
+                       nifti_image *deformationField,
+                       int *mask,
+                       int interp,
+                       float paddingValue,
+                       bool *dti_timepoint,
+                       mat33 * jacMat)
+{
+    if(floatingImage->datatype != warpedImage->datatype)
+    {
+        reg_print_fct_error("reg_resampleImage");
+        reg_print_msg_error("The floating and warped image should have the same data type");
+        reg_exit();
+    }
+
+    if(floatingImage->nt != warpedImage->nt)
+    {
+        reg_print_fct_error("reg_resampleImage");
+        reg_print_msg_error("The floating and warped images have different dimension along the time axis");
+        reg_exit();
+    }
+
+    // Define the DTI indices if required
+    int dtIndicies[6];
+    for(int i=0; i<6; ++i) dtIndicies[i]=-1;
+    if(dti_timepoint!=NULL)
+    {
+        if(jacMat==NULL)
+        {
+            reg_print_fct_error("reg_resampleImage");
+            reg_print_msg_error("DTI resampling: No Jacobian matrix array has been provided");
+            reg_exit();
+        }
+        int j=0;
+        for(int i=0; i<floatingImage->nt; ++i)
+        {
+            if(dti_timepoint[i]==true)
+                dtIndicies[j++]=i;
+        }
+        if((floatingImage->nz>1 && j!=6) && (floatingImage->nz==1 && j!=3))
+        {
+            reg_print_fct_error("reg_resampleImage");
+            reg_print_msg_error("DTI resampling: Unexpected number of DTI components");
+            reg_exit();
+        }
+    }
+
+    // The active voxels are converted into spans. A full mask array is only
+    // required by the reorientation of the diffusion tensors
+    int warpedDim[3]={warpedImage->nx, warpedImage->ny, warpedImage->nz};
+    reg_maskSpans *maskSpans=reg_tools_createMaskSpans(mask, warpedDim);
+    bool MrPropreRules = false;
+    if(mask==NULL && dtIndicies[0]!=-1)
+    {
+        // voxels in the background are set to negative value so 0 corresponds to active voxel
+        mask=(int *)calloc(warpedImage->nx*warpedImage->ny*warpedImage->nz,sizeof(int));
+        MrPropreRules = true;
+    }
+
+    reg_resampleImage1(floatingImage,
+                       warpedImage,
+                       deformationField,
+                       maskSpans,
+                       mask,
+                       interp,
+                       paddingValue,
+                       dtIndicies,
+                       jacMat);
+
+    reg_tools_freeMaskSpans(maskSpans);
     if(MrPropreRules==true)
     {
         free(mask);
@@ -1028,69 +1317,455 @@ void reg_resampleImage(nifti_image *floatingImage,
     }
 }
 /* *************************************************************** */
+void reg_resampleImage_spans(nifti_image *floatingImage,
+                             nifti_image *warpedImage,
+                             nifti_image *deformationField,
+                             const reg_maskSpans *maskSpans,
+                             int interp,
+                             float paddingValue)
+{
+    if(floatingImage->datatype != warpedImage->datatype)
+    {
+        reg_print_fct_error("reg_resampleImage_spans");
+        reg_print_msg_error("The floating and warped image should have the same data type");
+        reg_exit();
+    }
 
-template<class FloatingTYPE, class FieldTYPE>
-void ResampleImage3D_PSF_Sinc(nifti_image *floatingImage,
-                              nifti_image *deformationField,
-                              nifti_image *warpedImage,
-                              int *mask,
-                              FieldTYPE paddingValue,
-                              int kernel)
+    if(floatingImage->nt != warpedImage->nt)
+    {
+        reg_print_fct_error("reg_resampleImage_spans");
+        reg_print_msg_error("The floating and warped images have different dimension along the time axis");
+        reg_exit();
+    }
+
+    // All voxels are considered if no spans are provided
+    reg_maskSpans *temporarySpans=NULL;
+    if(maskSpans==NULL)
+    {
+        int warpedDim[3]={warpedImage->nx, warpedImage->ny, warpedImage->nz};
+        maskSpans=temporarySpans=reg_tools_createMaskSpans(NULL, warpedDim);
+    }
+    int dtIndicies[6];
+    for(int i=0; i<6; ++i) dtIndicies[i]=-1;
+    reg_resampleImage1(floatingImage,
+                       warpedImage,
+                       deformationField,
+                       maskSpans,
+                       NULL,
+                       interp,
+                       paddingValue,
+                       dtIndicies,
+                       NULL);
+    reg_tools_freeMaskSpans(temporarySpans);
+}
+/* *************************************************************** */
+/** The floating voxel position of every warped voxel is an affine
+ * function of its index. The composition of the floating ijk matrix, the
+ * affine transformation and the warped xyz matrix is thus computed once
+ * in double precision, and the positions are obtained line by line by
+ * adding the first column of the composed matrix for every step along x.
+ * No deformation field is required.
+ */
+template<class FloatingTYPE, int kernel>
+void ResampleImage3D_affine(nifti_image *floatingImage,
+                            nifti_image *warpedImage,
+                            const double *voxelMatrix,
+                            const reg_maskSpans *maskSpans,
+                            double paddingValue)
 {
-#ifdef _WIN32
-    long index;
-    long warpedVoxelNumber = (long)warpedImage->nx*warpedImage->ny*warpedImage->nz;
-    long warpedPlaneNumber = (long)warpedImage->nx*warpedImage->ny;
-    long warpedLineNumber = (long)warpedImage->nx;
-    long floatingVoxelNumber = (long)floatingImage->nx*floatingImage->ny*floatingImage->nz;
-#else
-    size_t index;
     size_t warpedVoxelNumber = (size_t)warpedImage->nx*warpedImage->ny*warpedImage->nz;
-    size_t warpedPlaneNumber = (size_t)warpedImage->nx*warpedImage->ny;
-    size_t warpedLineNumber = (size_t)warpedImage->nx;
     size_t floatingVoxelNumber = (size_t)floatingImage->nx*floatingImage->ny*floatingImage->nz;
-#endif
     FloatingTYPE *floatingIntensityPtr = static_cast<FloatingTYPE *>(floatingImage->data);
     FloatingTYPE *warpedIntensityPtr = static_cast<FloatingTYPE *>(warpedImage->data);
-    FieldTYPE *deformationFieldPtrX = static_cast<FieldTYPE *>(deformationField->data);
-    FieldTYPE *deformationFieldPtrY = &deformationFieldPtrX[warpedVoxelNumber];
-    FieldTYPE *deformationFieldPtrZ = &deformationFieldPtrY[warpedVoxelNumber];
-    int *maskPtr = &mask[0];
 
-    mat44 *floatingIJKMatrix;
-    if(floatingImage->sform_code>0)
-        floatingIJKMatrix=&(floatingImage->sto_ijk);
-    else floatingIJKMatrix=&(floatingImage->qto_ijk);
+    int warpedDim[3]={warpedImage->nx, warpedImage->ny, warpedImage->nz};
+    int floatingDim[3]={floatingImage->nx, floatingImage->ny, floatingImage->nz};
+    size_t floatingPlaneNumber = (size_t)floatingDim[0]*floatingDim[1];
+    size_t volumeNumber = (size_t)warpedImage->nt*warpedImage->nu;
+    FloatingTYPE warpedPadding = reg_castIntensity<FloatingTYPE>(paddingValue);
 
-    // Define the kernel to use
-    int kernel_size;
-    int kernel_offset=0;
-    void (*kernelCompFctPtr)(double,double *);
-    switch(kernel){
-    case 0:
-        reg_print_fct_error("ResampleImage3D_PSF");
-        reg_print_msg_error("Not implemented for NN interpolation yet");
-        reg_exit();
-        kernel_size=2;
-        kernelCompFctPtr=&interpNearestNeighKernel;
-        kernel_offset=0;
-        break; // nereast-neighboor interpolation
-    case 1:
-        kernel_size=2;
-        kernelCompFctPtr=&interpLinearKernel;
-        kernel_offset=0;
-        break; // linear interpolation
-    case 4:
-        kernel_size=SINC_KERNEL_SIZE;
-        kernelCompFctPtr=&interpWindowedSincKernel;
-        kernel_offset=SINC_KERNEL_RADIUS;
-        break; // sinc interpolation
-    default:
-        kernel_size=4;
-        kernelCompFctPtr=&interpCubicSplineKernel;
-        kernel_offset=1;
-        break; // cubic spline interpolation
-    }
+#ifndef NDEBUG
+    char text[255];
+    sprintf(text, "3D affine resampling of %zu volume(s)", volumeNumber);
+    reg_print_msg_debug(text);
+#endif
+
+    // The voxels are processed tile by tile so that the floating intensities
+    // read for neighbouring voxels remain in cache. Only the active spans of
+    // every line are interpolated, the voxels in between are set to the
+    // padding value
+    int tileNumber[3], tile, tileStart[3], tileEnd[3], x, y, z, begin, end;
+    int tileCount = reg_getTileNumber(warpedDim, tileNumber);
+    size_t index, t, line, span;
+    double start[3], position[3];
+#if defined (_OPENMP)
+#pragma omp parallel for default(none) schedule(dynamic) \
+    private(tile, tileStart, tileEnd, x, y, z, begin, end, line, span, index, t, start, position) \
+    shared(floatingIntensityPtr, warpedIntensityPtr, warpedDim, tileNumber, tileCount, maskSpans, \
+    warpedVoxelNumber, floatingVoxelNumber, volumeNumber, \
+    voxelMatrix, floatingDim, floatingPlaneNumber, paddingValue, warpedPadding)
+#endif // _OPENMP
+    for(tile=0; tile<tileCount; tile++)
+    {
+        reg_getTileBounds(tile, warpedDim, tileNumber, tileStart, tileEnd);
+        for(z=tileStart[2]; z<tileEnd[2]; z++)
+        {
+            for(y=tileStart[1]; y<tileEnd[1]; y++)
+            {
+                // Floating voxel position of the first voxel of the line
+                start[0] = voxelMatrix[1]*y + voxelMatrix[2]*z + voxelMatrix[3];
+                start[1] = voxelMatrix[5]*y + voxelMatrix[6]*z + voxelMatrix[7];
+                start[2] = voxelMatrix[9]*y + voxelMatrix[10]*z + voxelMatrix[11];
+                line=(size_t)z*warpedDim[1]+y;
+                x=tileStart[0];
+                for(span=maskSpans->lineSpan[line]; span<maskSpans->lineSpan[line+1] && x<tileEnd[0]; span++)
+                {
+                    begin=maskSpans->spanStart[span]>x?maskSpans->spanStart[span]:x;
+                    begin=begin<tileEnd[0]?begin:tileEnd[0];
+                    end=maskSpans->spanEnd[span]<tileEnd[0]?maskSpans->spanEnd[span]:tileEnd[0];
+                    for(index=line*warpedDim[0]+x; x<begin; x++, index++)
+                    {
+                        for(t=0; t<volumeNumber; t++)
+                            warpedIntensityPtr[t*warpedVoxelNumber+index]=warpedPadding;
+                    }
+                    for(index=line*warpedDim[0]+begin, x=begin; x<end; x++, index++)
+                    {
+                        position[0] = start[0] + voxelMatrix[0]*x;
+                        position[1] = start[1] + voxelMatrix[4]*x;
+                        position[2] = start[2] + voxelMatrix[8]*x;
+
+                        reg_interpolateVolumes3D<FloatingTYPE,kernel>(floatingIntensityPtr,
+                                                                      floatingDim,
+                                                                      floatingPlaneNumber,
+                                                                      floatingVoxelNumber,
+                                                                      &warpedIntensityPtr[index],
+                                                                      warpedVoxelNumber,
+                                                                      volumeNumber,
+                                                                      position,
+                                                                      paddingValue);
+                    }
+                }
+                for(index=line*warpedDim[0]+x; x<tileEnd[0]; x++, index++)
+                {
+                    for(t=0; t<volumeNumber; t++)
+                        warpedIntensityPtr[t*warpedVoxelNumber+index]=warpedPadding;
+                }
+            }
+        }
+    }
+}
+/* *************************************************************** */
+template<class FloatingTYPE, int kernel>
+void ResampleImage2D_affine(nifti_image *floatingImage,
+                            nifti_image *warpedImage,
+                            const double *voxelMatrix,
+                            const reg_maskSpans *maskSpans,
+                            double paddingValue)
+{
+    size_t warpedVoxelNumber = (size_t)warpedImage->nx*warpedImage->ny;
+    size_t floatingVoxelNumber = (size_t)floatingImage->nx*floatingImage->ny;
+    FloatingTYPE *floatingIntensityPtr = static_cast<FloatingTYPE *>(floatingImage->data);
+    FloatingTYPE *warpedIntensityPtr = static_cast<FloatingTYPE *>(warpedImage->data);
+
+    int warpedDim[2]={warpedImage->nx, warpedImage->ny};
+    int floatingDim[2]={floatingImage->nx, floatingImage->ny};
+    size_t volumeNumber = (size_t)warpedImage->nt*warpedImage->nu;
+    FloatingTYPE warpedPadding = reg_castIntensity<FloatingTYPE>(paddingValue);
+
+#ifndef NDEBUG
+    char text[255];
+    sprintf(text, "2D affine resampling of %zu volume(s)", volumeNumber);
+    reg_print_msg_debug(text);
+#endif
+
+    int x, y, begin, end;
+    size_t index, t, span;
+    double start[2], position[2];
+    // Only the active spans of every line are interpolated, the voxels in
+    // between are set to the padding value
+#if defined (_OPENMP)
+#pragma omp parallel for default(none) \
+    private(x, y, begin, end, span, index, t, start, position) \
+    shared(floatingIntensityPtr, warpedIntensityPtr, warpedDim, maskSpans, \
+    warpedVoxelNumber, floatingVoxelNumber, volumeNumber, \
+    voxelMatrix, floatingDim, paddingValue, warpedPadding)
+#endif // _OPENMP
+    for(y=0; y<warpedDim[1]; ++y)
+    {
+        start[0] = voxelMatrix[1]*y + voxelMatrix[3];
+        start[1] = voxelMatrix[5]*y + voxelMatrix[7];
+        x=0;
+        for(span=maskSpans->lineSpan[y]; span<maskSpans->lineSpan[y+1]; span++)
+        {
+            begin=maskSpans->spanStart[span];
+            end=maskSpans->spanEnd[span];
+            for(index=(size_t)y*warpedDim[0]+x; x<begin; x++, index++)
+            {
+                for(t=0; t<volumeNumber; t++)
+                    warpedIntensityPtr[t*warpedVoxelNumber+index]=warpedPadding;
+            }
+            for(index=(size_t)y*warpedDim[0]+begin, x=begin; x<end; x++, index++)
+            {
+                position[0] = start[0] + voxelMatrix[0]*x;
+                position[1] = start[1] + voxelMatrix[4]*x;
+
+                reg_interpolateVolumes2D<FloatingTYPE,kernel>(floatingIntensityPtr,
+                                                              floatingDim,
+                                                              floatingVoxelNumber,
+                                                              &warpedIntensityPtr[index],
+                                                              warpedVoxelNumber,
+                                                              volumeNumber,
+                                                              position,
+                                                              paddingValue);
+            }
+        }
+        for(index=(size_t)y*warpedDim[0]+x; x<warpedDim[0]; x++, index++)
+        {
+            for(t=0; t<volumeNumber; t++)
+                warpedIntensityPtr[t*warpedVoxelNumber+index]=warpedPadding;
+        }
+    }
+}
+/* *************************************************************** */
+template<class FloatingTYPE>
+void reg_resampleImage2_affine(nifti_image *floatingImage,
+                               nifti_image *warpedImage,
+                               mat44 *affineTransformation,
+                               const reg_maskSpans *maskSpans,
+                               int interp,
+                               double paddingValue)
+{
+    // voxel (warped) -> real (warped) -> real (floating) -> voxel (floating)
+    mat44 *warpedXYZMatrix;
+    if(warpedImage->sform_code>0)
+        warpedXYZMatrix=&(warpedImage->sto_xyz);
+    else warpedXYZMatrix=&(warpedImage->qto_xyz);
+    mat44 *floatingIJKMatrix;
+    if(floatingImage->sform_code>0)
+        floatingIJKMatrix=&(floatingImage->sto_ijk);
+    else floatingIJKMatrix=&(floatingImage->qto_ijk);
+
+    double worldMatrix[4][4], voxelMatrix[16];
+    for(int i=0; i<4; ++i)
+    {
+        for(int j=0; j<4; ++j)
+        {
+            worldMatrix[i][j]=0.0;
+            for(int k=0; k<4; ++k)
+                worldMatrix[i][j] += static_cast<double>(affineTransformation->m[i][k]) *
+                        static_cast<double>(warpedXYZMatrix->m[k][j]);
+        }
+    }
+    // The world z coordinate is ignored in 2D, as when a deformation field is used
+    if(warpedImage->nz==1)
+        for(int j=0; j<4; ++j)
+            worldMatrix[2][j]=0.0;
+    for(int i=0; i<4; ++i)
+    {
+        for(int j=0; j<4; ++j)
+        {
+            voxelMatrix[i*4+j]=0.0;
+            for(int k=0; k<4; ++k)
+                voxelMatrix[i*4+j] += static_cast<double>(floatingIJKMatrix->m[i][k]) *
+                        worldMatrix[k][j];
+        }
+    }
+
+    if(warpedImage->nz>1)
+    {
+        switch(interp){
+        case 0:
+            ResampleImage3D_affine<FloatingTYPE,0>
+                    (floatingImage, warpedImage, voxelMatrix, maskSpans, paddingValue);
+            break; // nereast-neighboor interpolation
+        case 1:
+            ResampleImage3D_affine<FloatingTYPE,1>
+                    (floatingImage, warpedImage, voxelMatrix, maskSpans, paddingValue);
+            break; // linear interpolation
+        case 4:
+            ResampleImage3D_affine<FloatingTYPE,4>
+                    (floatingImage, warpedImage, voxelMatrix, maskSpans, paddingValue);
+            break; // sinc interpolation
+        default:
+            ResampleImage3D_affine<FloatingTYPE,3>
+                    (floatingImage, warpedImage, voxelMatrix, maskSpans, paddingValue);
+            break; // cubic spline interpolation
+        }
+    }
+    else
+    {
+        switch(interp){
+        case 0:
+            ResampleImage2D_affine<FloatingTYPE,0>
+                    (floatingImage, warpedImage, voxelMatrix, maskSpans, paddingValue);
+            break; // nereast-neighboor interpolation
+        case 1:
+            ResampleImage2D_affine<FloatingTYPE,1>
+                    (floatingImage, warpedImage, voxelMatrix, maskSpans, paddingValue);
+            break; // linear interpolation
+        case 4:
+            ResampleImage2D_affine<FloatingTYPE,4>
+                    (floatingImage, warpedImage, voxelMatrix, maskSpans, paddingValue);
+            break; // sinc interpolation
+        default:
+            ResampleImage2D_affine<FloatingTYPE,3>
+                    (floatingImage, warpedImage, voxelMatrix, maskSpans, paddingValue);
+            break; // cubic spline interpolation
+        }
+    }
+}
+/* *************************************************************** */
+void reg_resampleImage_affine_spans(nifti_image *floatingImage,
+                                    nifti_image *warpedImage,
+                                    mat44 *affineTransformation,
+                                    const reg_maskSpans *maskSpans,
+                                    int interp,
+                                    float paddingValue)
+{
+    if(floatingImage->datatype != warpedImage->datatype)
+    {
+        reg_print_fct_error("reg_resampleImage_affine_spans");
+        reg_print_msg_error("The floating and warped image should have the same data type");
+        reg_exit();
+    }
+
+    if(floatingImage->nt != warpedImage->nt)
+    {
+        reg_print_fct_error("reg_resampleImage_affine_spans");
+        reg_print_msg_error("The floating and warped images have different dimension along the time axis");
+        reg_exit();
+    }
+
+    // All voxels are considered if no spans are provided
+    reg_maskSpans *temporarySpans=NULL;
+    if(maskSpans==NULL)
+    {
+        int warpedDim[3]={warpedImage->nx, warpedImage->ny, warpedImage->nz};
+        maskSpans=temporarySpans=reg_tools_createMaskSpans(NULL, warpedDim);
+    }
+    switch ( floatingImage->datatype )
+    {
+    case NIFTI_TYPE_UINT8:
+        reg_resampleImage2_affine<unsigned char>
+                (floatingImage, warpedImage, affineTransformation, maskSpans, interp, paddingValue);
+        break;
+    case NIFTI_TYPE_INT8:
+        reg_resampleImage2_affine<char>
+                (floatingImage, warpedImage, affineTransformation, maskSpans, interp, paddingValue);
+        break;
+    case NIFTI_TYPE_UINT16:
+        reg_resampleImage2_affine<unsigned short>
+                (floatingImage, warpedImage, affineTransformation, maskSpans, interp, paddingValue);
+        break;
+    case NIFTI_TYPE_INT16:
+        reg_resampleImage2_affine<short>
+                (floatingImage, warpedImage, affineTransformation, maskSpans, interp, paddingValue);
+        break;
+    case NIFTI_TYPE_UINT32:
+        reg_resampleImage2_affine<unsigned int>
+                (floatingImage, warpedImage, affineTransformation, maskSpans, interp, paddingValue);
+        break;
+    case NIFTI_TYPE_INT32:
+        reg_resampleImage2_affine<int>
+                (floatingImage, warpedImage, affineTransformation, maskSpans, interp, paddingValue);
+        break;
+    case NIFTI_TYPE_FLOAT32:
+        reg_resampleImage2_affine<float>
+                (floatingImage, warpedImage, affineTransformation, maskSpans, interp, paddingValue);
+        break;
+    case NIFTI_TYPE_FLOAT64:
+        reg_resampleImage2_affine<double>
+                (floatingImage, warpedImage, affineTransformation, maskSpans, interp, paddingValue);
+        break;
+    default:
+        reg_print_fct_error("reg_resampleImage_affine_spans");
+        reg_print_msg_error("Floating pixel type unsupported");
+        reg_exit();
+    }
+    reg_tools_freeMaskSpans(temporarySpans);
+}
+/* *************************************************************** */
+void reg_resampleImage_affine(nifti_image *floatingImage,
+                              nifti_image *warpedImage,
+                              mat44 *affineTransformation,
+                              int *mask,
+                              int interp,
+                              float paddingValue)
+{
+    int warpedDim[3]={warpedImage->nx, warpedImage->ny, warpedImage->nz};
+    reg_maskSpans *maskSpans=reg_tools_createMaskSpans(mask, warpedDim);
+    reg_resampleImage_affine_spans(floatingImage,
+                                   warpedImage,
+                                   affineTransformation,
+                                   maskSpans,
+                                   interp,
+                                   paddingValue);
+    reg_tools_freeMaskSpans(maskSpans);
+}
+/* *************************************************************** */
+
+template<class FloatingTYPE, class FieldTYPE>
+void ResampleImage3D_PSF_Sinc(nifti_image *floatingImage,
+                              nifti_image *deformationField,
+                              nifti_image *warpedImage,
+                              int *mask,
+                              FieldTYPE paddingValue,
+                              int kernel)
+{
+#ifdef _WIN32
+    long index;
+    long warpedVoxelNumber = (long)warpedImage->nx*warpedImage->ny*warpedImage->nz;
+    long warpedPlaneNumber = (long)warpedImage->nx*warpedImage->ny;
+    long warpedLineNumber = (long)warpedImage->nx;
+    long floatingVoxelNumber = (long)floatingImage->nx*floatingImage->ny*floatingImage->nz;
+#else
+    size_t index;
+    size_t warpedVoxelNumber = (size_t)warpedImage->nx*warpedImage->ny*warpedImage->nz;
+    size_t warpedPlaneNumber = (size_t)warpedImage->nx*warpedImage->ny;
+    size_t warpedLineNumber = (size_t)warpedImage->nx;
+    size_t floatingVoxelNumber = (size_t)floatingImage->nx*floatingImage->ny*floatingImage->nz;
+#endif
+    FloatingTYPE *floatingIntensityPtr = static_cast<FloatingTYPE *>(floatingImage->data);
+    FloatingTYPE *warpedIntensityPtr = static_cast<FloatingTYPE *>(warpedImage->data);
+    FieldTYPE *deformationFieldPtrX = static_cast<FieldTYPE *>(deformationField->data);
+    FieldTYPE *deformationFieldPtrY = &deformationFieldPtrX[warpedVoxelNumber];
+    FieldTYPE *deformationFieldPtrZ = &deformationFieldPtrY[warpedVoxelNumber];
+    int *maskPtr = &mask[0];
+
+    mat44 *floatingIJKMatrix;
+    if(floatingImage->sform_code>0)
+        floatingIJKMatrix=&(floatingImage->sto_ijk);
+    else floatingIJKMatrix=&(floatingImage->qto_ijk);
+
+    // Define the kernel to use
+    int kernel_size;
+    int kernel_offset=0;
+    void (*kernelCompFctPtr)(double,double *);
+    switch(kernel){
+    case 0:
+        reg_print_fct_error("ResampleImage3D_PSF");
+        reg_print_msg_error("Not implemented for NN interpolation yet");
+        reg_exit();
+        kernel_size=2;
+        kernelCompFctPtr=&interpNearestNeighKernel;
+        kernel_offset=0;
+        break; // nereast-neighboor interpolation
+    case 1:
+        kernel_size=2;
+        kernelCompFctPtr=&interpLinearKernel;
+        kernel_offset=0;
+        break; // linear interpolation
+    case 4:
+        kernel_size=SINC_KERNEL_SIZE;
+        kernelCompFctPtr=&interpWindowedSincKernel_LUT;
+        kernel_offset=SINC_KERNEL_RADIUS;
+        break; // sinc interpolation
+    default:
+        kernel_size=4;
+        kernelCompFctPtr=&interpCubicSplineKernel;
+        kernel_offset=1;
+        break; // cubic spline interpolation
+    }
 
     // Iteration over the different volume along the 4th axis
     for(size_t t=0; t<(size_t)warpedImage->nt*warpedImage->nu; t++)
@@ -1163,9 +1838,9 @@ void ResampleImage3D_PSF_Sinc(nifti_image *floatingImage,
                             // as the sqrt(eigenVal) is equivalent to the STD
 
 
-                            psfWeight=interpWindowedSincKernel_Samp(shiftSamp[0],shiftall)*
-                                    interpWindowedSincKernel_Samp(shiftSamp[1],shiftall)*
-                                    interpWindowedSincKernel_Samp(shiftSamp[2],shiftall);
+                            psfWeight=interpWindowedSincKernel_Samp_LUT(shiftSamp[0])*
+                                    interpWindowedSincKernel_Samp_LUT(shiftSamp[1])*
+                                    interpWindowedSincKernel_Samp_LUT(shiftSamp[2]);
                             //  std::cout<<shiftSamp[0]<<", "<<shiftSamp[1]<<", "<<shiftSamp[2]<<", "<<psfWeight<<std::endl;
 
                             // Interpolate (trilinearly) the deformation field for non-integer positions
@@ -1321,58 +1996,593 @@ void ResampleImage3D_PSF_Sinc(nifti_image *floatingImage,
 }
 
 /* *************************************************************** */
+/** Conversion of a PSF interpolated intensity into the warped image datatype */
+template<class FloatingTYPE>
+inline FloatingTYPE reg_castPSFIntensity(double intensity, int datatype)
+{
+    switch(datatype)
+    {
+    case NIFTI_TYPE_FLOAT32:
+    case NIFTI_TYPE_FLOAT64:
+        return static_cast<FloatingTYPE>(intensity);
+    case NIFTI_TYPE_UINT8:
+        if(intensity!=intensity)
+            intensity=0;
+        intensity=(intensity<=255?reg_round(intensity):255); // 255=2^8-1
+        return static_cast<FloatingTYPE>(intensity>0?reg_round(intensity):0);
+    case NIFTI_TYPE_UINT16:
+        if(intensity!=intensity)
+            intensity=0;
+        intensity=(intensity<=65535?reg_round(intensity):65535); // 65535=2^16-1
+        return static_cast<FloatingTYPE>(intensity>0?reg_round(intensity):0);
+    case NIFTI_TYPE_UINT32:
+        if(intensity!=intensity)
+            intensity=0;
+        intensity=(intensity<=4294967295?reg_round(intensity):4294967295); // 4294967295=2^32-1
+        return static_cast<FloatingTYPE>(intensity>0?reg_round(intensity):0);
+    case NIFTI_TYPE_INT16:
+        if(intensity!=intensity)
+            intensity=0;
+        intensity=(intensity<=32767?reg_round(intensity):32767); // 32767=2^15-1
+        return static_cast<FloatingTYPE>(intensity);
+    case NIFTI_TYPE_INT32:
+        if(intensity!=intensity)
+            intensity=0;
+        intensity=(intensity<=2147483647?reg_round(intensity):2147483647); // 2147483647=2^31-1
+        return static_cast<FloatingTYPE>(intensity);
+    default:
+        if(intensity!=intensity)
+            intensity=0;
+        return static_cast<FloatingTYPE>(reg_round(intensity));
+    }
+}
+/* *************************************************************** */
+/** Sample of a discretised PSF. The shift is expressed in warped voxel
+ * and the weight is the Gaussian density at the sample position.
+ */
+struct reg_psfSample
+{
+    float shift[3];
+    float weight;
+};
 /* *************************************************************** */
-template<class FloatingTYPE, class FieldTYPE>
-void ResampleImage3D_PSF(nifti_image *floatingImage,
-                         nifti_image *deformationField,
-                         nifti_image *warpedImage,
-                         int *mask,
-                         FieldTYPE paddingValue,
-                         int kernel,
-                         mat33 * jacMat,
-                         char algorithm)
+/** Estimation of the PSF to apply in the reference space, given the
+ * Jacobian matrix of the transformation, such as T=P+A*S*At. The eigen
+ * decomposition of P, its inverse and its determinant are returned.
+ * The algorithm minimises the matrix metric (0) or the determinant (1).
+ */
+void reg_getPSFCovariance(const mat33 &jacobian,
+                          const mat33 &T,
+                          const mat33 &S,
+                          char algorithm,
+                          mat33 &TmS_EigVec,
+                          mat33 &TmS_EigVal,
+                          mat33 &invP,
+                          float &currentDeterminant)
 {
-#ifdef _WIN32
-    long index;
-    long warpedVoxelNumber = (long)warpedImage->nx*warpedImage->ny*warpedImage->nz;
-    long warpedPlaneNumber = (long)warpedImage->nx*warpedImage->ny;
-    long warpedLineNumber = (long)warpedImage->nx;
-    long floatingVoxelNumber = (long)floatingImage->nx*floatingImage->ny*floatingImage->nz;
-#else
-    size_t index;
-    size_t warpedVoxelNumber = (size_t)warpedImage->nx*warpedImage->ny*warpedImage->nz;
-    size_t warpedPlaneNumber = (size_t)warpedImage->nx*warpedImage->ny;
-    size_t warpedLineNumber = (size_t)warpedImage->nx;
-    size_t floatingVoxelNumber = (size_t)floatingImage->nx*floatingImage->ny*floatingImage->nz;
-#endif
-    FloatingTYPE *floatingIntensityPtr = static_cast<FloatingTYPE *>(floatingImage->data);
-    FloatingTYPE *warpedIntensityPtr = static_cast<FloatingTYPE *>(warpedImage->data);
-    FieldTYPE *deformationFieldPtrX = static_cast<FieldTYPE *>(deformationField->data);
-    FieldTYPE *deformationFieldPtrY = &deformationFieldPtrX[warpedVoxelNumber];
-    FieldTYPE *deformationFieldPtrZ = &deformationFieldPtrY[warpedVoxelNumber];
+    mat33 ASAt, A, TmS;
+    if(algorithm==0){
+
+        // T=P+A*S*At
+        A=nifti_mat33_inverse(jacobian);
+
+        ASAt = A * S * reg_mat33_trans(A);
+
+        TmS = T - ASAt;
+        //reg_mat33_disp(&TmS, "matTmS");
+
+        reg_mat33_diagonalize(&TmS, &TmS_EigVec, &TmS_EigVal);
+
+        // If eigen values are less than 0, set them to 0.
+        // Also, invert the eigenvalues to estimate the inverse.
+        mat33 TmS_EigVal_inv;
+        for(int m=0;m<3;m++){
+            for(int n=0;n<3;n++){
+                if(m==n){ // Set diagonals to max(val,0)
+                    TmS_EigVal.m[m][n]=TmS_EigVal.m[m][n]>0.000001f?TmS_EigVal.m[m][n]:0.000001f;
+                    TmS_EigVal_inv.m[m][n]=1.0f/TmS_EigVal.m[m][n];
+                }else{ // Set off-diagonal residuals to 0
+                    TmS_EigVal.m[m][n]=0;
+                    TmS_EigVal_inv.m[m][n]=0;
+                }
+            }
+        }
 
-    int *maskPtr = &mask[0];
+        mat33 TmS_EigVec_trans=reg_mat33_trans(TmS_EigVec);
+        invP= TmS_EigVec * TmS_EigVal_inv * TmS_EigVec_trans;
+        currentDeterminant = TmS_EigVal.m[0][0]*TmS_EigVal.m[1][1]*TmS_EigVal.m[2][2];
+        currentDeterminant=currentDeterminant<0.000001f?0.000001f:currentDeterminant;
+    }
+    else{
 
-    mat44 *floatingIJKMatrix;
-    if(floatingImage->sform_code>0)
-        floatingIJKMatrix=&(floatingImage->sto_ijk);
-    else floatingIJKMatrix=&(floatingImage->qto_ijk);
-    mat44 *warpedMatrix = &(warpedImage->qto_xyz);
-    if(warpedImage->sform_code>0)
-        warpedMatrix = &(warpedImage->sto_xyz);
-    mat44 *floatingMatrix = &(floatingImage->qto_xyz);
-    if(floatingImage->sform_code>0)
-        floatingMatrix = &(floatingImage->sto_xyz);
+        A=nifti_mat33_inverse(jacobian);
 
-    float fwhmToStd=2.355f;
-    // T is the reference PSF and S is the floating PSF
-    mat33 T, S;
-    for(int j=0; j<3; j++){
-        for(int i=0; i<3; i++){
-            T.m[i][j]=0;
-            S.m[i][j]=0;
+        ASAt =  A * S * reg_mat33_trans(A);
+
+        mat33 S_EigVec, S_EigVal;
+
+        //                % rotate S
+        //                [ZS, DS] = eig(S);
+        reg_mat33_diagonalize(&ASAt, &S_EigVec, &S_EigVal);
+
+        //                T1 = ZS'*T*ZS;
+        mat33 T1 = reg_mat33_trans(S_EigVec) * T * S_EigVec;
+
+        //                % Volume-preserving scale of S to make it isotropic
+        //                detS = prod(diag(DS));
+        float detASAt = S_EigVal.m[0][0]*S_EigVal.m[1][1]*S_EigVal.m[2][2];
+
+        //                factDetS = detS^(1/4);
+        float factDetS=powf(detASAt,0.25);
+
+        //                LambdaN = factDetS*diag(diag(DS).^(-1/2));
+        //                invLambdaN = diag(1./diag(LambdaN))
+        mat33 LambdaN,invLambdaN;
+        for(int m=0;m<3;m++){
+            for(int n=0;n<3;n++){
+                if(m==n){
+                    LambdaN.m[m][n]=factDetS*powf(S_EigVal.m[m][n],-0.5);
+                    invLambdaN.m[m][n]=1.0f/LambdaN.m[m][n];
+                }else{ // Set off-diagonal to 0
+                    LambdaN.m[m][n]=0;
+                    invLambdaN.m[m][n]=0;
+                }
+            }
         }
-    }
+
+        //                T2 = LambdaN*T1*LambdaN';
+        mat33 T2 = LambdaN * T1 * reg_mat33_trans(LambdaN);
+
+        //                % Rotate to make thing axis-aligned
+        //                [ZT2, DT2] = eig(T2);
+        mat33 T2_EigVec, T2_EigVal;
+        reg_mat33_diagonalize(&T2, &T2_EigVec, &T2_EigVal);
+
+        //                % Optimal solution in the transformed axis-aligned space
+        //                DP2 = diag(max(sqrt(detS),diag(DT2)));
+        mat33 DP2;
+        for(int m=0;m<3;m++){
+            for(int n=0;n<3;n++){
+                if(m==n){
+                    DP2.m[m][n]= powf(factDetS,0.5)>(T2_EigVal.m[m][n])?powf(factDetS,0.5):(T2_EigVal.m[m][n]);
+                }else{ // Set off-diagonal to 0
+                    DP2.m[m][n]=0;
+                }
+            }
+        }
+
+        //                % Roll back the transforms
+        //                Q = ZS*invLambdaN*ZT2*DQ2*ZT2'*invLambdaN*ZS'
+        mat33 Q = S_EigVec * invLambdaN * T2_EigVec * DP2 * reg_mat33_trans(T2_EigVec) * invLambdaN * reg_mat33_trans(S_EigVec);
+        //                P=Q-S
+        TmS = Q - S;
+        invP=nifti_mat33_inverse(TmS);
+        reg_mat33_diagonalize(&TmS, &TmS_EigVec, &TmS_EigVal);
+
+        currentDeterminant = TmS_EigVal.m[0][0]*TmS_EigVal.m[1][1]*TmS_EigVal.m[2][2];
+        currentDeterminant=currentDeterminant<0.000001f?0.000001f:currentDeterminant;
+    }
+}
+/* *************************************************************** */
+/** Discretisation of a PSF in its eigen space. The samples are spaced by
+ * 0.75 standard deviation and only the samples within 3 standard deviations
+ * are kept.
+ */
+void reg_getPSFSamples(const mat33 &TmS_EigVec,
+                       const mat33 &TmS_EigVal,
+                       const mat33 &invP,
+                       float currentDeterminant,
+                       const float *warpedSpacing,
+                       std::vector<reg_psfSample> &samples)
+{
+    samples.clear();
+
+    // set sampling rate
+    float psfNumbSamples=3; // in standard deviations mm
+    float psfSampleSpacing=0.75; // in standard deviations mm
+    float psfKernelShift[3];
+    psfKernelShift[0]=TmS_EigVal.m[0][0]<0.01f?0.0f:(float)(psfNumbSamples)*psfSampleSpacing;
+    psfKernelShift[1]=TmS_EigVal.m[1][1]<0.01f?0.0f:(float)(psfNumbSamples)*psfSampleSpacing;
+    psfKernelShift[2]=TmS_EigVal.m[2][2]<0.01f?0.0f:(float)(psfNumbSamples)*psfSampleSpacing;
+
+    float psf_eig[3], psf_xyz[3], curLambda, mahal;
+    reg_psfSample sample;
+    // coordinates in eigen space
+    for(psf_eig[0]=-psfKernelShift[0];psf_eig[0]<=(psfKernelShift[0]); psf_eig[0]+=psfSampleSpacing)
+    {
+        for(psf_eig[1]=-psfKernelShift[1];psf_eig[1]<=(psfKernelShift[1]); psf_eig[1]+=psfSampleSpacing)
+        {
+            for(psf_eig[2]=-psfKernelShift[2];psf_eig[2]<=(psfKernelShift[2]); psf_eig[2]+=psfSampleSpacing)
+            {
+                // Distance threshold (only interpolate if distance is below 3 std)
+                if(sqrtf(psf_eig[0]*psf_eig[0]+psf_eig[1]*psf_eig[1]+psf_eig[2]*psf_eig[2])<=3){
+                    // Use the Eigen coordinates and convert them to XYZ
+                    // The new lambda per coordinate is eige_coordinate*sqrt(eigenVal)
+                    // as the sqrt(eigenVal) is equivalent to the STD
+                    psf_xyz[0]=0;
+                    psf_xyz[1]=0;
+                    psf_xyz[2]=0;
+                    for(int m=0;m<3;m++){
+                        curLambda=(float)(psf_eig[m])*sqrt(TmS_EigVal.m[m][m]);
+                        psf_xyz[0]+=curLambda*TmS_EigVec.m[0][m];
+                        psf_xyz[1]+=curLambda*TmS_EigVec.m[1][m];
+                        psf_xyz[2]+=curLambda*TmS_EigVec.m[2][m];
+                    }
+
+                    mahal=psf_xyz[0]*invP.m[0][0]*psf_xyz[0]+
+                            psf_xyz[0]*invP.m[1][0]*psf_xyz[1]+
+                            psf_xyz[0]*invP.m[2][0]*psf_xyz[2]+
+                            psf_xyz[1]*invP.m[0][1]*psf_xyz[0]+
+                            psf_xyz[1]*invP.m[1][1]*psf_xyz[1]+
+                            psf_xyz[1]*invP.m[2][1]*psf_xyz[2]+
+                            psf_xyz[2]*invP.m[0][2]*psf_xyz[0]+
+                            psf_xyz[2]*invP.m[1][2]*psf_xyz[1]+
+                            psf_xyz[2]*invP.m[2][2]*psf_xyz[2];
+
+                    sample.weight=powf(2.f*M_PI,-3.f/2.f)*
+                            pow(currentDeterminant,-0.5f)*
+                            expf(-0.5f*mahal);
+
+                    if(sample.weight!=0.f){ // If the relative weight is above 0
+                        sample.shift[0]=psf_xyz[0]/warpedSpacing[0];
+                        sample.shift[1]=psf_xyz[1]/warpedSpacing[1];
+                        sample.shift[2]=psf_xyz[2]/warpedSpacing[2];
+                        samples.push_back(sample);
+                    }
+                }
+            }
+        }
+    }
+}
+/* *************************************************************** */
+/** PSF weighted interpolation of one floating volume around a warped voxel.
+ * The deformation field is trilinearly interpolated at every PSF sample
+ * and the floating image is interpolated at the corresponding positions.
+ */
+template<class FloatingTYPE, class FieldTYPE>
+double reg_applyPSFSamples(const std::vector<reg_psfSample> &samples,
+                           const int *currentVoxel,
+                           const int *warpedDim,
+                           const FieldTYPE *deformationFieldPtrX,
+                           const FieldTYPE *deformationFieldPtrY,
+                           const FieldTYPE *deformationFieldPtrZ,
+                           const FloatingTYPE *floatingIntensity,
+                           const int *floatingDim,
+                           const mat44 *floatingIJKMatrix,
+                           void (*kernelCompFctPtr)(double,double *),
+                           int kernel_size,
+                           int kernel_offset,
+                           double paddingValue)
+{
+    size_t warpedLineNumber = (size_t)warpedDim[0];
+    size_t warpedPlaneNumber = (size_t)warpedDim[0]*warpedDim[1];
+    size_t floatingPlaneNumber = (size_t)floatingDim[0]*floatingDim[1];
+
+    double xBasis[SINC_KERNEL_SIZE], yBasis[SINC_KERNEL_SIZE], zBasis[SINC_KERNEL_SIZE], relative[3];
+    double xTempNewValue, yTempNewValue, psfIntensity, psfWorld[3], position[3];
+    int Y, Z, previous[3], currentPre[3];
+    float currentRel[3], resamplingWeightSum, resamplingWeight, psfWeightSum=0.0f;
+    size_t currentIndex;
+    const FloatingTYPE *zPointer, *xyzPointer;
+
+    double intensity=0.0;
+    for(size_t s=0; s<samples.size(); ++s)
+    {
+        const reg_psfSample &sample = samples[s];
+        // Interpolate (trilinearly) the deformation field for non-integer positions
+        for(int i=0; i<3; ++i)
+        {
+            currentPre[i]=currentVoxel[i]+static_cast<int>(reg_floor(sample.shift[i]));
+            currentRel[i]=(float)currentVoxel[i]+sample.shift[i]-(float)(currentPre[i]);
+        }
+
+        // Interpolate the PSF world coordinates
+        psfWorld[0]=0.0f;
+        psfWorld[1]=0.0f;
+        psfWorld[2]=0.0f;
+        resamplingWeightSum=0.0f;
+        for (int a=0;a<=1;a++){
+            for (int b=0;b<=1;b++){
+                for (int c=0;c<=1;c++){
+
+                    if((currentPre[0]+a)>=0
+                            && (currentPre[1]+b)>=0
+                            && (currentPre[2]+c)>=0
+                            && (currentPre[0]+a)<warpedDim[0]
+                            && (currentPre[1]+b)<warpedDim[1]
+                            && (currentPre[2]+c)<warpedDim[2]){
+
+                        currentIndex=((size_t)currentPre[0]+(size_t)a)+
+                                ((size_t)currentPre[1]+(size_t)b)*warpedLineNumber+
+                                ((size_t)currentPre[2]+(size_t)c)*warpedPlaneNumber;
+
+                        resamplingWeight=fabs((float)(1-a)-currentRel[0])*
+                                fabs((float)(1-b)-currentRel[1])*
+                                fabs((float)(1-c)-currentRel[2]);
+
+                        resamplingWeightSum+=resamplingWeight;
+
+                        psfWorld[0]+=static_cast<double>(resamplingWeight*deformationFieldPtrX[currentIndex]);
+                        psfWorld[1]+=static_cast<double>(resamplingWeight*deformationFieldPtrY[currentIndex]);
+                        psfWorld[2]+=static_cast<double>(resamplingWeight*deformationFieldPtrZ[currentIndex]);
+                    }
+                }
+            }
+        }
+
+        if(resamplingWeightSum>0.0f){
+            psfWorld[0]/=resamplingWeightSum;
+            psfWorld[1]/=resamplingWeightSum;
+            psfWorld[2]/=resamplingWeightSum;
+
+            // real -> voxel; floating space
+            reg_mat44_mul(floatingIJKMatrix, psfWorld, position);
+
+            previous[0] = static_cast<int>(reg_floor(position[0]));
+            previous[1] = static_cast<int>(reg_floor(position[1]));
+            previous[2] = static_cast<int>(reg_floor(position[2]));
+
+            relative[0]=position[0]-static_cast<double>(previous[0]);
+            relative[1]=position[1]-static_cast<double>(previous[1]);
+            relative[2]=position[2]-static_cast<double>(previous[2]);
+
+            (*kernelCompFctPtr)(relative[0], xBasis);
+            (*kernelCompFctPtr)(relative[1], yBasis);
+            (*kernelCompFctPtr)(relative[2], zBasis);
+            previous[0]-=kernel_offset;
+            previous[1]-=kernel_offset;
+            previous[2]-=kernel_offset;
+
+            psfIntensity=0.0;
+            for(int c=0; c<kernel_size; c++)
+            {
+                Z= previous[2]+c;
+                zPointer = &floatingIntensity[Z*floatingPlaneNumber];
+                yTempNewValue=0.0;
+                for(int b=0; b<kernel_size; b++)
+                {
+                    Y= previous[1]+b;
+                    xyzPointer = &zPointer[Y*floatingDim[0]+previous[0]];
+                    xTempNewValue=0.0;
+                    for(int a=0; a<kernel_size; a++)
+                    {
+                        if(-1<(previous[0]+a) && (previous[0]+a)<floatingDim[0] &&
+                                -1<Z && Z<floatingDim[2] &&
+                                -1<Y && Y<floatingDim[1])
+                        {
+                            xTempNewValue +=  static_cast<double>(*xyzPointer) * xBasis[a];
+                        }
+                        else
+                        {
+                            // paddingValue
+                            if(!(paddingValue!=paddingValue))// paddingValue
+                                xTempNewValue +=  paddingValue * xBasis[a];
+                        }
+                        xyzPointer++;
+                    }
+                    yTempNewValue += xTempNewValue * yBasis[b];
+                }
+                psfIntensity += yTempNewValue * zBasis[c];
+            }
+            if(!(psfIntensity!=psfIntensity)){
+                intensity+=sample.weight*psfIntensity;
+                psfWeightSum+=sample.weight;
+            }
+        }
+    }
+    if(psfWeightSum>0){
+        intensity/=psfWeightSum;
+    }
+    else{
+        intensity=paddingValue;
+    }
+    return intensity;
+}
+/* *************************************************************** */
+/** Quantised Jacobian matrix used to cache the PSF in the fast mode */
+#define REG_PSF_JACOBIAN_STEP 0.01f
+struct reg_psfKey
+{
+    int value[9];
+    bool operator<(const reg_psfKey &other) const
+    {
+        for(int i=0; i<9; ++i)
+        {
+            if(this->value[i]!=other.value[i])
+                return this->value[i]<other.value[i];
+        }
+        return false;
+    }
+};
+/* *************************************************************** */
+/** Fast PSF resampling when all the voxels share the same Jacobian matrix,
+ * i.e. with an affine transformation, and the PSF expressed in the floating
+ * voxel space is axis-aligned. The floating image is then convolved with a
+ * separable Gaussian kernel, using three 1D passes, before being resampled.
+ * False is returned, and nothing is done, when these conditions are not met.
+ */
+template<class FloatingTYPE, class FieldTYPE>
+bool ResampleImage3D_PSF_Separable(nifti_image *floatingImage,
+                                   nifti_image *deformationField,
+                                   nifti_image *warpedImage,
+                                   int *mask,
+                                   FieldTYPE paddingValue,
+                                   int kernel,
+                                   mat33 *jacMat,
+                                   char algorithm,
+                                   const mat33 &T,
+                                   const mat33 &S)
+{
+    size_t warpedVoxelNumber = (size_t)warpedImage->nx*warpedImage->ny*warpedImage->nz;
+
+    // Check that the Jacobian matrix is constant over the active voxels
+    size_t firstVoxel=0;
+    while(firstVoxel<warpedVoxelNumber && mask[firstVoxel]<0) ++firstVoxel;
+    if(firstVoxel==warpedVoxelNumber)
+        return false;
+    const mat33 &jacobian = jacMat[firstVoxel];
+    float tolerance=0.f;
+    for(int i=0; i<3; ++i)
+        for(int j=0; j<3; ++j)
+            tolerance=std::max(tolerance, fabsf(jacobian.m[i][j]));
+    tolerance *= 1.e-4f;
+    for(size_t index=firstVoxel; index<warpedVoxelNumber; ++index)
+    {
+        if(mask[index]<0) continue;
+        for(int i=0; i<3; ++i)
+            for(int j=0; j<3; ++j)
+                if(fabsf(jacMat[index].m[i][j]-jacobian.m[i][j])>tolerance)
+                    return false;
+    }
+
+    // Covariance of the PSF in the reference space. Only the eigen
+    // directions that are sampled in the exact path are considered
+    mat33 TmS_EigVec, TmS_EigVal, invP;
+    float currentDeterminant;
+    reg_getPSFCovariance(jacobian, T, S, algorithm, TmS_EigVec, TmS_EigVal, invP, currentDeterminant);
+    mat33 P;
+    for(int i=0; i<3; ++i){
+        for(int j=0; j<3; ++j){
+            P.m[i][j]=0;
+            for(int m=0; m<3; ++m){
+                if(TmS_EigVal.m[m][m]>=0.01f)
+                    P.m[i][j] += TmS_EigVec.m[i][m]*TmS_EigVal.m[m][m]*TmS_EigVec.m[j][m];
+            }
+        }
+    }
+
+    // Derivative of the floating voxel position with respect to the warped
+    // voxel position, scaled to map the PSF from mm to floating voxel. It
+    // is estimated between the first and last voxels along each axis, the
+    // exact path being used if an axis contains a single voxel
+    for(int j=0; j<3; ++j)
+        if(warpedImage->dim[j+1]<2)
+            return false;
+    FieldTYPE *deformationFieldPtr = static_cast<FieldTYPE *>(deformationField->data);
+    mat44 *floatingIJKMatrix;
+    if(floatingImage->sform_code>0)
+        floatingIJKMatrix=&(floatingImage->sto_ijk);
+    else floatingIJKMatrix=&(floatingImage->qto_ijk);
+    size_t lastVoxel[3]={(size_t)warpedImage->nx-1,
+                         ((size_t)warpedImage->ny-1)*warpedImage->nx,
+                         ((size_t)warpedImage->nz-1)*warpedImage->nx*warpedImage->ny};
+    mat33 K;
+    for(int j=0; j<3; ++j){
+        for(int i=0; i<3; ++i){
+            K.m[i][j]=0;
+            for(int k=0; k<3; ++k){
+                double delta = (static_cast<double>(deformationFieldPtr[k*warpedVoxelNumber+lastVoxel[j]]) -
+                                static_cast<double>(deformationFieldPtr[k*warpedVoxelNumber])) /
+                        static_cast<double>(warpedImage->dim[j+1]-1);
+                K.m[i][j] += floatingIJKMatrix->m[i][k] * delta;
+            }
+            K.m[i][j] /= warpedImage->pixdim[j+1];
+        }
+    }
+    mat33 C = K * P * reg_mat33_trans(K);
+
+    // The separable convolution is only used for an axis-aligned PSF
+    for(int i=0; i<3; ++i)
+        for(int j=i+1; j<3; ++j)
+            if(fabsf(C.m[i][j]) > 1.e-2f * sqrtf(fabsf(C.m[i][i]*C.m[j][j])) + 1.e-6f)
+                return false;
+
+#ifndef NDEBUG
+    char text[255];
+    sprintf(text, "Separable PSF with standard deviations [%g %g %g] floating voxels",
+            sqrtf(C.m[0][0]), sqrtf(C.m[1][1]), sqrtf(C.m[2][2]));
+    reg_print_msg_debug(text);
+#endif
+
+    // The floating image is converted to float and smoothed axis by axis
+    nifti_image *smoothedFloating = nifti_copy_nim_info(floatingImage);
+    smoothedFloating->data = (void *)malloc(smoothedFloating->nvox*smoothedFloating->nbyper);
+    memcpy(smoothedFloating->data, floatingImage->data, smoothedFloating->nvox*smoothedFloating->nbyper);
+    reg_tools_changeDatatype<float>(smoothedFloating);
+    float *sigma = new float[smoothedFloating->nt*smoothedFloating->nu];
+    for(int n=0; n<3; ++n){
+        bool axis[3]={false, false, false};
+        axis[n]=true;
+        // negative values are interpreted as a number of voxels
+        for(int t=0; t<smoothedFloating->nt*smoothedFloating->nu; ++t)
+            sigma[t] = -sqrtf(C.m[n][n]);
+        reg_tools_kernelConvolution(smoothedFloating, sigma, GAUSSIAN_KERNEL, NULL, NULL, axis);
+    }
+    delete []sigma;
+
+    nifti_image *smoothedWarped = nifti_copy_nim_info(warpedImage);
+    smoothedWarped->datatype = NIFTI_TYPE_FLOAT32;
+    smoothedWarped->nbyper = sizeof(float);
+    smoothedWarped->data = (void *)malloc(smoothedWarped->nvox*smoothedWarped->nbyper);
+    reg_resampleImage(smoothedFloating,
+                      smoothedWarped,
+                      deformationField,
+                      mask,
+                      kernel,
+                      paddingValue);
+
+    float *smoothedWarpedPtr = static_cast<float *>(smoothedWarped->data);
+    FloatingTYPE *warpedIntensityPtr = static_cast<FloatingTYPE *>(warpedImage->data);
+    for(size_t index=0; index<warpedImage->nvox; ++index)
+        warpedIntensityPtr[index] = reg_castPSFIntensity<FloatingTYPE>(smoothedWarpedPtr[index],
+                                                                       warpedImage->datatype);
+    nifti_image_free(smoothedFloating);
+    nifti_image_free(smoothedWarped);
+    return true;
+}
+/* *************************************************************** */
+template<class FloatingTYPE, class FieldTYPE>
+void ResampleImage3D_PSF(nifti_image *floatingImage,
+                         nifti_image *deformationField,
+                         nifti_image *warpedImage,
+                         int *mask,
+                         FieldTYPE paddingValue,
+                         int kernel,
+                         mat33 * jacMat,
+                         char algorithm,
+                         bool fastPSF)
+{
+#ifdef _WIN32
+    long index;
+    long warpedVoxelNumber = (long)warpedImage->nx*warpedImage->ny*warpedImage->nz;
+    long warpedPlaneNumber = (long)warpedImage->nx*warpedImage->ny;
+    long warpedLineNumber = (long)warpedImage->nx;
+    long floatingVoxelNumber = (long)floatingImage->nx*floatingImage->ny*floatingImage->nz;
+#else
+    size_t index;
+    size_t warpedVoxelNumber = (size_t)warpedImage->nx*warpedImage->ny*warpedImage->nz;
+    size_t warpedPlaneNumber = (size_t)warpedImage->nx*warpedImage->ny;
+    size_t warpedLineNumber = (size_t)warpedImage->nx;
+    size_t floatingVoxelNumber = (size_t)floatingImage->nx*floatingImage->ny*floatingImage->nz;
+#endif
+    FloatingTYPE *floatingIntensityPtr = static_cast<FloatingTYPE *>(floatingImage->data);
+    FloatingTYPE *warpedIntensityPtr = static_cast<FloatingTYPE *>(warpedImage->data);
+    FieldTYPE *deformationFieldPtrX = static_cast<FieldTYPE *>(deformationField->data);
+    FieldTYPE *deformationFieldPtrY = &deformationFieldPtrX[warpedVoxelNumber];
+    FieldTYPE *deformationFieldPtrZ = &deformationFieldPtrY[warpedVoxelNumber];
+
+    int *maskPtr = &mask[0];
+
+    mat44 *floatingIJKMatrix;
+    if(floatingImage->sform_code>0)
+        floatingIJKMatrix=&(floatingImage->sto_ijk);
+    else floatingIJKMatrix=&(floatingImage->qto_ijk);
+    mat44 *warpedMatrix = &(warpedImage->qto_xyz);
+    if(warpedImage->sform_code>0)
+        warpedMatrix = &(warpedImage->sto_xyz);
+    mat44 *floatingMatrix = &(floatingImage->qto_xyz);
+    if(floatingImage->sform_code>0)
+        floatingMatrix = &(floatingImage->sto_xyz);
+
+    float fwhmToStd=2.355f;
+    // T is the reference PSF and S is the floating PSF
+    mat33 T, S;
+    for(int j=0; j<3; j++){
+        for(int i=0; i<3; i++){
+            T.m[i][j]=0;
+            S.m[i][j]=0;
+        }
+    }
     for(int j=0; j<3; j++){
         for(int i=0; i<3; i++){
             T.m[j][j] += reg_pow2(warpedMatrix->m[i][j]);
@@ -1402,7 +2612,7 @@ void ResampleImage3D_PSF(nifti_image *floatingImage,
         break; // linear interpolation
     case 4:
         kernel_size=SINC_KERNEL_SIZE;
-        kernelCompFctPtr=&interpWindowedSincKernel;
+        kernelCompFctPtr=&interpWindowedSincKernel_LUT;
         kernel_offset=SINC_KERNEL_RADIUS;
         break; // sinc interpolation
     default:
@@ -1412,357 +2622,126 @@ void ResampleImage3D_PSF(nifti_image *floatingImage,
         break; // cubic spline interpolation
     }
 
-    // Iteration over the different volume along the 4th axis
-    for(size_t t=0; t<(size_t)warpedImage->nt*warpedImage->nu; t++)
+    // With an affine transformation, the PSF can be applied as a separable convolution
+    if(fastPSF && ResampleImage3D_PSF_Separable<FloatingTYPE,FieldTYPE>(floatingImage,
+                                                                         deformationField,
+                                                                         warpedImage,
+                                                                         mask,
+                                                                         paddingValue,
+                                                                         kernel,
+                                                                         jacMat,
+                                                                         algorithm,
+                                                                         T,
+                                                                         S))
+        return;
+
+    float warpedSpacing[3]={warpedImage->pixdim[1], warpedImage->pixdim[2], warpedImage->pixdim[3]};
+    int warpedDim[3]={warpedImage->nx, warpedImage->ny, warpedImage->nz};
+    int floatingDim[3]={floatingImage->nx, floatingImage->ny, floatingImage->nz};
+    size_t volumeNumber = (size_t)warpedImage->nt*warpedImage->nu;
+    double padding = static_cast<double>(paddingValue);
+    int datatype = floatingImage->datatype;
+
+    // In the fast mode, the PSF are cached per quantised Jacobian matrix
+    std::vector< std::vector<reg_psfSample> > psfCache;
+    int *psfIndex = NULL;
+    if(fastPSF)
     {
+        psfIndex = (int *)malloc(warpedVoxelNumber*sizeof(int));
+        std::map<reg_psfKey,int> psfMap;
+        reg_psfKey key;
+        mat33 quantisedJacobian, TmS_EigVec, TmS_EigVal, invP;
+        float currentDeterminant;
+        for(index=0; index<warpedVoxelNumber; index++)
+        {
+            psfIndex[index]=-1;
+            if(maskPtr[index]<0) continue;
+            for(int i=0; i<3; ++i)
+                for(int j=0; j<3; ++j)
+                    key.value[3*i+j]=static_cast<int>(reg_round(jacMat[index].m[i][j]/REG_PSF_JACOBIAN_STEP));
+            std::map<reg_psfKey,int>::iterator it = psfMap.find(key);
+            if(it!=psfMap.end())
+            {
+                psfIndex[index]=it->second;
+                continue;
+            }
+            // The PSF is estimated from the quantised matrix so that it does
+            // not depend on the first voxel that falls in the bin
+            for(int i=0; i<3; ++i)
+                for(int j=0; j<3; ++j)
+                    quantisedJacobian.m[i][j]=static_cast<float>(key.value[3*i+j])*REG_PSF_JACOBIAN_STEP;
+            reg_getPSFCovariance(quantisedJacobian, T, S, algorithm,
+                                 TmS_EigVec, TmS_EigVal, invP, currentDeterminant);
+            psfCache.push_back(std::vector<reg_psfSample>());
+            reg_getPSFSamples(TmS_EigVec, TmS_EigVal, invP, currentDeterminant,
+                              warpedSpacing, psfCache.back());
+            psfIndex[index]=static_cast<int>(psfCache.size())-1;
+            psfMap[key]=psfIndex[index];
+        }
 #ifndef NDEBUG
         char text[255];
-        sprintf(text,"PSF 3D resampling of volume number %zu\n",t);
+        sprintf(text, "%zu PSF estimated for %zu voxels", psfCache.size(), (size_t)warpedVoxelNumber);
         reg_print_msg_debug(text);
 #endif
+    }
 
-        FloatingTYPE *warpedIntensity = &warpedIntensityPtr[t*warpedVoxelNumber];
-        FloatingTYPE *floatingIntensity = &floatingIntensityPtr[t*floatingVoxelNumber];
-
-        double xBasis[SINC_KERNEL_SIZE], yBasis[SINC_KERNEL_SIZE], zBasis[SINC_KERNEL_SIZE], relative[3];
-        int Y, Z, previous[3];
-
-        float psf_xyz[3];
-
-        mat33 P, invP, ASAt, A,TmS,TmS_EigVec,TmS_EigVec_trans,TmS_EigVal,TmS_EigVal_inv;
-        float currentDeterminant, psfKernelShift[3], psfSampleSpacing, psfWeightSum,curLambda;
-        float psfNumbSamples;
-
-        FloatingTYPE *zPointer, *xyzPointer;
-        double xTempNewValue, yTempNewValue, intensity, psfIntensity, psfWorld[3], position[3];
-        size_t currentA, currentB, currentC, currentAPre, currentBPre, currentCPre;
-        float  psf_eig[3],  mahal, psfWeight;
-        float currentARel, currentBRel, currentCRel, resamplingWeightSum, resamplingWeight;
-        size_t currentIndex;
-
-        for(index=0; index<warpedVoxelNumber; index++)
+    // The PSF only depends on the voxel, it is thus estimated once for all volumes
+    int currentVoxel[3];
+    size_t t;
+    double intensity;
+    std::vector<reg_psfSample> psfSamples;
+    mat33 TmS_EigVec, TmS_EigVal, invP;
+    float currentDeterminant;
+#if defined (_OPENMP)
+#pragma omp parallel for default(none) \
+    private(index, t, currentVoxel, intensity, psfSamples, TmS_EigVec, TmS_EigVal, invP, currentDeterminant) \
+    shared(warpedVoxelNumber, warpedPlaneNumber, warpedLineNumber, floatingVoxelNumber, maskPtr, \
+    fastPSF, psfIndex, psfCache, jacMat, T, S, algorithm, warpedSpacing, warpedDim, floatingDim, \
+    deformationFieldPtrX, deformationFieldPtrY, deformationFieldPtrZ, floatingIntensityPtr, \
+    warpedIntensityPtr, floatingIJKMatrix, kernelCompFctPtr, kernel_size, kernel_offset, \
+    padding, volumeNumber, datatype)
+#endif // _OPENMP
+    for(index=0; index<warpedVoxelNumber; index++)
+    {
+        if(maskPtr[index]<0)
         {
-            intensity=paddingValue;
-
-            if((maskPtr[index])>-1)
-            {
-                if(algorithm==0){
-
-                    // T=P+A*S*At
-                    A=nifti_mat33_inverse(jacMat[index]);
-
-                    ASAt = A * S * reg_mat33_trans(A);
-
-                    TmS = T - ASAt;
-                    //reg_mat33_disp(&TmS, "matTmS");
-
-                    reg_mat33_diagonalize(&TmS, &TmS_EigVec, &TmS_EigVal);
-
-                    // If eigen values are less than 0, set them to 0.
-                    // Also, invert the eigenvalues to estimate the inverse.
-                    for(int m=0;m<3;m++){
-                        for(int n=0;n<3;n++){
-                            if(m==n){ // Set diagonals to max(val,0)
-                                TmS_EigVal.m[m][n]=TmS_EigVal.m[m][n]>0.000001f?TmS_EigVal.m[m][n]:0.000001f;
-                                TmS_EigVal_inv.m[m][n]=1.0f/TmS_EigVal.m[m][n];
-                            }else{ // Set off-diagonal residuals to 0
-                                TmS_EigVal.m[m][n]=0;
-                                TmS_EigVal_inv.m[m][n]=0;
-                            }
-                        }
-                    }
-
-                    TmS_EigVec_trans=reg_mat33_trans(TmS_EigVec);
-                    P= TmS_EigVec * TmS_EigVal * TmS_EigVec_trans;
-                    invP= TmS_EigVec * TmS_EigVal_inv * TmS_EigVec_trans;
-                    currentDeterminant = TmS_EigVal.m[0][0]*TmS_EigVal.m[1][1]*TmS_EigVal.m[2][2];
-                    currentDeterminant=currentDeterminant<0.000001f?0.000001f:currentDeterminant;
-                }
-                else{
-
-                    A=nifti_mat33_inverse(jacMat[index]);
-
-                    ASAt =  A * S * reg_mat33_trans(A);
-
-                    mat33 S_EigVec, S_EigVal;
-
-                    //                % rotate S
-                    //                [ZS, DS] = eig(S);
-                    reg_mat33_diagonalize(&ASAt, &S_EigVec, &S_EigVal);
-
-                    //                T1 = ZS'*T*ZS;
-                    mat33 T1 = reg_mat33_trans(S_EigVec) * T * S_EigVec;
-
-                    //                % Volume-preserving scale of S to make it isotropic
-                    //                detS = prod(diag(DS));
-                    float detASAt = S_EigVal.m[0][0]*S_EigVal.m[1][1]*S_EigVal.m[2][2];
-
-                    //                factDetS = detS^(1/4);
-                    float factDetS=powf(detASAt,0.25);
-
-                    //                LambdaN = factDetS*diag(diag(DS).^(-1/2));
-                    //                invLambdaN = diag(1./diag(LambdaN))
-                    mat33 LambdaN,invLambdaN;
-                    for(int m=0;m<3;m++){
-                        for(int n=0;n<3;n++){
-                            if(m==n){
-                                LambdaN.m[m][n]=factDetS*powf(S_EigVal.m[m][n],-0.5);
-                                invLambdaN.m[m][n]=1.0f/LambdaN.m[m][n];
-                            }else{ // Set off-diagonal to 0
-                                LambdaN.m[m][n]=0;
-                                invLambdaN.m[m][n]=0;
-                            }
-                        }
-                    }
-
-                    //                T2 = LambdaN*T1*LambdaN';
-                    mat33 T2 = LambdaN * T1 * reg_mat33_trans(LambdaN);
-
-                    //                % Rotate to make thing axis-aligned
-                    //                [ZT2, DT2] = eig(T2);
-                    mat33 T2_EigVec, T2_EigVal;
-                    reg_mat33_diagonalize(&T2, &T2_EigVec, &T2_EigVal);
-
-                    //                % Optimal solution in the transformed axis-aligned space
-                    //                DP2 = diag(max(sqrt(detS),diag(DT2)));
-                    mat33 DP2;
-                    for(int m=0;m<3;m++){
-                        for(int n=0;n<3;n++){
-                            if(m==n){
-                                DP2.m[m][n]= powf(factDetS,0.5)>(T2_EigVal.m[m][n])?powf(factDetS,0.5):(T2_EigVal.m[m][n]);
-                            }else{ // Set off-diagonal to 0
-                                DP2.m[m][n]=0;
-                            }
-                        }
-                    }
-
-                    //                % Roll back the transforms
-                    //                Q = ZS*invLambdaN*ZT2*DQ2*ZT2'*invLambdaN*ZS'
-                    mat33 Q = S_EigVec * invLambdaN * T2_EigVec * DP2 * reg_mat33_trans(T2_EigVec) * invLambdaN * reg_mat33_trans(S_EigVec);
-                    //                P=Q-S
-                    TmS = Q - S;
-                    invP=nifti_mat33_inverse(TmS);
-                    reg_mat33_diagonalize(&TmS, &TmS_EigVec, &TmS_EigVal);
-
-                    currentDeterminant = TmS_EigVal.m[0][0]*TmS_EigVal.m[1][1]*TmS_EigVal.m[2][2];
-                    currentDeterminant=currentDeterminant<0.000001f?0.000001f:currentDeterminant;
-                }
-
-                // set sampling rate
-                psfNumbSamples=3; // in standard deviations mm
-                psfSampleSpacing=0.75; // in standard deviations mm
-                psfKernelShift[0]=TmS_EigVal.m[0][0]<0.01f?0.0f:(float)(psfNumbSamples)*psfSampleSpacing;
-                psfKernelShift[1]=TmS_EigVal.m[1][1]<0.01f?0.0f:(float)(psfNumbSamples)*psfSampleSpacing;
-                psfKernelShift[2]=TmS_EigVal.m[2][2]<0.01f?0.0f:(float)(psfNumbSamples)*psfSampleSpacing;
-
-                // Get image coordinates of the centre
-                currentC=index/warpedPlaneNumber;
-                currentB=(index-currentC*warpedPlaneNumber)/warpedLineNumber;
-                currentA=(index-currentB*warpedLineNumber-currentC*warpedPlaneNumber);
-
-                //initialise weights
-                psfWeightSum=0.0f;
-                intensity=0.0f;
-
-                // coordinates in eigen space
-                for(psf_eig[0]=-psfKernelShift[0];psf_eig[0]<=(psfKernelShift[0]); psf_eig[0]+=psfSampleSpacing)
-                {
-                    for(psf_eig[1]=-psfKernelShift[1];psf_eig[1]<=(psfKernelShift[1]); psf_eig[1]+=psfSampleSpacing)
-                    {
-                        for(psf_eig[2]=-psfKernelShift[2];psf_eig[2]<=(psfKernelShift[2]); psf_eig[2]+=psfSampleSpacing)
-                        {
-                            // Distance threshold (only interpolate if distance is below 3 std)
-                            if(sqrtf(psf_eig[0]*psf_eig[0]+psf_eig[1]*psf_eig[1]+psf_eig[2]*psf_eig[2])<=3){
-                                // Use the Eigen coordinates and convert them to XYZ
-                                // The new lambda per coordinate is eige_coordinate*sqrt(eigenVal)
-                                // as the sqrt(eigenVal) is equivalent to the STD
-                                psf_xyz[0]=0;
-                                psf_xyz[1]=0;
-                                psf_xyz[2]=0;
-                                for(int m=0;m<3;m++){
-                                    curLambda=(float)(psf_eig[m])*sqrt(TmS_EigVal.m[m][m]);
-                                    psf_xyz[0]+=curLambda*TmS_EigVec.m[0][m];
-                                    psf_xyz[1]+=curLambda*TmS_EigVec.m[1][m];
-                                    psf_xyz[2]+=curLambda*TmS_EigVec.m[2][m];
-                                }
-
-                                //mahal=0;
-                                mahal=psf_xyz[0]*invP.m[0][0]*psf_xyz[0]+
-                                        psf_xyz[0]*invP.m[1][0]*psf_xyz[1]+
-                                        psf_xyz[0]*invP.m[2][0]*psf_xyz[2]+
-                                        psf_xyz[1]*invP.m[0][1]*psf_xyz[0]+
-                                        psf_xyz[1]*invP.m[1][1]*psf_xyz[1]+
-                                        psf_xyz[1]*invP.m[2][1]*psf_xyz[2]+
-                                        psf_xyz[2]*invP.m[0][2]*psf_xyz[0]+
-                                        psf_xyz[2]*invP.m[1][2]*psf_xyz[1]+
-                                        psf_xyz[2]*invP.m[2][2]*psf_xyz[2];
-
-                                psfWeight=powf(2.f*M_PI,-3.f/2.f)*
-                                        pow(currentDeterminant,-0.5f)*
-                                        expf(-0.5f*mahal);
-
-                                if(psfWeight!=0.f){ // If the relative weight is above 0
-                                    // Interpolate (trilinearly) the deformation field for non-integer positions
-                                    currentAPre=(size_t)(currentA+(size_t)reg_floor(psf_xyz[0]/(float)warpedImage->pixdim[1]));
-                                    currentARel=(float)currentA+(float)(psf_xyz[0]/(float)warpedImage->pixdim[1])-(float)(currentAPre);
-
-                                    currentBPre=(size_t)(currentB+(size_t)reg_floor(psf_xyz[1]/(float)warpedImage->pixdim[2]));
-                                    currentBRel=(float)currentB+(float)(psf_xyz[1]/(float)warpedImage->pixdim[2])-(float)(currentBPre);
-
-                                    currentCPre=(size_t)(currentC+(size_t)reg_floor(psf_xyz[2]/(float)warpedImage->pixdim[3]));
-                                    currentCRel=(float)currentC+(float)(psf_xyz[2]/(float)warpedImage->pixdim[3])-(float)(currentCPre);
-
-                                    // Interpolate the PSF world coordinates
-                                    psfWorld[0]=0.0f;
-                                    psfWorld[1]=0.0f;
-                                    psfWorld[2]=0.0f;
-                                    resamplingWeightSum=0.0f;
-                                    for (int a=0;a<=1;a++){
-                                        for (int b=0;b<=1;b++){
-                                            for (int c=0;c<=1;c++){
-
-                                                if(((int)currentAPre+a)>=0
-                                                        && ((int)currentBPre+b)>=0
-                                                        && ((int)currentCPre+c)>=0
-                                                        && ((int)currentAPre+a)<warpedImage->nx
-                                                        && ((int)currentBPre+b)<warpedImage->ny
-                                                        && ((int)currentCPre+c)<warpedImage->nz){
-
-                                                    currentIndex=((size_t)currentAPre+(size_t)a)+
-                                                            ((size_t)currentBPre+(size_t)b)*warpedLineNumber+
-                                                            ((size_t)currentCPre+(size_t)c)*warpedPlaneNumber;
-
-                                                    resamplingWeight=fabs((float)(1-a)-currentARel)*
-                                                            fabs((float)(1-b)-currentBRel)*
-                                                            fabs((float)(1-c)-currentCRel);
-
-                                                    resamplingWeightSum+=resamplingWeight;
-
-                                                    psfWorld[0]+=static_cast<double>(resamplingWeight*deformationFieldPtrX[currentIndex]);
-                                                    psfWorld[1]+=static_cast<double>(resamplingWeight*deformationFieldPtrY[currentIndex]);
-                                                    psfWorld[2]+=static_cast<double>(resamplingWeight*deformationFieldPtrZ[currentIndex]);
-                                                }
-                                            }
-                                        }
-                                    }
-
-                                    if(resamplingWeightSum>0.0f){
-                                        psfWorld[0]/=resamplingWeightSum;
-                                        psfWorld[1]/=resamplingWeightSum;
-                                        psfWorld[2]/=resamplingWeightSum;
-
-                                        // real -> voxel; floating space
-                                        reg_mat44_mul(floatingIJKMatrix, psfWorld, position);
-
-                                        previous[0] = static_cast<int>(reg_floor(position[0]));
-                                        previous[1] = static_cast<int>(reg_floor(position[1]));
-                                        previous[2] = static_cast<int>(reg_floor(position[2]));
-
-                                        relative[0]=position[0]-static_cast<double>(previous[0]);
-                                        relative[1]=position[1]-static_cast<double>(previous[1]);
-                                        relative[2]=position[2]-static_cast<double>(previous[2]);
+            for(t=0; t<volumeNumber; t++)
+                warpedIntensityPtr[t*warpedVoxelNumber+index]=reg_castPSFIntensity<FloatingTYPE>(padding, datatype);
+            continue;
+        }
+        if(!fastPSF)
+        {
+            reg_getPSFCovariance(jacMat[index], T, S, algorithm,
+                                 TmS_EigVec, TmS_EigVal, invP, currentDeterminant);
+            reg_getPSFSamples(TmS_EigVec, TmS_EigVal, invP, currentDeterminant,
+                              warpedSpacing, psfSamples);
+        }
+        const std::vector<reg_psfSample> &samples = fastPSF ? psfCache[psfIndex[index]] : psfSamples;
 
-                                        (*kernelCompFctPtr)(relative[0], xBasis);
-                                        (*kernelCompFctPtr)(relative[1], yBasis);
-                                        (*kernelCompFctPtr)(relative[2], zBasis);
-                                        previous[0]-=kernel_offset;
-                                        previous[1]-=kernel_offset;
-                                        previous[2]-=kernel_offset;
+        // Get image coordinates of the centre
+        currentVoxel[2]=index/warpedPlaneNumber;
+        currentVoxel[1]=(index-currentVoxel[2]*warpedPlaneNumber)/warpedLineNumber;
+        currentVoxel[0]=index-currentVoxel[1]*warpedLineNumber-currentVoxel[2]*warpedPlaneNumber;
 
-                                        psfIntensity=0.0;
-                                        for(int c=0; c<kernel_size; c++)
-                                        {
-                                            Z= previous[2]+c;
-                                            zPointer = &floatingIntensity[Z*floatingImage->nx*floatingImage->ny];
-                                            yTempNewValue=0.0;
-                                            for(int b=0; b<kernel_size; b++)
-                                            {
-                                                Y= previous[1]+b;
-                                                xyzPointer = &zPointer[Y*floatingImage->nx+previous[0]];
-                                                xTempNewValue=0.0;
-                                                for(int a=0; a<kernel_size; a++)
-                                                {
-                                                    if(-1<(previous[0]+a) && (previous[0]+a)<floatingImage->nx &&
-                                                            -1<Z && Z<floatingImage->nz &&
-                                                            -1<Y && Y<floatingImage->ny)
-                                                    {
-                                                        xTempNewValue +=  static_cast<double>(*xyzPointer) * xBasis[a];
-                                                    }
-                                                    else
-                                                    {
-                                                        // paddingValue
-                                                        if(!(paddingValue!=paddingValue))// paddingValue
-                                                            xTempNewValue +=  paddingValue * xBasis[a];
-                                                    }
-                                                    xyzPointer++;
-                                                }
-                                                yTempNewValue += xTempNewValue * yBasis[b];
-                                            }
-                                            psfIntensity += yTempNewValue * zBasis[c];
-                                        }
-                                        if(!(psfIntensity!=psfIntensity)){
-                                            intensity+=psfWeight*psfIntensity;
-                                            psfWeightSum+=psfWeight;
-                                        }
-                                    }
-                                }
-                            }
-                        }
-                    }
-                }
-                if(psfWeightSum>0){
-                    intensity/=psfWeightSum;
-                }
-                else{
-                    intensity=paddingValue;
-                }
-            } // if in mask
-            switch(floatingImage->datatype)
-            {
-            case NIFTI_TYPE_FLOAT32:
-                warpedIntensity[index]=static_cast<FloatingTYPE>(intensity);
-                break;
-            case NIFTI_TYPE_FLOAT64:
-                warpedIntensity[index]=intensity;
-                break;
-            case NIFTI_TYPE_UINT8:
-                if(intensity!=intensity)
-                    intensity=0;
-                intensity=(intensity<=255?reg_round(intensity):255); // 255=2^8-1
-                warpedIntensity[index]=static_cast<FloatingTYPE>(intensity>0?reg_round(intensity):0);
-                break;
-            case NIFTI_TYPE_UINT16:
-                if(intensity!=intensity)
-                    intensity=0;
-                intensity=(intensity<=65535?reg_round(intensity):65535); // 65535=2^16-1
-                warpedIntensity[index]=static_cast<FloatingTYPE>(intensity>0?reg_round(intensity):0);
-                break;
-            case NIFTI_TYPE_UINT32:
-                if(intensity!=intensity)
-                    intensity=0;
-                intensity=(intensity<=4294967295?reg_round(intensity):4294967295); // 4294967295=2^32-1
-                warpedIntensity[index]=static_cast<FloatingTYPE>(intensity>0?reg_round(intensity):0);
-                break;
-            case NIFTI_TYPE_INT16:
-                if(intensity!=intensity)
-                    intensity=0;
-                intensity=(intensity<=32767?reg_round(intensity):32767); // 32767=2^15-1
-                warpedIntensity[index]=static_cast<FloatingTYPE>(intensity);
-                break;
-            case NIFTI_TYPE_INT32:
-                if(intensity!=intensity)
-                    intensity=0;
-                intensity=(intensity<=2147483647?reg_round(intensity):2147483647); // 2147483647=2^31-1
-                warpedIntensity[index]=static_cast<FloatingTYPE>(intensity);
-                break;
-            default:
-                if(intensity!=intensity)
-                    intensity=0;
-                warpedIntensity[index]=static_cast<FloatingTYPE>(reg_round(intensity));
-                break;
-            }
+        for(t=0; t<volumeNumber; t++)
+        {
+            intensity=reg_applyPSFSamples<FloatingTYPE,FieldTYPE>(samples,
+                                                                  currentVoxel,
+                                                                  warpedDim,
+                                                                  deformationFieldPtrX,
+                                                                  deformationFieldPtrY,
+                                                                  deformationFieldPtrZ,
+                                                                  &floatingIntensityPtr[t*floatingVoxelNumber],
+                                                                  floatingDim,
+                                                                  floatingIJKMatrix,
+                                                                  kernelCompFctPtr,
+                                                                  kernel_size,
+                                                                  kernel_offset,
+                                                                  padding);
+            warpedIntensityPtr[t*warpedVoxelNumber+index]=reg_castPSFIntensity<FloatingTYPE>(intensity, datatype);
         }
     }
+    if(psfIndex!=NULL) free(psfIndex);
 }
 
 /* *************************************************************** */
@@ -1774,7 +2753,8 @@ void reg_resampleImage2_PSF(nifti_image *floatingImage,
                             int interp,
                             FieldTYPE paddingValue,
                             mat33 * jacMat,
-                            char algorithm)
+                            char algorithm,
+                            bool fastPSF)
 {
 
     // The deformation field contains the position in the real world
@@ -1803,7 +2783,8 @@ void reg_resampleImage2_PSF(nifti_image *floatingImage,
                                                         paddingValue,
                                                         interp,
                                                         jacMat,
-                                                        algorithm);
+                                                        algorithm,
+                                                        fastPSF);
 
 
         }
@@ -1824,7 +2805,8 @@ void reg_resampleImage_PSF(nifti_image *floatingImage,
                            int interp,
                            float paddingValue,
                            mat33 * jacMat,
-                           char algorithm)
+                           char algorithm,
+                           bool fastPSF)
 {
     if(floatingImage->datatype != warpedImage->datatype)
     {
@@ -1862,7 +2844,8 @@ void reg_resampleImage_PSF(nifti_image *floatingImage,
                                                         interp,
                                                         paddingValue,
                                                         jacMat,
-                                                        algorithm);
+                                                        algorithm,
+                                                        fastPSF);
             break;
         case NIFTI_TYPE_INT8:
             reg_resampleImage2_PSF<float,char>(floatingImage,
@@ -1872,7 +2855,8 @@ void reg_resampleImage_PSF(nifti_image *floatingImage,
                                                interp,
                                                paddingValue,
                                                jacMat,
-                                               algorithm);
+                                               algorithm,
+                                               fastPSF);
             break;
         case NIFTI_TYPE_UINT16:
             reg_resampleImage2_PSF<float,unsigned short>(floatingImage,
@@ -1882,7 +2866,8 @@ void reg_resampleImage_PSF(nifti_image *floatingImage,
                                                          interp,
                                                          paddingValue,
                                                          jacMat,
-                                                         algorithm);
+                                                         algorithm,
+                                                         fastPSF);
             break;
         case NIFTI_TYPE_INT16:
             reg_resampleImage2_PSF<float,short>(floatingImage,
@@ -1892,7 +2877,8 @@ void reg_resampleImage_PSF(nifti_image *floatingImage,
                                                 interp,
                                                 paddingValue,
                                                 jacMat,
-                                                algorithm);
+                                                algorithm,
+                                                fastPSF);
             break;
         case NIFTI_TYPE_UINT32:
             reg_resampleImage2_PSF<float,unsigned int>(floatingImage,
@@ -1902,7 +2888,8 @@ void reg_resampleImage_PSF(nifti_image *floatingImage,
                                                        interp,
                                                        paddingValue,
                                                        jacMat,
-                                                       algorithm);
+                                                       algorithm,
+                                                       fastPSF);
             break;
         case NIFTI_TYPE_INT32:
             reg_resampleImage2_PSF<float,int>(floatingImage,
@@ -1912,7 +2899,8 @@ void reg_resampleImage_PSF(nifti_image *floatingImage,
                                               interp,
                                               paddingValue,
                                               jacMat,
-                                              algorithm);
+                                              algorithm,
+                                              fastPSF);
             break;
         case NIFTI_TYPE_FLOAT32:
             reg_resampleImage2_PSF<float,float>(floatingImage,
@@ -1922,7 +2910,8 @@ void reg_resampleImage_PSF(nifti_image *floatingImage,
                                                 interp,
                                                 paddingValue,
                                                 jacMat,
-                                                algorithm);
+                                                algorithm,
+                                                fastPSF);
             break;
         case NIFTI_TYPE_FLOAT64:
             reg_resampleImage2_PSF<float,double>(floatingImage,
@@ -1932,7 +2921,8 @@ void reg_resampleImage_PSF(nifti_image *floatingImage,
                                                  interp,
                                                  paddingValue,
                                                  jacMat,
-                                                 algorithm);
+                                                 algorithm,
+                                                 fastPSF);
             break;
         default:
             printf("floating pixel type unsupported.");
@@ -1950,7 +2940,8 @@ void reg_resampleImage_PSF(nifti_image *floatingImage,
                                                          interp,
                                                          paddingValue,
                                                          jacMat,
-                                                         algorithm);
+                                                         algorithm,
+                                                         fastPSF);
             break;
         case NIFTI_TYPE_INT8:
             reg_resampleImage2_PSF<double,char>(floatingImage,
@@ -1960,7 +2951,8 @@ void reg_resampleImage_PSF(nifti_image *floatingImage,
                                                 interp,
                                                 paddingValue,
                                                 jacMat,
-                                                algorithm);
+                                                algorithm,
+                                                fastPSF);
             break;
         case NIFTI_TYPE_UINT16:
             reg_resampleImage2_PSF<double,unsigned short>(floatingImage,
@@ -1970,7 +2962,8 @@ void reg_resampleImage_PSF(nifti_image *floatingImage,
                                                           interp,
                                                           paddingValue,
                                                           jacMat,
-                                                          algorithm);
+                                                          algorithm,
+                                                          fastPSF);
             break;
         case NIFTI_TYPE_INT16:
             reg_resampleImage2_PSF<double,short>(floatingImage,
@@ -1980,7 +2973,8 @@ void reg_resampleImage_PSF(nifti_image *floatingImage,
                                                  interp,
                                                  paddingValue,
                                                  jacMat,
-                                                 algorithm);
+                                                 algorithm,
+                                                 fastPSF);
             break;
         case NIFTI_TYPE_UINT32:
             reg_resampleImage2_PSF<double,unsigned int>(floatingImage,
@@ -1990,7 +2984,8 @@ void reg_resampleImage_PSF(nifti_image *floatingImage,
                                                         interp,
                                                         paddingValue,
                                                         jacMat,
-                                                        algorithm);
+                                                        algorithm,
+                                                        fastPSF);
             break;
         case NIFTI_TYPE_INT32:
             reg_resampleImage2_PSF<double,int>(floatingImage,
@@ -2000,7 +2995,8 @@ void reg_resampleImage_PSF(nifti_image *floatingImage,
                                                interp,
                                                paddingValue,
                                                jacMat,
-                                               algorithm);
+                                               algorithm,
+                                               fastPSF);
             break;
         case NIFTI_TYPE_FLOAT32:
             reg_resampleImage2_PSF<double,float>(floatingImage,
@@ -2010,7 +3006,8 @@ void reg_resampleImage_PSF(nifti_image *floatingImage,
                                                  interp,
                                                  paddingValue,
                                                  jacMat,
-                                                 algorithm);
+                                                 algorithm,
+                                                 fastPSF);
             break;
         case NIFTI_TYPE_FLOAT64:
             reg_resampleImage2_PSF<double,double>(floatingImage,
@@ -2020,7 +3017,8 @@ void reg_resampleImage_PSF(nifti_image *floatingImage,
                                                   interp,
                                                   paddingValue,
                                                   jacMat,
-                                                  algorithm);
+                                                  algorithm,
+                                                  fastPSF);
             break;
         default:
             printf("floating pixel type unsupported.");
@@ -2529,7 +3527,7 @@ template<class FloatingTYPE, class GradientTYPE, class FieldTYPE>
 void TrilinearImageGradient(nifti_image *floatingImage,
                             nifti_image *deformationField,
                             nifti_image *warImgGradient,
-                            int *mask,
+                            const reg_maskSpans *maskSpans,
                             float paddingValue,
                             int active_timepoint)
 {
@@ -2558,8 +3556,6 @@ void TrilinearImageGradient(nifti_image *floatingImage,
     GradientTYPE *warpedGradientPtrY = &warpedGradientPtrX[referenceVoxelNumber];
     GradientTYPE *warpedGradientPtrZ = &warpedGradientPtrY[referenceVoxelNumber];
 
-    int *maskPtr = &mask[0];
-
     mat44 *floatingIJKMatrix;
     if(floatingImage->sform_code>0)
         floatingIJKMatrix=&(floatingImage->sto_ijk);
@@ -2579,145 +3575,167 @@ void TrilinearImageGradient(nifti_image *floatingImage,
     FieldTYPE relative, world[3], grad[3], coeff;
     FieldTYPE xxTempNewValue, yyTempNewValue, zzTempNewValue, xTempNewValue, yTempNewValue;
     FloatingTYPE *zPointer, *xyzPointer;
+    // The voxels are processed tile by tile so that the floating intensities
+    // read for neighbouring voxels remain in cache. The active spans of every line
+    // are walked along with the voxels
+    int warpedDim[3]={warImgGradient->nx, warImgGradient->ny, warImgGradient->nz};
+    int tileNumber[3], tile, tileStart[3], tileEnd[3], x, y, z;
+    size_t line, span;
+    int tileCount = reg_getTileNumber(warpedDim, tileNumber);
 #if defined (_OPENMP)
-#pragma omp parallel for default(none) \
-    private(index, world, position, previous, xBasis, yBasis, zBasis, relative, grad, coeff, \
+#pragma omp parallel for default(none) schedule(dynamic) \
+    private(tile, tileStart, tileEnd, x, y, z, line, span, index, world, position, previous, xBasis, yBasis, zBasis, relative, grad, coeff, \
     a, b, c, X, Y, Z, zPointer, xyzPointer, xTempNewValue, yTempNewValue, xxTempNewValue, yyTempNewValue, zzTempNewValue) \
     shared(floatingIntensity, referenceVoxelNumber, floatingVoxelNumber, deriv, paddingValue, \
-    deformationFieldPtrX, deformationFieldPtrY, deformationFieldPtrZ, maskPtr, \
-    floatingIJKMatrix, floatingImage, warpedGradientPtrX, warpedGradientPtrY, warpedGradientPtrZ)
+    deformationFieldPtrX, deformationFieldPtrY, deformationFieldPtrZ, maskSpans, \
+    floatingIJKMatrix, floatingImage, warpedGradientPtrX, warpedGradientPtrY, warpedGradientPtrZ, \
+    warpedDim, tileNumber, tileCount)
 #endif // _OPENMP
-    for(index=0; index<referenceVoxelNumber; index++)
+    for(tile=0; tile<tileCount; tile++)
     {
-
-        grad[0]=0.0;
-        grad[1]=0.0;
-        grad[2]=0.0;
-
-        if(maskPtr[index]>-1)
+        reg_getTileBounds(tile, warpedDim, tileNumber, tileStart, tileEnd);
+        for(z=tileStart[2]; z<tileEnd[2]; z++)
         {
-            world[0]=(FieldTYPE) deformationFieldPtrX[index];
-            world[1]=(FieldTYPE) deformationFieldPtrY[index];
-            world[2]=(FieldTYPE) deformationFieldPtrZ[index];
-
-            /* real -> voxel; floating space */
-            reg_mat44_mul(floatingIJKMatrix, world, position);
-
-            previous[0] = static_cast<int>(reg_floor(position[0]));
-            previous[1] = static_cast<int>(reg_floor(position[1]));
-            previous[2] = static_cast<int>(reg_floor(position[2]));
-            // basis values along the x axis
-            relative=position[0]-(FieldTYPE)previous[0];
-            xBasis[0]= (FieldTYPE)(1.0-relative);
-            xBasis[1]= relative;
-            // basis values along the y axis
-            relative=position[1]-(FieldTYPE)previous[1];
-            yBasis[0]= (FieldTYPE)(1.0-relative);
-            yBasis[1]= relative;
-            // basis values along the z axis
-            relative=position[2]-(FieldTYPE)previous[2];
-            zBasis[0]= (FieldTYPE)(1.0-relative);
-            zBasis[1]= relative;
-
-            // The padding value is used for interpolation if it is different from NaN
-            if(paddingValue==paddingValue)
+            for(y=tileStart[1]; y<tileEnd[1]; y++)
             {
-                for(c=0; c<2; c++)
+                line=(size_t)z*warpedDim[1]+y;
+                span=maskSpans->lineSpan[line];
+                index=line*warpedDim[0]+tileStart[0];
+                for(x=tileStart[0]; x<tileEnd[0]; x++, index++)
                 {
-                    Z=previous[2]+c;
-                    if(Z>-1 && Z<floatingImage->nz)
+
+                    grad[0]=0.0;
+                    grad[1]=0.0;
+                    grad[2]=0.0;
+
+                    while(span<maskSpans->lineSpan[line+1] && maskSpans->spanEnd[span]<=x) span++;
+                    if(span<maskSpans->lineSpan[line+1] && maskSpans->spanStart[span]<=x)
                     {
-                        zPointer = &floatingIntensity[Z*floatingImage->nx*floatingImage->ny];
-                        xxTempNewValue=0.0;
-                        yyTempNewValue=0.0;
-                        zzTempNewValue=0.0;
-                        for(b=0; b<2; b++)
+                        world[0]=(FieldTYPE) deformationFieldPtrX[index];
+                        world[1]=(FieldTYPE) deformationFieldPtrY[index];
+                        world[2]=(FieldTYPE) deformationFieldPtrZ[index];
+
+                        /* real -> voxel; floating space */
+                        reg_mat44_mul(floatingIJKMatrix, world, position);
+
+                        previous[0] = static_cast<int>(reg_floor(position[0]));
+                        previous[1] = static_cast<int>(reg_floor(position[1]));
+                        previous[2] = static_cast<int>(reg_floor(position[2]));
+                        // basis values along the x axis
+                        relative=position[0]-(FieldTYPE)previous[0];
+                        xBasis[0]= (FieldTYPE)(1.0-relative);
+                        xBasis[1]= relative;
+                        // basis values along the y axis
+                        relative=position[1]-(FieldTYPE)previous[1];
+                        yBasis[0]= (FieldTYPE)(1.0-relative);
+                        yBasis[1]= relative;
+                        // basis values along the z axis
+                        relative=position[2]-(FieldTYPE)previous[2];
+                        zBasis[0]= (FieldTYPE)(1.0-relative);
+                        zBasis[1]= relative;
+
+                        // The padding value is used for interpolation if it is different from NaN
+                        if(paddingValue==paddingValue)
+                        {
+                            for(c=0; c<2; c++)
+                            {
+                                Z=previous[2]+c;
+                                if(Z>-1 && Z<floatingImage->nz)
+                                {
+                                    zPointer = &floatingIntensity[Z*floatingImage->nx*floatingImage->ny];
+                                    xxTempNewValue=0.0;
+                                    yyTempNewValue=0.0;
+                                    zzTempNewValue=0.0;
+                                    for(b=0; b<2; b++)
+                                    {
+                                        Y=previous[1]+b;
+                                        if(Y>-1 && Y<floatingImage->ny)
+                                        {
+                                            xyzPointer = &zPointer[Y*floatingImage->nx+previous[0]];
+                                            xTempNewValue=0.0;
+                                            yTempNewValue=0.0;
+                                            for(a=0; a<2; a++)
+                                            {
+                                                X=previous[0]+a;
+                                                if(X>-1 && X<floatingImage->nx)
+                                                {
+                                                    coeff = *xyzPointer;
+                                                    xTempNewValue +=  coeff * deriv[a];
+                                                    yTempNewValue +=  coeff * xBasis[a];
+                                                } // end X in range
+                                                else
+                                                {
+                                                    xTempNewValue +=  paddingValue * deriv[a];
+                                                    yTempNewValue +=  paddingValue * xBasis[a];
+                                                }
+                                                xyzPointer++;
+                                            } // end a
+                                            xxTempNewValue += xTempNewValue * yBasis[b];
+                                            yyTempNewValue += yTempNewValue * deriv[b];
+                                            zzTempNewValue += yTempNewValue * yBasis[b];
+                                        } // end Y in range
+                                        else
+                                        {
+                                            xxTempNewValue += paddingValue * yBasis[b];
+                                            yyTempNewValue += paddingValue * deriv[b];
+                                            zzTempNewValue += paddingValue * yBasis[b];
+                                        }
+                                    } // end b
+                                    grad[0] += xxTempNewValue * zBasis[c];
+                                    grad[1] += yyTempNewValue * zBasis[c];
+                                    grad[2] += zzTempNewValue * deriv[c];
+                                } // end Z in range
+                                else
+                                {
+                                    grad[0] += paddingValue * zBasis[c];
+                                    grad[1] += paddingValue * zBasis[c];
+                                    grad[2] += paddingValue * deriv[c];
+                                }
+                            } // end c
+                        } // end padding value is different from NaN
+                        else if(previous[0]>=0.f && previous[0]<(floatingImage->nx-1) &&
+                                previous[1]>=0.f && previous[1]<(floatingImage->ny-1) &&
+                                previous[2]>=0.f && previous[2]<(floatingImage->nz-1) )
                         {
-                            Y=previous[1]+b;
-                            if(Y>-1 && Y<floatingImage->ny)
+                            for(c=0; c<2; c++)
                             {
-                                xyzPointer = &zPointer[Y*floatingImage->nx+previous[0]];
-                                xTempNewValue=0.0;
-                                yTempNewValue=0.0;
-                                for(a=0; a<2; a++)
+                                Z=previous[2]+c;
+                                zPointer = &floatingIntensity[Z*floatingImage->nx*floatingImage->ny];
+                                xxTempNewValue=0.0;
+                                yyTempNewValue=0.0;
+                                zzTempNewValue=0.0;
+                                for(b=0; b<2; b++)
                                 {
-                                    X=previous[0]+a;
-                                    if(X>-1 && X<floatingImage->nx)
+                                    Y=previous[1]+b;
+                                    xyzPointer = &zPointer[Y*floatingImage->nx+previous[0]];
+                                    xTempNewValue=0.0;
+                                    yTempNewValue=0.0;
+                                    for(a=0; a<2; a++)
                                     {
+                                        X=previous[0]+a;
                                         coeff = *xyzPointer;
                                         xTempNewValue +=  coeff * deriv[a];
                                         yTempNewValue +=  coeff * xBasis[a];
-                                    } // end X in range
-                                    else
-                                    {
-                                        xTempNewValue +=  paddingValue * deriv[a];
-                                        yTempNewValue +=  paddingValue * xBasis[a];
-                                    }
-                                    xyzPointer++;
-                                } // end a
-                                xxTempNewValue += xTempNewValue * yBasis[b];
-                                yyTempNewValue += yTempNewValue * deriv[b];
-                                zzTempNewValue += yTempNewValue * yBasis[b];
-                            } // end Y in range
-                            else
-                            {
-                                xxTempNewValue += paddingValue * yBasis[b];
-                                yyTempNewValue += paddingValue * deriv[b];
-                                zzTempNewValue += paddingValue * yBasis[b];
-                            }
-                        } // end b
-                        grad[0] += xxTempNewValue * zBasis[c];
-                        grad[1] += yyTempNewValue * zBasis[c];
-                        grad[2] += zzTempNewValue * deriv[c];
-                    } // end Z in range
-                    else
-                    {
-                        grad[0] += paddingValue * zBasis[c];
-                        grad[1] += paddingValue * zBasis[c];
-                        grad[2] += paddingValue * deriv[c];
-                    }
-                } // end c
-            } // end padding value is different from NaN
-            else if(previous[0]>=0.f && previous[0]<(floatingImage->nx-1) &&
-                    previous[1]>=0.f && previous[1]<(floatingImage->ny-1) &&
-                    previous[2]>=0.f && previous[2]<(floatingImage->nz-1) )
-            {
-                for(c=0; c<2; c++)
-                {
-                    Z=previous[2]+c;
-                    zPointer = &floatingIntensity[Z*floatingImage->nx*floatingImage->ny];
-                    xxTempNewValue=0.0;
-                    yyTempNewValue=0.0;
-                    zzTempNewValue=0.0;
-                    for(b=0; b<2; b++)
-                    {
-                        Y=previous[1]+b;
-                        xyzPointer = &zPointer[Y*floatingImage->nx+previous[0]];
-                        xTempNewValue=0.0;
-                        yTempNewValue=0.0;
-                        for(a=0; a<2; a++)
-                        {
-                            X=previous[0]+a;
-                            coeff = *xyzPointer;
-                            xTempNewValue +=  coeff * deriv[a];
-                            yTempNewValue +=  coeff * xBasis[a];
-                            xyzPointer++;
-                        } // end a
-                        xxTempNewValue += xTempNewValue * yBasis[b];
-                        yyTempNewValue += yTempNewValue * deriv[b];
-                        zzTempNewValue += yTempNewValue * yBasis[b];
-                    } // end b
-                    grad[0] += xxTempNewValue * zBasis[c];
-                    grad[1] += yyTempNewValue * zBasis[c];
-                    grad[2] += zzTempNewValue * deriv[c];
-                } // end c
-            } // end padding value is NaN
-            else grad[0]=grad[1]=grad[2]=0;
-        } // end mask
-
-        warpedGradientPtrX[index] = (GradientTYPE)grad[0];
-        warpedGradientPtrY[index] = (GradientTYPE)grad[1];
-        warpedGradientPtrZ[index] = (GradientTYPE)grad[2];
+                                        xyzPointer++;
+                                    } // end a
+                                    xxTempNewValue += xTempNewValue * yBasis[b];
+                                    yyTempNewValue += yTempNewValue * deriv[b];
+                                    zzTempNewValue += yTempNewValue * yBasis[b];
+                                } // end b
+                                grad[0] += xxTempNewValue * zBasis[c];
+                                grad[1] += yyTempNewValue * zBasis[c];
+                                grad[2] += zzTempNewValue * deriv[c];
+                            } // end c
+                        } // end padding value is NaN
+                        else grad[0]=grad[1]=grad[2]=0;
+                    } // end mask
+
+                    warpedGradientPtrX[index] = (GradientTYPE)grad[0];
+                    warpedGradientPtrY[index] = (GradientTYPE)grad[1];
+                    warpedGradientPtrZ[index] = (GradientTYPE)grad[2];
+                }
+            }
+        }
     }
 }
 /* *************************************************************** */
@@ -2725,7 +3743,7 @@ template<class FloatingTYPE, class GradientTYPE, class FieldTYPE>
 void BilinearImageGradient(nifti_image *floatingImage,
                            nifti_image *deformationField,
                            nifti_image *warImgGradient,
-                           int *mask,
+                           const reg_maskSpans *maskSpans,
                            float paddingValue,
                            int active_timepoint)
 {
@@ -2753,8 +3771,6 @@ void BilinearImageGradient(nifti_image *floatingImage,
     GradientTYPE *warpedGradientPtrX = static_cast<GradientTYPE *>(warImgGradient->data);
     GradientTYPE *warpedGradientPtrY = &warpedGradientPtrX[referenceVoxelNumber];
 
-    int *maskPtr = &mask[0];
-
     mat44 floatingIJKMatrix;
     if(floatingImage->sform_code>0)
         floatingIJKMatrix=floatingImage->sto_ijk;
@@ -2775,83 +3791,92 @@ void BilinearImageGradient(nifti_image *floatingImage,
     int previous[3], a, b, X, Y;
     FloatingTYPE *xyPointer;
 
+    int x, y;
+    size_t span;
+    // The active spans of every line are walked along with the voxels
 #if defined (_OPENMP)
 #pragma omp parallel for default(none) \
-    private(index, world, position, previous, xBasis, yBasis, relative, grad, coeff, \
+    private(x, y, span, index, world, position, previous, xBasis, yBasis, relative, grad, coeff, \
     a, b, X, Y, xyPointer, xTempNewValue, yTempNewValue) \
     shared(floatingIntensity, referenceVoxelNumber, floatingVoxelNumber, deriv, \
-    deformationFieldPtrX, deformationFieldPtrY, maskPtr, paddingValue, \
-    floatingIJKMatrix, floatingImage, warpedGradientPtrX, warpedGradientPtrY)
+    deformationFieldPtrX, deformationFieldPtrY, maskSpans, paddingValue, \
+    floatingIJKMatrix, floatingImage, warpedGradientPtrX, warpedGradientPtrY, warImgGradient)
 #endif // _OPENMP
-    for(index=0; index<referenceVoxelNumber; index++)
+    for(y=0; y<warImgGradient->ny; y++)
     {
-
-        grad[0]=0.0;
-        grad[1]=0.0;
-
-        if(maskPtr[index]>-1)
+        span=maskSpans->lineSpan[y];
+        index=(size_t)y*warImgGradient->nx;
+        for(x=0; x<warImgGradient->nx; x++, index++)
         {
-            world[0]=(FieldTYPE) deformationFieldPtrX[index];
-            world[1]=(FieldTYPE) deformationFieldPtrY[index];
 
-            /* real -> voxel; floating space */
-            position[0] = world[0]*floatingIJKMatrix.m[0][0] + world[1]*floatingIJKMatrix.m[0][1] +
-                    floatingIJKMatrix.m[0][3];
-            position[1] = world[0]*floatingIJKMatrix.m[1][0] + world[1]*floatingIJKMatrix.m[1][1] +
-                    floatingIJKMatrix.m[1][3];
+            grad[0]=0.0;
+            grad[1]=0.0;
 
-            previous[0] = static_cast<int>(reg_floor(position[0]));
-            previous[1] = static_cast<int>(reg_floor(position[1]));
-            // basis values along the x axis
-            relative=position[0]-(FieldTYPE)previous[0];
-            relative=relative>0?relative:0;
-            xBasis[0]= (FieldTYPE)(1.0-relative);
-            xBasis[1]= relative;
-            // basis values along the y axis
-            relative=position[1]-(FieldTYPE)previous[1];
-            relative=relative>0?relative:0;
-            yBasis[0]= (FieldTYPE)(1.0-relative);
-            yBasis[1]= relative;
-
-            for(b=0; b<2; b++)
+            while(span<maskSpans->lineSpan[y+1] && maskSpans->spanEnd[span]<=x) span++;
+            if(span<maskSpans->lineSpan[y+1] && maskSpans->spanStart[span]<=x)
             {
-                Y= previous[1]+b;
-                if(Y>-1 && Y<floatingImage->ny)
+                world[0]=(FieldTYPE) deformationFieldPtrX[index];
+                world[1]=(FieldTYPE) deformationFieldPtrY[index];
+
+                /* real -> voxel; floating space */
+                position[0] = world[0]*floatingIJKMatrix.m[0][0] + world[1]*floatingIJKMatrix.m[0][1] +
+                        floatingIJKMatrix.m[0][3];
+                position[1] = world[0]*floatingIJKMatrix.m[1][0] + world[1]*floatingIJKMatrix.m[1][1] +
+                        floatingIJKMatrix.m[1][3];
+
+                previous[0] = static_cast<int>(reg_floor(position[0]));
+                previous[1] = static_cast<int>(reg_floor(position[1]));
+                // basis values along the x axis
+                relative=position[0]-(FieldTYPE)previous[0];
+                relative=relative>0?relative:0;
+                xBasis[0]= (FieldTYPE)(1.0-relative);
+                xBasis[1]= relative;
+                // basis values along the y axis
+                relative=position[1]-(FieldTYPE)previous[1];
+                relative=relative>0?relative:0;
+                yBasis[0]= (FieldTYPE)(1.0-relative);
+                yBasis[1]= relative;
+
+                for(b=0; b<2; b++)
                 {
-                    xyPointer = &floatingIntensity[Y*floatingImage->nx+previous[0]];
-                    xTempNewValue=0.0;
-                    yTempNewValue=0.0;
-                    for(a=0; a<2; a++)
+                    Y= previous[1]+b;
+                    if(Y>-1 && Y<floatingImage->ny)
                     {
-                        X= previous[0]+a;
-                        if(X>-1 && X<floatingImage->nx)
-                        {
-                            coeff = *xyPointer;
-                            xTempNewValue +=  coeff * deriv[a];
-                            yTempNewValue +=  coeff * xBasis[a];
-                        }
-                        else
+                        xyPointer = &floatingIntensity[Y*floatingImage->nx+previous[0]];
+                        xTempNewValue=0.0;
+                        yTempNewValue=0.0;
+                        for(a=0; a<2; a++)
                         {
-                            xTempNewValue +=  paddingValue * deriv[a];
-                            yTempNewValue +=  paddingValue * xBasis[a];
+                            X= previous[0]+a;
+                            if(X>-1 && X<floatingImage->nx)
+                            {
+                                coeff = *xyPointer;
+                                xTempNewValue +=  coeff * deriv[a];
+                                yTempNewValue +=  coeff * xBasis[a];
+                            }
+                            else
+                            {
+                                xTempNewValue +=  paddingValue * deriv[a];
+                                yTempNewValue +=  paddingValue * xBasis[a];
+                            }
+                            xyPointer++;
                         }
-                        xyPointer++;
+                        grad[0] += xTempNewValue * yBasis[b];
+                        grad[1] += yTempNewValue * deriv[b];
+                    }
+                    else
+                    {
+                        grad[0] += paddingValue * yBasis[b];
+                        grad[1] += paddingValue * deriv[b];
                     }
-                    grad[0] += xTempNewValue * yBasis[b];
-                    grad[1] += yTempNewValue * deriv[b];
-                }
-                else
-                {
-                    grad[0] += paddingValue * yBasis[b];
-                    grad[1] += paddingValue * deriv[b];
                 }
-            }
-            if(grad[0]!=grad[0]) grad[0]=0;
-            if(grad[1]!=grad[1]) grad[1]=0;
-        }// mask
+                if(grad[0]!=grad[0]) grad[0]=0;
+                if(grad[1]!=grad[1]) grad[1]=0;
+            }// mask
 
-        warpedGradientPtrX[index] = (GradientTYPE)grad[0];
-        warpedGradientPtrY[index] = (GradientTYPE)grad[1];
+            warpedGradientPtrX[index] = (GradientTYPE)grad[0];
+            warpedGradientPtrY[index] = (GradientTYPE)grad[1];
+        }
     }
 }
 /* *************************************************************** */
@@ -2859,7 +3884,7 @@ template<class FloatingTYPE, class GradientTYPE, class FieldTYPE>
 void CubicSplineImageGradient3D(nifti_image *floatingImage,
                                 nifti_image *deformationField,
                                 nifti_image *warImgGradient,
-                                int *mask,
+                                const reg_maskSpans *maskSpans,
                                 float paddingValue,
                                 int active_timepoint)
 {
@@ -2888,8 +3913,6 @@ void CubicSplineImageGradient3D(nifti_image *floatingImage,
     GradientTYPE *warpedGradientPtrY = &warpedGradientPtrX[referenceVoxelNumber];
     GradientTYPE *warpedGradientPtrZ = &warpedGradientPtrY[referenceVoxelNumber];
 
-    int *maskPtr = &mask[0];
-
     mat44 *floatingIJKMatrix;
     if(floatingImage->sform_code>0)
         floatingIJKMatrix=&(floatingImage->sto_ijk);
@@ -2907,115 +3930,137 @@ void CubicSplineImageGradient3D(nifti_image *floatingImage,
     FieldTYPE coeff, position[3], world[3], grad[3];
     FieldTYPE xxTempNewValue, yyTempNewValue, zzTempNewValue, xTempNewValue, yTempNewValue;
     FloatingTYPE *zPointer, *yzPointer, *xyzPointer;
+    // The voxels are processed tile by tile so that the floating intensities
+    // read for neighbouring voxels remain in cache. The active spans of every line
+    // are walked along with the voxels
+    int warpedDim[3]={warImgGradient->nx, warImgGradient->ny, warImgGradient->nz};
+    int tileNumber[3], tile, tileStart[3], tileEnd[3], x, y, z;
+    size_t line, span;
+    int tileCount = reg_getTileNumber(warpedDim, tileNumber);
 #if defined (_OPENMP)
-#pragma omp parallel for default(none) \
-    private(index, world, position, previous, xBasis, yBasis, zBasis, xDeriv, yDeriv, zDeriv, relative, grad, coeff, \
+#pragma omp parallel for default(none) schedule(dynamic) \
+    private(tile, tileStart, tileEnd, x, y, z, line, span, index, world, position, previous, xBasis, yBasis, zBasis, xDeriv, yDeriv, zDeriv, relative, grad, coeff, \
     a, b, c, Y, Z, zPointer, yzPointer, xyzPointer, xTempNewValue, yTempNewValue, xxTempNewValue, yyTempNewValue, zzTempNewValue) \
     shared(floatingIntensity, referenceVoxelNumber, floatingVoxelNumber, paddingValue, \
-    deformationFieldPtrX, deformationFieldPtrY, deformationFieldPtrZ, maskPtr, \
-    floatingIJKMatrix, floatingImage, warpedGradientPtrX, warpedGradientPtrY, warpedGradientPtrZ)
+    deformationFieldPtrX, deformationFieldPtrY, deformationFieldPtrZ, maskSpans, \
+    floatingIJKMatrix, floatingImage, warpedGradientPtrX, warpedGradientPtrY, warpedGradientPtrZ, \
+    warpedDim, tileNumber, tileCount)
 #endif // _OPENMP
-    for(index=0; index<referenceVoxelNumber; index++)
+    for(tile=0; tile<tileCount; tile++)
     {
+        reg_getTileBounds(tile, warpedDim, tileNumber, tileStart, tileEnd);
+        for(z=tileStart[2]; z<tileEnd[2]; z++)
+        {
+            for(y=tileStart[1]; y<tileEnd[1]; y++)
+            {
+                line=(size_t)z*warpedDim[1]+y;
+                span=maskSpans->lineSpan[line];
+                index=line*warpedDim[0]+tileStart[0];
+                for(x=tileStart[0]; x<tileEnd[0]; x++, index++)
+                {
 
-        grad[0]=0.0;
-        grad[1]=0.0;
-        grad[2]=0.0;
+                    grad[0]=0.0;
+                    grad[1]=0.0;
+                    grad[2]=0.0;
 
-        if((*maskPtr++)>-1)
-        {
+                    while(span<maskSpans->lineSpan[line+1] && maskSpans->spanEnd[span]<=x) span++;
+                    if(span<maskSpans->lineSpan[line+1] && maskSpans->spanStart[span]<=x)
+                    {
 
-            world[0]=(FieldTYPE) deformationFieldPtrX[index];
-            world[1]=(FieldTYPE) deformationFieldPtrY[index];
-            world[2]=(FieldTYPE) deformationFieldPtrZ[index];
+                        world[0]=(FieldTYPE) deformationFieldPtrX[index];
+                        world[1]=(FieldTYPE) deformationFieldPtrY[index];
+                        world[2]=(FieldTYPE) deformationFieldPtrZ[index];
 
-            /* real -> voxel; floating space */
-            reg_mat44_mul(floatingIJKMatrix, world, position);
+                        /* real -> voxel; floating space */
+                        reg_mat44_mul(floatingIJKMatrix, world, position);
 
-            previous[0] = static_cast<int>(reg_floor(position[0]));
-            previous[1] = static_cast<int>(reg_floor(position[1]));
-            previous[2] = static_cast<int>(reg_floor(position[2]));
+                        previous[0] = static_cast<int>(reg_floor(position[0]));
+                        previous[1] = static_cast<int>(reg_floor(position[1]));
+                        previous[2] = static_cast<int>(reg_floor(position[2]));
 
-            // basis values along the x axis
-            relative=position[0]-(FieldTYPE)previous[0];
-            interpCubicSplineKernel(relative, xBasis, xDeriv);
+                        // basis values along the x axis
+                        relative=position[0]-(FieldTYPE)previous[0];
+                        interpCubicSplineKernel(relative, xBasis, xDeriv);
 
-            // basis values along the y axis
-            relative=position[1]-(FieldTYPE)previous[1];
-            interpCubicSplineKernel(relative, yBasis, yDeriv);
+                        // basis values along the y axis
+                        relative=position[1]-(FieldTYPE)previous[1];
+                        interpCubicSplineKernel(relative, yBasis, yDeriv);
 
-            // basis values along the z axis
-            relative=position[2]-(FieldTYPE)previous[2];
-            interpCubicSplineKernel(relative, zBasis, zDeriv);
+                        // basis values along the z axis
+                        relative=position[2]-(FieldTYPE)previous[2];
+                        interpCubicSplineKernel(relative, zBasis, zDeriv);
 
-            previous[0]--;
-            previous[1]--;
-            previous[2]--;
+                        previous[0]--;
+                        previous[1]--;
+                        previous[2]--;
 
-            for(c=0; c<4; c++)
-            {
-                Z = previous[2]+c;
-                if(-1<Z && Z<floatingImage->nz)
-                {
-                    zPointer = &floatingIntensity[Z*floatingImage->nx*floatingImage->ny];
-                    xxTempNewValue=0.0;
-                    yyTempNewValue=0.0;
-                    zzTempNewValue=0.0;
-                    for(b=0; b<4; b++)
-                    {
-                        Y= previous[1]+b;
-                        yzPointer = &zPointer[Y*floatingImage->nx];
-                        if(-1<Y && Y<floatingImage->ny)
+                        for(c=0; c<4; c++)
                         {
-                            xyzPointer = &yzPointer[previous[0]];
-                            xTempNewValue=0.0;
-                            yTempNewValue=0.0;
-                            for(a=0; a<4; a++)
+                            Z = previous[2]+c;
+                            if(-1<Z && Z<floatingImage->nz)
                             {
-                                if(-1<(previous[0]+a) && (previous[0]+a)<floatingImage->nx)
-                                {
-                                    coeff = *xyzPointer;
-                                    xTempNewValue +=  coeff * xDeriv[a];
-                                    yTempNewValue +=  coeff * xBasis[a];
-                                } // previous[0]+a in range
-                                else
+                                zPointer = &floatingIntensity[Z*floatingImage->nx*floatingImage->ny];
+                                xxTempNewValue=0.0;
+                                yyTempNewValue=0.0;
+                                zzTempNewValue=0.0;
+                                for(b=0; b<4; b++)
                                 {
-                                    xTempNewValue +=  paddingValue * xDeriv[a];
-                                    yTempNewValue +=  paddingValue * xBasis[a];
-                                }
-                                xyzPointer++;
-                            } // a
-                            xxTempNewValue += xTempNewValue * yBasis[b];
-                            yyTempNewValue += yTempNewValue * yDeriv[b];
-                            zzTempNewValue += yTempNewValue * yBasis[b];
-                        } // Y in range
-                        else
-                        {
-                            xxTempNewValue += paddingValue * yBasis[b];
-                            yyTempNewValue += paddingValue * yDeriv[b];
-                            zzTempNewValue += paddingValue * yBasis[b];
-                        }
-                    } // b
-                    grad[0] += xxTempNewValue * zBasis[c];
-                    grad[1] += yyTempNewValue * zBasis[c];
-                    grad[2] += zzTempNewValue * zDeriv[c];
-                } // Z in range
-                else
-                {
-                    grad[0] += paddingValue * zBasis[c];
-                    grad[1] += paddingValue * zBasis[c];
-                    grad[2] += paddingValue * zDeriv[c];
-                }
-            } // c
+                                    Y= previous[1]+b;
+                                    yzPointer = &zPointer[Y*floatingImage->nx];
+                                    if(-1<Y && Y<floatingImage->ny)
+                                    {
+                                        xyzPointer = &yzPointer[previous[0]];
+                                        xTempNewValue=0.0;
+                                        yTempNewValue=0.0;
+                                        for(a=0; a<4; a++)
+                                        {
+                                            if(-1<(previous[0]+a) && (previous[0]+a)<floatingImage->nx)
+                                            {
+                                                coeff = *xyzPointer;
+                                                xTempNewValue +=  coeff * xDeriv[a];
+                                                yTempNewValue +=  coeff * xBasis[a];
+                                            } // previous[0]+a in range
+                                            else
+                                            {
+                                                xTempNewValue +=  paddingValue * xDeriv[a];
+                                                yTempNewValue +=  paddingValue * xBasis[a];
+                                            }
+                                            xyzPointer++;
+                                        } // a
+                                        xxTempNewValue += xTempNewValue * yBasis[b];
+                                        yyTempNewValue += yTempNewValue * yDeriv[b];
+                                        zzTempNewValue += yTempNewValue * yBasis[b];
+                                    } // Y in range
+                                    else
+                                    {
+                                        xxTempNewValue += paddingValue * yBasis[b];
+                                        yyTempNewValue += paddingValue * yDeriv[b];
+                                        zzTempNewValue += paddingValue * yBasis[b];
+                                    }
+                                } // b
+                                grad[0] += xxTempNewValue * zBasis[c];
+                                grad[1] += yyTempNewValue * zBasis[c];
+                                grad[2] += zzTempNewValue * zDeriv[c];
+                            } // Z in range
+                            else
+                            {
+                                grad[0] += paddingValue * zBasis[c];
+                                grad[1] += paddingValue * zBasis[c];
+                                grad[2] += paddingValue * zDeriv[c];
+                            }
+                        } // c
 
-            grad[0]=grad[0]==grad[0]?grad[0]:0.0;
-            grad[1]=grad[1]==grad[1]?grad[1]:0.0;
-            grad[2]=grad[2]==grad[2]?grad[2]:0.0;
-        } // outside of the mask
+                        grad[0]=grad[0]==grad[0]?grad[0]:0.0;
+                        grad[1]=grad[1]==grad[1]?grad[1]:0.0;
+                        grad[2]=grad[2]==grad[2]?grad[2]:0.0;
+                    } // outside of the mask
 
-        warpedGradientPtrX[index] = (GradientTYPE)grad[0];
-        warpedGradientPtrY[index] = (GradientTYPE)grad[1];
-        warpedGradientPtrZ[index] = (GradientTYPE)grad[2];
+                    warpedGradientPtrX[index] = (GradientTYPE)grad[0];
+                    warpedGradientPtrY[index] = (GradientTYPE)grad[1];
+                    warpedGradientPtrZ[index] = (GradientTYPE)grad[2];
+                }
+            }
+        }
     }
 }
 /* *************************************************************** */
@@ -3023,7 +4068,7 @@ template<class FloatingTYPE, class GradientTYPE, class FieldTYPE>
 void CubicSplineImageGradient2D(nifti_image *floatingImage,
                                 nifti_image *deformationField,
                                 nifti_image *warImgGradient,
-                                int *mask,
+                                const reg_maskSpans *maskSpans,
                                 float paddingValue,
                                 int active_timepoint)
 {
@@ -3050,8 +4095,6 @@ void CubicSplineImageGradient2D(nifti_image *floatingImage,
     GradientTYPE *warpedGradientPtrX = static_cast<GradientTYPE *>(warImgGradient->data);
     GradientTYPE *warpedGradientPtrY = &warpedGradientPtrX[referenceVoxelNumber];
 
-    int *maskPtr = &mask[0];
-
     mat44 *floatingIJKMatrix;
     if(floatingImage->sform_code>0)
         floatingIJKMatrix=&(floatingImage->sto_ijk);
@@ -3067,85 +4110,94 @@ void CubicSplineImageGradient2D(nifti_image *floatingImage,
     FieldTYPE coeff, position[3], world[3], grad[2];
     FieldTYPE xTempNewValue, yTempNewValue;
     FloatingTYPE *yPointer, *xyPointer;
+    int x, y;
+    size_t span;
+    // The active spans of every line are walked along with the voxels
 #if defined (_OPENMP)
 #pragma omp parallel for default(none) \
-    private(index, world, position, previous, xBasis, yBasis, xDeriv, yDeriv, relative, grad, coeff, \
+    private(x, y, span, index, world, position, previous, xBasis, yBasis, xDeriv, yDeriv, relative, grad, coeff, \
     a, b, Y, yPointer, xyPointer, xTempNewValue, yTempNewValue) \
     shared(floatingIntensity, referenceVoxelNumber, floatingVoxelNumber, \
-    deformationFieldPtrX, deformationFieldPtrY, maskPtr, paddingValue, \
-    floatingIJKMatrix, floatingImage, warpedGradientPtrX, warpedGradientPtrY)
+    deformationFieldPtrX, deformationFieldPtrY, maskSpans, paddingValue, \
+    floatingIJKMatrix, floatingImage, warpedGradientPtrX, warpedGradientPtrY, warImgGradient)
 #endif // _OPENMP
-    for(index=0; index<referenceVoxelNumber; index++)
+    for(y=0; y<warImgGradient->ny; y++)
     {
-
-        grad[0]=0.0;
-        grad[1]=0.0;
-
-        if(maskPtr[index]>-1)
+        span=maskSpans->lineSpan[y];
+        index=(size_t)y*warImgGradient->nx;
+        for(x=0; x<warImgGradient->nx; x++, index++)
         {
-            world[0]=(FieldTYPE) deformationFieldPtrX[index];
-            world[1]=(FieldTYPE) deformationFieldPtrY[index];
 
-            /* real -> voxel; floating space */
-            position[0] = world[0]*floatingIJKMatrix->m[0][0] + world[1]*floatingIJKMatrix->m[0][1] +
-                    floatingIJKMatrix->m[0][3];
-            position[1] = world[0]*floatingIJKMatrix->m[1][0] + world[1]*floatingIJKMatrix->m[1][1] +
-                    floatingIJKMatrix->m[1][3];
+            grad[0]=0.0;
+            grad[1]=0.0;
 
-            previous[0] = static_cast<int>(reg_floor(position[0]));
-            previous[1] = static_cast<int>(reg_floor(position[1]));
-            // basis values along the x axis
-            relative=position[0]-(FieldTYPE)previous[0];
-            relative=relative>0?relative:0;
-            interpCubicSplineKernel(relative, xBasis, xDeriv);
-            // basis values along the y axis
-            relative=position[1]-(FieldTYPE)previous[1];
-            relative=relative>0?relative:0;
-            interpCubicSplineKernel(relative, yBasis, yDeriv);
-
-            previous[0]--;
-            previous[1]--;
-
-            for(b=0; b<4; b++)
+            while(span<maskSpans->lineSpan[y+1] && maskSpans->spanEnd[span]<=x) span++;
+            if(span<maskSpans->lineSpan[y+1] && maskSpans->spanStart[span]<=x)
             {
-                Y= previous[1]+b;
-                yPointer = &floatingIntensity[Y*floatingImage->nx];
-                if(-1<Y && Y<floatingImage->ny)
+                world[0]=(FieldTYPE) deformationFieldPtrX[index];
+                world[1]=(FieldTYPE) deformationFieldPtrY[index];
+
+                /* real -> voxel; floating space */
+                position[0] = world[0]*floatingIJKMatrix->m[0][0] + world[1]*floatingIJKMatrix->m[0][1] +
+                        floatingIJKMatrix->m[0][3];
+                position[1] = world[0]*floatingIJKMatrix->m[1][0] + world[1]*floatingIJKMatrix->m[1][1] +
+                        floatingIJKMatrix->m[1][3];
+
+                previous[0] = static_cast<int>(reg_floor(position[0]));
+                previous[1] = static_cast<int>(reg_floor(position[1]));
+                // basis values along the x axis
+                relative=position[0]-(FieldTYPE)previous[0];
+                relative=relative>0?relative:0;
+                interpCubicSplineKernel(relative, xBasis, xDeriv);
+                // basis values along the y axis
+                relative=position[1]-(FieldTYPE)previous[1];
+                relative=relative>0?relative:0;
+                interpCubicSplineKernel(relative, yBasis, yDeriv);
+
+                previous[0]--;
+                previous[1]--;
+
+                for(b=0; b<4; b++)
                 {
-                    xyPointer = &yPointer[previous[0]];
-                    xTempNewValue=0.0;
-                    yTempNewValue=0.0;
-                    for(a=0; a<4; a++)
+                    Y= previous[1]+b;
+                    yPointer = &floatingIntensity[Y*floatingImage->nx];
+                    if(-1<Y && Y<floatingImage->ny)
                     {
-                        if(-1<(previous[0]+a) && (previous[0]+a)<floatingImage->nx)
-                        {
-                            coeff = *xyPointer;
-                            xTempNewValue +=  coeff * xDeriv[a];
-                            yTempNewValue +=  coeff * xBasis[a];
-                        } // previous[0]+a in range
-                        else
+                        xyPointer = &yPointer[previous[0]];
+                        xTempNewValue=0.0;
+                        yTempNewValue=0.0;
+                        for(a=0; a<4; a++)
                         {
-                            xTempNewValue +=  paddingValue * xDeriv[a];
-                            yTempNewValue +=  paddingValue * xBasis[a];
-                        }
-                        xyPointer++;
-                    } // a
-                    grad[0] += xTempNewValue * yBasis[b];
-                    grad[1] += yTempNewValue * yDeriv[b];
-                } // Y in range
-                else
-                {
-                    grad[0] += paddingValue * yBasis[b];
-                    grad[1] += paddingValue * yDeriv[b];
-                }
-            } // b
+                            if(-1<(previous[0]+a) && (previous[0]+a)<floatingImage->nx)
+                            {
+                                coeff = *xyPointer;
+                                xTempNewValue +=  coeff * xDeriv[a];
+                                yTempNewValue +=  coeff * xBasis[a];
+                            } // previous[0]+a in range
+                            else
+                            {
+                                xTempNewValue +=  paddingValue * xDeriv[a];
+                                yTempNewValue +=  paddingValue * xBasis[a];
+                            }
+                            xyPointer++;
+                        } // a
+                        grad[0] += xTempNewValue * yBasis[b];
+                        grad[1] += yTempNewValue * yDeriv[b];
+                    } // Y in range
+                    else
+                    {
+                        grad[0] += paddingValue * yBasis[b];
+                        grad[1] += paddingValue * yDeriv[b];
+                    }
+                } // b
 
-            grad[0]=grad[0]==grad[0]?grad[0]:0.0;
-            grad[1]=grad[1]==grad[1]?grad[1]:0.0;
-        } // outside of the mask
+                grad[0]=grad[0]==grad[0]?grad[0]:0.0;
+                grad[1]=grad[1]==grad[1]?grad[1]:0.0;
+            } // outside of the mask
 
-        warpedGradientPtrX[index] = (GradientTYPE)grad[0];
-        warpedGradientPtrY[index] = (GradientTYPE)grad[1];
+            warpedGradientPtrX[index] = (GradientTYPE)grad[0];
+            warpedGradientPtrY[index] = (GradientTYPE)grad[1];
+        }
     }
 }
 /* *************************************************************** */
@@ -3153,6 +4205,7 @@ template <class FieldTYPE, class FloatingTYPE, class GradientTYPE>
 void reg_getImageGradient3(nifti_image *floatingImage,
                            nifti_image *warImgGradient,
                            nifti_image *deformationField,
+                           const reg_maskSpans *maskSpans,
                            int *mask,
                            int interp,
                            float paddingValue,
@@ -3177,7 +4230,7 @@ void reg_getImageGradient3(nifti_image *floatingImage,
                     <FloatingTYPE,GradientTYPE,FieldTYPE>(floatingImage,
                                                           deformationField,
                                                           warImgGradient,
-                                                          mask,
+                                                          maskSpans,
                                                           paddingValue,
                                                           active_timepoint);
         }
@@ -3187,7 +4240,7 @@ void reg_getImageGradient3(nifti_image *floatingImage,
                     <FloatingTYPE,GradientTYPE,FieldTYPE>(floatingImage,
                                                           deformationField,
                                                           warImgGradient,
-                                                          mask,
+                                                          maskSpans,
                                                           paddingValue,
                                                           active_timepoint);
         }
@@ -3200,7 +4253,7 @@ void reg_getImageGradient3(nifti_image *floatingImage,
                     <FloatingTYPE,GradientTYPE,FieldTYPE>(floatingImage,
                                                           deformationField,
                                                           warImgGradient,
-                                                          mask,
+                                                          maskSpans,
                                                           paddingValue,
                                                           active_timepoint);
         }
@@ -3210,7 +4263,7 @@ void reg_getImageGradient3(nifti_image *floatingImage,
                     <FloatingTYPE,GradientTYPE,FieldTYPE>(floatingImage,
                                                           deformationField,
                                                           warImgGradient,
-                                                          mask,
+                                                          maskSpans,
                                                           paddingValue,
                                                           active_timepoint);
         }
@@ -3235,6 +4288,7 @@ template <class FieldTYPE, class FloatingTYPE>
 void reg_getImageGradient2(nifti_image *floatingImage,
                            nifti_image *warImgGradient,
                            nifti_image *deformationField,
+                           const reg_maskSpans *maskSpans,
                            int *mask,
                            int interp,
                            float paddingValue,
@@ -3248,11 +4302,11 @@ void reg_getImageGradient2(nifti_image *floatingImage,
     {
     case NIFTI_TYPE_FLOAT32:
         reg_getImageGradient3<FieldTYPE,FloatingTYPE,float>
-                (floatingImage,warImgGradient,deformationField,mask,interp,paddingValue,active_timepoint,dtIndicies,jacMat, warpedImage);
+                (floatingImage,warImgGradient,deformationField,maskSpans,mask,interp,paddingValue,active_timepoint,dtIndicies,jacMat, warpedImage);
         break;
     case NIFTI_TYPE_FLOAT64:
         reg_getImageGradient3<FieldTYPE,FloatingTYPE,double>
-                (floatingImage,warImgGradient,deformationField,mask,interp,paddingValue,active_timepoint,dtIndicies,jacMat, warpedImage);
+                (floatingImage,warImgGradient,deformationField,maskSpans,mask,interp,paddingValue,active_timepoint,dtIndicies,jacMat, warpedImage);
         break;
     default:
         reg_print_fct_error("reg_getImageGradient2");
@@ -3265,6 +4319,7 @@ template <class FieldTYPE>
 void reg_getImageGradient1(nifti_image *floatingImage,
                            nifti_image *warImgGradient,
                            nifti_image *deformationField,
+                           const reg_maskSpans *maskSpans,
                            int *mask,
                            int interp,
                            float paddingValue,
@@ -3278,35 +4333,35 @@ void reg_getImageGradient1(nifti_image *floatingImage,
     {
     case NIFTI_TYPE_UINT8:
         reg_getImageGradient2<FieldTYPE,unsigned char>
-                (floatingImage,warImgGradient,deformationField,mask,interp,paddingValue,active_timepoint,dtIndicies,jacMat, warpedImage);
+                (floatingImage,warImgGradient,deformationField,maskSpans,mask,interp,paddingValue,active_timepoint,dtIndicies,jacMat, warpedImage);
         break;
     case NIFTI_TYPE_INT8:
         reg_getImageGradient2<FieldTYPE,char>
-                (floatingImage,warImgGradient,deformationField,mask,interp,paddingValue,active_timepoint,dtIndicies,jacMat, warpedImage);
+                (floatingImage,warImgGradient,deformationField,maskSpans,mask,interp,paddingValue,active_timepoint,dtIndicies,jacMat, warpedImage);
         break;
     case NIFTI_TYPE_UINT16:
         reg_getImageGradient2<FieldTYPE,unsigned short>
-                (floatingImage,warImgGradient,deformationField,mask,interp,paddingValue,active_timepoint,dtIndicies,jacMat, warpedImage);
+                (floatingImage,warImgGradient,deformationField,maskSpans,mask,interp,paddingValue,active_timepoint,dtIndicies,jacMat, warpedImage);
         break;
     case NIFTI_TYPE_INT16:
         reg_getImageGradient2<FieldTYPE,short>
-                (floatingImage,warImgGradient,deformationField,mask,interp,paddingValue,active_timepoint,dtIndicies,jacMat, warpedImage);
+                (floatingImage,warImgGradient,deformationField,maskSpans,mask,interp,paddingValue,active_timepoint,dtIndicies,jacMat, warpedImage);
         break;
     case NIFTI_TYPE_UINT32:
         reg_getImageGradient2<FieldTYPE,unsigned int>
-                (floatingImage,warImgGradient,deformationField,mask,interp,paddingValue,active_timepoint,dtIndicies,jacMat, warpedImage);
+                (floatingImage,warImgGradient,deformationField,maskSpans,mask,interp,paddingValue,active_timepoint,dtIndicies,jacMat, warpedImage);
         break;
     case NIFTI_TYPE_INT32:
         reg_getImageGradient2<FieldTYPE,int>
-                (floatingImage,warImgGradient,deformationField,mask,interp,paddingValue,active_timepoint,dtIndicies,jacMat, warpedImage);
+                (floatingImage,warImgGradient,deformationField,maskSpans,mask,interp,paddingValue,active_timepoint,dtIndicies,jacMat, warpedImage);
         break;
     case NIFTI_TYPE_FLOAT32:
         reg_getImageGradient2<FieldTYPE,float>
-                (floatingImage,warImgGradient,deformationField,mask,interp,paddingValue,active_timepoint,dtIndicies,jacMat, warpedImage);
+                (floatingImage,warImgGradient,deformationField,maskSpans,mask,interp,paddingValue,active_timepoint,dtIndicies,jacMat, warpedImage);
         break;
     case NIFTI_TYPE_FLOAT64:
         reg_getImageGradient2<FieldTYPE,double>
-                (floatingImage,warImgGradient,deformationField,mask,interp,paddingValue,active_timepoint,dtIndicies,jacMat, warpedImage);
+                (floatingImage,warImgGradient,deformationField,maskSpans,mask,interp,paddingValue,active_timepoint,dtIndicies,jacMat, warpedImage);
         break;
     default:
         reg_print_fct_error("reg_getImageGradient1");
@@ -3327,15 +4382,6 @@ void reg_getImageGradient(nifti_image *floatingImage,
                           nifti_image *warpedImage
                           )
 {
-    // a mask array is created if no mask is specified
-    bool MrPropreRule=false;
-    if(mask==NULL)
-    {
-        // voxels in the backgreg_round are set to -1 so 0 will do the job here
-        mask=(int *)calloc(deformationField->nx*deformationField->ny*deformationField->nz,sizeof(int));
-        MrPropreRule=true;
-    }
-
     // Define the DTI indices if required
     int dtIndicies[6];
     for(int i=0; i<6; ++i) dtIndicies[i]=-1;
@@ -3362,15 +4408,27 @@ void reg_getImageGradient(nifti_image *floatingImage,
         }
     }
 
+    // The active voxels are converted into spans. A full mask array is only
+    // required by the reorientation of the diffusion tensors
+    int warpedDim[3]={deformationField->nx, deformationField->ny, deformationField->nz};
+    reg_maskSpans *maskSpans=reg_tools_createMaskSpans(mask, warpedDim);
+    bool MrPropreRule=false;
+    if(mask==NULL && dtIndicies[0]!=-1)
+    {
+        // voxels in the backgreg_round are set to -1 so 0 will do the job here
+        mask=(int *)calloc(deformationField->nx*deformationField->ny*deformationField->nz,sizeof(int));
+        MrPropreRule=true;
+    }
+
     switch(deformationField->datatype)
     {
     case NIFTI_TYPE_FLOAT32:
         reg_getImageGradient1<float>
-                (floatingImage,warImgGradient,deformationField,mask,interp,paddingValue,active_timepoint,dtIndicies,jacMat, warpedImage);
+                (floatingImage,warImgGradient,deformationField,maskSpans,mask,interp,paddingValue,active_timepoint,dtIndicies,jacMat, warpedImage);
         break;
     case NIFTI_TYPE_FLOAT64:
         reg_getImageGradient1<double>
-                (floatingImage,warImgGradient,deformationField,mask,interp,paddingValue,active_timepoint,dtIndicies,jacMat, warpedImage);
+                (floatingImage,warImgGradient,deformationField,maskSpans,mask,interp,paddingValue,active_timepoint,dtIndicies,jacMat, warpedImage);
         break;
     default:
         reg_print_fct_error("reg_getImageGradient");
@@ -3378,9 +4436,618 @@ void reg_getImageGradient(nifti_image *floatingImage,
         reg_exit();
         break;
     }
+    reg_tools_freeMaskSpans(maskSpans);
     if(MrPropreRule==true) free(mask);
 }
 /* *************************************************************** */
+void reg_getImageGradient_spans(nifti_image *floatingImage,
+                                nifti_image *warImgGradient,
+                                nifti_image *deformationField,
+                                const reg_maskSpans *maskSpans,
+                                int interp,
+                                float paddingValue,
+                                int active_timepoint)
+{
+    // All voxels are considered if no spans are provided
+    reg_maskSpans *temporarySpans=NULL;
+    if(maskSpans==NULL)
+    {
+        int warpedDim[3]={deformationField->nx, deformationField->ny, deformationField->nz};
+        maskSpans=temporarySpans=reg_tools_createMaskSpans(NULL, warpedDim);
+    }
+    int dtIndicies[6];
+    for(int i=0; i<6; ++i) dtIndicies[i]=-1;
+    switch(deformationField->datatype)
+    {
+    case NIFTI_TYPE_FLOAT32:
+        reg_getImageGradient1<float>
+                (floatingImage,warImgGradient,deformationField,maskSpans,NULL,interp,paddingValue,active_timepoint,dtIndicies,NULL,NULL);
+        break;
+    case NIFTI_TYPE_FLOAT64:
+        reg_getImageGradient1<double>
+                (floatingImage,warImgGradient,deformationField,maskSpans,NULL,interp,paddingValue,active_timepoint,dtIndicies,NULL,NULL);
+        break;
+    default:
+        reg_print_fct_error("reg_getImageGradient_spans");
+        reg_print_msg_error("Unsupported deformation field image datatype");
+        reg_exit();
+        break;
+    }
+    reg_tools_freeMaskSpans(temporarySpans);
+}
+/* *************************************************************** */
+/* *************************************************************** */
+/** Interpolation of the floating intensity and of its derivatives along
+ * the floating voxel axes. The intensity is accumulated in the same order
+ * as in reg_applyInterpolationWeights3D so that both functions return the same
+ * value. Only the kernels with a derivative (linear and cubic spline) can
+ * be used.
+ */
+template<class FloatingTYPE, int kernel>
+inline double reg_interpolateIntensityAndGradient3D(const FloatingTYPE *floatingIntensity,
+                                                    const int *floatingDim,
+                                                    size_t floatingPlaneNumber,
+                                                    const double *position,
+                                                    double paddingValue,
+                                                    double *gradient)
+{
+    int a, b, c, X, Y, Z, previous[3];
+    const FloatingTYPE *zPointer, *xyzPointer;
+    double xBasis[reg_interpKernel<kernel>::size], xDeriv[reg_interpKernel<kernel>::size];
+    double yBasis[reg_interpKernel<kernel>::size], yDeriv[reg_interpKernel<kernel>::size];
+    double zBasis[reg_interpKernel<kernel>::size], zDeriv[reg_interpKernel<kernel>::size];
+    double coeff, xTempNewValue, xTempDeriv, yTempNewValue, yTempDerivX, yTempDerivY;
+    double intensity=0.0;
+    gradient[0]=gradient[1]=gradient[2]=0.0;
+
+    previous[0] = static_cast<int>(reg_floor(position[0]));
+    previous[1] = static_cast<int>(reg_floor(position[1]));
+    previous[2] = static_cast<int>(reg_floor(position[2]));
+
+    reg_interpKernel<kernel>::compute(position[0]-static_cast<double>(previous[0]), xBasis, xDeriv);
+    reg_interpKernel<kernel>::compute(position[1]-static_cast<double>(previous[1]), yBasis, yDeriv);
+    reg_interpKernel<kernel>::compute(position[2]-static_cast<double>(previous[2]), zBasis, zDeriv);
+    previous[0]-=reg_interpKernel<kernel>::offset;
+    previous[1]-=reg_interpKernel<kernel>::offset;
+    previous[2]-=reg_interpKernel<kernel>::offset;
+
+    const bool inside =
+            -1<previous[0] && (previous[0]+reg_interpKernel<kernel>::size-1)<floatingDim[0] &&
+            -1<previous[1] && (previous[1]+reg_interpKernel<kernel>::size-1)<floatingDim[1] &&
+            -1<previous[2] && (previous[2]+reg_interpKernel<kernel>::size-1)<floatingDim[2];
+
+    for(c=0; c<reg_interpKernel<kernel>::size; c++)
+    {
+        Z= previous[2]+c;
+        zPointer = &floatingIntensity[Z*floatingPlaneNumber];
+        yTempNewValue=yTempDerivX=yTempDerivY=0.0;
+        for(b=0; b<reg_interpKernel<kernel>::size; b++)
+        {
+            Y= previous[1]+b;
+            xyzPointer = &zPointer[Y*floatingDim[0]+previous[0]];
+            xTempNewValue=xTempDeriv=0.0;
+            for(a=0; a<reg_interpKernel<kernel>::size; a++)
+            {
+                X= previous[0]+a;
+                if(inside || (-1<X && X<floatingDim[0] &&
+                              -1<Y && Y<floatingDim[1] &&
+                              -1<Z && Z<floatingDim[2]))
+                    coeff = static_cast<double>(xyzPointer[a]);
+                else coeff = paddingValue;
+                xTempNewValue += coeff * xBasis[a];
+                xTempDeriv += coeff * xDeriv[a];
+            }
+            yTempNewValue += xTempNewValue * yBasis[b];
+            yTempDerivX += xTempDeriv * yBasis[b];
+            yTempDerivY += xTempNewValue * yDeriv[b];
+        }
+        intensity += yTempNewValue * zBasis[c];
+        gradient[0] += yTempDerivX * zBasis[c];
+        gradient[1] += yTempDerivY * zBasis[c];
+        gradient[2] += yTempNewValue * zDeriv[c];
+    }
+    return intensity;
+}
+/* *************************************************************** */
+template<class FloatingTYPE, int kernel>
+inline double reg_interpolateIntensityAndGradient2D(const FloatingTYPE *floatingIntensity,
+                                                    const int *floatingDim,
+                                                    const double *position,
+                                                    double paddingValue,
+                                                    double *gradient)
+{
+    int a, b, X, Y, previous[2];
+    const FloatingTYPE *xyzPointer;
+    double xBasis[reg_interpKernel<kernel>::size], xDeriv[reg_interpKernel<kernel>::size];
+    double yBasis[reg_interpKernel<kernel>::size], yDeriv[reg_interpKernel<kernel>::size];
+    double coeff, xTempNewValue, xTempDeriv, intensity=0.0;
+    gradient[0]=gradient[1]=0.0;
+
+    previous[0] = static_cast<int>(reg_floor(position[0]));
+    previous[1] = static_cast<int>(reg_floor(position[1]));
+
+    reg_interpKernel<kernel>::compute(position[0]-static_cast<double>(previous[0]), xBasis, xDeriv);
+    reg_interpKernel<kernel>::compute(position[1]-static_cast<double>(previous[1]), yBasis, yDeriv);
+    previous[0]-=reg_interpKernel<kernel>::offset;
+    previous[1]-=reg_interpKernel<kernel>::offset;
+
+    const bool inside =
+            -1<previous[0] && (previous[0]+reg_interpKernel<kernel>::size-1)<floatingDim[0] &&
+            -1<previous[1] && (previous[1]+reg_interpKernel<kernel>::size-1)<floatingDim[1];
+
+    for(b=0; b<reg_interpKernel<kernel>::size; b++)
+    {
+        Y= previous[1]+b;
+        xyzPointer = &floatingIntensity[Y*floatingDim[0]+previous[0]];
+        xTempNewValue=xTempDeriv=0.0;
+        for(a=0; a<reg_interpKernel<kernel>::size; a++)
+        {
+            X= previous[0]+a;
+            if(inside || (-1<X && X<floatingDim[0] &&
+                          -1<Y && Y<floatingDim[1]))
+                coeff = static_cast<double>(xyzPointer[a]);
+            else coeff = paddingValue;
+            xTempNewValue += coeff * xBasis[a];
+            xTempDeriv += coeff * xDeriv[a];
+        }
+        intensity += xTempNewValue * yBasis[b];
+        gradient[0] += xTempDeriv * yBasis[b];
+        gradient[1] += xTempNewValue * yDeriv[b];
+    }
+    return intensity;
+}
+/* *************************************************************** */
+/** Single traversal of the reference space that resamples every volume of
+ * the floating image and computes the warped image gradient of the active
+ * time point. The floating positions and interpolation weights are thus
+ * only computed once per voxel instead of once per volume plus once for
+ * the gradient.
+ */
+template<class FloatingTYPE, class FieldTYPE, int kernel>
+void ResampleImageAndGradient3D_core(nifti_image *floatingImage,
+                                     nifti_image *deformationField,
+                                     nifti_image *warpedImage,
+                                     nifti_image *warImgGradient,
+                                     const reg_maskSpans *maskSpans,
+                                     FieldTYPE paddingValue,
+                                     int active_timepoint)
+{
+#ifdef _WIN32
+    long  index;
+    long warpedVoxelNumber = (long)warpedImage->nx*warpedImage->ny*warpedImage->nz;
+    long floatingVoxelNumber = (long)floatingImage->nx*floatingImage->ny*floatingImage->nz;
+#else
+    size_t  index;
+    size_t warpedVoxelNumber = (size_t)warpedImage->nx*warpedImage->ny*warpedImage->nz;
+    size_t floatingVoxelNumber = (size_t)floatingImage->nx*floatingImage->ny*floatingImage->nz;
+#endif
+    FloatingTYPE *floatingIntensityPtr = static_cast<FloatingTYPE *>(floatingImage->data);
+    FloatingTYPE *warpedIntensityPtr = static_cast<FloatingTYPE *>(warpedImage->data);
+    FieldTYPE *deformationFieldPtrX = static_cast<FieldTYPE *>(deformationField->data);
+    FieldTYPE *deformationFieldPtrY = &deformationFieldPtrX[warpedVoxelNumber];
+    FieldTYPE *deformationFieldPtrZ = &deformationFieldPtrY[warpedVoxelNumber];
+
+    FieldTYPE *warpedGradientPtrX = static_cast<FieldTYPE *>(warImgGradient->data);
+    FieldTYPE *warpedGradientPtrY = &warpedGradientPtrX[warpedVoxelNumber];
+    FieldTYPE *warpedGradientPtrZ = &warpedGradientPtrY[warpedVoxelNumber];
+
+    mat44 *floatingIJKMatrix;
+    if(floatingImage->sform_code>0)
+        floatingIJKMatrix=&(floatingImage->sto_ijk);
+    else floatingIJKMatrix=&(floatingImage->qto_ijk);
+
+    int floatingDim[3]={floatingImage->nx, floatingImage->ny, floatingImage->nz};
+    size_t floatingPlaneNumber = (size_t)floatingDim[0]*floatingDim[1];
+    size_t volumeNumber = (size_t)warpedImage->nt*warpedImage->nu;
+    size_t activeVolume = (size_t)active_timepoint;
+    double padding = static_cast<double>(paddingValue);
+    FloatingTYPE warpedPadding = reg_castIntensity<FloatingTYPE>(padding);
+
+#ifndef NDEBUG
+    char text[255];
+    sprintf(text, "3D resampling and gradient computation of volume number %i", active_timepoint);
+    reg_print_msg_debug(text);
+#endif
+
+    size_t t;
+    float world[3], position[3];
+    double voxel[3], grad[3];
+    reg_interpWeights<kernel,3> weights;
+    // The voxels are processed tile by tile so that the floating intensities
+    // read for neighbouring voxels remain in cache. Only the active spans of every
+    // line are interpolated, the voxels in between are padded with a null gradient
+    int warpedDim[3]={warpedImage->nx, warpedImage->ny, warpedImage->nz};
+    int tileNumber[3], tile, tileStart[3], tileEnd[3], x, y, z, start, end;
+    size_t line, span;
+    int tileCount = reg_getTileNumber(warpedDim, tileNumber);
+#if defined (_OPENMP)
+#pragma omp parallel for default(none) schedule(dynamic) \
+    private(tile, tileStart, tileEnd, x, y, z, start, end, line, span, index, t, world, position, voxel, grad, weights) \
+    shared(floatingIntensityPtr, warpedIntensityPtr, warpedVoxelNumber, floatingVoxelNumber, \
+    deformationFieldPtrX, deformationFieldPtrY, deformationFieldPtrZ, maskSpans, \
+    warpedGradientPtrX, warpedGradientPtrY, warpedGradientPtrZ, volumeNumber, activeVolume, \
+    floatingIJKMatrix, floatingDim, floatingPlaneNumber, padding, warpedPadding, \
+    warpedDim, tileNumber, tileCount)
+#endif // _OPENMP
+    for(tile=0; tile<tileCount; tile++)
+    {
+        reg_getTileBounds(tile, warpedDim, tileNumber, tileStart, tileEnd);
+        for(z=tileStart[2]; z<tileEnd[2]; z++)
+        {
+            for(y=tileStart[1]; y<tileEnd[1]; y++)
+            {
+                line=(size_t)z*warpedDim[1]+y;
+                x=tileStart[0];
+                for(span=maskSpans->lineSpan[line]; span<maskSpans->lineSpan[line+1] && x<tileEnd[0]; span++)
+                {
+                    start=maskSpans->spanStart[span]>x?maskSpans->spanStart[span]:x;
+                    start=start<tileEnd[0]?start:tileEnd[0];
+                    end=maskSpans->spanEnd[span]<tileEnd[0]?maskSpans->spanEnd[span]:tileEnd[0];
+                    for(index=line*warpedDim[0]+x; x<start; x++, index++)
+                    {
+                        for(t=0; t<volumeNumber; t++)
+                            warpedIntensityPtr[t*warpedVoxelNumber+index]=warpedPadding;
+                        warpedGradientPtrX[index]=warpedGradientPtrY[index]=warpedGradientPtrZ[index]=0;
+                    }
+                    for(index=line*warpedDim[0]+start, x=start; x<end; x++, index++)
+                    {
+                        grad[0]=grad[1]=grad[2]=0.0;
+
+                        world[0]=static_cast<float>(deformationFieldPtrX[index]);
+                        world[1]=static_cast<float>(deformationFieldPtrY[index]);
+                        world[2]=static_cast<float>(deformationFieldPtrZ[index]);
+
+                        // real -> voxel; floating space
+                        reg_mat44_mul(floatingIJKMatrix, world, position);
+                        voxel[0]=position[0];
+                        voxel[1]=position[1];
+                        voxel[2]=position[2];
+
+                        // Weights used by the volumes whose gradient is not required
+                        reg_getInterpolationWeights<kernel,3>(floatingDim, voxel, weights);
+
+                        for(t=0; t<volumeNumber; t++)
+                        {
+                            const FloatingTYPE *floatingIntensity = &floatingIntensityPtr[t*floatingVoxelNumber];
+                            double intensity;
+                            if(t==activeVolume)
+                            {
+                                intensity=reg_interpolateIntensityAndGradient3D<FloatingTYPE,kernel>(floatingIntensity,
+                                                                                                    floatingDim,
+                                                                                                    floatingPlaneNumber,
+                                                                                                    voxel,
+                                                                                                    padding,
+                                                                                                    grad);
+                                grad[0]=grad[0]==grad[0]?grad[0]:0.0;
+                                grad[1]=grad[1]==grad[1]?grad[1]:0.0;
+                                grad[2]=grad[2]==grad[2]?grad[2]:0.0;
+                            }
+                            else intensity=reg_applyInterpolationWeights3D<FloatingTYPE,kernel>(floatingIntensity,
+                                                                                               floatingDim,
+                                                                                               floatingPlaneNumber,
+                                                                                               weights,
+                                                                                               padding);
+                            warpedIntensityPtr[t*warpedVoxelNumber+index]=reg_castIntensity<FloatingTYPE>(intensity);
+                        }
+
+                        warpedGradientPtrX[index] = static_cast<FieldTYPE>(grad[0]);
+                        warpedGradientPtrY[index] = static_cast<FieldTYPE>(grad[1]);
+                        warpedGradientPtrZ[index] = static_cast<FieldTYPE>(grad[2]);
+                    }
+                }
+                for(index=line*warpedDim[0]+x; x<tileEnd[0]; x++, index++)
+                {
+                    for(t=0; t<volumeNumber; t++)
+                        warpedIntensityPtr[t*warpedVoxelNumber+index]=warpedPadding;
+                    warpedGradientPtrX[index]=warpedGradientPtrY[index]=warpedGradientPtrZ[index]=0;
+                }
+            }
+        }
+    }
+}
+/* *************************************************************** */
+template<class FloatingTYPE, class FieldTYPE, int kernel>
+void ResampleImageAndGradient2D_core(nifti_image *floatingImage,
+                                     nifti_image *deformationField,
+                                     nifti_image *warpedImage,
+                                     nifti_image *warImgGradient,
+                                     const reg_maskSpans *maskSpans,
+                                     FieldTYPE paddingValue,
+                                     int active_timepoint)
+{
+#ifdef _WIN32
+    long  index;
+    long warpedVoxelNumber = (long)warpedImage->nx*warpedImage->ny;
+    long floatingVoxelNumber = (long)floatingImage->nx*floatingImage->ny;
+#else
+    size_t  index;
+    size_t warpedVoxelNumber = (size_t)warpedImage->nx*warpedImage->ny;
+    size_t floatingVoxelNumber = (size_t)floatingImage->nx*floatingImage->ny;
+#endif
+    FloatingTYPE *floatingIntensityPtr = static_cast<FloatingTYPE *>(floatingImage->data);
+    FloatingTYPE *warpedIntensityPtr = static_cast<FloatingTYPE *>(warpedImage->data);
+    FieldTYPE *deformationFieldPtrX = static_cast<FieldTYPE *>(deformationField->data);
+    FieldTYPE *deformationFieldPtrY = &deformationFieldPtrX[warpedVoxelNumber];
+
+    FieldTYPE *warpedGradientPtrX = static_cast<FieldTYPE *>(warImgGradient->data);
+    FieldTYPE *warpedGradientPtrY = &warpedGradientPtrX[warpedVoxelNumber];
+
+    mat44 *floatingIJKMatrix;
+    if(floatingImage->sform_code>0)
+        floatingIJKMatrix=&(floatingImage->sto_ijk);
+    else floatingIJKMatrix=&(floatingImage->qto_ijk);
+
+    int floatingDim[2]={floatingImage->nx, floatingImage->ny};
+    size_t volumeNumber = (size_t)warpedImage->nt*warpedImage->nu;
+    size_t activeVolume = (size_t)active_timepoint;
+    double padding = static_cast<double>(paddingValue);
+    FloatingTYPE warpedPadding = reg_castIntensity<FloatingTYPE>(padding);
+
+#ifndef NDEBUG
+    char text[255];
+    sprintf(text, "2D resampling and gradient computation of volume number %i", active_timepoint);
+    reg_print_msg_debug(text);
+#endif
+
+    size_t t, span;
+    int x, y, start, end;
+    float world[3] = {0.0, 0.0, 0.0};
+    float position[3] = {0.0, 0.0, 0.0};
+    double voxel[2], grad[2];
+    reg_interpWeights<kernel,2> weights;
+    // Only the active spans of every line are interpolated, the voxels in between
+    // are padded with a null gradient
+#if defined (_OPENMP)
+#pragma omp parallel for default(none) \
+    firstprivate(world, position) \
+    private(x, y, start, end, span, index, t, voxel, grad, weights) \
+    shared(floatingIntensityPtr, warpedIntensityPtr, warpedVoxelNumber, floatingVoxelNumber, \
+    deformationFieldPtrX, deformationFieldPtrY, maskSpans, \
+    warpedGradientPtrX, warpedGradientPtrY, volumeNumber, activeVolume, \
+    floatingIJKMatrix, floatingDim, padding, warpedPadding, warpedImage)
+#endif // _OPENMP
+    for(y=0; y<warpedImage->ny; y++)
+    {
+        x=0;
+        for(span=maskSpans->lineSpan[y]; span<maskSpans->lineSpan[y+1]; span++)
+        {
+            start=maskSpans->spanStart[span];
+            end=maskSpans->spanEnd[span];
+            for(index=(size_t)y*warpedImage->nx+x; x<start; x++, index++)
+            {
+                for(t=0; t<volumeNumber; t++)
+                    warpedIntensityPtr[t*warpedVoxelNumber+index]=warpedPadding;
+                warpedGradientPtrX[index]=warpedGradientPtrY[index]=0;
+            }
+            for(index=(size_t)y*warpedImage->nx+start, x=start; x<end; x++, index++)
+            {
+                grad[0]=grad[1]=0.0;
+
+                world[0] = static_cast<float>(deformationFieldPtrX[index]);
+                world[1] = static_cast<float>(deformationFieldPtrY[index]);
+
+                // real -> voxel; floating space
+                reg_mat44_mul(floatingIJKMatrix, world, position);
+                voxel[0]=position[0];
+                voxel[1]=position[1];
+
+                // Weights used by the volumes whose gradient is not required
+                reg_getInterpolationWeights<kernel,2>(floatingDim, voxel, weights);
+
+                for(t=0; t<volumeNumber; t++)
+                {
+                    const FloatingTYPE *floatingIntensity = &floatingIntensityPtr[t*floatingVoxelNumber];
+                    double intensity;
+                    if(t==activeVolume)
+                    {
+                        intensity=reg_interpolateIntensityAndGradient2D<FloatingTYPE,kernel>(floatingIntensity,
+                                                                                            floatingDim,
+                                                                                            voxel,
+                                                                                            padding,
+                                                                                            grad);
+                        grad[0]=grad[0]==grad[0]?grad[0]:0.0;
+                        grad[1]=grad[1]==grad[1]?grad[1]:0.0;
+                    }
+                    else intensity=reg_applyInterpolationWeights2D<FloatingTYPE,kernel>(floatingIntensity,
+                                                                                       floatingDim,
+                                                                                       weights,
+                                                                                       padding);
+                    warpedIntensityPtr[t*warpedVoxelNumber+index]=reg_castIntensity<FloatingTYPE>(intensity);
+                }
+
+                warpedGradientPtrX[index] = static_cast<FieldTYPE>(grad[0]);
+                warpedGradientPtrY[index] = static_cast<FieldTYPE>(grad[1]);
+            }
+        }
+        for(index=(size_t)y*warpedImage->nx+x; x<warpedImage->nx; x++, index++)
+        {
+            for(t=0; t<volumeNumber; t++)
+                warpedIntensityPtr[t*warpedVoxelNumber+index]=warpedPadding;
+            warpedGradientPtrX[index]=warpedGradientPtrY[index]=0;
+        }
+    }
+}
+/* *************************************************************** */
+template <class FieldTYPE, class FloatingTYPE>
+void reg_resampleImageAndGradient2(nifti_image *floatingImage,
+                                   nifti_image *warpedImage,
+                                   nifti_image *warImgGradient,
+                                   nifti_image *deformationField,
+                                   const reg_maskSpans *maskSpans,
+                                   int interp,
+                                   FieldTYPE paddingValue,
+                                   int active_timepoint)
+{
+    if(deformationField->nz>1)
+    {
+        if(interp==3)
+            ResampleImageAndGradient3D_core<FloatingTYPE,FieldTYPE,3>
+                    (floatingImage, deformationField, warpedImage, warImgGradient,
+                     maskSpans, paddingValue, active_timepoint);
+        else ResampleImageAndGradient3D_core<FloatingTYPE,FieldTYPE,1>
+                (floatingImage, deformationField, warpedImage, warImgGradient,
+                 maskSpans, paddingValue, active_timepoint);
+    }
+    else
+    {
+        if(interp==3)
+            ResampleImageAndGradient2D_core<FloatingTYPE,FieldTYPE,3>
+                    (floatingImage, deformationField, warpedImage, warImgGradient,
+                     maskSpans, paddingValue, active_timepoint);
+        else ResampleImageAndGradient2D_core<FloatingTYPE,FieldTYPE,1>
+                (floatingImage, deformationField, warpedImage, warImgGradient,
+                 maskSpans, paddingValue, active_timepoint);
+    }
+}
+/* *************************************************************** */
+template <class FieldTYPE>
+void reg_resampleImageAndGradient1(nifti_image *floatingImage,
+                                   nifti_image *warpedImage,
+                                   nifti_image *warImgGradient,
+                                   nifti_image *deformationField,
+                                   const reg_maskSpans *maskSpans,
+                                   int interp,
+                                   FieldTYPE paddingValue,
+                                   int active_timepoint)
+{
+    switch(floatingImage->datatype)
+    {
+    case NIFTI_TYPE_UINT8:
+        reg_resampleImageAndGradient2<FieldTYPE,unsigned char>
+                (floatingImage,warpedImage,warImgGradient,deformationField,maskSpans,interp,paddingValue,active_timepoint);
+        break;
+    case NIFTI_TYPE_INT8:
+        reg_resampleImageAndGradient2<FieldTYPE,char>
+                (floatingImage,warpedImage,warImgGradient,deformationField,maskSpans,interp,paddingValue,active_timepoint);
+        break;
+    case NIFTI_TYPE_UINT16:
+        reg_resampleImageAndGradient2<FieldTYPE,unsigned short>
+                (floatingImage,warpedImage,warImgGradient,deformationField,maskSpans,interp,paddingValue,active_timepoint);
+        break;
+    case NIFTI_TYPE_INT16:
+        reg_resampleImageAndGradient2<FieldTYPE,short>
+                (floatingImage,warpedImage,warImgGradient,deformationField,maskSpans,interp,paddingValue,active_timepoint);
+        break;
+    case NIFTI_TYPE_UINT32:
+        reg_resampleImageAndGradient2<FieldTYPE,unsigned int>
+                (floatingImage,warpedImage,warImgGradient,deformationField,maskSpans,interp,paddingValue,active_timepoint);
+        break;
+    case NIFTI_TYPE_INT32:
+        reg_resampleImageAndGradient2<FieldTYPE,int>
+                (floatingImage,warpedImage,warImgGradient,deformationField,maskSpans,interp,paddingValue,active_timepoint);
+        break;
+    case NIFTI_TYPE_FLOAT32:
+        reg_resampleImageAndGradient2<FieldTYPE,float>
+                (floatingImage,warpedImage,warImgGradient,deformationField,maskSpans,interp,paddingValue,active_timepoint);
+        break;
+    case NIFTI_TYPE_FLOAT64:
+        reg_resampleImageAndGradient2<FieldTYPE,double>
+                (floatingImage,warpedImage,warImgGradient,deformationField,maskSpans,interp,paddingValue,active_timepoint);
+        break;
+    default:
+        reg_print_fct_error("reg_resampleImageAndGradient1");
+        reg_print_msg_error("Unsupported floating image datatype");
+        reg_exit();
+    }
+}
+/* *************************************************************** */
+void reg_resampleImageAndGradient_spans(nifti_image *floatingImage,
+                                        nifti_image *warpedImage,
+                                        nifti_image *warImgGradient,
+                                        nifti_image *deformationField,
+                                        const reg_maskSpans *maskSpans,
+                                        int interp,
+                                        float paddingValue,
+                                        int active_timepoint)
+{
+    // Only the linear and cubic spline kernels have a derivative. The gradient
+    // is expected to be stored with the same precision as the deformation field.
+    if((interp!=1 && interp!=3) || warImgGradient->datatype!=deformationField->datatype)
+    {
+        reg_resampleImage_spans(floatingImage,
+                                warpedImage,
+                                deformationField,
+                                maskSpans,
+                                interp,
+                                paddingValue);
+        reg_getImageGradient_spans(floatingImage,
+                                   warImgGradient,
+                                   deformationField,
+                                   maskSpans,
+                                   interp,
+                                   paddingValue,
+                                   active_timepoint);
+        return;
+    }
+
+    if(floatingImage->datatype != warpedImage->datatype)
+    {
+        reg_print_fct_error("reg_resampleImageAndGradient_spans");
+        reg_print_msg_error("The floating and warped image should have the same data type");
+        reg_exit();
+    }
+    if(floatingImage->nt != warpedImage->nt)
+    {
+        reg_print_fct_error("reg_resampleImageAndGradient_spans");
+        reg_print_msg_error("The floating and warped images have different dimension along the time axis");
+        reg_exit();
+    }
+    if(active_timepoint<0 || active_timepoint>=floatingImage->nt)
+    {
+        reg_print_fct_error("reg_resampleImageAndGradient_spans");
+        reg_print_msg_error("The specified active timepoint is not defined in the floating image");
+        reg_exit();
+    }
+
+    // All voxels are considered if no spans are provided
+    reg_maskSpans *temporarySpans=NULL;
+    if(maskSpans==NULL)
+    {
+        int warpedDim[3]={deformationField->nx, deformationField->ny, deformationField->nz};
+        maskSpans=temporarySpans=reg_tools_createMaskSpans(NULL, warpedDim);
+    }
+
+    switch(deformationField->datatype)
+    {
+    case NIFTI_TYPE_FLOAT32:
+        reg_resampleImageAndGradient1<float>
+                (floatingImage,warpedImage,warImgGradient,deformationField,maskSpans,interp,paddingValue,active_timepoint);
+        break;
+    case NIFTI_TYPE_FLOAT64:
+        reg_resampleImageAndGradient1<double>
+                (floatingImage,warpedImage,warImgGradient,deformationField,maskSpans,interp,paddingValue,active_timepoint);
+        break;
+    default:
+        reg_print_fct_error("reg_resampleImageAndGradient_spans");
+        reg_print_msg_error("Unsupported deformation field image datatype");
+        reg_exit();
+        break;
+    }
+    reg_tools_freeMaskSpans(temporarySpans);
+}
+/* *************************************************************** */
+void reg_resampleImageAndGradient(nifti_image *floatingImage,
+                                  nifti_image *warpedImage,
+                                  nifti_image *warImgGradient,
+                                  nifti_image *deformationField,
+                                  int *mask,
+                                  int interp,
+                                  float paddingValue,
+                                  int active_timepoint)
+{
+    int warpedDim[3]={deformationField->nx, deformationField->ny, deformationField->nz};
+    reg_maskSpans *maskSpans=reg_tools_createMaskSpans(mask, warpedDim);
+    reg_resampleImageAndGradient_spans(floatingImage,
+                                       warpedImage,
+                                       warImgGradient,
+                                       deformationField,
+                                       maskSpans,
+                                       interp,
+                                       paddingValue,
+                                       active_timepoint);
+    reg_tools_freeMaskSpans(maskSpans);
+}
+/* *************************************************************** */
 /* *************************************************************** */
 template<class DTYPE>
 void reg_getImageGradient_symDiff_core(nifti_image *img,
@@ -15,6 +15,7 @@
 #define _REG_RESAMPLING_H
 
 #include "nifti1_io.h"
+#include "_reg_tools.h"
 
 /** @brief This function resample a floating image into the space of a reference/warped image.
  * The deformation is provided by a 4D nifti image which is in the space of the reference image.
@@ -43,6 +44,75 @@ void reg_resampleImage(nifti_image *floatingImage,
                        float paddingValue,
                        bool *dti_timepoint = NULL,
                        mat33 * jacMat = NULL);
+/** @brief This function resample a floating image into the space of a reference/warped image.
+ * It is equivalent to reg_resampleImage, without the diffusion tensor handling, but the active
+ * voxels are provided as spans so that only those are interpolated.
+ * @param floatingImage Floating image that is interpolated
+ * @param warpedImage Warped image that is being generated
+ * @param deformationField Vector field image that contains the dense correspondences
+ * @param maskSpans Spans of active voxels, as created by reg_tools_createMaskSpans. The voxels
+ * outside of the spans are set to the padding value. If NULL, all voxels are considered
+ * @param interp Interpolation type. 0, 1, 3 or 4 correspond to nearest neighbor, linear, cubic
+ * or sinc interpolation
+ * @param paddingValue Value to be used for padding when the correspondences are outside of the
+ * floating image space.
+ */
+extern "C++"
+void reg_resampleImage_spans(nifti_image *floatingImage,
+                             nifti_image *warpedImage,
+                             nifti_image *deformationField,
+                             const reg_maskSpans *maskSpans,
+                             int interp,
+                             float paddingValue);
+/** @brief This function resample a floating image into the space of a reference/warped image
+ * using an affine transformation. The floating voxel positions are computed on the fly from the
+ * transformation matrix so no deformation field is required.
+ * @param floatingImage Floating image that is interpolated
+ * @param warpedImage Warped image that is being generated. Its header defines the reference space
+ * @param affineTransformation Affine matrix, in real coordinates, from the reference to the floating space
+ * @param mask Array that contains information about the mask. Only voxel with positive or null mask
+ * value are being considered. If NULL, all voxels are considered
+ * @param interp Interpolation type. 0, 1, 3 or 4 correspond to nearest neighbor, linear, cubic
+ * or sinc interpolation
+ * @param paddingValue Value to be used for padding when the correspondences are outside of the
+ * floating image space.
+ */
+extern "C++"
+void reg_resampleImage_affine(nifti_image *floatingImage,
+                              nifti_image *warpedImage,
+                              mat44 *affineTransformation,
+                              int *mask,
+                              int interp,
+                              float paddingValue);
+/** @brief This function resample a floating image into the space of a reference/warped image
+ * using an affine transformation. It is equivalent to reg_resampleImage_affine but the active
+ * voxels are provided as spans so that only those are interpolated.
+ * @param maskSpans Spans of active voxels, as created by reg_tools_createMaskSpans. The voxels
+ * outside of the spans are set to the padding value. If NULL, all voxels are considered
+ */
+extern "C++"
+void reg_resampleImage_affine_spans(nifti_image *floatingImage,
+                                    nifti_image *warpedImage,
+                                    mat44 *affineTransformation,
+                                    const reg_maskSpans *maskSpans,
+                                    int interp,
+                                    float paddingValue);
+/** @brief This function resample a floating image into the space of a reference/warped image
+ * while accounting for the point spread function of both images.
+ * @param floatingImage Floating image that is interpolated
+ * @param warpedImage Warped image that is being generated
+ * @param deformationField Vector field image that contains the dense correspondences
+ * @param mask Array that contains information about the mask. Only voxel with positive or null mask
+ * value are being considered. If NULL, all voxels are considered
+ * @param interp Interpolation type. 1, 3 or 4 correspond to linear, cubic or sinc interpolation
+ * @param paddingValue Value to be used for padding when the correspondences are outside of the
+ * floating image space.
+ * @param jacMat Jacobian matrix of the transformation at every voxel
+ * @param algorithm PSF estimation: matrix metric (0), determinant (1) or sinc (2)
+ * @param fastPSF If true, the PSF is applied as a separable convolution of the floating image when
+ * it is shared by all voxels and axis-aligned, and is otherwise cached per quantised Jacobian matrix.
+ * The result approximates the exact PSF resampling. It is ignored for the sinc algorithm.
+ */
 extern "C++"
 void reg_resampleImage_PSF(nifti_image *floatingImage,
                            nifti_image *warpedImage,
@@ -51,7 +121,8 @@ void reg_resampleImage_PSF(nifti_image *floatingImage,
                            int interp,
                            float paddingValue,
                            mat33 * jacMat,
-                           char algorithm);
+                           char algorithm,
+                           bool fastPSF = false);
 
 
 extern "C++"
@@ -73,6 +144,56 @@ void reg_getImageGradient(nifti_image *floatingImage,
                           mat33 *jacMat = NULL,
                           nifti_image *warpedImage = NULL);
 
+/** @brief This function computes the warped image gradient of one time point of a floating
+ * image. It is equivalent to reg_getImageGradient, without the diffusion tensor handling, but
+ * the active voxels are provided as spans. The gradient is null outside of the spans.
+ */
+extern "C++"
+void reg_getImageGradient_spans(nifti_image *floatingImage,
+                                nifti_image *warImgGradient,
+                                nifti_image *deformationField,
+                                const reg_maskSpans *maskSpans,
+                                int interp,
+                                float paddingValue,
+                                int active_timepoint);
+
+/** @brief This function resamples all the volumes of a floating image and computes the
+ * warped image gradient of one of them in a single pass over the reference space. The
+ * result is equivalent to calling reg_resampleImage followed by reg_getImageGradient.
+ * @param floatingImage Floating image that is interpolated
+ * @param warpedImage Warped image that is being generated
+ * @param warImgGradient Warped image gradient that is being generated
+ * @param deformationField Vector field image that contains the dense correspondences
+ * @param mask Array that contains information about the mask. Only voxel with positive or null mask
+ * value are being considered. If NULL, all voxels are considered
+ * @param interp Interpolation type. Linear (1) and cubic spline (3) interpolations are computed
+ * in a single pass, the other interpolation types fall back to the two separate calls
+ * @param paddingValue Value to be used for padding when the correspondences are outside of the
+ * floating image space.
+ * @param active_timepoint Time point of the floating image whose gradient is computed
+ */
+extern "C++"
+void reg_resampleImageAndGradient(nifti_image *floatingImage,
+                                  nifti_image *warpedImage,
+                                  nifti_image *warImgGradient,
+                                  nifti_image *deformationField,
+                                  int *mask,
+                                  int interp,
+                                  float paddingValue,
+                                  int active_timepoint);
+/** @brief Equivalent to reg_resampleImageAndGradient with the active voxels provided as spans,
+ * as created by reg_tools_createMaskSpans.
+ */
+extern "C++"
+void reg_resampleImageAndGradient_spans(nifti_image *floatingImage,
+                                        nifti_image *warpedImage,
+                                        nifti_image *warImgGradient,
+                                        nifti_image *deformationField,
+                                        const reg_maskSpans *maskSpans,
+                                        int interp,
+                                        float paddingValue,
+                                        int active_timepoint);
+
 extern "C++"
 void reg_getImageGradient_symDiff(nifti_image* inputImg,
                                   nifti_image* gradImg,
@@ -81,5 +202,23 @@ void reg_getImageGradient_symDiff(nifti_image* inputImg,
                                   int timepoint);
 extern "C++"
 nifti_image *reg_makeIsotropic(nifti_image *, int);
+/** @brief Computes the six windowed sinc interpolation weights of the
+ * nodes surrounding a position, given its distance to the previous node.
+ */
+extern "C++"
+void interpWindowedSincKernel(double relative, double *basis);
+/** @brief Tabulated version of interpWindowedSincKernel, linearly
+ * interpolated between samples. The weights differ by less than 5.2e-7.
+ */
+extern "C++"
+void interpWindowedSincKernel_LUT(double relative, double *basis);
+/** @brief Windowed sinc kernel value at a distance x from its centre */
+extern "C++"
+double interpWindowedSincKernel_Samp(double x, double kernelsize);
+/** @brief Tabulated version of interpWindowedSincKernel_Samp for a kernel
+ * of radius 3. The values differ by less than 4.4e-7.
+ */
+extern "C++"
+double interpWindowedSincKernel_Samp_LUT(double x);
 
 #endif
@@ -0,0 +1,430 @@
+/*
+ *  _reg_simd.cpp
+ *
+ *
+ *  Copyright (c) 2018, NiftyReg Developers.
+ *  All rights reserved.
+ *  See the LICENSE.txt file in the nifty_reg root folder
+ *
+ */
+
+#include "_reg_simd.h"
+#include "_reg_maths.h"
+#include <string.h>
+#include <stdlib.h>
+
+#if defined(_MSC_VER) && (defined(_M_X64) || defined(_M_IX86))
+#include <intrin.h>
+#endif
+
+#if defined(__x86_64__) || defined(__i386__) || defined(_M_X64) || defined(_M_IX86)
+#define REG_SIMD_X86
+#endif
+
+#ifdef _BUILD_AVX2_KERNELS
+extern const reg_simd_kernels reg_simd_kernels_avx2;
+#endif
+#ifdef _BUILD_AVX512_KERNELS
+extern const reg_simd_kernels reg_simd_kernels_avx512;
+#endif
+
+/* *************************************************************** */
+/* *************************************************************** */
+static void reg_simd_splineValue_none(const float *xBasis,
+                                      const float *yBasis,
+                                      const float *zBasis,
+                                      const float *xControlPoint,
+                                      const float *yControlPoint,
+                                      const float *zControlPoint,
+                                      float *result)
+{
+   reg_simd_splineValue<float>(NULL, xBasis, yBasis, zBasis,
+                               xControlPoint, yControlPoint, zControlPoint,
+                               result);
+}
+/* *************************************************************** */
+static void reg_simd_splineJacobian_none(const float *basisX,
+                                         const float *basisY,
+                                         const float *basisZ,
+                                         const float *coeffX,
+                                         const float *coeffY,
+                                         const float *coeffZ,
+                                         float *jacobian)
+{
+   reg_simd_splineJacobian<float>(NULL, basisX, basisY, basisZ,
+                                  coeffX, coeffY, coeffZ,
+                                  jacobian);
+}
+/* *************************************************************** */
+static void reg_simd_splineCollapse_none(const float *basis,
+                                         const float *values,
+                                         int width,
+                                         float *result)
+{
+   reg_simd_splineCollapse<float>(NULL, basis, values, width, result);
+}
+/* *************************************************************** */
+static void reg_simd_convolutionWindow_none(const float *kernel,
+                                            const float *intensity,
+                                            const float *density,
+                                            int length,
+                                            double *intensitySum,
+                                            double *densitySum)
+{
+   reg_simd_convolutionWindow<float>(NULL, kernel, intensity, density, length,
+                                     intensitySum, densitySum);
+}
+/* *************************************************************** */
+static void reg_simd_convolutionColumns_none(const float *kernel,
+                                             const float *values,
+                                             int length,
+                                             float *result)
+{
+   reg_simd_convolutionColumns<float>(NULL, kernel, values, length, result);
+}
+/* *************************************************************** */
+static const reg_simd_kernels reg_simd_kernels_none =
+{
+   reg_simd_splineValue_none,
+   reg_simd_splineJacobian_none,
+   reg_simd_splineCollapse_none,
+   reg_simd_convolutionWindow_none,
+   reg_simd_convolutionColumns_none
+};
+/* *************************************************************** */
+/* *************************************************************** */
+#if _USE_SSE
+static inline float reg_simd_sum_sse(__m128 value)
+{
+   union
+   {
+      __m128 m;
+      float f[4];
+   } val;
+   val.m = value;
+   return val.f[0]+val.f[1]+val.f[2]+val.f[3];
+}
+/* *************************************************************** */
+static void reg_simd_splineValue_sse(const float *xBasis,
+                                     const float *yBasis,
+                                     const float *zBasis,
+                                     const float *xControlPoint,
+                                     const float *yControlPoint,
+                                     const float *zControlPoint,
+                                     float *result)
+{
+   __m128 tempX = _mm_setzero_ps();
+   __m128 tempY = _mm_setzero_ps();
+   __m128 tempZ = _mm_setzero_ps();
+   __m128 xBasis_sse = _mm_loadu_ps(xBasis);
+   for(int c=0; c<4; c++)
+   {
+      __m128 zBasis_sse = _mm_set_ps1(zBasis[c]);
+      for(int b=0; b<4; b++)
+      {
+         __m128 basis_sse = _mm_mul_ps(_mm_mul_ps(_mm_set_ps1(yBasis[b]), zBasis_sse),
+                                       xBasis_sse);
+         int coord = c*16+b*4;
+         tempX = _mm_add_ps(_mm_mul_ps(basis_sse, _mm_loadu_ps(&xControlPoint[coord])), tempX);
+         tempY = _mm_add_ps(_mm_mul_ps(basis_sse, _mm_loadu_ps(&yControlPoint[coord])), tempY);
+         tempZ = _mm_add_ps(_mm_mul_ps(basis_sse, _mm_loadu_ps(&zControlPoint[coord])), tempZ);
+      }
+   }
+   result[0] = reg_simd_sum_sse(tempX);
+   result[1] = reg_simd_sum_sse(tempY);
+   result[2] = reg_simd_sum_sse(tempZ);
+}
+/* *************************************************************** */
+static void reg_simd_splineJacobian_sse(const float *basisX,
+                                        const float *basisY,
+                                        const float *basisZ,
+                                        const float *coeffX,
+                                        const float *coeffY,
+                                        const float *coeffZ,
+                                        float *jacobian)
+{
+   __m128 sum[9];
+   for(int i=0; i<9; ++i) sum[i] = _mm_setzero_ps();
+   for(int n=0; n<64; n+=4)
+   {
+      __m128 bX = _mm_loadu_ps(&basisX[n]);
+      __m128 bY = _mm_loadu_ps(&basisY[n]);
+      __m128 bZ = _mm_loadu_ps(&basisZ[n]);
+      __m128 cX = _mm_loadu_ps(&coeffX[n]);
+      __m128 cY = _mm_loadu_ps(&coeffY[n]);
+      __m128 cZ = _mm_loadu_ps(&coeffZ[n]);
+      sum[0] = _mm_add_ps(_mm_mul_ps(bX, cX), sum[0]);
+      sum[1] = _mm_add_ps(_mm_mul_ps(bY, cX), sum[1]);
+      sum[2] = _mm_add_ps(_mm_mul_ps(bZ, cX), sum[2]);
+      sum[3] = _mm_add_ps(_mm_mul_ps(bX, cY), sum[3]);
+      sum[4] = _mm_add_ps(_mm_mul_ps(bY, cY), sum[4]);
+      sum[5] = _mm_add_ps(_mm_mul_ps(bZ, cY), sum[5]);
+      sum[6] = _mm_add_ps(_mm_mul_ps(bX, cZ), sum[6]);
+      sum[7] = _mm_add_ps(_mm_mul_ps(bY, cZ), sum[7]);
+      sum[8] = _mm_add_ps(_mm_mul_ps(bZ, cZ), sum[8]);
+   }
+   for(int i=0; i<9; ++i)
+      jacobian[i] = reg_simd_sum_sse(sum[i]);
+}
+/* *************************************************************** */
+static void reg_simd_splineCollapse_sse(const float *basis,
+                                        const float *values,
+                                        int width,
+                                        float *result)
+{
+   const __m128 b0 = _mm_set1_ps(basis[0]);
+   const __m128 b1 = _mm_set1_ps(basis[1]);
+   const __m128 b2 = _mm_set1_ps(basis[2]);
+   const __m128 b3 = _mm_set1_ps(basis[3]);
+   for(int j=0; j<width; j+=4)
+   {
+      __m128 sum = _mm_mul_ps(b0, _mm_loadu_ps(&values[j]));
+      sum = _mm_add_ps(_mm_mul_ps(b1, _mm_loadu_ps(&values[width+j])), sum);
+      sum = _mm_add_ps(_mm_mul_ps(b2, _mm_loadu_ps(&values[2*width+j])), sum);
+      sum = _mm_add_ps(_mm_mul_ps(b3, _mm_loadu_ps(&values[3*width+j])), sum);
+      _mm_storeu_ps(&result[j], sum);
+   }
+}
+/* *************************************************************** */
+static void reg_simd_convolutionWindow_sse(const float *kernel,
+                                           const float *intensity,
+                                           const float *density,
+                                           int length,
+                                           double *intensitySum,
+                                           double *densitySum)
+{
+   __m128 intensity_sum_sse = _mm_setzero_ps();
+   __m128 density_sum_sse = _mm_setzero_ps();
+   int k=0;
+   for(; k<length-3; k+=4)
+   {
+      __m128 kernel_sse = _mm_loadu_ps(&kernel[k]);
+      intensity_sum_sse = _mm_add_ps(_mm_mul_ps(kernel_sse, _mm_loadu_ps(&intensity[k])), intensity_sum_sse);
+      density_sum_sse = _mm_add_ps(_mm_mul_ps(kernel_sse, _mm_loadu_ps(&density[k])), density_sum_sse);
+   }
+   double intensityValue = reg_simd_sum_sse(intensity_sum_sse);
+   double densityValue = reg_simd_sum_sse(density_sum_sse);
+   for(; k<length; ++k)
+   {
+      intensityValue += kernel[k] * intensity[k];
+      densityValue   += kernel[k] * density[k];
+   }
+   *intensitySum=intensityValue;
+   *densitySum=densityValue;
+}
+/* *************************************************************** */
+static void reg_simd_convolutionColumns_sse(const float *kernel,
+                                            const float *values,
+                                            int length,
+                                            float *result)
+{
+   __m128 sum_sse[REG_SIMD_COLUMN_NUMBER/4];
+   for(int c=0; c<REG_SIMD_COLUMN_NUMBER/4; ++c)
+      sum_sse[c] = _mm_setzero_ps();
+   for(int k=0; k<length; ++k)
+   {
+      const __m128 kernel_sse = _mm_set1_ps(kernel[k]);
+      const float *current = &values[k*REG_SIMD_COLUMN_NUMBER];
+      for(int c=0; c<REG_SIMD_COLUMN_NUMBER/4; ++c)
+         sum_sse[c] = _mm_add_ps(_mm_mul_ps(kernel_sse, _mm_loadu_ps(&current[4*c])), sum_sse[c]);
+   }
+   for(int c=0; c<REG_SIMD_COLUMN_NUMBER/4; ++c)
+      _mm_storeu_ps(&result[4*c], sum_sse[c]);
+}
+/* *************************************************************** */
+static const reg_simd_kernels reg_simd_kernels_sse =
+{
+   reg_simd_splineValue_sse,
+   reg_simd_splineJacobian_sse,
+   reg_simd_splineCollapse_sse,
+   reg_simd_convolutionWindow_sse,
+   reg_simd_convolutionColumns_sse
+};
+#endif // _USE_SSE
+/* *************************************************************** */
+/* *************************************************************** */
+static bool reg_simd_isCompiled(NREG_SIMD_TYPE type)
+{
+   switch(type)
+   {
+   case SIMD_NONE:
+      return true;
+   case SIMD_SSE:
+#if _USE_SSE
+      return true;
+#else
+      return false;
+#endif
+   case SIMD_AVX2:
+#ifdef _BUILD_AVX2_KERNELS
+      return true;
+#else
+      return false;
+#endif
+   case SIMD_AVX512:
+#ifdef _BUILD_AVX512_KERNELS
+      return true;
+#else
+      return false;
+#endif
+   }
+   return false;
+}
+/* *************************************************************** */
+static bool reg_simd_isCPUSupported(NREG_SIMD_TYPE type)
+{
+#if defined(REG_SIMD_X86) && defined(_MSC_VER)
+   int info[4];
+   __cpuid(info, 1);
+   bool sse3 = (info[2] & 1) != 0;
+   bool fma = (info[2] & (1<<12)) != 0;
+   bool osxsave = (info[2] & (1<<27)) != 0;
+   bool avx = (info[2] & (1<<28)) != 0;
+   unsigned long long xcr0 = osxsave ? _xgetbv(0) : 0;
+   __cpuidex(info, 7, 0);
+   bool avx2 = (info[1] & (1<<5)) != 0;
+   bool avx512f = (info[1] & (1<<16)) != 0;
+   switch(type)
+   {
+   case SIMD_NONE:
+      return true;
+   case SIMD_SSE:
+      return sse3;
+   case SIMD_AVX2:
+      // The OS has to save the YMM registers
+      return avx && fma && avx2 && (xcr0 & 0x6) == 0x6;
+   case SIMD_AVX512:
+      // The OS has to save the opmask and ZMM registers
+      return avx && fma && avx2 && avx512f && (xcr0 & 0xe6) == 0xe6;
+   }
+   return false;
+#elif defined(REG_SIMD_X86)
+   __builtin_cpu_init();
+   switch(type)
+   {
+   case SIMD_NONE:
+      return true;
+   case SIMD_SSE:
+      return __builtin_cpu_supports("sse3");
+   case SIMD_AVX2:
+      return __builtin_cpu_supports("avx2") && __builtin_cpu_supports("fma");
+   case SIMD_AVX512:
+      return __builtin_cpu_supports("avx512f") &&
+            __builtin_cpu_supports("avx2") && __builtin_cpu_supports("fma");
+   }
+   return false;
+#else
+   return type==SIMD_NONE;
+#endif
+}
+/* *************************************************************** */
+static bool reg_simd_isSupported(NREG_SIMD_TYPE type)
+{
+   return reg_simd_isCompiled(type) && reg_simd_isCPUSupported(type);
+}
+/* *************************************************************** */
+static NREG_SIMD_TYPE reg_simd_clampType(NREG_SIMD_TYPE type)
+{
+   while(type>SIMD_NONE && !reg_simd_isSupported(type))
+      type = static_cast<NREG_SIMD_TYPE>(type-1);
+   return type;
+}
+/* *************************************************************** */
+static NREG_SIMD_TYPE reg_simd_initialType()
+{
+   NREG_SIMD_TYPE type = reg_simd_getCPUType();
+   const char *request = getenv("NIFTYREG_SIMD");
+   if(request!=NULL)
+   {
+      NREG_SIMD_TYPE requestedType = type;
+      if(strcmp(request, "none")==0) requestedType = SIMD_NONE;
+      else if(strcmp(request, "sse")==0) requestedType = SIMD_SSE;
+      else if(strcmp(request, "avx2")==0) requestedType = SIMD_AVX2;
+      else if(strcmp(request, "avx512")==0) requestedType = SIMD_AVX512;
+      else
+      {
+         reg_print_fct_warn("reg_simd_getType");
+         reg_print_msg_warn("NIFTYREG_SIMD is expected to be none, sse, avx2 or avx512. It is ignored");
+      }
+      if(requestedType<type)
+         type = reg_simd_clampType(requestedType);
+   }
+   return type;
+}
+/* *************************************************************** */
+static NREG_SIMD_TYPE reg_simd_selectedType = reg_simd_initialType();
+/* *************************************************************** */
+/* *************************************************************** */
+NREG_SIMD_TYPE reg_simd_getCPUType()
+{
+   static const NREG_SIMD_TYPE cpuType = reg_simd_clampType(SIMD_AVX512);
+   return cpuType;
+}
+/* *************************************************************** */
+NREG_SIMD_TYPE reg_simd_getType()
+{
+   return reg_simd_selectedType;
+}
+/* *************************************************************** */
+void reg_simd_setType(NREG_SIMD_TYPE type)
+{
+   reg_simd_selectedType = reg_simd_clampType(type);
+}
+/* *************************************************************** */
+const char *reg_simd_getName(NREG_SIMD_TYPE type)
+{
+   switch(type)
+   {
+   case SIMD_NONE:
+      return "scalar";
+   case SIMD_SSE:
+      return "SSE";
+   case SIMD_AVX2:
+      return "AVX2+FMA";
+   case SIMD_AVX512:
+      return "AVX-512";
+   }
+   return "unknown";
+}
+/* *************************************************************** */
+const reg_simd_kernels *reg_simd_getKernels()
+{
+   switch(reg_simd_getType())
+   {
+#ifdef _BUILD_AVX512_KERNELS
+   case SIMD_AVX512:
+      return &reg_simd_kernels_avx512;
+#endif
+#ifdef _BUILD_AVX2_KERNELS
+   case SIMD_AVX2:
+      return &reg_simd_kernels_avx2;
+#endif
+#if _USE_SSE
+   case SIMD_SSE:
+      return &reg_simd_kernels_sse;
+#endif
+   default:
+      return &reg_simd_kernels_none;
+   }
+}
+/* *************************************************************** */
+void showSIMDInfo()
+{
+   char text[255];
+   reg_print_info("NiftyReg SIMD", "-----------------------------------");
+   for(int i=SIMD_SSE; i<=SIMD_AVX512; ++i)
+   {
+      NREG_SIMD_TYPE type = static_cast<NREG_SIMD_TYPE>(i);
+      sprintf(text, "%-10s CPU: %-3s Compiled: %s", reg_simd_getName(type),
+              reg_simd_isCPUSupported(type)?"yes":"no",
+              reg_simd_isCompiled(type)?"yes":"no");
+      reg_print_info("NiftyReg SIMD", text);
+   }
+   reg_print_info("NiftyReg SIMD", "-----------------------------------");
+   sprintf(text, "Widest path supported: %s", reg_simd_getName(reg_simd_getCPUType()));
+   reg_print_info("NiftyReg SIMD", text);
+   sprintf(text, "Selected path: %s", reg_simd_getName(reg_simd_getType()));
+   reg_print_info("NiftyReg SIMD", text);
+   reg_print_info("NiftyReg SIMD", "-----------------------------------");
+}
+/* *************************************************************** */
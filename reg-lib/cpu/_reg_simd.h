@@ -0,0 +1,272 @@
+/**
+ * @file _reg_simd.h
+ * @brief Run-time selection of the vectorised CPU kernels
+ * @author NiftyReg Developers
+ * @date 17/10/2026
+ *
+ *  The spline, Jacobian and convolution kernels are compiled once per
+ *  instruction set and the widest set supported by the CPU is selected
+ *  the first time the kernels are requested.
+ *
+ *  Copyright (c) 2018, NiftyReg Developers.
+ *  All rights reserved.
+ *  See the LICENSE.txt file in the nifty_reg root folder
+ *
+ */
+#ifndef _REG_SIMD_H
+#define _REG_SIMD_H
+
+#include <stddef.h>
+
+/// Number of interleaved columns filtered together by convolutionColumns
+#define REG_SIMD_COLUMN_NUMBER 16
+
+typedef enum
+{
+   SIMD_NONE,
+   SIMD_SSE,
+   SIMD_AVX2,
+   SIMD_AVX512
+} NREG_SIMD_TYPE;
+
+/* *************************************************************** */
+/** @brief Table of the single precision kernels for one instruction set
+ */
+typedef struct
+{
+   /// Cubic spline value from a 4x4x4 neighbourhood of control points:
+   /// result[i] = sum_{c,b,a} zBasis[c]*yBasis[b]*xBasis[a] * cp_i[c*16+b*4+a]
+   void (*splineValue)(const float *xBasis,
+                       const float *yBasis,
+                       const float *zBasis,
+                       const float *xControlPoint,
+                       const float *yControlPoint,
+                       const float *zControlPoint,
+                       float *result);
+   /// Jacobian matrix from the 64 basis values and their derivatives:
+   /// jacobian[i*3+j] = sum_n basis_j[n] * coeff_i[n]
+   void (*splineJacobian)(const float *basisX,
+                          const float *basisY,
+                          const float *basisZ,
+                          const float *coeffX,
+                          const float *coeffY,
+                          const float *coeffZ,
+                          float *jacobian);
+   /// Cubic spline collapsed along its slowest axis, the width being a
+   /// multiple of four:
+   /// result[j] = sum_{c<4} basis[c] * values[c*width+j]
+   void (*splineCollapse)(const float *basis,
+                          const float *values,
+                          int width,
+                          float *result);
+   /// Weighted sums of an intensity and a density line over a kernel window
+   void (*convolutionWindow)(const float *kernel,
+                             const float *intensity,
+                             const float *density,
+                             int length,
+                             double *intensitySum,
+                             double *densitySum);
+   /// Weighted sums over a kernel window of REG_SIMD_COLUMN_NUMBER
+   /// interleaved columns:
+   /// result[c] = sum_k kernel[k] * values[k*REG_SIMD_COLUMN_NUMBER+c]
+   void (*convolutionColumns)(const float *kernel,
+                              const float *values,
+                              int length,
+                              float *result);
+} reg_simd_kernels;
+/* *************************************************************** */
+/** @brief Returns the widest instruction set that is both supported
+ * by the CPU and compiled in this build
+ */
+extern "C++"
+NREG_SIMD_TYPE reg_simd_getCPUType();
+/* *************************************************************** */
+/** @brief Returns the instruction set used by the kernels. It is the
+ * CPU type unless it has been lowered using reg_simd_setType or the
+ * NIFTYREG_SIMD environment variable (none, sse, avx2 or avx512)
+ */
+extern "C++"
+NREG_SIMD_TYPE reg_simd_getType();
+/* *************************************************************** */
+/** @brief Selects the instruction set used by the kernels. A type
+ * that is not supported is replaced by the widest supported one
+ */
+extern "C++"
+void reg_simd_setType(NREG_SIMD_TYPE type);
+/* *************************************************************** */
+/** @brief Returns a printable name of an instruction set */
+extern "C++"
+const char *reg_simd_getName(NREG_SIMD_TYPE type);
+/* *************************************************************** */
+/** @brief Returns the kernel table of the selected instruction set */
+extern "C++"
+const reg_simd_kernels *reg_simd_getKernels();
+/* *************************************************************** */
+/** @brief Prints the instruction sets detected and the one selected */
+extern "C++"
+void showSIMDInfo();
+/* *************************************************************** */
+/* *************************************************************** */
+/** The following wrappers dispatch the single precision calls to the
+ * selected kernels and fall back on scalar code for the other types
+ */
+template <class DTYPE>
+void reg_simd_splineValue(const reg_simd_kernels *,
+                          const DTYPE *xBasis,
+                          const DTYPE *yBasis,
+                          const DTYPE *zBasis,
+                          const DTYPE *xControlPoint,
+                          const DTYPE *yControlPoint,
+                          const DTYPE *zControlPoint,
+                          DTYPE *result)
+{
+   result[0]=result[1]=result[2]=0;
+   int coord=0;
+   for(int c=0; c<4; c++)
+   {
+      for(int b=0; b<4; b++)
+      {
+         for(int a=0; a<4; a++)
+         {
+            DTYPE tempValue = xBasis[a] * yBasis[b] * zBasis[c];
+            result[0] += xControlPoint[coord] * tempValue;
+            result[1] += yControlPoint[coord] * tempValue;
+            result[2] += zControlPoint[coord] * tempValue;
+            coord++;
+         }
+      }
+   }
+}
+inline void reg_simd_splineValue(const reg_simd_kernels *kernels,
+                                 const float *xBasis,
+                                 const float *yBasis,
+                                 const float *zBasis,
+                                 const float *xControlPoint,
+                                 const float *yControlPoint,
+                                 const float *zControlPoint,
+                                 float *result)
+{
+   kernels->splineValue(xBasis, yBasis, zBasis,
+                        xControlPoint, yControlPoint, zControlPoint,
+                        result);
+}
+/* *************************************************************** */
+template <class DTYPE>
+void reg_simd_splineJacobian(const reg_simd_kernels *,
+                             const DTYPE *basisX,
+                             const DTYPE *basisY,
+                             const DTYPE *basisZ,
+                             const DTYPE *coeffX,
+                             const DTYPE *coeffY,
+                             const DTYPE *coeffZ,
+                             float *jacobian)
+{
+   for(int i=0; i<9; ++i) jacobian[i]=0;
+   for(int n=0; n<64; ++n)
+   {
+      jacobian[0] += basisX[n]*coeffX[n];
+      jacobian[1] += basisY[n]*coeffX[n];
+      jacobian[2] += basisZ[n]*coeffX[n];
+      jacobian[3] += basisX[n]*coeffY[n];
+      jacobian[4] += basisY[n]*coeffY[n];
+      jacobian[5] += basisZ[n]*coeffY[n];
+      jacobian[6] += basisX[n]*coeffZ[n];
+      jacobian[7] += basisY[n]*coeffZ[n];
+      jacobian[8] += basisZ[n]*coeffZ[n];
+   }
+}
+inline void reg_simd_splineJacobian(const reg_simd_kernels *kernels,
+                                    const float *basisX,
+                                    const float *basisY,
+                                    const float *basisZ,
+                                    const float *coeffX,
+                                    const float *coeffY,
+                                    const float *coeffZ,
+                                    float *jacobian)
+{
+   kernels->splineJacobian(basisX, basisY, basisZ,
+                           coeffX, coeffY, coeffZ,
+                           jacobian);
+}
+/* *************************************************************** */
+template <class DTYPE>
+void reg_simd_splineCollapse(const reg_simd_kernels *,
+                             const DTYPE *basis,
+                             const DTYPE *values,
+                             int width,
+                             DTYPE *result)
+{
+   for(int j=0; j<width; ++j)
+   {
+      result[j] = basis[0]*values[j] +
+                  basis[1]*values[width+j] +
+                  basis[2]*values[2*width+j] +
+                  basis[3]*values[3*width+j];
+   }
+}
+inline void reg_simd_splineCollapse(const reg_simd_kernels *kernels,
+                                    const float *basis,
+                                    const float *values,
+                                    int width,
+                                    float *result)
+{
+   kernels->splineCollapse(basis, values, width, result);
+}
+/* *************************************************************** */
+template <class DTYPE>
+void reg_simd_convolutionWindow(const reg_simd_kernels *,
+                                const float *kernel,
+                                const DTYPE *intensity,
+                                const float *density,
+                                int length,
+                                double *intensitySum,
+                                double *densitySum)
+{
+   double intensityValue=0, densityValue=0;
+   for(int k=0; k<length; ++k)
+   {
+      intensityValue += kernel[k] * intensity[k];
+      densityValue   += kernel[k] * density[k];
+   }
+   *intensitySum=intensityValue;
+   *densitySum=densityValue;
+}
+inline void reg_simd_convolutionWindow(const reg_simd_kernels *kernels,
+                                       const float *kernel,
+                                       const float *intensity,
+                                       const float *density,
+                                       int length,
+                                       double *intensitySum,
+                                       double *densitySum)
+{
+   kernels->convolutionWindow(kernel, intensity, density, length,
+                              intensitySum, densitySum);
+}
+/* *************************************************************** */
+template <class DTYPE>
+void reg_simd_convolutionColumns(const reg_simd_kernels *,
+                                 const float *kernel,
+                                 const DTYPE *values,
+                                 int length,
+                                 DTYPE *result)
+{
+   for(int c=0; c<REG_SIMD_COLUMN_NUMBER; ++c)
+      result[c]=0;
+   for(int k=0; k<length; ++k)
+   {
+      const DTYPE *current = &values[k*REG_SIMD_COLUMN_NUMBER];
+      for(int c=0; c<REG_SIMD_COLUMN_NUMBER; ++c)
+         result[c] += kernel[k] * current[c];
+   }
+}
+inline void reg_simd_convolutionColumns(const reg_simd_kernels *kernels,
+                                        const float *kernel,
+                                        const float *values,
+                                        int length,
+                                        float *result)
+{
+   kernels->convolutionColumns(kernel, values, length, result);
+}
+/* *************************************************************** */
+
+#endif // _REG_SIMD_H
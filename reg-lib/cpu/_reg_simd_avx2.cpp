@@ -0,0 +1,173 @@
+/*
+ *  _reg_simd_avx2.cpp
+ *
+ *  AVX2 and FMA version of the kernels declared in _reg_simd.h. This
+ *  file is compiled with the AVX2 flags and is only called once the
+ *  CPU support has been checked at run time.
+ *
+ *  Copyright (c) 2018, NiftyReg Developers.
+ *  All rights reserved.
+ *  See the LICENSE.txt file in the nifty_reg root folder
+ *
+ */
+
+#include "_reg_simd.h"
+#include <immintrin.h>
+
+/* *************************************************************** */
+static inline float reg_simd_sum_avx2(__m256 value)
+{
+   __m128 sum = _mm_add_ps(_mm256_castps256_ps128(value),
+                           _mm256_extractf128_ps(value, 1));
+   sum = _mm_add_ps(sum, _mm_movehl_ps(sum, sum));
+   sum = _mm_add_ss(sum, _mm_shuffle_ps(sum, sum, 0x55));
+   return _mm_cvtss_f32(sum);
+}
+/* *************************************************************** */
+static void reg_simd_splineValue_avx2(const float *xBasis,
+                                      const float *yBasis,
+                                      const float *zBasis,
+                                      const float *xControlPoint,
+                                      const float *yControlPoint,
+                                      const float *zControlPoint,
+                                      float *result)
+{
+   __m256 tempX = _mm256_setzero_ps();
+   __m256 tempY = _mm256_setzero_ps();
+   __m256 tempZ = _mm256_setzero_ps();
+   // Two rows of four control points are processed at once
+   __m256 xBasis_avx = _mm256_broadcast_ps(reinterpret_cast<const __m128 *>(xBasis));
+   for(int c=0; c<4; c++)
+   {
+      for(int b=0; b<4; b+=2)
+      {
+         __m256 yzBasis_avx = _mm256_set_m128(_mm_set1_ps(yBasis[b+1]*zBasis[c]),
+                                              _mm_set1_ps(yBasis[b]*zBasis[c]));
+         __m256 basis_avx = _mm256_mul_ps(yzBasis_avx, xBasis_avx);
+         int coord = c*16+b*4;
+         tempX = _mm256_fmadd_ps(basis_avx, _mm256_loadu_ps(&xControlPoint[coord]), tempX);
+         tempY = _mm256_fmadd_ps(basis_avx, _mm256_loadu_ps(&yControlPoint[coord]), tempY);
+         tempZ = _mm256_fmadd_ps(basis_avx, _mm256_loadu_ps(&zControlPoint[coord]), tempZ);
+      }
+   }
+   result[0] = reg_simd_sum_avx2(tempX);
+   result[1] = reg_simd_sum_avx2(tempY);
+   result[2] = reg_simd_sum_avx2(tempZ);
+}
+/* *************************************************************** */
+static void reg_simd_splineJacobian_avx2(const float *basisX,
+                                         const float *basisY,
+                                         const float *basisZ,
+                                         const float *coeffX,
+                                         const float *coeffY,
+                                         const float *coeffZ,
+                                         float *jacobian)
+{
+   __m256 sum[9];
+   for(int i=0; i<9; ++i) sum[i] = _mm256_setzero_ps();
+   for(int n=0; n<64; n+=8)
+   {
+      __m256 bX = _mm256_loadu_ps(&basisX[n]);
+      __m256 bY = _mm256_loadu_ps(&basisY[n]);
+      __m256 bZ = _mm256_loadu_ps(&basisZ[n]);
+      __m256 cX = _mm256_loadu_ps(&coeffX[n]);
+      __m256 cY = _mm256_loadu_ps(&coeffY[n]);
+      __m256 cZ = _mm256_loadu_ps(&coeffZ[n]);
+      sum[0] = _mm256_fmadd_ps(bX, cX, sum[0]);
+      sum[1] = _mm256_fmadd_ps(bY, cX, sum[1]);
+      sum[2] = _mm256_fmadd_ps(bZ, cX, sum[2]);
+      sum[3] = _mm256_fmadd_ps(bX, cY, sum[3]);
+      sum[4] = _mm256_fmadd_ps(bY, cY, sum[4]);
+      sum[5] = _mm256_fmadd_ps(bZ, cY, sum[5]);
+      sum[6] = _mm256_fmadd_ps(bX, cZ, sum[6]);
+      sum[7] = _mm256_fmadd_ps(bY, cZ, sum[7]);
+      sum[8] = _mm256_fmadd_ps(bZ, cZ, sum[8]);
+   }
+   for(int i=0; i<9; ++i)
+      jacobian[i] = reg_simd_sum_avx2(sum[i]);
+}
+/* *************************************************************** */
+static void reg_simd_splineCollapse_avx2(const float *basis,
+                                         const float *values,
+                                         int width,
+                                         float *result)
+{
+   const __m256 b0 = _mm256_set1_ps(basis[0]);
+   const __m256 b1 = _mm256_set1_ps(basis[1]);
+   const __m256 b2 = _mm256_set1_ps(basis[2]);
+   const __m256 b3 = _mm256_set1_ps(basis[3]);
+   int j=0;
+   for(; j<width-7; j+=8)
+   {
+      __m256 sum = _mm256_mul_ps(b0, _mm256_loadu_ps(&values[j]));
+      sum = _mm256_fmadd_ps(b1, _mm256_loadu_ps(&values[width+j]), sum);
+      sum = _mm256_fmadd_ps(b2, _mm256_loadu_ps(&values[2*width+j]), sum);
+      sum = _mm256_fmadd_ps(b3, _mm256_loadu_ps(&values[3*width+j]), sum);
+      _mm256_storeu_ps(&result[j], sum);
+   }
+   // The width being a multiple of four, at most four values remain
+   if(j<width)
+   {
+      __m128 sum = _mm_mul_ps(_mm256_castps256_ps128(b0), _mm_loadu_ps(&values[j]));
+      sum = _mm_fmadd_ps(_mm256_castps256_ps128(b1), _mm_loadu_ps(&values[width+j]), sum);
+      sum = _mm_fmadd_ps(_mm256_castps256_ps128(b2), _mm_loadu_ps(&values[2*width+j]), sum);
+      sum = _mm_fmadd_ps(_mm256_castps256_ps128(b3), _mm_loadu_ps(&values[3*width+j]), sum);
+      _mm_storeu_ps(&result[j], sum);
+   }
+}
+/* *************************************************************** */
+static void reg_simd_convolutionWindow_avx2(const float *kernel,
+                                            const float *intensity,
+                                            const float *density,
+                                            int length,
+                                            double *intensitySum,
+                                            double *densitySum)
+{
+   __m256 intensity_sum_avx = _mm256_setzero_ps();
+   __m256 density_sum_avx = _mm256_setzero_ps();
+   int k=0;
+   for(; k<length-7; k+=8)
+   {
+      __m256 kernel_avx = _mm256_loadu_ps(&kernel[k]);
+      intensity_sum_avx = _mm256_fmadd_ps(kernel_avx, _mm256_loadu_ps(&intensity[k]), intensity_sum_avx);
+      density_sum_avx = _mm256_fmadd_ps(kernel_avx, _mm256_loadu_ps(&density[k]), density_sum_avx);
+   }
+   double intensityValue = reg_simd_sum_avx2(intensity_sum_avx);
+   double densityValue = reg_simd_sum_avx2(density_sum_avx);
+   for(; k<length; ++k)
+   {
+      intensityValue += kernel[k] * intensity[k];
+      densityValue   += kernel[k] * density[k];
+   }
+   *intensitySum=intensityValue;
+   *densitySum=densityValue;
+}
+/* *************************************************************** */
+static void reg_simd_convolutionColumns_avx2(const float *kernel,
+                                             const float *values,
+                                             int length,
+                                             float *result)
+{
+   __m256 sum_avx[REG_SIMD_COLUMN_NUMBER/8];
+   for(int c=0; c<REG_SIMD_COLUMN_NUMBER/8; ++c)
+      sum_avx[c] = _mm256_setzero_ps();
+   for(int k=0; k<length; ++k)
+   {
+      const __m256 kernel_avx = _mm256_set1_ps(kernel[k]);
+      const float *current = &values[k*REG_SIMD_COLUMN_NUMBER];
+      for(int c=0; c<REG_SIMD_COLUMN_NUMBER/8; ++c)
+         sum_avx[c] = _mm256_fmadd_ps(kernel_avx, _mm256_loadu_ps(&current[8*c]), sum_avx[c]);
+   }
+   for(int c=0; c<REG_SIMD_COLUMN_NUMBER/8; ++c)
+      _mm256_storeu_ps(&result[8*c], sum_avx[c]);
+}
+/* *************************************************************** */
+extern const reg_simd_kernels reg_simd_kernels_avx2 =
+{
+   reg_simd_splineValue_avx2,
+   reg_simd_splineJacobian_avx2,
+   reg_simd_splineCollapse_avx2,
+   reg_simd_convolutionWindow_avx2,
+   reg_simd_convolutionColumns_avx2
+};
+/* *************************************************************** */
@@ -0,0 +1,156 @@
+/*
+ *  _reg_simd_avx512.cpp
+ *
+ *  AVX-512 version of the kernels declared in _reg_simd.h. This file is
+ *  compiled with the AVX-512 flags and is only called once the CPU
+ *  support has been checked at run time.
+ *
+ *  Copyright (c) 2018, NiftyReg Developers.
+ *  All rights reserved.
+ *  See the LICENSE.txt file in the nifty_reg root folder
+ *
+ */
+
+#include "_reg_simd.h"
+#include <immintrin.h>
+
+/* *************************************************************** */
+static void reg_simd_splineValue_avx512(const float *xBasis,
+                                        const float *yBasis,
+                                        const float *zBasis,
+                                        const float *xControlPoint,
+                                        const float *yControlPoint,
+                                        const float *zControlPoint,
+                                        float *result)
+{
+   __m512 tempX = _mm512_setzero_ps();
+   __m512 tempY = _mm512_setzero_ps();
+   __m512 tempZ = _mm512_setzero_ps();
+   // The 16 control points of a z plane are processed at once
+   __m512 xBasis_avx = _mm512_broadcast_f32x4(_mm_loadu_ps(xBasis));
+   __m128 yBasis_sse = _mm_loadu_ps(yBasis);
+   const __m512i yIndex = _mm512_set_epi32(3,3,3,3,2,2,2,2,1,1,1,1,0,0,0,0);
+   for(int c=0; c<4; c++)
+   {
+      __m128 yzBasis_sse = _mm_mul_ps(yBasis_sse, _mm_set1_ps(zBasis[c]));
+      __m512 yzBasis_avx = _mm512_permutexvar_ps(yIndex, _mm512_castps128_ps512(yzBasis_sse));
+      __m512 basis_avx = _mm512_mul_ps(yzBasis_avx, xBasis_avx);
+      tempX = _mm512_fmadd_ps(basis_avx, _mm512_loadu_ps(&xControlPoint[c*16]), tempX);
+      tempY = _mm512_fmadd_ps(basis_avx, _mm512_loadu_ps(&yControlPoint[c*16]), tempY);
+      tempZ = _mm512_fmadd_ps(basis_avx, _mm512_loadu_ps(&zControlPoint[c*16]), tempZ);
+   }
+   result[0] = _mm512_reduce_add_ps(tempX);
+   result[1] = _mm512_reduce_add_ps(tempY);
+   result[2] = _mm512_reduce_add_ps(tempZ);
+}
+/* *************************************************************** */
+static void reg_simd_splineJacobian_avx512(const float *basisX,
+                                           const float *basisY,
+                                           const float *basisZ,
+                                           const float *coeffX,
+                                           const float *coeffY,
+                                           const float *coeffZ,
+                                           float *jacobian)
+{
+   __m512 sum[9];
+   for(int i=0; i<9; ++i) sum[i] = _mm512_setzero_ps();
+   for(int n=0; n<64; n+=16)
+   {
+      __m512 bX = _mm512_loadu_ps(&basisX[n]);
+      __m512 bY = _mm512_loadu_ps(&basisY[n]);
+      __m512 bZ = _mm512_loadu_ps(&basisZ[n]);
+      __m512 cX = _mm512_loadu_ps(&coeffX[n]);
+      __m512 cY = _mm512_loadu_ps(&coeffY[n]);
+      __m512 cZ = _mm512_loadu_ps(&coeffZ[n]);
+      sum[0] = _mm512_fmadd_ps(bX, cX, sum[0]);
+      sum[1] = _mm512_fmadd_ps(bY, cX, sum[1]);
+      sum[2] = _mm512_fmadd_ps(bZ, cX, sum[2]);
+      sum[3] = _mm512_fmadd_ps(bX, cY, sum[3]);
+      sum[4] = _mm512_fmadd_ps(bY, cY, sum[4]);
+      sum[5] = _mm512_fmadd_ps(bZ, cY, sum[5]);
+      sum[6] = _mm512_fmadd_ps(bX, cZ, sum[6]);
+      sum[7] = _mm512_fmadd_ps(bY, cZ, sum[7]);
+      sum[8] = _mm512_fmadd_ps(bZ, cZ, sum[8]);
+   }
+   for(int i=0; i<9; ++i)
+      jacobian[i] = _mm512_reduce_add_ps(sum[i]);
+}
+/* *************************************************************** */
+static void reg_simd_splineCollapse_avx512(const float *basis,
+                                           const float *values,
+                                           int width,
+                                           float *result)
+{
+   const __m512 b0 = _mm512_set1_ps(basis[0]);
+   const __m512 b1 = _mm512_set1_ps(basis[1]);
+   const __m512 b2 = _mm512_set1_ps(basis[2]);
+   const __m512 b3 = _mm512_set1_ps(basis[3]);
+   for(int j=0; j<width; j+=16)
+   {
+      // The last values are handled with a masked load and store
+      __mmask16 mask = width-j<16 ?
+            static_cast<__mmask16>((1u<<(width-j))-1u) : static_cast<__mmask16>(0xffff);
+      __m512 sum = _mm512_mul_ps(b0, _mm512_maskz_loadu_ps(mask, &values[j]));
+      sum = _mm512_fmadd_ps(b1, _mm512_maskz_loadu_ps(mask, &values[width+j]), sum);
+      sum = _mm512_fmadd_ps(b2, _mm512_maskz_loadu_ps(mask, &values[2*width+j]), sum);
+      sum = _mm512_fmadd_ps(b3, _mm512_maskz_loadu_ps(mask, &values[3*width+j]), sum);
+      _mm512_mask_storeu_ps(&result[j], mask, sum);
+   }
+}
+/* *************************************************************** */
+static void reg_simd_convolutionWindow_avx512(const float *kernel,
+                                              const float *intensity,
+                                              const float *density,
+                                              int length,
+                                              double *intensitySum,
+                                              double *densitySum)
+{
+   __m512 intensity_sum_avx = _mm512_setzero_ps();
+   __m512 density_sum_avx = _mm512_setzero_ps();
+   int k=0;
+   for(; k<length-15; k+=16)
+   {
+      __m512 kernel_avx = _mm512_loadu_ps(&kernel[k]);
+      intensity_sum_avx = _mm512_fmadd_ps(kernel_avx, _mm512_loadu_ps(&intensity[k]), intensity_sum_avx);
+      density_sum_avx = _mm512_fmadd_ps(kernel_avx, _mm512_loadu_ps(&density[k]), density_sum_avx);
+   }
+   // The remaining values are handled with a masked load
+   if(k<length)
+   {
+      __mmask16 mask = static_cast<__mmask16>((1u<<(length-k))-1u);
+      __m512 kernel_avx = _mm512_maskz_loadu_ps(mask, &kernel[k]);
+      intensity_sum_avx = _mm512_fmadd_ps(kernel_avx, _mm512_maskz_loadu_ps(mask, &intensity[k]), intensity_sum_avx);
+      density_sum_avx = _mm512_fmadd_ps(kernel_avx, _mm512_maskz_loadu_ps(mask, &density[k]), density_sum_avx);
+   }
+   *intensitySum = _mm512_reduce_add_ps(intensity_sum_avx);
+   *densitySum = _mm512_reduce_add_ps(density_sum_avx);
+}
+/* *************************************************************** */
+static void reg_simd_convolutionColumns_avx512(const float *kernel,
+                                               const float *values,
+                                               int length,
+                                               float *result)
+{
+   __m512 sum_avx[REG_SIMD_COLUMN_NUMBER/16];
+   for(int c=0; c<REG_SIMD_COLUMN_NUMBER/16; ++c)
+      sum_avx[c] = _mm512_setzero_ps();
+   for(int k=0; k<length; ++k)
+   {
+      const __m512 kernel_avx = _mm512_set1_ps(kernel[k]);
+      const float *current = &values[k*REG_SIMD_COLUMN_NUMBER];
+      for(int c=0; c<REG_SIMD_COLUMN_NUMBER/16; ++c)
+         sum_avx[c] = _mm512_fmadd_ps(kernel_avx, _mm512_loadu_ps(&current[16*c]), sum_avx[c]);
+   }
+   for(int c=0; c<REG_SIMD_COLUMN_NUMBER/16; ++c)
+      _mm512_storeu_ps(&result[16*c], sum_avx[c]);
+}
+/* *************************************************************** */
+extern const reg_simd_kernels reg_simd_kernels_avx512 =
+{
+   reg_simd_splineValue_avx512,
+   reg_simd_splineJacobian_avx512,
+   reg_simd_splineCollapse_avx512,
+   reg_simd_convolutionWindow_avx512,
+   reg_simd_convolutionColumns_avx512
+};
+/* *************************************************************** */
@@ -115,15 +115,26 @@ double reg_getSSDValue(nifti_image *referenceImage,
 							  nifti_image *jacobianDetImage,
 							  int *mask,
 							  float *currentValue,
-							  nifti_image *localWeightSimImage)
+							  nifti_image *localWeightSimImage,
+							  const reg_maskSpans *maskSpans)
 {
 #ifdef _WIN32
-   long voxel;
+   long voxel, line;
    long voxelNumber = (long)referenceImage->nx*referenceImage->ny*referenceImage->nz;
+   long lineNumber = (long)referenceImage->ny*referenceImage->nz;
 #else
-   size_t voxel;
+   size_t voxel, line;
    size_t voxelNumber = (size_t)referenceImage->nx*referenceImage->ny*referenceImage->nz;
+   size_t lineNumber = (size_t)referenceImage->ny*referenceImage->nz;
 #endif
+   size_t span;
+   // Only the active spans are visited. They are built from the mask array if not provided
+   reg_maskSpans *temporarySpans=NULL;
+   if(maskSpans==NULL)
+   {
+      int dim[3]={referenceImage->nx, referenceImage->ny, referenceImage->nz};
+      maskSpans=temporarySpans=reg_tools_createMaskSpans(mask, dim);
+   }
    // Create pointers to the reference and warped image data
    DTYPE *referencePtr=static_cast<DTYPE *>(referenceImage->data);
    DTYPE *warpedPtr=static_cast<DTYPE *>(warpedImage->data);
@@ -151,45 +162,48 @@ double reg_getSSDValue(nifti_image *referenceImage,
          double SSD_local=0., n=0.;
 #if defined (_OPENMP)
 #pragma omp parallel for default(none) \
-   shared(referenceImage, warpedImage, currentRefPtr, currentWarPtr, mask, \
-   jacobianDetImage, jacDetPtr, voxelNumber, localWeightPtr) \
-   private(voxel, refValue, warValue, diff) \
+   shared(referenceImage, warpedImage, currentRefPtr, currentWarPtr, maskSpans, \
+   jacobianDetImage, jacDetPtr, lineNumber, localWeightPtr) \
+   private(voxel, line, span, refValue, warValue, diff) \
    reduction(+:SSD_local) \
    reduction(+:n)
 #endif
-         for(voxel=0; voxel<voxelNumber; ++voxel)
+         for(line=0; line<lineNumber; ++line)
          {
-            // Check if the current voxel belongs to the mask
-            if(mask[voxel]>-1)
+            for(span=maskSpans->lineSpan[line]; span<maskSpans->lineSpan[line+1]; ++span)
             {
-               // Ensure that both ref and warped values are defined
-               refValue = (double)(currentRefPtr[voxel] * referenceImage->scl_slope +
-                                   referenceImage->scl_inter);
-               warValue = (double)(currentWarPtr[voxel] * warpedImage->scl_slope +
-                                   warpedImage->scl_inter);
-
-               if(refValue==refValue && warValue==warValue)
+               for(voxel=line*referenceImage->nx+maskSpans->spanStart[span];
+                   voxel<line*referenceImage->nx+maskSpans->spanEnd[span]; ++voxel)
                {
+                  // Ensure that both ref and warped values are defined
+                  refValue = (double)(currentRefPtr[voxel] * referenceImage->scl_slope +
+                                      referenceImage->scl_inter);
+                  warValue = (double)(currentWarPtr[voxel] * warpedImage->scl_slope +
+                                      warpedImage->scl_inter);
+
+                  if(refValue==refValue && warValue==warValue)
+                  {
 #ifdef MRF_USE_SAD
-                  diff = fabs(refValue-warValue);
+                     diff = fabs(refValue-warValue);
 #else
-                  diff = reg_pow2(refValue-warValue);
+                     diff = reg_pow2(refValue-warValue);
 #endif
-                  // Jacobian determinant modulation of the ssd if required
-                  if(jacDetPtr!=NULL)
-                  {
-                     SSD_local += diff * jacDetPtr[voxel];
-                     n += jacDetPtr[voxel];
-                  }
-                  else if(localWeightPtr!=NULL)
-                  {
-                     SSD_local += diff * localWeightPtr[voxel];
-                     n += localWeightPtr[voxel];
-                  }
-                  else
-                  {
-                     SSD_local += diff;
-                     n += 1.0;
+                     // Jacobian determinant modulation of the ssd if required
+                     if(jacDetPtr!=NULL)
+                     {
+                        SSD_local += diff * jacDetPtr[voxel];
+                        n += jacDetPtr[voxel];
+                     }
+                     else if(localWeightPtr!=NULL)
+                     {
+                        SSD_local += diff * localWeightPtr[voxel];
+                        n += localWeightPtr[voxel];
+                     }
+                     else
+                     {
+                        SSD_local += diff;
+                        n += 1.0;
+                     }
                   }
                }
             }
@@ -200,10 +214,11 @@ double reg_getSSDValue(nifti_image *referenceImage,
          SSD_global -= SSD_local/n;
       }
    }
+   reg_tools_freeMaskSpans(temporarySpans);
    return SSD_global;
 }
-template double reg_getSSDValue<float>(nifti_image *,nifti_image *,double *,nifti_image *,int *, float *, nifti_image *);
-template double reg_getSSDValue<double>(nifti_image *,nifti_image *,double *,nifti_image *,int *, float *, nifti_image *);
+template double reg_getSSDValue<float>(nifti_image *,nifti_image *,double *,nifti_image *,int *, float *, nifti_image *, const reg_maskSpans *);
+template double reg_getSSDValue<double>(nifti_image *,nifti_image *,double *,nifti_image *,int *, float *, nifti_image *, const reg_maskSpans *);
 /* *************************************************************** */
 double reg_ssd::GetSimilarityMeasureValue()
 {
@@ -225,7 +240,8 @@ double reg_ssd::GetSimilarityMeasureValue()
              NULL, // HERE TODO this->forwardJacDetImagePointer,
              this->referenceMaskPointer,
              this->currentValue,
-             this->forwardLocalWeightSimImagePointer
+             this->forwardLocalWeightSimImagePointer,
+             this->referenceMaskSpans
              );
       break;
    case NIFTI_TYPE_FLOAT64:
@@ -236,7 +252,8 @@ double reg_ssd::GetSimilarityMeasureValue()
              NULL, // HERE TODO this->forwardJacDetImagePointer,
              this->referenceMaskPointer,
              this->currentValue,
-             this->forwardLocalWeightSimImagePointer
+             this->forwardLocalWeightSimImagePointer,
+             this->referenceMaskSpans
              );
       break;
    default:
@@ -265,7 +282,8 @@ double reg_ssd::GetSimilarityMeasureValue()
                 NULL, // HERE TODO this->backwardJacDetImagePointer,
                 this->floatingMaskPointer,
                 this->currentValue,
-                NULL
+                NULL,
+                this->floatingMaskSpans
                 );
          break;
       case NIFTI_TYPE_FLOAT64:
@@ -276,7 +294,8 @@ double reg_ssd::GetSimilarityMeasureValue()
                 NULL, // HERE TODO this->backwardJacDetImagePointer,
                 this->floatingMaskPointer,
                 this->currentValue,
-                NULL
+                NULL,
+                this->floatingMaskSpans
                 );
          break;
       default:
@@ -298,7 +317,8 @@ void reg_getVoxelBasedSSDGradient(nifti_image *referenceImage,
                                   int *mask,
                                   int current_timepoint,
                                   double timepoint_weight,
-                                  nifti_image *localWeightSimImage
+                                  nifti_image *localWeightSimImage,
+                                  const reg_maskSpans *maskSpans
                                   )
 {
    if(current_timepoint<0 || current_timepoint>=referenceImage->nt){
@@ -308,12 +328,22 @@ void reg_getVoxelBasedSSDGradient(nifti_image *referenceImage,
    }
    // Create pointers to the reference and warped images
 #ifdef _WIN32
-   long voxel;
+   long voxel, line;
    long voxelNumber = (long)referenceImage->nx*referenceImage->ny*referenceImage->nz;
+   long lineNumber = (long)referenceImage->ny*referenceImage->nz;
 #else
-   size_t voxel;
+   size_t voxel, line;
    size_t voxelNumber = (size_t)referenceImage->nx*referenceImage->ny*referenceImage->nz;
+   size_t lineNumber = (size_t)referenceImage->ny*referenceImage->nz;
 #endif
+   size_t span;
+   // Only the active spans are visited. They are built from the mask array if not provided
+   reg_maskSpans *temporarySpans=NULL;
+   if(maskSpans==NULL)
+   {
+      int dim[3]={referenceImage->nx, referenceImage->ny, referenceImage->nz};
+      maskSpans=temporarySpans=reg_tools_createMaskSpans(mask, dim);
+   }
    // Pointers to the image data
    DTYPE *refImagePtr = static_cast<DTYPE *>(referenceImage->data);
    DTYPE *currentRefPtr=&refImagePtr[current_timepoint*voxelNumber];
@@ -345,12 +375,16 @@ void reg_getVoxelBasedSSDGradient(nifti_image *referenceImage,
 
    // find number of active voxels and correct weight
    double activeVoxel_num = 0.0;
-   for (voxel = 0; voxel < voxelNumber; voxel++)
+   for(line=0; line<lineNumber; ++line)
    {
-      if (mask[voxel]>-1)
+      for(span=maskSpans->lineSpan[line]; span<maskSpans->lineSpan[line+1]; ++span)
       {
-         if (currentRefPtr[voxel] == currentRefPtr[voxel] && currentWarPtr[voxel] == currentWarPtr[voxel])
-            activeVoxel_num += 1.0;
+         for(voxel=line*referenceImage->nx+maskSpans->spanStart[span];
+             voxel<line*referenceImage->nx+maskSpans->spanEnd[span]; ++voxel)
+         {
+            if (currentRefPtr[voxel] == currentRefPtr[voxel] && currentWarPtr[voxel] == currentWarPtr[voxel])
+               activeVoxel_num += 1.0;
+         }
       }
    }
    double adjusted_weight = timepoint_weight / activeVoxel_num;
@@ -360,53 +394,160 @@ void reg_getVoxelBasedSSDGradient(nifti_image *referenceImage,
 #if defined (_OPENMP)
 #pragma omp parallel for default(none) \
    shared(referenceImage, warpedImage, currentRefPtr, currentWarPtr, \
-   mask, jacDetPtr, spatialGradPtrX, spatialGradPtrY, spatialGradPtrZ, \
-   measureGradPtrX, measureGradPtrY, measureGradPtrZ, voxelNumber, \
+   maskSpans, jacDetPtr, spatialGradPtrX, spatialGradPtrY, spatialGradPtrZ, \
+   measureGradPtrX, measureGradPtrY, measureGradPtrZ, lineNumber, \
    localWeightPtr, adjusted_weight) \
-   private(voxel, refValue, warValue, common)
+   private(voxel, line, span, refValue, warValue, common)
 #endif
-   for(voxel=0; voxel<voxelNumber; voxel++)
+   for(line=0; line<lineNumber; ++line)
    {
-      if(mask[voxel]>-1)
+      for(span=maskSpans->lineSpan[line]; span<maskSpans->lineSpan[line+1]; ++span)
       {
-         refValue = (double)(currentRefPtr[voxel] * referenceImage->scl_slope +
-                             referenceImage->scl_inter);
-         warValue = (double)(currentWarPtr[voxel] * warpedImage->scl_slope +
-                             warpedImage->scl_inter);
-         if(refValue==refValue && warValue==warValue)
+         for(voxel=line*referenceImage->nx+maskSpans->spanStart[span];
+             voxel<line*referenceImage->nx+maskSpans->spanEnd[span]; ++voxel)
          {
+            refValue = (double)(currentRefPtr[voxel] * referenceImage->scl_slope +
+                                referenceImage->scl_inter);
+            warValue = (double)(currentWarPtr[voxel] * warpedImage->scl_slope +
+                                warpedImage->scl_inter);
+            if(refValue==refValue && warValue==warValue)
+            {
 #ifdef MRF_USE_SAD
-            common = refValue>warValue?-1.f:1.f;
-            common *= (refValue - warValue);
+               common = refValue>warValue?-1.f:1.f;
+               common *= (refValue - warValue);
 #else
-            common = -2.0 * (refValue - warValue);
+               common = -2.0 * (refValue - warValue);
 #endif
-            if(jacDetPtr!=NULL)
-               common *= jacDetPtr[voxel];
-            else if(localWeightPtr!=NULL)
-               common *= localWeightPtr[voxel];
+               if(jacDetPtr!=NULL)
+                  common *= jacDetPtr[voxel];
+               else if(localWeightPtr!=NULL)
+                  common *= localWeightPtr[voxel];
 
-            common *= adjusted_weight;
+               common *= adjusted_weight;
 
-            if(spatialGradPtrX[voxel]==spatialGradPtrX[voxel])
-               measureGradPtrX[voxel] += (DTYPE)(common * spatialGradPtrX[voxel]);
-            if(spatialGradPtrY[voxel]==spatialGradPtrY[voxel])
-               measureGradPtrY[voxel] += (DTYPE)(common * spatialGradPtrY[voxel]);
+               if(spatialGradPtrX[voxel]==spatialGradPtrX[voxel])
+                  measureGradPtrX[voxel] += (DTYPE)(common * spatialGradPtrX[voxel]);
+               if(spatialGradPtrY[voxel]==spatialGradPtrY[voxel])
+                  measureGradPtrY[voxel] += (DTYPE)(common * spatialGradPtrY[voxel]);
 
-            if(measureGradPtrZ!=NULL)
-            {
-               if(spatialGradPtrZ[voxel]==spatialGradPtrZ[voxel])
-                  measureGradPtrZ[voxel] += (DTYPE)(common * spatialGradPtrZ[voxel]);
+               if(measureGradPtrZ!=NULL)
+               {
+                  if(spatialGradPtrZ[voxel]==spatialGradPtrZ[voxel])
+                     measureGradPtrZ[voxel] += (DTYPE)(common * spatialGradPtrZ[voxel]);
+               }
             }
          }
       }
    }
+   reg_tools_freeMaskSpans(temporarySpans);
 }
 /* *************************************************************** */
 template void reg_getVoxelBasedSSDGradient<float>
-(nifti_image *,nifti_image *,nifti_image *,nifti_image *,nifti_image *, int *, int, double, nifti_image *);
+(nifti_image *,nifti_image *,nifti_image *,nifti_image *,nifti_image *, int *, int, double, nifti_image *, const reg_maskSpans *);
 template void reg_getVoxelBasedSSDGradient<double>
-(nifti_image *,nifti_image *,nifti_image *,nifti_image *,nifti_image *, int *, int, double, nifti_image *);
+(nifti_image *,nifti_image *,nifti_image *,nifti_image *,nifti_image *, int *, int, double, nifti_image *, const reg_maskSpans *);
+/* *************************************************************** */
+template <class DTYPE>
+void reg_getVoxelBasedSSDDerivative(nifti_image *referenceImage,
+                                    nifti_image *warpedImage,
+                                    nifti_image *derivativeImage,
+                                    int *mask,
+                                    int current_timepoint,
+                                    double timepoint_weight,
+                                    nifti_image *localWeightSimImage,
+                                    const reg_maskSpans *maskSpans
+                                    )
+{
+   if(current_timepoint<0 || current_timepoint>=referenceImage->nt){
+      reg_print_fct_error("reg_getVoxelBasedSSDDerivative");
+      reg_print_msg_error("The specified active timepoint is not defined in the ref/war images");
+      reg_exit();
+   }
+#ifdef _WIN32
+   long voxel, line;
+   long voxelNumber = (long)referenceImage->nx*referenceImage->ny*referenceImage->nz;
+   long lineNumber = (long)referenceImage->ny*referenceImage->nz;
+#else
+   size_t voxel, line;
+   size_t voxelNumber = (size_t)referenceImage->nx*referenceImage->ny*referenceImage->nz;
+   size_t lineNumber = (size_t)referenceImage->ny*referenceImage->nz;
+#endif
+   size_t span;
+   // Only the active spans are visited. They are built from the mask array if not provided
+   reg_maskSpans *temporarySpans=NULL;
+   if(maskSpans==NULL)
+   {
+      int dim[3]={referenceImage->nx, referenceImage->ny, referenceImage->nz};
+      maskSpans=temporarySpans=reg_tools_createMaskSpans(mask, dim);
+   }
+   // Pointers to the image data
+   DTYPE *refImagePtr = static_cast<DTYPE *>(referenceImage->data);
+   DTYPE *currentRefPtr=&refImagePtr[current_timepoint*voxelNumber];
+   DTYPE *warImagePtr = static_cast<DTYPE *>(warpedImage->data);
+   DTYPE *currentWarPtr=&warImagePtr[current_timepoint*voxelNumber];
+   DTYPE *derivativePtr = static_cast<DTYPE *>(derivativeImage->data);
+   // Create a pointer to the local weight image if defined
+   DTYPE *localWeightPtr=NULL;
+   if(localWeightSimImage!=NULL)
+      localWeightPtr=static_cast<DTYPE *>(localWeightSimImage->data);
+
+   // find number of active voxels and correct weight
+   double activeVoxel_num = 0.0;
+   for(line=0; line<lineNumber; ++line)
+   {
+      for(span=maskSpans->lineSpan[line]; span<maskSpans->lineSpan[line+1]; ++span)
+      {
+         for(voxel=line*referenceImage->nx+maskSpans->spanStart[span];
+             voxel<line*referenceImage->nx+maskSpans->spanEnd[span]; ++voxel)
+         {
+            if (currentRefPtr[voxel] == currentRefPtr[voxel] && currentWarPtr[voxel] == currentWarPtr[voxel])
+               activeVoxel_num += 1.0;
+         }
+      }
+   }
+   double adjusted_weight = timepoint_weight / activeVoxel_num;
+
+   double refValue, warValue, common;
+
+#if defined (_OPENMP)
+#pragma omp parallel for default(none) \
+   shared(referenceImage, warpedImage, currentRefPtr, currentWarPtr, \
+   maskSpans, derivativePtr, lineNumber, localWeightPtr, adjusted_weight) \
+   private(voxel, line, span, refValue, warValue, common)
+#endif
+   for(line=0; line<lineNumber; ++line)
+   {
+      for(span=maskSpans->lineSpan[line]; span<maskSpans->lineSpan[line+1]; ++span)
+      {
+         for(voxel=line*referenceImage->nx+maskSpans->spanStart[span];
+             voxel<line*referenceImage->nx+maskSpans->spanEnd[span]; ++voxel)
+         {
+            refValue = (double)(currentRefPtr[voxel] * referenceImage->scl_slope +
+                                referenceImage->scl_inter);
+            warValue = (double)(currentWarPtr[voxel] * warpedImage->scl_slope +
+                                warpedImage->scl_inter);
+            if(refValue==refValue && warValue==warValue)
+            {
+#ifdef MRF_USE_SAD
+               common = refValue>warValue?-1.f:1.f;
+               common *= (refValue - warValue);
+#else
+               common = -2.0 * (refValue - warValue);
+#endif
+               if(localWeightPtr!=NULL)
+                  common *= localWeightPtr[voxel];
+               derivativePtr[voxel] += (DTYPE)(common * adjusted_weight);
+            }
+         }
+      }
+   }
+   reg_tools_freeMaskSpans(temporarySpans);
+}
+/* *************************************************************** */
+template void reg_getVoxelBasedSSDDerivative<float>
+(nifti_image *,nifti_image *,nifti_image *, int *, int, double, nifti_image *, const reg_maskSpans *);
+template void reg_getVoxelBasedSSDDerivative<double>
+(nifti_image *,nifti_image *,nifti_image *, int *, int, double, nifti_image *, const reg_maskSpans *);
 /* *************************************************************** */
 void reg_ssd::GetVoxelBasedSimilarityMeasureGradient(int current_timepoint)
 {
@@ -439,7 +580,8 @@ void reg_ssd::GetVoxelBasedSimilarityMeasureGradient(int current_timepoint)
              this->referenceMaskPointer,
              current_timepoint,
              this->timePointWeight[current_timepoint],
-             this->forwardLocalWeightSimImagePointer
+             this->forwardLocalWeightSimImagePointer,
+             this->referenceMaskSpans
              );
       break;
    case NIFTI_TYPE_FLOAT64:
@@ -452,7 +594,8 @@ void reg_ssd::GetVoxelBasedSimilarityMeasureGradient(int current_timepoint)
              this->referenceMaskPointer,
              current_timepoint,
              this->timePointWeight[current_timepoint],
-             this->forwardLocalWeightSimImagePointer
+             this->forwardLocalWeightSimImagePointer,
+             this->referenceMaskSpans
              );
       break;
    default:
@@ -486,7 +629,8 @@ void reg_ssd::GetVoxelBasedSimilarityMeasureGradient(int current_timepoint)
                 this->floatingMaskPointer,
                 current_timepoint,
                 this->timePointWeight[current_timepoint],
-                NULL
+                NULL,
+                this->floatingMaskSpans
                 );
          break;
       case NIFTI_TYPE_FLOAT64:
@@ -499,7 +643,8 @@ void reg_ssd::GetVoxelBasedSimilarityMeasureGradient(int current_timepoint)
                 this->floatingMaskPointer,
                 current_timepoint,
                 this->timePointWeight[current_timepoint],
-                NULL
+                NULL,
+                this->floatingMaskSpans
                 );
          break;
       default:
@@ -510,6 +655,60 @@ void reg_ssd::GetVoxelBasedSimilarityMeasureGradient(int current_timepoint)
    }
 }
 /* *************************************************************** */
+bool reg_ssd::AddVoxelBasedSimilarityMeasureDerivative(int current_timepoint,
+                                                       nifti_image *derivativeImage)
+{
+   // Check if the specified time point exists and is active
+   reg_measure::GetVoxelBasedSimilarityMeasureGradient(current_timepoint);
+   if(this->timePointWeight[current_timepoint]==0.0)
+      return true;
+   // The backward gradient is only computed by GetVoxelBasedSimilarityMeasureGradient
+   if(this->isSymmetric)
+      return false;
+
+   // Check if all required input images are of the same data type
+   int dtype = this->referenceImagePointer->datatype;
+   if(this->warpedFloatingImagePointer->datatype != dtype ||
+         derivativeImage->datatype != dtype)
+   {
+      reg_print_fct_error("reg_ssd::AddVoxelBasedSimilarityMeasureDerivative");
+      reg_print_msg_error("Input images are exepected to be of the same type");
+      reg_exit();
+   }
+   switch(dtype)
+   {
+   case NIFTI_TYPE_FLOAT32:
+      reg_getVoxelBasedSSDDerivative<float>
+            (this->referenceImagePointer,
+             this->warpedFloatingImagePointer,
+             derivativeImage,
+             this->referenceMaskPointer,
+             current_timepoint,
+             this->timePointWeight[current_timepoint],
+             this->forwardLocalWeightSimImagePointer,
+             this->referenceMaskSpans
+             );
+      break;
+   case NIFTI_TYPE_FLOAT64:
+      reg_getVoxelBasedSSDDerivative<double>
+            (this->referenceImagePointer,
+             this->warpedFloatingImagePointer,
+             derivativeImage,
+             this->referenceMaskPointer,
+             current_timepoint,
+             this->timePointWeight[current_timepoint],
+             this->forwardLocalWeightSimImagePointer,
+             this->referenceMaskSpans
+             );
+      break;
+   default:
+      reg_print_fct_error("reg_ssd::AddVoxelBasedSimilarityMeasureDerivative");
+      reg_print_msg_error("Unsupported datatype");
+      reg_exit();
+   }
+   return true;
+}
+/* *************************************************************** */
 /* *************************************************************** */
 template <class DTYPE>
 void GetDiscretisedValueSSD_core3D(nifti_image *controlPointGridImage,
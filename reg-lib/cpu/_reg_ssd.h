@@ -44,6 +44,9 @@ public:
    virtual double GetSimilarityMeasureValue();
    /// @brief Compute the voxel based ssd gradient
    virtual void GetVoxelBasedSimilarityMeasureGradient(int current_timepoint);
+   /// @brief Add the ssd derivative with respect to the warped intensities
+   virtual bool AddVoxelBasedSimilarityMeasureDerivative(int current_timepoint,
+                                                         nifti_image *derivativeImage);
    /// @brief Here
    virtual void GetDiscretisedValue(nifti_image *controlPointGridImage,
                                     float *discretisedValue,
@@ -69,6 +72,8 @@ private:
  * pointer is set to NULL
  * @param mask Array that contains a mask to specify which voxel
  * should be considered. If set to NULL, all voxels are considered
+ * @param maskSpans Spans of active voxels. If provided, they are used
+ * instead of the mask array
  * @return Returns the computed sum squared difference
  */
 extern "C++" template <class DTYPE>
@@ -78,7 +83,8 @@ double reg_getSSDValue(nifti_image *referenceImage,
 							  nifti_image *jacobianDeterminantImage,
 							  int *mask,
 							  float *currentValue,
-							  nifti_image *localWeightImage
+							  nifti_image *localWeightImage,
+							  const reg_maskSpans *maskSpans = NULL
 							 );
 
 /** @brief Compute a voxel based gradient of the sum squared difference.
@@ -94,6 +100,8 @@ double reg_getSSDValue(nifti_image *referenceImage,
  * pointer is set to NULL
  * @param mask Array that contains a mask to specify which voxel
  * should be considered. If set to NULL, all voxels are considered
+ * @param maskSpans Spans of active voxels. If provided, they are used
+ * instead of the mask array
  */
 extern "C++" template <class DTYPE>
 void reg_getVoxelBasedSSDGradient(nifti_image *referenceImage,
@@ -104,6 +112,29 @@ void reg_getVoxelBasedSSDGradient(nifti_image *referenceImage,
                                   int *mask,
                                   int current_timepoint,
                                   double timepoint_weight,
-                                  nifti_image *localWeightImage
+                                  nifti_image *localWeightImage,
+                                  const reg_maskSpans *maskSpans = NULL
                                  );
+/** @brief Add the derivative of the sum squared difference with respect
+ * to the warped intensities to a scalar image. Multiplying it by the warped
+ * image gradient gives the result of reg_getVoxelBasedSSDGradient
+ * @param referenceImage First input image to use to compute the metric
+ * @param warpedImage Second input image to use to compute the metric
+ * @param derivativeImage Output image that will be updated with the
+ * value of the SSD derivative
+ * @param mask Array that contains a mask to specify which voxel
+ * should be considered. If set to NULL, all voxels are considered
+ * @param maskSpans Spans of active voxels. If provided, they are used
+ * instead of the mask array
+ */
+extern "C++" template <class DTYPE>
+void reg_getVoxelBasedSSDDerivative(nifti_image *referenceImage,
+                                    nifti_image *warpedImage,
+                                    nifti_image *derivativeImage,
+                                    int *mask,
+                                    int current_timepoint,
+                                    double timepoint_weight,
+                                    nifti_image *localWeightImage,
+                                    const reg_maskSpans *maskSpans = NULL
+                                   );
 #endif
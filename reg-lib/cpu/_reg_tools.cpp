@@ -16,6 +16,7 @@
 
 #include <cmath>
 #include "_reg_tools.h"
+#include "_reg_simd.h"
 
 /* *************************************************************** */
 /* *************************************************************** */
@@ -1101,6 +1102,428 @@ void reg_tools_divideValueToImage(nifti_image *img1,
 }
 /* *************************************************************** */
 /* *************************************************************** */
+/** Minimal Gaussian radius, in voxels, applied recursively along x and along y or z */
+#define REG_RECURSIVE_GAUSSIAN_MIN_RADIUS 8
+#define REG_RECURSIVE_GAUSSIAN_MIN_COLUMN_RADIUS 36
+/** Number of lines filtered together by the line-block filters. The
+ * intensity and density of each line fill the columns of the vectorised
+ * column convolution.
+ */
+#define REG_LINE_BLOCK_SIZE (REG_SIMD_COLUMN_NUMBER/2)
+/* *************************************************************** */
+/** @brief Computes the coefficients of the fourth order recursive
+ * approximation of a Gaussian kernel described by Deriche (INRIA RR-1893).
+ * The causal filter uses the numerator causal[0-3] and the anti-causal filter
+ * the numerator antiCausal[1-4]. Both filters share the denominator
+ * denominator[1-4]. The kernel is not normalised.
+ */
+static void reg_tools_getDericheCoefficients(double sigma,
+                                             double *causal,
+                                             double *antiCausal,
+                                             double *denominator)
+{
+   const double a0=1.680, a1=3.735, b0=1.783, b1=1.723;
+   const double w0=0.6318, w1=1.997, c0=-0.6803, c1=-0.2598;
+   const double cos0=cos(w0/sigma), sin0=sin(w0/sigma);
+   const double cos1=cos(w1/sigma), sin1=sin(w1/sigma);
+   const double exp0=exp(-b0/sigma), exp1=exp(-b1/sigma);
+
+   causal[0] = a0 + c0;
+   causal[1] = exp1*(c1*sin1-(c0+2.*a0)*cos1) +
+         exp0*(a1*sin0-(2.*c0+a0)*cos0);
+   causal[2] = 2.*exp0*exp1*((a0+c0)*cos1*cos0-a1*cos1*sin0-c1*cos0*sin1) +
+         c0*exp0*exp0 + a0*exp1*exp1;
+   causal[3] = exp1*exp0*exp0*(c1*sin1-c0*cos1) +
+         exp0*exp1*exp1*(a1*sin0-a0*cos0);
+
+   denominator[0] = 1.;
+   denominator[1] = -2.*exp1*cos1 - 2.*exp0*cos0;
+   denominator[2] = 4.*cos1*cos0*exp0*exp1 + exp1*exp1 + exp0*exp0;
+   denominator[3] = -2.*cos0*exp0*exp1*exp1 - 2.*cos1*exp1*exp0*exp0;
+   denominator[4] = exp0*exp0*exp1*exp1;
+
+   // The anti-causal filter excludes the central sample
+   antiCausal[0] = 0.;
+   for(int i=1; i<4; ++i)
+      antiCausal[i] = causal[i] - causal[0]*denominator[i];
+   antiCausal[4] = -causal[0]*denominator[4];
+}
+/* *************************************************************** */
+/** @brief Returns the number of lines along an axis and the offset between
+ * two consecutive voxels of a line.
+ */
+static void reg_tools_getLineLayout(const int *imageDim,
+                                    int n,
+                                    int *planeNumber,
+                                    int *lineOffset)
+{
+   switch(n)
+   {
+   case 0:
+      *planeNumber = imageDim[1]*imageDim[2];
+      *lineOffset  = 1;
+      break;
+   case 1:
+      *planeNumber = imageDim[0]*imageDim[2];
+      *lineOffset  = imageDim[0];
+      break;
+   default:
+      *planeNumber = imageDim[0]*imageDim[1];
+      *lineOffset  = *planeNumber;
+      break;
+   }
+}
+/* *************************************************************** */
+/** @brief Copies a block of REG_LINE_BLOCK_SIZE lines into an interleaved
+ * buffer. The intensity of line l at position i is stored in
+ * buffer[i*2*REG_LINE_BLOCK_SIZE+l] and its density REG_LINE_BLOCK_SIZE
+ * values further. Consecutive lines along y and z are adjacent x-columns, so
+ * the loads are contiguous. Unused lines of the last block are set to zero.
+ */
+template <class DTYPE, class BTYPE>
+static void reg_tools_getLineBlock(const DTYPE *intensityPtr,
+                                   const float *densityPtr,
+                                   const int *imageDim,
+                                   int n,
+                                   int lineOffset,
+                                   int firstPlane,
+                                   int blockLineNumber,
+                                   size_t *realIndex,
+                                   BTYPE *buffer)
+{
+   const int channelNumber = 2*REG_LINE_BLOCK_SIZE;
+   const int lineLength = imageDim[n];
+   for(int l=0; l<blockLineNumber; ++l)
+   {
+      const int planeIndex = firstPlane+l;
+      switch(n)
+      {
+      case 0:
+         realIndex[l] = (size_t)planeIndex * imageDim[0];
+         break;
+      case 1:
+         realIndex[l] = (size_t)(planeIndex/imageDim[0]) *
+               imageDim[0]*imageDim[1] +
+               planeIndex%imageDim[0];
+         break;
+      default:
+         realIndex[l] = planeIndex;
+      }
+   }
+   if(lineOffset==1)
+   {
+      // Lines along x are read one at a time
+      for(int l=0; l<REG_LINE_BLOCK_SIZE; ++l)
+      {
+         if(l<blockLineNumber)
+         {
+            const DTYPE *currentIntensity = &intensityPtr[realIndex[l]];
+            const float *currentDensity = &densityPtr[realIndex[l]];
+            for(int i=0; i<lineLength; ++i)
+            {
+               buffer[i*channelNumber+l] = static_cast<BTYPE>(currentIntensity[i]);
+               buffer[i*channelNumber+REG_LINE_BLOCK_SIZE+l] = static_cast<BTYPE>(currentDensity[i]);
+            }
+         }
+         else
+         {
+            for(int i=0; i<lineLength; ++i)
+               buffer[i*channelNumber+l] = buffer[i*channelNumber+REG_LINE_BLOCK_SIZE+l] = 0;
+         }
+      }
+      return;
+   }
+   for(int i=0; i<lineLength; ++i)
+   {
+      BTYPE *current = &buffer[i*channelNumber];
+      const size_t shift = (size_t)i*lineOffset;
+      int l=0;
+      for(; l<blockLineNumber; ++l)
+      {
+         current[l] = static_cast<BTYPE>(intensityPtr[realIndex[l]+shift]);
+         current[REG_LINE_BLOCK_SIZE+l] = static_cast<BTYPE>(densityPtr[realIndex[l]+shift]);
+      }
+      for(; l<REG_LINE_BLOCK_SIZE; ++l)
+         current[l] = current[REG_LINE_BLOCK_SIZE+l] = 0;
+   }
+}
+/* *************************************************************** */
+/** @brief Stores a block of lines filled by reg_tools_getLineBlock back into
+ * the intensity and density images.
+ */
+template <class DTYPE, class BTYPE>
+static void reg_tools_setLineBlock(DTYPE *intensityPtr,
+                                   float *densityPtr,
+                                   int lineLength,
+                                   int lineOffset,
+                                   int blockLineNumber,
+                                   const size_t *realIndex,
+                                   const BTYPE *buffer)
+{
+   const int channelNumber = 2*REG_LINE_BLOCK_SIZE;
+   for(int i=0; i<lineLength; ++i)
+   {
+      const BTYPE *current = &buffer[i*channelNumber];
+      const size_t shift = (size_t)i*lineOffset;
+      for(int l=0; l<blockLineNumber; ++l)
+      {
+         intensityPtr[realIndex[l]+shift] = static_cast<DTYPE>(current[l]);
+         densityPtr[realIndex[l]+shift] = static_cast<float>(current[REG_LINE_BLOCK_SIZE+l]);
+      }
+   }
+}
+/* *************************************************************** */
+/** @brief Convolves the intensity and density images along one axis with the
+ * recursive approximation of a Gaussian kernel. The cost per voxel does not
+ * depend on the kernel width. The samples outside of the image are considered
+ * to be zero, as with the finite kernels. Blocks of lines are filtered
+ * together so that the recursions of the different lines are independent.
+ */
+template <class DTYPE>
+static void reg_tools_recursiveGaussianAxis(DTYPE *intensityPtr,
+                                            float *densityPtr,
+                                            int *imageDim,
+                                            int n,
+                                            double sigma)
+{
+   // Intensity and density are stored as separate channels
+   const int channelNumber = 2*REG_LINE_BLOCK_SIZE;
+
+   double causal[4], antiCausal[5], denominator[5];
+   reg_tools_getDericheCoefficients(sigma, causal, antiCausal, denominator);
+
+   int planeNumber, lineOffset;
+   reg_tools_getLineLayout(imageDim, n, &planeNumber, &lineOffset);
+   const int lineLength = imageDim[n];
+   const int blockNumber = (planeNumber+REG_LINE_BLOCK_SIZE-1)/REG_LINE_BLOCK_SIZE;
+   int blockIndex;
+
+#if defined (_OPENMP)
+#pragma omp parallel default(none) \
+   shared(intensityPtr, densityPtr, imageDim, n, causal, antiCausal, denominator, \
+   planeNumber, lineOffset, lineLength, blockNumber) \
+   private(blockIndex)
+#endif // _OPENMP
+   {
+      // The line buffers are allocated on the heap for each thread so that
+      // any image size is supported
+      double *input = (double *)malloc(lineLength*channelNumber*sizeof(double));
+      double *output = (double *)malloc(lineLength*channelNumber*sizeof(double));
+      size_t realIndex[REG_LINE_BLOCK_SIZE];
+      double x[4][2*REG_LINE_BLOCK_SIZE];
+      double y[4][2*REG_LINE_BLOCK_SIZE];
+#if defined (_OPENMP)
+#pragma omp for
+#endif // _OPENMP
+      for(blockIndex=0; blockIndex<blockNumber; ++blockIndex)
+      {
+         const int firstPlane = blockIndex*REG_LINE_BLOCK_SIZE;
+         const int blockLineNumber = planeNumber-firstPlane<REG_LINE_BLOCK_SIZE ?
+                  planeNumber-firstPlane : REG_LINE_BLOCK_SIZE;
+         reg_tools_getLineBlock(intensityPtr, densityPtr, imageDim, n, lineOffset,
+                                firstPlane, blockLineNumber, realIndex, input);
+         // Causal pass
+         for(int k=0; k<4; ++k)
+            for(int c=0; c<channelNumber; ++c)
+               x[k][c] = y[k][c] = 0;
+         for(int i=0; i<lineLength; ++i)
+         {
+            const double *in = &input[i*channelNumber];
+            double *out = &output[i*channelNumber];
+            for(int c=0; c<channelNumber; ++c)
+            {
+               const double value = causal[0]*in[c] + causal[1]*x[0][c] +
+                     causal[2]*x[1][c] + causal[3]*x[2][c] -
+                     denominator[1]*y[0][c] - denominator[2]*y[1][c] -
+                     denominator[3]*y[2][c] - denominator[4]*y[3][c];
+               x[2][c]=x[1][c]; x[1][c]=x[0][c]; x[0][c]=in[c];
+               y[3][c]=y[2][c]; y[2][c]=y[1][c]; y[1][c]=y[0][c]; y[0][c]=value;
+               out[c] = value;
+            }
+         }
+         // Anti-causal pass, accumulated into the causal result
+         for(int k=0; k<4; ++k)
+            for(int c=0; c<channelNumber; ++c)
+               x[k][c] = y[k][c] = 0;
+         for(int i=lineLength-1; i>=0; --i)
+         {
+            const double *in = &input[i*channelNumber];
+            double *out = &output[i*channelNumber];
+            for(int c=0; c<channelNumber; ++c)
+            {
+               const double value = antiCausal[1]*x[0][c] + antiCausal[2]*x[1][c] +
+                     antiCausal[3]*x[2][c] + antiCausal[4]*x[3][c] -
+                     denominator[1]*y[0][c] - denominator[2]*y[1][c] -
+                     denominator[3]*y[2][c] - denominator[4]*y[3][c];
+               x[3][c]=x[2][c]; x[2][c]=x[1][c]; x[1][c]=x[0][c]; x[0][c]=in[c];
+               y[3][c]=y[2][c]; y[2][c]=y[1][c]; y[1][c]=y[0][c]; y[0][c]=value;
+               out[c] += value;
+            }
+         }
+         // Store the filtered lines in place
+         reg_tools_setLineBlock(intensityPtr, densityPtr, lineLength, lineOffset,
+                                blockLineNumber, realIndex, output);
+      } // blocks of lines
+      free(input);
+      free(output);
+   } // parallel region
+}
+/* *************************************************************** */
+/** @brief Convolves the intensity and density images along one axis with a
+ * mean kernel of 2*radius+1 voxels. A moving sum is used so that the cost per
+ * voxel does not depend on the radius. The samples outside of the image are
+ * considered to be zero.
+ */
+template <class DTYPE>
+static void reg_tools_meanAxis(DTYPE *intensityPtr,
+                               float *densityPtr,
+                               int *imageDim,
+                               int n,
+                               int radius)
+{
+   // Intensity and density are stored as separate channels
+   const int channelNumber = 2*REG_LINE_BLOCK_SIZE;
+
+   int planeNumber, lineOffset;
+   reg_tools_getLineLayout(imageDim, n, &planeNumber, &lineOffset);
+   const int lineLength = imageDim[n];
+   const int blockNumber = (planeNumber+REG_LINE_BLOCK_SIZE-1)/REG_LINE_BLOCK_SIZE;
+   int blockIndex;
+
+#if defined (_OPENMP)
+#pragma omp parallel default(none) \
+   shared(intensityPtr, densityPtr, imageDim, n, radius, planeNumber, \
+   lineOffset, lineLength, blockNumber) \
+   private(blockIndex)
+#endif // _OPENMP
+   {
+      // The line buffers are allocated on the heap for each thread so that
+      // any image size is supported
+      double *input = (double *)malloc(lineLength*channelNumber*sizeof(double));
+      double *output = (double *)malloc(lineLength*channelNumber*sizeof(double));
+      size_t realIndex[REG_LINE_BLOCK_SIZE];
+      double sum[2*REG_LINE_BLOCK_SIZE];
+#if defined (_OPENMP)
+#pragma omp for
+#endif // _OPENMP
+      for(blockIndex=0; blockIndex<blockNumber; ++blockIndex)
+      {
+         const int firstPlane = blockIndex*REG_LINE_BLOCK_SIZE;
+         const int blockLineNumber = planeNumber-firstPlane<REG_LINE_BLOCK_SIZE ?
+                  planeNumber-firstPlane : REG_LINE_BLOCK_SIZE;
+         reg_tools_getLineBlock(intensityPtr, densityPtr, imageDim, n, lineOffset,
+                                firstPlane, blockLineNumber, realIndex, input);
+         // Sum over the window of the first voxel
+         for(int c=0; c<channelNumber; ++c)
+            sum[c] = 0;
+         for(int i=0; i<=radius && i<lineLength; ++i)
+         {
+            const double *in = &input[i*channelNumber];
+            for(int c=0; c<channelNumber; ++c)
+               sum[c] += in[c];
+         }
+         // Slide the window along the lines
+         for(int i=0; i<lineLength; ++i)
+         {
+            double *out = &output[i*channelNumber];
+            if(i>0)
+            {
+               if(i+radius<lineLength)
+               {
+                  const double *in = &input[(i+radius)*channelNumber];
+                  for(int c=0; c<channelNumber; ++c)
+                     sum[c] += in[c];
+               }
+               if(i-radius-1>=0)
+               {
+                  const double *in = &input[(i-radius-1)*channelNumber];
+                  for(int c=0; c<channelNumber; ++c)
+                     sum[c] -= in[c];
+               }
+            }
+            for(int c=0; c<channelNumber; ++c)
+               out[c] = sum[c];
+         }
+         // Store the filtered lines in place
+         reg_tools_setLineBlock(intensityPtr, densityPtr, lineLength, lineOffset,
+                                blockLineNumber, realIndex, output);
+      } // blocks of lines
+      free(input);
+      free(output);
+   } // parallel region
+}
+/* *************************************************************** */
+/** @brief Convolves the intensity and density images along y or z with an
+ * explicit kernel. Blocks of adjacent x-columns are filtered together so that
+ * the loads are contiguous and the weighted sums are vectorised across the
+ * columns. The kernel is truncated at the image boundaries.
+ */
+template <class DTYPE>
+static void reg_tools_kernelConvolutionColumns(DTYPE *intensityPtr,
+                                               float *densityPtr,
+                                               int *imageDim,
+                                               int n,
+                                               const float *kernel,
+                                               int radius)
+{
+   const int channelNumber = 2*REG_LINE_BLOCK_SIZE;
+
+   int planeNumber, lineOffset;
+   reg_tools_getLineLayout(imageDim, n, &planeNumber, &lineOffset);
+   const int lineLength = imageDim[n];
+   const int blockNumber = (planeNumber+REG_LINE_BLOCK_SIZE-1)/REG_LINE_BLOCK_SIZE;
+   const reg_simd_kernels *simdKernels = reg_simd_getKernels();
+   int blockIndex;
+
+#if defined (_OPENMP)
+#pragma omp parallel default(none) \
+   shared(intensityPtr, densityPtr, imageDim, n, kernel, radius, planeNumber, \
+   lineOffset, lineLength, blockNumber, simdKernels) \
+   private(blockIndex)
+#endif // _OPENMP
+   {
+      // The column buffers are allocated on the heap for each thread so that
+      // any image size is supported
+      DTYPE *input = (DTYPE *)malloc(lineLength*channelNumber*sizeof(DTYPE));
+      DTYPE *output = (DTYPE *)malloc(lineLength*channelNumber*sizeof(DTYPE));
+      size_t realIndex[REG_LINE_BLOCK_SIZE];
+#if defined (_OPENMP)
+#pragma omp for
+#endif // _OPENMP
+      for(blockIndex=0; blockIndex<blockNumber; ++blockIndex)
+      {
+         const int firstPlane = blockIndex*REG_LINE_BLOCK_SIZE;
+         const int blockLineNumber = planeNumber-firstPlane<REG_LINE_BLOCK_SIZE ?
+                  planeNumber-firstPlane : REG_LINE_BLOCK_SIZE;
+         reg_tools_getLineBlock(intensityPtr, densityPtr, imageDim, n, lineOffset,
+                                firstPlane, blockLineNumber, realIndex, input);
+         for(int i=0; i<lineLength; ++i)
+         {
+            // Define the kernel boundaries
+            int shiftPre = i - radius;
+            int shiftPst = i + radius + 1;
+            const float *kernelPtr = kernel;
+            if(shiftPre<0)
+            {
+               kernelPtr = &kernel[-shiftPre];
+               shiftPre=0;
+            }
+            if(shiftPst>lineLength) shiftPst=lineLength;
+            reg_simd_convolutionColumns(simdKernels,
+                                        kernelPtr,
+                                        &input[shiftPre*channelNumber],
+                                        shiftPst-shiftPre,
+                                        &output[i*channelNumber]);
+         }
+         // Store the filtered columns in place
+         reg_tools_setLineBlock(intensityPtr, densityPtr, lineLength, lineOffset,
+                                blockLineNumber, realIndex, output);
+      } // blocks of columns
+      free(input);
+      free(output);
+   } // parallel region
+}
+/* *************************************************************** */
 template <class DTYPE>
 void reg_tools_kernelConvolution_core(nifti_image *image,
                                       float *sigma,
@@ -1109,11 +1532,6 @@ void reg_tools_kernelConvolution_core(nifti_image *image,
                                       bool *timePoint,
                                       bool *axis)
 {
-   if(image->nx>2048 || image->ny>2048 || image->nz>2048){
-      reg_print_fct_error("reg_tools_kernelConvolution_core");
-      reg_print_msg_error("This function does not support images with dimension > 2048");
-      reg_exit();
-   }
 #ifdef WIN32
    long index;
    long voxelNumber = (long)image->nx*image->ny*image->nz;
@@ -1176,10 +1594,29 @@ void reg_tools_kernelConvolution_core(nifti_image *image,
                   reg_print_msg_error("Unknown kernel type");
                   reg_exit();
                }
-               if(radius>0)
+               if(kernelType==GAUSSIAN_KERNEL &&
+                     radius>=(n>0?REG_RECURSIVE_GAUSSIAN_MIN_COLUMN_RADIUS:REG_RECURSIVE_GAUSSIAN_MIN_RADIUS))
+               {
+                  // Wide Gaussian kernels are applied recursively
+                  reg_tools_recursiveGaussianAxis<DTYPE>(intensityPtr,
+                                                         densityPtr,
+                                                         imageDim,
+                                                         n,
+                                                         temp);
+               }
+               else if(kernelType==MEAN_KERNEL && radius>0)
+               {
+                  // Mean kernels are applied with a moving sum
+                  reg_tools_meanAxis<DTYPE>(intensityPtr,
+                                            densityPtr,
+                                            imageDim,
+                                            n,
+                                            radius);
+               }
+               else if(radius>0)
                {
                   // Allocate the kernel
-                  float kernel[4096];
+                  float *kernel = (float *)malloc((2*radius+1)*sizeof(float));
                   double kernelSum=0;
                   // Fill the kernel
                   if(kernelType==CUBIC_SPLINE_KERNEL)
@@ -1216,111 +1653,83 @@ void reg_tools_kernelConvolution_core(nifti_image *image,
                         kernelSum += kernel[radius+i];
                      }
                   }
-                  else if(kernelType==MEAN_KERNEL && imageDim[2]==1)
-                  {
-                     // Compute the mean kernel
-                     for(int i=-radius; i<=radius; i++)
-                     {
-                        kernel[radius+i]= 1.f;
-                        kernelSum += kernel[radius+i];
-                     }
-                  }
-                  // No kernel is required for the mean filtering
                   // No need for kernel normalisation as this is handle by the density function
 #ifndef NDEBUG
                   char text[255];
                   sprintf(text, "Convolution type[%i] dim[%i] tp[%i] radius[%i] kernelSum[%g]", kernelType, n, t, radius, kernelSum);
                   reg_print_msg_debug(text);
 #endif
-                  int planeNumber, planeIndex, lineOffset;
-                  int lineIndex, shiftPre, shiftPst, k;
-                  switch(n)
+                  if(n>0)
                   {
-                  case 0:
-                     planeNumber=imageDim[1]*imageDim[2];
-                     lineOffset  = 1;
-                     break;
-                  case 1:
-                     planeNumber = imageDim[0]*imageDim[2];
-                     lineOffset  = imageDim[0];
-                     break;
-                  case 2:
-                     planeNumber = imageDim[0]*imageDim[1];
-                     lineOffset  = planeNumber;
-                     break;
+                     // Lines along y and z are filtered as blocks of columns
+                     reg_tools_kernelConvolutionColumns<DTYPE>(intensityPtr,
+                                                               densityPtr,
+                                                               imageDim,
+                                                               n,
+                                                               kernel,
+                                                               radius);
+                     free(kernel);
+                     continue;
                   }
+                  int planeNumber, planeIndex, lineOffset;
+                  int lineIndex, shiftPre, shiftPst;
+                  reg_tools_getLineLayout(imageDim, n, &planeNumber, &lineOffset);
 
-                  size_t realIndex;
-                  float *kernelPtr, kernelValue;
-                  double densitySum, intensitySum;
-                  DTYPE *currentIntensityPtr=NULL;
-                  float *currentDensityPtr = NULL;
-                  DTYPE bufferIntensity[2048];
-                  float bufferDensity[2048];
-                  double bufferIntensitycur=0;
-                  double bufferDensitycur=0;
-
-#ifdef _USE_SSE
-                  union
-                  {
-                     __m128 m;
-                     float f[4] ;
-                  } intensity_sum_sse, density_sum_sse;
-                  __m128 kernel_sse, intensity_sse, density_sse;
-#endif
+                  // The weighted sums use the widest vectorised kernel
+                  const reg_simd_kernels *simdKernels = reg_simd_getKernels();
+                  const int lineLength = imageDim[n];
 
 #if defined (_OPENMP)
-#ifdef _USE_SSE
-#pragma omp parallel for default(none) \
+#pragma omp parallel default(none) \
    shared(imageDim, intensityPtr, densityPtr, radius, kernel, lineOffset, n, \
-   planeNumber,kernelSum) \
-   private(realIndex,currentIntensityPtr,currentDensityPtr,lineIndex,bufferIntensity, \
-   bufferDensity,shiftPre,shiftPst,kernelPtr,kernelValue,densitySum,intensitySum, \
-   k, bufferIntensitycur,bufferDensitycur, planeIndex, \
-   kernel_sse, intensity_sse, density_sse, intensity_sum_sse, density_sum_sse)
-#else
-#pragma omp parallel for default(none) \
-   shared(imageDim, intensityPtr, densityPtr, radius, kernel, lineOffset, n, \
-   planeNumber,kernelSum) \
-   private(realIndex,currentIntensityPtr,currentDensityPtr,lineIndex,bufferIntensity, \
-   bufferDensity,shiftPre,shiftPst,kernelPtr,kernelValue,densitySum,intensitySum, \
-   k, bufferIntensitycur,bufferDensitycur, planeIndex)
-#endif
+   planeNumber, simdKernels, lineLength) \
+   private(planeIndex, lineIndex, shiftPre, shiftPst)
 #endif // _OPENMP
-                  // Loop over the different voxel
-                  for(planeIndex=0; planeIndex<planeNumber; ++planeIndex)
                   {
-
-                     switch(n)
-                     {
-                     case 0:
-                        realIndex = planeIndex * imageDim[0];
-                        break;
-                     case 1:
-                        realIndex = (planeIndex/imageDim[0]) *
-                              imageDim[0]*imageDim[1] +
-                              planeIndex%imageDim[0];
-                        break;
-                     case 2:
-                        realIndex = planeIndex;
-                        break;
-                     default:
-                        realIndex=0;
-                     }
-                     // Fetch the current line into a stack buffer
-                     currentIntensityPtr= &intensityPtr[realIndex];
-                     currentDensityPtr  = &densityPtr[realIndex];
-                     for(lineIndex=0; lineIndex<imageDim[n]; ++lineIndex)
-                     {
-                        bufferIntensity[lineIndex] = *currentIntensityPtr;
-                        bufferDensity[lineIndex]   = *currentDensityPtr;
-                        currentIntensityPtr       += lineOffset;
-                        currentDensityPtr         += lineOffset;
-                     }
-                     if(kernelSum>0)
+                     size_t realIndex;
+                     float *kernelPtr;
+                     double densitySum, intensitySum;
+                     DTYPE *currentIntensityPtr=NULL;
+                     float *currentDensityPtr = NULL;
+                     // The line buffers are allocated on the heap for each
+                     // thread so that any image size is supported
+                     DTYPE *bufferIntensity = (DTYPE *)malloc(lineLength*sizeof(DTYPE));
+                     float *bufferDensity = (float *)malloc(lineLength*sizeof(float));
+#if defined (_OPENMP)
+#pragma omp for
+#endif // _OPENMP
+                     // Loop over the different voxel
+                     for(planeIndex=0; planeIndex<planeNumber; ++planeIndex)
                      {
+
+                        switch(n)
+                        {
+                        case 0:
+                           realIndex = planeIndex * imageDim[0];
+                           break;
+                        case 1:
+                           realIndex = (planeIndex/imageDim[0]) *
+                                 imageDim[0]*imageDim[1] +
+                                 planeIndex%imageDim[0];
+                           break;
+                        case 2:
+                           realIndex = planeIndex;
+                           break;
+                        default:
+                           realIndex=0;
+                        }
+                        // Fetch the current line into the thread buffer
+                        currentIntensityPtr= &intensityPtr[realIndex];
+                        currentDensityPtr  = &densityPtr[realIndex];
+                        for(lineIndex=0; lineIndex<lineLength; ++lineIndex)
+                        {
+                           bufferIntensity[lineIndex] = *currentIntensityPtr;
+                           bufferDensity[lineIndex]   = *currentDensityPtr;
+                           currentIntensityPtr       += lineOffset;
+                           currentDensityPtr         += lineOffset;
+                        }
                         // Perform the kernel convolution along 1 line
-                        for(lineIndex=0; lineIndex<imageDim[n]; ++lineIndex)
+                        for(lineIndex=0; lineIndex<lineLength; ++lineIndex)
                         {
                            // Define the kernel boundaries
                            shiftPre = lineIndex - radius;
@@ -1331,103 +1740,25 @@ void reg_tools_kernelConvolution_core(nifti_image *image,
                               shiftPre=0;
                            }
                            else kernelPtr = &kernel[0];
-                           if(shiftPst>imageDim[n]) shiftPst=imageDim[n];
-                           // Set the current values to zero
-                           // Increment the current value by performing the weighted sum
-#ifdef _USE_SSE
-                           intensity_sum_sse.m = _mm_set_ps1(0.0);
-                           density_sum_sse.m = _mm_set_ps1(0.0);
-                           k=shiftPre;
-                           while(k<shiftPst-3)
-                           {
-                              kernel_sse = _mm_set_ps(kernelPtr[0], kernelPtr[1], kernelPtr[2], kernelPtr[3]);
-                              kernelPtr+=4;
-                              intensity_sse = _mm_set_ps(static_cast<float>(bufferIntensity[k]),
-                                                         static_cast<float>(bufferIntensity[k+1]),
-                                                         static_cast<float>(bufferIntensity[k+2]),
-                                                         static_cast<float>(bufferIntensity[k+3]));
-                              density_sse = _mm_set_ps(bufferDensity[k],
-                                    bufferDensity[k+1],
-                                    bufferDensity[k+2],
-                                    bufferDensity[k+3]);
-                              k+=4;
-                              intensity_sum_sse.m = _mm_add_ps(_mm_mul_ps(kernel_sse, intensity_sse), intensity_sum_sse.m);
-                              density_sum_sse.m = _mm_add_ps(_mm_mul_ps(kernel_sse, density_sse), density_sum_sse.m);
-                           }
-#ifdef __SSE3__
-                           intensity_sum_sse.m = _mm_hadd_ps(intensity_sum_sse.m, density_sum_sse.m);
-                           intensity_sum_sse.m = _mm_hadd_ps(intensity_sum_sse.m, intensity_sum_sse.m);
-                           intensitySum = intensity_sum_sse.f[0];
-                           densitySum = intensity_sum_sse.f[1];
-#else
-                           intensitySum = intensity_sum_sse.f[0] + intensity_sum_sse.f[1] + intensity_sum_sse.f[2] + intensity_sum_sse.f[3];
-                           densitySum = density_sum_sse.f[0] + density_sum_sse.f[1] + density_sum_sse.f[2] + density_sum_sse.f[3];
-#endif
-                           while(k<shiftPst)
-                           {
-                              kernelValue   = *kernelPtr++;
-                              intensitySum +=  kernelValue * bufferIntensity[k];
-                              densitySum   +=  kernelValue * bufferDensity[k++];
-                           }
-#else
-                           intensitySum=0;
-                           densitySum=0;
-                           for(k=shiftPre; k<shiftPst; ++k)
-                           {
-                              kernelValue   = *kernelPtr++;
-                              intensitySum +=  kernelValue * bufferIntensity[k];
-                              densitySum   +=  kernelValue * bufferDensity[k];
-                           }
-#endif
+                           if(shiftPst>lineLength) shiftPst=lineLength;
+                           // Perform the weighted sum over the kernel window
+                           reg_simd_convolutionWindow(simdKernels,
+                                                      kernelPtr,
+                                                      &bufferIntensity[shiftPre],
+                                                      &bufferDensity[shiftPre],
+                                                      shiftPst-shiftPre,
+                                                      &intensitySum,
+                                                      &densitySum);
                            // Store the computed value inplace
                            intensityPtr[realIndex] = static_cast<DTYPE>(intensitySum);
                            densityPtr[realIndex] = static_cast<float>(densitySum);
                            realIndex += lineOffset;
                         } // line convolution
-                     } // kernel sum
-                     else
-                     {
-                        for(lineIndex=1; lineIndex<imageDim[n]; ++lineIndex)
-                        {
-                           bufferIntensity[lineIndex]+=bufferIntensity[lineIndex-1];
-                           bufferDensity[lineIndex]+=bufferDensity[lineIndex-1];
-                        }
-                        shiftPre = -radius - 1;
-                        shiftPst = radius;
-                        for(lineIndex=0; lineIndex<imageDim[n]; ++lineIndex,++shiftPre,++shiftPst)
-                        {
-                           if(shiftPre>-1)
-                           {
-                              if(shiftPst<imageDim[n])
-                              {
-                                 bufferIntensitycur = bufferIntensity[shiftPre]-bufferIntensity[shiftPst];
-                                 bufferDensitycur = bufferDensity[shiftPre]-bufferDensity[shiftPst];
-                              }
-                              else
-                              {
-                                 bufferIntensitycur = bufferIntensity[shiftPre]-bufferIntensity[imageDim[n]-1];
-                                 bufferDensitycur = bufferDensity[shiftPre]-bufferDensity[imageDim[n]-1];
-                              }
-                           }
-                           else
-                           {
-                              if(shiftPst<imageDim[n])
-                              {
-                                 bufferIntensitycur = -bufferIntensity[shiftPst];
-                                 bufferDensitycur = -bufferDensity[shiftPst];
-                              }
-                              else{
-                                 bufferIntensitycur = 0;
-                                 bufferDensitycur = 0;
-                              }
-                           }
-                           intensityPtr[realIndex]=static_cast<DTYPE>(bufferIntensitycur);
-                           densityPtr[realIndex]=static_cast<float>(bufferDensitycur);
-
-                           realIndex += lineOffset;
-                        } // line convolution of mean filter
-                     } // No kernel computation
-                  } // pixel in starting plane
+                     } // pixel in starting plane
+                     free(bufferIntensity);
+                     free(bufferDensity);
+                  } // parallel region
+                  free(kernel);
                } // radius > 0
             } // active axis
          } // axes
@@ -1460,11 +1791,6 @@ void reg_tools_labelKernelConvolution_core(nifti_image *image,
                                            int *mask,
                                            bool *timePoint)
 {
-   if(image->nx>2048 || image->ny>2048 || image->nz>2048){
-      reg_print_fct_error("reg_tools_labelKernelConvolution_core");
-      reg_print_msg_error("This function does not support images with dimension > 2048");
-      reg_exit();
-   }
 #ifdef WIN32
    long index;
    long voxelNumber = (long)image->nx*image->ny*image->nz;
@@ -2073,6 +2399,350 @@ void reg_tools_binaryImage2int(nifti_image *image, int *array, int &activeVoxelN
    }
 }
 /* *************************************************************** */
+reg_maskSpans *reg_tools_createMaskSpans(const int *mask, const int *dim)
+{
+   reg_maskSpans *spans=(reg_maskSpans *)malloc(sizeof(reg_maskSpans));
+   spans->dim[0]=dim[0];
+   spans->dim[1]=dim[1];
+   spans->dim[2]=dim[2];
+   size_t lineNumber=(size_t)dim[1]*dim[2];
+   spans->lineSpan=(size_t *)malloc((lineNumber+1)*sizeof(size_t));
+   // The spans are first counted so that they can be stored contiguously
+   size_t spanNumber=0, index=0;
+   for(size_t line=0; line<lineNumber; ++line)
+   {
+      spans->lineSpan[line]=spanNumber;
+      if(mask==NULL)
+      {
+         if(dim[0]>0) ++spanNumber;
+         continue;
+      }
+      bool active=false;
+      for(int x=0; x<dim[0]; ++x, ++index)
+      {
+         if(mask[index]>-1 && !active) ++spanNumber;
+         active=mask[index]>-1;
+      }
+   }
+   spans->lineSpan[lineNumber]=spanNumber;
+   spans->spanStart=(int *)malloc((spanNumber>0?spanNumber:1)*sizeof(int));
+   spans->spanEnd=(int *)malloc((spanNumber>0?spanNumber:1)*sizeof(int));
+   spans->activeVoxelNumber=0;
+   size_t s=0;
+   index=0;
+   for(size_t line=0; line<lineNumber; ++line)
+   {
+      if(mask==NULL)
+      {
+         if(dim[0]>0)
+         {
+            spans->spanStart[s]=0;
+            spans->spanEnd[s++]=dim[0];
+            spans->activeVoxelNumber+=dim[0];
+         }
+         continue;
+      }
+      for(int x=0; x<dim[0]; ++x, ++index)
+      {
+         if(mask[index]<0) continue;
+         spans->spanStart[s]=x;
+         while(x<dim[0] && mask[index]>-1)
+         {
+            ++x;
+            ++index;
+         }
+         spans->spanEnd[s]=x;
+         spans->activeVoxelNumber+=spans->spanEnd[s]-spans->spanStart[s];
+         ++s;
+         if(x==dim[0]) break;
+      }
+   }
+   return spans;
+}
+/* *************************************************************** */
+void reg_tools_freeMaskSpans(reg_maskSpans *spans)
+{
+   if(spans==NULL) return;
+   free(spans->lineSpan);
+   free(spans->spanStart);
+   free(spans->spanEnd);
+   free(spans);
+}
+/* *************************************************************** */
+size_t reg_tools_sampleMask(const int *mask,
+                            int *sampledMask,
+                            size_t voxelNumber,
+                            float rate,
+                            unsigned int seed)
+{
+   // A voxel is kept when its hashed index falls below the threshold
+   double threshold=(double)rate*4294967296.0;
+   unsigned int seedHash=seed*0x9E3779B9u;
+   seedHash^=seedHash>>16;
+#ifdef _WIN32
+   long voxel;
+   long voxelNumberLong=(long)voxelNumber;
+#else
+   size_t voxel;
+   size_t voxelNumberLong=voxelNumber;
+#endif
+   size_t sampleNumber=0;
+   unsigned int hash;
+#if defined (_OPENMP)
+#pragma omp parallel for default(none) \
+   shared(voxelNumberLong,mask,sampledMask,threshold,seedHash) \
+   private(voxel,hash) \
+   reduction(+:sampleNumber)
+#endif
+   for(voxel=0; voxel<voxelNumberLong; ++voxel)
+   {
+      sampledMask[voxel]=-1;
+      if(mask[voxel]<0) continue;
+      // Murmur3 finaliser applied to the voxel index combined with the seed
+      hash=(unsigned int)voxel ^ (unsigned int)((unsigned long long)voxel>>32) ^ seedHash;
+      hash^=hash>>16;
+      hash*=0x85EBCA6Bu;
+      hash^=hash>>13;
+      hash*=0xC2B2AE35u;
+      hash^=hash>>16;
+      if((double)hash<threshold)
+      {
+         sampledMask[voxel]=mask[voxel];
+         ++sampleNumber;
+      }
+   }
+   return sampleNumber;
+}
+/* *************************************************************** */
+template <class DTYPE>
+void reg_tools_accumulateVoxelBasedGradient1(nifti_image **derivativeImages,
+                                             nifti_image **warpedGradientImages,
+                                             int imageNumber,
+                                             nifti_image *voxelBasedGradientImage,
+                                             const reg_maskSpans *maskSpans)
+{
+#ifdef _WIN32
+   long voxel, line;
+   long voxelNumber = (long)voxelBasedGradientImage->nx*voxelBasedGradientImage->ny*voxelBasedGradientImage->nz;
+   long lineNumber = (long)voxelBasedGradientImage->ny*voxelBasedGradientImage->nz;
+#else
+   size_t voxel, line;
+   size_t voxelNumber = (size_t)voxelBasedGradientImage->nx*voxelBasedGradientImage->ny*voxelBasedGradientImage->nz;
+   size_t lineNumber = (size_t)voxelBasedGradientImage->ny*voxelBasedGradientImage->nz;
+#endif
+   size_t span;
+   reg_maskSpans *temporarySpans=NULL;
+   if(maskSpans==NULL)
+   {
+      int dim[3]={voxelBasedGradientImage->nx, voxelBasedGradientImage->ny, voxelBasedGradientImage->nz};
+      maskSpans=temporarySpans=reg_tools_createMaskSpans(NULL, dim);
+   }
+   int dimNumber=voxelBasedGradientImage->nz>1?3:2;
+   DTYPE **derivativePtr = (DTYPE **)malloc(imageNumber*sizeof(DTYPE *));
+   DTYPE **warGradPtr = (DTYPE **)malloc(imageNumber*dimNumber*sizeof(DTYPE *));
+   DTYPE *measureGradPtr[3];
+   for(int t=0; t<imageNumber; ++t)
+   {
+      derivativePtr[t] = static_cast<DTYPE *>(derivativeImages[t]->data);
+      for(int d=0; d<dimNumber; ++d)
+         warGradPtr[t*dimNumber+d] = &static_cast<DTYPE *>(warpedGradientImages[t]->data)[d*voxelNumber];
+   }
+   for(int d=0; d<dimNumber; ++d)
+      measureGradPtr[d] = &static_cast<DTYPE *>(voxelBasedGradientImage->data)[d*voxelNumber];
+   DTYPE derivative, grad, sum[3];
+   int t, d;
+#if defined (_OPENMP)
+#pragma omp parallel for default(none) \
+   shared(lineNumber, voxelBasedGradientImage, maskSpans, derivativePtr, \
+   warGradPtr, measureGradPtr, dimNumber, imageNumber) \
+   private(voxel, line, span, derivative, grad, sum, t, d)
+#endif
+   for(line=0; line<lineNumber; ++line)
+   {
+      for(span=maskSpans->lineSpan[line]; span<maskSpans->lineSpan[line+1]; ++span)
+      {
+         for(voxel=line*voxelBasedGradientImage->nx+maskSpans->spanStart[span];
+             voxel<line*voxelBasedGradientImage->nx+maskSpans->spanEnd[span]; ++voxel)
+         {
+            sum[0]=sum[1]=sum[2]=0;
+            for(t=0; t<imageNumber; ++t)
+            {
+               derivative=derivativePtr[t][voxel];
+               if(derivative==0) continue;
+               for(d=0; d<dimNumber; ++d)
+               {
+                  grad=warGradPtr[t*dimNumber+d][voxel];
+                  if(grad==grad)
+                     sum[d] += derivative * grad;
+               }
+            }
+            for(d=0; d<dimNumber; ++d)
+               measureGradPtr[d][voxel] += sum[d];
+         }
+      }
+   }
+   free(derivativePtr);
+   free(warGradPtr);
+   reg_tools_freeMaskSpans(temporarySpans);
+}
+/* *************************************************************** */
+void reg_tools_accumulateVoxelBasedGradient(nifti_image **derivativeImages,
+                                            nifti_image **warpedGradientImages,
+                                            int imageNumber,
+                                            nifti_image *voxelBasedGradientImage,
+                                            const reg_maskSpans *maskSpans)
+{
+   for(int t=0; t<imageNumber; ++t)
+   {
+      if(derivativeImages[t]->datatype!=voxelBasedGradientImage->datatype ||
+            warpedGradientImages[t]->datatype!=voxelBasedGradientImage->datatype)
+      {
+         reg_print_fct_error("reg_tools_accumulateVoxelBasedGradient");
+         reg_print_msg_error("Input images are expected to have the same type");
+         reg_exit();
+      }
+   }
+   switch(voxelBasedGradientImage->datatype)
+   {
+   case NIFTI_TYPE_FLOAT32:
+      reg_tools_accumulateVoxelBasedGradient1<float>
+            (derivativeImages, warpedGradientImages, imageNumber, voxelBasedGradientImage, maskSpans);
+      break;
+   case NIFTI_TYPE_FLOAT64:
+      reg_tools_accumulateVoxelBasedGradient1<double>
+            (derivativeImages, warpedGradientImages, imageNumber, voxelBasedGradientImage, maskSpans);
+      break;
+   default:
+      reg_print_fct_error("reg_tools_accumulateVoxelBasedGradient");
+      reg_print_msg_error("The image data type is not supported");
+      reg_exit();
+   }
+}
+/* *************************************************************** */
+template <class DTYPE>
+bool reg_tools_getForegroundBoundingBox1(nifti_image *image, int margin, int *bbox)
+{
+   bbox[0]=image->nx; bbox[1]=-1;
+   bbox[2]=image->ny; bbox[3]=-1;
+   bbox[4]=image->nz; bbox[5]=-1;
+   size_t voxelNumber=(size_t)image->nx*image->ny*image->nz;
+   size_t volumeNumber=image->nvox/voxelNumber;
+   DTYPE *dataPtr=static_cast<DTYPE *>(image->data);
+   for(size_t v=0; v<volumeNumber; ++v)
+   {
+      DTYPE *volPtr=&dataPtr[v*voxelNumber];
+      size_t index=0;
+      for(int z=0; z<image->nz; ++z)
+      {
+         for(int y=0; y<image->ny; ++y)
+         {
+            for(int x=0; x<image->nx; ++x, ++index)
+            {
+               DTYPE value=volPtr[index];
+               if(value==0 || value!=value) continue;
+               if(x<bbox[0]) bbox[0]=x;
+               if(x>bbox[1]) bbox[1]=x;
+               if(y<bbox[2]) bbox[2]=y;
+               if(y>bbox[3]) bbox[3]=y;
+               if(z<bbox[4]) bbox[4]=z;
+               if(z>bbox[5]) bbox[5]=z;
+            }
+         }
+      }
+   }
+   if(bbox[1]<0) return false;
+   int dim[3]={image->nx, image->ny, image->nz};
+   for(int i=0; i<3; ++i)
+   {
+      bbox[2*i]=bbox[2*i]-margin<0?0:bbox[2*i]-margin;
+      bbox[2*i+1]=bbox[2*i+1]+margin>=dim[i]?dim[i]-1:bbox[2*i+1]+margin;
+   }
+   return true;
+}
+/* *************************************************************** */
+bool reg_tools_getForegroundBoundingBox(nifti_image *image, int margin, int *bbox)
+{
+   switch(image->datatype)
+   {
+   case NIFTI_TYPE_UINT8:
+      return reg_tools_getForegroundBoundingBox1<unsigned char>(image, margin, bbox);
+   case NIFTI_TYPE_INT8:
+      return reg_tools_getForegroundBoundingBox1<char>(image, margin, bbox);
+   case NIFTI_TYPE_UINT16:
+      return reg_tools_getForegroundBoundingBox1<unsigned short>(image, margin, bbox);
+   case NIFTI_TYPE_INT16:
+      return reg_tools_getForegroundBoundingBox1<short>(image, margin, bbox);
+   case NIFTI_TYPE_UINT32:
+      return reg_tools_getForegroundBoundingBox1<unsigned int>(image, margin, bbox);
+   case NIFTI_TYPE_INT32:
+      return reg_tools_getForegroundBoundingBox1<int>(image, margin, bbox);
+   case NIFTI_TYPE_FLOAT32:
+      return reg_tools_getForegroundBoundingBox1<float>(image, margin, bbox);
+   case NIFTI_TYPE_FLOAT64:
+      return reg_tools_getForegroundBoundingBox1<double>(image, margin, bbox);
+   default:
+      reg_print_fct_error("reg_tools_getForegroundBoundingBox");
+      reg_print_msg_error("The image data type is not supported");
+      reg_exit();
+   }
+   return false;
+}
+/* *************************************************************** */
+nifti_image *reg_tools_cropImage(nifti_image *image, const int *bbox)
+{
+   if(bbox[0]<0 || bbox[1]>=image->nx || bbox[0]>bbox[1] ||
+         bbox[2]<0 || bbox[3]>=image->ny || bbox[2]>bbox[3] ||
+         bbox[4]<0 || bbox[5]>=image->nz || bbox[4]>bbox[5])
+   {
+      reg_print_fct_error("reg_tools_cropImage");
+      reg_print_msg_error("The bounding box does not fit within the image");
+      reg_exit();
+   }
+   nifti_image *croppedImage=nifti_copy_nim_info(image);
+   croppedImage->dim[1]=croppedImage->nx=bbox[1]-bbox[0]+1;
+   croppedImage->dim[2]=croppedImage->ny=bbox[3]-bbox[2]+1;
+   croppedImage->dim[3]=croppedImage->nz=bbox[5]-bbox[4]+1;
+   size_t voxelNumber=(size_t)image->nx*image->ny*image->nz;
+   size_t volumeNumber=image->nvox/voxelNumber;
+   croppedImage->nvox=(size_t)croppedImage->nx*croppedImage->ny*croppedImage->nz*volumeNumber;
+   croppedImage->data=(void *)malloc(croppedImage->nvox*croppedImage->nbyper);
+
+   // The lines along the x-axis are copied one at a time
+   size_t lineSize=(size_t)croppedImage->nx*image->nbyper;
+   char *inPtr=static_cast<char *>(image->data);
+   char *outPtr=static_cast<char *>(croppedImage->data);
+   for(size_t v=0; v<volumeNumber; ++v)
+   {
+      for(int z=bbox[4]; z<=bbox[5]; ++z)
+      {
+         for(int y=bbox[2]; y<=bbox[3]; ++y)
+         {
+            size_t index=v*voxelNumber+((size_t)z*image->ny+y)*image->nx+bbox[0];
+            memcpy(outPtr, &inPtr[index*image->nbyper], lineSize);
+            outPtr+=lineSize;
+         }
+      }
+   }
+
+   // The first cropped voxel keeps its world position
+   float originIndex[3]={(float)bbox[0], (float)bbox[2], (float)bbox[4]};
+   float originReal[3];
+   reg_mat44_mul(&image->qto_xyz, originIndex, originReal);
+   croppedImage->qto_xyz.m[0][3]=croppedImage->qoffset_x=originReal[0];
+   croppedImage->qto_xyz.m[1][3]=croppedImage->qoffset_y=originReal[1];
+   croppedImage->qto_xyz.m[2][3]=croppedImage->qoffset_z=originReal[2];
+   croppedImage->qto_ijk=nifti_mat44_inverse(croppedImage->qto_xyz);
+   if(image->sform_code>0)
+   {
+      reg_mat44_mul(&image->sto_xyz, originIndex, originReal);
+      croppedImage->sto_xyz.m[0][3]=originReal[0];
+      croppedImage->sto_xyz.m[1][3]=originReal[1];
+      croppedImage->sto_xyz.m[2][3]=originReal[2];
+      croppedImage->sto_ijk=nifti_mat44_inverse(croppedImage->sto_xyz);
+   }
+   return croppedImage;
+}
+/* *************************************************************** */
 /* *************************************************************** */
 template <class ATYPE,class BTYPE>
 double reg_tools_getMeanRMS2(nifti_image *imageA, nifti_image *imageB)
@@ -27,6 +27,20 @@ typedef enum
    CUBIC_SPLINE_KERNEL
 } NREG_CONV_KERNEL_TYPE;
 
+/** @brief Compact representation of a mask as runs of active voxels.
+ * The active voxels of each line along the x-axis are stored as
+ * [spanStart,spanEnd) intervals. The spans of the line (y,z) are
+ * the entries lineSpan[z*dim[1]+y] to lineSpan[z*dim[1]+y+1]-1.
+ */
+typedef struct
+{
+   int dim[3];
+   size_t activeVoxelNumber;
+   size_t *lineSpan;
+   int *spanStart;
+   int *spanEnd;
+} reg_maskSpans;
+
 /* *************************************************************** */
 /** @brief This function check some header parameters and correct them in
  * case of error. For example no dimension is lower than one. The scl_sclope
@@ -83,7 +97,10 @@ void reg_getRealImageSpacing(nifti_image *image,
 /** @brief Smooth an image using a Gaussian kernel
  * @param image Image to be smoothed
  * @param sigma Standard deviation of the Gaussian kernel
- * to use. The kernel is bounded between +/- 3 sigma.
+ * to use. The kernel is bounded between +/- 3 sigma. Gaussian kernels
+ * with a radius of at least 8 voxels along x, or 36 voxels along y and z,
+ * are approximated with a recursive filter whose cost does not depend on
+ * sigma.
  * @param axis Boolean array to specify which axis have to be
  * smoothed. The array follow the dim array of the nifti header.
  */
@@ -266,6 +283,87 @@ extern "C++"
 void reg_tools_binaryImage2int(nifti_image *img,
                                int *array,
                                int &activeVoxelNumber);
+/* *************************************************************** */
+/** @brief Convert a mask array into runs of active voxels along the x-axis
+ * @param mask Mask array. Voxels with a negative value are inactive.
+ * If NULL, all voxels are considered active
+ * @param dim Dimension of the mask along the x, y and z axes
+ * @return The allocated spans, to be released using reg_tools_freeMaskSpans
+ */
+extern "C++"
+reg_maskSpans *reg_tools_createMaskSpans(const int *mask,
+                                         const int *dim);
+/* *************************************************************** */
+/** @brief Release the spans created by reg_tools_createMaskSpans
+ * @param spans Spans to be released. NULL is accepted
+ */
+extern "C++"
+void reg_tools_freeMaskSpans(reg_maskSpans *spans);
+/* *************************************************************** */
+/** @brief Draw a random subset of the active voxels of a mask. Every
+ * active voxel is kept with a probability equal to the sampling rate.
+ * The draw only depends on the voxel index and on the seed, it is thus
+ * reproducible and independent of the number of threads
+ * @param mask Input mask array. Voxels with a negative value are inactive
+ * @param sampledMask Output mask array, the discarded voxels are set to -1
+ * @param voxelNumber Number of voxels in the mask arrays
+ * @param rate Sampling rate, between 0 and 1
+ * @param seed Seed of the draw
+ * @return The number of active voxels in the sampled mask
+ */
+extern "C++"
+size_t reg_tools_sampleMask(const int *mask,
+                            int *sampledMask,
+                            size_t voxelNumber,
+                            float rate,
+                            unsigned int seed);
+/* *************************************************************** */
+/** @brief Add to a voxel based gradient image the sum, over several time
+ * points, of the products of a scalar derivative image and of a spatial
+ * gradient image. The voxel based gradient is updated once per voxel and
+ * the undefined components of the spatial gradients are ignored
+ * @param derivativeImages Scalar images that contain the derivative of
+ * the measure(s) of similarity with respect to the warped intensities of
+ * each time point
+ * @param warpedGradientImages Spatial gradients of the warped image for
+ * the same time points
+ * @param imageNumber Number of time points to accumulate
+ * @param voxelBasedGradientImage Image to be updated
+ * @param maskSpans Spans of active voxels. All voxels are visited if NULL
+ */
+extern "C++"
+void reg_tools_accumulateVoxelBasedGradient(nifti_image **derivativeImages,
+                                            nifti_image **warpedGradientImages,
+                                            int imageNumber,
+                                            nifti_image *voxelBasedGradientImage,
+                                            const reg_maskSpans *maskSpans);
+/* *************************************************************** */
+/** @brief Compute the bounding box of the foreground of an image.
+ * A voxel belongs to the foreground when any of its time points
+ * holds a finite non-zero value
+ * @param img Input image
+ * @param margin Number of voxels added on each side of the box. The
+ * box is clipped to the image extent
+ * @param bbox Output box, stored as [xmin xmax ymin ymax zmin zmax]
+ * with inclusive bounds
+ * @return false if the image has no foreground voxel
+ */
+extern "C++"
+bool reg_tools_getForegroundBoundingBox(nifti_image *img,
+                                        int margin,
+                                        int *bbox);
+/* *************************************************************** */
+/** @brief Crop an image to a bounding box. The qform and sform of
+ * the returned image are updated so that every voxel keeps its
+ * world position
+ * @param img Input image
+ * @param bbox Box, stored as [xmin xmax ymin ymax zmin zmax] with
+ * inclusive bounds
+ * @return Newly allocated cropped image
+ */
+extern "C++"
+nifti_image *reg_tools_cropImage(nifti_image *img,
+                                 const int *bbox);
 
 /* *************************************************************** */
 /** @brief Compute the mean root mean squared error between
@@ -120,6 +120,10 @@ void CudaAladinContent::initVars()
          reg_tools_changeDatatype<float>(this->CurrentWarped);
    }
 
+   // The device kernels always rely on a deformation field
+   if (this->CurrentReference != NULL && this->CurrentDeformationField == NULL)
+      this->AllocateDeformationField(this->bytes);
+
    this->cudaSContext = &CUDAContextSingletton::Instance();
    this->cudaContext = this->cudaSContext->getContext();
 
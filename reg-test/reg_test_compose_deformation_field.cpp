@@ -1,64 +1,370 @@
-#include "_reg_ReadWriteImage.h"
 #include "_reg_localTrans.h"
 #include "_reg_tools.h"
 
-#define EPS 0.000001
-
-int main(int argc, char **argv)
-{
-   if(argc!=3)
-   {
-      fprintf(stderr, "Usage: %s <inputDefField> <expectedField>\n", argv[0]);
-      return EXIT_FAILURE;
-   }
-
-   char *inputDefFieldImageName=argv[1];
-   char *inputComFieldImageName=argv[2];
-
-   // Read the input deformation field image image
-   nifti_image *inputDeformationField = reg_io_ReadImageFile(inputDefFieldImageName);
-   if(inputDeformationField==NULL){
-      reg_print_msg_error("The input deformation field image could not be read");
-      return EXIT_FAILURE;
-   }
-   nifti_image *inputComFieldImage = reg_io_ReadImageFile(inputComFieldImageName);
-   if(inputComFieldImage==NULL){
-      reg_print_msg_error("The input composed deformation field image could not be read");
-      return EXIT_FAILURE;
-   }
-   // Check the dimension of the input images
-   if(inputDeformationField->nx != inputComFieldImage->nx ||
-      inputDeformationField->ny != inputComFieldImage->ny ||
-      inputDeformationField->nz != inputComFieldImage->nz ||
-      inputDeformationField->nu != inputComFieldImage->nu){
-      reg_print_msg_error("The input deformation field images do not have corresponding sizes");
-      return EXIT_FAILURE;
-   }
-
-   // Create a deformation field
-   nifti_image *test_field=nifti_copy_nim_info(inputDeformationField);
-   test_field->data=(void *)malloc(test_field->nvox*test_field->nbyper);
-   memcpy(test_field->data, inputDeformationField->data, test_field->nvox*test_field->nbyper);
-
-   // Compute the non-linear deformation field
-   reg_defField_compose(inputDeformationField,
-                        test_field,
-                        NULL);
-
-   // Compute the difference between the computed and inputed deformation field
-   reg_tools_substractImageToImage(inputComFieldImage,test_field,test_field);
-   reg_tools_abs_image(test_field);
-   double max_difference=reg_tools_getMaxValue(test_field);
-
-   nifti_image_free(inputDeformationField);
-   nifti_image_free(inputComFieldImage);
-   nifti_image_free(test_field);
-
-   if(max_difference>EPS){
-      fprintf(stderr, "reg_test_compose_deformation_field error too large: %g (>%g)\n",
-              max_difference, EPS);
-      return EXIT_FAILURE;
-   }
-
-   return EXIT_SUCCESS;
+#include <algorithm>
+#include <cmath>
+
+#include <catch2/catch_test_macros.hpp>
+#include <catch2/benchmark/catch_benchmark.hpp>
+
+#define EPS_SINGLE 0.0001
+
+/*
+    This test file contains the following unit tests:
+    test function: composition of a deformation field with a position field
+    test function: composition of two cubic B-spline control point grids
+    In 3D
+    legacy in place composition applied to a copy of the positions
+    composition into a separate output image
+    composition into the position image
+    The tiled kernels are compared against a voxel by voxel implementation.
+    The benchmarks are hidden and run with: reg_test_compose_deformation_field "[benchmark]"
+*/
+
+
+nifti_image *create_image(int nx, int ny, int nz, float spacing) {
+    int dim[8]= {3, nx, ny, nz, 1, 1, 1, 1};
+    nifti_image *image = nifti_make_new_nim(dim, NIFTI_TYPE_FLOAT32, true);
+    image->pixdim[1]=image->dx=spacing;
+    image->pixdim[2]=image->dy=1.5f*spacing;
+    image->pixdim[3]=image->dz=.75f*spacing;
+    image->qform_code=1;
+    image->qoffset_x=-10.f;
+    image->qoffset_y=4.f;
+    image->qoffset_z=2.5f;
+    image->qto_xyz=nifti_quatern_to_mat44(0.f, 0.f, 0.f,
+                                          image->qoffset_x,
+                                          image->qoffset_y,
+                                          image->qoffset_z,
+                                          image->dx, image->dy, image->dz, 1.f);
+    image->qto_ijk=nifti_mat44_inverse(image->qto_xyz);
+    reg_checkAndCorrectDimension(image);
+    return image;
+}
+
+
+nifti_image *create_field(nifti_image *reference) {
+    nifti_image *field = nifti_copy_nim_info(reference);
+    field->dim[0]=field->ndim=5;
+    field->dim[4]=field->nt=1;
+    field->dim[5]=field->nu=3;
+    field->nvox=(size_t)field->nx*field->ny*field->nz*field->nu;
+    field->data=calloc(field->nvox, field->nbyper);
+    field->intent_code=NIFTI_INTENT_VECTOR;
+    memset(field->intent_name, 0, 16);
+    strcpy(field->intent_name,"NREG_TRANS");
+    field->intent_p1=DEF_FIELD;
+    return field;
+}
+
+
+// Fills a field with the voxel positions plus a smooth displacement whose
+// amplitude is expressed in voxel
+void fill_field(nifti_image *field, float amplitude, float phase) {
+    const size_t voxelNumber=(size_t)field->nx*field->ny*field->nz;
+    float *ptrX=static_cast<float *>(field->data);
+    float *ptrY=&ptrX[voxelNumber];
+    float *ptrZ=&ptrY[voxelNumber];
+    mat44 *voxel2Real = field->sform_code>0?&field->sto_xyz:&field->qto_xyz;
+    size_t index=0;
+    for(int z=0; z<field->nz; ++z) {
+        for(int y=0; y<field->ny; ++y) {
+            for(int x=0; x<field->nx; ++x) {
+                float voxel[3]= {
+                    x + amplitude * sinf(.31f*y + .17f*z + phase),
+                    y + amplitude * cosf(.23f*x - .29f*z + phase),
+                    z + amplitude * sinf(.19f*x + .37f*y - phase)
+                };
+                float position[3];
+                reg_mat44_mul(voxel2Real, voxel, position);
+                ptrX[index]=position[0];
+                ptrY[index]=position[1];
+                ptrZ[index]=position[2];
+                ++index;
+            }
+        }
+    }
+}
+
+
+// Voxel by voxel trilinear composition that relies on the sliding
+// effect for every neighbour that is outside of the deformation field
+void reference_compose(nifti_image *deformationField,
+                       nifti_image *positionField,
+                       nifti_image *outputField,
+                       int *mask) {
+    const size_t defVoxelNumber=(size_t)deformationField->nx*deformationField->ny*deformationField->nz;
+    const size_t voxelNumber=(size_t)positionField->nx*positionField->ny*positionField->nz;
+    float *defPtrX=static_cast<float *>(deformationField->data);
+    float *defPtrY=&defPtrX[defVoxelNumber];
+    float *defPtrZ=&defPtrY[defVoxelNumber];
+    float *posPtr=static_cast<float *>(positionField->data);
+    float *outPtr=static_cast<float *>(outputField->data);
+    mat44 *real2Voxel=deformationField->sform_code>0?&deformationField->sto_ijk:&deformationField->qto_ijk;
+    mat44 *voxel2Real=deformationField->sform_code>0?&deformationField->sto_xyz:&deformationField->qto_xyz;
+    for(size_t i=0; i<voxelNumber; ++i) {
+        float position[3]= {posPtr[i], posPtr[i+voxelNumber], posPtr[i+2*voxelNumber]};
+        if(mask!=nullptr && mask[i]<0) {
+            for(int d=0; d<3; ++d)
+                outPtr[i+d*voxelNumber]=position[d];
+            continue;
+        }
+        float voxel[3];
+        reg_mat44_mul(real2Voxel, position, voxel);
+        int pre[3];
+        float rel[3][2];
+        for(int d=0; d<3; ++d) {
+            pre[d]=static_cast<int>(floorf(voxel[d]));
+            rel[d][1]=voxel[d]-static_cast<float>(pre[d]);
+            rel[d][0]=1.f-rel[d][1];
+        }
+        double result[3]= {0, 0, 0};
+        for(int c=0; c<2; ++c) {
+            for(int b=0; b<2; ++b) {
+                for(int a=0; a<2; ++a) {
+                    int X=pre[0]+a, Y=pre[1]+b, Z=pre[2]+c;
+                    float value[3];
+                    if(X>-1 && X<deformationField->nx &&
+                       Y>-1 && Y<deformationField->ny &&
+                       Z>-1 && Z<deformationField->nz) {
+                        size_t index=((size_t)Z*deformationField->ny+Y)*deformationField->nx+X;
+                        value[0]=defPtrX[index];
+                        value[1]=defPtrY[index];
+                        value[2]=defPtrZ[index];
+                    }
+                    else get_SlidedValues<float>(value[0], value[1], value[2],
+                                                 X, Y, Z,
+                                                 defPtrX, defPtrY, defPtrZ,
+                                                 voxel2Real,
+                                                 deformationField->dim,
+                                                 false);
+                    double basis=rel[0][a]*rel[1][b]*rel[2][c];
+                    for(int d=0; d<3; ++d)
+                        result[d]+=value[d]*basis;
+                }
+            }
+        }
+        for(int d=0; d<3; ++d)
+            outPtr[i+d*voxelNumber]=static_cast<float>(result[d]);
+    }
+}
+
+
+// Node by node cubic B-spline composition of two grids that contain
+// displacements
+void reference_cppComposition(nifti_image *grid1,
+                              nifti_image *grid2,
+                              nifti_image *outputGrid) {
+    const size_t nodeNumber1=(size_t)grid1->nx*grid1->ny*grid1->nz;
+    const size_t nodeNumber2=(size_t)grid2->nx*grid2->ny*grid2->nz;
+    float *grid1PtrX=static_cast<float *>(grid1->data);
+    float *grid1PtrY=&grid1PtrX[nodeNumber1];
+    float *grid1PtrZ=&grid1PtrY[nodeNumber1];
+    float *grid2Ptr=static_cast<float *>(grid2->data);
+    float *outPtr=static_cast<float *>(outputGrid->data);
+    mat44 *real2Voxel1=grid1->sform_code>0?&grid1->sto_ijk:&grid1->qto_ijk;
+    mat44 *voxel2Real2=grid2->sform_code>0?&grid2->sto_xyz:&grid2->qto_xyz;
+    float xControlPoint[64], yControlPoint[64], zControlPoint[64];
+    size_t index=0;
+    for(int z=0; z<grid2->nz; ++z) {
+        for(int y=0; y<grid2->ny; ++y) {
+            for(int x=0; x<grid2->nx; ++x) {
+                float node[3]= {(float)x, (float)y, (float)z};
+                float initial[3], position[3], voxel[3];
+                reg_mat44_mul(voxel2Real2, node, initial);
+                for(int d=0; d<3; ++d)
+                    position[d]=grid2Ptr[index+d*nodeNumber2]+initial[d];
+                reg_mat44_mul(real2Voxel1, position, voxel);
+                int pre[3];
+                float basis[3][4];
+                for(int d=0; d<3; ++d) {
+                    pre[d]=static_cast<int>(floorf(voxel[d]));
+                    float rel=voxel[d]-static_cast<float>(pre[d]);
+                    if(rel<0) rel=0;
+                    get_BSplineBasisValues<float>(rel, basis[d]);
+                }
+                get_GridValues<float>(pre[0]-1, pre[1]-1, pre[2]-1,
+                                      grid1,
+                                      grid1PtrX, grid1PtrY, grid1PtrZ,
+                                      xControlPoint, yControlPoint, zControlPoint,
+                                      false, true);
+                double result[3]= {0, 0, 0};
+                int coord=0;
+                for(int c=0; c<4; ++c) {
+                    for(int b=0; b<4; ++b) {
+                        for(int a=0; a<4; ++a) {
+                            double weight=basis[0][a]*basis[1][b]*basis[2][c];
+                            result[0]+=xControlPoint[coord]*weight;
+                            result[1]+=yControlPoint[coord]*weight;
+                            result[2]+=zControlPoint[coord]*weight;
+                            ++coord;
+                        }
+                    }
+                }
+                for(int d=0; d<3; ++d)
+                    outPtr[index+d*nodeNumber2]=static_cast<float>(result[d]-initial[d]);
+                ++index;
+            }
+        }
+    }
+}
+
+
+nifti_image *copy_image(nifti_image *image) {
+    nifti_image *copy = nifti_copy_nim_info(image);
+    copy->data=malloc(copy->nvox*copy->nbyper);
+    memcpy(copy->data, image->data, copy->nvox*copy->nbyper);
+    return copy;
+}
+
+
+double get_max_difference(nifti_image *image1, nifti_image *image2) {
+    float *ptr1=static_cast<float *>(image1->data);
+    float *ptr2=static_cast<float *>(image2->data);
+    double max_difference=0;
+    for(size_t i=0; i<image1->nvox; ++i)
+        max_difference=std::max(max_difference, fabs((double)ptr1[i]-ptr2[i]));
+    return max_difference;
+}
+
+
+TEST_CASE("Deformation field composition", "[ComposeDefField]") {
+    // The sizes are not multiple of the tile size and the positions go
+    // beyond the deformation field to use the sliding effect
+    nifti_image *reference = create_image(37, 29, 21, 1.25f);
+    nifti_image *deformationField = create_field(reference);
+    fill_field(deformationField, 1.5f, 0.f);
+    nifti_image *positionField = create_field(reference);
+    fill_field(positionField, 2.5f, .5f);
+    int *mask = (int *)malloc(positionField->nx*positionField->ny*positionField->nz*sizeof(int));
+    for(int i=0; i<positionField->nx*positionField->ny*positionField->nz; ++i)
+        mask[i] = i%7==0 ? -1 : 0;
+
+    for(auto && use_mask: {false, true}) {
+        int *test_mask = use_mask ? mask : nullptr;
+        nifti_image *expected = create_field(reference);
+        reference_compose(deformationField, positionField, expected, test_mask);
+
+        SECTION(std::string("in place on a copy of the positions") + (use_mask ? " with a mask" : "")) {
+            nifti_image *test_field = copy_image(positionField);
+            reg_defField_compose(deformationField, test_field, test_mask);
+            REQUIRE(get_max_difference(test_field, expected) < EPS_SINGLE);
+            nifti_image_free(test_field);
+        }
+        SECTION(std::string("into an output field") + (use_mask ? " with a mask" : "")) {
+            nifti_image *positions = copy_image(positionField);
+            nifti_image *test_field = create_field(reference);
+            reg_defField_compose(deformationField, positions, test_field, test_mask);
+            REQUIRE(get_max_difference(test_field, expected) < EPS_SINGLE);
+            // The positions are left untouched
+            REQUIRE(get_max_difference(positions, positionField) == 0);
+            nifti_image_free(positions);
+            nifti_image_free(test_field);
+        }
+        SECTION(std::string("into the position field") + (use_mask ? " with a mask" : "")) {
+            nifti_image *test_field = copy_image(positionField);
+            reg_defField_compose(deformationField, test_field, test_field, test_mask);
+            REQUIRE(get_max_difference(test_field, expected) < EPS_SINGLE);
+            nifti_image_free(test_field);
+        }
+        nifti_image_free(expected);
+    }
+    free(mask);
+    nifti_image_free(positionField);
+    nifti_image_free(deformationField);
+    nifti_image_free(reference);
+}
+
+
+TEST_CASE("Control point grid composition", "[ComposeCPP]") {
+    // The second grid is finer than the first one to use the boundary
+    // nodes of the first grid
+    nifti_image *reference = create_image(41, 35, 27, 1.f);
+    nifti_image *grid1 = nullptr, *grid2 = nullptr;
+    float spacing1[3]= {5.f, 5.f, 5.f}, spacing2[3]= {2.5f, 3.f, 2.f};
+    reg_createControlPointGrid<float>(&grid1, reference, spacing1);
+    reg_createControlPointGrid<float>(&grid2, reference, spacing2);
+    fill_field(grid1, .3f, .2f);
+    reg_getDisplacementFromDeformation(grid1);
+    fill_field(grid2, .4f, -.7f);
+    reg_getDisplacementFromDeformation(grid2);
+
+    nifti_image *expected = copy_image(grid2);
+    reference_cppComposition(grid1, grid2, expected);
+
+    SECTION("in place on a copy of the second grid") {
+        nifti_image *test_grid = copy_image(grid2);
+        reg_spline_cppComposition(grid1, test_grid, true, true, true);
+        REQUIRE(get_max_difference(test_grid, expected) < EPS_SINGLE);
+        nifti_image_free(test_grid);
+    }
+    SECTION("into an output grid") {
+        nifti_image *positions = copy_image(grid2);
+        nifti_image *test_grid = copy_image(grid2);
+        memset(test_grid->data, 0, test_grid->nvox*test_grid->nbyper);
+        reg_spline_cppComposition(grid1, positions, test_grid, true, true, true);
+        REQUIRE(get_max_difference(test_grid, expected) < EPS_SINGLE);
+        // The second grid is left untouched
+        REQUIRE(get_max_difference(positions, grid2) == 0);
+        nifti_image_free(positions);
+        nifti_image_free(test_grid);
+    }
+    SECTION("into the second grid") {
+        nifti_image *test_grid = copy_image(grid2);
+        reg_spline_cppComposition(grid1, test_grid, test_grid, true, true, true);
+        REQUIRE(get_max_difference(test_grid, expected) < EPS_SINGLE);
+        nifti_image_free(test_grid);
+    }
+    nifti_image_free(expected);
+    nifti_image_free(grid2);
+    nifti_image_free(grid1);
+    nifti_image_free(reference);
+}
+
+
+TEST_CASE("Composition computation time", "[.][benchmark]") {
+    nifti_image *reference = create_image(160, 160, 160, 1.f);
+    nifti_image *deformationField = create_field(reference);
+    fill_field(deformationField, 1.5f, 0.f);
+    nifti_image *positionField = create_field(reference);
+    fill_field(positionField, 2.5f, .5f);
+    nifti_image *outputField = create_field(reference);
+
+    BENCHMARK("Field composition with a copy of the positions") {
+        memcpy(outputField->data, positionField->data, outputField->nvox*outputField->nbyper);
+        reg_defField_compose(deformationField, outputField, nullptr);
+        return outputField->data;
+    };
+    BENCHMARK("Field composition into an output field") {
+        reg_defField_compose(deformationField, positionField, outputField, nullptr);
+        return outputField->data;
+    };
+
+    nifti_image *grid1 = nullptr, *grid2 = nullptr;
+    float spacing[3]= {3.75f, 3.75f, 3.75f};
+    reg_createControlPointGrid<float>(&grid1, reference, spacing);
+    reg_createControlPointGrid<float>(&grid2, reference, spacing);
+    fill_field(grid1, .3f, .2f);
+    reg_getDisplacementFromDeformation(grid1);
+    fill_field(grid2, .4f, -.7f);
+    reg_getDisplacementFromDeformation(grid2);
+    nifti_image *outputGrid = copy_image(grid2);
+
+    BENCHMARK("Grid composition with a copy of the second grid") {
+        memcpy(outputGrid->data, grid2->data, outputGrid->nvox*outputGrid->nbyper);
+        reg_spline_cppComposition(grid1, outputGrid, true, true, true);
+        return outputGrid->data;
+    };
+    BENCHMARK("Grid composition into an output grid") {
+        reg_spline_cppComposition(grid1, grid2, outputGrid, true, true, true);
+        return outputGrid->data;
+    };
+
+    nifti_image_free(outputGrid);
+    nifti_image_free(grid2);
+    nifti_image_free(grid1);
+    nifti_image_free(outputField);
+    nifti_image_free(positionField);
+    nifti_image_free(deformationField);
+    nifti_image_free(reference);
 }
@@ -3,8 +3,7 @@
 //#define ONLY_ONE_ITERATION
 
 //#define COMPUTE_DEF_AFFINE
-#define COMPUTE_DEF_SPLINE_LUT
-//#define COMPUTE_DEF_SPLINE
+#define COMPUTE_DEF_SPLINE
 //#define COMPUTE_DEF_COMP
 #define COMPUTE_RESAMPLING
 #define COMPUTE_SP_GRAD
@@ -114,20 +113,6 @@ int main(int argc, char **argv)
     const int spline_iteration=150;
 #endif
 #ifdef COMPUTE_DEF_SPLINE
-    time(&start);
-    for(int i=0;i<spline_iteration;++i)
-        reg_spline_getDeformationField(splineGridOne,
-                                       defFieldOne,
-                                       mask,
-                                       false,
-                                       true,
-                                       true);
-    time(&end);
-    total_time=end-start;
-    printf("BSpline (no lut) deformation in %g second(s) per iteration [%g]\n",
-           total_time/(float)spline_iteration, total_time);
-#endif
-#ifdef COMPUTE_DEF_SPLINE_LUT
     time(&start);
     for(int i=0;i<spline_iteration;++i)
         reg_spline_getDeformationField(splineGridOne,
@@ -135,7 +120,7 @@ int main(int argc, char **argv)
                                        mask);
     time(&end);
     total_time=end-start;
-    printf("BSpline (with lut) deformation in %g second(s) per iteration [%g]\n",
+    printf("BSpline deformation in %g second(s) per iteration [%g]\n",
            total_time/(float)spline_iteration, total_time);
 #endif
 
@@ -0,0 +1,152 @@
+#include "_reg_localTrans.h"
+#include "_reg_tools.h"
+
+#include <algorithm>
+#include <cmath>
+
+#include <catch2/catch_test_macros.hpp>
+
+#define EPS_SINGLE 0.001
+
+/*
+    This test file contains the following unit tests:
+    test function: extension of a control point grid over a reference image
+    In 3D
+    The reference image has a sform that is not aligned with the axes. A grid
+    is created over a crop of the image whose first voxel lies on a node and
+    is then extended over the whole image. The extended grid is expected to
+    match the grid created over the whole image: the first voxel lies on the
+    node 1 and the identity transformation is preserved.
+*/
+
+
+// Creates a reference image whose voxel axes are rotated by angle around
+// the (1,2,3) axis. The qform and sform are identical
+nifti_image *create_reference(float angle) {
+    int dim[8]= {3, 50, 44, 36, 1, 1, 1, 1};
+    nifti_image *reference = nifti_make_new_nim(dim, NIFTI_TYPE_FLOAT32, false);
+    const float spacing[3]= {1.1f, .9f, 1.3f};
+    float axis[3]= {1.f, 2.f, 3.f};
+    const float norm = sqrtf(axis[0]*axis[0]+axis[1]*axis[1]+axis[2]*axis[2]);
+    for(int i=0; i<3; ++i) axis[i] /= norm;
+    const float c=cosf(angle), s=sinf(angle);
+    mat44 voxel2Real;
+    reg_mat44_eye(&voxel2Real);
+    for(int i=0; i<3; ++i) {
+        for(int j=0; j<3; ++j) {
+            float rotation = (1.f-c)*axis[i]*axis[j] + (i==j ? c : 0.f);
+            if(i!=j) {
+                const int k = 3-i-j;
+                const float sign = ((i+1)%3==j) ? -1.f : 1.f;
+                rotation += sign*s*axis[k];
+            }
+            voxel2Real.m[i][j] = rotation * spacing[j];
+        }
+    }
+    voxel2Real.m[0][3]=-31.7f;
+    voxel2Real.m[1][3]=12.3f;
+    voxel2Real.m[2][3]=-7.9f;
+    reference->sform_code=1;
+    reference->sto_xyz=voxel2Real;
+    reference->sto_ijk=nifti_mat44_inverse(voxel2Real);
+    reference->qform_code=1;
+    nifti_mat44_to_quatern(voxel2Real,
+                           &reference->quatern_b, &reference->quatern_c, &reference->quatern_d,
+                           &reference->qoffset_x, &reference->qoffset_y, &reference->qoffset_z,
+                           &reference->dx, &reference->dy, &reference->dz, &reference->qfac);
+    reference->pixdim[1]=reference->dx;
+    reference->pixdim[2]=reference->dy;
+    reference->pixdim[3]=reference->dz;
+    reference->qto_xyz=nifti_quatern_to_mat44(reference->quatern_b, reference->quatern_c, reference->quatern_d,
+                                              reference->qoffset_x, reference->qoffset_y, reference->qoffset_z,
+                                              reference->dx, reference->dy, reference->dz, reference->qfac);
+    reference->qto_ijk=nifti_mat44_inverse(reference->qto_xyz);
+    reg_checkAndCorrectDimension(reference);
+    return reference;
+}
+
+
+// Creates the header of the sub-image that starts at the voxel start
+nifti_image *create_crop(nifti_image *reference, const int *start, const int *size) {
+    nifti_image *crop = nifti_copy_nim_info(reference);
+    crop->dim[1]=crop->nx=size[0];
+    crop->dim[2]=crop->ny=size[1];
+    crop->dim[3]=crop->nz=size[2];
+    crop->nvox=(size_t)crop->nx*crop->ny*crop->nz;
+    float voxel[3]= {(float)start[0], (float)start[1], (float)start[2]}, origin[3];
+    reg_mat44_mul(&reference->sto_xyz, voxel, origin);
+    for(int i=0; i<3; ++i)
+        crop->sto_xyz.m[i][3]=origin[i];
+    crop->sto_ijk=nifti_mat44_inverse(crop->sto_xyz);
+    reg_mat44_mul(&reference->qto_xyz, voxel, origin);
+    crop->qoffset_x=crop->qto_xyz.m[0][3]=origin[0];
+    crop->qoffset_y=crop->qto_xyz.m[1][3]=origin[1];
+    crop->qoffset_z=crop->qto_xyz.m[2][3]=origin[2];
+    crop->qto_ijk=nifti_mat44_inverse(crop->qto_xyz);
+    return crop;
+}
+
+
+void test_extension(float angle) {
+    nifti_image *reference = create_reference(angle);
+    // The grid spacing is five voxels along every axis
+    float spacing[3]= {5.f*reference->dx, 5.f*reference->dy, 5.f*reference->dz};
+    const int start[3]= {10, 15, 5}, size[3]= {31, 22, 24};
+    nifti_image *crop = create_crop(reference, start, size);
+
+    nifti_image *grid = nullptr;
+    reg_createControlPointGrid<float>(&grid, crop, spacing);
+    reg_getDeformationFromDisplacement(grid);
+    reg_spline_extendControlPointGrid(&grid, reference, nullptr);
+
+    nifti_image *expectedGrid = nullptr;
+    reg_createControlPointGrid<float>(&expectedGrid, reference, spacing);
+
+    // The first reference voxel lies on the node 1 of the extended grid
+    REQUIRE(grid->nx == expectedGrid->nx);
+    REQUIRE(grid->ny == expectedGrid->ny);
+    REQUIRE(grid->nz == expectedGrid->nz);
+    mat44 referenceToGrid = reg_mat44_mul(&grid->sto_ijk, &reference->sto_xyz);
+    float voxel[3]= {0.f, 0.f, 0.f}, node[3];
+    reg_mat44_mul(&referenceToGrid, voxel, node);
+    for(int i=0; i<3; ++i)
+        REQUIRE(fabs(node[i]-1.f) < EPS_SINGLE);
+
+    // The extended grid still parametrises the identity
+    nifti_image *field = nifti_copy_nim_info(reference);
+    field->dim[0]=field->ndim=5;
+    field->dim[5]=field->nu=3;
+    field->nvox=(size_t)field->nx*field->ny*field->nz*field->nu;
+    field->data=calloc(field->nvox, field->nbyper);
+    reg_spline_getDeformationField(grid, field);
+    const size_t voxelNumber=(size_t)field->nx*field->ny*field->nz;
+    float *fieldPtr=static_cast<float *>(field->data);
+    double max_difference=0;
+    size_t index=0;
+    for(int z=0; z<field->nz; ++z) {
+        for(int y=0; y<field->ny; ++y) {
+            for(int x=0; x<field->nx; ++x, ++index) {
+                float position[3], current[3]= {(float)x, (float)y, (float)z};
+                reg_mat44_mul(&reference->sto_xyz, current, position);
+                for(int d=0; d<3; ++d)
+                    max_difference = std::max(max_difference,
+                                              (double)fabs(fieldPtr[index+d*voxelNumber]-position[d]));
+            }
+        }
+    }
+    REQUIRE(max_difference < EPS_SINGLE);
+
+    nifti_image_free(field);
+    nifti_image_free(expectedGrid);
+    nifti_image_free(grid);
+    nifti_image_free(crop);
+    nifti_image_free(reference);
+}
+
+
+TEST_CASE("Control point grid extension", "[ExtendControlPointGrid]") {
+    SECTION("rotated sform") {
+        for(int i=1; i<=8; ++i)
+            test_extension(.1f*(float)i);
+    }
+}
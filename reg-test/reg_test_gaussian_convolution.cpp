@@ -0,0 +1,173 @@
+#include "_reg_tools.h"
+
+#include <algorithm>
+#include <cmath>
+#include <limits>
+#include <vector>
+
+#include <catch2/catch_test_macros.hpp>
+
+#define EPS_SINGLE 0.00001
+#define EPS_RECURSIVE 0.001
+
+/*
+    This test file contains the following unit tests:
+    test function: Gaussian smoothing of an image
+    In 3D
+    narrow kernels, which use the explicit kernel along every axis
+    kernels that use the recursive filter along x only
+    wide kernels, which use the recursive filter along every axis
+    The result is compared against a density normalised convolution with the
+    explicit Gaussian kernel, bounded between +/- 3 sigma. The image contains
+    undefined and masked voxels.
+*/
+
+
+// Separable convolution of the intensities and of the density, which is one
+// for the defined voxels, with the explicit Gaussian kernel. The intensities
+// are normalised by the density once every axis has been filtered
+void reference_gaussian(const std::vector<double> &input,
+                        const std::vector<bool> &defined,
+                        const int *dim,
+                        double sigma,
+                        std::vector<double> &output) {
+    const size_t voxelNumber = (size_t)dim[0]*dim[1]*dim[2];
+    const int radius = static_cast<int>(sigma*3.0f);
+    std::vector<double> kernel(2*radius+1);
+    for(int i=-radius; i<=radius; ++i)
+        kernel[i+radius] = exp(-(double)(i*i)/(2.0*sigma*sigma));
+    std::vector<double> intensity(voxelNumber), density(voxelNumber);
+    for(size_t i=0; i<voxelNumber; ++i) {
+        density[i] = defined[i] ? 1. : 0.;
+        intensity[i] = defined[i] ? input[i] : 0.;
+    }
+    const size_t stride[3]= {1, (size_t)dim[0], (size_t)dim[0]*dim[1]};
+    std::vector<double> newIntensity(voxelNumber), newDensity(voxelNumber);
+    for(int n=0; n<3; ++n) {
+        size_t index=0;
+        for(int z=0; z<dim[2]; ++z) {
+            for(int y=0; y<dim[1]; ++y) {
+                for(int x=0; x<dim[0]; ++x, ++index) {
+                    const int position[3]= {x, y, z};
+                    double intensitySum=0, densitySum=0;
+                    for(int k=-radius; k<=radius; ++k) {
+                        const int p = position[n]+k;
+                        if(p<0 || p>=dim[n]) continue;
+                        const size_t neighbour = index + (long)k*(long)stride[n];
+                        intensitySum += kernel[k+radius] * intensity[neighbour];
+                        densitySum += kernel[k+radius] * density[neighbour];
+                    }
+                    newIntensity[index] = intensitySum;
+                    newDensity[index] = densitySum;
+                }
+            }
+        }
+        intensity.swap(newIntensity);
+        density.swap(newDensity);
+    }
+    output.resize(voxelNumber);
+    for(size_t i=0; i<voxelNumber; ++i)
+        output[i] = defined[i] ? intensity[i]/density[i] :
+                                 std::numeric_limits<double>::quiet_NaN();
+}
+
+
+// Returns the largest difference between the smoothed image and the
+// reference. The undefined voxels are expected to remain undefined
+double test_gaussian(float sigma) {
+    int dim[8]= {3, 61, 47, 39, 1, 1, 1, 1};
+    nifti_image *image = nifti_make_new_nim(dim, NIFTI_TYPE_FLOAT32, true);
+    reg_checkAndCorrectDimension(image);
+    const size_t voxelNumber = image->nvox;
+    float *imagePtr = static_cast<float *>(image->data);
+    std::vector<double> input(voxelNumber);
+    std::vector<bool> defined(voxelNumber, true);
+    int *mask = (int *)calloc(voxelNumber, sizeof(int));
+    srand(3);
+    for(size_t i=0; i<voxelNumber; ++i) {
+        imagePtr[i] = (float)rand() / (float)RAND_MAX;
+        input[i] = imagePtr[i];
+        if(i%53==0) {
+            imagePtr[i] = std::numeric_limits<float>::quiet_NaN();
+            defined[i] = false;
+        }
+        if(i%71==0) {
+            mask[i] = -1;
+            defined[i] = false;
+        }
+    }
+
+    // A negative standard deviation is expressed in voxel
+    float sigmaValue = -sigma;
+    reg_tools_kernelConvolution(image, &sigmaValue, GAUSSIAN_KERNEL, mask);
+    std::vector<double> expected;
+    reference_gaussian(input, defined, &dim[1], sigma, expected);
+
+    double max_difference=0;
+    size_t undefinedNumber=0;
+    for(size_t i=0; i<voxelNumber; ++i) {
+        if(!defined[i]) {
+            if(imagePtr[i]!=imagePtr[i]) ++undefinedNumber;
+            continue;
+        }
+        max_difference = std::max(max_difference, fabs(expected[i]-imagePtr[i]));
+    }
+    REQUIRE(undefinedNumber == (size_t)std::count(defined.begin(), defined.end(), false));
+    free(mask);
+    nifti_image_free(image);
+    return max_difference;
+}
+
+
+// Returns the largest difference, relative to the peak, between the
+// response to an impulse and the sampled Gaussian along the axis n
+double test_impulse(int n, float sigma) {
+    int dim[8]= {3, 2, 2, 2, 1, 1, 1, 1};
+    dim[n+1] = 241;
+    nifti_image *image = nifti_make_new_nim(dim, NIFTI_TYPE_FLOAT32, true);
+    reg_checkAndCorrectDimension(image);
+    float *imagePtr = static_cast<float *>(image->data);
+    const size_t stride[3]= {1, (size_t)dim[1], (size_t)dim[1]*dim[2]};
+    const int centre = 120;
+    imagePtr[centre*stride[n]] = 1.f;
+    float sigmaValue = -sigma;
+    bool axis[3]= {n==0, n==1, n==2};
+    reg_tools_kernelConvolution(image, &sigmaValue, GAUSSIAN_KERNEL, nullptr, nullptr, axis);
+
+    // The response is normalised by the kernel density within the line
+    double peak=0, max_difference=0;
+    std::vector<double> expected(dim[n+1]);
+    for(int i=0; i<dim[n+1]; ++i) {
+        double density=0;
+        for(int j=0; j<dim[n+1]; ++j)
+            density += exp(-(double)reg_pow2(i-j)/(2.0*sigma*sigma));
+        expected[i] = exp(-(double)reg_pow2(i-centre)/(2.0*sigma*sigma)) / density;
+        peak = std::max(peak, expected[i]);
+    }
+    for(int i=0; i<dim[n+1]; ++i)
+        max_difference = std::max(max_difference, fabs(expected[i]-imagePtr[i*stride[n]]));
+    nifti_image_free(image);
+    return max_difference / peak;
+}
+
+
+TEST_CASE("Gaussian convolution", "[GaussianConvolution]") {
+    SECTION("explicit kernel along every axis") {
+        REQUIRE(test_gaussian(1.5f) < EPS_SINGLE);
+        REQUIRE(test_gaussian(2.5f) < EPS_SINGLE);
+    }
+    SECTION("recursive filter along x") {
+        REQUIRE(test_gaussian(2.7f) < EPS_RECURSIVE);
+        REQUIRE(test_gaussian(6.f) < EPS_RECURSIVE);
+    }
+    SECTION("recursive filter along every axis") {
+        REQUIRE(test_gaussian(12.f) < EPS_RECURSIVE);
+        REQUIRE(test_gaussian(20.f) < EPS_RECURSIVE);
+    }
+    SECTION("impulse response of the recursive filter") {
+        for(int n=0; n<3; ++n) {
+            REQUIRE(test_impulse(n, 12.f) < EPS_RECURSIVE);
+            REQUIRE(test_impulse(n, 30.f) < EPS_RECURSIVE);
+        }
+    }
+}
@@ -0,0 +1,168 @@
+#include "_reg_localTrans.h"
+#include "_reg_tools.h"
+
+#include <algorithm>
+#include <cmath>
+#include <cstring>
+
+#include <catch2/catch_test_macros.hpp>
+
+#define EPS_INVERSION 0.0001
+
+/*
+    This test file contains the following unit tests:
+    test function: inversion of a deformation field
+    In 3D
+    smooth field, which is inverted by the fixed-point iteration
+    field that collapses a slab onto a plane, which stalls the fixed-point
+    iteration and forces the simplex fallback
+    The inverse composed with the field, using the trilinear interpolation
+    of the field, is checked to be the identity.
+*/
+
+
+nifti_image *create_field(int nx, int ny, int nz, float spacing) {
+    int dim[8]= {5, nx, ny, nz, 1, 3, 1, 1};
+    nifti_image *field = nifti_make_new_nim(dim, NIFTI_TYPE_FLOAT32, true);
+    field->pixdim[1]=field->dx=spacing;
+    field->pixdim[2]=field->dy=1.5f*spacing;
+    field->pixdim[3]=field->dz=.75f*spacing;
+    field->qform_code=1;
+    field->qoffset_x=-10.f;
+    field->qoffset_y=4.f;
+    field->qoffset_z=2.5f;
+    field->qto_xyz=nifti_quatern_to_mat44(0.f, 0.f, 0.f,
+                                          field->qoffset_x,
+                                          field->qoffset_y,
+                                          field->qoffset_z,
+                                          field->dx, field->dy, field->dz, 1.f);
+    field->qto_ijk=nifti_mat44_inverse(field->qto_xyz);
+    field->intent_code=NIFTI_INTENT_VECTOR;
+    memset(field->intent_name, 0, 16);
+    strcpy(field->intent_name,"NREG_TRANS");
+    field->intent_p1=DEF_FIELD;
+    reg_checkAndCorrectDimension(field);
+    return field;
+}
+
+
+// Fills a field with the world position of displaced voxels. The
+// displacement, expressed in voxel, is returned by the displacement
+// function
+template <class DisplacementFunction>
+void fill_field(nifti_image *field, DisplacementFunction displacement) {
+    const size_t voxelNumber=(size_t)field->nx*field->ny*field->nz;
+    float *ptr=static_cast<float *>(field->data);
+    size_t index=0;
+    for(int z=0; z<field->nz; ++z) {
+        for(int y=0; y<field->ny; ++y) {
+            for(int x=0; x<field->nx; ++x, ++index) {
+                float voxel[3]= {(float)x, (float)y, (float)z}, position[3];
+                displacement(voxel);
+                reg_mat44_mul(&field->qto_xyz, voxel, position);
+                for(int d=0; d<3; ++d)
+                    ptr[index+d*voxelNumber]=position[d];
+            }
+        }
+    }
+}
+
+
+// Trilinear interpolation of a field at a world position. Positions
+// outside of the field are linearly extrapolated from the closest cell
+void trilinear_warp(nifti_image *field, const double *position, double *warped) {
+    const size_t voxelNumber=(size_t)field->nx*field->ny*field->nz;
+    const float *ptr=static_cast<float *>(field->data);
+    double voxel[3];
+    for(int i=0; i<3; ++i)
+        voxel[i] = field->qto_ijk.m[i][0]*position[0] +
+                   field->qto_ijk.m[i][1]*position[1] +
+                   field->qto_ijk.m[i][2]*position[2] +
+                   field->qto_ijk.m[i][3];
+    const int dims[3]= {field->nx, field->ny, field->nz};
+    int pre[3];
+    double rel[3];
+    for(int i=0; i<3; ++i) {
+        pre[i]=std::min(std::max((int)voxel[i], 0), dims[i]-2);
+        rel[i]=voxel[i]-pre[i];
+    }
+    for(int d=0; d<3; ++d) {
+        double value=0;
+        for(int c=0; c<2; ++c) {
+            for(int b=0; b<2; ++b) {
+                for(int a=0; a<2; ++a) {
+                    double weight = (a?rel[0]:1.-rel[0]) *
+                                    (b?rel[1]:1.-rel[1]) *
+                                    (c?rel[2]:1.-rel[2]);
+                    size_t index = ((size_t)(pre[2]+c)*field->ny+pre[1]+b)*field->nx+pre[0]+a;
+                    value += weight * ptr[index+d*voxelNumber];
+                }
+            }
+        }
+        warped[d]=value;
+    }
+}
+
+
+// Largest distance between the world position of a voxel and the field
+// applied to its inverse
+double max_inversion_error(nifti_image *field, nifti_image *inverse) {
+    const size_t voxelNumber=(size_t)inverse->nx*inverse->ny*inverse->nz;
+    const float *invPtr=static_cast<float *>(inverse->data);
+    double max_error=0;
+    size_t index=0;
+    for(int z=0; z<inverse->nz; ++z) {
+        for(int y=0; y<inverse->ny; ++y) {
+            for(int x=0; x<inverse->nx; ++x, ++index) {
+                float voxel[3]= {(float)x, (float)y, (float)z}, target[3];
+                reg_mat44_mul(&inverse->qto_xyz, voxel, target);
+                double position[3]= {invPtr[index],
+                                     invPtr[index+voxelNumber],
+                                     invPtr[index+2*voxelNumber]
+                                    }, warped[3];
+                trilinear_warp(field, position, warped);
+                double error = sqrt(reg_pow2(warped[0]-target[0]) +
+                                    reg_pow2(warped[1]-target[1]) +
+                                    reg_pow2(warped[2]-target[2]));
+                if(error!=error) return error;
+                max_error = std::max(max_error, error);
+            }
+        }
+    }
+    return max_error;
+}
+
+
+TEST_CASE("Deformation field inversion", "[InvertDefField]") {
+    nifti_image *field = create_field(31, 27, 23, 1.2f);
+    nifti_image *inverse = create_field(31, 27, 23, 1.2f);
+
+    SECTION("smooth field") {
+        fill_field(field, [](float *voxel) {
+            const float x=voxel[0], y=voxel[1], z=voxel[2];
+            voxel[0] += 1.5f * sinf(.21f*y + .13f*z) + .5f * sinf(.17f*x);
+            voxel[1] += 1.5f * cosf(.19f*x - .23f*z) + .5f * cosf(.11f*y);
+            voxel[2] += 1.5f * sinf(.15f*x + .27f*y) - .5f * sinf(.13f*z);
+        });
+        reg_defFieldInvert(field, inverse, 1.0e-6f);
+        REQUIRE(max_inversion_error(field, inverse) < EPS_INVERSION);
+    }
+    SECTION("field that collapses a slab") {
+        // The voxels from x=12 to x=15 are mapped onto the x=12 plane. The
+        // field Jacobian is singular in the slab, where the fixed-point
+        // iteration started from the extrapolated neighbouring inverse
+        // can not decrease the residual and the simplex is used for several
+        // hundreds of voxels
+        fill_field(field, [](float *voxel) {
+            const float x=voxel[0], y=voxel[1], z=voxel[2];
+            voxel[0] = x<12.f ? x : (x<15.f ? 12.f : x-3.f);
+            voxel[1] += .5f * sinf(.2f*x + .1f*z);
+            voxel[2] += .5f * cosf(.3f*y);
+        });
+        reg_defFieldInvert(field, inverse, 1.0e-6f);
+        REQUIRE(max_inversion_error(field, inverse) < EPS_INVERSION);
+    }
+
+    nifti_image_free(inverse);
+    nifti_image_free(field);
+}
@@ -0,0 +1,203 @@
+#include "_reg_nmi.h"
+#include "_reg_tools.h"
+
+#include <algorithm>
+#include <cmath>
+
+#include <catch2/catch_test_macros.hpp>
+
+#define EPS_SINGLE 0.00001
+
+/*
+    This test file contains the following unit tests:
+    test function: voxel based NMI gradient and derivative
+    In 2D and 3D
+    The tabulated derivatives are compared against the direct summation over
+    the 4x4 bins that surround every intensity pair. The intensities span
+    [-1,binNumber+1[ so that the edges of the table are used.
+*/
+
+
+double basis_spline_value(double x) {
+    x=fabs(x);
+    double value=0.0;
+    if(x<2.0) {
+        if(x<1.0)
+            value = 2.0/3.0 + (0.5*x-1.0)*x*x;
+        else {
+            x-=2.0;
+            value = -x*x*x/6.0;
+        }
+    }
+    return value;
+}
+
+
+double basis_spline_derivative_value(double ori) {
+    double x=fabs(ori);
+    double value=0.0;
+    if(x<2.0) {
+        if(x<1.0)
+            value = (1.5*x-2.0)*ori;
+        else {
+            x-=2.0;
+            value = -0.5*x*x;
+            if(ori<0.0) value=-value;
+        }
+    }
+    return value;
+}
+
+
+// Direct summation of the NMI derivative over the bins that surround an
+// intensity pair
+double direct_nmi_derivative(float refValue,
+                             float warValue,
+                             int referenceBinNumber,
+                             int floatingBinNumber,
+                             double *logHistoPtr,
+                             double *entropyPtr) {
+    double nmi = (entropyPtr[0]+entropyPtr[1])/entropyPtr[2];
+    size_t referenceOffset=(size_t)referenceBinNumber*floatingBinNumber;
+    size_t floatingOffset=referenceOffset+referenceBinNumber;
+    double jointDeriv=0, refDeriv=0, warDeriv=0;
+    for(int r=(int)floor(refValue)-1; r<(int)floor(refValue)+3; ++r) {
+        if(-1<r && r<referenceBinNumber) {
+            for(int w=(int)floor(warValue)-1; w<(int)floor(warValue)+3; ++w) {
+                if(-1<w && w<floatingBinNumber) {
+                    double commun =
+                        basis_spline_value((double)refValue - (double)r) *
+                        basis_spline_derivative_value((double)warValue - (double)w);
+                    jointDeriv += commun * logHistoPtr[r+w*referenceBinNumber];
+                    refDeriv += commun * logHistoPtr[r+referenceOffset];
+                    warDeriv += commun * logHistoPtr[w+floatingOffset];
+                }
+            }
+        }
+    }
+    return (refDeriv + warDeriv - nmi * jointDeriv) / (entropyPtr[2]*entropyPtr[3]);
+}
+
+
+// Fills an image with intensities in [-1,binNumber+1[. The first voxels
+// are set to the edges of the accepted range
+void fill_intensities(nifti_image *image, int binNumber) {
+    float *ptr = static_cast<float *>(image->data);
+    const float edges[] = {-1.f, -.5f, 0.f, .25f,
+                           binNumber-1.f, binNumber-.5f, (float)binNumber,
+                           binNumber+.5f, binNumber+.999f};
+    for(size_t i=0; i<image->nvox; ++i) {
+        if(i<sizeof(edges)/sizeof(float))
+            ptr[i] = edges[i];
+        else ptr[i] = (float)(binNumber+2) * (float)rand() / (float)RAND_MAX - 1.f;
+    }
+}
+
+
+void test_nmi_gradient(int ndim, int referenceBin, int floatingBin) {
+    int dim[8]= {ndim, 23, 19, ndim==2?1:17, 1, 1, 1, 1};
+    nifti_image *reference = nifti_make_new_nim(dim, NIFTI_TYPE_FLOAT32, true);
+    reg_checkAndCorrectDimension(reference);
+    nifti_image *warped = nifti_make_new_nim(dim, NIFTI_TYPE_FLOAT32, true);
+    reg_checkAndCorrectDimension(warped);
+    fill_intensities(reference, referenceBin);
+    fill_intensities(warped, floatingBin);
+    // The edge values are paired with the other image's edge values
+    std::reverse(static_cast<float *>(warped->data), static_cast<float *>(warped->data)+9);
+    const size_t voxelNumber = reference->nvox;
+    int *mask = (int *)calloc(voxelNumber, sizeof(int));
+    for(size_t i=9; i<voxelNumber; i+=11)
+        mask[i] = -1;
+
+    // The joint histogram and entropies are computed
+    double timePointWeight = 1.0;
+    unsigned short referenceBinNumber = referenceBin;
+    unsigned short floatingBinNumber = floatingBin;
+    unsigned short totalBinNumber = referenceBin*floatingBin + referenceBin + floatingBin;
+    double *jointHistogramLog = (double *)calloc(totalBinNumber, sizeof(double));
+    double *jointHistogramPro = (double *)calloc(totalBinNumber, sizeof(double));
+    double *entropyValues = (double *)calloc(4, sizeof(double));
+    reg_getNMIValue<float>(reference, warped, &timePointWeight,
+                           &referenceBinNumber, &floatingBinNumber, &totalBinNumber,
+                           &jointHistogramLog, &jointHistogramPro, &entropyValues,
+                           mask);
+
+    // A random warped image gradient that contains undefined values
+    nifti_image *gradient = nifti_copy_nim_info(reference);
+    gradient->dim[0]=gradient->ndim=5;
+    gradient->dim[5]=gradient->nu=ndim;
+    gradient->nvox=voxelNumber*ndim;
+    gradient->data=calloc(gradient->nvox, gradient->nbyper);
+    float *gradPtr = static_cast<float *>(gradient->data);
+    for(size_t i=0; i<gradient->nvox; ++i)
+        gradPtr[i] = i%37==0 ? std::numeric_limits<float>::quiet_NaN() :
+                               2.f * (float)rand() / (float)RAND_MAX - 1.f;
+
+    nifti_image *measureGradient = nifti_copy_nim_info(gradient);
+    measureGradient->data=calloc(measureGradient->nvox, measureGradient->nbyper);
+    if(ndim==2)
+        reg_getVoxelBasedNMIGradient2D<float>(reference, warped,
+                                              &referenceBinNumber, &floatingBinNumber,
+                                              &jointHistogramLog, &entropyValues,
+                                              gradient, measureGradient, mask, 0, 1.0);
+    else reg_getVoxelBasedNMIGradient3D<float>(reference, warped,
+                                               &referenceBinNumber, &floatingBinNumber,
+                                               &jointHistogramLog, &entropyValues,
+                                               gradient, measureGradient, mask, 0, 1.0);
+    nifti_image *derivative = nifti_copy_nim_info(reference);
+    derivative->data=calloc(derivative->nvox, derivative->nbyper);
+    reg_getVoxelBasedNMIDerivative<float>(reference, warped,
+                                          &referenceBinNumber, &floatingBinNumber,
+                                          &jointHistogramLog, &entropyValues,
+                                          derivative, mask, 0, 1.0);
+
+    // The expected values are computed by direct summation
+    float *refPtr = static_cast<float *>(reference->data);
+    float *warPtr = static_cast<float *>(warped->data);
+    float *measureGradPtr = static_cast<float *>(measureGradient->data);
+    float *derivPtr = static_cast<float *>(derivative->data);
+    double max_value=0, max_gradient_difference=0, max_derivative_difference=0;
+    for(size_t i=0; i<voxelNumber; ++i) {
+        double expected = 0;
+        if(mask[i]>-1)
+            expected = direct_nmi_derivative(refPtr[i], warPtr[i],
+                                             referenceBin, floatingBin,
+                                             jointHistogramLog, entropyValues);
+        max_value = std::max(max_value, fabs(expected));
+        max_derivative_difference = std::max(max_derivative_difference,
+                                             fabs(expected - derivPtr[i]));
+        for(int d=0; d<ndim; ++d) {
+            float grad = gradPtr[i+d*voxelNumber];
+            double expected_gradient = grad==grad ? expected * grad : 0;
+            max_gradient_difference = std::max(max_gradient_difference,
+                                               fabs(expected_gradient - measureGradPtr[i+d*voxelNumber]));
+        }
+    }
+    REQUIRE(max_value > 0);
+    REQUIRE(max_gradient_difference < EPS_SINGLE * max_value);
+    REQUIRE(max_derivative_difference < EPS_SINGLE * max_value);
+
+    nifti_image_free(derivative);
+    nifti_image_free(measureGradient);
+    nifti_image_free(gradient);
+    free(entropyValues);
+    free(jointHistogramPro);
+    free(jointHistogramLog);
+    free(mask);
+    nifti_image_free(warped);
+    nifti_image_free(reference);
+}
+
+
+TEST_CASE("NMI gradient", "[NMIGradient]") {
+    srand(42);
+    SECTION("2D") {
+        test_nmi_gradient(2, 24, 40);
+    }
+    SECTION("3D") {
+        test_nmi_gradient(3, 24, 40);
+    }
+    SECTION("3D with equal bin numbers") {
+        test_nmi_gradient(3, 68, 68);
+    }
+}
@@ -0,0 +1,47 @@
+#include "_reg_resampling.h"
+
+#include <algorithm>
+#include <cmath>
+
+#include <catch2/catch_test_macros.hpp>
+
+#define EPS_SINC_KERNEL_LUT 5.2e-7
+#define EPS_SINC_SAMPLE_LUT 4.4e-7
+
+/*
+    This test file contains the following unit tests:
+    test function: tabulated windowed sinc kernel
+    The interpolation weights and the kernel values obtained from the lookup
+    tables are compared against the direct evaluation of the kernel, densely
+    sampled between and on the table samples. The tolerances are the maximal
+    errors stated with the lookup table definition.
+*/
+
+
+TEST_CASE("Tabulated windowed sinc kernel", "[SincKernelLUT]") {
+    // 1024 samples per unit are tabulated, 7 positions are tested per sample
+    const int positionNumber = 7*1024;
+
+    SECTION("interpolation weights") {
+        double max_difference=0;
+        for(int i=0; i<=positionNumber; ++i) {
+            const double relative = (double)i / (double)positionNumber;
+            double expected[6], tabulated[6];
+            interpWindowedSincKernel(relative, expected);
+            interpWindowedSincKernel_LUT(relative, tabulated);
+            for(int j=0; j<6; ++j)
+                max_difference = std::max(max_difference, fabs(expected[j]-tabulated[j]));
+        }
+        REQUIRE(max_difference < EPS_SINC_KERNEL_LUT);
+    }
+    SECTION("kernel values") {
+        double max_difference=0;
+        for(int i=-3*positionNumber-10; i<=3*positionNumber+10; ++i) {
+            const double x = (double)i / (double)positionNumber;
+            const double expected = interpWindowedSincKernel_Samp(x, 3.0);
+            max_difference = std::max(max_difference,
+                                      fabs(expected-interpWindowedSincKernel_Samp_LUT(x)));
+        }
+        REQUIRE(max_difference < EPS_SINC_SAMPLE_LUT);
+    }
+}
@@ -0,0 +1,247 @@
+#include "_reg_localTrans.h"
+#include "_reg_tools.h"
+
+#include <algorithm>
+#include <cmath>
+#include <cstring>
+#include <vector>
+
+#include <catch2/catch_test_macros.hpp>
+
+#define EPS_SINGLE 0.0001
+
+/*
+    This test file contains the following unit tests:
+    test function: projection of a voxel based gradient onto the control points
+    In 3D
+    line aligned grid, which uses the line projection
+    non aligned grid, which uses the voxel by voxel projection
+    The projection is the adjoint of the cubic B-spline interpolation and
+    agrees with the convolution based projection on the interior nodes.
+*/
+
+
+// Creates a gradient image filled with random values. When transposed is
+// set, the image x and y axes are swapped with respect to the space and
+// the values are the transpose of the ones of a non transposed image
+nifti_image *create_gradient(int nx, int ny, int nz, bool transposed) {
+    int dim[8]= {5, transposed?ny:nx, transposed?nx:ny, nz, 1, 3, 1, 1};
+    nifti_image *gradient = nifti_make_new_nim(dim, NIFTI_TYPE_FLOAT32, true);
+    gradient->pixdim[1]=gradient->pixdim[2]=gradient->pixdim[3]=1.f;
+    gradient->dx=gradient->dy=gradient->dz=1.f;
+    gradient->qform_code=0;
+    gradient->sform_code=1;
+    mat44 voxel2Real;
+    reg_mat44_eye(&voxel2Real);
+    if(transposed) {
+        voxel2Real.m[0][0]=voxel2Real.m[1][1]=0.f;
+        voxel2Real.m[0][1]=voxel2Real.m[1][0]=1.f;
+    }
+    gradient->sto_xyz=voxel2Real;
+    gradient->sto_ijk=nifti_mat44_inverse(voxel2Real);
+    const size_t voxelNumber=(size_t)nx*ny*nz;
+    float *gradPtr=static_cast<float *>(gradient->data);
+    srand(7);
+    for(int d=0; d<3; ++d) {
+        for(int z=0; z<nz; ++z) {
+            for(int y=0; y<ny; ++y) {
+                for(int x=0; x<nx; ++x) {
+                    size_t index = transposed ?
+                                   ((size_t)z*nx+x)*ny+y :
+                                   ((size_t)z*ny+y)*nx+x;
+                    gradPtr[d*voxelNumber+index] = 2.f * (float)rand() / (float)RAND_MAX - 1.f;
+                }
+            }
+        }
+    }
+    return gradient;
+}
+
+
+// Creates a control point grid whose space is aligned with the non
+// transposed gradient image
+nifti_image *create_grid(int nx, int ny, int nz, float spacing) {
+    int dim[8]= {3, nx, ny, nz, 1, 1, 1, 1};
+    nifti_image *reference = nifti_make_new_nim(dim, NIFTI_TYPE_FLOAT32, false);
+    reg_checkAndCorrectDimension(reference);
+    nifti_image *grid = nullptr;
+    float gridSpacing[3]= {spacing, spacing, spacing};
+    reg_createControlPointGrid<float>(&grid, reference, gridSpacing);
+    nifti_image_free(reference);
+    return grid;
+}
+
+
+// Convolution based projection that was used by reg_f3d
+void convolution_projection(nifti_image *grid, nifti_image *gradient) {
+    nifti_image *convolved = nifti_copy_nim_info(gradient);
+    convolved->data = malloc(convolved->nvox*convolved->nbyper);
+    memcpy(convolved->data, gradient->data, convolved->nvox*convolved->nbyper);
+    float nodeSpacing[3]= {grid->dx, grid->dx, grid->dx};
+    for(int d=0; d<3; ++d) {
+        bool activeAxis[3]= {d==0, d==1, d==2};
+        reg_tools_kernelConvolution(convolved, nodeSpacing, CUBIC_SPLINE_KERNEL,
+                                    nullptr, nullptr, activeAxis);
+    }
+    reg_voxelCentric2NodeCentric(grid, convolved, 1.f, false, nullptr);
+    nifti_image_free(convolved);
+}
+
+
+// Checks that <g, Jv> equals <J^T g, v>, where J is the B-spline
+// interpolation and J^T the projection onto the nodes. The deformation
+// fields are computed on the grid axes, in the non transposed layout
+void check_adjoint(nifti_image *grid, nifti_image *gradient, nifti_image *alignedGradient,
+                   bool transposed) {
+    nifti_image *projection = nifti_copy_nim_info(grid);
+    projection->data = calloc(projection->nvox, projection->nbyper);
+    reg_spline_voxelCentric2NodeCentric(projection, gradient, 1.f, false, nullptr);
+
+    // A random displacement v is added to the identity grid
+    nifti_image *displacedGrid = nifti_copy_nim_info(grid);
+    displacedGrid->data = malloc(grid->nvox*grid->nbyper);
+    float *gridPtr = static_cast<float *>(grid->data);
+    float *displacedPtr = static_cast<float *>(displacedGrid->data);
+    std::vector<float> displacement(grid->nvox);
+    for(size_t i=0; i<grid->nvox; ++i) {
+        displacement[i] = 2.f * (float)rand() / (float)RAND_MAX - 1.f;
+        displacedPtr[i] = gridPtr[i] + displacement[i];
+    }
+    nifti_image *identityField = nifti_copy_nim_info(alignedGradient);
+    identityField->data = calloc(identityField->nvox, identityField->nbyper);
+    nifti_image *displacedField = nifti_copy_nim_info(alignedGradient);
+    displacedField->data = calloc(displacedField->nvox, displacedField->nbyper);
+    reg_spline_getDeformationField(grid, identityField);
+    reg_spline_getDeformationField(displacedGrid, displacedField);
+
+    const int nx = identityField->nx, ny = identityField->ny, nz = identityField->nz;
+    const size_t voxelNumber = (size_t)nx*ny*nz;
+    double voxelProduct=0, nodeProduct=0, norm=0;
+    float *gradPtr = static_cast<float *>(gradient->data);
+    float *identityPtr = static_cast<float *>(identityField->data);
+    float *displacedFieldPtr = static_cast<float *>(displacedField->data);
+    for(int d=0; d<3; ++d) {
+        for(int z=0; z<nz; ++z) {
+            for(int y=0; y<ny; ++y) {
+                for(int x=0; x<nx; ++x) {
+                    size_t index = d*voxelNumber + ((size_t)z*ny+y)*nx+x;
+                    size_t gradIndex = d*voxelNumber + (transposed ?
+                                                        ((size_t)z*nx+x)*ny+y : index-d*voxelNumber);
+                    double jv = (double)displacedFieldPtr[index] - identityPtr[index];
+                    voxelProduct += gradPtr[gradIndex] * jv;
+                    norm += fabs(gradPtr[gradIndex] * jv);
+                }
+            }
+        }
+    }
+    float *projectionPtr = static_cast<float *>(projection->data);
+    for(size_t i=0; i<grid->nvox; ++i)
+        nodeProduct += projectionPtr[i] * displacement[i];
+    REQUIRE(fabs(voxelProduct - nodeProduct) < EPS_SINGLE * norm);
+
+    nifti_image_free(displacedField);
+    nifti_image_free(identityField);
+    nifti_image_free(displacedGrid);
+    nifti_image_free(projection);
+}
+
+
+// Relative L2 difference between two node gradients over the nodes whose
+// support is fully included in the image
+double interior_difference(nifti_image *grid, nifti_image *image1, nifti_image *image2,
+                           const int *imageDim) {
+    const size_t nodeNumber = (size_t)grid->nx*grid->ny*grid->nz;
+    const int margin = (int)ceil(2.f*grid->dx)+1;
+    float *ptr1 = static_cast<float *>(image1->data);
+    float *ptr2 = static_cast<float *>(image2->data);
+    double difference=0, norm=0;
+    size_t index=0;
+    for(int z=0; z<grid->nz; ++z) {
+        for(int y=0; y<grid->ny; ++y) {
+            for(int x=0; x<grid->nx; ++x, ++index) {
+                float node[3]= {(float)x, (float)y, (float)z}, position[3];
+                reg_mat44_mul(&grid->qto_xyz, node, position);
+                bool interior = true;
+                for(int d=0; d<3; ++d)
+                    if(position[d]<margin || position[d]>imageDim[d]-1-margin)
+                        interior = false;
+                if(!interior) continue;
+                for(int d=0; d<3; ++d) {
+                    double value1 = ptr1[d*nodeNumber+index];
+                    double value2 = ptr2[d*nodeNumber+index];
+                    difference += (value1-value2)*(value1-value2);
+                    norm += value2*value2;
+                }
+            }
+        }
+    }
+    REQUIRE(norm > 0);
+    return sqrt(difference/norm);
+}
+
+
+TEST_CASE("Voxel based gradient projection onto the control points", "[VoxelCentric2NodeCentric]") {
+    const int imageDim[3]= {45, 41, 33};
+    nifti_image *grid = create_grid(imageDim[0], imageDim[1], imageDim[2], 5.f);
+    nifti_image *alignedGradient = create_gradient(imageDim[0], imageDim[1], imageDim[2], false);
+    nifti_image *transposedGradient = create_gradient(imageDim[0], imageDim[1], imageDim[2], true);
+
+    nifti_image *alignedProjection = nifti_copy_nim_info(grid);
+    alignedProjection->data = calloc(grid->nvox, grid->nbyper);
+    reg_spline_voxelCentric2NodeCentric(alignedProjection, alignedGradient, 1.f, false, nullptr);
+    nifti_image *transposedProjection = nifti_copy_nim_info(grid);
+    transposedProjection->data = calloc(grid->nvox, grid->nbyper);
+    reg_spline_voxelCentric2NodeCentric(transposedProjection, transposedGradient, 1.f, false, nullptr);
+
+    SECTION("line aligned grid is the adjoint of the interpolation") {
+        check_adjoint(grid, alignedGradient, alignedGradient, false);
+    }
+    SECTION("non aligned grid is the adjoint of the interpolation") {
+        check_adjoint(grid, transposedGradient, alignedGradient, true);
+    }
+    SECTION("line aligned grid matches the convolution on the interior nodes") {
+        nifti_image *expected = nifti_copy_nim_info(grid);
+        expected->data = calloc(grid->nvox, grid->nbyper);
+        convolution_projection(expected, alignedGradient);
+        REQUIRE(interior_difference(grid, alignedProjection, expected, imageDim) < EPS_SINGLE);
+        nifti_image_free(expected);
+    }
+    SECTION("non aligned grid matches the convolution on the interior nodes") {
+        nifti_image *expected = nifti_copy_nim_info(grid);
+        expected->data = calloc(grid->nvox, grid->nbyper);
+        convolution_projection(expected, transposedGradient);
+        REQUIRE(interior_difference(grid, transposedProjection, expected, imageDim) < EPS_SINGLE);
+        nifti_image_free(expected);
+    }
+    SECTION("both paths agree on the same gradient") {
+        float *alignedPtr = static_cast<float *>(alignedProjection->data);
+        float *transposedPtr = static_cast<float *>(transposedProjection->data);
+        double max_difference=0, max_value=0;
+        for(size_t i=0; i<grid->nvox; ++i) {
+            max_difference = std::max(max_difference, fabs((double)alignedPtr[i]-transposedPtr[i]));
+            max_value = std::max(max_value, fabs((double)alignedPtr[i]));
+        }
+        REQUIRE(max_difference < EPS_SINGLE * max_value);
+    }
+    SECTION("the update flag and weight are applied") {
+        nifti_image *updated = nifti_copy_nim_info(grid);
+        updated->data = malloc(grid->nvox*grid->nbyper);
+        memcpy(updated->data, alignedProjection->data, grid->nvox*grid->nbyper);
+        reg_spline_voxelCentric2NodeCentric(updated, alignedGradient, 2.f, true, nullptr);
+        float *updatedPtr = static_cast<float *>(updated->data);
+        float *alignedPtr = static_cast<float *>(alignedProjection->data);
+        double max_difference=0, max_value=0;
+        for(size_t i=0; i<grid->nvox; ++i) {
+            max_difference = std::max(max_difference, fabs((double)updatedPtr[i]-3.*alignedPtr[i]));
+            max_value = std::max(max_value, fabs(3.*alignedPtr[i]));
+        }
+        REQUIRE(max_difference < EPS_SINGLE * max_value);
+        nifti_image_free(updated);
+    }
+
+    nifti_image_free(transposedProjection);
+    nifti_image_free(alignedProjection);
+    nifti_image_free(transposedGradient);
+    nifti_image_free(alignedGradient);
+    nifti_image_free(grid);
+}